@@ -14,186 +14,245 @@ namespace LZMA
 #pragma pack()
 	static_assert( sizeof( lzma_header_t ) == 17 );
 
-	static inline void* SzAlloc( void*, size_t size )
-	{
-		return malloc( size );
-	}
-	static inline void SzFree( void*, void* address )
-	{
-		free( address );
-	}
-	static ISzAlloc g_Alloc = { SzAlloc, SzFree };
+	// Same as LzmaEncProps_Init
+	static constexpr int DEFAULT_LEVEL = 5;
 
-	static inline SRes LzmaEncode( const Byte* inBuffer, size_t inSize, Byte* outBuffer, size_t outSize, size_t* outSizeProcessed )
+	// Bump allocator backing one encoder. The encoder keeps its match finder tables
+	// and probabilities between calls, so nothing is given back before the arena dies.
+	class CArena : public ISzAlloc
 	{
-		class CInStreamRam : public ISeqInStream
-		{
-			const Byte* Data;
-			size_t Size;
-			size_t Pos;
+	public:
+		static constexpr size_t CHUNK_SIZE = 1 << 20;
 
-			SRes DoRead( void* buf, size_t* size )
-			{
-				size_t inSize = *size;
-				size_t remain = Size - Pos;
-				if ( inSize > remain )
-					inSize = remain;
+		CArena() : m_pCur( nullptr ), m_nLeft( 0 )
+		{
+			Alloc = StaticAlloc;
+			Free  = StaticFree;
+		}
 
-				for ( size_t i = 0; i < inSize; ++i )
-					reinterpret_cast<Byte*>( buf )[i] = Data[Pos + i];
+		CArena( const CArena& ) = delete;
+		CArena& operator=( const CArena& ) = delete;
 
-				Pos += inSize;
-				*size = inSize;
-				return SZ_OK;
-			}
+		void Reset()
+		{
+			m_Chunks.clear();
+			m_pCur  = nullptr;
+			m_nLeft = 0;
+		}
 
-			static SRes StaticRead( void* p, void* buf, size_t* size )
-			{
-				return reinterpret_cast<CInStreamRam*>( p )->DoRead( buf, size );
-			}
+	private:
+		static void* StaticAlloc( void* p, size_t size )
+		{
+			return static_cast<CArena*>( reinterpret_cast<ISzAlloc*>( p ) )->DoAlloc( size );
+		}
 
-		public:
-			CInStreamRam( const Byte* data, size_t size )
-			{
-				Data = data;
-				Size = size;
-				Pos = 0;
-				Read = StaticRead;
-			}
-		};
+		static void StaticFree( void*, void* )
+		{
+		}
 
-		class COutStreamRam : public ISeqOutStream
+		void* DoAlloc( size_t size )
 		{
-			size_t Size;
+			size = ( size + 15 ) & ~size_t( 15 );
+			if ( size > CHUNK_SIZE / 4 )
+				return m_Chunks.emplace_back( std::make_unique<uint8_t[]>( size ) ).get();
 
-			static size_t StaticWrite( void* p, const void* buf, size_t size )
+			if ( size > m_nLeft )
 			{
-				return reinterpret_cast<COutStreamRam*>( p )->DoWrite( buf, size );
+				m_pCur  = m_Chunks.emplace_back( std::make_unique<uint8_t[]>( CHUNK_SIZE ) ).get();
+				m_nLeft = CHUNK_SIZE;
 			}
 
-		public:
-			Byte* Data;
-			size_t Pos;
-			bool Overflow;
+			void* pRet = m_pCur;
+			m_pCur  += size;
+			m_nLeft -= size;
+			return pRet;
+		}
 
-			COutStreamRam( Byte* data, size_t size )
-			{
-				Data = data;
-				Size = size;
-				Pos = 0;
-				Overflow = false;
-				Write = StaticWrite;
-			}
+		std::vector<std::unique_ptr<uint8_t[]>> m_Chunks;
+		uint8_t* m_pCur;
+		size_t m_nLeft;
+	};
 
-			size_t DoWrite( const void* buf, size_t size )
-			{
-				size_t i;
-				for ( i = 0; i < size && Pos < Size; ++i )
-					Data[Pos++] = reinterpret_cast<const Byte*>( buf )[i];
-				if ( i != size )
-					Overflow = true;
-				return i;
-			}
-		};
+	// Encoder state kept between blocks, one per thread.
+	class CEncoder
+	{
+	public:
+		CEncoder() : m_hEnc( nullptr ), m_nScratchSize( 0 ), m_nLevel( DEFAULT_LEVEL ), m_nMaxInputSize( 0 ) {}
+		~CEncoder() { Destroy(); }
+
+		// Level 0-4 uses the fast hash chain match finder, 5-9 the binary tree one.
+		// Dictionary is never bigger than the largest input, that would only cost memory.
+		void SetProps( int nLevel, size_t nMaxInputSize )
+		{
+			if ( m_hEnc && ( nLevel != m_nLevel || nMaxInputSize != m_nMaxInputSize ) )
+				Destroy();
+
+			m_nLevel        = nLevel;
+			m_nMaxInputSize = nMaxInputSize;
+		}
+
+		CEncoder( const CEncoder& ) = delete;
+		CEncoder& operator=( const CEncoder& ) = delete;
+
+		static CEncoder& ThreadLocal()
+		{
+			thread_local CEncoder s_Encoder;
+			return s_Encoder;
+		}
 
-		// Based on Encode helper in SDK/LzmaUtil
-		*outSizeProcessed = 0;
+		// Primed blocks and plain ones need different dictionary sizes
+		static CEncoder& ThreadLocalPrimed()
+		{
+			thread_local CEncoder s_Encoder;
+			return s_Encoder;
+		}
 
-		const size_t kMinDestSize = 13;
-		if ( outSize < kMinDestSize )
-			return SZ_ERROR_FAIL;
+		// Codes the input as a bare LZMA stream, without the 13 byte header of the SDK, its properties go to pProps.
+		// With a dictionary the input is coded as if the dictionary came right before it, only a decoder
+		// whose window already holds the same bytes can decode it
+		SRes Encode( const Byte* inBuffer, size_t inSize, Byte* outBuffer, size_t outSize, size_t* outSizeProcessed, Byte* pProps, const Byte* pDictionary = nullptr, size_t nDictionarySize = 0 )
+		{
+			*outSizeProcessed = 0;
 
-		CLzmaEncHandle enc;
-		SRes res;
-		CLzmaEncProps props;
+			if ( !m_hEnc )
+			{
+				m_hEnc = LzmaEnc_Create( &m_Alloc );
+				if ( !m_hEnc )
+					return SZ_ERROR_FAIL;
+
+				CLzmaEncProps props;
+				LzmaEncProps_Init( &props );
+				props.level = m_nLevel;
+				if ( m_nMaxInputSize )
+					props.reduceSize = m_nMaxInputSize;
+				if ( const SRes res = LzmaEnc_SetProps( m_hEnc, &props ); res != SZ_OK )
+				{
+					Destroy();
+					return res;
+				}
+			}
 
-		enc = LzmaEnc_Create( &g_Alloc );
-		if ( !enc )
-			return SZ_ERROR_FAIL;
+			SizeT propsSize = LZMA_PROPS_SIZE;
+			SRes res		= LzmaEnc_WriteProperties( m_hEnc, pProps, &propsSize );
+			if ( res != SZ_OK )
+				return res;
 
-		LzmaEncProps_Init( &props );
-		res = LzmaEnc_SetProps( enc, &props );
+			// Either way the match finder reads the input where it is and the range coder writes straight to outBuffer
+			SizeT nWritten = outSize;
+			if ( !nDictionarySize )
+				// Encoder reinitializes its state, but keeps the allocated tables
+				res = LzmaEnc_MemEncode( m_hEnc, outBuffer, &nWritten, inBuffer, inSize, 0, nullptr, &m_Alloc, &m_Alloc );
+			else
+			{
+				// The match finder walks over the dictionary without coding it, so matches reach back into it
+				m_Window.assign( pDictionary, pDictionary + nDictionarySize );
+				m_Window.insert( m_Window.end(), inBuffer, inBuffer + inSize );
+
+				CSeqOutStreamBuf outStream;
+				outStream.funcTable.Write = MyWrite;
+				outStream.data			  = outBuffer;
+				outStream.rem			  = outSize;
+				outStream.overflow		  = False;
+
+				res = LzmaEnc_MemPrepare( m_hEnc, m_Window.data(), m_Window.size(), 0, &m_Alloc, &m_Alloc );
+				if ( res == SZ_OK )
+				{
+					CLzmaEnc* p		= static_cast<CLzmaEnc*>( m_hEnc );
+					p->rc.outStream = &outStream.funcTable;
+					p->matchFinder.Init( p->matchFinderObj );
+					p->needInit = 0;
+					p->matchFinder.Skip( p->matchFinderObj, gsl::narrow<UInt32>( nDictionarySize ) );
+					p->nowPos64 = nDictionarySize;
+					res			= LzmaEnc_Encode2( p, nullptr );
+				}
+
+				nWritten -= outStream.rem;
+				if ( outStream.overflow )
+					res = SZ_ERROR_OUTPUT_EOF;
+			}
 
-		if ( res != SZ_OK )
+			if ( res == SZ_OK )
+				*outSizeProcessed = nWritten;
 			return res;
+		}
 
-		COutStreamRam outStream( outBuffer, outSize );
+		// Returns data in the scratch buffer of this encoder, valid until the next call
+		const uint8_t* Compress( const uint8_t* pInput, size_t inputSize, size_t* pOutputSize, const uint8_t* pDictionary = nullptr, size_t nDictionarySize = 0 )
+		{
+			*pOutputSize = 0;
 
-		Byte header[LZMA_PROPS_SIZE + 8];
-		size_t headerSize = LZMA_PROPS_SIZE;
+			// using same work buffer calcs as the SDK 105% + 64K
+			const size_t outSize = inputSize / 20 * 21 + ( 1 << 16 );
+			if ( outSize > m_nScratchSize )
+			{
+				m_pScratch     = std::make_unique<uint8_t[]>( outSize );
+				m_nScratchSize = outSize;
+			}
+			uint8_t* pOutputBuffer = m_pScratch.get();
 
-		res = LzmaEnc_WriteProperties( enc, header, &headerSize );
-		if ( res != SZ_OK )
-			return res;
+			// compress right behind our header, the properties go into it
+			lzma_header_t* pHeader = reinterpret_cast<lzma_header_t*>( pOutputBuffer );
+			size_t compressedSize;
+			int result = Encode( pInput, inputSize, pOutputBuffer + sizeof( lzma_header_t ), outSize - sizeof( lzma_header_t ), &compressedSize, pHeader->properties, pDictionary, nDictionarySize );
+			if ( result != SZ_OK )
+			{
+				Assert( result == SZ_OK );
+				return nullptr;
+			}
 
-		// Uncompressed size after properties in header
-		for ( int i = 0; i < 8; i++ )
-			header[headerSize++] = static_cast<Byte>( inSize >> ( 8 * i ) );
+			pHeader->id = LZMA_ID;
+			pHeader->actualSize = gsl::narrow<uint32_t>( inputSize );
+			pHeader->lzmaSize = gsl::narrow<uint32_t>( compressedSize );
 
-		if ( outStream.DoWrite( header, headerSize ) != headerSize )
-			res = SZ_ERROR_WRITE;
-		else if ( res == SZ_OK )
-		{
-			CInStreamRam inStream( inBuffer, inSize );
-			res = LzmaEnc_Encode( enc, &outStream, &inStream, nullptr, &g_Alloc, &g_Alloc );
+			// final output size is our header plus compressed bits
+			*pOutputSize = sizeof( lzma_header_t ) + compressedSize;
 
-			if ( outStream.Overflow )
-				res = SZ_ERROR_FAIL;
-			else
-				*outSizeProcessed = outStream.Pos;
+			return pOutputBuffer;
 		}
 
-		LzmaEnc_Destroy( enc, &g_Alloc, &g_Alloc );
+		const uint8_t* OpportunisticCompress( const uint8_t* pInput, size_t inputSize, size_t* pOutputSize, const uint8_t* pDictionary = nullptr, size_t nDictionarySize = 0 )
+		{
+			const uint8_t* pRet = Compress( pInput, inputSize, pOutputSize, pDictionary, nDictionarySize );
+			if ( *pOutputSize >= inputSize )
+			{
+				// compression got worse or stayed the same
+				return nullptr;
+			}
 
-		return res;
-	}
+			return pRet;
+		}
 
-	static inline uint8_t* Compress( uint8_t* pInput, size_t inputSize, size_t* pOutputSize )
-	{
-		*pOutputSize = 0;
-
-		// using same work buffer calcs as the SDK 105% + 64K
-		size_t outSize = inputSize / 20 * 21 + ( 1 << 16 );
-		uint8_t* pOutputBuffer = new uint8_t[outSize];
-		if ( !pOutputBuffer )
-			return nullptr;
-
-		// compress, skipping past our header
-		size_t compressedSize;
-		int result = LzmaEncode( pInput, inputSize, pOutputBuffer + sizeof( lzma_header_t ), outSize - sizeof( lzma_header_t ), &compressedSize );
-		if ( result != SZ_OK )
+	private:
+		void Destroy()
 		{
-			Assert( result == SZ_OK );
-			delete[] pOutputBuffer;
-			return nullptr;
+			if ( m_hEnc )
+				LzmaEnc_Destroy( m_hEnc, &m_Alloc, &m_Alloc );
+			m_hEnc = nullptr;
+			m_Alloc.Reset();
 		}
 
-		// construct our header, strip theirs
-		lzma_header_t* pHeader = reinterpret_cast<lzma_header_t*>( pOutputBuffer );
-		pHeader->id = LZMA_ID;
-		pHeader->actualSize = gsl::narrow<uint32_t>( inputSize );
-		pHeader->lzmaSize = gsl::narrow<uint32_t>( compressedSize - 13 );
-		memcpy( pHeader->properties, pOutputBuffer + sizeof( lzma_header_t ), LZMA_PROPS_SIZE );
-
-		// shift the compressed data into place
-		memmove( pOutputBuffer + sizeof( lzma_header_t ), pOutputBuffer + sizeof( lzma_header_t ) + 13, compressedSize - 13 );
-
-		// final output size is our header plus compressed bits
-		*pOutputSize = sizeof( lzma_header_t ) + compressedSize - 13;
+		CArena m_Alloc;
+		CLzmaEncHandle m_hEnc;
+		std::unique_ptr<uint8_t[]> m_pScratch;
+		size_t m_nScratchSize;
+		std::vector<uint8_t> m_Window; // Dictionary and input of a primed encode
+		int m_nLevel;
+		size_t m_nMaxInputSize;
+	};
 
-		return pOutputBuffer;
+	// Result is owned by the calling thread's encoder and is valid until its next call
+	static inline const uint8_t* OpportunisticCompress( const uint8_t* pInput, size_t inputSize, size_t* pOutputSize, int nLevel, size_t nMaxInputSize )
+	{
+		CEncoder& encoder = CEncoder::ThreadLocal();
+		encoder.SetProps( nLevel, nMaxInputSize );
+		return encoder.OpportunisticCompress( pInput, inputSize, pOutputSize );
 	}
 
-	static inline uint8_t* OpportunisticCompress( uint8_t* pInput, size_t inputSize, size_t* pOutputSize )
+	// Same for a block primed with a dictionary, nMaxInputSize has to make room for the largest dictionary as well
+	static inline const uint8_t* OpportunisticCompressPrimed( const uint8_t* pInput, size_t inputSize, const uint8_t* pDictionary, size_t nDictionarySize, size_t* pOutputSize, int nLevel, size_t nMaxInputSize )
 	{
-		uint8_t* pRet = Compress( pInput, inputSize, pOutputSize );
-		if ( *pOutputSize >= inputSize )
-		{
-			// compression got worse or stayed the same
-			delete[] pRet;
-			return nullptr;
-		}
-
-		return pRet;
+		CEncoder& encoder = CEncoder::ThreadLocalPrimed();
+		encoder.SetProps( nLevel, nMaxInputSize );
+		return encoder.OpportunisticCompress( pInput, inputSize, pOutputSize, pDictionary, nDictionarySize );
 	}
 } // namespace LZMA
\ No newline at end of file
@@ -8,6 +8,7 @@
 // vmpi_bareshell.cpp : Defines the entry point for the console application.
 //
 
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #define NOWINRES
 #define NOSERVICE
@@ -17,37 +18,72 @@
 
 #include <windows.h>
 
-#include "DbgHelp.h"
 #include "d3dcompiler.h"
+#else
+#include <vkd3d_d3dcompiler.h>
+#endif
+#include <array>
 #include <atomic>
+#include <bit>
+#include <charconv>
 #include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
 #include <future>
 #include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <regex>
 #include <set>
+#include <sstream>
 #include <thread>
 #include <immintrin.h>
 #include <inttypes.h>
 
 #include "basetypes.h"
+#include "bench.h"
+#include "buildplan.h"
 #include "cfgprocessor.h"
 #include "cmdsink.h"
+#include "comboreport.h"
+#include "consolelog.h"
+#include "combostats.h"
+#include "compilecache.h"
 #include "d3dxfxc.h"
+#include "defineanalysis.h"
+#include "failpredict.h"
+#include "includegraph.h"
+#include "latency.h"
+#include "memorybudget.h"
+#include "metrics.h"
+#include "platform.h"
+#include "resumejournal.h"
 #include "shader_vcs_version.h"
+#include "staticdedup.h"
+#include "status.h"
+#include "threadtuner.h"
+#include "trace.h"
 #include "utlbuffer.h"
-#include "utlnodehash.h"
+#include "vcsinspect.h"
+#include "vcspatch.h"
+#include "vcsreuse.h"
+#include "workerprocess.h"
 
 #include "ezOptionParser.hpp"
 #include "termcolor/style.hpp"
 #include "gsl/narrow"
 #include "robin_hood.h"
 
-#include "CRC32.hpp"
 #include "movingaverage.hpp"
 #include "termcolors.hpp"
 #include "strmanip.hpp"
 #include "shaderparser.h"
+#include "sharedblobs.h"
 
 extern "C" {
 #define _7ZIP_ST
@@ -59,12 +95,16 @@ extern "C" {
 #undef _7ZIP_ST
 }
 
-#include "LZMA.hpp"
+#include "C/LzmaDec.h"
+#include "vcsloader.h"
 
-#pragma comment( lib, "DbgHelp" )
+#include "LZMA.hpp"
+#include "CRC32.hpp"
 
+#ifdef _MSC_VER
 // Type conversions should be controlled by programmer explicitly - shadercompile makes use of 64-bit integer arithmetics
 #pragma warning( error : 4244 )
+#endif
 
 namespace clr
 {
@@ -93,46 +133,316 @@ static Clock::time_point g_flStartTime;
 static bool g_bVerbose	= false;
 static bool g_bVerbose2 = false;
 static bool g_bFastFail = false;
+static int g_nCompressLevel = LZMA::DEFAULT_LEVEL;
+static bool g_bPreprocess = false;
+static bool g_bDedupStatic = false;
+static bool g_bSpill = false;
+static bool g_bReuse = false;
+static bool g_bStaticClaims = false;
+static bool g_bDictionary = false;
+static bool g_bBlockIndex = false; // Not in -shard fragments, -merge indexes them when it puts them together
+static bool g_bSharedBlobs = false;
+static bool g_bParallelBlocks = false;
+static bool g_bStreamPack = false;
+static bool g_bResume = false;
+static bool g_bSharedCache = false;
+static bool g_bCacheStats = false;
+static bool g_bMemoryStats = false;
+static std::vector<std::pair<std::string, Compiler::Strip>> g_arrStrip; // -strip, later ones win
+static std::vector<std::pair<std::string, uint32_t>> g_arrBlockSize; // -block-size in bytes, later ones win
+static uint32_t g_nPreviewSeconds = 0; // -preview, 0 writes every shader once it is complete
+static uint32_t g_nValidateSample = 0; // -validate-sample, 0 validates every combo
+static std::vector<std::pair<std::string, std::string>> g_arrPriority; // -priority, shader and expression of its static combos, empty for all of them
+
+// -profile-guided, the static combos of every shader the engine used, ascending. The rest alias a fallback until the
+// whole build that follows at low priority.
+static bool g_bProfileGuided = false;
+static robin_hood::unordered_node_map<std::string, std::vector<uint64_t>> g_ProfileGuided;
+
+// -load-order, when the engine first loaded every static combo of a shader. The vcs file stores them in that order.
+static robin_hood::unordered_node_map<std::string, robin_hood::unordered_flat_map<uint64_t, uint32_t>> g_StaticLoadOrder;
+
+// -combo-usage, how often every dynamic combo id of a shader was used in game
+using ComboUsage_t = robin_hood::unordered_flat_map<uint32_t, uint64_t>;
+static robin_hood::unordered_node_map<std::string, ComboUsage_t> g_ComboUsage;
+// Shaders that build the same vcs file as the one they are listed under, which is compiled alone and copied to them
+struct ShaderDuplicate_t
+{
+	std::string m_szName;
+	std::string m_szSource; // Relative to the shader path, its manifest is made from it
+};
+static robin_hood::unordered_node_map<std::string, std::vector<ShaderDuplicate_t>> g_ShaderDuplicates;
+// Blocks of the dynamic combos that were used at all, small so fetching one of them doesn't hitch
+static constexpr uint32_t HOT_BLOCK_SIZE = 16 * 1024;
+static uint32_t g_iShard = 0;
+static uint32_t g_nShards = 1; // Above 1 the vcs files are written as fragments of shard g_iShard, -merge puts them together
+static bool g_bBackground = false;
 
 static constexpr const std::string_view lineRewind = "\033[2K"sv;
 static constexpr const std::string_view endLine = "\r"sv;
 
 struct ShaderInfo_t
 {
-	ShaderInfo_t() { memset( this, 0, sizeof( *this ) ); }
-
-	uint64_t m_nShaderCombo;
-	uint64_t m_nTotalShaderCombos;
+	uint64_t m_nShaderCombo = 0;
+	uint64_t m_nTotalShaderCombos = 0;
 	std::string_view m_pShaderName;
 	std::string_view m_pShaderSrc;
-	unsigned m_CentroidMask;
-	uint64_t m_nDynamicCombos;
-	uint64_t m_nStaticCombo;
-	uint32_t m_Crc32;
+	unsigned m_CentroidMask = 0;
+	uint64_t m_nDynamicCombos = 0;
+	uint64_t m_nStaticCombo = 0;
+	uint32_t m_Crc32 = 0;
+	uint64_t m_nInputHash = 0; // Of everything that goes into the vcs file, see InputHashOf
 };
 static robin_hood::unordered_node_map<std::string_view, ShaderInfo_t> g_ShaderToShaderInfo;
 
+// Per shader counters for the final summary. Every shader is added before the workers
+// start, so workers only ever look entries up and need no lock.
+struct ShaderStats_t
+{
+	std::atomic<uint64_t> m_nCompiled;
+	std::atomic<uint64_t> m_nFailed;
+	std::atomic<uint64_t> m_nCancelled; // -fastfail, combos dropped once the shader failed
+	uint64_t m_nSurviving; // Combos left after the skips, for -status-port
+	std::atomic<uint64_t> m_nCacheHits;
+	std::atomic<uint64_t> m_nCacheMisses;
+	std::atomic<uint64_t> m_nCacheBytes; // Code the hits returned
+	std::atomic<uint64_t> m_nCacheMicroseconds; // What the hits took to compile when they were cached
+	std::atomic<uint64_t> m_nAliased; // Combos of static combos -dedup-static aliased, never compiled
+	std::atomic<uint64_t> m_nResumed; // Combos of static combos -resume read from the journal, never compiled
+	std::atomic<uint64_t> m_nRevalidated; // Combos -validate-sample compiled again since their code was new
+	std::atomic<uint64_t> m_nByteCode; // Bytes of every successful compile, for -bench
+	std::atomic<Clock::rep> m_nFirstCompile; // Clock ticks of the first compile, 0 until then
+	Clock::time_point m_tWritten;
+	ComboStats::ShaderRecord_t* m_pStaticComboTime; // Microseconds spent on each static combo
+	uint64_t m_nPeakCode;	// -memory-stats, most compiled code held since the shader written before
+	uint64_t m_nPeakMemory;	// -memory-stats, peak working set of the process when it was written
+	Latency::CHistogram m_Compile;	// -latency, compiles that came from no cache
+	Latency::CHistogram m_Pack;		// -latency, packing of every static combo
+};
+static robin_hood::unordered_node_map<std::string_view, ShaderStats_t> g_ShaderStats;
+
+static ShaderStats_t& ShaderStats( std::string_view pShaderName )
+{
+	return g_ShaderStats.find( pShaderName )->second;
+}
+
+// Surviving combos of all shaders and how many of them were compiled so far, for the ETA
+static std::atomic<uint64_t> g_nCombosTotal;
+static std::atomic<uint64_t> g_nCombosDone;
+static std::atomic<uint64_t> g_nCombosFailed; // Over every build of -watch, for -metrics
+static std::atomic<uint64_t> g_nCombosCancelled; // Same, -fastfail
+static Clock::time_point g_flCompileStartTime;
+
 static void Shader_ParseShaderInfoFromCompileCommands( const CfgProcessor::CfgEntryInfo* pEntry, ShaderInfo_t& shaderInfo );
 
-struct CByteCodeBlock : private std::unique_ptr<uint8_t[]>
+struct CByteCodeBlock
 {
 	uint64_t m_nComboID;
 	size_t m_nCodeSize;
 
-	CByteCodeBlock( const void* pByteCode, size_t nCodeSize, uint64_t nComboID ) : std::unique_ptr<uint8_t[]>( new uint8_t[nCodeSize] )
+	CByteCodeBlock( std::shared_ptr<const uint8_t[]> pByteCode, size_t nCodeSize, uint64_t nComboID ) : m_pByteCode( std::move( pByteCode ) )
 	{
 		m_nComboID  = nComboID;
 		m_nCodeSize = nCodeSize;
-		memcpy( get(), pByteCode, nCodeSize );
 	}
 
-	using std::unique_ptr<uint8_t[]>::get;
+	[[nodiscard]] const uint8_t* get() const noexcept { return m_pByteCode.get(); }
+
+private:
+	std::shared_ptr<const uint8_t[]> m_pByteCode; // Shared with identical dynamic combos of the shader
+};
+
+// Bytecode is copied out of the compiler's blob into chunks of the worker that received it, without any lock held.
+// Every block holds a reference to its chunk. Dynamic combos of a static combo finish close together,
+// so a chunk goes back in one piece soon after packing.
+class CByteCodeArena
+{
+public:
+	static constexpr size_t CHUNK_SIZE = 256 * 1024;
+
+	[[nodiscard]] std::shared_ptr<uint8_t[]> Copy( const void* pByteCode, size_t nSize )
+	{
+		std::shared_ptr<uint8_t[]> pBlock = Alloc( nSize );
+		memcpy( pBlock.get(), pByteCode, nSize );
+		return pBlock;
+	}
+
+	// Gives back the last copy, nothing else may have taken a reference to it
+	void Unwind( std::shared_ptr<uint8_t[]>&& pBlock )
+	{
+		if ( m_pChunk && pBlock.get() == m_pChunk.get() + m_nLastBlock )
+			m_nChunkUsed = m_nLastBlock;
+		pBlock.reset();
+	}
+
+	// Drops the chunk being filled once no block is left in it, so that it isn't held against -max-memory while idle
+	void Trim() noexcept
+	{
+		if ( m_pChunk.use_count() == 1 )
+			m_pChunk.reset();
+	}
+
+private:
+	[[nodiscard]] std::shared_ptr<uint8_t[]> Alloc( size_t nSize )
+	{
+		if ( nSize > CHUNK_SIZE / 8 )
+		{
+			MemoryBudget::Add( nSize, MemoryBudget::Store::ByteCode );
+			return std::shared_ptr<uint8_t[]>( new uint8_t[nSize], MemoryBudget::CDelete{ nSize, MemoryBudget::Store::ByteCode } );
+		}
+
+		if ( !m_pChunk || m_nChunkUsed + nSize > CHUNK_SIZE )
+		{
+			MemoryBudget::Add( CHUNK_SIZE, MemoryBudget::Store::ByteCode );
+			m_pChunk.reset( new uint8_t[CHUNK_SIZE], MemoryBudget::CDelete{ CHUNK_SIZE, MemoryBudget::Store::ByteCode } );
+			m_nChunkUsed = 0;
+		}
+
+		std::shared_ptr<uint8_t[]> pBlock( m_pChunk, m_pChunk.get() + m_nChunkUsed );
+		m_nLastBlock = m_nChunkUsed;
+		m_nChunkUsed += ( nSize + 7 ) & ~size_t( 7 );
+		return pBlock;
+	}
+
+	std::shared_ptr<uint8_t[]> m_pChunk; // The one being filled
+	size_t m_nChunkUsed = 0;
+	size_t m_nLastBlock = 0;
+};
+static thread_local CByteCodeArena s_tlByteCodeArena;
+
+// Identical bytecode of one shader is kept in memory once.
+// Split by hash, so that the workers of a shader rarely wait for each other.
+class CByteCodeInternTable
+{
+public:
+	// Returns the block already holding the same code, or pByteCode which is remembered for the next ones
+	[[nodiscard]] std::shared_ptr<const uint8_t[]> Intern( uint64_t nHash, const std::shared_ptr<uint8_t[]>& pByteCode, size_t nCodeSize )
+	{
+		Shard_t& shard = m_Shards[nHash >> ( 64 - SHARD_BITS )];
+		std::lock_guard guard{ shard.m_mtx };
+		++shard.m_nLookups;
+
+		std::weak_ptr<const uint8_t[]>& rpBlock = shard.m_Blocks[Key_t{ nHash, nCodeSize }];
+		if ( std::shared_ptr<const uint8_t[]> pBlock = rpBlock.lock(); pBlock && memcmp( pBlock.get(), pByteCode.get(), nCodeSize ) == 0 )
+		{
+			++shard.m_nHits;
+			return pBlock;
+		}
+
+		rpBlock = pByteCode;
+		return pByteCode;
+	}
+
+	// Only once the shader is finished
+	[[nodiscard]] uint64_t NumLookups() const noexcept
+	{
+		return std::accumulate( std::begin( m_Shards ), std::end( m_Shards ), 0ULL, []( uint64_t n, const Shard_t& shard ) { return n + shard.m_nLookups; } );
+	}
+
+	[[nodiscard]] uint64_t NumHits() const noexcept
+	{
+		return std::accumulate( std::begin( m_Shards ), std::end( m_Shards ), 0ULL, []( uint64_t n, const Shard_t& shard ) { return n + shard.m_nHits; } );
+	}
+
+private:
+	static constexpr uint32_t SHARD_BITS = 4;
+
+	struct Key_t
+	{
+		uint64_t m_nHash;
+		size_t m_nSize;
+
+		bool operator==( const Key_t& ) const = default;
+	};
+
+	struct KeyHash_t
+	{
+		size_t operator()( const Key_t& key ) const noexcept { return static_cast<size_t>( key.m_nHash ); }
+	};
+
+	struct alignas( 64 ) Shard_t
+	{
+		std::mutex m_mtx;
+		// Blocks die with the last dynamic combo using them, after packing
+		robin_hood::unordered_flat_map<Key_t, std::weak_ptr<const uint8_t[]>, KeyHash_t> m_Blocks;
+		uint64_t m_nLookups = 0;
+		uint64_t m_nHits = 0;
+	};
+	Shard_t m_Shards[1 << SHARD_BITS];
+};
+static robin_hood::unordered_node_map<std::string_view, CByteCodeInternTable> g_ShaderByteCodeIntern;
+
+// Packed static combos of one shader, appended as soon as they are packed so that
+// the whole shader never has to sit in memory. The file is removed with the object.
+class CSpillFile
+{
+public:
+	static constexpr uint64_t INVALID_OFFSET = ~0ULL;
+
+	explicit CSpillFile( fs::path path ) : m_Path( std::move( path ) ), m_nSize( 0 )
+	{
+		m_File.open( m_Path, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc );
+	}
+
+	~CSpillFile()
+	{
+		m_File.close();
+		std::error_code c;
+		fs::remove( m_Path, c );
+	}
+
+	// Returns INVALID_OFFSET if the data could not be written
+	[[nodiscard]] uint64_t Append( const void* pData, size_t nSize )
+	{
+		std::lock_guard guard{ m_mtx };
+		if ( !m_File )
+			return INVALID_OFFSET;
+
+		m_File.seekp( m_nSize, std::ios::beg );
+		if ( !m_File.write( static_cast<const char*>( pData ), nSize ) )
+			return INVALID_OFFSET;
+
+		const uint64_t nOffset = m_nSize;
+		m_nSize += nSize;
+		return nOffset;
+	}
+
+	[[nodiscard]] bool Read( uint64_t nOffset, void* pData, size_t nSize )
+	{
+		std::lock_guard guard{ m_mtx };
+		m_File.seekg( nOffset, std::ios::beg );
+		return static_cast<bool>( m_File.read( static_cast<char*>( pData ), nSize ) );
+	}
+
+private:
+	fs::path m_Path;
+	std::fstream m_File;
+	uint64_t m_nSize;
+	std::mutex m_mtx;
 };
+static robin_hood::unordered_flat_map<std::string_view, CSpillFile*> g_ShaderSpill;
+static robin_hood::unordered_flat_map<std::string_view, VcsReuse::CPreviousShader*> g_ShaderPrevious; // nullptr if there is nothing to reuse
+static robin_hood::unordered_flat_map<std::string_view, ResumeJournal::CJournal*> g_ShaderJournal; // -resume
+static robin_hood::unordered_flat_map<std::string_view, std::vector<uint64_t>> g_ShaderResumed; // -resume, static combos read from the journal, ascending
 
 struct CStaticCombo // all the data for one static combo
 {
 	struct PackedCode : private std::unique_ptr<uint8_t[]>
 	{
+		PackedCode() = default;
+		PackedCode( PackedCode&& ) = default;
+		PackedCode& operator=( PackedCode&& other ) noexcept
+		{
+			Free();
+			std::unique_ptr<uint8_t[]>::operator=( std::move( other ) );
+			return *this;
+		}
+
+		~PackedCode()
+		{
+			Free();
+		}
+
 		[[nodiscard]] size_t GetLength() const
 		{
 			if ( uint8_t* pb = get() )
@@ -149,9 +459,10 @@ struct CStaticCombo // all the data for one static combo
 
 		[[nodiscard]] uint8_t* AllocData( size_t len )
 		{
-			reset();
+			Free();
 			if ( len )
 			{
+				MemoryBudget::Add( len + sizeof( size_t ), MemoryBudget::Store::Packed );
 				reset( new uint8_t[len + sizeof( size_t )] );
 				*reinterpret_cast<size_t*>( get() ) = len;
 			}
@@ -159,213 +470,744 @@ struct CStaticCombo // all the data for one static combo
 		}
 
 		using std::unique_ptr<uint8_t[]>::operator bool;
+
+		void Free() noexcept
+		{
+			if ( const size_t nLength = GetLength() )
+				MemoryBudget::Release( nLength + sizeof( size_t ), MemoryBudget::Store::Packed );
+			reset();
+		}
+	};
+	// -stream-pack: the dynamic combos go into blocks from the highest id down, the order they are compiled in,
+	// as soon as all above them are done. Full blocks are compressed right away.
+	struct PackStream_t
+	{
+		std::mutex m_mtx;
+		std::condition_variable m_cvIdle;
+		bool m_bPacking = false;								// A thread is appending, others leave their ranges to it
+		uint64_t m_nFrontier;									// Dynamic combos from here up are in the blocks
+		std::vector<std::pair<uint64_t, uint64_t>> m_arrDone;	// [first, end) of dynamic combos done but not in the blocks yet
+		CUtlBuffer m_Block;										// Unpacked block being filled
+		CUtlBuffer m_Packed;									// Blocks compressed so far
+		size_t m_nBytesWritten = 0;
+		uint64_t m_nCombos = 0;
+		uint32_t m_nBlock = 0;
+		bool m_bIndex = true;
+		std::vector<DynamicComboIndexRecord_t> m_Index;
 	};
-	CStaticCombo *m_pNext, *m_pPrev;
 private:
 	uint64_t m_nStaticComboID;
 
-	std::vector<std::unique_ptr<CByteCodeBlock>> m_DynamicCombos;
+	std::vector<CByteCodeBlock> m_DynamicCombos;
+	std::atomic_flag m_bAdding; // Workers only meet here when one steals from the span of another
 
+	std::unique_ptr<PackStream_t> m_pStream; // Only while it is streamed
 	PackedCode m_abPackedCode; // Packed code for entire static combo
+	uint64_t m_nPackedHash = 0; // Hash of m_abPackedCode, for finding identical static combos
+	uint64_t m_nFingerprint = 0; // Of the dynamic combos it was packed from, with -reuse only
+	std::vector<DynamicComboIndexRecord_t> m_DynamicIndex; // Where packing put the dynamic combos, with -block-index only
 
-	static bool CompareDynamicComboIDs( const std::unique_ptr<CByteCodeBlock>& pA, const std::unique_ptr<CByteCodeBlock>& pB )
+	// Where m_abPackedCode went if it was moved to the spill file
+	uint64_t m_nSpillOffset = CSpillFile::INVALID_OFFSET;
+	size_t m_nSpillSize = 0;
+
+	static bool CompareDynamicComboIDs( const CByteCodeBlock& a, const CByteCodeBlock& b )
 	{
-		return pA->m_nComboID < pB->m_nComboID;
+		return a.m_nComboID < b.m_nComboID;
 	}
 
 public:
-	[[nodiscard]] uint64_t Key() const
+	[[nodiscard]] uint64_t ComboId() const
 	{
 		return m_nStaticComboID;
 	}
 
-	[[nodiscard]] uint64_t ComboId() const
+	[[nodiscard]] const PackedCode& Code() const
 	{
-		return m_nStaticComboID;
+		return m_abPackedCode;
 	}
 
-	[[nodiscard]] CStaticCombo* Next() const
+	[[nodiscard]] bool IsSpilled() const
 	{
-		return m_pNext;
+		return m_nSpillOffset != CSpillFile::INVALID_OFFSET;
 	}
 
-	[[nodiscard]] const PackedCode& Code() const
+	[[nodiscard]] size_t PackedSize() const
 	{
-		return m_abPackedCode;
+		return IsSpilled() ? m_nSpillSize : m_abPackedCode.GetLength();
+	}
+
+	[[nodiscard]] uint64_t PackedHash() const
+	{
+		return m_nPackedHash;
+	}
+
+	[[nodiscard]] uint64_t Fingerprint() const
+	{
+		return m_nFingerprint;
+	}
+
+	// Returns the packed code, reading it back into scratch if it was spilled
+	[[nodiscard]] const uint8_t* PackedData( CSpillFile* pSpill, std::vector<uint8_t>& scratch ) const
+	{
+		if ( !IsSpilled() )
+			return m_abPackedCode.GetData();
+
+		scratch.resize( m_nSpillSize );
+		if ( !pSpill || !pSpill->Read( m_nSpillOffset, scratch.data(), m_nSpillSize ) )
+			return nullptr;
+		return scratch.data();
+	}
+
+	// Moves the packed code to the spill file, keeps it in memory if that fails
+	void Spill( CSpillFile& file )
+	{
+		const size_t nSize = m_abPackedCode.GetLength();
+		if ( !nSize )
+			return;
+
+		const uint64_t nOffset = file.Append( m_abPackedCode.GetData(), nSize );
+		if ( nOffset == CSpillFile::INVALID_OFFSET )
+			return;
+
+		m_nSpillSize   = nSize;
+		m_nSpillOffset = nOffset;
+		m_abPackedCode.Free();
 	}
 
-	[[nodiscard]] const std::vector<std::unique_ptr<CByteCodeBlock>>& DynamicCombos() const
+	[[nodiscard]] const std::vector<CByteCodeBlock>& DynamicCombos() const
 	{
 		return m_DynamicCombos;
 	}
 
+	// Empty if the packed code came from somewhere else, sorted by dynamic combo id
+	[[nodiscard]] const std::vector<DynamicComboIndexRecord_t>& DynamicIndex() const
+	{
+		return m_DynamicIndex;
+	}
+
+	void SetDynamicIndex( const std::vector<DynamicComboIndexRecord_t>& index )
+	{
+		m_DynamicIndex.assign( index.begin(), index.end() );
+	}
+
 	CStaticCombo( uint64_t nComboID )
 	{
 		m_nStaticComboID = nComboID;
-		m_pNext = nullptr;
-		m_pPrev = nullptr;
 	}
 
 	~CStaticCombo() = default;
 
-	void AddDynamicCombo( uint64_t nComboID, const void* pComboData, size_t nCodeSize )
+	void AddDynamicCombo( uint64_t nComboID, std::shared_ptr<const uint8_t[]> pComboData, size_t nCodeSize )
 	{
-		m_DynamicCombos.emplace_back( std::make_unique<CByteCodeBlock>( pComboData, nCodeSize, nComboID ) );
+		while ( m_bAdding.test_and_set( std::memory_order_acquire ) )
+			_mm_pause();
+		m_DynamicCombos.emplace_back( std::move( pComboData ), nCodeSize, nComboID );
+		m_bAdding.clear( std::memory_order_release );
 	}
 
-	void SortDynamicCombos()
+	// Anything compiled, packed or not yet
+	[[nodiscard]] bool HasCode() const
 	{
-		std::sort( m_DynamicCombos.begin(), m_DynamicCombos.end(), CompareDynamicComboIDs );
+		return !m_DynamicCombos.empty() || ( m_pStream && m_pStream->m_nCombos );
 	}
 
-	[[nodiscard]] uint8_t* AllocPackedCodeBlock( size_t nPackedCodeSize )
+	[[nodiscard]] PackStream_t& Stream( uint64_t nDynamicCombos )
 	{
-		return m_abPackedCode.AllocData( nPackedCodeSize );
+		while ( m_bAdding.test_and_set( std::memory_order_acquire ) )
+			_mm_pause();
+		if ( !m_pStream )
+		{
+			m_pStream			   = std::make_unique<PackStream_t>();
+			m_pStream->m_nFrontier = nDynamicCombos;
+		}
+		m_bAdding.clear( std::memory_order_release );
+		return *m_pStream;
 	}
-};
 
-using StaticComboNodeHash_t = CUtlNodeHash<CStaticCombo, 7097, uint64_t>;
-using CShaderMap = robin_hood::unordered_map<std::string_view, StaticComboNodeHash_t*>;
-static CShaderMap g_ShaderByteCode;
+	// Once the last command is finished, waits for the thread still appending
+	PackStream_t* WaitForStream()
+	{
+		if ( m_pStream )
+		{
+			std::unique_lock guard{ m_pStream->m_mtx };
+			m_pStream->m_cvIdle.wait( guard, [this] { return !m_pStream->m_bPacking; } );
+		}
+		return m_pStream.get();
+	}
 
-static CStaticCombo* StaticComboFromDictAdd( std::string_view pszShaderName, uint64_t nStaticComboId )
-{
-	StaticComboNodeHash_t* &rpNodeHash = g_ShaderByteCode[pszShaderName];
-	if ( !rpNodeHash )
-		rpNodeHash = new StaticComboNodeHash_t;
+	void FreeStream()
+	{
+		m_pStream.reset();
+	}
 
-	// search for this static combo. make it if not found
-	CStaticCombo* pStaticCombo = rpNodeHash->FindByKey( nStaticComboId );
-	if ( !pStaticCombo )
+	// Moves the dynamic combos [nFirst, nEnd) to out, highest id first
+	void TakeDynamicCombos( uint64_t nFirst, uint64_t nEnd, std::vector<CByteCodeBlock>& out )
 	{
-		pStaticCombo = new CStaticCombo( nStaticComboId );
-		rpNodeHash->Add( pStaticCombo );
+		out.clear();
+		while ( m_bAdding.test_and_set( std::memory_order_acquire ) )
+			_mm_pause();
+		const auto it = std::partition( m_DynamicCombos.begin(), m_DynamicCombos.end(), [nFirst, nEnd]( const CByteCodeBlock& combo ) { return combo.m_nComboID < nFirst || combo.m_nComboID >= nEnd; } );
+		out.assign( std::make_move_iterator( it ), std::make_move_iterator( m_DynamicCombos.end() ) );
+		m_DynamicCombos.erase( it, m_DynamicCombos.end() );
+		m_bAdding.clear( std::memory_order_release );
+		std::sort( out.begin(), out.end(), []( const CByteCodeBlock& a, const CByteCodeBlock& b ) { return a.m_nComboID > b.m_nComboID; } );
 	}
 
-	return pStaticCombo;
-}
+	void SortDynamicCombos()
+	{
+		std::sort( m_DynamicCombos.begin(), m_DynamicCombos.end(), CompareDynamicComboIDs );
+	}
 
-static CStaticCombo* StaticComboFromDict( std::string_view pszShaderName, uint64_t nStaticComboId )
-{
-	if ( StaticComboNodeHash_t* pNodeHash = g_ShaderByteCode[pszShaderName] )
-		return pNodeHash->FindByKey( nStaticComboId );
-	return nullptr;
-}
+	void FreeDynamicCombos()
+	{
+		std::vector<CByteCodeBlock>().swap( m_DynamicCombos );
+	}
 
-class CompilerMsgInfo
-{
-public:
-	CompilerMsgInfo() : m_numTimesReported( 0 ) {}
+	[[nodiscard]] uint8_t* AllocPackedCodeBlock( size_t nPackedCodeSize )
+	{
+		return m_abPackedCode.AllocData( nPackedCodeSize );
+	}
 
-	void SetMsgReportedCommand( const std::string& szCommand )
+	void FreePackedCode() noexcept
 	{
-		if ( !m_numTimesReported )
-			m_sFirstCommand = szCommand;
-		++m_numTimesReported;
+		m_abPackedCode.Free();
 	}
 
-	[[nodiscard]] const std::string& GetFirstCommand() const { return m_sFirstCommand; }
-	[[nodiscard]] uint64_t GetNumTimesReported() const { return m_numTimesReported; }
+	// Called once the packed code block is filled in
+	void HashPackedCode()
+	{
+		m_nPackedHash = CompileCache::HashBytes( m_abPackedCode.GetData(), m_abPackedCode.GetLength(), 0 );
+	}
 
-protected:
-	std::string m_sFirstCommand;
-	uint64_t m_numTimesReported;
-};
+	// For packed code copied from somewhere that already knows its hash
+	void SetPackedHash( uint64_t nPackedHash )
+	{
+		m_nPackedHash = nPackedHash;
+	}
 
-static robin_hood::unordered_flat_set<std::string_view> g_ShaderHadError;
-static robin_hood::unordered_flat_set<std::string_view> g_ShaderWrittenToDisk;
-struct CompilerMsg
-{
-	robin_hood::unordered_node_map<std::string, CompilerMsgInfo> warning;
-	robin_hood::unordered_node_map<std::string, CompilerMsgInfo> error;
-};
-static robin_hood::unordered_node_map<std::string_view, CompilerMsg> g_CompilerMsg;
+	// Takes over the packed code of another static combo, pCode is its PackedData
+	void CopyPackedCode( const CStaticCombo& from, const uint8_t* pCode )
+	{
+		memcpy( m_abPackedCode.AllocData( from.PackedSize() ), pCode, from.PackedSize() );
+		m_nPackedHash  = from.m_nPackedHash;
+		m_nFingerprint = from.m_nFingerprint;
+		m_DynamicIndex = from.m_DynamicIndex;
+	}
 
-namespace Threading
-{
-class null_mutex
-{
-public:
-	void lock() noexcept {}
-	void unlock() noexcept {}
+	// Everything that goes into the packed code, the dynamic combos have to be sorted.
+	// The default layout adds nothing, so fingerprints of files packed before it existed still match.
+	void ComputeFingerprint( int nCompressLevel, uint64_t nDictionaryHash, uint32_t nBlockSize, const ComboUsage_t* pUsage )
+	{
+		uint64_t nFingerprint = CompileCache::HashBytes( &nCompressLevel, sizeof( nCompressLevel ), 0 );
+		if ( nDictionaryHash )
+			nFingerprint = CompileCache::HashBytes( &nDictionaryHash, sizeof( nDictionaryHash ), nFingerprint );
+		if ( nBlockSize != static_cast<uint32_t>( MAX_SHADER_UNPACKED_BLOCK_SIZE ) )
+			nFingerprint = CompileCache::HashBytes( &nBlockSize, sizeof( nBlockSize ), nFingerprint );
+		for ( const CByteCodeBlock& combo : m_DynamicCombos )
+		{
+			nFingerprint = CompileCache::HashBytes( &combo.m_nComboID, sizeof( combo.m_nComboID ), nFingerprint );
+			nFingerprint = CompileCache::HashBytes( combo.get(), combo.m_nCodeSize, nFingerprint );
+			if ( pUsage )
+			{
+				const auto it			= pUsage->find( gsl::narrow<uint32_t>( combo.m_nComboID ) );
+				const uint64_t nUsage	= it != pUsage->end() ? it->second : 0;
+				nFingerprint			= CompileCache::HashBytes( &nUsage, sizeof( nUsage ), nFingerprint );
+			}
+		}
+		m_nFingerprint = nFingerprint;
+	}
 };
 
-// A special object that makes single-threaded code incur no penalties
-// and multithreaded code to be synchronized properly.
-template <auto& mtx>
-class CSwitchableMutex
+// Static combos of one shader, one slot for every static combo id. The number of them is
+// known up front, so results go straight into their slot without any shared lock.
+// Slots come in pages made on first use, and so do the directories of pages, skips can leave most of a huge space empty.
+class CStaticComboTable
 {
-	using mtx_type = std::decay_t<decltype( mtx )>;
 public:
-	explicit CSwitchableMutex() noexcept : m_pUseMtx( nullptr ) {}
+	explicit CStaticComboTable( uint64_t nStaticCombos ) : m_nDirs( ( nStaticCombos + DIR_SPAN - 1 ) >> ( PAGE_BITS + DIR_BITS ) ), m_arrDirs( std::make_unique<std::atomic<Dir_t*>[]>( m_nDirs ) ), m_nCount( 0 )
+	{
+	}
 
-	void EnableThreadedMode() noexcept { m_pUseMtx = &mtx; }
+	~CStaticComboTable()
+	{
+		for ( uint64_t i = 0; i < m_nDirs; ++i )
+		{
+			Dir_t* pDir = m_arrDirs[i].load( std::memory_order_relaxed );
+			if ( !pDir )
+				continue;
+			for ( std::atomic<Page_t*>& rpPage : *pDir )
+			{
+				if ( Page_t* pPage = rpPage.load( std::memory_order_relaxed ) )
+				{
+					for ( std::atomic<CStaticCombo*>& rpSlot : *pPage )
+						delete rpSlot.load( std::memory_order_relaxed );
+					delete pPage;
+				}
+			}
+			delete pDir;
+		}
+	}
 
-	void lock()
+	CStaticComboTable( const CStaticComboTable& ) = delete;
+	CStaticComboTable& operator=( const CStaticComboTable& ) = delete;
+
+	// -dictionary: what every block of the shader is primed with, the code of the donor HoldForDonor picks.
+	// pDonor still has its dynamic combos, every later caller gets the same bytes.
+	const std::vector<uint8_t>& Dictionary( const CStaticCombo* pDonor )
 	{
-		if ( mtx_type* pUseMtx = m_pUseMtx )
-			pUseMtx->lock();
+		std::call_once( m_onceDictionary, [this, pDonor]
+		{
+			for ( const CByteCodeBlock& combo : pDonor->DynamicCombos() )
+			{
+				const size_t nTake = std::min( combo.m_nCodeSize, MAX_SHADER_DICTIONARY_SIZE - m_Dictionary.size() );
+				m_Dictionary.insert( m_Dictionary.end(), combo.get(), combo.get() + nTake );
+			}
+			m_nDictionaryHash = CompileCache::HashBytes( m_Dictionary.data(), m_Dictionary.size(), 0 ) | 1;
+		} );
+		return m_Dictionary;
 	}
 
-	void unlock()
+	// For a table with some of the static combos of from, once the first of them is packed
+	void CopyDictionary( const CStaticComboTable& from )
 	{
-		if ( mtx_type* pUseMtx = m_pUseMtx )
-			pUseMtx->unlock();
+		std::call_once( m_onceDictionary, [this, &from]
+		{
+			m_Dictionary	  = from.m_Dictionary;
+			m_nDictionaryHash = from.m_nDictionaryHash;
+		} );
 	}
 
-private:
-	std::atomic<mtx_type*> m_pUseMtx;
-};
+	// Once all static combos are packed, empty without -dictionary
+	[[nodiscard]] const std::vector<uint8_t>& Dictionary() const noexcept { return m_Dictionary; }
+	[[nodiscard]] uint64_t DictionaryHash() const noexcept { return m_nDictionaryHash; }
 
-namespace Private
-{
-	static std::mutex g_mtxSyncObjMT;
-	static std::mutex g_mtxSyncObjMT2;
-}; // namespace Private
+	// Two workers can only race in here if one stole from the span of the other
+	[[nodiscard]] CStaticCombo* FindOrAdd( uint64_t nStaticComboId )
+	{
+		Dir_t* pDir = MakeOnce( m_arrDirs[nStaticComboId >> ( PAGE_BITS + DIR_BITS )] );
+		Page_t* pPage = MakeOnce( ( *pDir )[( nStaticComboId >> PAGE_BITS ) & ( DIR_SIZE - 1 )] );
 
-static CSwitchableMutex<Private::g_mtxSyncObjMT> g_mtxGlobal;
-static CSwitchableMutex<Private::g_mtxSyncObjMT2> g_mtxMsgReport;
-}; // namespace Threading
+		std::atomic<CStaticCombo*>& rpSlot = ( *pPage )[nStaticComboId & ( PAGE_SIZE - 1 )];
+		CStaticCombo* pStaticCombo = rpSlot.load( std::memory_order_acquire );
+		if ( pStaticCombo )
+			return pStaticCombo;
 
-static void ErrMsgDispatchMsgLine( const char* szCommand, const char* szMsgLine, std::string_view szName )
-{
-	std::lock_guard guard{ Threading::g_mtxMsgReport };
-	auto& msg = g_CompilerMsg[szName];
-	char* dupMsg = _strdup( szMsgLine );
-	char *start = dupMsg, *end = dupMsg + strlen( dupMsg );
-	char* start2 = start;
+		CStaticCombo* pNew = new CStaticCombo( nStaticComboId );
+		if ( !rpSlot.compare_exchange_strong( pStaticCombo, pNew, std::memory_order_acq_rel ) )
+		{
+			delete pNew;
+			return pStaticCombo;
+		}
+		m_nCount.fetch_add( 1, std::memory_order_relaxed );
+		return pNew;
+	}
 
-	// Now store the message with the command it was generated from
-	for ( ; start2 < end && ( start = strchr( start2, '\n' ) ); start2 = start + 1 )
+	[[nodiscard]] CStaticCombo* Find( uint64_t nStaticComboId ) const
 	{
-		*start = 0;
-		if ( strstr( start2, "warning X" ) )
-			msg.warning[start2].SetMsgReportedCommand( szCommand );
-		else
-			msg.error[start2].SetMsgReportedCommand( szCommand );
+		const Page_t* pPage = PageOf( nStaticComboId );
+		return pPage ? ( *pPage )[nStaticComboId & ( PAGE_SIZE - 1 )].load( std::memory_order_acquire ) : nullptr;
 	}
 
-	if ( start2 < end )
+	void Delete( uint64_t nStaticComboId )
 	{
-		if ( strstr( start2, "warning X" ) )
-			msg.warning[start2].SetMsgReportedCommand( szCommand );
-		else
-			msg.error[start2].SetMsgReportedCommand( szCommand );
+		Page_t* pPage = PageOf( nStaticComboId );
+		if ( CStaticCombo* pStaticCombo = pPage ? ( *pPage )[nStaticComboId & ( PAGE_SIZE - 1 )].exchange( nullptr, std::memory_order_acq_rel ) : nullptr )
+		{
+			m_nCount.fetch_sub( 1, std::memory_order_relaxed );
+			delete pStaticCombo;
+		}
 	}
-	free( dupMsg );
-}
-
-static void ShaderHadErrorDispatchInt( std::string_view szShader )
-{
-	g_ShaderHadError.emplace( szShader );
-}
 
-// new format:
-// ver#
-// total shader combos
-// total dynamic combos
-// flags
-// centroid mask
+	// Calls fn for every static combo in id order
+	template <typename Fn>
+	void ForEach( Fn&& fn ) const
+	{
+		for ( uint64_t i = 0; i < m_nDirs; ++i )
+		{
+			const Dir_t* pDir = m_arrDirs[i].load( std::memory_order_acquire );
+			if ( !pDir )
+				continue;
+			for ( const std::atomic<Page_t*>& rpPage : *pDir )
+			{
+				if ( const Page_t* pPage = rpPage.load( std::memory_order_acquire ) )
+				{
+					for ( const std::atomic<CStaticCombo*>& rpSlot : *pPage )
+					{
+						if ( CStaticCombo* pStaticCombo = rpSlot.load( std::memory_order_acquire ) )
+							fn( pStaticCombo );
+					}
+				}
+			}
+		}
+	}
+
+	[[nodiscard]] uint64_t Count() const noexcept
+	{
+		return m_nCount.load( std::memory_order_relaxed );
+	}
+
+private:
+	static constexpr uint32_t PAGE_BITS = 10;
+	static constexpr uint64_t PAGE_SIZE = 1ULL << PAGE_BITS;
+	static constexpr uint32_t DIR_BITS	= 10;
+	static constexpr uint64_t DIR_SIZE	= 1ULL << DIR_BITS;
+	static constexpr uint64_t DIR_SPAN	= PAGE_SIZE * DIR_SIZE; // Static combos of a directory
+	using Page_t = std::array<std::atomic<CStaticCombo*>, PAGE_SIZE>;
+	using Dir_t	 = std::array<std::atomic<Page_t*>, DIR_SIZE>;
+
+	// Whoever loses the race deletes its own
+	template <typename T>
+	[[nodiscard]] static T* MakeOnce( std::atomic<T*>& rp )
+	{
+		T* p = rp.load( std::memory_order_acquire );
+		if ( p )
+			return p;
+		T* pNew = new T{};
+		if ( rp.compare_exchange_strong( p, pNew, std::memory_order_acq_rel ) )
+			return pNew;
+		delete pNew;
+		return p;
+	}
+
+	[[nodiscard]] Page_t* PageOf( uint64_t nStaticComboId ) const
+	{
+		const Dir_t* pDir = m_arrDirs[nStaticComboId >> ( PAGE_BITS + DIR_BITS )].load( std::memory_order_acquire );
+		return pDir ? ( *pDir )[( nStaticComboId >> PAGE_BITS ) & ( DIR_SIZE - 1 )].load( std::memory_order_acquire ) : nullptr;
+	}
+
+	uint64_t m_nDirs;
+	std::unique_ptr<std::atomic<Dir_t*>[]> m_arrDirs;
+	std::atomic<uint64_t> m_nCount;
+
+	std::once_flag m_onceDictionary;
+	std::vector<uint8_t> m_Dictionary;
+	uint64_t m_nDictionaryHash = 0;
+};
+static robin_hood::unordered_map<std::string_view, CStaticComboTable*> g_ShaderByteCode;
+
+// Surviving commands every static combo of one shader still waits for. Only the static combos some of whose commands
+// are done and others aren't are held, skips can leave most of a huge space without any. Split by static combo, so
+// that workers on different static combos rarely wait for each other.
+class CStaticComboCountdown
+{
+public:
+	void Clear()
+	{
+		for ( Shard_t& shard : m_Shards )
+			shard.m_Remaining.clear();
+	}
+
+	// What static combo s still waits for, fnSurviving gives all of its surviving commands if none are done yet
+	template <typename Fn>
+	[[nodiscard]] uint64_t Remaining( uint64_t s, Fn&& fnSurviving )
+	{
+		Shard_t& shard = ShardOf( s );
+		std::lock_guard guard{ shard.m_mtx };
+		const auto it = shard.m_Remaining.find( s );
+		return it != shard.m_Remaining.end() ? it->second : fnSurviving();
+	}
+
+	// Counts nDone of them off, true once none is left
+	template <typename Fn>
+	[[nodiscard]] bool CountOff( uint64_t s, uint64_t nDone, Fn&& fnSurviving )
+	{
+		Shard_t& shard = ShardOf( s );
+		std::lock_guard guard{ shard.m_mtx };
+		const auto [it, bInserted] = shard.m_Remaining.try_emplace( s, 0 );
+		if ( bInserted )
+			it->second = fnSurviving();
+		if ( ( it->second -= nDone ) )
+			return false;
+		shard.m_Remaining.erase( it );
+		return true;
+	}
+
+private:
+	static constexpr uint32_t SHARD_BITS = 4;
+
+	struct alignas( 64 ) Shard_t
+	{
+		std::mutex m_mtx;
+		robin_hood::unordered_flat_map<uint64_t, uint64_t> m_Remaining;
+	};
+	Shard_t m_Shards[1 << SHARD_BITS];
+
+	[[nodiscard]] Shard_t& ShardOf( uint64_t s ) noexcept
+	{
+		return m_Shards[( s * 0x9E3779B97F4A7C15ULL ) >> ( 64 - SHARD_BITS )];
+	}
+};
+
+class CompilerMsgInfo
+{
+public:
+	CompilerMsgInfo() : m_numTimesReported( 0 ) {}
+
+	void SetMsgReportedCommand( const std::string& szCommand, uint64_t numTimes = 1 )
+	{
+		if ( !m_numTimesReported )
+			m_sFirstCommand = szCommand;
+		m_numTimesReported += numTimes;
+	}
+
+	[[nodiscard]] const std::string& GetFirstCommand() const { return m_sFirstCommand; }
+	[[nodiscard]] uint64_t GetNumTimesReported() const { return m_numTimesReported; }
+
+protected:
+	std::string m_sFirstCommand;
+	uint64_t m_numTimesReported;
+};
+
+static robin_hood::unordered_flat_set<std::string_view> g_ShaderHadError;
+static robin_hood::unordered_node_map<std::string_view, std::vector<StaticComboAliasRecordWide_t>> g_ShaderStaticAliases; // -dedup-static and -profile-guided, sorted
+static robin_hood::unordered_flat_set<std::string_view> g_ShaderWrittenToDisk;
+struct CompilerMsg
+{
+	robin_hood::unordered_node_map<std::string, CompilerMsgInfo> warning;
+	robin_hood::unordered_node_map<std::string, CompilerMsgInfo> error;
+};
+static robin_hood::unordered_node_map<std::string_view, CompilerMsg> g_CompilerMsg;
+
+namespace Threading
+{
+class null_mutex
+{
+public:
+	void lock() noexcept {}
+	void unlock() noexcept {}
+};
+
+// How often a lock was taken, how often it had to wait for it and for how long, printed with -verbose
+struct LockStats_t
+{
+	std::atomic<uint64_t> m_nAcquisitions	 = 0;
+	std::atomic<uint64_t> m_nContended		 = 0;
+	std::atomic<uint64_t> m_nWaitNanoseconds = 0;
+	Latency::CHistogram m_Waits; // -latency, microseconds of the contended ones
+};
+
+static LockStats_t g_lsGlobal;
+static LockStats_t g_lsPackaged;
+static LockStats_t g_lsMessages;
+
+// Only an acquisition that doesn't get the lock right away is timed
+template <typename TMutex>
+static void LockCounted( TMutex& mtx, LockStats_t& stats )
+{
+	stats.m_nAcquisitions.fetch_add( 1, std::memory_order_relaxed );
+	if ( mtx.try_lock() )
+		return;
+
+	const Clock::time_point tStart = Clock::now();
+	mtx.lock();
+	const uint64_t nWait = duration_cast<chrono::nanoseconds>( Clock::now() - tStart ).count();
+	stats.m_nContended.fetch_add( 1, std::memory_order_relaxed );
+	stats.m_nWaitNanoseconds.fetch_add( nWait, std::memory_order_relaxed );
+	if ( Latency::Enabled() )
+		stats.m_Waits.Add( nWait / 1000 );
+}
+
+// TMutex counting into stats, doesn't count anything around a null_mutex
+template <typename TMutex, auto& stats>
+class CCountedMutex
+{
+public:
+	void lock()
+	{
+		if constexpr ( std::is_same_v<TMutex, null_mutex> )
+			m_mtx.lock();
+		else
+			LockCounted( m_mtx, stats );
+	}
+
+	void unlock() { m_mtx.unlock(); }
+
+private:
+	TMutex m_mtx;
+};
+
+// A special object that makes single-threaded code incur no penalties
+// and multithreaded code to be synchronized properly.
+template <auto& mtx, auto& stats>
+class CSwitchableMutex
+{
+	using mtx_type = std::decay_t<decltype( mtx )>;
+public:
+	explicit CSwitchableMutex() noexcept : m_pUseMtx( nullptr ) {}
+
+	void EnableThreadedMode() noexcept { m_pUseMtx = &mtx; }
+
+	void lock()
+	{
+		if ( mtx_type* pUseMtx = m_pUseMtx )
+			LockCounted( *pUseMtx, stats );
+	}
+
+	void unlock()
+	{
+		if ( mtx_type* pUseMtx = m_pUseMtx )
+			pUseMtx->unlock();
+	}
+
+private:
+	std::atomic<mtx_type*> m_pUseMtx;
+};
+
+namespace Private
+{
+	static std::mutex g_mtxSyncObjMT;
+}; // namespace Private
+
+static CSwitchableMutex<Private::g_mtxSyncObjMT, g_lsGlobal> g_mtxGlobal;
+}; // namespace Threading
+
+// Messages seen by one worker. A warning from a shared include comes back from every combo,
+// counting it here keeps the workers from meeting on a lock. Merged into g_CompilerMsg for printing.
+class CCompilerMsgTable
+{
+public:
+	void Add( std::string_view szShader, std::string_view szLine, const auto& FormatCommand )
+	{
+		std::lock_guard guard{ m_mtx };
+		for ( uint64_t nHash = CompileCache::HashString( szLine, CompileCache::HashString( szShader, 0 ) );; ++nHash )
+		{
+			Msg_t& msg = m_Msgs[nHash];
+			if ( !msg.m_nCount )
+			{
+				msg = Msg_t{ szShader, std::string( szLine ), FormatCommand(), 1, szLine.find( "warning X"sv ) != std::string_view::npos };
+				return;
+			}
+			if ( msg.m_szShader == szShader && msg.m_sLine == szLine )
+			{
+				++msg.m_nCount;
+				return;
+			}
+		}
+	}
+
+	// Moves everything seen so far into g_CompilerMsg
+	void MergeInto( robin_hood::unordered_node_map<std::string_view, CompilerMsg>& compilerMsg )
+	{
+		std::lock_guard guard{ m_mtx };
+		for ( const auto& [nHash, msg] : m_Msgs )
+		{
+			CompilerMsg& shaderMsg = compilerMsg[msg.m_szShader];
+			( msg.m_bWarning ? shaderMsg.warning : shaderMsg.error )[msg.m_sLine].SetMsgReportedCommand( msg.m_sFirstCommand, msg.m_nCount );
+		}
+		m_Msgs.clear();
+	}
+
+	// For -memory-stats
+	[[nodiscard]] uint64_t Bytes()
+	{
+		std::lock_guard guard{ m_mtx };
+		uint64_t nBytes = m_Msgs.size() * sizeof( robin_hood::pair<uint64_t, Msg_t> );
+		for ( const auto& [nHash, msg] : m_Msgs )
+			nBytes += msg.m_sLine.capacity() + msg.m_sFirstCommand.capacity();
+		return nBytes;
+	}
+
+private:
+	struct Msg_t
+	{
+		std::string_view m_szShader;
+		std::string m_sLine;
+		std::string m_sFirstCommand;
+		uint64_t m_nCount = 0;
+		bool m_bWarning	  = false;
+	};
+
+	Threading::CCountedMutex<std::mutex, Threading::g_lsMessages> m_mtx; // Only ever taken by its worker and the final merge
+	robin_hood::unordered_node_map<uint64_t, Msg_t> m_Msgs;
+};
+
+static std::mutex g_mtxCompilerMsgTables;
+static std::vector<std::unique_ptr<CCompilerMsgTable>> g_CompilerMsgTables; // Outlive their workers
+static thread_local CCompilerMsgTable* s_tlCompilerMsgTable;
+
+static void MergeCompilerMsgTables()
+{
+	std::lock_guard guard{ g_mtxCompilerMsgTables };
+	for ( const auto& pTable : g_CompilerMsgTables )
+		pTable->MergeInto( g_CompilerMsg );
+}
+
+// -memory-stats: what the big stores hold when szPhase is over. The compiled code is accounted as it comes and goes,
+// the rest is counted here.
+static void PrintMemoryStats( std::string_view szPhase )
+{
+	uint64_t nMessages = 0;
+	{
+		std::lock_guard guard{ g_mtxCompilerMsgTables };
+		for ( const auto& pTable : g_CompilerMsgTables )
+			nMessages += pTable->Bytes();
+	}
+	const CfgProcessor::MemoryUsage_t cfg = CfgProcessor::MemoryUsage();
+
+	using MemoryBudget::Store;
+	const auto& Code = [szPhase]( std::string_view szName, Store store )
+	{
+		std::cout << szPhase << ", "sv << szName << ": "sv << clr::green << PrettyPrint( MemoryBudget::Held( store ) >> 20 ) << clr::reset << " MB held, "sv << clr::green
+				  << PrettyPrint( MemoryBudget::Peak( store ) >> 20 ) << clr::reset << " MB at most"sv << std::endl;
+	};
+	const auto& Held = [szPhase]( std::string_view szName, uint64_t nBytes )
+	{
+		std::cout << szPhase << ", "sv << szName << ": "sv << clr::green << PrettyPrint( nBytes >> 10 ) << clr::reset << " KB held"sv << std::endl;
+	};
+	std::cout << szPhase << ": "sv << clr::green << PrettyPrint( Platform::PeakMemory() >> 20 ) << clr::reset << " MB peak working set, "sv << clr::green
+			  << PrettyPrint( MemoryBudget::Peak() >> 20 ) << clr::reset << " MB of compiled code at most"sv << std::endl;
+	Code( "bytecode of the workers"sv, Store::ByteCode );
+	Code( "packed static combos"sv, Store::Packed );
+	Held( "sources and includes"sv, fileCache.Bytes() );
+	Held( "combo index"sv, cfg.m_nComboIndex );
+	Held( "names and defines"sv, cfg.m_nStrings );
+	Held( "compiler messages"sv, nMessages );
+}
+
+static void ErrMsgDispatchMsgLine( CfgProcessor::ComboHandle hCombo, std::string_view szMsgLine, std::string_view szName )
+{
+	if ( !s_tlCompilerMsgTable )
+	{
+		std::lock_guard guard{ g_mtxCompilerMsgTables };
+		s_tlCompilerMsgTable = g_CompilerMsgTables.emplace_back( std::make_unique<CCompilerMsgTable>() ).get();
+	}
+
+	// The command is only needed the first time this worker sees a line
+	std::string sCommand;
+	const auto& FormatCommand = [&sCommand, hCombo]
+	{
+		if ( sCommand.empty() )
+		{
+			char chBuffer[4096];
+			Combo_FormatCommandHumanReadable( hCombo, chBuffer );
+			sCommand = chBuffer;
+		}
+		return sCommand;
+	};
+
+	// Store every line with the command it was generated from
+	while ( !szMsgLine.empty() )
+	{
+		const size_t nEnd = szMsgLine.find( '\n' );
+		s_tlCompilerMsgTable->Add( szName, szMsgLine.substr( 0, nEnd ), FormatCommand );
+		if ( nEnd == std::string_view::npos )
+			break;
+		szMsgLine.remove_prefix( nEnd + 1 );
+	}
+}
+
+static void ShaderHadErrorDispatchInt( std::string_view szShader )
+{
+	g_ShaderHadError.emplace( szShader );
+}
+
+// new format:
+// ver#
+// total shader combos
+// total dynamic combos
+// flags
+// centroid mask
 // total non-skipped static combos
 // [ (sorted by static combo id)
 //   static combo id
@@ -399,52 +1241,215 @@ static void ShaderHadErrorDispatchInt( std::string_view szShader )
 // returns negative number if idA is less than idB, positive when idA is greater than idB
 // and zero if the ids are equal
 
-static bool CompareDupComboIndices( const StaticComboAliasRecord_t& pA, const StaticComboAliasRecord_t& pB ) noexcept
+static bool CompareDupComboIndices( const StaticComboAliasRecordWide_t& pA, const StaticComboAliasRecordWide_t& pB ) noexcept
 {
 	return pA.m_nStaticComboID < pB.m_nStaticComboID;
 }
 
-static void FlushCombos( size_t& pnTotalFlushedSize, CUtlBuffer& pDynamicComboBuffer, CUtlBuffer& pBuf )
+// Packs the block of dynamic combos that starts at pBlock and appends it to pBuf
+static void FlushCombos( size_t& pnTotalFlushedSize, const uint8_t* pBlock, size_t nBlockSize, CUtlBuffer& pBuf, int nCompressLevel, const std::vector<uint8_t>* pDictionary )
 {
-	if ( !pDynamicComboBuffer.TellPut() )
+	if ( !nBlockSize )
 		// Nothing to do here
 		return;
 
+	const Trace::CScope trace{ "FlushCombos" };
 	size_t nCompressedSize;
-	uint8_t* pCompressedShader = LZMA::OpportunisticCompress( reinterpret_cast<uint8_t*>( pDynamicComboBuffer.Base() ), pDynamicComboBuffer.TellPut(), &nCompressedSize );
+	const bool bPrimed				 = pDictionary && !pDictionary->empty();
+	const uint8_t* pCompressedShader = bPrimed ? LZMA::OpportunisticCompressPrimed( pBlock, nBlockSize, pDictionary->data(), pDictionary->size(), &nCompressedSize,
+																					nCompressLevel, MAX_SHADER_UNPACKED_BLOCK_SIZE + MAX_SHADER_DICTIONARY_SIZE )
+											   : LZMA::OpportunisticCompress( pBlock, nBlockSize, &nCompressedSize, nCompressLevel, MAX_SHADER_UNPACKED_BLOCK_SIZE );
 	// high 2 bits of length =
 	// 00 = bzip2 compressed
 	// 10 = uncompressed
 	// 01 = lzma compressed
-	// 11 = unused
+	// 11 = lzma primed with the shader dictionary (v7)
 
 	if ( !pCompressedShader )
 	{
 		// it grew
-		const uint32_t lFlagSize = 0x80000000 | pDynamicComboBuffer.TellPut();
+		const uint32_t lFlagSize = 0x80000000 | gsl::narrow<uint32_t>( nBlockSize );
 		pBuf.Put( &lFlagSize, sizeof( lFlagSize ) );
-		pBuf.Put( pDynamicComboBuffer.Base(), pDynamicComboBuffer.TellPut() );
-		pnTotalFlushedSize += sizeof( lFlagSize ) + pDynamicComboBuffer.TellPut();
+		pBuf.Put( pBlock, gsl::narrow<int>( nBlockSize ) );
+		pnTotalFlushedSize += sizeof( lFlagSize ) + nBlockSize;
 	}
 	else
 	{
-		const uint32_t lFlagSize = 0x40000000 | gsl::narrow<uint32_t>( nCompressedSize );
+		const uint32_t lFlagSize = ( bPrimed ? SHADER_BLOCK_PRIMED : 0x40000000 ) | gsl::narrow<uint32_t>( nCompressedSize );
 		pBuf.Put( &lFlagSize, sizeof( lFlagSize ) );
 		pBuf.Put( pCompressedShader, gsl::narrow<uint32_t>( nCompressedSize ) );
-		delete[] pCompressedShader;
 		pnTotalFlushedSize += sizeof( lFlagSize ) + nCompressedSize;
 	}
-	pDynamicComboBuffer.Clear(); // start over
 }
 
-static void OutputDynamicCombo( size_t& pnTotalFlushedSize, CUtlBuffer& pDynamicComboBuffer, CUtlBuffer& pBuf, uint64_t nComboID, uint32_t nComboSize, const uint8_t* pComboCode )
+// Workers that ran out of commands, -parallel-blocks packs on their cores
+static std::atomic<int> g_nSpareThreads;
+
+// Up to nWanted of the spare threads, give them back with ReleaseSpareThreads
+static uint32_t ClaimSpareThreads( uint32_t nWanted )
+{
+	int nSpare = g_nSpareThreads.load( std::memory_order_relaxed );
+	while ( nSpare > 0 && !g_nSpareThreads.compare_exchange_weak( nSpare, nSpare - std::min<int>( nSpare, nWanted ) ) )
+		continue;
+	return nSpare > 0 ? std::min<uint32_t>( nSpare, nWanted ) : 0;
+}
+
+static void ReleaseSpareThreads( uint32_t nClaimed )
+{
+	g_nSpareThreads += nClaimed;
+}
+
+// The blocks of dynamic combos laid out back to back in pRaw, each one ending at its entry of arrBlockEnds, are packed
+// side by side on nHelpers more threads and appended to pBuf in order. Comes out the same as packing them one by one.
+static void FlushCombosParallel( size_t& pnTotalFlushedSize, const uint8_t* pRaw, const std::vector<size_t>& arrBlockEnds, CUtlBuffer& pBuf, int nCompressLevel,
+								 const std::vector<uint8_t>* pDictionary, uint32_t nHelpers )
+{
+	const size_t nBlocks = arrBlockEnds.size();
+	std::vector<CUtlBuffer> arrPacked( nBlocks );
+	std::vector<size_t> arrSizes( nBlocks, 0 );
+	std::atomic<size_t> nNextBlock = 0;
+	const auto& PackBlocks = [&]()
+	{
+		for ( size_t iBlock; ( iBlock = nNextBlock++ ) < nBlocks; )
+		{
+			const size_t nStart = iBlock ? arrBlockEnds[iBlock - 1] : 0;
+			FlushCombos( arrSizes[iBlock], pRaw + nStart, arrBlockEnds[iBlock] - nStart, arrPacked[iBlock], nCompressLevel, pDictionary );
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for ( uint32_t i = 0; i < nHelpers; ++i )
+	{
+		threads.emplace_back( [&PackBlocks]()
+		{
+			if ( g_bBackground )
+				Platform::SetThreadBackground();
+			PackBlocks();
+		} );
+	}
+	PackBlocks();
+	for ( std::thread& t : threads )
+		t.join();
+
+	for ( size_t iBlock = 0; iBlock < nBlocks; ++iBlock )
+	{
+		pBuf.Put( arrPacked[iBlock].Base(), arrPacked[iBlock].TellPut() );
+		pnTotalFlushedSize += arrSizes[iBlock];
+	}
+}
+
+// Block number and offset in the unpacked block of a dynamic combo, false if the block number doesn't fit
+static bool AddIndexRecord( std::vector<DynamicComboIndexRecord_t>& index, uint32_t nComboID, uint32_t nBlock, uint32_t nOffset )
+{
+	if ( nBlock > UINT32_MAX >> SHADER_INDEX_BLOCK_SHIFT || nOffset >> SHADER_INDEX_BLOCK_SHIFT )
+		return false;
+	index.emplace_back( DynamicComboIndexRecord_t{ nComboID, nBlock << SHADER_INDEX_BLOCK_SHIFT | nOffset } );
+	return true;
+}
+
+// Index of packed code that was copied from an old vcs or a shard fragment, the blocks are unpacked to find the combos
+static bool IndexPackedCode( const uint8_t* pCode, size_t nSize, const std::vector<uint8_t>& dictionary, std::vector<DynamicComboIndexRecord_t>& index )
+{
+	static thread_local CVcsFile s_tlDecoder;
+	static thread_local std::vector<uint8_t> s_tlBuffer;
+	s_tlBuffer.resize( MAX_SHADER_DICTIONARY_SIZE + MAX_SHADER_UNPACKED_BLOCK_SIZE );
+
+	uint32_t nBlock = 0;
+	for ( size_t nPos = 0; nPos < nSize; ++nBlock )
+	{
+		uint32_t nFlagSize;
+		if ( nSize - nPos < sizeof( nFlagSize ) )
+			return false;
+		memcpy( &nFlagSize, pCode + nPos, sizeof( nFlagSize ) );
+		nPos += sizeof( nFlagSize );
+		const uint32_t nBlockSize = nFlagSize & ~SHADER_BLOCK_TYPE_MASK;
+		const unsigned char* pCombos;
+		unsigned int nCombosSize;
+		if ( nBlockSize > nSize - nPos
+			 || !s_tlDecoder.UnpackBlock( nFlagSize, pCode + nPos, dictionary.data(), gsl::narrow<uint32_t>( dictionary.size() ), s_tlBuffer.data(), &pCombos, &nCombosSize ) )
+			return false;
+		nPos += nBlockSize;
+
+		for ( uint32_t nCombo = 0; nCombo < nCombosSize; )
+		{
+			uint32_t rec[2]; // id, size
+			if ( nCombosSize - nCombo < sizeof( rec ) )
+				return false;
+			memcpy( rec, pCombos + nCombo, sizeof( rec ) );
+			if ( rec[1] > nCombosSize - nCombo - sizeof( rec ) || !AddIndexRecord( index, rec[0], nBlock, nCombo ) )
+				return false;
+			nCombo += sizeof( rec ) + rec[1];
+		}
+	}
+	return true;
+}
+
+static bool CompareIndexRecords( const DynamicComboIndexRecord_t& a, const DynamicComboIndexRecord_t& b ) noexcept
+{
+	return a.m_nDynamicComboID < b.m_nDynamicComboID;
+}
+
+// Where shard iShard of nShards leaves its part of vcsPath
+static fs::path ShardFragmentPath( const fs::path& vcsPath, uint32_t iShard, uint32_t nShards )
+{
+	fs::path path = vcsPath;
+	path += ".shard"s + std::to_string( iShard ) + "of"s + std::to_string( nShards );
+	return path;
+}
+
+// Next to a vcs file, the hash of everything that went into it. Identical inputs give a bit-identical file,
+// so a build machine can key prebuilt vcs files on it.
+static fs::path InputHashPath( const fs::path& vcsPath )
+{
+	fs::path path = vcsPath;
+	path += ".inputs";
+	return path;
+}
+
+static void WriteInputHash( const fs::path& vcsPath, uint64_t nInputHash )
 {
-	if ( pDynamicComboBuffer.TellPut() + nComboSize + 16 >= MAX_SHADER_UNPACKED_BLOCK_SIZE )
-		FlushCombos( pnTotalFlushedSize, pDynamicComboBuffer, pBuf );
+	char szHash[24];
+	sprintf_s( szHash, sizeof( szHash ), "%016" PRIx64 "\n", nInputHash );
+	std::ofstream file( InputHashPath( vcsPath ), std::ios::binary | std::ios::trunc );
+	file << szHash;
+}
+
+static fs::path GetVCSFilenames( const ShaderInfo_t& si );
+
+// The vcs file of a shader has no name in it, its duplicates get a copy of it. Without a file they lose theirs as well.
+static void WriteDuplicates( const ShaderInfo_t& shaderInfo, const fs::path& path, bool bWritten )
+{
+	const auto it = g_ShaderDuplicates.find( std::string( shaderInfo.m_pShaderName ) );
+	if ( it == g_ShaderDuplicates.end() )
+		return;
+
+	for ( const ShaderDuplicate_t& duplicate : it->second )
+	{
+		ShaderInfo_t duplicateInfo  = shaderInfo;
+		duplicateInfo.m_pShaderName = duplicate.m_szName;
+		auto duplicatePath			= GetVCSFilenames( duplicateInfo );
+		if ( g_nShards > 1 )
+			duplicatePath = ShardFragmentPath( duplicatePath, g_iShard, g_nShards );
+
+		VcsReuse::Remove( duplicatePath );
+		std::error_code c;
+		fs::remove( InputHashPath( duplicatePath ), c );
+		fs::path tmpPath = duplicatePath;
+		tmpPath += ".tmp"sv;
+		if ( !bWritten || !fs::copy_file( path, tmpPath, fs::copy_options::overwrite_existing, c ) || !Platform::RenameOver( tmpPath, duplicatePath ) )
+		{
+			fs::remove( tmpPath, c );
+			fs::remove( duplicatePath, c );
+			if ( bWritten )
+				ConsoleLog::CLine() << clr::red << "Failed to copy "sv << path.string() << " to "sv << duplicatePath.string() << clr::reset << std::endl;
+			continue;
+		}
 
-	pDynamicComboBuffer.PutUnsignedInt( gsl::narrow<uint32_t>( nComboID ) );
-	pDynamicComboBuffer.PutUnsignedInt( nComboSize );
-	pDynamicComboBuffer.Put( pComboCode, nComboSize );
+		// The same inputs, and its manifest lets the next run see it is up to date without reading the sources
+		WriteInputHash( duplicatePath, shaderInfo.m_nInputHash );
+		uint32_t nCrc;
+		Parser::CheckCrc( g_pShaderPath / duplicate.m_szSource, g_pShaderPath.string(), duplicate.m_szName, nCrc );
+	}
 }
 
 static fs::path GetVCSFilenames( const ShaderInfo_t& si )
@@ -490,77 +1495,363 @@ static fs::path GetVCSFilenames( const ShaderInfo_t& si )
 
 // WriteShaderFiles
 //
-// should be called either on the main thread or
-// on the async writing thread.
+// should be called on the main thread, it takes the finished shader
+// out of the global variables and hands it to the async writing thread.
 //
 // So the function WriteShaderFiles should not be reentrant, however the
-// data that it uses might be updated by the main thread when built pieces
-// are received from the workers.
+// data that it uses might be updated by the worker threads when other
+// shaders are packaged.
 //
-static constexpr uint32_t STATIC_COMBO_HASH_SIZE = 73;
-
-struct StaticComboAuxInfo_t : StaticComboRecord_t
+struct StaticComboAuxInfo_t : StaticComboRecordWide_t
 {
-	uint32_t m_nCRC32; // CRC32 of packed data
+	uint64_t m_nHash; // Hash of packed data
 	CStaticCombo* m_pByteCode;
 };
 
-static bool CompareComboIds( const StaticComboAuxInfo_t& pA, const StaticComboAuxInfo_t& pB ) noexcept
+// Only asserts use it
+[[maybe_unused]] static bool CompareComboIds( const StaticComboAuxInfo_t& pA, const StaticComboAuxInfo_t& pB ) noexcept
 {
 	return pA.m_nStaticComboID < pB.m_nStaticComboID;
 }
 
-static void WriteShaderFiles( std::string_view pShaderName )
+// Writes a file front to back through one large buffer, so that slow (network) drives
+// see a few big sequential writes instead of many small ones
+class CSequentialFileWriter
 {
-	if ( !g_ShaderWrittenToDisk.emplace( pShaderName ).second )
-		return;
+public:
+	static constexpr size_t BUFFER_SIZE = 4 << 20;
 
-	const bool bShaderFailed                = g_ShaderHadError.contains( pShaderName );
-	const char* const szShaderFileOperation = bShaderFailed ? "Removing failed" : "Writing";
+	explicit CSequentialFileWriter( const fs::path& path ) : m_hFile( Platform::CreateSequentialFile( path ) ), m_pBuffer( new uint8_t[BUFFER_SIZE] ), m_nBuffered( 0 ), m_nWritten( 0 )
+	{
+		m_bOk = m_hFile != nullptr;
+	}
 
-	static Clock::time_point lastTime = g_flStartTime;
+	~CSequentialFileWriter() { Close(); }
 
-	//
-	// Progress indication
-	//
-	std::cout << "\r"sv << clr::escaped( lineRewind ) << szShaderFileOperation << " "sv << (bShaderFailed ? clr::red : clr::green) << pShaderName << clr::reset << "..."sv << endLine;
+	CSequentialFileWriter( const CSequentialFileWriter& ) = delete;
+	CSequentialFileWriter& operator=( const CSequentialFileWriter& ) = delete;
+
+	void Write( const void* pData, size_t nSize )
+	{
+		if ( m_nBuffered + nSize > BUFFER_SIZE )
+			Flush();
+
+		// Big blocks go straight to the file
+		if ( nSize >= BUFFER_SIZE )
+			WriteToFile( pData, nSize );
+		else if ( nSize )
+		{
+			memcpy( m_pBuffer.get() + m_nBuffered, pData, nSize );
+			m_nBuffered += nSize;
+		}
+		m_nWritten += nSize;
+	}
+
+	[[nodiscard]] uint64_t Tell() const noexcept { return m_nWritten; }
+
+	// Returns false if anything failed to make it to the file
+	bool Close()
+	{
+		if ( m_hFile )
+		{
+			Flush();
+			Platform::CloseFile( m_hFile );
+			m_hFile = nullptr;
+		}
+		return m_bOk;
+	}
+
+private:
+	void Flush()
+	{
+		WriteToFile( m_pBuffer.get(), m_nBuffered );
+		m_nBuffered = 0;
+	}
+
+	void WriteToFile( const void* pData, size_t nSize )
+	{
+		m_bOk = m_bOk && Platform::WriteToFile( m_hFile, pData, nSize );
+	}
+
+	void* m_hFile;
+	std::unique_ptr<uint8_t[]> m_pBuffer;
+	size_t m_nBuffered;
+	uint64_t m_nWritten;
+	bool m_bOk;
+};
+
+// A finished shader taken out of the global variables
+struct PendingShaderWrite_t
+{
+	std::string_view m_pShaderName;
+	CStaticComboTable* m_pByteCodeArray = nullptr;
+	CSpillFile* m_pSpill = nullptr;
+	VcsReuse::CPreviousShader* m_pPrevious = nullptr;
+	ResumeJournal::CJournal* m_pJournal = nullptr;
+	ShaderInfo_t m_ShaderInfo{};
+	bool m_bShaderFailed = false;
+	bool m_bPartial = false; // Only some static combos, for -priority or -preview, the others alias the closest one before them
+	std::vector<StaticComboAliasRecordWide_t> m_arrAliases{}; // Found by -dedup-static before compiling, sorted
+};
+
+static void WriteShaderFile( const PendingShaderWrite_t& pending );
+
+//
+// CShaderWriter
+//
+// Runs the dedup and disk I/O of finished shaders on its own thread, so that
+// the next shader does not wait for the previous one to hit the disk.
+// The queue is bounded to keep finished bytecode from piling up in memory.
+//
+class CShaderWriter
+{
+public:
+	static constexpr size_t MAX_PENDING = 4;
+
+	CShaderWriter() : m_bFinished( false ), m_Thread( &CShaderWriter::Run, this ) {}
+	~CShaderWriter() { Finish(); }
+
+	void Push( const PendingShaderWrite_t& pending )
+	{
+		std::unique_lock guard{ m_mtx };
+		m_cvNotFull.wait( guard, [this] { return m_Queue.size() < MAX_PENDING; } );
+		m_Queue.emplace_back( pending );
+		m_nMaxQueued = std::max( m_nMaxQueued, m_Queue.size() );
+		m_cvNotEmpty.notify_one();
+	}
+
+	// Most shaders that were waiting for the disk at once
+	[[nodiscard]] size_t MaxQueued() const noexcept { return m_nMaxQueued; }
+
+	// Writes out everything queued and stops the thread
+	void Finish()
+	{
+		{
+			std::lock_guard guard{ m_mtx };
+			m_bFinished = true;
+		}
+		m_cvNotEmpty.notify_one();
+
+		if ( m_Thread.joinable() )
+			m_Thread.join();
+	}
+
+private:
+	void Run()
+	{
+		for ( ;; )
+		{
+			PendingShaderWrite_t pending;
+			{
+				std::unique_lock guard{ m_mtx };
+				m_cvNotEmpty.wait( guard, [this] { return m_bFinished || !m_Queue.empty(); } );
+				if ( m_Queue.empty() )
+					return;
+				pending = m_Queue.front();
+				m_Queue.pop_front();
+			}
+			m_cvNotFull.notify_one();
+
+			WriteShaderFile( pending );
+		}
+	}
+
+	std::mutex m_mtx;
+	std::condition_variable m_cvNotEmpty;
+	std::condition_variable m_cvNotFull;
+	std::deque<PendingShaderWrite_t> m_Queue;
+	size_t m_nMaxQueued = 0;
+	bool m_bFinished;
+	std::thread m_Thread;
+};
+
+static CShaderWriter* g_pShaderWriter = nullptr;
+
+static void WriteShaderFiles( std::string_view pShaderName )
+{
+	if ( !g_ShaderWrittenToDisk.emplace( pShaderName ).second )
+		return;
+
+	const Trace::CScope trace{ "WriteShaderFiles", pShaderName };
+
+	ShaderStats( pShaderName ).m_tWritten = Clock::now();
 
 	//
 	// Retrieve the data we are going to operate on
 	// from global variables under lock.
 	//
-	StaticComboNodeHash_t* pByteCodeArray;
-	ShaderInfo_t shaderInfo;
+	PendingShaderWrite_t pending{ .m_pShaderName = pShaderName };
+	uint64_t nInternLookups = 0, nInternHits = 0;
 	{
 		std::lock_guard guard{ Threading::g_mtxGlobal };
-		StaticComboNodeHash_t*& rp	= g_ShaderByteCode[pShaderName]; // Get a static combo pointer, reset it as well
-		pByteCodeArray				= rp;
+		if ( const auto it = g_ShaderByteCodeIntern.find( pShaderName ); it != g_ShaderByteCodeIntern.end() )
+		{
+			nInternLookups = it->second.NumLookups();
+			nInternHits    = it->second.NumHits();
+			g_ShaderByteCodeIntern.erase( it );
+		}
+
+		CStaticComboTable*& rp		= g_ShaderByteCode[pShaderName]; // Get a static combo pointer, reset it as well
+		pending.m_pByteCodeArray	= rp;
 		rp							= nullptr;
-		shaderInfo					= g_ShaderToShaderInfo[pShaderName];
+		pending.m_pSpill			= nullptr;
+		if ( const auto it = g_ShaderSpill.find( pShaderName ); it != g_ShaderSpill.end() )
+		{
+			pending.m_pSpill = it->second;
+			g_ShaderSpill.erase( it );
+		}
+		pending.m_pPrevious			= nullptr;
+		if ( const auto it = g_ShaderPrevious.find( pShaderName ); it != g_ShaderPrevious.end() )
+		{
+			pending.m_pPrevious = it->second;
+			g_ShaderPrevious.erase( it );
+		}
+		pending.m_pJournal			= nullptr;
+		if ( const auto it = g_ShaderJournal.find( pShaderName ); it != g_ShaderJournal.end() )
+		{
+			pending.m_pJournal = it->second;
+			g_ShaderJournal.erase( it );
+		}
+		g_ShaderResumed.erase( pShaderName );
+		pending.m_ShaderInfo		= g_ShaderToShaderInfo[pShaderName];
+		pending.m_bShaderFailed		= g_ShaderHadError.contains( pShaderName );
+
+		// Unused static combos only alias a fallback, the next build has to compile them
+		if ( g_bProfileGuided )
+		{
+			pending.m_bPartial			  = true;
+			pending.m_ShaderInfo.m_Crc32 = 0;
+		}
+		if ( const auto it = g_ShaderStaticAliases.find( pShaderName ); it != g_ShaderStaticAliases.end() )
+		{
+			pending.m_arrAliases = std::move( it->second );
+			g_ShaderStaticAliases.erase( it );
+		}
+	}
+
+	if ( g_bVerbose && nInternLookups )
+		ConsoleLog::CLine() << "\r"sv << clr::escaped( lineRewind ) << pShaderName << ": "sv << clr::green << PrettyPrint( nInternHits ) << clr::reset << " of "sv << clr::green << PrettyPrint( nInternLookups ) << clr::reset << " dynamic combos share bytecode ("sv
+				  << clr::green << nInternHits * 100 / nInternLookups << "%"sv << clr::reset << ")"sv << std::endl;
+
+	// Taken before the code of the shader is written and given back, shaders finish side by side so the peak is of all of them
+	if ( g_bMemoryStats )
+	{
+		ShaderStats_t& stats = ShaderStats( pShaderName );
+		stats.m_nPeakCode	 = MemoryBudget::TakeRecentPeak();
+		stats.m_nPeakMemory	 = Platform::PeakMemory();
+		ConsoleLog::CLine() << "\r"sv << clr::escaped( lineRewind ) << pShaderName << ": "sv << clr::green << PrettyPrint( stats.m_nPeakCode >> 20 ) << clr::reset << " MB of compiled code at most since the last shader, "sv
+							<< clr::green << PrettyPrint( stats.m_nPeakMemory >> 20 ) << clr::reset << " MB peak working set"sv << std::endl;
+	}
+
+	if ( g_pShaderWriter )
+		g_pShaderWriter->Push( pending );
+	else
+		WriteShaderFile( pending );
+}
+
+// -priority and -preview: writes the shader with just the given packed static combos while the rest still compiles, so
+// the engine can load it early. Without the crc a build that is cut short before the whole shader is written builds it again.
+static void WritePartialShaderFile( const CfgProcessor::CfgEntryInfo* pEntry, const CStaticComboTable& staticCombos, const std::vector<uint64_t>& arrStaticCombos )
+{
+	PendingShaderWrite_t pending{ .m_pShaderName = pEntry->m_szName, .m_bPartial = true };
+	CSpillFile* pSpill = nullptr;
+	{
+		std::lock_guard guard{ Threading::g_mtxGlobal };
+		if ( g_ShaderHadError.contains( pEntry->m_szName ) )
+			return;
+		pending.m_ShaderInfo = g_ShaderToShaderInfo[pEntry->m_szName];
+		if ( const auto it = g_ShaderStaticAliases.find( pEntry->m_szName ); it != g_ShaderStaticAliases.end() )
+			pending.m_arrAliases = it->second;
+		if ( const auto it = g_ShaderSpill.find( pEntry->m_szName ); it != g_ShaderSpill.end() )
+			pSpill = it->second;
+	}
+	pending.m_ShaderInfo.m_Crc32 = 0;
+
+	// Finished static combos aren't touched by the workers anymore
+	auto pTable = std::make_unique<CStaticComboTable>( pEntry->m_numStaticCombos );
+	pTable->CopyDictionary( staticCombos );
+	std::vector<uint8_t> scratch;
+	for ( const uint64_t nStaticCombo : arrStaticCombos )
+	{
+		const CStaticCombo* pStatic = staticCombos.Find( nStaticCombo );
+		if ( !pStatic || !pStatic->PackedSize() )
+			continue;
+		const uint8_t* pCode = pStatic->PackedData( pSpill, scratch );
+		if ( !pCode )
+			return;
+		pTable->FindOrAdd( nStaticCombo )->CopyPackedCode( *pStatic, pCode );
 	}
+	if ( !pTable->Count() )
+		return;
+
+	pending.m_pByteCodeArray = pTable.release();
+	if ( g_pShaderWriter )
+		g_pShaderWriter->Push( pending );
+	else
+		WriteShaderFile( pending );
+}
+
+static void WriteShaderFile( const PendingShaderWrite_t& pending )
+{
+	const std::string_view pShaderName		= pending.m_pShaderName;
+	const Trace::CScope trace{ "WriteShaderFile", pShaderName };
+	CStaticComboTable* pByteCodeArray		= pending.m_pByteCodeArray;
+	const ShaderInfo_t& shaderInfo			= pending.m_ShaderInfo;
+	const bool bShaderFailed				= pending.m_bShaderFailed;
+	const std::unique_ptr<CSpillFile> pSpill( pending.m_pSpill );
+	// Everything taken from the old vcs is in memory by now, and it has to be closed before it is replaced
+	delete pending.m_pPrevious;
+	// Nothing is appended to it anymore, it goes once the vcs file is written
+	delete pending.m_pJournal;
+	const char* const szShaderFileOperation = bShaderFailed ? "Removing failed" : pending.m_bPartial ? "Writing part of" : "Writing";
+
+	static Clock::time_point lastTime = g_flStartTime;
+
+	//
+	// Progress indication
+	//
+	ConsoleLog::CLine() << "\r"sv << clr::escaped( lineRewind ) << szShaderFileOperation << " "sv << (bShaderFailed ? clr::red : clr::green) << pShaderName << clr::reset << "..."sv << endLine;
 
 	if ( shaderInfo.m_pShaderName.empty() )
+	{
+		delete pByteCodeArray;
 		return;
+	}
 
 	//
 	// Shader vcs file name
 	//
 	auto path = GetVCSFilenames( shaderInfo );
+	if ( g_nShards > 1 )
+		path = ShardFragmentPath( path, g_iShard, g_nShards );
 
 	if ( bShaderFailed )
 	{
+		VcsReuse::Remove( path );
 		std::error_code c;
 		fs::remove( path, c );
-		std::cout << "\r"sv << clr::escaped( lineRewind ) << clr::red << pShaderName << clr::reset << " "sv << FormatTimeShort( duration_cast<chrono::seconds>( Clock::now() - lastTime ).count() ) << std::endl;
+		fs::remove( InputHashPath( path ), c );
+		WriteDuplicates( shaderInfo, path, false );
+		ConsoleLog::CLine() << "\r"sv << clr::escaped( lineRewind ) << clr::red << pShaderName << clr::reset << " "sv << FormatTimeShort( duration_cast<chrono::seconds>( Clock::now() - lastTime ).count() ) << std::endl;
 		lastTime = Clock::now();
+		delete pByteCodeArray;
 		return;
 	}
 
-	if ( !pByteCodeArray )
-		return;
+	// Every combo was skipped, a shard still leaves an empty fragment so that -merge knows it is done
+	if ( !pByteCodeArray || !pByteCodeArray->Count() )
+	{
+		if ( g_nShards == 1 )
+		{
+			delete pByteCodeArray;
+			return;
+		}
+		if ( !pByteCodeArray )
+			pByteCodeArray = new CStaticComboTable( 0 );
+	}
 
 	if ( g_bVerbose )
-		std::cout << "\r"sv << std::showbase << pShaderName << ": "sv << clr::green << shaderInfo.m_nTotalShaderCombos << clr::reset << " combos, centroid mask: "sv << clr::green << std::hex << shaderInfo.m_CentroidMask << std::dec << clr::reset << ", numDynamicCombos: "sv << clr::green << shaderInfo.m_nDynamicCombos << clr::reset << std::endl;
+		ConsoleLog::CLine() << "\r"sv << std::showbase << pShaderName << ": "sv << clr::green << shaderInfo.m_nTotalShaderCombos << clr::reset << " combos, centroid mask: "sv << clr::green << std::hex << shaderInfo.m_CentroidMask << std::dec << clr::reset << ", numDynamicCombos: "sv << clr::green << shaderInfo.m_nDynamicCombos << clr::reset << std::endl;
 
 	//
 	// Static combo headers
@@ -569,307 +1860,1524 @@ static void WriteShaderFiles( std::string_view pShaderName )
 
 	StaticComboHeaders.reserve( 1ULL + pByteCodeArray->Count() ); // we know how much ram we need
 
-	std::vector<size_t> comboIndicesHashedByCRC32[STATIC_COMBO_HASH_SIZE];
-	std::vector<StaticComboAliasRecord_t> duplicateCombos;
+	robin_hood::unordered_flat_map<uint64_t, size_t> comboIndicesByHash; // First combo with that hash
+	comboIndicesByHash.reserve( pByteCodeArray->Count() );
+	std::vector<StaticComboAliasRecordWide_t> duplicateCombos;
+	std::vector<uint8_t> scratch, checkScratch; // Spilled code read back for comparing and writing
 
 	// now, lets fill in our combo headers, sort, and write
-	for ( int nChain = 0; nChain < StaticComboNodeHash_t::NumChains; ++nChain )
+	// in id order, so both the headers and the duplicate records come out sorted
+	pByteCodeArray->ForEach( [&]( CStaticCombo* pStatic )
 	{
-		for ( CStaticCombo* pStatic = pByteCodeArray->Chain( nChain ).Head(); pStatic; pStatic = pStatic->Next() )
-		{
-			const CStaticCombo::PackedCode& code = pStatic->Code();
-			if ( code.GetLength() )
+		const size_t nPackedSize = pStatic->PackedSize();
+		if ( !nPackedSize )
+			return;
+
+		StaticComboAuxInfo_t hdr {
 			{
-				StaticComboAuxInfo_t hdr {
-					{
-						.m_nStaticComboID = gsl::narrow<uint32_t>( pStatic->ComboId() ),
-						.m_nFileOffset = 0,
-					},
-					CRC32::ProcessSingleBuffer( code.GetData(), code.GetLength() ),
-					pStatic
-				};
-				const uint32_t nHashIdx = hdr.m_nCRC32 % STATIC_COMBO_HASH_SIZE;
-				__assume( 0 <= nHashIdx && nHashIdx < STATIC_COMBO_HASH_SIZE );
-
-				// now, see if we have an identical static combo
-				auto& hash = comboIndicesHashedByCRC32[nHashIdx];
-				bool bIsDuplicate = false;
-				for ( const size_t i : hash )
-				{
-					const StaticComboAuxInfo_t& check = StaticComboHeaders[i];
-					const CStaticCombo::PackedCode& checkCode = check.m_pByteCode->Code();
-					if ( check.m_nCRC32 == hdr.m_nCRC32 && checkCode.GetLength() == code.GetLength() && memcmp( checkCode.GetData(), code.GetData(), checkCode.GetLength() ) == 0 )
-					{
-						// this static combo is the same as another one!!
-						duplicateCombos.emplace_back( StaticComboAliasRecord_t { hdr.m_nStaticComboID, check.m_nStaticComboID } );
-						bIsDuplicate = true;
-						break;
-					}
-				}
+				.m_nStaticComboID = pStatic->ComboId(),
+				.m_nFileOffset = 0,
+			},
+			pStatic->PackedHash(),
+			pStatic
+		};
 
-				if ( !bIsDuplicate )
+		// now, see if we have an identical static combo, the bytes are only compared on a hash hit
+		const auto [it, bInserted] = comboIndicesByHash.try_emplace( hdr.m_nHash, StaticComboHeaders.size() );
+		if ( !bInserted )
+		{
+			const StaticComboAuxInfo_t& check = StaticComboHeaders[it->second];
+			if ( check.m_pByteCode->PackedSize() == nPackedSize )
+			{
+				const uint8_t* pCheckCode = check.m_pByteCode->PackedData( pSpill.get(), checkScratch );
+				const uint8_t* pCode = pStatic->PackedData( pSpill.get(), scratch );
+				if ( pCheckCode && pCode && memcmp( pCheckCode, pCode, nPackedSize ) == 0 )
 				{
-					StaticComboHeaders.emplace_back( std::move( hdr ) );
-					hash.emplace_back( StaticComboHeaders.size() - 1 );
+					// this static combo is the same as another one!!
+					duplicateCombos.emplace_back( StaticComboAliasRecordWide_t { hdr.m_nStaticComboID, check.m_nStaticComboID } );
+					return;
 				}
 			}
+			// a plain hash collision, just keep it unique
+		}
+
+		StaticComboHeaders.emplace_back( std::move( hdr ) );
+	} );
+	// Static combos aliased before they were compiled read whatever their source reads, nothing if it has no code
+	if ( !pending.m_arrAliases.empty() )
+	{
+		robin_hood::unordered_flat_map<uint64_t, uint64_t> sourceOf;
+		sourceOf.reserve( StaticComboHeaders.size() + duplicateCombos.size() );
+		for ( const StaticComboAuxInfo_t& hdr : StaticComboHeaders )
+			sourceOf.emplace( hdr.m_nStaticComboID, hdr.m_nStaticComboID );
+		for ( const StaticComboAliasRecordWide_t& dup : duplicateCombos )
+			sourceOf.emplace( dup.m_nStaticComboID, dup.m_nSourceStaticCombo );
+
+		const size_t nDuplicates = duplicateCombos.size();
+		for ( const StaticComboAliasRecordWide_t& alias : pending.m_arrAliases )
+		{
+			if ( const auto it = sourceOf.find( alias.m_nSourceStaticCombo ); it != sourceOf.end() )
+				duplicateCombos.emplace_back( StaticComboAliasRecordWide_t{ alias.m_nStaticComboID, it->second } );
 		}
+		std::inplace_merge( duplicateCombos.begin(), duplicateCombos.begin() + nDuplicates, duplicateCombos.end(), CompareDupComboIndices );
 	}
-	// add sentinel key
-	StaticComboHeaders.emplace_back( StaticComboAuxInfo_t { { 0xffffffff, 0 }, 0, nullptr } );
+	// A partial file stands in for the whole shader, every static combo that isn't there yet reads the closest one before it,
+	// or the first one for those before that. Aliases always point at a combo with code of its own.
+	if ( pending.m_bPartial && !StaticComboHeaders.empty() )
+	{
+		std::vector<StaticComboAliasRecordWide_t> present; // Every combo that is there and the one it reads, in id order
+		present.reserve( StaticComboHeaders.size() + duplicateCombos.size() );
+		for ( const StaticComboAuxInfo_t& hdr : StaticComboHeaders )
+			present.emplace_back( StaticComboAliasRecordWide_t{ hdr.m_nStaticComboID, hdr.m_nStaticComboID } );
+		present.insert( present.end(), duplicateCombos.begin(), duplicateCombos.end() );
+		std::sort( present.begin(), present.end(), CompareDupComboIndices );
+
+		std::vector<StaticComboAliasRecordWide_t> aliases;
+		const uint64_t nStaticCombos = shaderInfo.m_nTotalShaderCombos / shaderInfo.m_nDynamicCombos;
+		uint64_t nFallback = present.front().m_nSourceStaticCombo;
+		auto itPresent = present.cbegin();
+		for ( uint64_t nStaticCombo = 0; nStaticCombo < nStaticCombos; ++nStaticCombo )
+		{
+			if ( itPresent != present.cend() && itPresent->m_nStaticComboID == nStaticCombo )
+				nFallback = ( itPresent++ )->m_nSourceStaticCombo;
+			else
+				aliases.emplace_back( StaticComboAliasRecordWide_t{ nStaticCombo, nFallback } );
+		}
 
-	// now, sort. sentinel key will end up at end
-	std::sort( StaticComboHeaders.begin(), StaticComboHeaders.end(), CompareComboIds );
+		const size_t nDuplicates = duplicateCombos.size();
+		duplicateCombos.insert( duplicateCombos.end(), aliases.begin(), aliases.end() );
+		std::inplace_merge( duplicateCombos.begin(), duplicateCombos.begin() + nDuplicates, duplicateCombos.end(), CompareDupComboIndices );
+	}
+
+	// -load-order: the static combos the engine loaded go first, in the order it did, the rest after them by id. The records
+	// stay sorted by id for the binary search. Shard fragments stay in id order for -merge.
+	std::vector<size_t> writeOrder( StaticComboHeaders.size() );
+	std::iota( writeOrder.begin(), writeOrder.end(), size_t( 0 ) );
+	if ( const auto it = g_StaticLoadOrder.find( std::string( pShaderName ) ); it != g_StaticLoadOrder.end() && g_nShards == 1 )
+	{
+		const auto& RankOf = [&order = it->second, &StaticComboHeaders]( size_t i )
+		{
+			const auto itRank = order.find( StaticComboHeaders[i].m_nStaticComboID );
+			return itRank != order.end() ? itRank->second : UINT32_MAX;
+		};
+		std::stable_sort( writeOrder.begin(), writeOrder.end(), [&RankOf]( size_t a, size_t b ) { return RankOf( a ) < RankOf( b ); } );
+	}
+	const bool bLoadOrder = !std::is_sorted( writeOrder.begin(), writeOrder.end() );
+
+	// add sentinel key, it sorts last
+	StaticComboHeaders.emplace_back( StaticComboAuxInfo_t { { UINT64_MAX, 0 }, 0, nullptr } );
+	Assert( std::is_sorted( StaticComboHeaders.begin(), StaticComboHeaders.end(), CompareComboIds ) );
+	Assert( std::is_sorted( duplicateCombos.begin(), duplicateCombos.end(), CompareDupComboIndices ) );
 
 	//
-	// Shader file stream buffer
+	// All offsets are known now, so the file is written front to back in one go
 	//
-	std::ofstream ShaderFile( path, std::ios::binary | std::ios::trunc ); // Streaming buffer for vcs file (since this can blow memory)
+	constexpr uint32_t endMark = 0xffffffff; // end of dynamic combos
+	const std::vector<uint8_t>& dictionary = pByteCodeArray->Dictionary();
+
+	// Dynamic combo index, entries of every record start at indexFirst, the sentinel's is the end
+	std::vector<uint32_t> indexFirst;
+	std::vector<DynamicComboIndexRecord_t> indexEntries;
+	if ( g_bBlockIndex && g_nShards == 1 )
+	{
+		const Trace::CScope traceIndex{ "IndexShaderFile", pShaderName };
+		for ( const StaticComboAuxInfo_t& SRec : StaticComboHeaders )
+		{
+			indexFirst.emplace_back( gsl::narrow<uint32_t>( indexEntries.size() ) );
+			const CStaticCombo* pStatic = SRec.m_pByteCode;
+			if ( !pStatic )
+				continue;
+			if ( !pStatic->DynamicIndex().empty() )
+			{
+				indexEntries.insert( indexEntries.end(), pStatic->DynamicIndex().begin(), pStatic->DynamicIndex().end() );
+				continue;
+			}
+
+			const size_t nFirst  = indexEntries.size();
+			const uint8_t* pCode = pStatic->PackedData( pSpill.get(), scratch );
+			if ( !pCode || !IndexPackedCode( pCode, pStatic->PackedSize(), dictionary, indexEntries ) )
+			{
+				ConsoleLog::CLine() << clr::yellow << "Can't index static combo "sv << SRec.m_nStaticComboID << " of "sv << pShaderName << ", writing it without a dynamic combo index"sv << clr::reset << std::endl;
+				indexFirst.clear();
+				indexEntries.clear();
+				break;
+			}
+			std::sort( indexEntries.begin() + nFirst, indexEntries.end(), CompareIndexRecords );
+		}
+	}
+	const bool bIndex = !indexFirst.empty();
+
+	// -shared-blobs: the vcs file only keeps a reference to static combos that went to shared.vcsblob, m_nSize 0 for the rest
+	std::vector<SharedBlobReference_t> sharedBlobs;
+	bool bShared = false;
+	if ( g_bSharedBlobs )
+	{
+		sharedBlobs.resize( StaticComboHeaders.size(), SharedBlobReference_t{} );
+		for ( size_t i = 0; i < StaticComboHeaders.size(); ++i )
+		{
+			const CStaticCombo* pStatic = StaticComboHeaders[i].m_pByteCode;
+			if ( !pStatic || pStatic->PackedSize() < SharedBlobs::MIN_SIZE )
+				continue;
+			const uint8_t* pCode = pStatic->PackedData( pSpill.get(), scratch );
+			if ( pCode && SharedBlobs::Store( pCode, pStatic->PackedSize(), pStatic->PackedHash(), sharedBlobs[i] ) )
+				bShared = true;
+		}
+	}
+	constexpr uint32_t sharedFlagSize = SHADER_BLOCK_SHARED | sizeof( SharedBlobReference_t );
+	const bool bVersion7 = !dictionary.empty() || bIndex || bShared || bLoadOrder;
+
+	// An id that reaches the sentinel of version 6 and 7 or a count too big for their header makes it version 8
+	const uint64_t nLastStaticCombo = StaticComboHeaders.size() > 1 ? StaticComboHeaders[StaticComboHeaders.size() - 2].m_nStaticComboID : 0;
+	const uint64_t nLastDuplicate	= duplicateCombos.empty() ? 0 : duplicateCombos.back().m_nStaticComboID;
+	const bool bWide				= std::max( nLastStaticCombo, nLastDuplicate ) >= 0xffffffff || shaderInfo.m_nTotalShaderCombos > INT32_MAX || shaderInfo.m_nDynamicCombos > INT32_MAX;
+	const size_t nRecordSize		= bWide ? sizeof( StaticComboRecordWide_t ) : sizeof( StaticComboRecord_t );
+	const size_t nAliasSize			= bWide ? sizeof( StaticComboAliasRecordWide_t ) : sizeof( StaticComboAliasRecord_t );
+
+	size_t nFileOffset = sizeof( ShaderHeader_t ) + ( bWide ? sizeof( ShaderHeaderWide_t ) : 0 ) + nRecordSize * StaticComboHeaders.size() + sizeof( uint32_t ) + nAliasSize * duplicateCombos.size();
+	if ( bVersion7 || bWide )
+		nFileOffset += sizeof( uint32_t ) + dictionary.size();
+	if ( bIndex )
+		nFileOffset += sizeof( uint32_t ) + sizeof( uint32_t ) * indexFirst.size() + sizeof( DynamicComboIndexRecord_t ) * indexEntries.size();
+	for ( const size_t i : writeOrder )
+	{
+		StaticComboAuxInfo_t& SRec = StaticComboHeaders[i];
+		SRec.m_nFileOffset = gsl::narrow<uint32_t>( nFileOffset );
+		if ( bShared && sharedBlobs[i].m_nSize )
+			nFileOffset += sizeof( sharedFlagSize ) + sizeof( SharedBlobReference_t ) + sizeof( endMark );
+		else
+			nFileOffset += SRec.m_pByteCode->PackedSize() + sizeof( endMark );
+	}
+	StaticComboHeaders.back().m_nFileOffset = gsl::narrow<uint32_t>( nFileOffset ); // the sentinel's is the end of the file
+
+	// Written next to the target and moved over it once complete, an interrupted
+	// build never leaves a truncated file behind that still passes the crc check
+	fs::path tmpPath = path;
+	tmpPath += ".tmp"sv;
+	CSequentialFileWriter ShaderFile( tmpPath );
 
 	// ------ Header --------------
+	// Files without primed blocks, an index or shared static combos stay readable for engines that only know version 6
 	const ShaderHeader_t header {
-		SHADER_VCS_VERSION_NUMBER,
-		gsl::narrow_cast<int32_t>( shaderInfo.m_nTotalShaderCombos ), // this is not actually used in vertexshaderdx8.cpp for combo checking
-		gsl::narrow<int32_t>( shaderInfo.m_nDynamicCombos ),          // this is used
-		0,
+		bWide ? SHADER_VCS_WIDE_VERSION_NUMBER : bVersion7 ? SHADER_VCS_DICTIONARY_VERSION_NUMBER : SHADER_VCS_VERSION_NUMBER,
+		bWide ? -1 : static_cast<int32_t>( shaderInfo.m_nTotalShaderCombos ), // this is not actually used in vertexshaderdx8.cpp for combo checking
+		bWide ? -1 : static_cast<int32_t>( shaderInfo.m_nDynamicCombos ),     // this is used
+		bLoadOrder ? SHADER_FLAG_LOAD_ORDER : 0U,
 		shaderInfo.m_CentroidMask,
 		gsl::narrow<uint32_t>( StaticComboHeaders.size() ),
 		shaderInfo.m_Crc32
 	};
-	ShaderFile.write( reinterpret_cast<const char*>( &header ), sizeof( header ) );
-
-	// static combo dictionary
-	const auto nDictionaryOffset = ShaderFile.tellp();
+	ShaderFile.Write( &header, sizeof( header ) );
+	if ( bWide )
+	{
+		const ShaderHeaderWide_t wideHeader { shaderInfo.m_nTotalShaderCombos, shaderInfo.m_nDynamicCombos };
+		ShaderFile.Write( &wideHeader, sizeof( wideHeader ) );
+	}
 
-	// we will re write this one we know the offsets
-	ShaderFile.write( reinterpret_cast<const char*>( StaticComboHeaders.data() ), sizeof( StaticComboRecord_t ) * StaticComboHeaders.size() ); // dummy write, 8 bytes per static combo
+	// static combo dictionary, 8 bytes per static combo, 12 in version 8. Below version 8 every id fits, the sentinel's becomes 0xffffffff.
+	for ( const StaticComboRecordWide_t& SRec : StaticComboHeaders )
+	{
+		const StaticComboRecord_t narrowRec { static_cast<uint32_t>( SRec.m_nStaticComboID ), SRec.m_nFileOffset };
+		ShaderFile.Write( bWide ? static_cast<const void*>( &SRec ) : &narrowRec, nRecordSize );
+	}
 
+	// now, write out all duplicate header records
 	const uint32_t dupl = gsl::narrow<uint32_t>( duplicateCombos.size() );
-	ShaderFile.write( reinterpret_cast<const char*>( &dupl ), sizeof( dupl ) );
+	ShaderFile.Write( &dupl, sizeof( dupl ) );
+	for ( const StaticComboAliasRecordWide_t& dup : duplicateCombos )
+	{
+		const StaticComboAliasRecord_t narrowDup { static_cast<uint32_t>( dup.m_nStaticComboID ), static_cast<uint32_t>( dup.m_nSourceStaticCombo ) };
+		ShaderFile.Write( bWide ? static_cast<const void*>( &dup ) : &narrowDup, nAliasSize );
+	}
 
-	// now, write out all duplicate header records
-	// sort duplicate combo records for binary search
-	std::sort( duplicateCombos.begin(), duplicateCombos.end(), CompareDupComboIndices );
+	if ( bVersion7 || bWide )
+	{
+		const uint32_t nDictionarySize = gsl::narrow<uint32_t>( dictionary.size() );
+		ShaderFile.Write( &nDictionarySize, sizeof( nDictionarySize ) );
+		ShaderFile.Write( dictionary.data(), dictionary.size() );
+	}
 
-	ShaderFile.write( reinterpret_cast<const char*>( duplicateCombos.data() ), sizeof( StaticComboAliasRecord_t ) * duplicateCombos.size() );
+	if ( bIndex )
+	{
+		const uint32_t nIndexEntries = gsl::narrow<uint32_t>( indexEntries.size() );
+		ShaderFile.Write( &nIndexEntries, sizeof( nIndexEntries ) );
+		ShaderFile.Write( indexFirst.data(), sizeof( uint32_t ) * indexFirst.size() );
+		ShaderFile.Write( indexEntries.data(), sizeof( DynamicComboIndexRecord_t ) * indexEntries.size() );
+	}
 
 	// now, write out all static combos
-	for ( StaticComboRecord_t& SRec : StaticComboHeaders )
+	bool bWritten = true;
+	for ( const size_t i : writeOrder )
 	{
-		SRec.m_nFileOffset = gsl::narrow<uint32_t>( ShaderFile.tellp() );
-		if ( SRec.m_nStaticComboID != 0xffffffff ) // sentinel key?
-		{
-			CStaticCombo* pStatic = pByteCodeArray->FindByKey( SRec.m_nStaticComboID );
-			Assert( pStatic );
+		const StaticComboAuxInfo_t& SRec = StaticComboHeaders[i];
+		const CStaticCombo* pStatic = SRec.m_pByteCode;
 
-			// Put the packed chunk of code for this static combo
-			if ( const auto& code = pStatic->Code() )
-				ShaderFile.write( reinterpret_cast<const char*>( code.GetData() ), code.GetLength() );
+		Assert( ShaderFile.Tell() == SRec.m_nFileOffset );
 
-			constexpr uint32_t endMark = 0xffffffff; // end of dynamic combos
-			ShaderFile.write( reinterpret_cast<const char*>( &endMark ), sizeof( endMark ) );
+		// Put the packed chunk of code for this static combo, or where it is in shared.vcsblob
+		if ( bShared && sharedBlobs[i].m_nSize )
+		{
+			ShaderFile.Write( &sharedFlagSize, sizeof( sharedFlagSize ) );
+			ShaderFile.Write( &sharedBlobs[i], sizeof( SharedBlobReference_t ) );
 		}
+		else if ( const size_t nPackedSize = pStatic->PackedSize() )
+		{
+			const uint8_t* pCode = pStatic->PackedData( pSpill.get(), scratch );
+			if ( !pCode )
+			{
+				ConsoleLog::CLine() << clr::red << "Failed to read back spilled static combo "sv << SRec.m_nStaticComboID << " of "sv << pShaderName << clr::reset << std::endl;
+				bWritten = false;
+				break;
+			}
+			ShaderFile.Write( pCode, nPackedSize );
+		}
+
+		ShaderFile.Write( &endMark, sizeof( endMark ) );
 	}
 
-	//
-	// Re-writing the combo header
-	//
-	ShaderFile.seekp( nDictionaryOffset, std::ios::beg );
+	if ( !ShaderFile.Close() && bWritten )
+	{
+		ConsoleLog::CLine() << clr::red << "Failed to write "sv << path.string() << clr::reset << std::endl;
+		bWritten = false;
+	}
+
+	// The blobs the new file refers to have to be there before it is
+	if ( bWritten && bShared && !SharedBlobs::Flush() )
+	{
+		ConsoleLog::CLine() << clr::red << "Failed to write shared.vcsblob for "sv << path.string() << clr::reset << std::endl;
+		bWritten = false;
+	}
 
-	// now, rewrite header. data is already byte-swapped appropriately
-	for ( const StaticComboRecord_t& SRec : StaticComboHeaders )
-		ShaderFile.write( reinterpret_cast<const char*>( &SRec ), sizeof( StaticComboRecord_t ) );
+	VcsReuse::Remove( path );
+	if ( !pending.m_bPartial )
+	{
+		std::error_code c;
+		fs::remove( InputHashPath( path ), c );
+	}
+	if ( bWritten && !Platform::RenameOver( tmpPath, path ) )
+	{
+		ConsoleLog::CLine() << clr::red << "Failed to replace "sv << path.string() << clr::reset << std::endl;
+		bWritten = false;
+	}
 
-	ShaderFile.close();
+	if ( bWritten && g_bReuse )
+	{
+		std::vector<VcsReuse::Entry> reuseEntries;
+		reuseEntries.reserve( pByteCodeArray->Count() );
+		pByteCodeArray->ForEach( [&reuseEntries]( const CStaticCombo* pStatic )
+		{
+			if ( pStatic->PackedSize() && pStatic->ComboId() < UINT32_MAX )
+				reuseEntries.emplace_back( VcsReuse::Entry{ gsl::narrow<uint32_t>( pStatic->ComboId() ), pStatic->Fingerprint(), pStatic->PackedHash() } );
+		} );
+		VcsReuse::Save( path, nFileOffset, reuseEntries );
+	}
+
+	if ( !bWritten )
+	{
+		std::error_code c;
+		fs::remove( tmpPath, c );
+		fs::remove( path, c );
+	}
+	else if ( !pending.m_bPartial )
+	{
+		WriteInputHash( path, shaderInfo.m_nInputHash );
+		ResumeJournal::Remove( path );
+	}
+	if ( !pending.m_bPartial )
+		WriteDuplicates( shaderInfo, path, bWritten );
 
 	// Finalize, free memory
 	delete pByteCodeArray;
 
-	std::cout << "\r"sv << clr::escaped( lineRewind ) << clr::green << pShaderName << clr::reset << " "sv << FormatTimeShort( duration_cast<chrono::seconds>( Clock::now() - lastTime ).count() ) << std::endl;
+	ConsoleLog::CLine() << "\r"sv << clr::escaped( lineRewind ) << clr::green << pShaderName << clr::reset << " "sv << FormatTimeShort( duration_cast<chrono::seconds>( Clock::now() - lastTime ).count() ) << std::endl;
 	lastTime = Clock::now();
 }
 
-// Assemble a reply package to the master from the compiled bytecode
-// return the length of the package.
-static size_t AssembleWorkerReplyPackage( const CfgProcessor::CfgEntryInfo* pEntry, uint64_t nComboOfEntry, CUtlBuffer& pBuf )
-{
-	CStaticCombo* pStComboRec;
-	StaticComboNodeHash_t* pByteCodeArray;
-	{
-		std::lock_guard guard{ Threading::g_mtxGlobal };
-		pStComboRec    = StaticComboFromDict( pEntry->m_szName, nComboOfEntry );
-		pByteCodeArray = g_ShaderByteCode[pEntry->m_szName];
+// Appends dynamic combos to the stream of their static combo, highest id first, and compresses every block that fills up.
+// Blocks end where PackStaticCombo would end them, only the combos go in the other way round.
+static void AppendToStream( CStaticCombo::PackStream_t& stream, const std::vector<CByteCodeBlock>& combos, int nCompressLevel, uint32_t nBlockSize )
+{
+	CUtlBuffer& ubBlock = stream.m_Block;
+	for ( const CByteCodeBlock& combo : combos )
+	{
+		const uint32_t nCodeSize = gsl::narrow<uint32_t>( combo.m_nCodeSize );
+		const size_t nInBlock	 = ubBlock.TellPut();
+		if ( nInBlock && nInBlock + nCodeSize + 16 >= nBlockSize )
+		{
+			FlushCombos( stream.m_nBytesWritten, static_cast<const uint8_t*>( ubBlock.Base() ), nInBlock, stream.m_Packed, nCompressLevel, nullptr );
+			ubBlock.Clear();
+			++stream.m_nBlock;
+		}
+
+		ubBlock.PutUnsignedInt( gsl::narrow<uint32_t>( combo.m_nComboID ) );
+		ubBlock.PutUnsignedInt( nCodeSize );
+		ubBlock.Put( combo.get(), nCodeSize );
+		stream.m_bIndex = stream.m_bIndex && AddIndexRecord( stream.m_Index, gsl::narrow<uint32_t>( combo.m_nComboID ), stream.m_nBlock,
+															  gsl::narrow<uint32_t>( ubBlock.TellPut() ) - nCodeSize - 2 * sizeof( uint32_t ) );
+		++stream.m_nCombos;
+	}
+}
+
+// -stream-pack: the dynamic combos [nFirst, nEnd) of a static combo still being compiled are done. They go into its blocks
+// along with the ranges done before them once every dynamic combo above them is in. A thread that finds another one
+// appending leaves its range to it instead of waiting.
+static void StreamDynamicCombos( CStaticCombo* pStComboRec, uint64_t nFirst, uint64_t nEnd, uint64_t nDynamicCombos, int nCompressLevel, uint32_t nBlockSize )
+{
+	static thread_local std::vector<CByteCodeBlock> s_tlTaken;
+
+	CStaticCombo::PackStream_t& stream = pStComboRec->Stream( nDynamicCombos );
+	std::unique_lock guard{ stream.m_mtx };
+	stream.m_arrDone.emplace_back( nFirst, nEnd );
+	if ( stream.m_bPacking )
+		return;
+	stream.m_bPacking = true;
+
+	for ( ;; )
+	{
+		const uint64_t nFrom = stream.m_nFrontier;
+		std::sort( stream.m_arrDone.begin(), stream.m_arrDone.end() );
+		while ( !stream.m_arrDone.empty() && stream.m_arrDone.back().second == stream.m_nFrontier )
+		{
+			stream.m_nFrontier = stream.m_arrDone.back().first;
+			stream.m_arrDone.pop_back();
+		}
+		if ( stream.m_nFrontier == nFrom )
+			break;
+
+		const uint64_t nTo = stream.m_nFrontier;
+		guard.unlock();
+		pStComboRec->TakeDynamicCombos( nTo, nFrom, s_tlTaken );
+		AppendToStream( stream, s_tlTaken, nCompressLevel, nBlockSize );
+		s_tlTaken.clear();
+		guard.lock();
+	}
+
+	stream.m_bPacking = false;
+	stream.m_cvIdle.notify_all();
+}
+
+// Pack the compiled dynamic combos of a finished static combo into its packed code block.
+// The static combo must not be reachable by the workers anymore, so no lock is taken.
+// With pPrimeFrom the blocks are primed with the dictionary of that table.
+// With pUsage the used dynamic combos come first, most used first, in blocks of their own.
+// With bStream they go in like StreamDynamicCombos lays them out, whether any of them were streamed or not.
+static void PackStaticCombo( CStaticCombo* pStComboRec, int nCompressLevel, uint32_t nBlockSize, const ComboUsage_t* pUsage, VcsReuse::CPreviousShader* pPrevious,
+							 CStaticComboTable* pPrimeFrom, bool bStream )
+{
+	// Scratch of the packing thread, reused for every static combo it packs, the biggest ones are let go afterwards
+	static constexpr int KEEP_PACKED_SCRATCH = 4 << 20;
+	static thread_local CUtlBuffer s_tlPacked;
+	static thread_local CUtlBuffer s_tlBlock;
+
+	// Streamed, what is left goes in after the rest. The ones that weren't are laid out the same, so identical static combos still pack the same.
+	CStaticCombo::PackStream_t* pStream = pStComboRec->WaitForStream();
+	if ( !pStream && bStream )
+		pStream = &pStComboRec->Stream( UINT64_MAX );
+	if ( pStream )
+	{
+		static thread_local std::vector<CByteCodeBlock> s_tlRest;
+		pStComboRec->TakeDynamicCombos( 0, pStream->m_nFrontier, s_tlRest );
+		AppendToStream( *pStream, s_tlRest, nCompressLevel, nBlockSize );
+		s_tlRest.clear();
+		FlushCombos( pStream->m_nBytesWritten, static_cast<const uint8_t*>( pStream->m_Block.Base() ), pStream->m_Block.TellPut(), pStream->m_Packed, nCompressLevel, nullptr );
+
+		if ( pStream->m_bIndex && g_bBlockIndex && g_nShards == 1 )
+		{
+			std::sort( pStream->m_Index.begin(), pStream->m_Index.end(), CompareIndexRecords );
+			pStComboRec->SetDynamicIndex( pStream->m_Index );
+		}
+		if ( uint8_t* pCodeBuffer = pStream->m_nBytesWritten ? pStComboRec->AllocPackedCodeBlock( pStream->m_nBytesWritten ) : nullptr )
+		{
+			memcpy( pCodeBuffer, pStream->m_Packed.Base(), pStream->m_nBytesWritten );
+			pStComboRec->HashPackedCode();
+		}
+		pStComboRec->FreeStream();
+		return;
+	}
+
+	size_t nBytesWritten = 0;
+	CUtlBuffer& mbPacked			 = s_tlPacked;
+	CUtlBuffer& ubDynamicComboBuffer = s_tlBlock;
+	mbPacked.Clear();
+	ubDynamicComboBuffer.Clear();
+
+	pStComboRec->SortDynamicCombos();
+	const std::vector<uint8_t>* pDictionary = pPrimeFrom ? &pPrimeFrom->Dictionary( pStComboRec ) : nullptr;
+
+	// Packed from the same dynamic combos last time, the old block is still good. The sidecar only keeps 32-bit ids.
+	if ( g_bReuse && pStComboRec->ComboId() < UINT32_MAX )
+	{
+		pStComboRec->ComputeFingerprint( nCompressLevel, pPrimeFrom ? pPrimeFrom->DictionaryHash() : 0, nBlockSize, pUsage );
+
+		const uint32_t nStaticComboID = gsl::narrow<uint32_t>( pStComboRec->ComboId() );
+		uint64_t nPackedHash;
+		if ( const size_t nSize = pPrevious ? pPrevious->Find( nStaticComboID, pStComboRec->Fingerprint(), nPackedHash ) : 0 )
+		{
+			if ( pPrevious->Read( nStaticComboID, pStComboRec->AllocPackedCodeBlock( nSize ), nSize ) )
+			{
+				pStComboRec->SetPackedHash( nPackedHash );
+				pStComboRec->FreeDynamicCombos();
+				return;
+			}
+			pStComboRec->FreePackedCode();
+		}
+	}
+
+	// The engine looks through every block until it finds the id, so any order reads back
+	static thread_local std::vector<std::pair<uint64_t, const CByteCodeBlock*>> s_tlOrder;
+	s_tlOrder.clear();
+	for ( const CByteCodeBlock& combo : pStComboRec->DynamicCombos() )
+	{
+		const auto it = pUsage ? pUsage->find( gsl::narrow<uint32_t>( combo.m_nComboID ) ) : ComboUsage_t::const_iterator{};
+		s_tlOrder.emplace_back( pUsage && it != pUsage->end() ? it->second : 0, &combo );
+	}
+	if ( pUsage )
+		std::stable_sort( s_tlOrder.begin(), s_tlOrder.end(), []( const auto& a, const auto& b ) { return a.first > b.first; } );
+
+	// Blocks that don't compress are stored as they are, so the packed code never outgrows the combos with their id and
+	// size plus a block header each. Sized for that up front, neither buffer grows while packing.
+	size_t nPackedBound = 0;
+	for ( const CByteCodeBlock& combo : pStComboRec->DynamicCombos() )
+		nPackedBound += 3 * sizeof( uint32_t ) + combo.m_nCodeSize;
+
+	// With threads to spare all blocks are laid out first and packed side by side after, else every one as it fills up
+	const uint32_t nHelpers = g_bParallelBlocks && nPackedBound > 2 * size_t( nBlockSize ) ? ClaimSpareThreads( gsl::narrow_cast<uint32_t>( nPackedBound / nBlockSize ) ) : 0;
+	static thread_local std::vector<size_t> s_tlBlockEnds;
+	s_tlBlockEnds.clear();
+	size_t nBlockStart = 0;
+	const auto& EndBlock = [&]()
+	{
+		if ( nHelpers )
+		{
+			nBlockStart = ubDynamicComboBuffer.TellPut();
+			s_tlBlockEnds.emplace_back( nBlockStart );
+			return;
+		}
+		FlushCombos( nBytesWritten, static_cast<const uint8_t*>( ubDynamicComboBuffer.Base() ), ubDynamicComboBuffer.TellPut(), mbPacked, nCompressLevel, pDictionary );
+		ubDynamicComboBuffer.Clear(); // start over
+	};
+
+	mbPacked.EnsureCapacity( gsl::narrow<int>( nPackedBound ) );
+	ubDynamicComboBuffer.EnsureCapacity( gsl::narrow<int>( nHelpers ? nPackedBound : std::min<size_t>( nPackedBound, nBlockSize + 2 * sizeof( uint32_t ) ) ) );
+
+	// Block number and offset of every combo, known as it goes in
+	static thread_local std::vector<DynamicComboIndexRecord_t> s_tlIndex;
+	s_tlIndex.clear();
+	bool bIndex = g_bBlockIndex && g_nShards == 1;
+	uint32_t nBlock = 0;
+
+	bool bHot = true;
+	for ( const auto& [nUsage, pCombo] : s_tlOrder )
+	{
+		// Unused combos never share a block with used ones
+		if ( bHot && !nUsage )
+		{
+			if ( size_t( ubDynamicComboBuffer.TellPut() ) != nBlockStart )
+			{
+				EndBlock();
+				++nBlock;
+			}
+			bHot = false;
+		}
+
+		// Starts a new block first when the combo would take this one to the block size
+		const uint32_t nCodeSize = gsl::narrow<uint32_t>( pCombo->m_nCodeSize );
+		const size_t nInBlock	 = ubDynamicComboBuffer.TellPut() - nBlockStart;
+		if ( nInBlock && nInBlock + nCodeSize + 16 >= ( nUsage ? std::min( nBlockSize, HOT_BLOCK_SIZE ) : nBlockSize ) )
+		{
+			EndBlock();
+			++nBlock;
+		}
+
+		// identical combos share bytecode in memory, but the format can't alias them, LZMA takes care of the repeats
+		ubDynamicComboBuffer.PutUnsignedInt( gsl::narrow<uint32_t>( pCombo->m_nComboID ) );
+		ubDynamicComboBuffer.PutUnsignedInt( nCodeSize );
+		ubDynamicComboBuffer.Put( pCombo->get(), nCodeSize );
+		bIndex = bIndex && AddIndexRecord( s_tlIndex, gsl::narrow<uint32_t>( pCombo->m_nComboID ), nBlock,
+										   gsl::narrow<uint32_t>( ubDynamicComboBuffer.TellPut() - nBlockStart ) - nCodeSize - 2 * sizeof( uint32_t ) );
+	}
+	if ( size_t( ubDynamicComboBuffer.TellPut() ) != nBlockStart )
+		EndBlock();
+	if ( nHelpers )
+	{
+		FlushCombosParallel( nBytesWritten, static_cast<const uint8_t*>( ubDynamicComboBuffer.Base() ), s_tlBlockEnds, mbPacked, nCompressLevel, pDictionary, nHelpers );
+		ReleaseSpareThreads( nHelpers );
+	}
+
+	// Without one the writer tries again from the packed code and leaves the index out if it can't either
+	if ( bIndex )
+	{
+		std::sort( s_tlIndex.begin(), s_tlIndex.end(), CompareIndexRecords );
+		pStComboRec->SetDynamicIndex( s_tlIndex );
+	}
+
+	pStComboRec->FreeDynamicCombos();
+
+	// The static combo keeps exactly what it packed to, the scratch is sized for the worst case
+	if ( uint8_t* pCodeBuffer = nBytesWritten ? pStComboRec->AllocPackedCodeBlock( nBytesWritten ) : nullptr )
+	{
+		memcpy( pCodeBuffer, mbPacked.Base(), nBytesWritten );
+		pStComboRec->HashPackedCode();
+	}
+	if ( mbPacked.Size() > KEEP_PACKED_SCRATCH )
+		mbPacked.Purge();
+	if ( ubDynamicComboBuffer.Size() > KEEP_PACKED_SCRATCH )
+		ubDynamicComboBuffer.Purge();
+}
+
+// -status-port: what the progress line shows as json, and every shader on its own. Called with g_mtxGlobal held.
+static void PublishStatus( std::string_view state, uint64_t nRate, int64_t nEstimate )
+{
+	std::ostringstream json;
+	json << "{\"state\":\""sv << state << "\",\"elapsed_seconds\":"sv << duration_cast<chrono::seconds>( Clock::now() - g_flStartTime ).count() << ",\"combos_total\":"sv << g_nCombosTotal.load()
+		 << ",\"combos_done\":"sv << g_nCombosDone.load() << ",\"combos_failed\":"sv << g_nCombosFailed.load() << ",\"combos_cancelled\":"sv << g_nCombosCancelled.load() << ",\"combos_per_second\":"sv << nRate << ",\"eta_seconds\":"sv << nEstimate
+		 << ",\"shaders_failed\":"sv << g_ShaderHadError.size() << ",\"peak_memory_bytes\":"sv << Platform::PeakMemory() << ",\"shaders\":["sv;
+	bool bFirst = true;
+	for ( const auto& [name, stats] : g_ShaderStats )
+	{
+		// Shader names are file names, nothing in them needs escaping but these
+		json << ( bFirst ? "{\"name\":\""sv : ",{\"name\":\""sv );
+		for ( const char c : name )
+		{
+			if ( c == '"' || c == '\\' )
+				json << '\\';
+			json << c;
+		}
+		json << "\",\"done\":"sv << stats.m_nCompiled + stats.m_nFailed + stats.m_nCancelled << ",\"total\":"sv << stats.m_nSurviving << ",\"failed\":"sv << stats.m_nFailed
+			 << ",\"cancelled\":"sv << stats.m_nCancelled << "}"sv;
+		bFirst = false;
+	}
+	json << "]}"sv;
+	Status::Publish( json.str() );
+}
+
+// Progress indication, called with g_mtxGlobal held whenever static combos of pEntry are packaged
+static void ReportPackagingProgress( const CfgProcessor::CfgEntryInfo* pEntry )
+{
+	// Time to limit amount of prints
+	static Clock::time_point s_fLastInfoTime;
+	static uint64_t s_nLastDone = 0;
+	static CUtlMovingAverage<uint64_t, 60> s_averageProcess;
+	const Clock::time_point fCurTime = Clock::now();
+
+	if ( duration_cast<chrono::seconds>( fCurTime - s_fLastInfoTime ).count() != 0 )
+	{
+		// Static combos finish in any order, so count what is left of the shader by what was compiled
+		const ShaderStats_t& stats   = ShaderStats( pEntry->m_szName );
+		const uint64_t nComboOfEntry = pEntry->m_numSurvivingCombos - std::min( pEntry->m_numSurvivingCombos, stats.m_nCompiled + stats.m_nFailed + stats.m_nCancelled );
+
+		// The rate shown follows the last minute, the estimate uses the whole run so it doesn't swing around
+		const uint64_t nDone = g_nCombosDone;
+		s_averageProcess.PushValue( nDone - s_nLastDone );
+		s_nLastDone = nDone;
+		const auto avg = s_averageProcess.GetAverage();
+
+		const int64_t nCompileSeconds = std::max<int64_t>( duration_cast<chrono::seconds>( fCurTime - g_flCompileStartTime ).count(), 1 );
+		const uint64_t nTotal         = g_nCombosTotal;
+		const uint64_t nRemaining     = nTotal - std::min( nDone, nTotal );
+		const int64_t nEstimate       = nDone ? static_cast<int64_t>( nRemaining * nCompileSeconds / nDone ) : 0;
+		ConsoleLog::CLine( true ) << "\r"sv << clr::escaped( lineRewind ) << "Compiling "sv << ( g_ShaderHadError.contains( pEntry->m_szName ) ? clr::red : clr::green ) << pEntry->m_szName << clr::reset << " ["sv << clr::blue << PrettyPrint( nComboOfEntry ) << clr::reset << " remaining, "sv
+			<< clr::blue << PrettyPrint( nRemaining ) << clr::reset << " total] "sv << FormatTimeShort( duration_cast<chrono::seconds>( fCurTime - g_flStartTime ).count() ) << " elapsed ("sv << clr::green2 << avg << clr::reset << " c/s, est. remaining "sv
+			<< FormatTimeShort( nEstimate ) << ")"sv << endLine;
+		if ( Status::Enabled() )
+			PublishStatus( "compiling"sv, avg, nEstimate );
+		s_fLastInfoTime = fCurTime;
+	}
+}
+
+// Expected compile time of every span, from the static combo times of the last run. Span i covers
+// [arrSpanBegin[i], arrSpanBegin[i + 1]). Shaders that weren't timed cost the average per command.
+// Empty if nothing was timed at all.
+static std::vector<double> EstimateSpanCosts( const std::vector<uint64_t>& arrSpanBegin )
+{
+	const uint64_t iFirstCommand = arrSpanBegin.front();
+	const uint64_t iEndCommand   = arrSpanBegin.back();
+
+	std::vector<double> arrCost( arrSpanBegin.size() - 1, 0.0 );
+	const auto& AddCost = [&]( uint64_t iBegin, uint64_t iEnd, double flCostPerCommand )
+	{
+		iBegin = std::max( iBegin, iFirstCommand );
+		iEnd   = std::min( iEnd, iEndCommand );
+		for ( size_t iSpan = std::upper_bound( arrSpanBegin.cbegin(), arrSpanBegin.cend() - 1, iBegin ) - arrSpanBegin.cbegin() - 1; iBegin < iEnd; ++iSpan )
+		{
+			const uint64_t iSpanEnd = std::min( arrSpanBegin[iSpan + 1], iEnd );
+			arrCost[iSpan] += static_cast<double>( iSpanEnd - iBegin ) * flCostPerCommand;
+			iBegin = iSpanEnd;
+		}
+	};
+
+	double flKnownCost = 0.0, flKnownCommands = 0.0;
+	std::vector<std::pair<uint64_t, uint64_t>> arrUnknown;
+	for ( uint64_t iCommand = iFirstCommand; iCommand < iEndCommand; )
+	{
+		const CfgProcessor::CfgEntryInfo* pEntry = CfgProcessor::Combo_FindEntryInfo( iCommand );
+		if ( !pEntry )
+			break;
+
+		// Static combo s covers the commands [end - ( s + 1 ) * dynamic combos, end - s * dynamic combos)
+		if ( const std::vector<ComboStats::StaticComboTime_t>* pTimes = ComboStats::Find( pEntry->m_szName, pEntry->m_numStaticCombos ) )
+		{
+			const uint64_t nDynamic = pEntry->m_numDynamicCombos;
+			const uint64_t sFirst   = ( pEntry->m_iCommandEnd - std::max( iCommand, pEntry->m_iCommandStart ) - 1 ) / nDynamic;
+			const uint64_t sLast    = ( pEntry->m_iCommandEnd - std::min( iEndCommand, pEntry->m_iCommandEnd ) ) / nDynamic;
+			for ( auto it = std::partition_point( pTimes->cbegin(), pTimes->cend(), [sLast]( const ComboStats::StaticComboTime_t& time ) { return time.m_nStaticCombo < sLast; } );
+				  it != pTimes->cend() && it->m_nStaticCombo <= sFirst; ++it )
+			{
+				const uint64_t s	 = it->m_nStaticCombo;
+				const double flCost = it->m_nMicroseconds;
+				AddCost( pEntry->m_iCommandEnd - ( s + 1 ) * nDynamic, pEntry->m_iCommandEnd - s * nDynamic, flCost / static_cast<double>( nDynamic ) );
+				flKnownCost += flCost;
+			}
+			flKnownCommands += static_cast<double>( ( sFirst - sLast + 1 ) * nDynamic );
+		}
+		else
+			arrUnknown.emplace_back( iCommand, pEntry->m_iCommandEnd );
+
+		iCommand = pEntry->m_iCommandEnd;
+	}
+
+	if ( flKnownCommands <= 0.0 )
+		return {};
+
+	for ( const auto& [iBegin, iEnd] : arrUnknown )
+		AddCost( iBegin, iEnd, flKnownCost / flKnownCommands );
+	return arrCost;
+}
+
+// With -background, workers beyond the processors the rest of the system leaves alone wait between
+// their claims. Once memory runs low it keeps halving them, so pages aren't pushed out to disk.
+class CWorkerThrottle
+{
+public:
+	static constexpr uint32_t MAX_MEMORY_LOAD = 90; // Percent of physical memory in use
+
+	// Returns once worker iWorker may claim more commands, or when fnDone says there is no point waiting
+	template <typename Fn>
+	void Wait( uint32_t iWorker, uint32_t nWorkers, Fn&& fnDone )
+	{
+		for ( ;; )
+		{
+			Update( nWorkers );
+			if ( iWorker < m_nAllowed.load( std::memory_order_relaxed ) || fnDone() )
+				return;
+			std::this_thread::sleep_for( chrono::milliseconds( 100 ) );
+		}
+	}
+
+private:
+	// Whoever gets here first after the interval samples the system, the others go on with the last verdict
+	void Update( uint32_t nWorkers )
+	{
+		std::unique_lock guard{ m_mtx, std::try_to_lock };
+		const Clock::time_point tNow = Clock::now();
+		if ( !guard || tNow < m_tNext )
+			return;
+		m_tNext = tNow + chrono::seconds( 1 );
+
+		Platform::CpuTimes_t times;
+		if ( !Platform::GetCpuTimes( times ) )
+			return;
+
+		// The children of -processes are ours too
+		const uint64_t nTotal = times.m_nTotal;
+		const uint64_t nBusy  = nTotal - times.m_nIdle;
+		const uint64_t nOwn   = times.m_nOwn + WorkerProcess::CpuTime();
+		const uint64_t nDeltaTotal = nTotal - m_nLastTotal, nDeltaBusy = nBusy - m_nLastBusy, nDeltaOwn = nOwn - m_nLastOwn;
+		const bool bFirst = !m_nLastTotal;
+		m_nLastTotal = nTotal;
+		m_nLastBusy  = nBusy;
+		m_nLastOwn   = nOwn;
+		if ( bFirst || !nDeltaTotal )
+			return;
+
+		const uint32_t nProcessors = Platform::NumLogicalProcessors();
+		const double flOthers      = static_cast<double>( nDeltaBusy - std::min( nDeltaBusy, nDeltaOwn ) ) / static_cast<double>( nDeltaTotal ) * nProcessors;
+		uint32_t nAllowed          = std::clamp<uint32_t>( nProcessors - std::min<uint32_t>( nProcessors, static_cast<uint32_t>( std::ceil( flOthers ) ) ), 1, nWorkers );
+
+		if ( Platform::MemoryLoad() >= MAX_MEMORY_LOAD )
+			nAllowed = std::max( 1U, std::min( nAllowed, m_nAllowed.load( std::memory_order_relaxed ) / 2 ) );
+
+		m_nAllowed.store( nAllowed, std::memory_order_relaxed );
+	}
+
+	std::atomic<uint32_t> m_nAllowed = ~0U;
+	std::mutex m_mtx;
+	Clock::time_point m_tNext;
+	uint64_t m_nLastTotal = 0;
+	uint64_t m_nLastBusy  = 0;
+	uint64_t m_nLastOwn   = 0;
+};
+static CWorkerThrottle s_WorkerThrottle;
+
+// Child process the calling worker thread hands its compiles to, -1 if it compiles them itself
+static thread_local int s_tliWorkerProcess = -1;
+
+static Compiler::Strip StripOf( std::string_view shader )
+{
+	for ( auto it = g_arrStrip.crbegin(); it != g_arrStrip.crend(); ++it )
+	{
+		if ( it->first == "*"sv || it->first == shader )
+			return it->second;
+	}
+	return Compiler::Strip::None;
+}
+
+static uint32_t BlockSizeOf( std::string_view shader )
+{
+	for ( auto it = g_arrBlockSize.crbegin(); it != g_arrBlockSize.crend(); ++it )
+	{
+		if ( it->first == "*"sv || it->first == shader )
+			return it->second;
+	}
+	return MAX_SHADER_UNPACKED_BLOCK_SIZE;
+}
+
+static const ComboUsage_t* UsageOf( std::string_view shader )
+{
+	const auto it = g_ComboUsage.find( std::string( shader ) );
+	return it != g_ComboUsage.end() ? &it->second : nullptr;
+}
+
+// -priority: false if the shader has none. Otherwise arrStaticCombos are the static combos that go first, all of them if it is empty.
+static bool PriorityOf( std::string_view shader, std::vector<uint64_t>& arrStaticCombos )
+{
+	arrStaticCombos.clear();
+	std::vector<uint64_t> arrMatching;
+	for ( const auto& [name, expression] : g_arrPriority )
+	{
+		if ( name != "*"sv && name != shader )
+			continue;
+		if ( expression.empty() )
+		{
+			arrStaticCombos.clear();
+			return true;
+		}
+
+		// Expressions for every shader may read defines only some of them have
+		if ( !CfgProcessor::FindStaticCombos( shader, expression, arrMatching ) )
+		{
+			if ( name != "*"sv )
+				ConsoleLog::CLine() << clr::yellow << "-priority: "sv << expression << " doesn't parse on the static combos of "sv << shader << clr::reset << std::endl;
+			continue;
+		}
+		arrStaticCombos.insert( arrStaticCombos.end(), arrMatching.begin(), arrMatching.end() );
+	}
+
+	std::sort( arrStaticCombos.begin(), arrStaticCombos.end() );
+	arrStaticCombos.erase( std::unique( arrStaticCombos.begin(), arrStaticCombos.end() ), arrStaticCombos.end() );
+	return !arrStaticCombos.empty();
+}
+
+template <typename TMutexType>
+class CWorkerAccumState
+{
+public:
+	explicit CWorkerAccumState( uint32_t iFlags ) noexcept
+		: m_iFirstCommand( 0 ), m_iNextCommand( 0 ), m_iEndCommand( 0 ), m_nShaders( 0 ), m_nShadersReturned( 0 ), m_hCombo( nullptr ), m_iFlags( iFlags )
+		, m_nWorkers( 0 ), m_nSpans( 0 ), m_iGeneration( 0 ), m_bShutdown( false ) {}
+
+	~CWorkerAccumState() { StopThreads(); }
+
+	// Posts the commands of every shader in pEntries, up to the entry without a name
+	void RangeBegin( const CfgProcessor::CfgEntryInfo* pEntries );
+	void RangeFinished();
+
+	void ExecuteCompileCommand( CfgProcessor::ComboHandle hCombo );
+	// Returns true if the code is the same as a combo of the shader before it
+	bool HandleCommandResponse( CfgProcessor::ComboHandle hCombo, CmdSink::IResponse* pResponse );
+
+	// Spawns the worker pool, workers live until the state is destroyed
+	// and pick up every range posted with RangeBegin.
+	void StartThreads( uint32_t i )
+	{
+		m_nWorkers   = i;
+		m_arrWorkers = std::make_unique<Worker[]>( i );
+		m_arrThreads.reserve( i );
+		for ( uint32_t iWorker = 0; iWorker < i; ++iWorker )
+			m_arrThreads.emplace_back( DoExecute, this, &m_arrWorkers[iWorker] );
+	}
+
+	void StopThreads()
+	{
+		{
+			std::lock_guard guard{ m_mtxPool };
+			m_bShutdown = true;
+		}
+		m_cvPool.notify_all();
+
+		std::for_each( m_arrThreads.begin(), m_arrThreads.end(), []( std::thread& t ) { if ( t.joinable() ) t.join(); } );
+		m_arrThreads.clear();
+	}
+
+	// Returns the next shader that is compiled and packaged completely. Worker threads finish
+	// shaders in whatever order they get to them, single-threaded mode compiles the next one
+	// in order right here. nullptr once all of them were returned or Stop cut the range short.
+	const CfgProcessor::CfgEntryInfo* NextPackagedShader();
+
+	void OnProcessST( uint64_t iCommandEnd );
+
+	// Busy and idle time of every worker during the last range and the most shaders that waited to be written
+	void PrintStats() const;
+
+	void Stop() noexcept
+	{
+		m_bBreak.store( true, std::memory_order_release );
+	}
+
+private:
+	// Number of commands a worker claims from a span at once
+	static constexpr uint64_t CLAIM_SIZE = 16;
+
+	// Scheduling state of one worker thread. The command range is cut into spans
+	// and worker i owns spans i, i + N, i + 2N... of m_arrSpanOrder, so that all workers
+	// move through the range together. A worker that runs out of its own spans steals
+	// from the current span of the others.
+	struct alignas( 64 ) Worker
+	{
+		std::atomic<uint64_t> m_iPos;				// Current position of this worker's list in m_arrSpanOrder
+		std::atomic<uint64_t> m_nBusyNanoseconds;	// Spent on its claims, only this worker adds to it
+	};
+
+	// Packaging state of one shader. Every static combo counts down the commands it still
+	// waits for, whoever finishes the last one packs it right away, in whatever order they complete.
+	struct ShaderRange_t
+	{
+		const CfgProcessor::CfgEntryInfo* m_pEntry;
+		CStaticComboCountdown m_Remaining;							// Unfinished surviving commands of the static combos in progress
+		std::atomic<uint64_t> m_nUnpacked;							// Static combos with surviving commands that aren't packed yet
+		CStaticComboTable* m_pStaticCombos;							// Also in g_ShaderByteCode until the shader is written
+		Compiler::Strip m_eStrip;
+		uint32_t m_nBlockSize;										// Unpacked size blocks get flushed at
+		const ComboUsage_t* m_pUsage;								// nullptr packs the dynamic combos in id order
+		bool m_bStreamPack;											// -stream-pack, not with an order or a dictionary that needs all of them
+		CByteCodeInternTable* m_pByteCodeIntern;					// Same for g_ShaderByteCodeIntern
+		FailPredict::CShaderModel* m_pFailures;						// nullptr without -predict-failures
+		std::atomic<bool> m_bFailed;								// A combo failed, with -fastfail the rest of it is dropped
+		bool m_bPriority;											// -priority, the static combos of m_arrPriority or all of them if it is empty
+		std::vector<uint64_t> m_arrPriority;						// Ascending
+		std::atomic<uint64_t> m_nPriorityLeft;						// Of m_arrPriority, not packed yet
+		std::vector<uint64_t> m_arrAliased;							// -dedup-static, ascending, none of their combos are compiled
+		std::vector<uint64_t> m_arrResumed;							// -resume, ascending, read from the journal and never compiled
+		ResumeJournal::CJournal* m_pJournal;						// -resume, gets every static combo that is packed
+		std::mutex m_mtxDonor;										// -dictionary, until the donor is known
+		bool m_bDonorKnown;
+		uint64_t m_nDonorScan;										// Static combos above it with surviving commands finished without code, UINT64_MAX if none is left
+		robin_hood::unordered_flat_map<uint64_t, uint8_t> m_Finished; // 1 once a static combo is finished, 2 if it has code
+		std::vector<CStaticCombo*> m_arrHeld;						// Finished with code before the donor was known
+		std::mutex m_mtxPreview;
+		std::vector<uint64_t> m_arrPacked;							// -preview, static combos packed so far
+		Clock::time_point m_tNextPreview;
+	};
+
+	// -fastfail cancels a shader at its first error, the other shaders go on
+	[[nodiscard]] static bool Cancelled( const ShaderRange_t& shader ) noexcept
+	{
+		return g_bFastFail && shader.m_bFailed.load( std::memory_order_acquire );
+	}
+
+	// Static combo s covers the commands [end - ( s + 1 ) * dynamic combos, end - s * dynamic combos)
+	[[nodiscard]] static uint64_t SurvivingOf( const ShaderRange_t& shader, uint64_t s )
+	{
+		const uint64_t iStaticEnd = shader.m_pEntry->m_iCommandEnd - s * shader.m_pEntry->m_numDynamicCombos;
+		return CfgProcessor::Combo_CountSurviving( iStaticEnd - shader.m_pEntry->m_numDynamicCombos, iStaticEnd );
+	}
+
+	// Highest static combo below s with a surviving command, UINT64_MAX if there is none
+	[[nodiscard]] static uint64_t LiveStaticBelow( const ShaderRange_t& shader, uint64_t s ) noexcept
+	{
+		const CfgProcessor::CfgEntryInfo* pEntry = shader.m_pEntry;
+		const uint64_t iCommand = CfgProcessor::Combo_NextSurviving( pEntry->m_iCommandEnd - s * pEntry->m_numDynamicCombos, pEntry->m_iCommandEnd );
+		return iCommand < pEntry->m_iCommandEnd ? ( pEntry->m_iCommandEnd - 1 - iCommand ) / pEntry->m_numDynamicCombos : UINT64_MAX;
+	}
+
+	std::atomic<bool>			m_bBreak;
+	std::atomic<int>			m_nActive;
+	std::atomic<uint32_t>		m_nProgress;	// Bumped whenever a shader is packaged or m_nActive changes
+
+	void SignalProgress()
+	{
+		++m_nProgress;
+		m_nProgress.notify_all();
+	}
+
+	static void DoExecute( CWorkerAccumState* pThis, Worker* pWorker )
+	{
+		const uint32_t iWorker = gsl::narrow_cast<uint32_t>( pWorker - pThis->m_arrWorkers.get() );
+		s_tliWorkerProcess     = iWorker < WorkerProcess::Count() ? static_cast<int>( iWorker ) : -1;
+		Platform::AssignThreadToNode( iWorker, pThis->m_nWorkers );
+		if ( g_bBackground )
+			Platform::SetThreadBackground();
+
+		for ( uint64_t iGeneration = 0; pThis->WaitForRange( iGeneration ); )
+		{
+			while ( pThis->OnProcess( *pWorker ) )
+				continue;
+
+			++g_nSpareThreads;
+			--pThis->m_nActive;
+			pThis->SignalProgress();
+		}
+	}
+
+	bool WaitForRange( uint64_t& riGeneration )
+	{
+		std::unique_lock guard{ m_mtxPool };
+		m_cvPool.wait( guard, [this, riGeneration] { return m_bShutdown || m_iGeneration != riGeneration; } );
+		riGeneration = m_iGeneration;
+		return !m_bShutdown;
+	}
+
+	uint64_t				m_iFirstCommand;
+	uint64_t				m_iNextCommand;
+	uint64_t				m_iEndCommand;
+
+	std::unique_ptr<ShaderRange_t[]>	m_arrShaders;	// In command order
+	size_t								m_nShaders;
+	Threading::CCountedMutex<TMutexType, Threading::g_lsPackaged>	m_mtxPackaged;
+	std::vector<const ShaderRange_t*>	m_arrPackaged;	// In the order they were packaged
+	size_t								m_nShadersReturned;
+	size_t								m_nMaxBacklog = 0;	// Most shaders packaged but not returned yet
+	Clock::time_point					m_tRangeBegin;
+	Clock::time_point					m_tRangeEnd;
+
+	CfgProcessor::ComboHandle m_hCombo;
+
+	const uint32_t			m_iFlags;
+
+	uint32_t								m_nWorkers;
+	uint64_t								m_nSpans;
+	std::unique_ptr<Worker[]>				m_arrWorkers;
+	std::unique_ptr<std::atomic<uint64_t>[]>	m_arrSpanCursor;
+	std::vector<uint64_t>					m_arrSpanBegin;	// First command of every span, and the end of the range
+	std::vector<uint64_t>					m_arrSpanClaim;	// Commands claimed from every span at once
+	std::vector<uint64_t>					m_arrSpanOrder;	// Spans in the order they are handed out
+	std::vector<uint8_t>					m_arrSpanPriority;	// Spans of -priority static combos
+
+	std::vector<std::thread>	m_arrThreads;
+	std::mutex					m_mtxPool;
+	std::condition_variable		m_cvPool;
+	uint64_t					m_iGeneration;
+	bool						m_bShutdown;
+
+	[[nodiscard]] uint64_t SpanEnd( uint64_t iSpan ) const noexcept
+	{
+		return m_arrSpanBegin[iSpan + 1];
+	}
+
+	[[nodiscard]] ShaderRange_t& ShaderOf( uint64_t iCommand ) noexcept
+	{
+		return *( std::upper_bound( m_arrShaders.get(), m_arrShaders.get() + m_nShaders, iCommand, []( uint64_t i, const ShaderRange_t& shader ) noexcept { return i < shader.m_pEntry->m_iCommandStart; } ) - 1 );
+	}
+
+	void SplitRange();
+	bool ClaimCommands( Worker& self, uint64_t& riBegin, uint64_t& riEnd, uint64_t& riSpanEnd ) noexcept;
+
+	// Nothing left to wait for, the build stops or every span is claimed
+	[[nodiscard]] bool Drained() const noexcept
+	{
+		if ( m_bBreak.load( std::memory_order_acquire ) )
+			return true;
+		for ( uint64_t iSpan = 0; iSpan < m_nSpans; ++iSpan )
+		{
+			if ( m_arrSpanCursor[iSpan].load( std::memory_order_relaxed ) < SpanEnd( iSpan ) )
+				return false;
+		}
+		return true;
+	}
+
+	// With -background, waits while the system can't spare this worker, with -auto-threads while it isn't one of the
+	// active ones. Paused workers give up once every span is claimed, so that they don't hold up the end of the range,
+	// and the end of a range isn't measured. Over -max-memory only the first worker goes on, it finishes static combos
+	// so that they get packed, the others give up their empty chunk and stop waiting once every span is claimed.
+	bool WaitForTurn( Worker& self )
+	{
+		const uint32_t iWorker = gsl::narrow_cast<uint32_t>( &self - m_arrWorkers.get() );
+		if ( iWorker && MemoryBudget::OverLimit() )
+		{
+			s_tlByteCodeArena.Trim();
+			MemoryBudget::WaitBelowLimit( [this] { return Drained(); } );
+		}
+		if ( g_bBackground )
+			s_WorkerThrottle.Wait( iWorker, m_nWorkers, [this] { return Drained(); } );
+		for ( ; ThreadTuner::Enabled() && !Drained(); std::this_thread::sleep_for( chrono::milliseconds( 100 ) ) )
+		{
+			ThreadTuner::Update( g_nCombosDone );
+			if ( ThreadTuner::MayRun( iWorker ) )
+				break;
+		}
+		return !m_bBreak.load( std::memory_order_acquire );
+	}
+
+	bool OnProcess( Worker& self );
+	void DropCommands( ShaderRange_t& shader, uint64_t iBegin, uint64_t iEnd );
+	void FinishCommands( uint64_t iBegin, uint64_t iEnd );
+	void PackStaticCombos( ShaderRange_t& shader, const std::vector<uint64_t>& arrStaticCombos );
+	static void HoldForDonor( ShaderRange_t& shader, std::vector<CStaticCombo*>& arrPack, std::vector<uint64_t>& arrFinished );
+};
+
+template <typename TMutexType>
+void CWorkerAccumState<TMutexType>::RangeBegin( const CfgProcessor::CfgEntryInfo* pEntries )
+{
+	m_nShaders = 0;
+	while ( pEntries && !pEntries[m_nShaders].m_szName.empty() )
+		++m_nShaders;
+
+	m_arrShaders = std::make_unique<ShaderRange_t[]>( m_nShaders );
+	for ( size_t i = 0; i < m_nShaders; ++i )
+	{
+		ShaderRange_t& shader = m_arrShaders[i];
+		shader.m_pEntry       = &pEntries[i];
+		shader.m_Remaining.Clear();
+		shader.m_nUnpacked.store( CfgProcessor::Combo_CountStaticSurviving( pEntries[i] ) );
+		shader.m_eStrip = StripOf( pEntries[i].m_szName );
+		shader.m_nBlockSize = BlockSizeOf( pEntries[i].m_szName );
+		shader.m_pUsage		= UsageOf( pEntries[i].m_szName );
+		shader.m_bStreamPack = g_bStreamPack && !shader.m_pUsage && !g_bReuse && !g_bDictionary;
+		shader.m_pFailures	= FailPredict::Begin( pEntries[i].m_szName );
+		shader.m_bFailed.store( false, std::memory_order_relaxed );
+		shader.m_bPriority = PriorityOf( pEntries[i].m_szName, shader.m_arrPriority );
+		std::erase_if( shader.m_arrPriority, [&shader]( uint64_t s ) { return !SurvivingOf( shader, s ); } );
+		shader.m_nPriorityLeft.store( shader.m_arrPriority.size(), std::memory_order_relaxed );
+		shader.m_tNextPreview = Clock::now() + chrono::seconds( g_nPreviewSeconds );
+		shader.m_bDonorKnown  = !g_bDictionary;
+		shader.m_nDonorScan	  = LiveStaticBelow( shader, pEntries[i].m_numStaticCombos );
+		shader.m_Finished.clear();
+		shader.m_arrHeld.clear();
+
+		// Workers find them through the shader range, not through the maps
+		std::lock_guard guard{ Threading::g_mtxGlobal };
+		CStaticComboTable*& rpStaticCombos = g_ShaderByteCode[pEntries[i].m_szName];
+		if ( !rpStaticCombos )
+			rpStaticCombos = new CStaticComboTable( pEntries[i].m_numStaticCombos );
+		shader.m_pStaticCombos	 = rpStaticCombos;
+		shader.m_pByteCodeIntern = &g_ShaderByteCodeIntern[pEntries[i].m_szName];
+		shader.m_arrAliased.clear();
+		if ( const auto it = g_ShaderStaticAliases.find( pEntries[i].m_szName ); it != g_ShaderStaticAliases.end() )
+		{
+			for ( const StaticComboAliasRecordWide_t& alias : it->second )
+				shader.m_arrAliased.emplace_back( alias.m_nStaticComboID );
+		}
+		shader.m_arrResumed.clear();
+		if ( const auto it = g_ShaderResumed.find( pEntries[i].m_szName ); it != g_ShaderResumed.end() )
+			shader.m_arrResumed = it->second;
+		const auto itJournal = g_ShaderJournal.find( pEntries[i].m_szName );
+		shader.m_pJournal	 = itJournal != g_ShaderJournal.end() ? itJournal->second : nullptr;
+	}
+	m_arrPackaged.clear();
+	// Shaders without a surviving combo have nothing to wait for
+	for ( size_t i = 0; i < m_nShaders; ++i )
+	{
+		if ( !m_arrShaders[i].m_nUnpacked.load( std::memory_order_relaxed ) )
+			m_arrPackaged.emplace_back( &m_arrShaders[i] );
+	}
+	m_nShadersReturned = 0;
+	m_nMaxBacklog      = 0;
+	m_tRangeBegin      = Clock::now();
+
+	m_iFirstCommand = m_nShaders ? pEntries[0].m_iCommandStart : 0;
+	m_iNextCommand  = m_iFirstCommand;
+	m_iEndCommand   = m_nShaders ? pEntries[m_nShaders - 1].m_iCommandEnd : 0;
+	m_hCombo        = nullptr;
+
+	if constexpr ( std::is_same_v<TMutexType, Threading::null_mutex> )
+	{
+		// Whatever is skipped before the first combo is done already
+		CfgProcessor::Combo_GetNext( m_iNextCommand, m_hCombo, m_iEndCommand );
+		FinishCommands( m_iFirstCommand, m_iNextCommand );
+	}
+	else
+	{
+		// Worker threads seek their own combo handles, wake them up
+		SplitRange();
+		{
+			std::lock_guard guard{ m_mtxPool };
+			m_nActive = m_nWorkers;
+			g_nSpareThreads = 0;
+			++m_iGeneration;
+		}
+		m_cvPool.notify_all();
+	}
+}
+
+template <typename TMutexType>
+void CWorkerAccumState<TMutexType>::RangeFinished()
+{
+	// Workers may still be on their way out after Stop
+	if constexpr ( !std::is_same_v<TMutexType, Threading::null_mutex> )
+	{
+		for ( uint32_t nProgress = m_nProgress.load(); m_nActive.load(); nProgress = m_nProgress.load() )
+			m_nProgress.wait( nProgress );
+	}
+	m_tRangeEnd = Clock::now();
+}
+
+template <typename TMutexType>
+void CWorkerAccumState<TMutexType>::PrintStats() const
+{
+	// Whatever a worker didn't spend on its claims it waited, for a claim, its turn with -background or the last workers
+	if constexpr ( !std::is_same_v<TMutexType, Threading::null_mutex> )
+	{
+		const uint64_t nRange = duration_cast<chrono::nanoseconds>( m_tRangeEnd - m_tRangeBegin ).count();
+		for ( uint32_t iWorker = 0; iWorker < m_nWorkers; ++iWorker )
+		{
+			const uint64_t nBusy = std::min( nRange, m_arrWorkers[iWorker].m_nBusyNanoseconds.load( std::memory_order_relaxed ) );
+			std::cout << "Worker "sv << iWorker << ": "sv << clr::green << PrettyPrint( nBusy / 1'000'000 ) << clr::reset << " ms busy, "sv
+					  << clr::green << PrettyPrint( ( nRange - nBusy ) / 1'000'000 ) << clr::reset << " ms idle"sv << std::endl;
+		}
+	}
+	std::cout << "Most shaders waiting to be written: "sv << clr::green << m_nMaxBacklog << clr::reset << std::endl;
+}
+
+template <typename TMutexType>
+const CfgProcessor::CfgEntryInfo* CWorkerAccumState<TMutexType>::NextPackagedShader()
+{
+	if constexpr ( std::is_same_v<TMutexType, Threading::null_mutex> )
+	{
+		// Compile up to the end of the current shader, skipped ones after it may be done along the way
+		while ( m_nShadersReturned == m_arrPackaged.size() )
+		{
+			if ( m_nShadersReturned == m_nShaders || m_bBreak.load( std::memory_order_acquire ) )
+				return nullptr;
+			OnProcessST( ShaderOf( m_iNextCommand ).m_pEntry->m_iCommandEnd );
+		}
+
+		return m_arrPackaged[m_nShadersReturned++]->m_pEntry;
 	}
+	else
+	{
+		for ( ;; )
+		{
+			// Read the progress counter first, so that a signal between the checks and the wait is not lost.
+			// Workers publish their shaders before they retire, so nothing is missed once none are active.
+			const uint32_t nProgress = m_nProgress.load();
+			const bool bActive       = m_nActive.load() != 0;
+			{
+				std::lock_guard guard{ m_mtxPackaged };
+				if ( m_nShadersReturned < m_arrPackaged.size() )
+					return m_arrPackaged[m_nShadersReturned++]->m_pEntry;
+			}
 
-	size_t nBytesWritten = 0;
+			if ( !bActive || m_nShadersReturned == m_nShaders )
+				return nullptr;
+			m_nProgress.wait( nProgress );
+		}
+	}
+}
 
-	if ( pStComboRec && !pStComboRec->DynamicCombos().empty() )
+template <typename TMutexType>
+void CWorkerAccumState<TMutexType>::SplitRange()
+{
+	// Aim for a few dozen spans per worker, so that stealing rarely has to happen.
+	// Spans don't cross shaders, so a claim never holds back two shaders at once.
+	const uint64_t nSpanSize = std::clamp<uint64_t>( ( m_iEndCommand - m_iFirstCommand ) / ( m_nWorkers * 64ULL ), CLAIM_SIZE, 1ULL << 20 );
+	m_arrSpanBegin.clear();
+	m_arrSpanClaim.clear();
+	m_arrSpanPriority.clear();
+	for ( size_t i = 0; i < m_nShaders; ++i )
 	{
-		CUtlBuffer ubDynamicComboBuffer;
+		// With -static-claims every claim is one whole static combo, which starts at a multiple
+		// of the dynamic combos from the start of the shader, so its spans are cut on those too
+		const ShaderRange_t& shader				 = m_arrShaders[i];
+		const CfgProcessor::CfgEntryInfo* pEntry = shader.m_pEntry;
+		const uint64_t nDynamic   = pEntry->m_numDynamicCombos;
+		const uint64_t nClaim     = g_bStaticClaims ? nDynamic : CLAIM_SIZE;
+		const uint64_t nShaderSpan = g_bStaticClaims ? ( nSpanSize + nDynamic - 1 ) / nDynamic * nDynamic : nSpanSize;
+		const auto& AddSpans = [&]( uint64_t iBegin, uint64_t iEnd, bool bPriority )
+		{
+			for ( uint64_t iCommand = iBegin; iCommand < iEnd; iCommand += nShaderSpan )
+			{
+				m_arrSpanBegin.emplace_back( iCommand );
+				m_arrSpanClaim.emplace_back( nClaim );
+				m_arrSpanPriority.emplace_back( bPriority );
+			}
+		};
 
-		pStComboRec->SortDynamicCombos();
-		// iterate over all dynamic combos.
-		for ( const auto& combo : pStComboRec->DynamicCombos() )
+		// -priority static combos get spans of their own, static combo s covers the commands [end - ( s + 1 ) * dynamic combos, end - s * dynamic combos)
+		uint64_t iCommand = pEntry->m_iCommandStart;
+		for ( auto it = shader.m_arrPriority.crbegin(); it != shader.m_arrPriority.crend(); )
 		{
-			CByteCodeBlock* pCode = combo.get();
-			// check if we have already output an identical combo
-			OutputDynamicCombo( nBytesWritten, ubDynamicComboBuffer, pBuf, pCode->m_nComboID,
-								gsl::narrow<uint32_t>( pCode->m_nCodeSize ), pCode->get() );
+			const uint64_t iBegin = pEntry->m_iCommandEnd - ( *it + 1 ) * nDynamic;
+			uint64_t s			  = *it;
+			while ( ++it != shader.m_arrPriority.crend() && *it == s - 1 )
+				s = *it;
+			AddSpans( iCommand, iBegin, false );
+			iCommand = pEntry->m_iCommandEnd - s * nDynamic;
+			AddSpans( iBegin, iCommand, true );
 		}
-		FlushCombos( nBytesWritten, ubDynamicComboBuffer, pBuf );
+		AddSpans( iCommand, pEntry->m_iCommandEnd, shader.m_bPriority && shader.m_arrPriority.empty() );
 	}
+	m_nSpans = m_arrSpanBegin.size();
+	m_arrSpanBegin.emplace_back( m_iEndCommand );
 
-	// Time to limit amount of prints
-	static Clock::time_point s_fLastInfoTime;
-	static uint64_t s_nLastEntry = nComboOfEntry;
-	static CUtlMovingAverage<uint64_t, 60> s_averageProcess;
-	static std::string_view s_lastShader = pEntry->m_szName;
-	const Clock::time_point fCurTime = Clock::now();
+	m_arrSpanCursor = std::make_unique<std::atomic<uint64_t>[]>( m_nSpans );
+	for ( uint64_t iSpan = 0; iSpan < m_nSpans; ++iSpan )
+		m_arrSpanCursor[iSpan].store( m_arrSpanBegin[iSpan], std::memory_order_relaxed );
+
+	// With compile times from an earlier run the most expensive spans go first,
+	// so that a few slow static combos don't end up as the tail of the build
+	m_arrSpanOrder.resize( m_nSpans );
+	std::iota( m_arrSpanOrder.begin(), m_arrSpanOrder.end(), 0ULL );
+	if ( const std::vector<double> arrCost = EstimateSpanCosts( m_arrSpanBegin ); !arrCost.empty() )
+		std::stable_sort( m_arrSpanOrder.begin(), m_arrSpanOrder.end(), [&arrCost]( uint64_t a, uint64_t b ) noexcept { return arrCost[a] > arrCost[b]; } );
+
+	// -priority spans before everything else
+	std::stable_partition( m_arrSpanOrder.begin(), m_arrSpanOrder.end(), [this]( uint64_t iSpan ) noexcept { return m_arrSpanPriority[iSpan] != 0; } );
 
+	for ( uint32_t iWorker = 0; iWorker < m_nWorkers; ++iWorker )
+		m_arrWorkers[iWorker].m_iPos.store( iWorker, std::memory_order_relaxed );
+}
+
+template <typename TMutexType>
+bool CWorkerAccumState<TMutexType>::ClaimCommands( Worker& self, uint64_t& riBegin, uint64_t& riEnd, uint64_t& riSpanEnd ) noexcept
+{
+	// Drain own spans first, then steal from the lists of the other workers
+	const size_t iSelf = &self - m_arrWorkers.get();
+	for ( uint32_t k = 0; k < m_nWorkers; ++k )
 	{
-		std::lock_guard guard{ Threading::g_mtxGlobal };
-		if ( pStComboRec )
-		{
-			CStaticCombo *pCombo = pByteCodeArray->FindByKey( nComboOfEntry );
-			pByteCodeArray->DeleteByKey( nComboOfEntry );
-			delete pCombo;
-		}
-		if ( duration_cast<chrono::seconds>( fCurTime - s_fLastInfoTime ).count() != 0 )
+		Worker& victim = m_arrWorkers[( iSelf + k ) % m_nWorkers];
+		for ( uint64_t iPos = victim.m_iPos.load(); iPos < m_nSpans; iPos = victim.m_iPos.load() )
 		{
-			if ( s_lastShader.data() != pEntry->m_szName.data() )
+			const uint64_t iSpan          = m_arrSpanOrder[iPos];
+			std::atomic<uint64_t>& cursor = m_arrSpanCursor[iSpan];
+			const uint64_t iSpanEnd       = SpanEnd( iSpan );
+			if ( cursor.load() < iSpanEnd )
 			{
-				s_averageProcess.Reset();
-				s_lastShader = pEntry->m_szName;
-				s_nLastEntry = nComboOfEntry;
+				const uint64_t nClaim = m_arrSpanClaim[iSpan];
+				if ( const uint64_t iClaim = cursor.fetch_add( nClaim ); iClaim < iSpanEnd )
+				{
+					riBegin   = iClaim;
+					riEnd     = std::min( iClaim + nClaim, iSpanEnd );
+					riSpanEnd = iSpanEnd;
+
+					// Skipped commands up to the next surviving one go along, unless someone claimed past the end already.
+					// A whole static combo claim stays one, it only takes the ones without any.
+					uint64_t iSkipTo = CfgProcessor::Combo_NextSurviving( riEnd, iSpanEnd );
+					if ( g_bStaticClaims && iSkipTo < iSpanEnd )
+						iSkipTo -= ( iSkipTo - ShaderOf( iClaim ).m_pEntry->m_iCommandStart ) % nClaim;
+					if ( uint64_t iCursor = riEnd; iSkipTo > riEnd && cursor.compare_exchange_strong( iCursor, iSkipTo ) )
+						riEnd = iSkipTo;
+					return true;
+				}
 			}
 
-			s_averageProcess.PushValue( s_nLastEntry - nComboOfEntry );
-			s_nLastEntry = nComboOfEntry;
-			const auto avg = s_averageProcess.GetAverage();
-			std::cout << "\r"sv << clr::escaped( lineRewind ) << "Compiling "sv << ( g_ShaderHadError.contains( pEntry->m_szName ) ? clr::red : clr::green ) << pEntry->m_szName << clr::reset << " ["sv << clr::blue << PrettyPrint( nComboOfEntry ) << clr::reset << " remaining] "sv
-				<< FormatTimeShort( duration_cast<chrono::seconds>( fCurTime - g_flStartTime ).count() ) << " elapsed ("sv << clr::green2 << avg << clr::reset << " c/s, est. remaining "sv << FormatTimeShort( nComboOfEntry / std::max<uint64_t>( avg, 1 ) ) << ")"sv << endLine;
-			s_fLastInfoTime = fCurTime;
+			// Span is drained, move its owner on to the next one
+			victim.m_iPos.compare_exchange_strong( iPos, iPos + m_nWorkers );
 		}
 	}
 
-	return nBytesWritten;
+	return false;
 }
 
 template <typename TMutexType>
-class CWorkerAccumState
+void CWorkerAccumState<TMutexType>::ExecuteCompileCommand( CfgProcessor::ComboHandle hCombo )
 {
-public:
-	explicit CWorkerAccumState( uint32_t iFlags ) noexcept
-		: m_iFirstCommand( 0 ), m_iNextCommand( 0 ), m_iEndCommand( 0 )
-		, m_iLastFinished( 0 ), m_hCombo( nullptr ), m_iFlags( iFlags ) {}
-
-	void RangeBegin( uint64_t iFirstCommand, uint64_t iEndCommand );
-	void RangeFinished();
-
-	void ExecuteCompileCommand( CfgProcessor::ComboHandle hCombo );
-	void HandleCommandResponse( CfgProcessor::ComboHandle hCombo, CmdSink::IResponse* pResponse );
+	CmdSink::IResponse* pResponse = nullptr;
 
-	void Run( uint32_t i )
+	const CfgProcessor::CfgEntryInfo* pEntryInfo = Combo_GetEntryInfo( hCombo );
+	ShaderStats_t& stats = ShaderStats( pEntryInfo->m_szName );
+	const uint64_t iComboNum    = Combo_GetComboNum( hCombo );
+	const uint64_t nStaticCombo = iComboNum / pEntryInfo->m_numDynamicCombos;
+	const Trace::CScope trace{ "ExecuteCommand", pEntryInfo->m_szName, nStaticCombo, iComboNum - nStaticCombo * pEntryInfo->m_numDynamicCombos };
+	const Clock::time_point tStart = Clock::now();
+	if ( !stats.m_nFirstCompile.load( std::memory_order_relaxed ) )
 	{
-		m_arrSubProcessInfos.reserve( i );
-
-		std::vector<std::thread> threads;
-		threads.reserve( i );
-
-		while ( i-- > 0 )
-		{
-			++m_nActive;
-			threads.emplace_back( DoExecute, this );
-		}
+		Clock::rep nNone = 0;
+		stats.m_nFirstCompile.compare_exchange_strong( nNone, tStart.time_since_epoch().count() );
+	}
 
-		constexpr const std::chrono::milliseconds sleepTime{ 250 };
-		while ( m_nActive )
+	if constexpr ( std::is_same_v<TMutexType, Threading::null_mutex> )
+	{
+		if ( g_bVerbose2 )
 		{
-			_mm_pause();
-			std::this_thread::sleep_for( sleepTime );
+			char chReadBuf[4096];
+			Combo_FormatCommandHumanReadable( hCombo, chReadBuf );
+			ConsoleLog::CLine() << "running: \""sv << clr::green << chReadBuf << clr::reset << "\""sv << endLine;
 		}
-
-		std::for_each( threads.begin(), threads.end(), []( std::thread& t ) { if ( t.joinable() ) t.join(); } );
-		m_arrSubProcessInfos.clear();
 	}
 
-	void OnProcessST();
+	// The static combo compiles like another one, it is written as an alias of it
+	ShaderRange_t& shader = ShaderOf( Combo_GetCommandNum( hCombo ) );
+	if ( std::binary_search( shader.m_arrAliased.cbegin(), shader.m_arrAliased.cend(), nStaticCombo ) )
+	{
+		++stats.m_nAliased;
+		++g_nCombosDone;
+		return;
+	}
 
-	void Stop() noexcept
+	// Packed by a build that didn't finish, the journal had it
+	if ( std::binary_search( shader.m_arrResumed.cbegin(), shader.m_arrResumed.cend(), nStaticCombo ) )
 	{
-		m_bBreak.store( true, std::memory_order_release );
+		++stats.m_nResumed;
+		++g_nCombosDone;
+		return;
 	}
 
-private:
-	std::atomic<bool>			m_bBreak;
-	std::atomic<int>			m_nActive;
-	TMutexType					m_Mutex;
+	// Reused for every combo the thread compiles, only the changed define values get rewritten
+	static thread_local CfgProcessor::ComboBuildCommand s_tlCommand;
+	Combo_BuildCommand( hCombo, s_tlCommand );
+	const CfgProcessor::ComboBuildCommand& command = s_tlCommand;
 
-	static void DoExecute( CWorkerAccumState* pThis )
+	// A cancelled shader is checked again before the compiler runs, since another worker may have cancelled it in the
+	// meantime. Combos predicted to fail count as failed.
+	const auto& Cancel		= [&stats]
 	{
-		while ( pThis->OnProcess() )
-			continue;
-
-		--pThis->m_nActive;
+		++stats.m_nCancelled;
+		++g_nCombosCancelled;
+		++g_nCombosDone;
+	};
+	if ( Cancelled( shader ) )
+	{
+		Cancel();
+		return;
+	}
+	if ( shader.m_pFailures && FailPredict::Skip( *shader.m_pFailures, nStaticCombo, command, pEntryInfo->m_numDynamicDefines ) )
+	{
+		++stats.m_nFailed;
+		++g_nCombosFailed;
+		++g_nCombosDone;
+		return;
 	}
 
-	std::vector<uint64_t>	m_arrSubProcessInfos;
-	uint64_t				m_iFirstCommand;
-	uint64_t				m_iNextCommand;
-	uint64_t				m_iEndCommand;
-
-	uint64_t				m_iLastFinished;
+	// -validate-sample: the combos of a static combo take turns being validated, the others skip it unless their
+	// code is new. Validation doesn't change the code, so both share the cache keys of a validated compile.
+	const uint32_t flags		= Compiler::FlagsFor( *pEntryInfo, m_iFlags );
+	const uint64_t iDynamicCombo = iComboNum - nStaticCombo * pEntryInfo->m_numDynamicCombos;
+	const bool bSampled			= !g_nValidateSample || ( iDynamicCombo + nStaticCombo ) % g_nValidateSample == 0;
+	const uint32_t compileFlags = bSampled ? flags : flags | D3DCOMPILE_SKIP_VALIDATION;
+
+	// Keyed on the preprocessed text, combos that differ only in defines the code never reads
+	// are compiled once. If the preprocessor fails, the regular compile reports the errors.
+	std::string preprocessed;
+	const bool bPreprocessed = g_bPreprocess && Compiler::PreprocessCommand( command, preprocessed );
+
+	// Cache hits go straight to AddDynamicCombo like any other successful compile
+	CompileCache::Key key;
+	const bool bCache = CompileCache::Enabled();
+	uint32_t nCachedMicroseconds = 0; // What the compile took when it was cached
+	if ( bPreprocessed )
+	{
+		const CfgProcessor::ComboBuildCommand preprocessedCommand{ command.entryPoint, command.fileName, command.shaderModel };
+		key       = CompileCache::ComputeKey( CompileCache::HashString( preprocessed, 0 ), preprocessedCommand, flags );
+		pResponse = CompileCache::FindRecent( key, nCachedMicroseconds );
+	}
+	else if ( bCache )
+		key = CompileCache::ComputeKey( Combo_GetEntryInfo( hCombo )->m_nSourceHash, command, flags );
 
-	CfgProcessor::ComboHandle m_hCombo;
+	if ( !pResponse && bCache && ( pResponse = CompileCache::Find( key, nCachedMicroseconds ) ) != nullptr && bPreprocessed )
+		CompileCache::StoreRecent( key, pResponse, nCachedMicroseconds );
 
-	const uint32_t			m_iFlags;
+	const bool bCached = pResponse != nullptr;
+	if ( bCached )
+	{
+		++stats.m_nCacheHits;
+		stats.m_nCacheBytes.fetch_add( pResponse->GetResultBufferLen(), std::memory_order_relaxed );
+		stats.m_nCacheMicroseconds.fetch_add( nCachedMicroseconds, std::memory_order_relaxed );
+	}
+	else if ( Cancelled( shader ) )
+	{
+		Cancel();
+		return;
+	}
+	else
+	{
+		stats.m_nCacheMisses += bCache;
+		Compiler::IBackend& backend = Compiler::SelectBackend( *pEntryInfo );
+		const auto& Compile			= [&]( uint32_t nFlags )
+		{
+			CmdSink::IResponse* pCompiled = nullptr;
+			if ( s_tliWorkerProcess >= 0 && backend.UsesWorkerProcesses() )
+				pCompiled = WorkerProcess::Execute( s_tliWorkerProcess, command, bPreprocessed ? &preprocessed : nullptr, nFlags );
 
-	bool OnProcess();
-	void TryToPackageData( uint64_t iCommandNumber );
-};
+			// No child for this thread, or it went away
+			if ( !pCompiled )
+			{
+				const CfgProcessor::ComboBuildCommand* pCommand = &command;
+				const std::string* pPreprocessed				= bPreprocessed ? &preprocessed : nullptr;
+				backend.Compile( &pCommand, &pPreprocessed, &pCompiled, 1, nFlags );
+			}
+			return pCompiled;
+		};
+		pResponse = Compile( compileFlags );
 
-template <typename TMutexType>
-void CWorkerAccumState<TMutexType>::RangeBegin( uint64_t iFirstCommand, uint64_t iEndCommand )
-{
-	m_iFirstCommand = iFirstCommand;
-	m_iNextCommand  = iFirstCommand;
-	m_iEndCommand   = iEndCommand;
-	m_iLastFinished = iFirstCommand;
-	m_hCombo        = nullptr;
-	CfgProcessor::Combo_GetNext( m_iNextCommand, m_hCombo, m_iEndCommand );
-}
+		// Code no validated compile produced yet is compiled again with validation, what the cache stores is always validated
+		if ( g_nValidateSample && pResponse && pResponse->Succeeded() )
+		{
+			const uint64_t nCodeHash = CompileCache::HashBytes( pResponse->GetResultBuffer(), pResponse->GetResultBufferLen(), 0 );
+			if ( !bSampled && !CompileCache::IsValidated( nCodeHash ) )
+			{
+				pResponse->Release();
+				pResponse = Compile( flags );
+				++stats.m_nRevalidated;
+			}
+			if ( pResponse && pResponse->Succeeded() )
+				CompileCache::SetValidated( nCodeHash );
+		}
 
-template <typename TMutexType>
-void CWorkerAccumState<TMutexType>::RangeFinished()
-{
-	// Finish packaging data
-	TryToPackageData( m_iEndCommand - 1 );
-}
+		if ( pResponse && pResponse->Succeeded() )
+		{
+			const uint32_t nCompileMicroseconds = gsl::narrow_cast<uint32_t>( duration_cast<chrono::microseconds>( Clock::now() - tStart ).count() );
+			if ( bCache )
+				CompileCache::Store( key, pResponse, nCompileMicroseconds );
+			if ( bPreprocessed )
+				CompileCache::StoreRecent( key, pResponse, nCompileMicroseconds );
+		}
+	}
 
-template <typename TMutexType>
-void CWorkerAccumState<TMutexType>::ExecuteCompileCommand( CfgProcessor::ComboHandle hCombo )
-{
-	CmdSink::IResponse* pResponse = nullptr;
+	++( pResponse && pResponse->Succeeded() ? stats.m_nCompiled : stats.m_nFailed );
+	g_nCombosFailed += !pResponse || !pResponse->Succeeded();
+	if ( shader.m_pFailures && pResponse )
+	{
+		const char* szListing = pResponse->GetListing();
+		FailPredict::Record( *shader.m_pFailures, nStaticCombo, command, pEntryInfo->m_numDynamicDefines, pResponse->Succeeded(), szListing ? szListing : "" );
+	}
+	if ( pResponse && pResponse->Succeeded() )
+		stats.m_nByteCode.fetch_add( pResponse->GetResultBufferLen(), std::memory_order_relaxed );
+	++g_nCombosDone;
 
-	if constexpr ( std::is_same_v<TMutexType, Threading::null_mutex> )
+	const uint64_t nMicroseconds = duration_cast<chrono::microseconds>( Clock::now() - tStart ).count();
+	ComboStats::Add( stats.m_pStaticComboTime, nStaticCombo, gsl::narrow_cast<uint32_t>( nMicroseconds ) );
+	if ( Latency::Enabled() && !bCached )
 	{
-		if ( g_bVerbose2 )
+		stats.m_Compile.Add( nMicroseconds );
+		if ( Latency::IsSlowest( nMicroseconds ) )
 		{
-			char chReadBuf[4096];
-			Combo_FormatCommandHumanReadable( hCombo, chReadBuf );
-			std::cout << "running: \""sv << clr::green << chReadBuf << clr::reset << "\""sv << endLine;
+			char chCommand[4096];
+			Combo_FormatCommandHumanReadable( hCombo, chCommand );
+			Latency::AddSlowest( pEntryInfo->m_szName, nMicroseconds, chCommand );
 		}
 	}
 
-	Compiler::ExecuteCommand( Combo_BuildCommand( hCombo ), pResponse, m_iFlags );
+	// The code has to be looked at before HandleCommandResponse releases it
+	if ( DefineAnalysis::Enabled() && pResponse && pResponse->Succeeded() )
+		DefineAnalysis::Record( pEntryInfo->m_szName, command, CompileCache::HashBytes( pResponse->GetResultBuffer(), pResponse->GetResultBufferLen(), 0 ), gsl::narrow_cast<uint32_t>( nMicroseconds ) );
 
-	HandleCommandResponse( hCombo, pResponse );
-}
+	if ( !ComboReport::Enabled() || !pResponse )
+	{
+		HandleCommandResponse( hCombo, pResponse );
+		return;
+	}
+
+	ComboReport::Combo_t combo{ .m_szShader = pEntryInfo->m_szName, .m_nStaticCombo = nStaticCombo, .m_nDynamicCombo = iComboNum - nStaticCombo * pEntryInfo->m_numDynamicCombos,
+								.m_nMicroseconds = gsl::narrow_cast<uint32_t>( nMicroseconds ), .m_nSize = 0, .m_nInstructions = 0, .m_bCached = bCached, .m_bDeduped = false };
+	if ( pResponse->Succeeded() )
+	{
+		combo.m_nSize		  = gsl::narrow<uint32_t>( pResponse->GetResultBufferLen() );
+		combo.m_nInstructions = Compiler::CountInstructions( pResponse->GetResultBuffer(), pResponse->GetResultBufferLen() );
+	}
+	combo.m_bDeduped = HandleCommandResponse( hCombo, pResponse );
 
-static void StopCommandRange();
+	static thread_local std::string s_tlDefines;
+	s_tlDefines.clear();
+	for ( const auto& [name, value] : command.defines )
+	{
+		if ( !s_tlDefines.empty() )
+			s_tlDefines += ' ';
+		s_tlDefines.append( name ).append( "="sv ).append( value );
+	}
+	ComboReport::Record( combo, s_tlDefines );
+}
 
 template <typename TMutexType>
-void CWorkerAccumState<TMutexType>::HandleCommandResponse( CfgProcessor::ComboHandle hCombo, CmdSink::IResponse* pResponse )
+bool CWorkerAccumState<TMutexType>::HandleCommandResponse( CfgProcessor::ComboHandle hCombo, CmdSink::IResponse* pResponse )
 {
 	Assert( pResponse );
 
@@ -877,16 +3385,40 @@ void CWorkerAccumState<TMutexType>::HandleCommandResponse( CfgProcessor::ComboHa
 	const CfgProcessor::CfgEntryInfo* pEntryInfo = Combo_GetEntryInfo( hCombo );
 	const uint64_t iComboIndex                   = Combo_GetComboNum( hCombo );
 	const uint64_t iCommandNumber                = Combo_GetCommandNum( hCombo );
+	bool bDeduped                                = false;
 
 	if ( pResponse->Succeeded() )
 	{
-		std::lock_guard guard{ Threading::g_mtxGlobal };
+		const ShaderRange_t& shader = ShaderOf( iCommandNumber );
+		const void* pCode			= pResponse->GetResultBuffer();
+		size_t nCodeSize			= pResponse->GetResultBufferLen();
+
+		// Only the packed code goes without, the compile cache keeps all of it
+		static thread_local std::vector<uint8_t> s_tlStripped;
+		if ( shader.m_eStrip != Compiler::Strip::None && Compiler::StripByteCode( pCode, nCodeSize, shader.m_eStrip, s_tlStripped ) )
+		{
+			pCode	  = s_tlStripped.data();
+			nCodeSize = s_tlStripped.size();
+		}
+
+		const uint64_t nHash   = CompileCache::HashBytes( pCode, nCodeSize, 0 );
+		std::shared_ptr<uint8_t[]> pCopy = s_tlByteCodeArena.Copy( pCode, nCodeSize );
+
 		const uint64_t nStComboIdx = iComboIndex / pEntryInfo->m_numDynamicCombos;
 		const uint64_t nDyComboIdx = iComboIndex - ( nStComboIdx * pEntryInfo->m_numDynamicCombos );
-		StaticComboFromDictAdd( pEntryInfo->m_szName, nStComboIdx )->AddDynamicCombo( nDyComboIdx, pResponse->GetResultBuffer(), pResponse->GetResultBufferLen() );
+		std::shared_ptr<const uint8_t[]> pByteCode = shader.m_pByteCodeIntern->Intern( nHash, pCopy, nCodeSize );
+		bDeduped = pByteCode.get() != pCopy.get();
+		if ( !bDeduped )
+			pCopy.reset();
+		shader.m_pStaticCombos->FindOrAdd( nStComboIdx )->AddDynamicCombo( nDyComboIdx, std::move( pByteCode ), nCodeSize );
+
+		// Same code as a combo before it, the copy is not needed
+		if ( pCopy )
+			s_tlByteCodeArena.Unwind( std::move( pCopy ) );
 	}
 	else // Tell the master that this shader failed
 	{
+		ShaderOf( iCommandNumber ).m_bFailed.store( true, std::memory_order_release );
 		std::lock_guard guard{ Threading::g_mtxGlobal };
 		ShaderHadErrorDispatchInt( pEntryInfo->m_szName );
 	}
@@ -902,131 +3434,279 @@ void CWorkerAccumState<TMutexType>::HandleCommandResponse( CfgProcessor::ComboHa
 			szListing = chUnreportedListing;
 		}
 
-		char chBuffer[4096];
-		Combo_FormatCommandHumanReadable( hCombo, chBuffer );
-
-		ErrMsgDispatchMsgLine( chBuffer, szListing, pEntryInfo->m_szName );
-		if ( !pResponse->Succeeded() && g_bFastFail )
-			StopCommandRange();
+		ErrMsgDispatchMsgLine( hCombo, szListing, pEntryInfo->m_szName );
 	}
 
 	pResponse->Release();
-
-	// Maybe zip things up
-	TryToPackageData( iCommandNumber );
+	return bDeduped;
 }
 
+// Counts the surviving commands in [iBegin, iEnd) of a cancelled shader as cancelled, without building them
 template <typename TMutexType>
-void CWorkerAccumState<TMutexType>::TryToPackageData( uint64_t iCommandNumber )
+void CWorkerAccumState<TMutexType>::DropCommands( ShaderRange_t& shader, uint64_t iBegin, uint64_t iEnd )
 {
-	std::unique_lock guard{ m_Mutex };
+	const uint64_t nDropped = CfgProcessor::Combo_CountSurviving( iBegin, iEnd );
+	ShaderStats( shader.m_pEntry->m_szName ).m_nCancelled += nDropped;
+	g_nCombosCancelled += nDropped;
+	g_nCombosDone += nDropped;
+}
 
-	uint64_t iFinishedByNow = iCommandNumber + 1;
+// Counts the surviving commands of [iBegin, iEnd) off the static combos they belong to, these are compiled or skipped.
+// Static combos without any are passed over through the combo index.
+template <typename TMutexType>
+void CWorkerAccumState<TMutexType>::FinishCommands( uint64_t iBegin, uint64_t iEnd )
+{
+	static thread_local std::vector<uint64_t> s_tlCompleted;
+	constexpr size_t PACK_BATCH = 4096; // Completed static combos packed at once, a claim can span billions of them
 
-	// Check if somebody is running an earlier command
-	for ( const auto& iRunningCommand : m_arrSubProcessInfos )
+	while ( iBegin < iEnd )
 	{
-		if ( iRunningCommand < iCommandNumber )
+		ShaderRange_t& shader                    = ShaderOf( iBegin );
+		const CfgProcessor::CfgEntryInfo* pEntry = shader.m_pEntry;
+		const uint64_t iShaderEnd                = std::min( iEnd, pEntry->m_iCommandEnd );
+		const uint64_t nDynamic                  = pEntry->m_numDynamicCombos;
+
+		// Static combo s covers the commands [end - ( s + 1 ) * dynamic combos, end - s * dynamic combos)
+		s_tlCompleted.clear();
+		for ( ; ( iBegin = CfgProcessor::Combo_NextSurviving( iBegin, iShaderEnd ) ) < iShaderEnd; )
 		{
-			iFinishedByNow = 0;
-			break;
+			const uint64_t s		  = ( pEntry->m_iCommandEnd - 1 - iBegin ) / nDynamic;
+			const uint64_t iStaticEnd = pEntry->m_iCommandEnd - s * nDynamic;
+			const uint64_t iComboEnd  = std::min( iStaticEnd, iShaderEnd );
+			const uint64_t nDone	  = CfgProcessor::Combo_CountSurviving( iBegin, iComboEnd );
+			const auto& Surviving	  = [&shader, s] { return SurvivingOf( shader, s ); };
+
+			// Dynamic combo d of static combo s is command end - s * dynamic combos - 1 - d. The last range packs with the rest.
+			if ( shader.m_bStreamPack && !Cancelled( shader ) && !std::binary_search( shader.m_arrResumed.cbegin(), shader.m_arrResumed.cend(), s )
+				 && shader.m_Remaining.Remaining( s, Surviving ) != nDone )
+				StreamDynamicCombos( shader.m_pStaticCombos->FindOrAdd( s ), iStaticEnd - iComboEnd, iStaticEnd - iBegin, nDynamic, g_nCompressLevel, shader.m_nBlockSize );
+			if ( shader.m_Remaining.CountOff( s, nDone, Surviving ) )
+				s_tlCompleted.emplace_back( s );
+			if ( s_tlCompleted.size() == PACK_BATCH )
+			{
+				PackStaticCombos( shader, s_tlCompleted );
+				s_tlCompleted.clear();
+			}
+			iBegin = iComboEnd;
 		}
-	}
 
-	const uint64_t iLastFinished = m_iLastFinished;
-	if ( iFinishedByNow > m_iLastFinished )
-	{
-		m_iLastFinished = iFinishedByNow;
-		guard.unlock();
+		if ( !s_tlCompleted.empty() )
+			PackStaticCombos( shader, s_tlCompleted );
 	}
-	else
+}
+
+// -dictionary: the blocks of a shader are primed with the code of the first static combo in command order that has any,
+// the one with the highest id. Static combos with code that finish before it is known are held and packed along with it,
+// so the dictionary and with it the vcs file don't depend on the order the static combos finish in. Takes the held
+// ones out of arrPack and arrFinished, and puts all of them back in once the donor is known.
+template <typename TMutexType>
+void CWorkerAccumState<TMutexType>::HoldForDonor( ShaderRange_t& shader, std::vector<CStaticCombo*>& arrPack, std::vector<uint64_t>& arrFinished )
+{
+	std::lock_guard guard{ shader.m_mtxDonor };
+	if ( shader.m_bDonorKnown )
 		return;
 
-	CfgProcessor::ComboHandle hChBegin = CfgProcessor::Combo_GetCombo( iLastFinished );
-	CfgProcessor::ComboHandle hChEnd   = CfgProcessor::Combo_GetCombo( iFinishedByNow );
+	for ( const uint64_t nStaticCombo : arrFinished )
+		shader.m_Finished[nStaticCombo] = 1;
+	for ( const CStaticCombo* pStComboRec : arrPack )
+		shader.m_Finished[pStComboRec->ComboId()] = 2;
+	std::erase_if( arrFinished, [&shader]( uint64_t s ) { return shader.m_Finished[s] == 2; } );
+	shader.m_arrHeld.insert( shader.m_arrHeld.end(), arrPack.begin(), arrPack.end() );
+	arrPack.clear();
 
-	Assert( hChBegin && hChEnd );
+	// Only static combos with surviving commands ever finish
+	const auto& FinishedAs = [&shader]( uint64_t s ) -> uint8_t
+	{
+		const auto it = shader.m_Finished.find( s );
+		return it != shader.m_Finished.end() ? it->second : 0;
+	};
+	while ( shader.m_nDonorScan != UINT64_MAX && FinishedAs( shader.m_nDonorScan ) == 1 )
+		shader.m_nDonorScan = LiveStaticBelow( shader, shader.m_nDonorScan );
+	if ( shader.m_nDonorScan != UINT64_MAX && !FinishedAs( shader.m_nDonorScan ) )
+		return;
 
-	const CfgProcessor::CfgEntryInfo* pInfoBegin = Combo_GetEntryInfo( hChBegin );
-	const CfgProcessor::CfgEntryInfo* pInfoEnd   = Combo_GetEntryInfo( hChEnd );
+	// The donor, or none of the static combos has code
+	shader.m_bDonorKnown = true;
+	for ( CStaticCombo* pStComboRec : shader.m_arrHeld )
+	{
+		if ( pStComboRec->ComboId() == shader.m_nDonorScan )
+			shader.m_pStaticCombos->Dictionary( pStComboRec );
+		arrFinished.emplace_back( pStComboRec->ComboId() );
+	}
+	arrPack = std::move( shader.m_arrHeld );
+	shader.m_arrHeld.clear();
+	decltype( shader.m_Finished )().swap( shader.m_Finished );
+}
 
-	uint64_t nComboBegin     = Combo_GetComboNum( hChBegin ) / pInfoBegin->m_numDynamicCombos;
-	const uint64_t nComboEnd = Combo_GetComboNum( hChEnd ) / pInfoEnd->m_numDynamicCombos;
+// Packs static combos nothing is left to compile of, and hands the shader to NextPackagedShader after its last one
+template <typename TMutexType>
+void CWorkerAccumState<TMutexType>::PackStaticCombos( ShaderRange_t& shader, const std::vector<uint64_t>& arrStaticCombos )
+{
+	const Trace::CScope trace{ "PackStaticCombos", shader.m_pEntry->m_szName };
 
-	for ( ; pInfoBegin && ( pInfoBegin->m_iCommandStart < pInfoEnd->m_iCommandStart || nComboBegin > nComboEnd ); )
+	// Combos that compiled to nothing are dropped right here
+	static thread_local std::vector<CStaticCombo*> s_tlPack;
+	s_tlPack.clear();
+	CSpillFile* pSpill = nullptr;
+	VcsReuse::CPreviousShader* pPrevious = nullptr;
 	{
-		// Zip this combo
-		CUtlBuffer mbPacked;
-		const size_t nPackedLength = AssembleWorkerReplyPackage( pInfoBegin, nComboBegin, mbPacked );
-
-		if ( nPackedLength )
+		std::lock_guard guard{ Threading::g_mtxGlobal };
+		if ( g_bReuse )
+		{
+			const auto [it, bInserted] = g_ShaderPrevious.try_emplace( shader.m_pEntry->m_szName, nullptr );
+			if ( bInserted )
+				it->second = VcsReuse::CPreviousShader::Open( g_pShaderPath / "shaders"sv / "fxc"sv / ( std::string( shader.m_pEntry->m_szName ) + ".vcs" ) ).release();
+			pPrevious = it->second;
+		}
+		if ( g_bSpill || MemoryBudget::NearLimit() )
 		{
-			// Packed buffer
-			uint8_t* pCodeBuffer;
+			CSpillFile*& rpSpill = g_ShaderSpill[shader.m_pEntry->m_szName];
+			if ( !rpSpill )
 			{
-				std::lock_guard guard{ Threading::g_mtxGlobal };
-				pCodeBuffer = StaticComboFromDictAdd( pInfoBegin->m_szName, nComboBegin )->AllocPackedCodeBlock( nPackedLength );
+				const fs::path dir = g_pShaderPath / "shaders"sv / "fxc"sv;
+				std::error_code c;
+				fs::create_directories( dir, c );
+				rpSpill = new CSpillFile( dir / ( std::string( shader.m_pEntry->m_szName ) + ".spill" ) );
 			}
+			pSpill = rpSpill;
+		}
 
-			if ( pCodeBuffer )
-			{
-				mbPacked.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
-				mbPacked.Get( pCodeBuffer, gsl::narrow<int>( nPackedLength ) );
-			}
+		ReportPackagingProgress( shader.m_pEntry );
+	}
+
+	// Nothing else touches the slots of finished static combos. A cancelled shader is never written, its code goes right away.
+	// Resumed ones are packed already.
+	static thread_local std::vector<CStaticCombo*> s_tlResumed;
+	s_tlResumed.clear();
+	const bool bCancelled = Cancelled( shader );
+	for ( const uint64_t nStaticCombo : arrStaticCombos )
+	{
+		if ( CStaticCombo* pStComboRec = shader.m_pStaticCombos->Find( nStaticCombo ) )
+		{
+			pStComboRec->WaitForStream(); // A thread may still be streaming its last range in
+			if ( !bCancelled && pStComboRec->HasCode() )
+				s_tlPack.emplace_back( pStComboRec );
+			else if ( !bCancelled && std::binary_search( shader.m_arrResumed.cbegin(), shader.m_arrResumed.cend(), nStaticCombo ) )
+				s_tlResumed.emplace_back( pStComboRec );
+			else
+				shader.m_pStaticCombos->Delete( nStaticCombo );
 		}
+	}
+
+	// Static combos this call is done with, less the ones held for the donor and plus the ones it lets go
+	static thread_local std::vector<uint64_t> s_tlFinished;
+	s_tlFinished.assign( arrStaticCombos.begin(), arrStaticCombos.end() );
+	if ( g_bDictionary )
+		HoldForDonor( shader, s_tlPack, s_tlFinished );
+
+	// Workers never touch finished static combos again, so they can be compressed without the lock
+	ShaderStats_t* pStats = Latency::Enabled() ? &ShaderStats( shader.m_pEntry->m_szName ) : nullptr;
+	for ( CStaticCombo* pStComboRec : s_tlPack )
+	{
+		const Clock::time_point tPack = Clock::now();
+		PackStaticCombo( pStComboRec, g_nCompressLevel, shader.m_nBlockSize, shader.m_pUsage, pPrevious, g_bDictionary ? shader.m_pStaticCombos : nullptr, shader.m_bStreamPack );
+		if ( pStats )
+			pStats->m_Pack.Add( duration_cast<chrono::microseconds>( Clock::now() - tPack ).count() );
+		if ( shader.m_pJournal && pStComboRec->PackedSize() )
+			shader.m_pJournal->Append( pStComboRec->ComboId(), pStComboRec->PackedHash(), pStComboRec->Code().GetData(), pStComboRec->PackedSize() );
+		if ( pSpill )
+			pStComboRec->Spill( *pSpill );
+	}
+	if ( pSpill )
+	{
+		for ( CStaticCombo* pStComboRec : s_tlResumed )
+			pStComboRec->Spill( *pSpill );
+	}
+	s_tlPack.insert( s_tlPack.end(), s_tlResumed.begin(), s_tlResumed.end() );
+	// -priority: the shader is written with its priority static combos once they are all packed, unless it is done anyway.
+	// Not with -reuse, the old file is still read from, nor as a fragment of a shard.
+	if ( !shader.m_arrPriority.empty() && !g_bReuse && g_nShards == 1 )
+	{
+		const uint64_t nPriority = std::count_if( s_tlFinished.begin(), s_tlFinished.end(), [&shader]( uint64_t s ) { return std::binary_search( shader.m_arrPriority.begin(), shader.m_arrPriority.end(), s ); } );
+		if ( nPriority && shader.m_nPriorityLeft.fetch_sub( nPriority ) == nPriority && shader.m_nUnpacked.load() != s_tlFinished.size() && !Cancelled( shader ) )
+			WritePartialShaderFile( shader.m_pEntry, *shader.m_pStaticCombos, shader.m_arrPriority );
+	}
 
-		// Next iteration
-		if ( !nComboBegin-- )
+	// -preview: every so often the shader is written with what is packed so far, same restrictions
+	if ( g_nPreviewSeconds && !g_bReuse && g_nShards == 1 )
+	{
+		static thread_local std::vector<uint64_t> s_tlPreview;
+		s_tlPreview.clear();
 		{
-			Combo_Free( hChBegin );
-			if ( ( hChBegin = CfgProcessor::Combo_GetCombo( pInfoBegin->m_iCommandEnd ) ) != nullptr )
+			std::lock_guard guard{ shader.m_mtxPreview };
+			for ( const CStaticCombo* pStComboRec : s_tlPack )
+				shader.m_arrPacked.emplace_back( pStComboRec->ComboId() );
+
+			const Clock::time_point tNow = Clock::now();
+			if ( tNow >= shader.m_tNextPreview && !shader.m_arrPacked.empty() && shader.m_nUnpacked.load() != s_tlFinished.size() )
 			{
-				pInfoBegin  = Combo_GetEntryInfo( hChBegin );
-				nComboBegin = pInfoBegin->m_numStaticCombos - 1;
+				shader.m_tNextPreview = tNow + chrono::seconds( g_nPreviewSeconds );
+				s_tlPreview			  = shader.m_arrPacked;
 			}
 		}
+		if ( !s_tlPreview.empty() && !Cancelled( shader ) )
+			WritePartialShaderFile( shader.m_pEntry, *shader.m_pStaticCombos, s_tlPreview );
 	}
 
-	Combo_Free( hChBegin );
-	Combo_Free( hChEnd );
-}
+	if ( shader.m_nUnpacked.fetch_sub( s_tlFinished.size() ) != s_tlFinished.size() )
+		return;
 
-template <typename TMutexType>
-bool CWorkerAccumState<TMutexType>::OnProcess()
-{
-	CfgProcessor::ComboHandle hThreadCombo;
-	uint64_t* iCurrentId;
 	{
-		std::lock_guard guard{ m_Mutex };
-		hThreadCombo = m_hCombo ? Combo_Alloc( m_hCombo ) : nullptr;
-		m_arrSubProcessInfos.resize( m_arrSubProcessInfos.size() + 1 );
-		iCurrentId = &m_arrSubProcessInfos.back();
+		std::lock_guard guard{ m_mtxPackaged };
+		m_arrPackaged.emplace_back( &shader );
+		m_nMaxBacklog = std::max( m_nMaxBacklog, m_arrPackaged.size() - m_nShadersReturned );
 	}
 
+	if constexpr ( !std::is_same_v<TMutexType, Threading::null_mutex> )
+		SignalProgress();
+}
+
+template <typename TMutexType>
+bool CWorkerAccumState<TMutexType>::OnProcess( Worker& self )
+{
+	CfgProcessor::ComboHandle hThreadCombo = nullptr;
 	uint64_t iThreadCommand = ~0ULL;
+	// hThreadCombo has already skipped everything in [iScanFrom, iThreadCommand), but never looks past iScanEnd
+	uint64_t iScanFrom = ~0ULL, iScanEnd = 0;
 
-	for ( ;; )
+	for ( uint64_t iBegin, iEnd, iSpanEnd; !m_bBreak.load( std::memory_order_acquire ) && WaitForTurn( self ) && ClaimCommands( self, iBegin, iEnd, iSpanEnd ); iScanFrom = iEnd )
 	{
+		const Clock::time_point tClaimed = Clock::now();
+
+		// Seek our own handle unless it already walked up to this claim
+		if ( iBegin != iScanFrom || iEnd > iScanEnd )
 		{
-			std::lock_guard guard{ m_Mutex };
-			if ( m_hCombo )
-			{
-				Combo_Assign( hThreadCombo, m_hCombo );
-				*iCurrentId = Combo_GetCommandNum( hThreadCombo );
-				Combo_GetNext( iThreadCommand, m_hCombo, m_iEndCommand );
-			}
-			else
+			Combo_Free( hThreadCombo );
+			iThreadCommand = iBegin;
+			iScanEnd       = iSpanEnd;
+			Combo_GetNext( iThreadCommand, hThreadCombo, iScanEnd );
+		}
+
+		while ( hThreadCombo && iThreadCommand < iEnd && !m_bBreak.load( std::memory_order_acquire ) )
+		{
+			// The rest of a cancelled shader in this claim goes at once
+			if ( ShaderRange_t& shader = ShaderOf( iThreadCommand ); Cancelled( shader ) )
 			{
+				const uint64_t iSkipTo = std::min( shader.m_pEntry->m_iCommandEnd, iEnd );
+				DropCommands( shader, iThreadCommand, iSkipTo );
 				Combo_Free( hThreadCombo );
-				iThreadCommand = ~0ULL;
-				*iCurrentId = ~0ULL;
+				iThreadCommand = iSkipTo;
+				if ( iSkipTo < iEnd )
+					Combo_GetNext( iThreadCommand, hThreadCombo, iScanEnd );
+				else
+					iScanEnd = 0; // The next claim seeks again
+				continue;
 			}
-		}
 
-		if ( hThreadCombo && !m_bBreak.load( std::memory_order_acquire ) )
 			ExecuteCompileCommand( hThreadCombo );
-		else
+			Combo_GetNext( iThreadCommand, hThreadCombo, iScanEnd );
+		}
+
+		// Maybe zip things up, skipped commands count as well
+		if ( m_bBreak.load( std::memory_order_acquire ) )
 			break;
+		FinishCommands( iBegin, iEnd );
+		self.m_nBusyNanoseconds.fetch_add( duration_cast<chrono::nanoseconds>( Clock::now() - tClaimed ).count(), std::memory_order_relaxed );
 	}
 
 	Combo_Free( hThreadCombo );
@@ -1034,13 +3714,28 @@ bool CWorkerAccumState<TMutexType>::OnProcess()
 }
 
 template <typename TMutexType>
-void CWorkerAccumState<TMutexType>::OnProcessST()
+void CWorkerAccumState<TMutexType>::OnProcessST( uint64_t iCommandEnd )
 {
-	while ( m_hCombo && !m_bBreak.load( std::memory_order_acquire ) )
+	while ( m_hCombo && m_iNextCommand < iCommandEnd && !m_bBreak.load( std::memory_order_acquire ) )
 	{
-		ExecuteCompileCommand( m_hCombo );
+		const uint64_t iDone = m_iNextCommand;
+		if ( ShaderRange_t& shader = ShaderOf( iDone ); Cancelled( shader ) )
+		{
+			// The rest of a cancelled shader goes at once
+			DropCommands( shader, iDone, iCommandEnd );
+			Combo_Free( m_hCombo );
+			m_iNextCommand = iCommandEnd;
+			if ( m_iNextCommand < m_iEndCommand )
+				Combo_GetNext( m_iNextCommand, m_hCombo, m_iEndCommand );
+		}
+		else
+		{
+			ExecuteCompileCommand( m_hCombo );
+			Combo_GetNext( m_iNextCommand, m_hCombo, m_iEndCommand );
+		}
 
-		Combo_GetNext( m_iNextCommand, m_hCombo, m_iEndCommand );
+		// Maybe zip things up, along with the skipped ones up to the next combo
+		FinishCommands( iDone, m_iNextCommand );
 	}
 }
 
@@ -1072,7 +3767,12 @@ public:
 	}
 
 public:
-	void ProcessCommandRange( uint64_t shaderStart, uint64_t shaderEnd );
+	// The commands of every shader are posted at once, so that workers never idle between shaders.
+	// NextPackagedShader returns the shaders as they are done, nullptr once there are no more.
+	void BeginCommandRange( const CfgProcessor::CfgEntryInfo* pEntries );
+	const CfgProcessor::CfgEntryInfo* NextPackagedShader();
+	void EndCommandRange();
+	void PrintStats() const;
 
 	void Stop();
 	bool Stoped() const { return m_bStopped; }
@@ -1094,24 +3794,21 @@ protected:
 	bool m_bStopped = false;
 };
 
-// TODO: Cleanup this hack
-static void StopCommandRange()
-{
-	ProcessCommandRange_Singleton::Instance()->Stop();
-}
-
 void ProcessCommandRange_Singleton::Startup( uint32_t flags )
 {
 	if ( m_nThreads > 1 )
 	{
 		// Make sure that our mutex is in multi-threaded mode
 		Threading::g_mtxGlobal.EnableThreadedMode();
-		Threading::g_mtxMsgReport.EnableThreadedMode();
 
 		m_MT = new MT( flags );
+		m_MT->StartThreads( m_nThreads );
 	}
 	else // Otherwise initialize single-threaded mode
+	{
 		m_ST = new ST( flags );
+		s_tliWorkerProcess = WorkerProcess::Count() ? 0 : -1;
+	}
 }
 
 void ProcessCommandRange_Singleton::Shutdown()
@@ -1131,29 +3828,43 @@ void ProcessCommandRange_Singleton::Stop()
 		m_ST->Stop();
 }
 
-void ProcessCommandRange_Singleton::ProcessCommandRange( uint64_t shaderStart, uint64_t shaderEnd )
+void ProcessCommandRange_Singleton::BeginCommandRange( const CfgProcessor::CfgEntryInfo* pEntries )
+{
+	if ( m_nThreads > 1 )
+		m_MT->RangeBegin( pEntries );
+	else
+		m_ST->RangeBegin( pEntries );
+}
+
+const CfgProcessor::CfgEntryInfo* ProcessCommandRange_Singleton::NextPackagedShader()
+{
+	if ( m_nThreads > 1 )
+		return m_MT->NextPackagedShader();
+	else
+		return m_ST->NextPackagedShader();
+}
+
+void ProcessCommandRange_Singleton::EndCommandRange()
 {
 	if ( m_nThreads > 1 )
-	{
-		m_MT->RangeBegin( shaderStart, shaderEnd );
-		m_MT->Run( m_nThreads );
 		m_MT->RangeFinished();
-	}
 	else
-	{
-		m_ST->RangeBegin( shaderStart, shaderEnd );
-		m_ST->OnProcessST();
 		m_ST->RangeFinished();
-	}
+}
+
+void ProcessCommandRange_Singleton::PrintStats() const
+{
+	if ( m_nThreads > 1 )
+		m_MT->PrintStats();
+	else
+		m_ST->PrintStats();
 }
 
 static void Shader_ParseShaderInfoFromCompileCommands( const CfgProcessor::CfgEntryInfo* pEntry, ShaderInfo_t& shaderInfo )
 {
-	if ( CfgProcessor::ComboHandle hCombo = CfgProcessor::Combo_GetCombo( pEntry->m_iCommandStart ) )
+	if ( CfgProcessor::CfgEntryInfo const* info = CfgProcessor::Combo_FindEntryInfo( pEntry->m_iCommandStart ) )
 	{
-		CfgProcessor::CfgEntryInfo const* info = Combo_GetEntryInfo( hCombo );
-
-		memset( &shaderInfo, 0, sizeof( ShaderInfo_t ) );
+		shaderInfo = {};
 
 		shaderInfo.m_CentroidMask       = info->m_nCentroidMask;
 		shaderInfo.m_nShaderCombo       = 0;
@@ -1164,170 +3875,659 @@ static void Shader_ParseShaderInfoFromCompileCommands( const CfgProcessor::CfgEn
 		shaderInfo.m_pShaderName		= pEntry->m_szName;
 		shaderInfo.m_pShaderSrc			= pEntry->m_szShaderFileName;
 		shaderInfo.m_Crc32				= pEntry->m_nCrc32;
+	}
+}
+
+struct ShaderInputData
+{
+	std::string name;
+	std::string_view version;
+	std::string_view target;
 
-		Combo_Free( hCombo );
+	bool operator==(const ShaderInputData&) const = default;
+	std::strong_ordering operator<=>(const ShaderInputData&) const = default;
+};
+
+// Calls fn( file, i ) for every file on up to nThreads threads, whichever is free takes the next one
+template <typename Fn>
+static void ForEachShaderFile( const std::vector<ShaderInputData>& arrFiles, uint32_t nThreads, const Fn& fn )
+{
+	std::atomic<size_t> nNextFile = 0;
+	const auto& Run = [&]()
+	{
+		for ( size_t iFile; ( iFile = nNextFile++ ) < arrFiles.size(); )
+			fn( arrFiles[iFile], iFile );
+	};
+
+	std::vector<std::thread> threads;
+	for ( uint32_t i = 1; i < std::min<size_t>( nThreads, arrFiles.size() ); ++i )
+		threads.emplace_back( Run );
+	Run();
+	for ( std::thread& t : threads )
+		t.join();
+}
+// Everything the vcs file of a shader follows from but its name: the contents of its sources, the names of the files it
+// includes, its combos, skips, model and entry point, and the settings given per shader
+static uint64_t DuplicateKeyOf( const CfgProcessor::ShaderConfig& conf )
+{
+	uint64_t nKey = CompileCache::HashString( conf.main, 0 );
+	nKey = CompileCache::HashString( conf.version, CompileCache::HashString( conf.target, nKey ) );
+	const uint64_t arrSettings[] = { conf.centroid_mask, conf.crc32, conf.release_profile, BlockSizeOf( conf.name ), static_cast<uint64_t>( StripOf( conf.name ) ),
+									 UsageOf( conf.name ) != nullptr, g_ProfileGuided.contains( conf.name ), g_StaticLoadOrder.contains( conf.name ) };
+	nKey = CompileCache::HashBytes( arrSettings, sizeof( arrSettings ), nKey );
+	for ( const std::vector<Parser::Combo>* pCombos : { &conf.dynamic_c, &conf.static_c } )
+	{
+		for ( const Parser::Combo& combo : *pCombos )
+		{
+			const int32_t arrRange[] = { combo.minVal, combo.maxVal };
+			nKey = CompileCache::HashBytes( arrRange, sizeof( arrRange ), CompileCache::HashString( combo.name, nKey ) );
+		}
+		nKey = CompileCache::HashString( "|"sv, nKey );
+	}
+	for ( const std::string& skip : conf.skip )
+		nKey = CompileCache::HashString( skip, nKey );
+
+	// The source itself may be a copy under another name
+	for ( size_t i = 0; i < conf.includes.size(); ++i )
+	{
+		const std::string& file = conf.includes[i];
+		if ( i )
+			nKey = CompileCache::HashString( file, nKey );
+		if ( const CSharedFile* pFile = fileCache.GetOrLoad( file, g_pShaderPath / file ) )
+			nKey = CompileCache::HashBytes( pFile->Data(), pFile->Size(), nKey );
+		else
+			nKey = CompileCache::HashString( file, nKey );
 	}
+	return nKey;
 }
 
-struct ShaderInputData
+// Equal keys of DuplicateKeyOf can still collide, this compares all of it
+static bool SameVcsInputs( const CfgProcessor::ShaderConfig& a, const CfgProcessor::ShaderConfig& b )
 {
-	std::string name;
-	std::string_view version;
-	std::string_view target;
+	const auto& SameCombos = []( const std::vector<Parser::Combo>& x, const std::vector<Parser::Combo>& y )
+	{
+		return std::equal( x.cbegin(), x.cend(), y.cbegin(), y.cend(), []( const Parser::Combo& l, const Parser::Combo& r )
+		{
+			return l.name == r.name && l.minVal == r.minVal && l.maxVal == r.maxVal;
+		} );
+	};
+	// Given for neither shader or the same for both
+	const auto& SameOption = [&]( const auto& map )
+	{
+		const auto itA = map.find( a.name ), itB = map.find( b.name );
+		return itA == map.end() ? itB == map.end() : itB != map.end() && itA->second == itB->second;
+	};
 
-	bool operator==(const ShaderInputData&) const = default;
-	std::strong_ordering operator<=>(const ShaderInputData&) const = default;
-};
-static std::unique_ptr<CfgProcessor::CfgEntryInfo[]> Shared_ParseListOfCompileCommands( std::set<ShaderInputData> files, bool bForce, bool bSpewSkips, bool isCSGO )
+	if ( a.main != b.main || a.version != b.version || a.target != b.target || a.centroid_mask != b.centroid_mask || a.crc32 != b.crc32 || a.release_profile != b.release_profile ||
+		 BlockSizeOf( a.name ) != BlockSizeOf( b.name ) || StripOf( a.name ) != StripOf( b.name ) || !SameOption( g_ComboUsage ) || !SameOption( g_ProfileGuided ) ||
+		 !SameOption( g_StaticLoadOrder ) || !SameCombos( a.dynamic_c, b.dynamic_c ) || !SameCombos( a.static_c, b.static_c ) || a.skip != b.skip ||
+		 a.includes.size() != b.includes.size() )
+		return false;
+
+	for ( size_t i = 0; i < a.includes.size(); ++i )
+	{
+		const std::string &fileA = a.includes[i], &fileB = b.includes[i];
+		if ( i && fileA != fileB )
+			return false;
+		const CSharedFile* pA = fileCache.GetOrLoad( fileA, g_pShaderPath / fileA );
+		const CSharedFile* pB = fileCache.GetOrLoad( fileB, g_pShaderPath / fileB );
+		if ( !pA || !pB )
+		{
+			if ( pA != pB || fileA != fileB )
+				return false;
+		}
+		else if ( pA != pB && ( pA->Size() != pB->Size() || memcmp( pA->Data(), pB->Data(), pA->Size() ) ) )
+			return false;
+	}
+	return true;
+}
+
+// nullptr if nothing needs compiling, or some shader didn't parse which sets bFailed
+static std::unique_ptr<CfgProcessor::CfgEntryInfo[]> Shared_ParseListOfCompileCommands( std::set<ShaderInputData> files, bool bForce, bool bSpewSkips, bool isCSGO, bool bSkipTables, uint32_t nThreads, uint32_t nIndexThreads, bool& bFailed )
 {
 	using namespace std::literals;
 	const Clock::time_point tt_start = Clock::now();
 
-	bool failed = false;
-	std::vector<CfgProcessor::ShaderConfig> configs;
+	std::atomic<bool> failed = false;
 	const auto root = g_pShaderPath.string();
-	for ( const auto& file : files )
+	// bShared if other files build a vcs file of the same name, only the first of them checks its crc and writes the include.
+	// Those are all read, bUpToDate says the vcs file is up to date if the others agree.
+	const auto& ParseShader = [&]( const ShaderInputData& file, bool bShared, bool bFirst, bool& bUpToDate, std::optional<CfgProcessor::ShaderConfig>& config )
 	{
-		uint32_t crc;
+		const Trace::CScope trace{ "ParseFile", Trace::Enabled() ? Trace::Keep( file.name ) : std::string_view{} };
+		if ( !bFirst && BuildPlan::Enabled() )
+			return;
+		uint32_t crc = 0;
 		std::string name = Parser::ConstructName( file.name, file.target, file.version );
-		if ( Parser::CheckCrc( g_pShaderPath / file.name, root, name, crc ) && !bForce )
-			continue;
+		// -plan goes on with the shaders that are up to date to show them as well
+		if ( bFirst && Parser::CheckCrc( g_pShaderPath / file.name, root, name, crc ) )
+		{
+			if ( BuildPlan::Enabled() )
+				BuildPlan::SetUpToDate( name );
+			else if ( bShared )
+				bUpToDate = !bForce;
+			else if ( !bForce )
+				return;
+		}
 
-		CfgProcessor::ShaderConfig conf;
+		CfgProcessor::ShaderConfig& conf = config.emplace();
 		if ( !Parser::ParseFile( g_pShaderPath / file.name, root, file.target, file.version, conf ) )
 		{
 			std::cout << clr::red << "Failed to parse "sv << file.name << clr::reset << std::endl;
 			failed = true;
-			continue;
+			config.reset();
+			return;
+		}
+		if ( !BuildPlan::Enabled() && bFirst )
+		{
+			IncludeGraph::Set( name, conf.includes );
+			Parser::WriteInclude( g_pShaderPath / "include"sv / ( name + ".inc" ), name, file.target, conf.static_c, conf.dynamic_c, conf.skip, isCSGO, bSkipTables );
 		}
-		Parser::WriteInclude( g_pShaderPath / "include"sv / ( name + ".inc" ), name, file.target, conf.static_c, conf.dynamic_c, conf.skip, isCSGO );
 		conf.name = std::move( name );
 		conf.crc32 = crc;
 		conf.target = file.target;
 		conf.version = file.version;
-		configs.emplace_back( std::move( conf ) );
+
+		// Whatever the static combos took last time, as long as they are still the same
+		const uint64_t nStaticCombos = std::accumulate( conf.static_c.cbegin(), conf.static_c.cend(), 1ULL, []( uint64_t n, const Parser::Combo& c ) { return n * ( static_cast<uint64_t>( c.maxVal ) - c.minVal + 1 ); } );
+		if ( const std::vector<ComboStats::StaticComboTime_t>* pTimes = ComboStats::Find( conf.name, nStaticCombos ) )
+			conf.cost = ComboStats::Total( *pTimes );
+	};
+
+	// Every shader is read, checked and has its include written on its own, the results keep the order of the files
+	const std::vector<ShaderInputData> arrFiles( files.cbegin(), files.cend() );
+	std::vector<std::optional<CfgProcessor::ShaderConfig>> arrConfigs( arrFiles.size() );
+	// foo_vs20.fxc and foo_vsxx.fxc under -ver 20b both build foo_vs20.vcs, all of them are read to see if they agree
+	std::vector<size_t> arrFirstOfName( arrFiles.size() );
+	std::vector<bool> arrShared( arrFiles.size(), false );
+	const std::unique_ptr<bool[]> arrUpToDate = std::make_unique<bool[]>( arrFiles.size() );
+	{
+		robin_hood::unordered_flat_map<std::string, size_t> firstOfName;
+		for ( size_t i = 0; i < arrFiles.size(); ++i )
+		{
+			const ShaderInputData& file = arrFiles[i];
+			const size_t iFirst = arrFirstOfName[i] = firstOfName.try_emplace( Parser::ConstructName( file.name, file.target, file.version ), i ).first->second;
+			if ( iFirst != i )
+				arrShared[i] = arrShared[iFirst] = true;
+		}
 	}
+	ForEachShaderFile( arrFiles, nThreads, [&]( const ShaderInputData& file, size_t iFile ) { ParseShader( file, arrShared[iFile], arrFirstOfName[iFile] == iFile, arrUpToDate[iFile], arrConfigs[iFile] ); } );
+	if ( !BuildPlan::Enabled() )
+		IncludeGraph::Save();
 
+	bFailed = failed;
 	if ( failed )
-		exit( -1 );
+		return nullptr;
+
+	// Files that build a vcs file of the same name are built once or not at all, from the first of them
+	std::vector<CfgProcessor::ShaderConfig> configs;
+	{
+		robin_hood::unordered_flat_map<std::string, size_t> firstOfName;
+		std::vector<bool> arrUpToDateConfigs;
+		for ( size_t iFile = 0; iFile < arrConfigs.size(); ++iFile )
+		{
+			std::optional<CfgProcessor::ShaderConfig>& config = arrConfigs[iFile];
+			if ( !config )
+				continue;
+			if ( !arrShared[iFile] )
+			{
+				configs.emplace_back( std::move( *config ) );
+				arrUpToDateConfigs.emplace_back( false );
+				continue;
+			}
+
+			const auto it = firstOfName.find( config->name );
+			if ( it == firstOfName.end() )
+			{
+				firstOfName.emplace( config->name, configs.size() );
+				configs.emplace_back( std::move( *config ) );
+				arrUpToDateConfigs.emplace_back( arrUpToDate[iFile] );
+				continue;
+			}
+
+			// Only the first of them has its crc checked, and it is the one that is built
+			config->crc32 = configs[it->second].crc32;
+			if ( !SameVcsInputs( *config, configs[it->second] ) )
+				std::cout << clr::yellow << arrFiles[iFile].name << " and "sv << configs[it->second].includes[0] << " both build "sv << config->name << ".vcs from different sources or settings, only "sv << configs[it->second].includes[0] << " is built"sv << clr::reset << std::endl;
+		}
+		std::erase_if( configs, [&]( const CfgProcessor::ShaderConfig& conf ) { return arrUpToDateConfigs[&conf - configs.data()]; } );
+	}
 
 	if ( configs.empty() )
-		exit( 0 );
+		return nullptr;
+
+	// Shaders that would build the same vcs file are compiled once
+	g_ShaderDuplicates.clear();
+	if ( !BuildPlan::Enabled() )
+	{
+		robin_hood::unordered_flat_map<uint64_t, std::vector<size_t>> distinctOfKey; // Configs that are compiled, by DuplicateKeyOf
+		std::vector<bool> arrCopies( configs.size(), false );
+		for ( size_t i = 0; i < configs.size(); ++i )
+		{
+			const CfgProcessor::ShaderConfig& conf = configs[i];
+			std::vector<size_t>& arrDistinct = distinctOfKey[DuplicateKeyOf( conf )];
+			const auto it = std::find_if( arrDistinct.cbegin(), arrDistinct.cend(), [&]( size_t iOther ) { return SameVcsInputs( conf, configs[iOther] ); } );
+			if ( it == arrDistinct.cend() )
+			{
+				arrDistinct.emplace_back( i );
+				continue;
+			}
 
-	CfgProcessor::SetupConfiguration( configs, g_pShaderPath, g_bVerbose );
+			const std::string& original = configs[*it].name;
+			std::cout << clr::green << conf.name << clr::reset << " builds the same vcs file as "sv << clr::green << original << clr::reset << ", it gets a copy"sv << std::endl;
+			g_ShaderDuplicates[original].emplace_back( ShaderDuplicate_t{ conf.name, conf.includes[0] } );
+			arrCopies[i] = true;
+		}
+		std::erase_if( configs, [&]( const CfgProcessor::ShaderConfig& conf ) { return arrCopies[&conf - configs.data()]; } );
+	}
 
-	auto arrEntries = CfgProcessor::DescribeConfiguration( bSpewSkips );
+	std::unique_ptr<CfgProcessor::CfgEntryInfo[]> arrEntries;
+	{
+		const Trace::CScope trace{ "SetupConfiguration" };
+		const fs::path indexPath = g_pShaderPath / "shadercompile.index"sv;
+		if ( nIndexThreads )
+			CfgProcessor::LoadComboIndex( indexPath );
+		CfgProcessor::SetupConfiguration( configs, g_pShaderPath, g_bVerbose, nThreads, nIndexThreads );
+		CfgProcessor::SaveComboIndex( indexPath );
+		arrEntries = CfgProcessor::DescribeConfiguration( bSpewSkips );
+	}
 
-	uint64_t numCompileCommands = 0, numStaticCombos = 0;
+	uint64_t numCompileCommands = 0, numSkippedCommands = 0, numStaticCombos = 0;
 	for ( const CfgProcessor::CfgEntryInfo* pInfo = arrEntries.get(); pInfo && !pInfo->m_szName.empty(); ++pInfo )
 	{
 		numStaticCombos += pInfo->m_numStaticCombos;
-		numCompileCommands = pInfo->m_iCommandEnd;
+		numCompileCommands += pInfo->m_numSurvivingCombos;
+		numSkippedCommands += pInfo->m_numCombos - pInfo->m_numSurvivingCombos;
 	}
 
 	const Clock::time_point tt_end = Clock::now();
 
-	std::cout << "\rCompiling "sv << clr::green << PrettyPrint( numCompileCommands ) << clr::reset << " commands  in "sv << clr::green << PrettyPrint( numStaticCombos ) << clr::reset << " static combos, setup took "sv << clr::green << duration_cast<chrono::seconds>( tt_end - tt_start ).count() << clr::reset << " seconds."sv << endLine;
+	std::cout << "\rCompiling "sv << clr::green << PrettyPrint( numCompileCommands ) << clr::reset << " commands ("sv << clr::green << PrettyPrint( numSkippedCommands ) << clr::reset << " skipped) in "sv << clr::green << PrettyPrint( numStaticCombos ) << clr::reset << " static combos, setup took "sv << clr::green << duration_cast<chrono::seconds>( tt_end - tt_start ).count() << clr::reset << " seconds."sv << endLine;
 
 	return arrEntries;
 }
 
+// Everything that changes the vcs file of the shader: its sources, combos and skips, the compiler and how it is packed
+static uint64_t InputHashOf( const CfgProcessor::CfgEntryInfo* pEntry, const ShaderInfo_t& shaderInfo, uint32_t flags )
+{
+	// Bump when anything else starts to change the output
+	static constexpr uint64_t INPUT_HASH_VERSION = 1;
+
+	const uint64_t arrInputs[] = { INPUT_HASH_VERSION, pEntry->m_nSourceHash, shaderInfo.m_Crc32, pEntry->m_numStaticCombos, pEntry->m_numDynamicCombos, pEntry->m_numSurvivingCombos,
+								   Compiler::Version(), Compiler::FlagsFor( *pEntry, flags ), static_cast<uint64_t>( g_nCompressLevel ), BlockSizeOf( pEntry->m_szName ), static_cast<uint64_t>( StripOf( pEntry->m_szName ) ),
+								   g_bStreamPack, g_bDictionary, g_bBlockIndex, g_bSharedBlobs, g_bDedupStatic, g_iShard, g_nShards };
+	uint64_t nHash = CompileCache::HashBytes( arrInputs, sizeof( arrInputs ), 0 );
+
+	// The order of the map is no input, every entry is hashed on its own
+	if ( const ComboUsage_t* pUsage = UsageOf( pEntry->m_szName ) )
+	{
+		uint64_t nUsage = 0;
+		for ( const auto& [nDynamicCombo, nCount] : *pUsage )
+		{
+			const uint64_t arrEntry[] = { nDynamicCombo, nCount };
+			nUsage += CompileCache::HashBytes( arrEntry, sizeof( arrEntry ), 0 );
+		}
+		nHash = CompileCache::HashBytes( &nUsage, sizeof( nUsage ), nHash );
+	}
+	return nHash;
+}
+
+// -resume: opens the journal of the shader and puts the static combos it has into its table, packed and ready to write
+static void OpenJournal( const CfgProcessor::CfgEntryInfo* pEntry, const ShaderInfo_t& shaderInfo )
+{
+	auto path = GetVCSFilenames( shaderInfo );
+	if ( g_nShards > 1 )
+		path = ShardFragmentPath( path, g_iShard, g_nShards );
+	auto pJournal = std::make_unique<ResumeJournal::CJournal>( path, shaderInfo.m_nInputHash );
+
+	std::vector<uint64_t> arrResumed;
+	CStaticComboTable*& rpStaticCombos = g_ShaderByteCode[pEntry->m_szName];
+	if ( !rpStaticCombos )
+		rpStaticCombos = new CStaticComboTable( pEntry->m_numStaticCombos );
+	for ( ResumeJournal::Record_t record; pJournal->Read( record ); )
+	{
+		if ( record.m_nStaticComboID >= pEntry->m_numStaticCombos || record.m_Code.empty() || rpStaticCombos->Find( record.m_nStaticComboID ) )
+			continue;
+		CStaticCombo* pStComboRec = rpStaticCombos->FindOrAdd( record.m_nStaticComboID );
+		memcpy( pStComboRec->AllocPackedCodeBlock( record.m_Code.size() ), record.m_Code.data(), record.m_Code.size() );
+		pStComboRec->SetPackedHash( record.m_nPackedHash );
+		arrResumed.emplace_back( record.m_nStaticComboID );
+	}
+
+	if ( !arrResumed.empty() )
+	{
+		std::sort( arrResumed.begin(), arrResumed.end() );
+		std::cout << pEntry->m_szName << ": "sv << clr::green << PrettyPrint( arrResumed.size() ) << clr::reset << " of "sv << clr::green << PrettyPrint( pEntry->m_numStaticCombos ) << clr::reset
+				  << " static combos resumed from the journal"sv << std::endl;
+		g_ShaderResumed[pEntry->m_szName] = std::move( arrResumed );
+	}
+	g_ShaderJournal[pEntry->m_szName] = pJournal.release();
+}
+
+// -profile-guided: only the static combos the engine used are compiled, every other one aliases a fallback. That is the
+// first used one with combos that survive the skips, or the first such static combo at all for shaders nothing used.
+// Aliases of -dedup-static stay, the fallback is never one of them.
+static void AliasUnusedStaticCombos( const CfgProcessor::CfgEntryInfo* pEntries )
+{
+	for ( const CfgProcessor::CfgEntryInfo* pEntry = pEntries; pEntry && !pEntry->m_szName.empty(); ++pEntry )
+	{
+		static const std::vector<uint64_t> s_arrNone;
+		const auto itUsed				 = g_ProfileGuided.find( std::string( pEntry->m_szName ) );
+		const std::vector<uint64_t>& arrUsed = itUsed != g_ProfileGuided.end() ? itUsed->second : s_arrNone;
+		std::vector<StaticComboAliasRecordWide_t>& aliases = g_ShaderStaticAliases[pEntry->m_szName];
+
+		const auto& SourceOf = [&aliases]( uint64_t nStaticCombo )
+		{
+			const auto it = std::lower_bound( aliases.cbegin(), aliases.cend(), StaticComboAliasRecordWide_t{ nStaticCombo, 0 }, CompareDupComboIndices );
+			return it != aliases.cend() && it->m_nStaticComboID == nStaticCombo ? it->m_nSourceStaticCombo : nStaticCombo;
+		};
+		const auto& Survives = [pEntry]( uint64_t nStaticCombo )
+		{
+			const uint64_t iEnd = pEntry->m_iCommandEnd - nStaticCombo * pEntry->m_numDynamicCombos;
+			return CfgProcessor::Combo_CountSurviving( iEnd - pEntry->m_numDynamicCombos, iEnd ) != 0;
+		};
+
+		uint64_t nFallback = UINT64_MAX;
+		for ( auto it = arrUsed.cbegin(); nFallback == UINT64_MAX && it != arrUsed.cend() && *it < pEntry->m_numStaticCombos; ++it )
+		{
+			if ( Survives( SourceOf( *it ) ) )
+				nFallback = SourceOf( *it );
+		}
+		for ( uint64_t nStaticCombo = 0; nFallback == UINT64_MAX && nStaticCombo < pEntry->m_numStaticCombos; ++nStaticCombo )
+		{
+			if ( SourceOf( nStaticCombo ) == nStaticCombo && Survives( nStaticCombo ) )
+				nFallback = nStaticCombo;
+		}
+
+		std::vector<StaticComboAliasRecordWide_t> unused;
+		for ( uint64_t nStaticCombo = 0; nFallback != UINT64_MAX && nStaticCombo < pEntry->m_numStaticCombos; ++nStaticCombo )
+		{
+			if ( nStaticCombo != nFallback && SourceOf( nStaticCombo ) == nStaticCombo && !std::binary_search( arrUsed.cbegin(), arrUsed.cend(), nStaticCombo ) )
+				unused.emplace_back( StaticComboAliasRecordWide_t{ nStaticCombo, nFallback } );
+		}
+		const size_t nDeduped = aliases.size();
+		aliases.insert( aliases.end(), unused.cbegin(), unused.cend() );
+		std::inplace_merge( aliases.begin(), aliases.begin() + nDeduped, aliases.end(), CompareDupComboIndices );
+		if ( aliases.empty() )
+			g_ShaderStaticAliases.erase( pEntry->m_szName );
+		else if ( !unused.empty() )
+			std::cout << pEntry->m_szName << ": "sv << clr::green << PrettyPrint( pEntry->m_numStaticCombos - aliases.size() ) << clr::reset << " of "sv << clr::green << PrettyPrint( pEntry->m_numStaticCombos ) << clr::reset
+					  << " static combos compiled, the rest alias static combo "sv << nFallback << std::endl;
+	}
+}
+
 static void CompileShaders( std::unique_ptr<CfgProcessor::CfgEntryInfo[]> arrEntries, uint32_t threads, uint32_t flags )
 {
+	Metrics::EnterPhase( "compile" );
 	ProcessCommandRange_Singleton pcr{ threads, flags };
 
+	CShaderWriter writer;
+	g_pShaderWriter = &writer;
+
 	//
-	// We will iterate on the cfg entries and process them
+	// Stick the shader info of every entry before workers start on them
 	//
+	uint64_t iFirstCommand = 0, iEndCommand = 0;
 	for ( const CfgProcessor::CfgEntryInfo* pEntry = arrEntries.get(); pEntry && !pEntry->m_szName.empty(); ++pEntry )
 	{
-		//
-		// Stick the shader info
-		//
 		ShaderInfo_t siLastShaderInfo;
-		memset( &siLastShaderInfo, 0, sizeof( siLastShaderInfo ) );
-
 		Shader_ParseShaderInfoFromCompileCommands( pEntry, siLastShaderInfo );
+		siLastShaderInfo.m_nInputHash = InputHashOf( pEntry, siLastShaderInfo, flags );
 
 		g_ShaderToShaderInfo[pEntry->m_szName] = siLastShaderInfo;
+		ShaderStats_t& stats	  = g_ShaderStats[pEntry->m_szName];
+		stats.m_pStaticComboTime = ComboStats::Begin( pEntry->m_szName, pEntry->m_numStaticCombos );
+		stats.m_nSurviving		  = pEntry->m_numSurvivingCombos;
+		g_nCombosTotal += pEntry->m_numSurvivingCombos;
+		if ( g_bResume )
+			OpenJournal( pEntry, siLastShaderInfo );
+
+		if ( pEntry == arrEntries.get() )
+			iFirstCommand = pEntry->m_iCommandStart;
+		iEndCommand = pEntry->m_iCommandEnd;
+	}
+
+	g_ShaderStaticAliases.clear();
+	if ( g_bDedupStatic && iFirstCommand < iEndCommand )
+	{
+		std::vector<std::vector<StaticComboAliasRecordWide_t>> arrAliases = StaticDedup::FindAliases( arrEntries.get(), threads );
+		for ( size_t i = 0; i < arrAliases.size(); ++i )
+		{
+			if ( !arrAliases[i].empty() )
+				g_ShaderStaticAliases[arrEntries[i].m_szName] = std::move( arrAliases[i] );
+		}
+	}
+	if ( g_bProfileGuided && iFirstCommand < iEndCommand )
+		AliasUnusedStaticCombos( arrEntries.get() );
 
-		//
-		// Compile stuff
-		//
-		pcr.ProcessCommandRange( pEntry->m_iCommandStart, pEntry->m_iCommandEnd );
+	// Workers and the writer never print straight to the console from here on
+	ConsoleLog::Start();
+	g_flCompileStartTime = Clock::now();
+	if ( iFirstCommand < iEndCommand )
+		pcr.BeginCommandRange( arrEntries.get() );
 
+	//
+	// Shaders are compiled side by side, each one is written as soon as it is finished
+	//
+	for ( const CfgProcessor::CfgEntryInfo* pEntry; iFirstCommand < iEndCommand && ( pEntry = pcr.NextPackagedShader() ) != nullptr; )
+	{
 		if ( pcr.Stoped() )
 			break;
 
-		//
-		// Now when the whole shader is finished we can write it
-		//
 		WriteShaderFiles( pEntry->m_szName );
+
+		// A shader cancelled by -fastfail keeps the times of its last complete build
+		bool bCancelled = false;
+		if ( g_bFastFail )
+		{
+			std::lock_guard guard{ Threading::g_mtxGlobal };
+			bCancelled = g_ShaderHadError.contains( pEntry->m_szName );
+		}
+		if ( !bCancelled )
+			ComboStats::Finish( pEntry->m_szName );
+	}
+
+	if ( iFirstCommand < iEndCommand )
+		pcr.EndCommandRange();
+
+	// Wait for the writes still in flight
+	Metrics::EnterPhase( "write" );
+	writer.Finish();
+	g_pShaderWriter = nullptr;
+	ConsoleLog::Stop();
+
+	ComboStats::Save();
+	ThreadTuner::Save();
+	// The uploads to -shared-cache still queued
+	CompileCache::Finish();
+	Metrics::EnterPhase( "idle" );
+	if ( Status::Enabled() )
+	{
+		std::lock_guard guard{ Threading::g_mtxGlobal };
+		PublishStatus( "done"sv, 0, 0 );
 	}
 
 	std::cout << "\r"sv << clr::escaped( lineRewind ) << endLine;
-}
 
-static LONG WINAPI ExceptionFilter( _EXCEPTION_POINTERS* pExceptionInfo )
-{
-	constexpr const auto iType = static_cast<MINIDUMP_TYPE>( MiniDumpNormal | MiniDumpWithDataSegs | MiniDumpWithIndirectlyReferencedMemory | MiniDumpWithThreadInfo );
+	if ( g_bVerbose )
+	{
+		const auto& PrintLock = []( std::string_view szName, const Threading::LockStats_t& stats )
+		{
+			std::cout << szName << ": "sv << clr::green << PrettyPrint( stats.m_nAcquisitions ) << clr::reset << " acquisitions, "sv << clr::green << PrettyPrint( stats.m_nContended ) << clr::reset << " contended, "sv
+					  << clr::green << PrettyPrint( stats.m_nWaitNanoseconds / 1'000'000 ) << clr::reset << " ms waiting"sv << std::endl;
+		};
+		PrintLock( "Global lock"sv, Threading::g_lsGlobal );
+		PrintLock( "Packaged shaders lock"sv, Threading::g_lsPackaged );
+		PrintLock( "Compiler message locks"sv, Threading::g_lsMessages );
+		if ( iFirstCommand < iEndCommand )
+			pcr.PrintStats();
+		std::cout << "Most shaders waiting for the disk: "sv << clr::green << writer.MaxQueued() << clr::reset << std::endl;
+	}
 
-	// create a unique filename for the minidump based on the current time and module name
-	time_t currTime = time( nullptr );
-	struct tm pTime;
-	localtime_s( &pTime, &currTime );
+	if ( CompileCache::Enabled() )
+	{
+		std::cout << "Compile cache: "sv << clr::green << PrettyPrint( CompileCache::NumHits() ) << clr::reset << " hits, "sv << clr::green << PrettyPrint( CompileCache::NumMisses() ) << clr::reset << " misses"sv;
+		if ( g_bSharedCache )
+			std::cout << ", "sv << clr::green << PrettyPrint( CompileCache::NumSharedHits() ) << clr::reset << " hits from the shared cache, "sv << clr::green << PrettyPrint( CompileCache::NumUploaded() ) << clr::reset << " uploaded"sv;
+		std::cout << std::endl;
+	}
+	if ( g_bPreprocess )
+		std::cout << "Identical preprocessed combos: "sv << clr::green << PrettyPrint( CompileCache::NumRecentHits() ) << clr::reset << std::endl;
+	if ( g_bReuse )
+		std::cout << "Static combos reused from the old vcs files: "sv << clr::green << PrettyPrint( VcsReuse::NumReused() ) << clr::reset << std::endl;
+	if ( g_bSharedBlobs )
+		std::cout << "Static combos already in shared.vcsblob: "sv << clr::green << PrettyPrint( SharedBlobs::NumShared() ) << clr::reset << std::endl;
+	if ( ThreadTuner::Enabled() )
+		std::cout << "Fastest with "sv << clr::green << ThreadTuner::Best() << clr::reset << " threads: "sv << clr::green << PrettyPrint( ThreadTuner::BestRate() ) << clr::reset << " c/s"sv << std::endl;
+	if ( g_bMemoryStats )
+		PrintMemoryStats( "Memory after compiling"sv );
+	else if ( MemoryBudget::Limit() )
+		std::cout << "Most compiled code held in memory: "sv << clr::green << PrettyPrint( MemoryBudget::Peak() >> 20 ) << clr::reset << " of "sv << PrettyPrint( MemoryBudget::Limit() >> 20 ) << " MB"sv << std::endl;
+
+	// Skipped is whatever of the combo space was not compiled, that holds with or without the combo index
+	for ( const CfgProcessor::CfgEntryInfo* pEntry = arrEntries.get(); pEntry && !pEntry->m_szName.empty(); ++pEntry )
+	{
+		const ShaderStats_t& stats = ShaderStats( pEntry->m_szName );
+		const uint64_t nCompiled   = stats.m_nCompiled;
+		const uint64_t nFailed     = stats.m_nFailed;
+		const uint64_t nCancelled  = stats.m_nCancelled;
+		const uint64_t nAliased    = stats.m_nAliased;
+		const uint64_t nResumed    = stats.m_nResumed;
+		const Clock::rep nFirst    = stats.m_nFirstCompile;
+		const int64_t nSeconds     = nFirst && stats.m_tWritten.time_since_epoch().count() > nFirst ? duration_cast<chrono::seconds>( stats.m_tWritten.time_since_epoch() - Clock::duration( nFirst ) ).count() : 0;
+		std::cout << ( nFailed ? clr::red : clr::green ) << pEntry->m_szName << clr::reset << ": "sv << clr::green << PrettyPrint( nCompiled ) << clr::reset << " compiled, "sv
+				  << clr::green << PrettyPrint( pEntry->m_numCombos - std::min( pEntry->m_numCombos, nCompiled + nFailed + nCancelled + nAliased + nResumed ) ) << clr::reset << " skipped, "sv << ( nFailed ? clr::red : clr::green ) << PrettyPrint( nFailed ) << clr::reset << " failed, "sv
+				  << clr::green << PrettyPrint( stats.m_nCacheHits ) << clr::reset << " cache hits, "sv;
+		if ( nCancelled )
+			std::cout << clr::red << PrettyPrint( nCancelled ) << clr::reset << " cancelled, "sv;
+		if ( nAliased )
+			std::cout << clr::green << PrettyPrint( nAliased ) << clr::reset << " aliased, "sv;
+		if ( nResumed )
+			std::cout << clr::green << PrettyPrint( nResumed ) << clr::reset << " resumed, "sv;
+		if ( const uint64_t nRevalidated = stats.m_nRevalidated )
+			std::cout << clr::green << PrettyPrint( nRevalidated ) << clr::reset << " validated again, "sv;
+		if ( g_bMemoryStats && stats.m_nPeakMemory )
+			std::cout << clr::green << PrettyPrint( stats.m_nPeakCode >> 20 ) << clr::reset << " MB of code at most, "sv;
+		std::cout << FormatTimeShort( nSeconds ) << std::endl;
+		if ( Latency::Enabled() && stats.m_Compile.Count() )
+			std::cout << "  compile "sv << Latency::Describe( stats.m_Compile ) << ", pack "sv << Latency::Describe( stats.m_Pack ) << std::endl;
+	}
 
-	// strip off the rest of the path from the .exe name
-	char rgchModuleName[MAX_PATH];
-	::GetModuleFileName( nullptr, rgchModuleName, std::size( rgchModuleName ) );
-	char* pch1 = strchr( rgchModuleName, '.' );
-	if ( pch1 )
-		*pch1 = 0;
-	const char* pch = strchr( rgchModuleName, '\\' );
-	if ( pch )
-		// move past the last slash
-		pch++;
-	else
-		pch = "unknown";
+	if ( Latency::Enabled() )
+	{
+		const auto& PrintWaits = []( std::string_view szName, const Threading::LockStats_t& stats )
+		{
+			if ( stats.m_Waits.Count() )
+				std::cout << szName << " waits: "sv << Latency::Describe( stats.m_Waits ) << std::endl;
+		};
+		PrintWaits( "Global lock"sv, Threading::g_lsGlobal );
+		PrintWaits( "Packaged shaders lock"sv, Threading::g_lsPackaged );
+		PrintWaits( "Compiler message locks"sv, Threading::g_lsMessages );
+		Latency::PrintSlowest();
+	}
+}
 
-	// can't use the normal string functions since we're in tier0
-	char rgchFileName[MAX_PATH];
-	_snprintf_s( rgchFileName, std::size( rgchFileName ),
-		"%s_%d%.2d%2d%.2d%.2d%.2d.mdmp",
-		pch,
-		pTime.tm_year + 1900,	/* Year less 2000 */
-		pTime.tm_mon + 1,		/* month (0 - 11 : 0 = January) */
-		pTime.tm_mday,			/* day of month (1 - 31) */
-		pTime.tm_hour,			/* hour (0 - 23) */
-		pTime.tm_min,			/* minutes (0 - 59) */
-		pTime.tm_sec			/* seconds (0 - 59) */
-		);
+// Reads the static combos of a -shard fragment into staticCombos, duplicates come back as copies of their source.
+// WriteShaderFile finds them again, the ones across fragments as well. Fragments are version 6, or 8 when the ids don't fit.
+static bool LoadShardFragment( const fs::path& path, uint64_t nStaticCombos, CStaticComboTable& staticCombos )
+{
+	constexpr uint32_t endMark = 0xffffffff;
+
+	std::ifstream file( path, std::ios::binary );
+	ShaderHeader_t header;
+	if ( !file || !file.read( reinterpret_cast<char*>( &header ), sizeof( header ) ) || !header.m_nNumStaticCombos )
+		return false;
+	if ( header.m_nVersion != SHADER_VCS_VERSION_NUMBER && header.m_nVersion != SHADER_VCS_WIDE_VERSION_NUMBER )
+		return false;
+	const bool bWide = header.m_nVersion == SHADER_VCS_WIDE_VERSION_NUMBER;
+
+	ShaderHeaderWide_t wideHeader;
+	if ( bWide && !file.read( reinterpret_cast<char*>( &wideHeader ), sizeof( wideHeader ) ) )
+		return false;
+
+	std::vector<StaticComboRecordWide_t> records( header.m_nNumStaticCombos );
+	for ( StaticComboRecordWide_t& rec : records )
+	{
+		StaticComboRecord_t narrowRec;
+		if ( bWide ? !file.read( reinterpret_cast<char*>( &rec ), sizeof( rec ) ) : !file.read( reinterpret_cast<char*>( &narrowRec ), sizeof( narrowRec ) ) )
+			return false;
+		if ( !bWide )
+			rec = { narrowRec.m_nStaticComboID == endMark ? UINT64_MAX : narrowRec.m_nStaticComboID, narrowRec.m_nFileOffset };
+	}
 
-	BOOL bMinidumpResult = FALSE;
-	const HANDLE hFile = ::CreateFile( rgchFileName, GENERIC_WRITE, FILE_SHARE_WRITE, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr );
+	uint32_t nDuplicates;
+	if ( !file.read( reinterpret_cast<char*>( &nDuplicates ), sizeof( nDuplicates ) ) || records.back().m_nStaticComboID != UINT64_MAX )
+		return false;
 
-	if ( hFile )
+	std::vector<StaticComboAliasRecordWide_t> duplicates( nDuplicates );
+	for ( StaticComboAliasRecordWide_t& dup : duplicates )
 	{
-		// dump the exception information into the file
-		MINIDUMP_EXCEPTION_INFORMATION ExInfo;
-		ExInfo.ThreadId = GetCurrentThreadId();
-		ExInfo.ExceptionPointers = pExceptionInfo;
-		ExInfo.ClientPointers = FALSE;
+		StaticComboAliasRecord_t narrowDup;
+		if ( bWide ? !file.read( reinterpret_cast<char*>( &dup ), sizeof( dup ) ) : !file.read( reinterpret_cast<char*>( &narrowDup ), sizeof( narrowDup ) ) )
+			return false;
+		if ( !bWide )
+			dup = { narrowDup.m_nStaticComboID, narrowDup.m_nSourceStaticCombo };
+	}
 
-		bMinidumpResult = MiniDumpWriteDump( ::GetCurrentProcess(), ::GetCurrentProcessId(), hFile, iType, &ExInfo, nullptr, nullptr );
-		CloseHandle( hFile );
+	// The size of a block runs up to the next one
+	for ( size_t i = 0; i + 1 < records.size(); ++i )
+	{
+		const StaticComboRecordWide_t& rec = records[i];
+		const uint32_t nEnd            = records[i + 1].m_nFileOffset;
+		if ( rec.m_nStaticComboID >= nStaticCombos || nEnd < rec.m_nFileOffset + sizeof( endMark ) )
+			return false;
+
+		const size_t nSize   = nEnd - rec.m_nFileOffset - sizeof( endMark );
+		CStaticCombo* pCombo = staticCombos.FindOrAdd( rec.m_nStaticComboID );
+		uint8_t* pCode       = pCombo->AllocPackedCodeBlock( nSize );
+		if ( nSize && ( !file.seekg( rec.m_nFileOffset, std::ios::beg ) || !file.read( reinterpret_cast<char*>( pCode ), nSize ) ) )
+			return false;
+		pCombo->HashPackedCode();
 	}
 
-	// mark any failed minidump writes by renaming them
-	if ( !bMinidumpResult )
+	for ( const StaticComboAliasRecordWide_t& dup : duplicates )
 	{
-		char rgchFailedFileName[_MAX_PATH];
-		_snprintf_s( rgchFailedFileName, std::size( rgchFailedFileName ), "failed_%s", rgchFileName );
-		std::error_code c;
-		fs::rename( rgchFileName, rgchFailedFileName, c );
+		const CStaticCombo* pSource = staticCombos.Find( dup.m_nSourceStaticCombo );
+		if ( !pSource || dup.m_nStaticComboID >= nStaticCombos )
+			return false;
+
+		CStaticCombo* pCombo = staticCombos.FindOrAdd( dup.m_nStaticComboID );
+		if ( const size_t nSize = pSource->PackedSize() )
+			memcpy( pCombo->AllocPackedCodeBlock( nSize ), pSource->Code().GetData(), nSize );
+		pCombo->SetPackedHash( pSource->PackedHash() );
 	}
 
-	return EXCEPTION_CONTINUE_SEARCH;
+	return true;
+}
+
+// -merge, builds every vcs file from the fragments the shards left behind. A shader
+// that is missing a fragment fails like one that didn't compile.
+static void MergeShards( std::unique_ptr<CfgProcessor::CfgEntryInfo[]> arrEntries, uint32_t nShards )
+{
+	for ( const CfgProcessor::CfgEntryInfo* pEntry = arrEntries.get(); pEntry && !pEntry->m_szName.empty(); ++pEntry )
+	{
+		ShaderInfo_t shaderInfo;
+		Shader_ParseShaderInfoFromCompileCommands( pEntry, shaderInfo );
+		g_ShaderToShaderInfo[pEntry->m_szName] = shaderInfo;
+		g_ShaderStats[pEntry->m_szName];
+
+		CStaticComboTable* pStaticCombos     = new CStaticComboTable( pEntry->m_numStaticCombos );
+		g_ShaderByteCode[pEntry->m_szName] = pStaticCombos;
+
+		const fs::path vcsPath = g_pShaderPath / "shaders"sv / "fxc"sv / ( std::string( pEntry->m_szName ) + ".vcs" );
+		for ( uint32_t iShard = 0; iShard < nShards; ++iShard )
+		{
+			const fs::path fragment = ShardFragmentPath( vcsPath, iShard, nShards );
+			if ( !LoadShardFragment( fragment, pEntry->m_numStaticCombos, *pStaticCombos ) )
+			{
+				std::cout << clr::red << "Missing or broken shard fragment "sv << fragment.string() << clr::reset << std::endl;
+				g_ShaderHadError.emplace( pEntry->m_szName );
+				break;
+			}
+		}
+
+		WriteShaderFiles( pEntry->m_szName );
+	}
 }
 
 static void PrintCompileErrors( bool skipWarnings )
@@ -1339,6 +4539,7 @@ static void PrintCompileErrors( bool skipWarnings )
 	//
 	//////////////////////////////////////////////////////////////////////////
 
+	MergeCompilerMsgTables();
 	if ( !g_CompilerMsg.empty() )
 	{
 		size_t totalWarnings = 0, totalErrors = 0;
@@ -1404,35 +4605,426 @@ static void PrintCompileErrors( bool skipWarnings )
 
 	// Failed shaders summary
 	for ( const auto& failed : g_ShaderHadError )
+	{
 		std::cout << clr::escaped( "\033[2K"sv ) << clr::pinkish << "FAILED: "sv << clr::red << failed << clr::reset << std::endl;
+		FailPredict::PrintSkipped( failed );
+	}
 }
 
 static bool s_write = true;
-static BOOL WINAPI CtrlHandler( DWORD signal )
+static void InterruptHandler()
+{
+	s_write = false;
+	if ( auto inst = ProcessCommandRange_Singleton::Instance() )
+		inst->Stop();
+	ConsoleLog::Stop();
+	PrintCompileErrors( false );
+	Platform::KeepAwake( false );
+}
+
+// The primitives of the pipeline on their own, over the combos of the -bench corpus
+static void RunMicroBenchmarks( const std::vector<CfgProcessor::CfgEntryInfo>& arrEntries, uint32_t flags )
+{
+	// Passes over the big entries stop here, so that every one finishes quickly
+	static constexpr uint64_t MAX_PASS_COMMANDS = 1 << 16;
+	static constexpr uint32_t NUM_LOOKUPS		= 4096;
+	static constexpr uint32_t NUM_BLOCK_COMBOS	= 32;
+
+	if ( arrEntries.empty() )
+		return;
+
+	std::cout << "Micro benchmarks:"sv << std::endl;
+	Bench::Measure( "Combo_GetNext"sv, "command"sv, [&arrEntries]
+	{
+		uint64_t nCommands = 0;
+		for ( const CfgProcessor::CfgEntryInfo& entry : arrEntries )
+		{
+			const uint64_t iEnd = std::min( entry.m_iCommandEnd, entry.m_iCommandStart + MAX_PASS_COMMANDS );
+			uint64_t iCommand = entry.m_iCommandStart, nSurviving = 0;
+			CfgProcessor::ComboHandle hCombo = nullptr;
+			for ( CfgProcessor::Combo_GetNext( iCommand, hCombo, iEnd ); hCombo; CfgProcessor::Combo_GetNext( iCommand, hCombo, iEnd ) )
+				++nSurviving;
+			Bench::Consume( nSurviving );
+			nCommands += iEnd - entry.m_iCommandStart;
+		}
+		return nCommands;
+	} );
+
+	for ( const bool bTree : { true, false } )
+	{
+		Bench::Measure( bTree ? "Skip expression tree"sv : "Skip decision graph"sv, "combo"sv, [&arrEntries, bTree]
+		{
+			uint64_t nCombos = 0;
+			for ( const CfgProcessor::CfgEntryInfo& entry : arrEntries )
+			{
+				const uint64_t iEnd = std::min( entry.m_iCommandEnd, entry.m_iCommandStart + MAX_PASS_COMMANDS );
+				Bench::Consume( CfgProcessor::Combo_EvaluateSkips( entry.m_iCommandStart, iEnd, bTree ) );
+				nCombos += iEnd - entry.m_iCommandStart;
+			}
+			return nCombos;
+		} );
+	}
+
+	// Scattered over the whole range like the first claims of the workers, the same ones every run
+	const uint64_t iFirst = arrEntries.front().m_iCommandStart, nCommands = arrEntries.back().m_iCommandEnd - iFirst;
+	Bench::Measure( "Combo_GetCombo"sv, "lookup"sv, [iFirst, nCommands]
+	{
+		uint64_t nSeed = 0x9E3779B97F4A7C15ULL;
+		for ( uint32_t i = 0; i < NUM_LOOKUPS; ++i )
+		{
+			nSeed = nSeed * 6364136223846793005ULL + 1442695040888963407ULL;
+			CfgProcessor::ComboHandle hCombo = CfgProcessor::Combo_GetCombo( iFirst + ( nSeed >> 32 ) % nCommands );
+			Bench::Consume( reinterpret_cast<uintptr_t>( hCombo ) );
+			CfgProcessor::Combo_Free( hCombo );
+		}
+		return NUM_LOOKUPS;
+	} );
+	Bench::Measure( "Combo_FindEntryInfo"sv, "lookup"sv, [iFirst, nCommands]
+	{
+		uint64_t nSeed = 0x9E3779B97F4A7C15ULL;
+		for ( uint32_t i = 0; i < NUM_LOOKUPS; ++i )
+		{
+			nSeed = nSeed * 6364136223846793005ULL + 1442695040888963407ULL;
+			Bench::Consume( reinterpret_cast<uintptr_t>( CfgProcessor::Combo_FindEntryInfo( iFirst + ( nSeed >> 32 ) % nCommands ) ) );
+		}
+		return NUM_LOOKUPS;
+	} );
+
+	// A block of real code laid out the way FlushCombos gets it, compiled as one batch
+	CUtlBuffer block;
+	{
+		std::vector<CfgProcessor::ComboBuildCommand> arrCommands( NUM_BLOCK_COMBOS );
+		std::vector<uint64_t> arrComboNums;
+		uint64_t iCommand = arrEntries.front().m_iCommandStart;
+		CfgProcessor::ComboHandle hCombo = nullptr;
+		CfgProcessor::Combo_GetNext( iCommand, hCombo, arrEntries.front().m_iCommandEnd );
+		for ( ; hCombo && arrComboNums.size() < NUM_BLOCK_COMBOS; CfgProcessor::Combo_GetNext( iCommand, hCombo, arrEntries.front().m_iCommandEnd ) )
+		{
+			CfgProcessor::Combo_BuildCommand( hCombo, arrCommands[arrComboNums.size()] );
+			arrComboNums.emplace_back( CfgProcessor::Combo_GetComboNum( hCombo ) );
+		}
+		CfgProcessor::Combo_Free( hCombo );
+
+		std::vector<const CfgProcessor::ComboBuildCommand*> arrCommandPtrs;
+		for ( size_t i = 0; i < arrComboNums.size(); ++i )
+			arrCommandPtrs.emplace_back( &arrCommands[i] );
+		std::vector<CmdSink::IResponse*> arrResponses( arrCommandPtrs.size(), nullptr );
+		Compiler::SelectBackend( arrEntries.front() ).Compile( arrCommandPtrs.data(), nullptr, arrResponses.data(), arrCommandPtrs.size(), Compiler::FlagsFor( arrEntries.front(), flags ) );
+
+		for ( size_t i = 0; i < arrResponses.size(); ++i )
+		{
+			CmdSink::IResponse* pResponse = arrResponses[i];
+			if ( pResponse && pResponse->Succeeded() && block.TellPut() + pResponse->GetResultBufferLen() + 16 < MAX_SHADER_UNPACKED_BLOCK_SIZE )
+			{
+				block.PutUnsignedInt( gsl::narrow<uint32_t>( arrComboNums[i] ) );
+				block.PutUnsignedInt( gsl::narrow<uint32_t>( pResponse->GetResultBufferLen() ) );
+				block.Put( pResponse->GetResultBuffer(), gsl::narrow<int>( pResponse->GetResultBufferLen() ) );
+			}
+			if ( pResponse )
+				pResponse->Release();
+		}
+	}
+
+	if ( const size_t nBlock = block.TellPut() )
+	{
+		const uint8_t* pBlock = reinterpret_cast<const uint8_t*>( block.Base() );
+		Bench::Measure( "LZMA::OpportunisticCompress"sv, "byte"sv, [pBlock, nBlock]
+		{
+			size_t nCompressed = 0;
+			LZMA::OpportunisticCompress( pBlock, nBlock, &nCompressed, g_nCompressLevel, MAX_SHADER_UNPACKED_BLOCK_SIZE );
+			Bench::Consume( nCompressed );
+			return nBlock;
+		} );
+		Bench::Measure( "CRC32::ProcessSingleBuffer"sv, "byte"sv, [pBlock, nBlock]
+		{
+			Bench::Consume( CRC32::ProcessSingleBuffer( pBlock, nBlock ) );
+			return nBlock;
+		} );
+	}
+}
+
+// Lines of "shader dynamic-combo-id count", counts of the same combo add up and # starts a comment
+static bool LoadComboUsage( const fs::path& path )
+{
+	std::ifstream file( path );
+	if ( !file )
+		return false;
+
+	std::string line;
+	while ( std::getline( file, line ) )
+	{
+		std::istringstream fields( line.substr( 0, line.find( '#' ) ) );
+		std::string shader;
+		uint32_t nComboID;
+		uint64_t nCount;
+		if ( !( fields >> shader ) )
+			continue;
+		if ( !( fields >> nComboID >> nCount ) )
+			return false;
+		g_ComboUsage[shader][nComboID] += nCount;
+	}
+	return true;
+}
+
+// -profile-guided: lines of "shader static-combo-id dynamic-combo-id" the engine recorded, # starts a comment. The dynamic
+// combos count as used once each for -combo-usage, so they are packed first as well.
+static bool LoadProfileGuided( const fs::path& path )
+{
+	std::ifstream file( path );
+	if ( !file )
+		return false;
+
+	std::string line;
+	while ( std::getline( file, line ) )
+	{
+		std::istringstream fields( line.substr( 0, line.find( '#' ) ) );
+		std::string shader;
+		uint64_t nStaticCombo;
+		uint32_t nDynamicCombo;
+		if ( !( fields >> shader ) )
+			continue;
+		if ( !( fields >> nStaticCombo >> nDynamicCombo ) )
+			return false;
+		g_ProfileGuided[shader].emplace_back( nStaticCombo );
+		++g_ComboUsage[shader][nDynamicCombo];
+	}
+
+	for ( auto& [shader, arrUsed] : g_ProfileGuided )
+	{
+		std::sort( arrUsed.begin(), arrUsed.end() );
+		arrUsed.erase( std::unique( arrUsed.begin(), arrUsed.end() ), arrUsed.end() );
+	}
+	return true;
+}
+
+// -load-order: lines of "shader static-combo-id" in the order the engine loaded them, anything after the id is ignored so
+// the file of -profile-guided does as well. Static combos a material loads together come out next to each other.
+static bool LoadStaticLoadOrder( const fs::path& path )
+{
+	std::ifstream file( path );
+	if ( !file )
+		return false;
+
+	std::string line;
+	while ( std::getline( file, line ) )
+	{
+		std::istringstream fields( line.substr( 0, line.find( '#' ) ) );
+		std::string shader;
+		uint64_t nStaticCombo;
+		if ( !( fields >> shader ) )
+			continue;
+		if ( !( fields >> nStaticCombo ) )
+			return false;
+		auto& order = g_StaticLoadOrder[shader];
+		order.try_emplace( nStaticCombo, gsl::narrow<uint32_t>( order.size() ) );
+	}
+	return true;
+}
+
+// -cache-stats: what the compile cache saved every shader, the time is what its hits took to compile when they were cached
+static void PrintCacheStats()
 {
-	if ( signal == CTRL_C_EVENT )
+	std::vector<std::pair<std::string_view, const ShaderStats_t*>> arrShaders;
+	for ( const auto& [name, stats] : g_ShaderStats )
+		arrShaders.emplace_back( name, &stats );
+	std::sort( arrShaders.begin(), arrShaders.end(), []( const auto& a, const auto& b ) { return a.first < b.first; } );
+
+	uint64_t nHits = 0, nMisses = 0, nBytes = 0, nMicroseconds = 0;
+	std::cout << "Compile cache by shader:"sv << std::endl;
+	for ( const auto& [name, pStats] : arrShaders )
 	{
-		s_write = false;
-		if ( auto inst = ProcessCommandRange_Singleton::Instance() )
-			inst->Stop();
-		PrintCompileErrors( false );
-		SetThreadExecutionState( ES_CONTINUOUS );
+		const uint64_t nShaderHits = pStats->m_nCacheHits, nShaderMisses = pStats->m_nCacheMisses;
+		if ( !nShaderHits && !nShaderMisses )
+			continue;
+		std::cout << "  "sv << name << ": "sv << clr::green << PrettyPrint( nShaderHits ) << clr::reset << " hits, "sv << clr::green << PrettyPrint( nShaderMisses ) << clr::reset << " misses ("sv
+				  << clr::green << nShaderHits * 100 / ( nShaderHits + nShaderMisses ) << "%"sv << clr::reset << "), "sv << clr::green << PrettyPrint( pStats->m_nCacheBytes >> 10 ) << clr::reset << " KB of code, "sv
+				  << clr::green << FormatTimeShort( static_cast<int64_t>( pStats->m_nCacheMicroseconds / 1000000 ) ) << clr::reset << " of compiling saved"sv << std::endl;
+		nHits += nShaderHits;
+		nMisses += nShaderMisses;
+		nBytes += pStats->m_nCacheBytes;
+		nMicroseconds += pStats->m_nCacheMicroseconds;
 	}
+	if ( nHits + nMisses )
+		std::cout << "Compile cache hit "sv << clr::green << nHits * 100 / ( nHits + nMisses ) << "%"sv << clr::reset << " of "sv << clr::green << PrettyPrint( nHits + nMisses ) << clr::reset << " combos, "sv
+				  << clr::green << PrettyPrint( nBytes >> 20 ) << clr::reset << " MB of code and "sv << clr::green << FormatTimeShort( static_cast<int64_t>( nMicroseconds / 1000000 ) ) << clr::reset << " of compiling saved"sv << std::endl;
+}
+
+// Everything the metrics thread reads is an atomic or takes its own lock, the workers never notice it
+static void StartMetrics()
+{
+	Metrics::AddGauge( "shadercompile_combos", "Combos of the build that survive the skips", [] { return static_cast<double>( g_nCombosTotal.load() ); } );
+	Metrics::AddGauge( "shadercompile_combos_done", "Combos of the build compiled, failed or skipped so far", [] { return static_cast<double>( g_nCombosDone.load() ); } );
+	Metrics::AddGauge( "shadercompile_combos_per_second", "Combos done a second since the last write of the metrics", []
+	{
+		static uint64_t s_nLastDone = 0;
+		static Clock::time_point s_tLast = Clock::now();
+		const uint64_t nDone		   = g_nCombosDone;
+		const Clock::time_point tNow   = Clock::now();
+		const double flSeconds		   = chrono::duration<double>( tNow - s_tLast ).count();
+		const double flRate			   = flSeconds > 0.0 && nDone >= s_nLastDone ? static_cast<double>( nDone - s_nLastDone ) / flSeconds : 0.0;
+		s_nLastDone					   = nDone;
+		s_tLast						   = tNow;
+		return flRate;
+	} );
+	Metrics::AddCounter( "shadercompile_combos_failed_total", "Combos that failed to compile", [] { return static_cast<double>( g_nCombosFailed.load() ); } );
+	Metrics::AddCounter( "shadercompile_combos_cancelled_total", "Combos -fastfail dropped after their shader failed", [] { return static_cast<double>( g_nCombosCancelled.load() ); } );
+
+	Metrics::AddCounter( "shadercompile_cache_hits_total", "Compile cache hits, shared ones included", [] { return static_cast<double>( CompileCache::NumHits() ); } );
+	Metrics::AddCounter( "shadercompile_cache_misses_total", "Compile cache misses", [] { return static_cast<double>( CompileCache::NumMisses() ); } );
+	Metrics::AddCounter( "shadercompile_cache_recent_hits_total", "Combos that preprocessed to the text of one compiled just before", [] { return static_cast<double>( CompileCache::NumRecentHits() ); } );
+	Metrics::AddCounter( "shadercompile_cache_shared_hits_total", "Hits of the shared compile cache", [] { return static_cast<double>( CompileCache::NumSharedHits() ); } );
+	Metrics::AddCounter( "shadercompile_cache_uploads_total", "Entries copied to the shared compile cache", [] { return static_cast<double>( CompileCache::NumUploaded() ); } );
+	Metrics::AddGauge( "shadercompile_peak_memory_bytes", "Largest the working set of the process got so far", [] { return static_cast<double>( Platform::PeakMemory() ); } );
+
+	static const std::pair<const char*, const Threading::LockStats_t&> arrLocks[] = {
+		{ "{lock=\"global\"}", Threading::g_lsGlobal },
+		{ "{lock=\"packaged\"}", Threading::g_lsPackaged },
+		{ "{lock=\"messages\"}", Threading::g_lsMessages },
+	};
+	static std::vector<std::string> s_arrNames; // Metrics keeps the names, not copies of them
+	s_arrNames.reserve( std::size( arrLocks ) * 3 );
+	const auto& AddLocks = [&]( const char* szName, const char* szHelp, double ( *fnValue )( const Threading::LockStats_t& ) )
+	{
+		for ( const auto& [szLabels, stats] : arrLocks )
+		{
+			const Threading::LockStats_t* pStats = &stats;
+			Metrics::AddCounter( s_arrNames.emplace_back( std::string( szName ) + szLabels ).c_str(), szHelp, [pStats, fnValue] { return fnValue( *pStats ); } );
+		}
+	};
+	AddLocks( "shadercompile_lock_acquisitions_total", "Times the lock was taken", []( const Threading::LockStats_t& stats ) { return static_cast<double>( stats.m_nAcquisitions.load() ); } );
+	AddLocks( "shadercompile_lock_contended_total", "Times the lock had to be waited for", []( const Threading::LockStats_t& stats ) { return static_cast<double>( stats.m_nContended.load() ); } );
+	AddLocks( "shadercompile_lock_wait_seconds_total", "Time spent waiting for the lock", []( const Threading::LockStats_t& stats ) { return static_cast<double>( stats.m_nWaitNanoseconds.load() ) / 1e9; } );
+	Metrics::Start();
+}
+
+static void WriteStats( bool skipWarnings )
+{
+	if ( s_write )
+		PrintCompileErrors( skipWarnings );
+
+	if ( g_bCacheStats && CompileCache::Enabled() )
+		PrintCacheStats();
+
+	//
+	// End
+	//
+	const Clock::time_point end = Clock::now();
+
+	std::cout << "\r"sv << clr::green << FormatTime( duration_cast<chrono::seconds>( end - g_flStartTime ).count() ) << clr::reset << " elapsed"sv << std::endl;
+}
+
+// -watch: forgets everything about the last build, the file cache and the compile cache stay warm
+static void ResetBuildState()
+{
+	for ( const auto& [name, pStaticCombos] : g_ShaderByteCode )
+		delete pStaticCombos;
+	for ( const auto& [name, pSpill] : g_ShaderSpill )
+		delete pSpill;
+	for ( const auto& [name, pPrevious] : g_ShaderPrevious )
+		delete pPrevious;
+	for ( const auto& [name, pJournal] : g_ShaderJournal )
+		delete pJournal;
+	g_ShaderByteCode.clear();
+	g_ShaderSpill.clear();
+	g_ShaderPrevious.clear();
+	g_ShaderJournal.clear();
+	g_ShaderResumed.clear();
+	g_ShaderByteCodeIntern.clear();
+	g_ShaderToShaderInfo.clear();
+	g_ShaderStats.clear();
+	g_ShaderHadError.clear();
+	g_ShaderWrittenToDisk.clear();
+	g_CompilerMsg.clear();
+	g_ShaderDuplicates.clear();
+	FailPredict::Reset();
+	g_nCombosTotal = 0;
+	g_nCombosDone  = 0;
+	CfgProcessor::ResetConfiguration();
+	Parser::ForgetParsedSources();
+}
 
-	return FALSE;
+// What the build writes itself below the shader path, changes to it don't start another build
+static bool IsBuildOutput( std::string_view name )
+{
+	using namespace std::literals;
+	return name.starts_with( "shaders/"sv ) || name.starts_with( "include/"sv ) || name.ends_with( ".stats"sv ) || name.ends_with( ".tmp"sv );
 }
 
-static void WriteStats( bool skipWarnings )
-{
-	if ( s_write )
-		PrintCompileErrors( skipWarnings );
+// -watch: waits for files below the shader path to change and builds again. Parsing only reads what changed,
+// the crc check then leaves every shader whose sources are the same. Runs until Ctrl+C.
+template <typename Parse>
+static int WatchShaders( const std::set<ShaderInputData>& files, const Parse& parse, uint32_t threads, uint32_t flags )
+{
+	using namespace std::literals;
+	// Editors save in bursts, more changes this soon after the last one join its build
+	static constexpr uint32_t SETTLE_MS = 200;
+
+	Platform::CDirectoryWatch watch( g_pShaderPath );
+	if ( !watch.IsValid() )
+	{
+		std::cout << clr::red << clr::bold << "ERROR: Can't watch "sv << g_pShaderPath.string() << clr::reset << std::endl;
+		return -1;
+	}
+
+	for ( ;; )
+	{
+		std::cout << "Watching "sv << clr::green << g_pShaderPath.string() << clr::reset << " for changes, Ctrl+C to stop"sv << std::endl;
+
+		std::vector<std::string> changed;
+		bool bSources = false;
+		while ( !bSources )
+		{
+			changed.clear();
+			if ( !watch.Wait( UINT32_MAX, changed ) )
+				break;
+			for ( size_t nSeen = 0; nSeen != changed.size(); )
+			{
+				nSeen = changed.size();
+				if ( !watch.Wait( SETTLE_MS, changed ) )
+					break;
+			}
+			bSources = std::any_of( changed.cbegin(), changed.cend(), []( const std::string& name ) { return !IsBuildOutput( name ); } );
+		}
+		if ( !bSources )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: Lost the watch on "sv << g_pShaderPath.string() << clr::reset << std::endl;
+			return -1;
+		}
+
+		// An empty name means the changes didn't all fit, anything may be stale
+		if ( std::find( changed.cbegin(), changed.cend(), std::string() ) != changed.cend() )
+			fileCache.Clear();
+		else
+		{
+			for ( const std::string& name : changed )
+				fileCache.Forget( name );
+		}
 
-	//
-	// End
-	//
-	const Clock::time_point end = Clock::now();
+		// Only the shaders that read one of the files are checked, and those the graph doesn't know yet
+		std::set<ShaderInputData> affected;
+		if ( std::find( changed.cbegin(), changed.cend(), std::string() ) != changed.cend() )
+			affected = files;
+		else
+		{
+			const std::set<std::string> dependents = IncludeGraph::Dependents( changed );
+			std::copy_if( files.cbegin(), files.cend(), std::inserter( affected, affected.end() ), [&dependents]( const ShaderInputData& file )
+			{
+				const std::string name = Parser::ConstructName( file.name, file.target, file.version );
+				return dependents.contains( name ) || !IncludeGraph::Knows( name );
+			} );
+		}
 
-	std::cout << "\r"sv << clr::green << FormatTime( duration_cast<chrono::seconds>( end - g_flStartTime ).count() ) << clr::reset << " elapsed"sv << std::endl;
+		ResetBuildState();
+		g_flStartTime = Clock::now();
+		bool bFailed  = false;
+		if ( auto entries = affected.empty() ? nullptr : parse( std::move( affected ), false, bFailed ) )
+		{
+			CompileShaders( std::move( entries ), threads, flags );
+			WriteStats( false );
+		}
+		else if ( !bFailed )
+			std::cout << "All shaders are up to date"sv << std::endl;
+	}
 }
 
 static constexpr const char* const validTypes[] =
@@ -1445,18 +5037,60 @@ static constexpr const char* const validModels[] =
 	"20b", "30", "40", "41", "50", "51"
 };
 
-int main( int argc, const char* argv[] )
+static constexpr const char* const validProfiles[] =
+{
+	"dev", "release"
+};
+
+// -list: a shader per line, followed by its comma separated versions or none for defaultVersion, // starts a comment.
+// Every version of a shader is an entry of its own.
+static bool ReadShaderList( const fs::path& path, std::string_view defaultVersion, std::vector<std::pair<std::string, std::string>>& shaders )
 {
+	std::ifstream file( path );
+	if ( !file )
 	{
-		const HANDLE console = GetStdHandle( STD_OUTPUT_HANDLE );
-		DWORD mode;
-		GetConsoleMode( console, &mode );
-		if ( SetConsoleMode( console, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING ) )
-			std::cout << clr::colorize;
-		else
-			std::cout << clr::nocolorize;
-		SetConsoleCtrlHandler( CtrlHandler, true );
+		std::cout << clr::red << clr::bold << "ERROR: Couldn't open shader list \""sv << path.string() << "\""sv << clr::reset << std::endl;
+		return false;
+	}
+
+	std::string line;
+	for ( uint32_t nLine = 1; std::getline( file, line ); ++nLine )
+	{
+		std::istringstream fields( line.substr( 0, line.find( "//"sv ) ) );
+		std::string shader, versions;
+		if ( !( fields >> shader ) )
+			continue;
+		if ( !( fields >> versions ) )
+			versions = defaultVersion;
+		if ( versions.empty() )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: "sv << shader << " on line "sv << nLine << " of the shader list has no version and -ver isn't set"sv << clr::reset << std::endl;
+			return false;
+		}
+
+		for ( std::string_view spec = versions; !spec.empty(); )
+		{
+			const size_t nComma			   = spec.find( ',' );
+			const std::string_view version = spec.substr( 0, nComma );
+			spec.remove_prefix( nComma == std::string_view::npos ? spec.size() : nComma + 1 );
+			if ( std::find( std::begin( validModels ), std::end( validModels ), version ) == std::end( validModels ) )
+			{
+				std::cout << clr::red << clr::bold << "ERROR: Invalid version \""sv << version << "\" on line "sv << nLine << " of the shader list"sv << clr::reset << std::endl;
+				return false;
+			}
+			shaders.emplace_back( shader, version );
+		}
 	}
+	return true;
+}
+
+int main( int argc, const char* argv[] )
+{
+	if ( Platform::EnableTerminalColors() )
+		std::cout << clr::colorize;
+	else
+		std::cout << clr::nocolorize;
+	Platform::SetInterruptHandler( InterruptHandler );
 
 	bool parseLegacy = false;
 	for ( int i = 1; i < argc; i++ )
@@ -1484,13 +5118,69 @@ int main( int argc, const char* argv[] )
 	}
 	else
 	{
-		cmdLine.add( "", true, -1, ',', "Sets shader version", "-ver", "/ver", new ez::ezOptionValidator{ ez::ezOptionValidator::T, ez::ezOptionValidator::IN, validModels, std::size( validModels ), false } );
+		cmdLine.add( "", false, -1, ',', "Sets shader version", "-ver", "/ver", new ez::ezOptionValidator{ ez::ezOptionValidator::T, ez::ezOptionValidator::IN, validModels, std::size( validModels ), false } );
 		cmdLine.add( "", true, 1, 0, "Base path for shaders", "-shaderpath", "/shaderpath" );
+		cmdLine.add( "", false, 1, 0, "File of shaders to compile in this one process, one per line followed by its comma separated versions, -ver is for the lines without", "-list", "/list" );
 		cmdLine.add( "", false, 0, 0, "Skip crc check during compilation", "-force", "/force" );
 		cmdLine.add( "", false, 0, 0, "Calculate crc for shader", "-crc", "/crc" );
+		cmdLine.add( "", false, 1, 0, "Print which of the shaders read any of these comma separated files, from the include graph of the last build", "-affected", "/affected" );
 		cmdLine.add( "", false, 0, 0, "Generate only header", "-dynamic", "/dynamic" );
-		cmdLine.add( "", false, 0, 0, "Stop on first error", "-fastfail", "/fastfail" );
+		cmdLine.add( "", false, 0, 0, "Stop compiling a shader at its first error and drop the rest of its combos, the other shaders go on", "-fastfail", "/fastfail" );
+		cmdLine.add( "", false, 0, 0, "Learn which static define values the failures of a shader come with and compile only a sample of the other static combos expected to fail", "-predict-failures", "/predict-failures" );
 		cmdLine.add( "0", false, 1, 0, "Number of threads used, defaults to core count", "-threads", "/threads" );
+		cmdLine.add( "", false, 1, 0, "Directory of the persistent compile cache, disabled if not set", "-cache", "/cache" );
+		cmdLine.add( "", false, 1, 0, "Directory on a network share other machines keep a compile cache in as well, -cache is checked first and what it misses is copied from here", "-shared-cache", "/shared-cache" );
+		cmdLine.add( "0", false, 1, 0, "Megabytes the -cache directory is trimmed to after a build, least recently used first, 0 keeps everything", "-cache-size", "/cache-size" );
+		cmdLine.add( "", false, 0, 0, "Print the compile cache hits and misses of every shader and the code and compile time they saved at the end", "-cache-stats", "/cache-stats" );
+		cmdLine.add( "", false, 0, 0, "Only clean up the -cache directory: temp files left behind, entries of older versions and what doesn't fit -cache-size", "-cache-gc", "/cache-gc" );
+		cmdLine.add( "", false, 0, 0, "Preprocess every combo first, combos with identical preprocessed code are compiled once", "-preprocess", "/preprocess" );
+		cmdLine.add( "", false, 0, 0, "Preprocess every static combo before compiling, ones that preprocess like another are not compiled and alias it", "-dedup-static", "/dedup-static" );
+		cmdLine.add( "5", false, 1, 0, "Set LZMA compression level of shader blocks (0-9), 0-4 are fast, 9 is smallest", "-compress-level", "/compress-level" );
+		cmdLine.add( "", false, 0, 0, "Don't index the combos that survive skips up front", "-no-combo-index", "/no-combo-index" );
+		cmdLine.add( "", false, 0, 0, "Keep packed static combos in a temp file instead of memory until the shader is written", "-spill", "/spill" );
+		cmdLine.add( "", false, 1, 0, "Megabytes of compiled code held in memory, past 3/4 of it packed static combos are spilled and past it workers wait", "-max-memory", "/max-memory" );
+		cmdLine.add( "", false, 0, 0, "Print what the big stores hold after parsing, as every shader is written and at the end", "-memory-stats", "/memory-stats" );
+		cmdLine.add( "", false, 0, 0, "Copy static combos that compiled to the same code as last time from the old vcs files instead of packing them again", "-reuse", "/reuse" );
+		cmdLine.add( "", false, 1, 0, "Comma separated shaders (* for all) whose code is packed without the comment blocks the engine doesn't read, shader:all also drops the constant table", "-strip", "/strip" );
+		cmdLine.add( "", false, 0, 0, "Prime the LZMA blocks of every shader with a dictionary of its code, writes version 7 vcs files that need the reader in scripts/headers", "-dictionary", "/dictionary" );
+		cmdLine.add( "", false, 0, 0, "Write an index of where every dynamic combo is in its static combo's blocks, makes version 7 vcs files that need scripts/headers/vcsloader.h", "-block-index", "/block-index" );
+		cmdLine.add( "", false, 0, 0, "Keep static combos in one shaders/fxc/shared.vcsblob, code that is the same in several shaders is stored once, makes version 7 vcs files that need scripts/headers/vcsloader.h", "-shared-blobs", "/shared-blobs" );
+		cmdLine.add( "", false, 1, 0, "Comma separated KB (1-128) blocks of dynamic combos are flushed at, shader:KB for one shader, the later ones win", "-block-size", "/block-size" );
+		cmdLine.add( "", false, 1, 0, "File of \"shader dynamic-combo-id count\" lines, used combos get packed first, most used first, in small blocks of their own", "-combo-usage", "/combo-usage" );
+		cmdLine.add( "", false, 1, 0, "File of \"shader static-combo-id dynamic-combo-id\" lines the engine used, only their static combos are compiled and written first, the others alias one of them until the whole build that follows in the background", "-profile-guided", "/profile-guided" );
+		cmdLine.add( "", false, 1, 0, "File of \"shader static-combo-id\" lines in the order the engine loaded them, the vcs files store their static combos in that order and become version 7 that needs scripts/headers/vcsloader.h, -profile-guided uses its own file", "-load-order", "/load-order" );
+		cmdLine.add( "", false, 0, 0, "Have a thread compile all dynamic combos of a static combo back to back and pack it itself", "-static-claims", "/static-claims" );
+		cmdLine.add( "", false, 0, 0, "Compress the blocks of a static combo side by side on the cores of workers that ran out of combos, shortens the end of a build", "-parallel-blocks", "/parallel-blocks" );
+		cmdLine.add( "", false, 0, 0, "Pack the dynamic combos of a static combo into blocks as they finish instead of once all of them have, highest id first", "-stream-pack", "/stream-pack" );
+		cmdLine.add( "", false, 0, 0, "Keep a journal of the packed static combos of every shader in progress next to its vcs file and pick up from it after a crash or Ctrl+C", "-resume", "/resume" );
+		cmdLine.add( "0", false, 1, 0, "Every this many seconds write the shaders still compiling with the static combos done so far, the others read the closest one done before them", "-preview", "/preview" );
+		cmdLine.add( "", false, 1, 0, "Comma separated shaders to compile first, shader:expression only the static combos the expression is true for, written like a skip. Those get written to the vcs file before the rest", "-priority", "/priority" );
+		cmdLine.add( "0", false, 1, 0, "Number of worker threads that hand their compiles to a child process each, 0 compiles everything in this process", "-processes", "/processes" );
+		cmdLine.add( "", false, 0, 0, "Used by -processes to start its children", "-worker-process" );
+		cmdLine.add( "", false, 1, 0, "Used by -processes to hand its children the sources it read", "-worker-sources" );
+		cmdLine.add( "", false, 1, 0, "Also compile on remote workers, comma separated host:port/connections, every connection adds a worker thread", "-remote", "/remote" );
+		cmdLine.add( "", false, 1, 0, "Run as a remote worker on [host:]port, loopback unless a host is given, and compile for -remote coordinators, the shader path must match theirs", "-worker-listen", "/worker-listen" );
+		cmdLine.add( "", false, 1, 0, "Secret that -remote coordinators hand their remote workers and -worker-listen checks, needed to listen on anything but loopback", "-worker-token", "/worker-token" );
+		cmdLine.add( "", false, 0, 0, "Run at low priority and only use the processors and memory the rest of the system leaves idle", "-background", "/background" );
+		cmdLine.add( "", false, 0, 0, "Find the number of threads, up to -threads, that compiles the most combos a second, and start from it on this machine next time", "-auto-threads", "/auto-threads" );
+		cmdLine.add( "", false, 0, 0, "Stay running after the build and build again whenever files below the shader path change, until Ctrl+C", "-watch", "/watch" );
+		cmdLine.add( "", false, 1, 0, "Compile only shard i/N of the static combos of every shader and write them as fragments next to the vcs files", "-shard", "/shard" );
+		cmdLine.add( "", false, 1, 0, "Build the vcs files from the fragments of N shards instead of compiling", "-merge", "/merge" );
+		cmdLine.add( "", false, 1, 0, "Write a Chrome trace of every phase of the build to this json file, for chrome://tracing or Perfetto", "-trace", "/trace" );
+		cmdLine.add( "", false, 1, 0, "Keep the counters of the build in this Prometheus text file for the node_exporter textfile collector", "-metrics", "/metrics" );
+		cmdLine.add( "10", false, 1, 0, "Seconds between writes of the -metrics file", "-metrics-interval", "/metrics-interval" );
+		cmdLine.add( "", false, 1, 0, "Serve the progress of the build as json on this port of 127.0.0.1, every connection gets the latest", "-status-port", "/status-port" );
+		cmdLine.add( "", false, 1, 0, "Build a synthetic corpus written to the shader path and report the speed of every phase, settings like shaders=4,static=5,dynamic=4,skips=2,includes=2,cost=8", "-bench", "/bench" );
+		cmdLine.add( "", false, 1, 0, "Write compile time, size and instructions of every combo to this csv file, or json if it ends in .json", "-report", "/report" );
+		cmdLine.add( "", false, 0, 0, "Find the defines that don't change the code of some combos and suggest SKIP expressions for them", "-analyze", "/analyze" );
+		cmdLine.add( "", false, 1, 0, "Print p50, p90, p99 and max of compiles and packing of every shader and of the lock waits, and this many of the slowest compiles", "-latency", "/latency" );
+		cmdLine.add( "", false, 0, 0, "Only print what the build would do for every shader: up to date or not, the combos that survive, compile cache hits and the time predicted from the last run", "-plan", "/plan" );
+		cmdLine.add( "", false, 1, 0, "Compile with this d3dcompiler compatible library, e.g. d3dcompiler_47.dll or libvkd3d-utils.so.1", "-compiler-lib", "/compiler-lib" );
+		cmdLine.add( "", false, 0, 0, "Print sizes, compression and duplicates of the given vcs files", "-inspect", "/inspect" );
+		cmdLine.add( "", false, 0, 0, "Check that the given vcs files are well formed and every block decodes", "-verify", "/verify" );
+		cmdLine.add( "", false, 0, 0, "Compare two vcs files static combo by static combo: old.vcs new.vcs", "-diff", "/diff" );
+		cmdLine.add( "", false, 0, 0, "Write a patch of the static combos that changed between two vcs files: old.vcs new.vcs patch", "-make-patch", "/make-patch" );
+		cmdLine.add( "", false, 0, 0, "Apply a patch of -make-patch to the vcs file it was made from: old.vcs patch new.vcs", "-apply-patch", "/apply-patch" );
 		cmdLine.add( "", false, 0, 0, "Shows help", "-help", "-h", "/help", "/h" );
 
 		cmdLine.add( "", false, 0, 0, "Verbose file cache and final shader info", "-verbose", "/verbose" );
@@ -1498,23 +5188,24 @@ int main( int argc, const char* argv[] )
 		cmdLine.add( "", false, 0, 0, "Enables preprocessor debug printing", "-verbose_preprocessor" );
 
 		cmdLine.add( "", false, 0, 0, "Skips shader validation", "/Vd", "-no-validation" );
+		cmdLine.add( "", false, 1, 0, "Validate one in N combos of every static combo and the ones whose code is new, the others compile without validation", "-validate-sample", "/validate-sample" );
 		cmdLine.add( "", false, 0, 0, "Directs the compiler to not use flow-control constructs where possible", "/Gfa", "-no-flow-control" );
 		cmdLine.add( "", false, 0, 0, "Directs the compiler to use flow-control constructs where possible", "/Gfp", "-prefer-flow-control" );
 		cmdLine.add( "", false, 0, 0, "Disables shader optimization", "/Od", "-disable-optimization" );
 		cmdLine.add( "", false, 0, 0, "Enable debugging information", "/Zi", "-debug-info" );
 		cmdLine.add( "1", false, 1, 0, "Set optimization level (0-3)", "/O", "-optimize" );
+		cmdLine.add( "release", false, 1, 0, "Compile profile: release optimizes every shader, dev skips optimization except for shaders with \"// PROFILE: release\"", "-profile", "/profile", new ez::ezOptionValidator{ ez::ezOptionValidator::T, ez::ezOptionValidator::IN, validProfiles, std::size( validProfiles ), false } );
 		cmdLine.add( "", false, -1, ',', "Set shader type, if compiling multiple different shaders, values can be separated by ','", "/T", "-types", new ez::ezOptionValidator{ ez::ezOptionValidator::T, ez::ezOptionValidator::IN, validTypes, std::size( validTypes ), false } );
 		cmdLine.add( "", false, 0, 0, "Generate ShaderComboSemantics_t and friends for shader", "-csgo", "/csgo" );
+		cmdLine.add( "", false, 0, 0, "Check combos against a table of the ones that survive the skips in GetIndex, needs cshader.h from this repo", "-skip-tables", "/skip-tables" );
 	}
 
 	cmdLine.parse( argc, argv );
 
 	if ( cmdLine.isSet( "-help" ) )
 	{
-		CONSOLE_SCREEN_BUFFER_INFO csbi;
-		GetConsoleScreenBufferInfo( GetStdHandle( STD_OUTPUT_HANDLE ), &csbi );
 		std::string usage;
-		cmdLine.getUsageDescriptions( usage, csbi.srWindow.Right - csbi.srWindow.Left + 1, ez::ezOptionParser::ALIGN );
+		cmdLine.getUsageDescriptions( usage, Platform::ConsoleWidth(), ez::ezOptionParser::ALIGN );
 		std::cout << cmdLine.overview << "\n\n"
 				  << "Usage: "sv << cmdLine.syntax << "\n\n"sv
 				  << clr::green << clr::bold << "OPTIONS:\n"sv
@@ -1522,6 +5213,87 @@ int main( int argc, const char* argv[] )
 		return 0;
 	}
 
+	// Only where something gets compiled, the vcs file tools work without it. The children and remote workers compile with it too.
+	const auto& LoadCompiler = [&cmdLine, parseLegacy]
+	{
+		std::string compilerLib;
+		if ( !parseLegacy )
+			cmdLine.get( "-compiler-lib" )->getString( compilerLib );
+		if ( Compiler::LoadCompilerLibrary( compilerLib ) )
+			return true;
+		std::cout << clr::red << clr::bold << "ERROR: Couldn't load the compiler library "sv << ( compilerLib.empty() ? "libvkd3d-utils.so.1"sv : std::string_view( compilerLib ) ) << clr::reset << std::endl;
+		return false;
+	};
+
+	// Child of -processes, compiles whatever the parent sends until it goes away
+	if ( !parseLegacy && cmdLine.isSet( "-worker-process" ) )
+	{
+		if ( !LoadCompiler() )
+			return -1;
+		std::string path, sources;
+		cmdLine.get( "-shaderpath" )->getString( path );
+		if ( cmdLine.isSet( "-worker-sources" ) )
+			cmdLine.get( "-worker-sources" )->getString( sources );
+		return WorkerProcess::Serve( fs::absolute( std::move( path ) ), sources );
+	}
+
+	// Remote worker, compiles for any coordinator that connects until it is killed
+	if ( !parseLegacy && cmdLine.isSet( "-worker-listen" ) )
+	{
+		if ( !LoadCompiler() )
+			return -1;
+		std::string path, address, token;
+		cmdLine.get( "-shaderpath" )->getString( path );
+		cmdLine.get( "-worker-listen" )->getString( address );
+		if ( cmdLine.isSet( "-worker-token" ) )
+			cmdLine.get( "-worker-token" )->getString( token );
+		return WorkerProcess::Listen( address, token, fs::absolute( std::move( path ) ) );
+	}
+
+	// Working on finished vcs files, nothing gets compiled
+	if ( !parseLegacy && ( cmdLine.isSet( "-inspect" ) || cmdLine.isSet( "-verify" ) || cmdLine.isSet( "-diff" ) || cmdLine.isSet( "-make-patch" ) || cmdLine.isSet( "-apply-patch" ) ) )
+	{
+		if ( cmdLine.isSet( "-make-patch" ) || cmdLine.isSet( "-apply-patch" ) )
+		{
+			const bool bMake = cmdLine.isSet( "-make-patch" );
+			if ( cmdLine.lastArgs.size() != 3 )
+			{
+				std::cout << clr::red << clr::bold << "ERROR: "sv << ( bMake ? "-make-patch"sv : "-apply-patch"sv ) << " takes three files"sv << clr::reset << std::endl;
+				return -1;
+			}
+			const std::string &first = *cmdLine.lastArgs[0], &second = *cmdLine.lastArgs[1], &third = *cmdLine.lastArgs[2];
+			return bMake ? VcsPatch::Make( first, second, third ) : VcsPatch::Apply( first, second, third );
+		}
+
+		unsigned long threads = 0;
+		cmdLine.get( "-threads" )->getULong( threads );
+		if ( !threads )
+			threads = Platform::NumLogicalProcessors();
+
+		const bool bVerbose = cmdLine.isSet( "-verbose" );
+		if ( cmdLine.isSet( "-diff" ) )
+		{
+			if ( cmdLine.lastArgs.size() != 2 )
+			{
+				std::cout << clr::red << clr::bold << "ERROR: -diff takes two vcs files"sv << clr::reset << std::endl;
+				return -1;
+			}
+			return VcsInspect::Diff( *cmdLine.lastArgs[0], *cmdLine.lastArgs[1], threads, bVerbose );
+		}
+
+		int result = 0;
+		const bool bInspect = cmdLine.isSet( "-inspect" );
+		for ( const std::string* file : cmdLine.lastArgs )
+		{
+			if ( ( bInspect ? VcsInspect::Inspect( *file, threads, bVerbose ) : VcsInspect::Verify( *file, threads ) ) != 0 )
+				result = -1;
+		}
+		return result;
+	}
+
+	if ( !LoadCompiler() )
+		return -1;
+
 	g_flStartTime = Clock::now();
 
 	uint32_t flags = 0;
@@ -1559,7 +5331,17 @@ int main( int argc, const char* argv[] )
 		break;
 	}
 
-	if ( std::vector<std::string> badOptions; !cmdLine.gotRequired( badOptions ) || ( !parseLegacy && cmdLine.lastArgs.size() < 1 ) )
+	if ( !parseLegacy && cmdLine.isSet( "-profile" ) )
+	{
+		std::string profile;
+		cmdLine.get( "-profile" )->getString( profile );
+		Compiler::SetProfile( profile == "dev"sv ? Compiler::Profile::Dev : Compiler::Profile::Release );
+	}
+
+	const bool bBench = !parseLegacy && cmdLine.isSet( "-bench" );
+	const bool bList  = !parseLegacy && cmdLine.isSet( "-list" );
+	const bool bCacheGc = !parseLegacy && cmdLine.isSet( "-cache-gc" );
+	if ( std::vector<std::string> badOptions; !cmdLine.gotRequired( badOptions ) || ( !parseLegacy && !bBench && !bList && !bCacheGc && cmdLine.lastArgs.size() < 1 ) )
 	{
 		std::cout << clr::red << clr::bold << "ERROR: Missing argument"sv << ( badOptions.size() == 1 ? ": "sv : "s:\n"sv ) << clr::reset;
 		for ( const auto& option : badOptions )
@@ -1568,6 +5350,13 @@ int main( int argc, const char* argv[] )
 		return -1;
 	}
 
+	// The lines of -list can bring their own versions
+	if ( !parseLegacy && !bList && !cmdLine.isSet( "-ver" ) )
+	{
+		std::cout << clr::red << clr::bold << "ERROR: Missing argument: "sv << clr::reset << "-ver"sv << std::endl << std::endl;
+		return -1;
+	}
+
 	if ( std::vector<std::string> badOptions; !cmdLine.gotExpected( badOptions ) )
 	{
 		std::cout << clr::red << clr::bold << "ERROR: Got unexpected number of arguments for option"sv << ( badOptions.size() == 1 ? ": "sv : "s:\n"sv ) << clr::reset;
@@ -1587,6 +5376,51 @@ int main( int argc, const char* argv[] )
 
 	auto targets = cmdLine.get( "-types" );
 	auto versions = cmdLine.get( "-ver" );
+
+	// The shaders of the list join those on the command line, every one with a version of its own from here on
+	if ( bList )
+	{
+		if ( ( !versions->args.empty() && versions->args[0]->size() > 1 ) || ( !targets->args.empty() && targets->args[0]->size() > 1 ) )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: -list takes a single -ver and -types for all shaders"sv << clr::reset << std::endl;
+			return -1;
+		}
+		if ( bBench )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: -list can't be combined with -bench"sv << clr::reset << std::endl;
+			return -1;
+		}
+
+		if ( versions->args.empty() )
+			versions->args.emplace_back( new std::vector<std::string*> );
+		std::vector<std::string*>& arrVersions = *versions->args[0];
+		const std::string defaultVersion = arrVersions.empty() ? std::string() : *arrVersions.front();
+		while ( arrVersions.size() > cmdLine.lastArgs.size() )
+		{
+			delete arrVersions.back();
+			arrVersions.pop_back();
+		}
+		while ( arrVersions.size() < cmdLine.lastArgs.size() )
+			arrVersions.emplace_back( new std::string( defaultVersion ) );
+
+		std::string listPath;
+		cmdLine.get( "-list" )->getString( listPath );
+		std::vector<std::pair<std::string, std::string>> listed;
+		if ( !ReadShaderList( listPath, defaultVersion, listed ) )
+			return -1;
+		for ( auto& [shader, version] : listed )
+		{
+			cmdLine.lastArgs.emplace_back( new std::string( std::move( shader ) ) );
+			arrVersions.emplace_back( new std::string( std::move( version ) ) );
+		}
+
+		if ( cmdLine.lastArgs.empty() )
+		{
+			std::cout << clr::red << "The shader list doesn't contain any shaders!"sv << clr::reset << std::endl;
+			return -1;
+		}
+	}
+
 	if ( parseLegacy )
 		/*skip*/;
 	else if ( auto s = versions->args[0]->size(); s != 1 && s != cmdLine.lastArgs.size() )
@@ -1604,6 +5438,22 @@ int main( int argc, const char* argv[] )
 	std::string path;
 	cmdLine.get( "-shaderpath" )->getString( path );
 	g_pShaderPath = fs::absolute( std::move( path ) );
+	Compiler::LoadIncludesFrom( g_pShaderPath );
+
+	// The corpus takes the place of the shaders on the command line
+	if ( bBench )
+	{
+		std::string spec;
+		cmdLine.get( "-bench" )->getString( spec );
+		Bench::Settings_t settings;
+		if ( !Bench::ParseSettings( spec, settings ) )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: Invalid -bench settings \""sv << spec << "\""sv << clr::reset << std::endl;
+			return -1;
+		}
+		for ( std::string& file : Bench::GenerateCorpus( g_pShaderPath, settings ) )
+			cmdLine.lastArgs.emplace_back( new std::string( std::move( file ) ) );
+	}
 
 	if ( parseLegacy )
 	{
@@ -1679,34 +5529,78 @@ int main( int argc, const char* argv[] )
 		files.insert( ShaderInputData{ fs::path( *cmdLine.lastArgs[i] ).filename().string(), version, target } );
 	}
 
+	// -crc and -dynamic read the shaders on every thread, their includes are loaded once for all of them.
+	// What they print keeps the order of the files.
+	unsigned long nFileThreads = 0;
+	cmdLine.get( "-threads" )->getULong( nFileThreads );
+	if ( !nFileThreads )
+		nFileThreads = Platform::NumLogicalProcessors();
+
 	if ( cmdLine.isSet( "-crc" ) )
 	{
 		const auto root = g_pShaderPath.string();
-		for ( const auto& file : files )
+		const std::vector<ShaderInputData> arrFiles( files.cbegin(), files.cend() );
+		std::vector<uint32_t> arrCrcs( arrFiles.size(), 0 );
+		ForEachShaderFile( arrFiles, nFileThreads, [&]( const ShaderInputData& file, size_t iFile )
 		{
 			const std::string name = Parser::ConstructName( file.name, file.target, file.version );
-			uint32_t crc = 0;
-			Parser::CheckCrc( g_pShaderPath / file.name, root, name, crc );
+			Parser::CheckCrc( g_pShaderPath / file.name, root, name, arrCrcs[iFile] );
+		} );
+		for ( const uint32_t crc : arrCrcs )
 			std::cout << crc << std::endl;
+		return 0;
+	}
+
+	if ( !parseLegacy && cmdLine.isSet( "-affected" ) )
+	{
+		std::string list;
+		cmdLine.get( "-affected" )->getString( list );
+		std::replace( list.begin(), list.end(), '\\', '/' );
+		std::vector<std::string> changed;
+		for ( std::string_view spec = list; !spec.empty(); )
+		{
+			const size_t nComma = spec.find( ',' );
+			if ( const std::string_view file = spec.substr( 0, nComma ); !file.empty() )
+				changed.emplace_back( file );
+			spec.remove_prefix( nComma == std::string_view::npos ? spec.size() : nComma + 1 );
+		}
+
+		IncludeGraph::Load( g_pShaderPath / "shaders"sv / "fxc"sv / "includes.graph"sv );
+		const std::set<std::string> dependents = IncludeGraph::Dependents( changed );
+		for ( const auto& file : files )
+		{
+			const std::string name = Parser::ConstructName( file.name, file.target, file.version );
+			if ( dependents.contains( name ) )
+				std::cout << name << std::endl;
+			else if ( !IncludeGraph::Knows( name ) )
+				std::cout << name << " (never built)"sv << std::endl;
 		}
 		return 0;
 	}
 
 	const bool isCSGO = cmdLine.isSet( "-csgo" );
+	const bool bSkipTables = !parseLegacy && cmdLine.isSet( "-skip-tables" );
 	if ( cmdLine.isSet( "-dynamic" ) )
 	{
-		bool failed = false;
 		const auto root = g_pShaderPath.string();
-		for ( const auto& file : files )
+		const std::vector<ShaderInputData> arrFiles( files.cbegin(), files.cend() );
+		std::vector<uint8_t> arrFailed( arrFiles.size(), 0 );
+		// WriteInclude leaves the headers that come out the same alone, so the game doesn't rebuild what includes them
+		ForEachShaderFile( arrFiles, nFileThreads, [&]( const ShaderInputData& file, size_t iFile )
 		{
 			CfgProcessor::ShaderConfig conf;
-			if ( !Parser::ParseFile( g_pShaderPath / file.name, root, file.target, file.version, conf ) )
-			{
-				std::cout << clr::red << "Failed to parse "sv << file.name << clr::reset << std::endl;
-				failed = true;
-			}
+			arrFailed[iFile] = !Parser::ParseFile( g_pShaderPath / file.name, root, file.target, file.version, conf );
 			const std::string name = Parser::ConstructName( file.name, file.target, file.version );
-			Parser::WriteInclude( g_pShaderPath / "include"sv / ( name + ".inc" ), name, file.target, conf.static_c, conf.dynamic_c, conf.skip, isCSGO );
+			Parser::WriteInclude( g_pShaderPath / "include"sv / ( name + ".inc" ), name, file.target, conf.static_c, conf.dynamic_c, conf.skip, isCSGO, bSkipTables );
+		} );
+
+		bool failed = false;
+		for ( size_t i = 0; i < arrFiles.size(); ++i )
+		{
+			if ( !arrFailed[i] )
+				continue;
+			std::cout << clr::red << "Failed to parse "sv << arrFiles[i].name << clr::reset << std::endl;
+			failed = true;
 		}
 		return failed ? -1 : 0;
 	}
@@ -1714,16 +5608,399 @@ int main( int argc, const char* argv[] )
 	g_bVerbose = cmdLine.isSet( "-verbose" );
 	g_bVerbose2 = cmdLine.isSet( "-verbose2" );
 	g_bFastFail = cmdLine.isSet( "-fastfail" );
+	FailPredict::Enable( cmdLine.isSet( "-predict-failures" ) );
+	if ( !parseLegacy )
+	{
+		cmdLine.get( "-compress-level" )->getInt( g_nCompressLevel );
+		g_nCompressLevel = std::clamp( g_nCompressLevel, 0, 9 );
 
-	// Setting up the minidump handlers
-	SetUnhandledExceptionFilter( ExceptionFilter );
-	SetThreadExecutionState( ES_CONTINUOUS | ES_SYSTEM_REQUIRED );
+		g_bPreprocess = cmdLine.isSet( "-preprocess" );
+		g_bDedupStatic = cmdLine.isSet( "-dedup-static" );
+		if ( cmdLine.isSet( "-preview" ) )
+		{
+			int nPreviewSeconds = 0;
+			cmdLine.get( "-preview" )->getInt( nPreviewSeconds );
+			g_nPreviewSeconds = static_cast<uint32_t>( std::max( nPreviewSeconds, 0 ) );
+		}
+		g_bSpill = cmdLine.isSet( "-spill" );
+		if ( cmdLine.isSet( "-max-memory" ) )
+		{
+			int nMaxMemory = 0;
+			cmdLine.get( "-max-memory" )->getInt( nMaxMemory );
+			// Every thread may hold a chunk of code it is filling, the limit can't be below that
+			const uint64_t nMinMemory = ( uint64_t( nFileThreads ) * CByteCodeArena::CHUNK_SIZE + ( 1 << 20 ) - 1 ) >> 20;
+			if ( nMaxMemory > 0 && static_cast<uint64_t>( nMaxMemory ) < nMinMemory )
+			{
+				std::cout << clr::yellow << "-max-memory is raised to "sv << nMinMemory << " MB, the least "sv << nFileThreads << " threads need"sv << clr::reset << std::endl;
+				nMaxMemory = static_cast<int>( nMinMemory );
+			}
+			MemoryBudget::SetLimit( static_cast<uint64_t>( std::max( nMaxMemory, 0 ) ) << 20 );
+		}
+		g_bMemoryStats = cmdLine.isSet( "-memory-stats" );
+		g_bReuse = cmdLine.isSet( "-reuse" );
+		g_bStaticClaims = cmdLine.isSet( "-static-claims" );
+		g_bParallelBlocks = cmdLine.isSet( "-parallel-blocks" );
+		g_bStreamPack = cmdLine.isSet( "-stream-pack" );
+		g_bResume = cmdLine.isSet( "-resume" );
+		if ( cmdLine.isSet( "-validate-sample" ) && !cmdLine.isSet( "/Vd" ) )
+		{
+			int nSample = 0;
+			cmdLine.get( "-validate-sample" )->getInt( nSample );
+			g_nValidateSample = static_cast<uint32_t>( std::max( nSample, 0 ) );
+		}
+		g_bBlockIndex = cmdLine.isSet( "-block-index" );
+		if ( cmdLine.isSet( "-strip" ) )
+		{
+			std::string strip;
+			cmdLine.get( "-strip" )->getString( strip );
+			for ( std::string_view spec = strip; !spec.empty(); )
+			{
+				const size_t nComma		 = spec.find( ',' );
+				std::string_view shader = spec.substr( 0, nComma );
+				spec.remove_prefix( nComma == std::string_view::npos ? spec.size() : nComma + 1 );
+
+				const bool bAll = shader.ends_with( ":all"sv );
+				if ( bAll )
+					shader.remove_suffix( 4 );
+				if ( !shader.empty() )
+					g_arrStrip.emplace_back( shader, bAll ? Compiler::Strip::All : Compiler::Strip::Comments );
+			}
+		}
+		if ( cmdLine.isSet( "-block-size" ) )
+		{
+			std::string blockSize;
+			cmdLine.get( "-block-size" )->getString( blockSize );
+			for ( std::string_view spec = blockSize; !spec.empty(); )
+			{
+				const size_t nComma	   = spec.find( ',' );
+				std::string_view entry = spec.substr( 0, nComma );
+				spec.remove_prefix( nComma == std::string_view::npos ? spec.size() : nComma + 1 );
+
+				const size_t nColon		= entry.rfind( ':' );
+				const std::string_view shader = nColon == std::string_view::npos ? "*"sv : entry.substr( 0, nColon );
+				entry.remove_prefix( nColon == std::string_view::npos ? 0 : nColon + 1 );
+				uint32_t nKB = 0;
+				if ( std::from_chars( entry.data(), entry.data() + entry.size(), nKB ).ec != std::errc{} || nKB < 1 || nKB > MAX_SHADER_UNPACKED_BLOCK_SIZE / 1024 || shader.empty() )
+				{
+					std::cout << clr::red << clr::bold << "ERROR: -block-size takes KB from 1 to "sv << MAX_SHADER_UNPACKED_BLOCK_SIZE / 1024 << ", not "sv << entry << clr::reset << std::endl;
+					return -1;
+				}
+				g_arrBlockSize.emplace_back( shader, nKB * 1024 );
+			}
+		}
+		if ( cmdLine.isSet( "-priority" ) )
+		{
+			std::string priority;
+			cmdLine.get( "-priority" )->getString( priority );
+			for ( std::string_view spec = priority; !spec.empty(); )
+			{
+				const size_t nComma	   = spec.find( ',' );
+				std::string_view entry = spec.substr( 0, nComma );
+				spec.remove_prefix( nComma == std::string_view::npos ? spec.size() : nComma + 1 );
+
+				const size_t nColon = entry.find( ':' );
+				const std::string_view shader = entry.substr( 0, nColon );
+				if ( !shader.empty() )
+					g_arrPriority.emplace_back( shader, nColon == std::string_view::npos ? std::string_view() : entry.substr( nColon + 1 ) );
+			}
+		}
+		if ( cmdLine.isSet( "-combo-usage" ) )
+		{
+			std::string usageFile;
+			cmdLine.get( "-combo-usage" )->getString( usageFile );
+			if ( !LoadComboUsage( usageFile ) )
+			{
+				std::cout << clr::red << clr::bold << "ERROR: Can't read the combo usage from "sv << usageFile << clr::reset << std::endl;
+				return -1;
+			}
+		}
+		if ( cmdLine.isSet( "-profile-guided" ) )
+		{
+			std::string profileFile;
+			cmdLine.get( "-profile-guided" )->getString( profileFile );
+			if ( !LoadProfileGuided( profileFile ) )
+			{
+				std::cout << clr::red << clr::bold << "ERROR: Can't read the usage profile from "sv << profileFile << clr::reset << std::endl;
+				return -1;
+			}
+			g_bProfileGuided = true;
+		}
+		if ( cmdLine.isSet( "-load-order" ) || cmdLine.isSet( "-profile-guided" ) )
+		{
+			std::string orderFile;
+			cmdLine.get( cmdLine.isSet( "-load-order" ) ? "-load-order" : "-profile-guided" )->getString( orderFile );
+			if ( !LoadStaticLoadOrder( orderFile ) )
+			{
+				std::cout << clr::red << clr::bold << "ERROR: Can't read the load order from "sv << orderFile << clr::reset << std::endl;
+				return -1;
+			}
+		}
+		g_bBackground = cmdLine.isSet( "-background" );
+
+		// -bench adds up the phases from the trace, with or without a file
+		std::string traceFile;
+		if ( cmdLine.isSet( "-trace" ) )
+			cmdLine.get( "-trace" )->getString( traceFile );
+		Trace::Initialize( traceFile, bBench );
+
+		if ( cmdLine.isSet( "-metrics" ) )
+		{
+			std::string metricsFile;
+			cmdLine.get( "-metrics" )->getString( metricsFile );
+			unsigned long nInterval = 10;
+			cmdLine.get( "-metrics-interval" )->getULong( nInterval );
+			Metrics::Initialize( metricsFile, static_cast<uint32_t>( nInterval ) );
+		}
+
+		if ( cmdLine.isSet( "-status-port" ) )
+		{
+			std::string port;
+			cmdLine.get( "-status-port" )->getString( port );
+			if ( !Status::Start( port ) )
+			{
+				std::cout << clr::red << clr::bold << "ERROR: Couldn't serve the status on port "sv << port << clr::reset << std::endl;
+				return -1;
+			}
+		}
+
+		if ( cmdLine.isSet( "-report" ) )
+		{
+			std::string reportFile;
+			cmdLine.get( "-report" )->getString( reportFile );
+			ComboReport::Initialize( reportFile );
+		}
+		DefineAnalysis::Enable( cmdLine.isSet( "-analyze" ) );
+		if ( cmdLine.isSet( "-latency" ) )
+		{
+			unsigned long nSlowest = 0;
+			cmdLine.get( "-latency" )->getULong( nSlowest );
+			Latency::Initialize( static_cast<uint32_t>( std::clamp( nSlowest, 1UL, 1000UL ) ) );
+		}
+		BuildPlan::Enable( cmdLine.isSet( "-plan" ) );
+		if ( BuildPlan::Enabled() && ( cmdLine.isSet( "-merge" ) || cmdLine.isSet( "-watch" ) || bBench ) )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: -plan can't be combined with -merge, -watch or -bench"sv << clr::reset << std::endl;
+			return -1;
+		}
+
+		if ( cmdLine.isSet( "-cache" ) )
+		{
+			std::string cacheDir;
+			cmdLine.get( "-cache" )->getString( cacheDir );
+			CompileCache::Initialize( cacheDir );
+		}
+		if ( cmdLine.isSet( "-cache-size" ) )
+		{
+			int nCacheSize = 0;
+			cmdLine.get( "-cache-size" )->getInt( nCacheSize );
+			CompileCache::SetLocalLimit( static_cast<uint64_t>( std::max( nCacheSize, 0 ) ) << 20 );
+		}
+		g_bCacheStats = cmdLine.isSet( "-cache-stats" );
+
+		// Maintenance only, nothing is built
+		if ( bCacheGc )
+		{
+			if ( !CompileCache::Enabled() )
+			{
+				std::cout << clr::red << clr::bold << "ERROR: -cache-gc needs -cache"sv << clr::reset << std::endl;
+				return -1;
+			}
+			const CompileCache::GarbageStats_t stats = CompileCache::CollectGarbage();
+			std::cout << "Removed "sv << clr::green << PrettyPrint( stats.m_nRemoved ) << clr::reset << " files ("sv << clr::green << PrettyPrint( stats.m_nRemovedBytes >> 20 ) << clr::reset << " MB), kept "sv
+					  << clr::green << PrettyPrint( stats.m_nKept ) << clr::reset << " entries ("sv << clr::green << PrettyPrint( stats.m_nKeptBytes >> 20 ) << clr::reset << " MB)"sv << std::endl;
+			return 0;
+		}
+
+		// Hits from the share are copied to the local cache and uploads are copied from it
+		g_bSharedCache = cmdLine.isSet( "-shared-cache" );
+		if ( g_bSharedCache && !CompileCache::Enabled() )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: -shared-cache needs -cache"sv << clr::reset << std::endl;
+			return -1;
+		}
+		if ( g_bSharedCache )
+		{
+			std::string sharedDir;
+			cmdLine.get( "-shared-cache" )->getString( sharedDir );
+			CompileCache::InitializeShared( sharedDir );
+		}
+
+		if ( cmdLine.isSet( "-shard" ) )
+		{
+			std::string shard;
+			cmdLine.get( "-shard" )->getString( shard );
+			if ( sscanf_s( shard.c_str(), "%u/%u", &g_iShard, &g_nShards ) != 2 || !g_nShards || g_iShard >= g_nShards )
+			{
+				std::cout << clr::red << clr::bold << "ERROR: -shard takes i/N with i below N"sv << clr::reset << std::endl;
+				return -1;
+			}
+			CfgProcessor::SetShard( g_iShard, g_nShards );
+		}
+
+		// Every shard would pick a dictionary of its own, the merged file can only have one
+		g_bDictionary = cmdLine.isSet( "-dictionary" );
+		if ( g_bDictionary && ( cmdLine.isSet( "-shard" ) || cmdLine.isSet( "-merge" ) ) )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: -dictionary can't be combined with -shard or -merge"sv << clr::reset << std::endl;
+			return -1;
+		}
+		// The dictionary is made of the dynamic combos of a static combo, a resumed one has none left
+		if ( g_bDictionary && g_bResume )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: -dictionary can't be combined with -resume"sv << clr::reset << std::endl;
+			return -1;
+		}
+
+		// Primed blocks only decode with the dictionary of their own shader
+		g_bSharedBlobs = cmdLine.isSet( "-shared-blobs" );
+		if ( g_bSharedBlobs && ( g_bDictionary || cmdLine.isSet( "-shard" ) || cmdLine.isSet( "-merge" ) ) )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: -shared-blobs can't be combined with -dictionary, -shard or -merge"sv << clr::reset << std::endl;
+			return -1;
+		}
+		if ( g_bSharedBlobs && !SharedBlobs::Open( g_pShaderPath / "shaders"sv / "fxc"sv ) )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: Can't open shaders/fxc/shared.vcsblob"sv << clr::reset << std::endl;
+			return -1;
+		}
+
+		// Children and remote workers read the includes once and would keep compiling the old ones,
+		// the trace and the report are written when the process ends, which Ctrl+C doesn't wait for
+		if ( cmdLine.isSet( "-watch" ) && ( cmdLine.isSet( "-processes" ) || cmdLine.isSet( "-remote" ) || cmdLine.isSet( "-shard" ) || cmdLine.isSet( "-merge" ) || bBench
+											 || cmdLine.isSet( "-trace" ) || cmdLine.isSet( "-report" ) || cmdLine.isSet( "-analyze" ) ) )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: -watch can't be combined with -processes, -remote, -shard, -merge, -bench, -trace, -report or -analyze"sv << clr::reset << std::endl;
+			return -1;
+		}
+	}
+	const bool bMerge = !parseLegacy && cmdLine.isSet( "-merge" );
+	const bool bWatch = !parseLegacy && cmdLine.isSet( "-watch" );
 
-	auto entries = Shared_ParseListOfCompileCommands( std::move( files ), cmdLine.isSet( "-force" ), cmdLine.isSet( "-verbose_preprocessor" ), isCSGO );
+	// Setting up the minidump handlers
+	Platform::InstallCrashHandler();
+	// A background build doesn't keep the machine awake, and the children of -processes inherit the priority class
+	if ( g_bBackground )
+		Platform::LowerProcessPriority();
+	else
+		Platform::KeepAwake( true );
 
 	unsigned long threads = 0;
 	cmdLine.get( "-threads" )->getULong( threads );
-	CompileShaders( std::move( entries ), threads ? threads : std::thread::hardware_concurrency(), flags );
+	if ( !threads )
+		threads = Platform::NumLogicalProcessors();
+	if ( !parseLegacy && cmdLine.isSet( "-auto-threads" ) )
+		ThreadTuner::Start( g_pShaderPath / "shadercompile.threads"sv, threads );
+
+	const uint32_t nIndexThreads = ( !parseLegacy && cmdLine.isSet( "-no-combo-index" ) ) || bMerge ? 0 : threads;
+
+	// Compile times of the last run decide what gets compiled first
+	ComboStats::Load( g_pShaderPath / "shadercompile.stats"sv );
+	IncludeGraph::Load( g_pShaderPath / "shaders"sv / "fxc"sv / "includes.graph"sv );
+	const bool bSpewSkips = cmdLine.isSet( "-verbose_preprocessor" );
+	const auto& Parse = [&]( std::set<ShaderInputData> shaders, bool bForce, bool& bFailed )
+	{
+		Metrics::EnterPhase( "parse" );
+		return Shared_ParseListOfCompileCommands( std::move( shaders ), bForce, bSpewSkips, isCSGO, bSkipTables, threads, nIndexThreads, bFailed );
+	};
+	bool bParseFailed = false;
+	auto entries = Parse( files, cmdLine.isSet( "-force" ) || bBench, bParseFailed );
+	if ( !entries && !bWatch )
+		return bParseFailed ? -1 : 0;
+	if ( g_bMemoryStats )
+		PrintMemoryStats( "Memory after parsing"sv );
+
+	if ( BuildPlan::Enabled() )
+	{
+		BuildPlan::Print( entries.get(), flags, g_bPreprocess, cmdLine.isSet( "-force" ), threads );
+		Trace::Finish();
+		return 0;
+	}
+
+	if ( bMerge )
+	{
+		unsigned long shards = 0;
+		cmdLine.get( "-merge" )->getULong( shards );
+		MergeShards( std::move( entries ), std::max( 1UL, shards ) );
+		Trace::Finish();
+		return gsl::narrow_cast<int>( g_ShaderHadError.size() );
+	}
+
+	unsigned long processes = 0;
+	if ( !parseLegacy )
+		cmdLine.get( "-processes" )->getULong( processes );
+	if ( processes )
+	{
+		const uint32_t nStarted = WorkerProcess::Start( std::min<uint32_t>( processes, threads ), g_pShaderPath );
+		std::cout << "Started "sv << clr::green << nStarted << clr::reset << " worker processes"sv << std::endl;
+	}
+
+	// Remote connections take the worker threads after the ones of the children, on top of the local threads
+	if ( !parseLegacy && cmdLine.isSet( "-remote" ) )
+	{
+		std::string remotes, token;
+		cmdLine.get( "-remote" )->getString( remotes );
+		if ( cmdLine.isSet( "-worker-token" ) )
+			cmdLine.get( "-worker-token" )->getString( token );
+		const uint32_t nConnected = WorkerProcess::Connect( remotes, token );
+		std::cout << "Connected to remote workers with "sv << clr::green << nConnected << clr::reset << " threads"sv << std::endl;
+		threads += nConnected;
+	}
+
+	uint64_t nBenchCombos = 0;
+	std::vector<CfgProcessor::CfgEntryInfo> arrBenchEntries;
+	for ( const CfgProcessor::CfgEntryInfo* pEntry = entries.get(); bBench && pEntry && !pEntry->m_szName.empty(); ++pEntry )
+	{
+		nBenchCombos += pEntry->m_numCombos;
+		arrBenchEntries.emplace_back( *pEntry );
+	}
+
+	if ( Metrics::Enabled() )
+		StartMetrics();
+	if ( entries )
+		CompileShaders( std::move( entries ), threads, flags );
+
+	// -profile-guided: what the engine used is there, the whole build follows at low priority. With -watch every build
+	// stays profile guided.
+	if ( g_bProfileGuided && !bWatch && !bBench )
+	{
+		WriteStats( false );
+		std::cout << "Used static combos written, building the rest in the background"sv << std::endl;
+		g_bProfileGuided = false;
+		g_bBackground	 = true;
+		Platform::LowerProcessPriority();
+		Platform::KeepAwake( false );
+		ResetBuildState();
+		g_flStartTime = Clock::now();
+		bool bFailed  = false;
+		if ( auto rest = Parse( files, false, bFailed ) )
+			CompileShaders( std::move( rest ), threads, flags );
+	}
+
+	if ( bWatch )
+	{
+		WriteStats( false );
+		const int nResult = WatchShaders( files, Parse, threads, flags );
+		Metrics::Finish();
+		Status::Finish();
+		return nResult;
+	}
+
+	if ( bBench )
+	{
+		uint64_t nByteCode = 0;
+		for ( const auto& [name, stats] : g_ShaderStats )
+			nByteCode += stats.m_nByteCode;
+		Bench::PrintResults( { .m_nCombos = nBenchCombos, .m_nCompiled = g_nCombosDone, .m_nByteCode = nByteCode,
+							   .m_nCompileNanoseconds = duration_cast<chrono::nanoseconds>( Clock::now() - g_flCompileStartTime ).count(), .m_arrPhases = Trace::Totals() } );
+		RunMicroBenchmarks( arrBenchEntries, flags );
+	}
+
+	WorkerProcess::Stop();
+	Trace::Finish();
+	Metrics::Finish();
+	Status::Finish();
+	ComboReport::Finish();
+	DefineAnalysis::Finish();
 
 	WriteStats( parseLegacy );
 
@@ -1745,7 +6022,7 @@ int main( int argc, const char* argv[] )
 		}
 	}
 
-	SetThreadExecutionState( ES_CONTINUOUS );
+	Platform::KeepAwake( false );
 
 	return gsl::narrow_cast<int>( g_ShaderHadError.size() );
 }
\ No newline at end of file
@@ -12,12 +12,27 @@
 #endif
 
 #ifndef WIN32
-#ifndef strcpy_s
-#define strcpy_s(dst, n, src) strncpy(dst, src, n)
-#endif
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+
+// Truncates instead of failing, but always terminates like the real one
+inline int strcpy_s( char* dst, size_t n, const char* src )
+{
+	snprintf( dst, n, "%s", src );
+	return 0;
+}
 #ifndef sprintf_s
 #define sprintf_s snprintf
 #endif
-#define _strupr_s strupr
+#define sscanf_s sscanf
+#define _stricmp strcasecmp
 #define _strdup strdup
+template <size_t N>
+inline void _strupr_s( char ( &str )[N] )
+{
+	for ( char& c : str )
+		c = static_cast<char>( toupper( static_cast<unsigned char>( c ) ) );
+}
 #endif
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "bench.h"
+#include "platform.h"
+#include "termcolor/style.hpp"
+#include "termcolors.hpp"
+#include "strmanip.hpp"
+
+using namespace std::literals;
+namespace fs = std::filesystem;
+
+namespace Bench
+{
+	static constexpr std::string_view PREFIX = "bench"sv;
+	static constexpr uint32_t NUM_PARAMS	 = 8;
+
+	bool ParseSettings( std::string_view spec, Settings_t& settings )
+	{
+		while ( !spec.empty() )
+		{
+			const size_t nComma		  = spec.find( ',' );
+			const std::string_view kv = spec.substr( 0, nComma );
+			spec.remove_prefix( nComma == std::string_view::npos ? spec.size() : nComma + 1 );
+
+			const size_t nEquals = kv.find( '=' );
+			if ( nEquals == std::string_view::npos )
+				return false;
+			const std::string_view key = kv.substr( 0, nEquals ), value = kv.substr( nEquals + 1 );
+
+			uint32_t* pSetting = key == "shaders"sv ? &settings.m_nShaders
+							   : key == "static"sv	 ? &settings.m_nStatic
+							   : key == "dynamic"sv	 ? &settings.m_nDynamic
+							   : key == "skips"sv	 ? &settings.m_nSkips
+							   : key == "includes"sv ? &settings.m_nIncludeDepth
+							   : key == "cost"sv	 ? &settings.m_nCost
+													 : nullptr;
+			if ( !pSetting || std::from_chars( value.data(), value.data() + value.size(), *pSetting ).ec != std::errc{} )
+				return false;
+		}
+
+		// Keeps the combo count of a shader in 32 bits
+		return settings.m_nStatic + settings.m_nDynamic <= 24;
+	}
+
+	static void WriteFile( const fs::path& path, const std::string& contents )
+	{
+		std::ofstream( path, std::ios::binary | std::ios::trunc ).write( contents.data(), contents.size() );
+	}
+
+	// Every include of the chain calls the one below it
+	static void WriteIncludes( const fs::path& dir, uint32_t nDepth )
+	{
+		for ( uint32_t i = 0; i < nDepth; ++i )
+		{
+			std::ostringstream inc;
+			if ( i + 1 < nDepth )
+				inc << "#include \""sv << PREFIX << "_inc"sv << i + 1 << ".h\"\n\n"sv;
+			inc << "float4 Inc"sv << i << "( float4 v )\n{\n"sv;
+			if ( i + 1 < nDepth )
+				inc << "\treturn Inc"sv << i + 1 << "( v * 0.5 + "sv << i << ".0 );\n"sv;
+			else
+				inc << "\treturn v * 0.5;\n"sv;
+			inc << "}\n"sv;
+			WriteFile( dir / ( std::string( PREFIX ) + "_inc"s + std::to_string( i ) + ".h"s ), inc.str() );
+		}
+	}
+
+	static std::string GenerateShader( uint32_t iShader, const Settings_t& settings )
+	{
+		std::vector<std::string> defines;
+		std::ostringstream fxc;
+		for ( uint32_t i = 0; i < settings.m_nStatic; ++i )
+		{
+			fxc << "// STATIC: \"S"sv << i << "\" \"0..1\"\n"sv;
+			defines.emplace_back( "S"s + std::to_string( i ) );
+		}
+		for ( uint32_t i = 0; i < settings.m_nDynamic; ++i )
+		{
+			fxc << "// DYNAMIC: \"D"sv << i << "\" \"0..1\"\n"sv;
+			defines.emplace_back( "D"s + std::to_string( i ) );
+		}
+
+		// Pairs walk through all the defines, so skips only overlap once there are more of them than defines
+		const size_t nDefines = defines.size();
+		for ( uint32_t k = 0; nDefines > 1 && k < settings.m_nSkips; ++k )
+		{
+			const size_t a = k % nDefines, b = ( a + 1 + k / nDefines ) % nDefines;
+			if ( a != b )
+				fxc << "// SKIP: $"sv << defines[a] << " && $"sv << defines[b] << "\n"sv;
+		}
+		fxc << "\n"sv;
+
+		if ( settings.m_nIncludeDepth )
+			fxc << "#include \""sv << PREFIX << "_inc0.h\"\n\n"sv;
+		fxc << "sampler Tex : register( s0 );\nconst float4 Params["sv << NUM_PARAMS << "] : register( c0 );\n\n"sv;
+		fxc << "float4 main( float2 uv : TEXCOORD0 ) : COLOR\n{\n\tfloat4 r = tex2D( Tex, uv ) + "sv << iShader << ".0;\n"sv;
+
+		// Every define changes the code, so no two combos compile to the same thing
+		for ( size_t i = 0; i < nDefines; ++i )
+			fxc << "#if "sv << defines[i] << "\n\tr = r * Params["sv << i % NUM_PARAMS << "] + Params["sv << ( i + 3 ) % NUM_PARAMS << "].wzyx;\n#endif\n"sv;
+		for ( uint32_t n = 0; n < settings.m_nCost; ++n )
+			fxc << "\tr = sin( r * Params["sv << n % NUM_PARAMS << "] ) + r.yzwx;\n"sv;
+
+		fxc << ( settings.m_nIncludeDepth ? "\treturn Inc0( r );\n}\n"sv : "\treturn r;\n}\n"sv );
+		return fxc.str();
+	}
+
+	std::vector<std::string> GenerateCorpus( const fs::path& dir, const Settings_t& settings )
+	{
+		std::error_code c;
+		fs::create_directories( dir, c );
+
+		// What an earlier run compiled, and its compile times, would change what this one does
+		fs::remove( dir / "shadercompile.stats"sv, c );
+		for ( const fs::path& output : { dir / "shaders"sv / "fxc"sv, dir / "include"sv } )
+		{
+			for ( const auto& entry : fs::directory_iterator( output, c ) )
+			{
+				if ( entry.path().filename().string().starts_with( PREFIX ) )
+					fs::remove( entry.path(), c );
+			}
+		}
+
+		WriteIncludes( dir, settings.m_nIncludeDepth );
+
+		std::vector<std::string> files;
+		for ( uint32_t i = 0; i < settings.m_nShaders; ++i )
+		{
+			std::string name = std::string( PREFIX ) + std::to_string( i ) + "_ps2x.fxc"s;
+			WriteFile( dir / name, GenerateShader( i, settings ) );
+			files.emplace_back( std::move( name ) );
+		}
+		return files;
+	}
+
+	void PrintResults( const Results_t& results )
+	{
+		const auto& Seconds = []( int64_t nNanoseconds ) { return std::max<int64_t>( nNanoseconds, 1 ) / 1e9; };
+		const auto& Phase = [&results]( std::string_view name )
+		{
+			const auto it = std::find_if( results.m_arrPhases.cbegin(), results.m_arrPhases.cend(), [name]( const Trace::Total_t& total ) { return total.m_szName == name; } );
+			return it != results.m_arrPhases.cend() ? it->m_nNanoseconds : int64_t{ 0 };
+		};
+
+		std::cout << std::fixed << std::setprecision( 1 );
+		std::cout << "Compiled: "sv << clr::green << results.m_nCompiled / Seconds( results.m_nCompileNanoseconds ) << clr::reset << " combos/s"sv << std::endl;
+		std::cout << "Enumerated: "sv << clr::green << results.m_nCombos / Seconds( Phase( "SetupConfiguration"sv ) ) << clr::reset << " combos/s"sv << std::endl;
+		std::cout << "Packed: "sv << clr::green << results.m_nByteCode / Seconds( Phase( "PackStaticCombos"sv ) ) / ( 1024 * 1024 ) << clr::reset << " MB/s per thread"sv << std::endl;
+		std::cout << "Peak memory: "sv << clr::green << PrettyPrint( Platform::PeakMemory() / ( 1024 * 1024 ) ) << clr::reset << " MB"sv << std::endl;
+
+		// Added up over all threads, phases that run in parallel can take longer than the build
+		for ( const Trace::Total_t& total : results.m_arrPhases )
+		{
+			std::cout << "  "sv << std::left << std::setw( 20 ) << total.m_szName << std::right << clr::green << PrettyPrint( total.m_nEvents ) << clr::reset << " times, "sv
+					  << clr::green << total.m_nNanoseconds / 1e6 << clr::reset << " ms"sv << std::endl;
+		}
+		std::cout << std::defaultfloat;
+	}
+
+	static volatile uint64_t s_nConsumed;
+
+	void Consume( uint64_t nValue ) noexcept
+	{
+		s_nConsumed = s_nConsumed + nValue;
+	}
+
+	void PrintMicro( std::string_view name, std::string_view unit, uint64_t nUnits, int64_t nNanoseconds )
+	{
+		const double flSeconds = std::max<int64_t>( nNanoseconds, 1 ) / 1e9;
+		std::cout << std::fixed << std::setprecision( 1 ) << "  "sv << std::left << std::setw( 28 ) << name << std::right << clr::green << PrettyPrint( static_cast<uint64_t>( nUnits / flSeconds ) ) << clr::reset << " "sv << unit << "/s, "sv
+				  << clr::green << ( nUnits ? nNanoseconds / static_cast<double>( nUnits ) : 0.0 ) << clr::reset << " ns per "sv << unit << std::defaultfloat << std::endl;
+	}
+}
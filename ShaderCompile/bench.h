@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "trace.h"
+
+// -bench: builds a synthetic corpus of shaders with the full pipeline and reports how fast every part of it went.
+// The corpus only depends on the settings, so runs with the same settings and -ver can be compared.
+namespace Bench
+{
+	struct Settings_t
+	{
+		uint32_t m_nShaders		 = 4;
+		uint32_t m_nStatic		 = 5;	// STATIC defines of every shader, 0..1 each
+		uint32_t m_nDynamic		 = 4;	// DYNAMIC defines, 0..1 each
+		uint32_t m_nSkips		 = 2;	// SKIP lines, each one rules out the combos that set two of the defines together
+		uint32_t m_nIncludeDepth = 2;	// Nested includes below every shader
+		uint32_t m_nCost		 = 8;	// Unrolled iterations of math in every combo
+	};
+
+	// Reads comma separated settings like "shaders=8,static=6,dynamic=4,skips=3,includes=2,cost=16".
+	// Settings not given keep their defaults, false on anything it doesn't know.
+	[[nodiscard]] bool ParseSettings( std::string_view spec, Settings_t& settings );
+
+	// Writes the corpus to dir, replacing what an earlier run left there, and returns the names of the shaders
+	[[nodiscard]] std::vector<std::string> GenerateCorpus( const std::filesystem::path& dir, const Settings_t& settings );
+
+	struct Results_t
+	{
+		uint64_t m_nCombos;			// All combos of the corpus, skipped ones included
+		uint64_t m_nCompiled;
+		uint64_t m_nByteCode;		// Bytes all compiled combos came to
+		int64_t m_nCompileNanoseconds;
+		std::vector<Trace::Total_t> m_arrPhases;
+	};
+
+	void PrintResults( const Results_t& results );
+
+	// Keeps the compiler from dropping work whose result nothing else reads
+	void Consume( uint64_t nValue ) noexcept;
+
+	void PrintMicro( std::string_view name, std::string_view unit, uint64_t nUnits, int64_t nNanoseconds );
+
+	// Calls fn, which returns the units of work it did, until a quarter of a second has passed and prints how fast it went
+	template <typename Fn>
+	void Measure( std::string_view name, std::string_view unit, Fn&& fn )
+	{
+		using Clock = std::chrono::steady_clock;
+		uint64_t nUnits				   = 0;
+		const Clock::time_point tStart = Clock::now();
+		Clock::duration elapsed;
+		do
+			nUnits += fn();
+		while ( ( elapsed = Clock::now() - tStart ) < std::chrono::milliseconds( 250 ) );
+		PrintMicro( name, unit, nUnits, std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count() );
+	}
+}
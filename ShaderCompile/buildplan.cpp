@@ -0,0 +1,147 @@
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buildplan.h"
+#include "combostats.h"
+#include "compilecache.h"
+#include "d3dxfxc.h"
+#include "termcolor/style.hpp"
+#include "termcolors.hpp"
+#include "strmanip.hpp"
+#include "robin_hood.h"
+
+using namespace std::literals;
+
+namespace BuildPlan
+{
+	static bool s_bEnabled = false;
+	static std::mutex s_mtxUpToDate;
+	static robin_hood::unordered_flat_set<std::string> s_setUpToDate;
+
+	void Enable( bool bEnable ) noexcept
+	{
+		s_bEnabled = bEnable;
+	}
+
+	bool Enabled() noexcept
+	{
+		return s_bEnabled;
+	}
+
+	void SetUpToDate( std::string_view szShader )
+	{
+		std::lock_guard guard{ s_mtxUpToDate };
+		s_setUpToDate.emplace( szShader );
+	}
+
+	struct Counts_t
+	{
+		std::atomic<uint64_t> m_nStaticCombos = 0; // With a dynamic combo that survives the skips
+		std::atomic<uint64_t> m_nCached		  = 0;
+	};
+
+	// Static combo s covers the commands [end - ( s + 1 ) * dynamic combos, end - s * dynamic combos)
+	static void PlanStaticCombo( const CfgProcessor::CfgEntryInfo& entry, uint64_t nStaticCombo, uint32_t flags, bool bPreprocess, Counts_t& counts )
+	{
+		static thread_local CfgProcessor::ComboBuildCommand s_tlCommand;
+		static thread_local std::string s_tlText;
+		flags = Compiler::FlagsFor( entry, flags );
+
+		const uint64_t iEnd	  = entry.m_iCommandEnd - nStaticCombo * entry.m_numDynamicCombos;
+		const uint64_t iBegin = iEnd - entry.m_numDynamicCombos;
+		if ( !CompileCache::Enabled() )
+		{
+			counts.m_nStaticCombos += CfgProcessor::Combo_CountSurviving( iBegin, iEnd ) != 0;
+			return;
+		}
+
+		// The same keys the workers look up, without reading the code
+		uint64_t nSurviving = 0, nCached = 0, iCommand = iBegin;
+		CfgProcessor::ComboHandle hCombo = nullptr;
+		for ( CfgProcessor::Combo_GetNext( iCommand, hCombo, iEnd ); hCombo && iCommand < iEnd; CfgProcessor::Combo_GetNext( iCommand, hCombo, iEnd ) )
+		{
+			++nSurviving;
+			CfgProcessor::Combo_BuildCommand( hCombo, s_tlCommand );
+			CompileCache::Key key;
+			if ( bPreprocess && Compiler::PreprocessCommand( s_tlCommand, s_tlText ) )
+			{
+				const CfgProcessor::ComboBuildCommand preprocessedCommand{ s_tlCommand.entryPoint, s_tlCommand.fileName, s_tlCommand.shaderModel };
+				key = CompileCache::ComputeKey( CompileCache::HashString( s_tlText, 0 ), preprocessedCommand, flags );
+			}
+			else
+				key = CompileCache::ComputeKey( entry.m_nSourceHash, s_tlCommand, flags );
+			nCached += CompileCache::Contains( key );
+		}
+		CfgProcessor::Combo_Free( hCombo );
+		counts.m_nStaticCombos += nSurviving != 0;
+		counts.m_nCached += nCached;
+	}
+
+	void Print( const CfgProcessor::CfgEntryInfo* pEntries, uint32_t flags, bool bPreprocess, bool bForce, uint32_t nThreads )
+	{
+		const bool bCache = CompileCache::Enabled();
+		uint64_t nShaders = 0, nToCompile = 0, nCombos = 0, nCached = 0, nMicroseconds = 0, nWithoutStats = 0;
+		std::cout << "Plan, nothing is compiled:"sv << std::endl;
+		for ( const CfgProcessor::CfgEntryInfo* pEntry = pEntries; pEntry && !pEntry->m_szName.empty(); ++pEntry )
+		{
+			Counts_t counts;
+			std::atomic<uint64_t> nNext = 0;
+			const auto& Work = [&]
+			{
+				for ( uint64_t s; ( s = nNext++ ) < pEntry->m_numStaticCombos; )
+					PlanStaticCombo( *pEntry, s, flags, bPreprocess, counts );
+			};
+			std::vector<std::thread> threads;
+			for ( uint32_t i = 1; i < std::min<uint64_t>( nThreads, pEntry->m_numStaticCombos ); ++i )
+				threads.emplace_back( Work );
+			Work();
+			for ( std::thread& t : threads )
+				t.join();
+
+			// The time of the last run, less the share of the combos the cache has by now
+			const uint64_t nSurviving		 = pEntry->m_numSurvivingCombos;
+			const std::vector<ComboStats::StaticComboTime_t>* pTimes = ComboStats::Find( pEntry->m_szName, pEntry->m_numStaticCombos );
+			const uint64_t nLastTime		 = pTimes ? ComboStats::Total( *pTimes ) : 0;
+			const uint64_t nPredicted		 = nSurviving ? static_cast<uint64_t>( static_cast<double>( nLastTime ) * static_cast<double>( nSurviving - counts.m_nCached ) / static_cast<double>( nSurviving ) ) : 0;
+
+			const bool bUpToDate = s_setUpToDate.contains( std::string( pEntry->m_szName ) );
+			std::cout << "  "sv;
+			if ( bUpToDate )
+				std::cout << clr::green << pEntry->m_szName << clr::reset << ": up to date, "sv;
+			else
+				std::cout << clr::yellow << pEntry->m_szName << clr::reset << ": changed, "sv;
+			std::cout << PrettyPrint( counts.m_nStaticCombos ) << " of "sv << PrettyPrint( pEntry->m_numStaticCombos ) << " static combos, "sv << PrettyPrint( nSurviving ) << " combos ("sv
+					  << PrettyPrint( pEntry->m_numCombos - nSurviving ) << " skipped), "sv;
+			if ( bCache )
+				std::cout << PrettyPrint( counts.m_nCached ) << " cached, "sv;
+			if ( pTimes )
+				std::cout << FormatTimeShort( static_cast<int64_t>( nPredicted / 1000000 ) ) << " predicted"sv << std::endl;
+			else
+				std::cout << "no stats"sv << std::endl;
+
+			++nShaders;
+			if ( bUpToDate && !bForce )
+				continue;
+			++nToCompile;
+			nCombos += nSurviving;
+			nCached += counts.m_nCached;
+			nMicroseconds += nPredicted;
+			nWithoutStats += !pTimes;
+		}
+
+		std::cout << clr::green << PrettyPrint( nToCompile ) << clr::reset << " of "sv << PrettyPrint( nShaders ) << " shaders to compile, "sv << clr::green << PrettyPrint( nCombos ) << clr::reset << " combos"sv;
+		if ( bCache )
+			std::cout << ", "sv << clr::green << PrettyPrint( nCached ) << clr::reset << " of them cached"sv;
+		std::cout << std::endl
+				  << "Predicted "sv << clr::green << FormatTimeShort( static_cast<int64_t>( nMicroseconds / 1000000 ) ) << clr::reset << " of compile time, about "sv << clr::green
+				  << FormatTimeShort( static_cast<int64_t>( nMicroseconds / 1000000 / std::max( nThreads, 1U ) ) ) << clr::reset << " on "sv << nThreads << " threads"sv;
+		if ( nWithoutStats )
+			std::cout << ", "sv << clr::yellow << PrettyPrint( nWithoutStats ) << clr::reset << " shaders without stats not counted"sv;
+		std::cout << std::endl;
+	}
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+#include "cfgprocessor.h"
+
+// -plan: what a build would do, without compiling anything. The shaders are parsed, crc checked and their combos
+// enumerated like for a build, then every shader prints whether it is up to date, the static and dynamic combos that
+// survive the skips, how many of them the compile cache already has and what its static combos took last time.
+// Neither the vcs files nor the includes are written.
+namespace BuildPlan
+{
+	void Enable( bool bEnable ) noexcept;
+	[[nodiscard]] bool Enabled() noexcept;
+
+	// The vcs file of the shader matches its sources, a build without -force skips it
+	void SetUpToDate( std::string_view szShader );
+
+	// Prints the plan of every entry. Cache keys are computed like the workers do, from the preprocessed text if bPreprocess.
+	void Print( const CfgProcessor::CfgEntryInfo* pEntries, uint32_t flags, bool bPreprocess, bool bForce, uint32_t nThreads );
+}
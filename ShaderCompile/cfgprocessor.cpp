@@ -14,19 +14,26 @@
 #define NOMINMAX
 
 #include "cfgprocessor.h"
+#include "compilecache.h"
 #include "d3dxfxc.h"
+#include "platform.h"
 
 #include "utlbuffer.h"
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
 #include <charconv>
+#include <climits>
 #include <cstdarg>
 #include <ctime>
 #include <filesystem>
-#include <map>
+#include <mutex>
 #include <numeric>
-#include <set>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 #include <fstream>
@@ -87,6 +94,70 @@ public:
 	virtual int GetVariableSlot( const std::string& szVariableName ) const noexcept	= 0;
 };
 
+// Decision graph form of a boolean expression tree for a single combo. Every node tests one variable slot against
+// a range and goes on to one of two nodes, so there is no dispatch on the kind of node and no stack.
+class CSkipBranches
+{
+public:
+	static constexpr int TRUE_EXIT	= -1;
+	static constexpr int FALSE_EXIT	= -2;
+	static constexpr int NONE		= -3; // The expression has parts that aren't a test of a variable against a constant
+
+	void Clear() noexcept
+	{
+		m_arrNodes.clear();
+		m_iEntry	  = NONE;
+		m_nLowestSlot = INT_MAX;
+	}
+
+	// Node that goes on to iTrue where nMin <= slots[nSlot] <= nMax and to iFalse elsewhere
+	[[nodiscard]] int Test( int nSlot, int64_t nMin, int64_t nMax, int iTrue, int iFalse );
+	void SetEntry( int iEntry ) noexcept { m_iEntry = iEntry; }
+
+	[[nodiscard]] bool IsValid() const noexcept { return m_iEntry != NONE; }
+	// Lowest variable slot a node tests, INT_MAX if there are none
+	[[nodiscard]] int LowestSlot() const noexcept { return m_nLowestSlot; }
+	[[nodiscard]] bool Evaluate( const int* pnSlots ) const noexcept
+	{
+		const Node_t* const pNodes = m_arrNodes.data();
+		int i = m_iEntry;
+		while ( i >= 0 )
+		{
+			const Node_t& node = pNodes[i];
+			i = static_cast<uint32_t>( pnSlots[node.m_nSlot] ) - node.m_nMin <= node.m_nRange ? node.m_iTrue : node.m_iFalse;
+		}
+		return i == TRUE_EXIT;
+	}
+
+private:
+	struct Node_t
+	{
+		int m_nSlot;
+		uint32_t m_nMin;
+		uint32_t m_nRange;
+		int m_iTrue;
+		int m_iFalse;
+	};
+
+	std::vector<Node_t> m_arrNodes;
+	int m_iEntry	  = NONE;
+	int m_nLowestSlot = INT_MAX;
+};
+
+int CSkipBranches::Test( int nSlot, int64_t nMin, int64_t nMax, int iTrue, int iFalse )
+{
+	nMin = std::max<int64_t>( nMin, INT_MIN );
+	nMax = std::min<int64_t>( nMax, INT_MAX );
+	if ( nMin > nMax )
+		return iFalse;
+	if ( iTrue == iFalse )
+		return iTrue;
+
+	m_nLowestSlot = std::min( m_nLowestSlot, nSlot );
+	m_arrNodes.push_back( { nSlot, static_cast<uint32_t>( nMin ), static_cast<uint32_t>( nMax - nMin ), iTrue, iFalse } );
+	return static_cast<int>( m_arrNodes.size() - 1 );
+}
+
 class IExpression
 {
 public:
@@ -95,12 +166,19 @@ public:
 	virtual void Print( const IEvaluationContext* pCtx ) const										= 0;
 	virtual std::string Build( const std::string& pPrefix, const IEvaluationContext* pCtx ) const	= 0;
 	virtual bool IsValid() const																	= 0;
+	// Node that goes on to iTrue where the expression is non-zero and to iFalse elsewhere, CSkipBranches::NONE if it can't
+	virtual int Branch( CSkipBranches& br, int iTrue, int iFalse ) const							= 0;
+
+	// Leaves comparisons can branch on
+	virtual bool IsConstant( [[maybe_unused]] int& rnValue ) const noexcept { return false; }
+	virtual int VariableSlot() const noexcept { return -1; }
 };
 
 #define EVAL int Evaluate( [[maybe_unused]] const IEvaluationContext* pCtx ) const noexcept override
 #define PRNT void Print( [[maybe_unused]] const IEvaluationContext* pCtx ) const override
 #define BUILD std::string Build( [[maybe_unused]] const std::string& pPrefix, [[maybe_unused]] const IEvaluationContext* pCtx ) const override
 #define CHECK bool IsValid() const override
+#define BRANCH int Branch( [[maybe_unused]] CSkipBranches& br, [[maybe_unused]] int iTrue, [[maybe_unused]] int iFalse ) const override
 
 class CExprConstant : public IExpression
 {
@@ -119,6 +197,15 @@ public:
 	{
 		return true;
 	}
+	BRANCH
+	{
+		return m_value ? iTrue : iFalse;
+	}
+	bool IsConstant( int& rnValue ) const noexcept override
+	{
+		rnValue = m_value;
+		return true;
+	}
 
 private:
 	int m_value;
@@ -147,6 +234,16 @@ public:
 	{
 		return m_nSlot >= 0;
 	}
+	BRANCH
+	{
+		return m_nSlot >= 0 ? br.Test( m_nSlot, 0, 0, iFalse, iTrue ) : iFalse;
+	}
+	bool IsConstant( int& rnValue ) const noexcept override
+	{
+		rnValue = 0;
+		return m_nSlot < 0;
+	}
+	int VariableSlot() const noexcept override { return m_nSlot; }
 
 private:
 	int m_nSlot;
@@ -187,6 +284,10 @@ BEGIN_EXPR_UNARY( CExprUnary_Negate )
 	{
 		return m_x->IsValid();
 	}
+	BRANCH
+	{
+		return m_x->Branch( br, iFalse, iTrue );
+	}
 END_EXPR_UNARY()
 
 class CExprBinary : public IExpression
@@ -204,6 +305,24 @@ public:
 		return m_x->IsValid() && m_y->IsValid();
 	}
 protected:
+	// $VAR op N or N op $VAR, fnRange gives the range of $VAR it holds for from N and whether $VAR is on the right
+	template <typename TRange>
+	int BranchCompare( CSkipBranches& br, int iTrue, int iFalse, TRange fnRange ) const
+	{
+		int nValue, nOther;
+		if ( m_x->IsConstant( nValue ) && m_y->IsConstant( nOther ) )
+			return Evaluate( nullptr ) ? iTrue : iFalse;
+
+		const bool bRight = m_x->IsConstant( nValue );
+		const int nSlot	  = bRight ? m_y->VariableSlot() : m_x->VariableSlot();
+		if ( nSlot < 0 || ( !bRight && !m_y->IsConstant( nValue ) ) )
+			return CSkipBranches::NONE;
+
+		const auto [nMin, nMax] = fnRange( static_cast<int64_t>( nValue ), bRight );
+		return br.Test( nSlot, nMin, nMax, iTrue, iFalse );
+	}
+
+
 	IExpression* m_x;
 	IExpression* m_y;
 };
@@ -234,6 +353,11 @@ BEGIN_EXPR_BINARY( CExprBinary_And )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " && " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	BRANCH
+	{
+		const int iY = m_y->Branch( br, iTrue, iFalse );
+		return iY != CSkipBranches::NONE ? m_x->Branch( br, iY, iFalse ) : CSkipBranches::NONE;
+	}
 	EXPR_BINARY_PRIORITY( 1 );
 END_EXPR_BINARY()
 
@@ -254,6 +378,11 @@ BEGIN_EXPR_BINARY( CExprBinary_Or )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " || " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	BRANCH
+	{
+		const int iY = m_y->Branch( br, iTrue, iFalse );
+		return iY != CSkipBranches::NONE ? m_x->Branch( br, iTrue, iY ) : CSkipBranches::NONE;
+	}
 	EXPR_BINARY_PRIORITY( 2 );
 END_EXPR_BINARY()
 
@@ -274,6 +403,10 @@ BEGIN_EXPR_BINARY( CExprBinary_Eq )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " == " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	BRANCH
+	{
+		return BranchCompare( br, iTrue, iFalse, []( int64_t n, [[maybe_unused]] bool bRight ) { return std::pair{ n, n }; } );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -294,6 +427,10 @@ BEGIN_EXPR_BINARY( CExprBinary_Neq )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " != " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	BRANCH
+	{
+		return BranchCompare( br, iFalse, iTrue, []( int64_t n, [[maybe_unused]] bool bRight ) { return std::pair{ n, n }; } );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -314,6 +451,10 @@ BEGIN_EXPR_BINARY( CExprBinary_G )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " > " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	BRANCH
+	{
+		return BranchCompare( br, iTrue, iFalse, []( int64_t n, [[maybe_unused]] bool bRight ) { return bRight ? std::pair{ INT64_MIN, n - 1 } : std::pair{ n + 1, INT64_MAX }; } );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -334,6 +475,10 @@ BEGIN_EXPR_BINARY( CExprBinary_Ge )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " >= " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	BRANCH
+	{
+		return BranchCompare( br, iTrue, iFalse, []( int64_t n, [[maybe_unused]] bool bRight ) { return bRight ? std::pair{ INT64_MIN, n } : std::pair{ n, INT64_MAX }; } );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -354,6 +499,10 @@ BEGIN_EXPR_BINARY( CExprBinary_L )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " < " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	BRANCH
+	{
+		return BranchCompare( br, iTrue, iFalse, []( int64_t n, [[maybe_unused]] bool bRight ) { return bRight ? std::pair{ n + 1, INT64_MAX } : std::pair{ INT64_MIN, n - 1 }; } );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -374,6 +523,10 @@ BEGIN_EXPR_BINARY( CExprBinary_Le )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " <= " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	BRANCH
+	{
+		return BranchCompare( br, iTrue, iFalse, []( int64_t n, [[maybe_unused]] bool bRight ) { return bRight ? std::pair{ n, INT64_MAX } : std::pair{ INT64_MIN, n }; } );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -410,6 +563,15 @@ public:
 	{
 		return m_pRoot && m_pRoot != m_pDefFalse && m_pRoot->IsValid();
 	}
+	BRANCH
+	{
+		return m_pRoot ? m_pRoot->Branch( br, iTrue, iFalse ) : iFalse;
+	}
+
+	// Evaluates the compiled form directly on an array of variable slots
+	[[nodiscard]] bool IsCompiled() const noexcept { return m_Branches.IsValid(); }
+	[[nodiscard]] bool EvaluateCompiled( const int* pnSlots ) const noexcept { return m_Branches.Evaluate( pnSlots ); }
+	[[nodiscard]] int LowestSlot() const noexcept { return m_Branches.LowestSlot(); }
 
 protected:
 	IExpression* ParseTopLevel( char*& szExpression );
@@ -428,6 +590,8 @@ protected:
 	IEvaluationContext* m_pContext;
 
 	IExpression* m_pDefFalse;
+
+	CSkipBranches m_Branches;
 };
 
 #undef BEGIN_EXPR_UNARY
@@ -442,6 +606,7 @@ protected:
 #undef PRNT
 #undef BUILD
 #undef CHECK
+#undef BRANCH
 
 void CComplexExpression::Parse( std::string szExpression )
 {
@@ -456,6 +621,8 @@ void CComplexExpression::Parse( std::string szExpression )
 
 	if ( szParse != szExpectEnd )
 		m_pRoot = m_pDefFalse;
+
+	m_Branches.SetEntry( Branch( m_Branches, CSkipBranches::TRUE_EXIT, CSkipBranches::FALSE_EXIT ) );
 }
 
 IExpression* CComplexExpression::ParseTopLevel( char* &szExpression )
@@ -635,6 +802,7 @@ void CComplexExpression::Clear() noexcept
 {
 	m_arrAllExpressions.clear();
 	m_pRoot = nullptr;
+	m_Branches.Clear();
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -702,25 +870,141 @@ namespace ConfigurationProcessing
 class CfgEntry
 {
 public:
-	CfgEntry() noexcept : m_szName( "" ), m_szShaderSrc( "" ), m_pCg( nullptr ), m_pExpr( nullptr )
+	CfgEntry() noexcept : m_szName( "" ), m_szShaderSrc( "" ), m_pCg( nullptr ), m_pExpr( nullptr ), m_flCost( 0 ), m_nComboHash( 0 ), m_bIndexed( false ), m_bCounted( false )
 	{
-		memset( &m_eiInfo, 0, sizeof( m_eiInfo ) );
 	}
 
-	bool operator<( const CfgEntry& x ) const noexcept { return m_pCg->NumCombos() < x.m_pCg->NumCombos(); }
+	bool operator<( const CfgEntry& x ) const noexcept { return m_flCost < x.m_flCost; }
+
+	// First surviving command at or after iCommand, m_iCommandEnd if there is none
+	[[nodiscard]] uint64_t NextSurviving( uint64_t iCommand ) const noexcept;
+	// Number of surviving commands before iCommand
+	[[nodiscard]] uint64_t CountSurviving( uint64_t iCommand ) const noexcept;
 
 	std::string_view m_szName;
 	std::string_view m_szShaderSrc;
 	std::unique_ptr<ComboGenerator> m_pCg;
 	std::unique_ptr<CComplexExpression> m_pExpr;
 
+	// Defines and macros of every command of the entry, without the values
+	std::vector<std::pair<std::string_view, std::string_view>> m_arrDefines;
+	std::vector<CfgProcessor::ComboBuildCommand::Macro_t> m_arrMacros;
+
+	// Every SKIP on its own, the ones that depend on the highest slots first.
+	// Empty when they can't stand in for m_pExpr.
+	std::vector<std::unique_ptr<CComplexExpression>> m_arrSkipClauses;
+
+	// Expected compile time, recorded by an earlier run or estimated from the number of combos
+	double m_flCost;
+
+	// Name, defines and skips, everything the combo index follows from
+	uint64_t m_nComboHash;
+
+	// Surviving combos as runs of consecutive commands, filled by BuildComboIndex
+	struct ComboRun_t
+	{
+		uint64_t m_iBegin;
+		uint64_t m_iEnd;
+		uint64_t m_nBefore; // Surviving combos of the entry before this run
+	};
+	std::vector<ComboRun_t> m_arrComboRuns;
+	bool m_bIndexed;
+	bool m_bCounted; // m_numSurvivingCombos came from the index file, BuildComboIndex leaves the entry alone
+
 	CfgProcessor::CfgEntryInfo m_eiInfo;
 };
 
-static robin_hood::unordered_node_set<std::string> s_strPool;
-static std::multiset<CfgEntry> s_setEntries;
+uint64_t CfgEntry::NextSurviving( uint64_t iCommand ) const noexcept
+{
+	const auto it = std::partition_point( m_arrComboRuns.cbegin(), m_arrComboRuns.cend(), [iCommand]( const ComboRun_t& run ) noexcept { return run.m_iEnd <= iCommand; } );
+	return it != m_arrComboRuns.cend() ? std::max( it->m_iBegin, iCommand ) : m_eiInfo.m_iCommandEnd;
+}
 
-class ComboHandleImpl : public IEvaluationContext
+uint64_t CfgEntry::CountSurviving( uint64_t iCommand ) const noexcept
+{
+	const auto it = std::partition_point( m_arrComboRuns.cbegin(), m_arrComboRuns.cend(), [iCommand]( const ComboRun_t& run ) noexcept { return run.m_iEnd <= iCommand; } );
+	if ( it == m_arrComboRuns.cend() )
+		return m_eiInfo.m_numSurvivingCombos;
+	return it->m_nBefore + ( iCommand > it->m_iBegin ? iCommand - it->m_iBegin : 0 );
+}
+
+// Strings that live as long as the configuration, packed back to back and null terminated.
+// Views it hands out stay valid, equal strings are stored once.
+class CStringArena
+{
+public:
+	[[nodiscard]] std::string_view Intern( std::string_view str )
+	{
+		std::lock_guard lock( m_mtx );
+		if ( const auto it = m_setStrings.find( str ); it != m_setStrings.end() )
+			return *it;
+
+		const size_t nSize = str.size() + 1;
+		char* pStr;
+		if ( nSize > BLOCK_SIZE / 4 )
+		{
+			pStr = m_arrBlocks.emplace_back( std::make_unique<char[]>( nSize ) ).get();
+			m_nBytes += nSize;
+		}
+		else
+		{
+			if ( m_nBlockUsed + nSize > BLOCK_SIZE )
+			{
+				m_pBlock     = m_arrBlocks.emplace_back( std::make_unique<char[]>( BLOCK_SIZE ) ).get();
+				m_nBlockUsed = 0;
+				m_nBytes += BLOCK_SIZE;
+			}
+			pStr = m_pBlock + m_nBlockUsed;
+			m_nBlockUsed += nSize;
+		}
+
+		memcpy( pStr, str.data(), str.size() );
+		pStr[str.size()] = '\0';
+		return *m_setStrings.emplace( pStr, str.size() ).first;
+	}
+
+	// Blocks and the set, for -memory-stats
+	[[nodiscard]] uint64_t Bytes()
+	{
+		std::lock_guard lock( m_mtx );
+		return m_nBytes + m_setStrings.size() * sizeof( std::string_view );
+	}
+
+private:
+	static constexpr size_t BLOCK_SIZE = 64 << 10;
+
+	std::mutex m_mtx;
+	std::vector<std::unique_ptr<char[]>> m_arrBlocks;
+	char* m_pBlock      = nullptr;
+	size_t m_nBlockUsed = BLOCK_SIZE;
+	uint64_t m_nBytes   = 0; // Of the blocks
+	robin_hood::unordered_flat_set<std::string_view> m_setStrings;
+};
+
+static CStringArena s_strPool;
+// Biggest entries first, that is the order they are compiled in
+static std::vector<CfgEntry> s_arrEntries;
+
+// Lets the expression tree read the variables of a combo handle
+class CSlotContext final : public IEvaluationContext
+{
+public:
+	CSlotContext( const ComboGenerator& cg, const int* pnSlots ) noexcept : m_cg( cg ), m_pnSlots( pnSlots ) {}
+
+	int GetVariableValue( int nSlot ) const noexcept override { return m_pnSlots[nSlot]; }
+	const std::string& GetVariableName( int nSlot ) const noexcept override { return m_cg.GetVariableName( nSlot ); }
+	int GetVariableSlot( const std::string& szVariableName ) const noexcept override { return m_cg.GetVariableSlot( szVariableName ); }
+
+private:
+	const ComboGenerator& m_cg;
+	const int* m_pnSlots;
+};
+
+// Handles are copied around the whole time while scheduling, so they keep the values of up to
+// MAX_INLINE_DEFINES defines inline. Shaders with more keep them on the heap.
+static constexpr uint32_t MAX_INLINE_DEFINES = 64;
+
+class ComboHandleImpl
 {
 public:
 	uint64_t m_iTotalCommand;
@@ -729,29 +1013,95 @@ public:
 	const CfgEntry* m_pEntry;
 
 public:
-	ComboHandleImpl() noexcept : m_iTotalCommand( 0 ), m_iComboNumber( 0 ), m_numCombos( 0 ), m_pEntry( nullptr ) {}
-	ComboHandleImpl( const ComboHandleImpl& ) = default;
+	ComboHandleImpl() noexcept : m_iTotalCommand( 0 ), m_iComboNumber( 0 ), m_numCombos( 0 ), m_pEntry( nullptr ), m_nVarSlots( 0 ) {}
+	ComboHandleImpl( const ComboHandleImpl& other ) : ComboHandleImpl() { *this = other; }
+	ComboHandleImpl& operator=( const ComboHandleImpl& other )
+	{
+		m_iTotalCommand = other.m_iTotalCommand;
+		m_iComboNumber  = other.m_iComboNumber;
+		m_numCombos     = other.m_numCombos;
+		m_pEntry        = other.m_pEntry;
+		std::copy_n( other.m_pVarSlots, other.m_nVarSlots, ResizeVarSlots( other.m_nVarSlots ) );
+		return *this;
+	}
+	explicit ComboHandleImpl( const struct ComboCheckpoint_t& checkpoint );
 
-	// IEvaluationContext
 private:
-	std::vector<int> m_arrVarSlots;
+	// Keeps a heap buffer that is big enough, spare handles are reused for every shader
+	int* ResizeVarSlots( uint32_t nSlots )
+	{
+		if ( nSlots > MAX_INLINE_DEFINES && nSlots > m_nHeapSlots )
+		{
+			m_pHeapSlots = std::make_unique<int[]>( nSlots );
+			m_nHeapSlots = nSlots;
+		}
+		m_nVarSlots = nSlots;
+		m_pVarSlots = nSlots > MAX_INLINE_DEFINES ? m_pHeapSlots.get() : m_arrVarSlots;
+		return m_pVarSlots;
+	}
+
+	uint32_t m_nVarSlots;
+	int* m_pVarSlots = m_arrVarSlots; // Either of the two below
+	int m_arrVarSlots[MAX_INLINE_DEFINES];
+	std::unique_ptr<int[]> m_pHeapSlots;
+	uint32_t m_nHeapSlots = 0;
 
 public:
-	int GetVariableValue( int nSlot ) const noexcept override { return m_arrVarSlots[nSlot]; }
-	const std::string& GetVariableName( int nSlot ) const noexcept override { return m_pEntry->m_pCg->GetVariableName( nSlot ); }
-	int GetVariableSlot( const std::string& szVariableName ) const noexcept override { return m_pEntry->m_pCg->GetVariableSlot( szVariableName ); }
+	[[nodiscard]] const int* VarSlots() const noexcept { return m_pVarSlots; }
+	[[nodiscard]] uint32_t NumVarSlots() const noexcept { return m_nVarSlots; }
 
 	// External implementation
 public:
 	bool Initialize( uint64_t iTotalCommand, const CfgEntry* pEntry );
 	bool AdvanceCommands( uint64_t& riAdvanceMore ) noexcept;
 	bool NextNotSkipped( uint64_t iTotalCommand ) noexcept;
-	bool IsSkipped() const noexcept { return m_pEntry->m_pExpr->Evaluate( this ) != 0; }
-	CfgProcessor::ComboBuildCommand BuildCommand() const;
+	bool NextIndexed( uint64_t iTotalCommand ) noexcept;
+	int SkippedSlot() const noexcept;
+	bool IsSkipped() const noexcept
+	{
+		const CComplexExpression& expr = *m_pEntry->m_pExpr;
+		if ( expr.IsCompiled() )
+			return expr.EvaluateCompiled( m_pVarSlots );
+
+		const CSlotContext ctx{ *m_pEntry->m_pCg, m_pVarSlots };
+		return expr.Evaluate( &ctx ) != 0;
+	}
+	void BuildCommand( CfgProcessor::ComboBuildCommand& command ) const;
 	void FormatCommandHumanReadable( gsl::span<char> pchBuffer ) const;
 };
 
-static std::map<uint64_t, ComboHandleImpl> s_mapComboCommands;
+// State of a handle every so many combos, looking up a command starts from the closest one before it.
+// The values of the variables of all checkpoints live back to back in s_arrCheckpointSlots.
+struct ComboCheckpoint_t
+{
+	uint64_t m_iTotalCommand;
+	uint64_t m_iComboNumber;
+	const CfgEntry* m_pEntry;
+	uint32_t m_iFirstSlot;
+	uint32_t m_nSlots;
+};
+static std::vector<ComboCheckpoint_t> s_arrCheckpoints;
+static std::vector<int> s_arrCheckpointSlots;
+
+static void AddCheckpoint( const ComboHandleImpl& chi, std::vector<ComboCheckpoint_t>& arrCheckpoints = s_arrCheckpoints, std::vector<int>& arrSlots = s_arrCheckpointSlots )
+{
+	arrCheckpoints.emplace_back( ComboCheckpoint_t { chi.m_iTotalCommand, chi.m_iComboNumber, chi.m_pEntry, gsl::narrow<uint32_t>( arrSlots.size() ), chi.NumVarSlots() } );
+	arrSlots.insert( arrSlots.end(), chi.VarSlots(), chi.VarSlots() + chi.NumVarSlots() );
+}
+
+// Last checkpoint at or before iCommand, nullptr if there is none
+static const ComboCheckpoint_t* FindCheckpoint( uint64_t iCommand ) noexcept
+{
+	const auto it = std::partition_point( s_arrCheckpoints.cbegin(), s_arrCheckpoints.cend(), [iCommand]( const ComboCheckpoint_t& c ) noexcept { return c.m_iTotalCommand <= iCommand; } );
+	return it != s_arrCheckpoints.cbegin() ? &*( it - 1 ) : nullptr;
+}
+
+ComboHandleImpl::ComboHandleImpl( const ComboCheckpoint_t& checkpoint )
+	: m_iTotalCommand( checkpoint.m_iTotalCommand ), m_iComboNumber( checkpoint.m_iComboNumber ), m_numCombos( checkpoint.m_pEntry->m_pCg ? checkpoint.m_pEntry->m_eiInfo.m_numCombos : 0 ), m_pEntry( checkpoint.m_pEntry )
+	, m_nVarSlots( 0 )
+{
+	std::copy_n( s_arrCheckpointSlots.data() + checkpoint.m_iFirstSlot, checkpoint.m_nSlots, ResizeVarSlots( checkpoint.m_nSlots ) );
+}
 
 bool ComboHandleImpl::Initialize( uint64_t iTotalCommand, const CfgEntry* pEntry )
 {
@@ -764,8 +1114,9 @@ bool ComboHandleImpl::Initialize( uint64_t iTotalCommand, const CfgEntry* pEntry
 	const Define* const pDefVarsEnd = m_pEntry->m_pCg->GetDefinesEnd();
 
 	// Set all the variables to max values
+	int* pSlot = ResizeVarSlots( gsl::narrow<uint32_t>( pDefVarsEnd - pDefVars ) );
 	for ( const Define* pSetDef = pDefVars; pSetDef < pDefVarsEnd; ++pSetDef )
-		m_arrVarSlots.emplace_back( pSetDef->Max() );
+		*pSlot++ = pSetDef->Max();
 
 	m_iComboNumber = m_numCombos - 1;
 	return true;
@@ -777,8 +1128,8 @@ bool ComboHandleImpl::AdvanceCommands( uint64_t& riAdvanceMore ) noexcept
 		return true;
 
 	// Get the pointers
-	int* const pnValues    = m_arrVarSlots.data();
-	int* const pnValuesEnd = pnValues + m_arrVarSlots.size();
+	int* const pnValues    = m_pVarSlots;
+	int* const pnValuesEnd = pnValues + m_nVarSlots;
 	int* pSetValues;
 
 	// Defines
@@ -809,9 +1160,12 @@ bool ComboHandleImpl::AdvanceCommands( uint64_t& riAdvanceMore ) noexcept
 
 bool ComboHandleImpl::NextNotSkipped( uint64_t iTotalCommand ) noexcept
 {
+	if ( m_pEntry->m_bIndexed )
+		return NextIndexed( iTotalCommand );
+
 	// Get the pointers
-	int* const pnValues    = m_arrVarSlots.data();
-	int* const pnValuesEnd = pnValues + m_arrVarSlots.size();
+	int* const pnValues    = m_pVarSlots;
+	int* const pnValuesEnd = pnValues + m_nVarSlots;
 	int* pSetValues;
 
 	// Defines
@@ -838,60 +1192,120 @@ next_combo_iteration:
 	return false;
 
 have_combo_iteration:
-	if ( m_pEntry->m_pExpr->Evaluate( this ) )
+	if ( const int iSkipSlot = SkippedSlot(); iSkipSlot >= 0 )
+	{
+		// Combos that only differ from this one below the slots the skip reads are
+		// skipped as well, so step over to the last of them in one go
+		if ( iSkipSlot > 0 )
+		{
+			uint64_t nRemaining = 0;
+			uint64_t nStride    = 1;
+			for ( pSetValues = pnValues, pSetDef = pDefVars; pSetValues < pnValues + iSkipSlot; ++pSetValues, ++pSetDef )
+			{
+				nRemaining += nStride * static_cast<uint64_t>( *pSetValues - pSetDef->Min() );
+				nStride *= static_cast<uint64_t>( pSetDef->Max() ) - pSetDef->Min() + 1ULL;
+			}
+
+			nRemaining = std::min( nRemaining, iTotalCommand - m_iTotalCommand - 1 );
+			AdvanceCommands( nRemaining );
+		}
 		goto next_combo_iteration;
+	}
 
 	return true;
 }
 
-static thread_local robin_hood::unordered_node_set<std::string> s_tlPool;
-template <typename T>
-static std::string_view String( const T& str )
+// Same as NextNotSkipped, but jumps straight to the next surviving combo in the index
+bool ComboHandleImpl::NextIndexed( uint64_t iTotalCommand ) noexcept
 {
-	return *s_tlPool.emplace( str ).first;
+	if ( m_iTotalCommand + 1 >= iTotalCommand || !m_iComboNumber )
+		return false;
+
+	// Without a next one stop where the walk would have stopped
+	const uint64_t iNext = m_pEntry->NextSurviving( m_iTotalCommand + 1 );
+	const uint64_t iLast = std::min( iTotalCommand - 1, m_iTotalCommand + m_iComboNumber );
+
+	uint64_t nAdvance = std::min( iNext, iLast ) - m_iTotalCommand;
+	AdvanceCommands( nAdvance );
+	return iNext <= iLast;
 }
 
-CfgProcessor::ComboBuildCommand ComboHandleImpl::BuildCommand() const
+// Returns the lowest slot the skip of the current combo depends on, -1 if it is not skipped
+int ComboHandleImpl::SkippedSlot() const noexcept
 {
-	// Get the pointers
-	const int* const pnValues    = m_arrVarSlots.data();
-	const int* const pnValuesEnd = pnValues + m_arrVarSlots.size();
-	const int* pSetValues;
+	if ( m_pEntry->m_arrSkipClauses.empty() )
+		return IsSkipped() ? 0 : -1;
 
-	// Defines
-	const Define* const pDefVars = m_pEntry->m_pCg->GetDefinesBase();
-	const Define* const pDefVarsEnd = m_pEntry->m_pCg->GetDefinesEnd();
-	const Define* pSetDef;
+	for ( const auto& pClause : m_pEntry->m_arrSkipClauses )
+	{
+		if ( pClause->EvaluateCompiled( m_pVarSlots ) )
+			return std::min( pClause->LowestSlot(), static_cast<int>( m_nVarSlots ) );
+	}
 
-	CfgProcessor::ComboBuildCommand command{ m_pEntry->m_eiInfo.m_szEntryPoint, m_pEntry->m_szShaderSrc, m_pEntry->m_eiInfo.m_szShaderVersion };
-	command.defines.reserve( m_pEntry->m_pCg->DefineCount() + 2 );
+	return -1;
+}
 
-	char tmpBuf[24]{};
-	std::to_chars( std::begin( tmpBuf ), std::end( tmpBuf ), m_iComboNumber, 16 );
+// Combo values are almost always small, their strings are formatted once up front
+static constexpr int NUM_SMALL_VALUES = 256;
+static const auto s_arrSmallValues = []()
+{
+	std::array<std::array<char, 4>, NUM_SMALL_VALUES> values{};
+	for ( int i = 0; i < NUM_SMALL_VALUES; ++i )
+		std::to_chars( values[i].data(), values[i].data() + values[i].size() - 1, i );
+	return values;
+}();
 
-	command.defines.emplace_back( "SHADERCOMBO", String( tmpBuf ) );
+void ComboHandleImpl::BuildCommand( CfgProcessor::ComboBuildCommand& command ) const
+{
+	// Defines: SHADERCOMBO, SHADER_MODEL_, then one per combo. Strings: SHADERCOMBO value, then one per combo value.
+	static constexpr size_t FIRST_VALUE = 2;
+	const auto& Format = []( std::array<char, 24>& str, auto value, int base = 10 )
+	{
+		char* const pEnd = std::to_chars( str.data(), str.data() + str.size() - 1, value, base ).ptr;
+		*pEnd = 0;
+		return std::string_view( str.data(), pEnd - str.data() );
+	};
 
-	char version[16];
-	strcpy_s( version, sizeof( version ), m_pEntry->m_eiInfo.m_szShaderVersion.data() );
-	_strupr_s( version );
-	sprintf_s( tmpBuf, sizeof( tmpBuf ), "SHADER_MODEL_%6.6s", version );
+	const bool bRebuild = command.builtFor != m_pEntry;
+	if ( bRebuild )
+	{
+		command.entryPoint  = m_pEntry->m_eiInfo.m_szEntryPoint;
+		command.fileName    = m_pEntry->m_szShaderSrc;
+		command.shaderModel = m_pEntry->m_eiInfo.m_szShaderVersion;
+		command.strings.resize( m_nVarSlots + 1 );
+		command.values.resize( m_nVarSlots );
+		command.defines  = m_pEntry->m_arrDefines;
+		command.macros   = m_pEntry->m_arrMacros;
+		command.builtFor = m_pEntry;
+	}
 
-	command.defines.emplace_back( String( tmpBuf ), "1" );
+	const auto& SetValue = [&command]( size_t iDefine, std::string_view value )
+	{
+		command.defines[iDefine].second   = value;
+		command.macros[iDefine].Definition = value.data();
+	};
+	SetValue( 0, Format( command.strings[0], m_iComboNumber, 16 ) );
 
-	for ( pSetValues = pnValues, pSetDef = pDefVars; pSetValues < pnValuesEnd && pDefVars < pDefVarsEnd; ++pSetValues, ++pSetDef )
+	// Going from one combo to the next usually changes a single value
+	for ( uint32_t i = 0; i < m_nVarSlots; ++i )
 	{
-		*std::to_chars( std::begin( tmpBuf ), std::end( tmpBuf ), *pSetValues ).ptr = 0;
-		command.defines.emplace_back( pSetDef->Name(), String( tmpBuf ) );
+		const int nValue = m_pVarSlots[i];
+		if ( bRebuild || command.values[i] != nValue )
+		{
+			command.values[i] = nValue;
+			if ( nValue >= 0 && nValue < NUM_SMALL_VALUES )
+				SetValue( FIRST_VALUE + i, s_arrSmallValues[nValue].data() );
+			else
+				SetValue( FIRST_VALUE + i, Format( command.strings[1 + i], nValue ) );
+		}
 	}
-
-	return command;
 }
 
 void ComboHandleImpl::FormatCommandHumanReadable( gsl::span<char> pchBuffer ) const
 {
 	// Get the pointers
-	const int* const pnValues    = m_arrVarSlots.data();
-	const int* const pnValuesEnd = pnValues + m_arrVarSlots.size();
+	const int* const pnValues    = m_pVarSlots;
+	const int* const pnValuesEnd = pnValues + m_nVarSlots;
 	const int* pSetValues;
 
 	// Defines
@@ -905,7 +1319,7 @@ void ComboHandleImpl::FormatCommandHumanReadable( gsl::span<char> pchBuffer ) co
 	_strupr_s( version );
 	int o = sprintf_s( pchBuffer.data(), pchBuffer.size(),
 		"fxc /DCENTROIDMASK=%d /DSHADERCOMBO=%llx /DSHADER_MODEL_%s=1 /T%s /Emain",
-		m_pEntry->m_eiInfo.m_nCentroidMask, m_iComboNumber, version, m_pEntry->m_eiInfo.m_szShaderVersion.data() );
+		m_pEntry->m_eiInfo.m_nCentroidMask, static_cast<unsigned long long>( m_iComboNumber ), version, m_pEntry->m_eiInfo.m_szShaderVersion.data() );
 
 	for ( pSetValues = pnValues, pSetDef = pDefVars; pSetValues < pnValuesEnd && pDefVars < pDefVarsEnd; ++pSetValues, ++pSetDef )
 		o += sprintf_s( &pchBuffer[o], pchBuffer.size() - o, " /D%s=%d", pSetDef->Name().c_str(), *pSetValues );
@@ -937,7 +1351,149 @@ std::vector<std::pair<std::string, std::string>> GenerateSkipAsserts( const std:
 	return asserts;
 }
 
-static void SetupConfiguration( const std::vector<CfgProcessor::ShaderConfig>& configs, const std::filesystem::path& root, bool bVerbose )
+// Bigger than that and the table costs more header than the asserts it replaces
+static constexpr uint64_t MAX_SKIP_TABLE_COMBOS = 1 << 12;
+
+bool GenerateSkipTable( const std::vector<Parser::Combo>& combos, const std::vector<std::string>& skips, std::vector<uint32_t>& table )
+{
+	ComboGenerator cg{};
+	for ( const Parser::Combo& combo : combos )
+		cg.AddDefine( Define( combo.name, combo.minVal, combo.maxVal, false ) );
+
+	table.clear();
+	const uint64_t nCombos = cg.NumCombos();
+	if ( nCombos > MAX_SKIP_TABLE_COMBOS )
+		return false;
+
+	// Same as the asserts, skips that read combos of the other kind don't apply
+	std::vector<std::unique_ptr<CComplexExpression>> arrSkips;
+	for ( const auto& skip : skips )
+	{
+		auto pSkip = std::make_unique<CComplexExpression>( &cg );
+		pSkip->Parse( skip );
+		if ( pSkip->IsValid() )
+			arrSkips.emplace_back( std::move( pSkip ) );
+	}
+	if ( arrSkips.empty() )
+		return true;
+
+	// Combo i has the first combo as its lowest digit, the way GetIndex adds them up
+	std::vector<int> slots( combos.size() );
+	const CSlotContext ctx{ cg, slots.data() };
+	table.resize( gsl::narrow<size_t>( ( nCombos + 31 ) / 32 ) );
+	for ( uint64_t i = 0; i < nCombos; ++i )
+	{
+		uint64_t n = i;
+		for ( size_t j = 0; j < combos.size(); ++j )
+		{
+			const uint64_t nRange = static_cast<uint64_t>( combos[j].maxVal ) - combos[j].minVal + 1;
+			slots[j]              = combos[j].minVal + static_cast<int>( n % nRange );
+			n /= nRange;
+		}
+
+		if ( std::none_of( arrSkips.cbegin(), arrSkips.cend(), [&ctx]( const auto& pSkip ) { return pSkip->Evaluate( &ctx ) != 0; } ) )
+			table[i / 32] |= 1U << ( i % 32 );
+	}
+	return true;
+}
+
+// Any more runs than that and the index costs more memory than walking the combos costs time
+static constexpr size_t MAX_COMBO_RUNS = 1 << 20;
+
+static void BuildComboIndex( uint32_t nThreads )
+{
+	struct IndexJob_t
+	{
+		CfgEntry* m_pEntry;
+		uint64_t m_iBegin;
+		uint64_t m_iEnd;
+		uint64_t m_nSurviving;
+		std::vector<CfgEntry::ComboRun_t> m_arrRuns;
+	};
+
+	// Big entries are cut into pieces so they spread over all the threads
+	std::vector<IndexJob_t> jobs;
+	for ( CfgEntry& e : s_arrEntries )
+	{
+		if ( e.m_bCounted )
+			continue;
+		const CfgProcessor::CfgEntryInfo& info = e.m_eiInfo;
+		const uint64_t nStep                   = std::max<uint64_t>( info.m_numCombos / ( nThreads * 8ULL ), 1ULL << 16 );
+		for ( uint64_t iBegin = info.m_iCommandStart; iBegin < info.m_iCommandEnd; iBegin += nStep )
+			jobs.emplace_back( IndexJob_t { &e, iBegin, std::min( iBegin + nStep, info.m_iCommandEnd ), 0, {} } );
+	}
+
+	std::atomic<size_t> nNextJob = 0;
+	const auto& IndexJobs = [&jobs, &nNextJob]()
+	{
+		for ( size_t iJob; ( iJob = nNextJob++ ) < jobs.size(); )
+		{
+			IndexJob_t& job = jobs[iJob];
+
+			uint64_t iCommand                = job.m_iBegin;
+			CfgProcessor::ComboHandle hCombo = nullptr;
+			for ( CfgProcessor::Combo_GetNext( iCommand, hCombo, job.m_iEnd ); hCombo && iCommand < job.m_iEnd; CfgProcessor::Combo_GetNext( iCommand, hCombo, job.m_iEnd ) )
+			{
+				++job.m_nSurviving;
+				if ( !job.m_arrRuns.empty() && job.m_arrRuns.back().m_iEnd == iCommand )
+					++job.m_arrRuns.back().m_iEnd;
+				else if ( job.m_arrRuns.size() <= MAX_COMBO_RUNS )
+					job.m_arrRuns.emplace_back( CfgEntry::ComboRun_t { iCommand, iCommand + 1, 0 } );
+			}
+			CfgProcessor::Combo_Free( hCombo );
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for ( uint32_t i = 1; i < nThreads; ++i )
+		threads.emplace_back( IndexJobs );
+	IndexJobs();
+	for ( std::thread& t : threads )
+		t.join();
+
+	// Stitch the pieces of every entry back together, jobs of an entry are in order
+	for ( IndexJob_t& job : jobs )
+	{
+		CfgEntry& e = *job.m_pEntry;
+		if ( job.m_iBegin == e.m_eiInfo.m_iCommandStart )
+		{
+			e.m_eiInfo.m_numSurvivingCombos = 0;
+			e.m_bIndexed                    = true;
+		}
+
+		e.m_eiInfo.m_numSurvivingCombos += job.m_nSurviving;
+		e.m_bIndexed = e.m_bIndexed && job.m_arrRuns.size() <= MAX_COMBO_RUNS;
+		for ( const CfgEntry::ComboRun_t& run : job.m_arrRuns )
+		{
+			if ( !e.m_bIndexed )
+				break;
+
+			if ( !e.m_arrComboRuns.empty() && e.m_arrComboRuns.back().m_iEnd == run.m_iBegin )
+				e.m_arrComboRuns.back().m_iEnd = run.m_iEnd;
+			else
+				e.m_arrComboRuns.emplace_back( run );
+		}
+		job.m_arrRuns = {};
+
+		if ( !e.m_bIndexed || e.m_arrComboRuns.size() > MAX_COMBO_RUNS )
+		{
+			e.m_bIndexed     = false;
+			e.m_arrComboRuns = {};
+		}
+	}
+
+	for ( CfgEntry& e : s_arrEntries )
+	{
+		uint64_t nBefore = 0;
+		for ( CfgEntry::ComboRun_t& run : e.m_arrComboRuns )
+		{
+			run.m_nBefore = nBefore;
+			nBefore += run.m_iEnd - run.m_iBegin;
+		}
+	}
+}
+
+static void SetupConfiguration( const std::vector<CfgProcessor::ShaderConfig>& configs, const std::filesystem::path& root, bool bVerbose, uint32_t nThreads )
 {
 	using namespace std::literals;
 	const auto& AddCombos = []( ComboGenerator& cg, const std::vector<Parser::Combo>& combos, bool staticC )
@@ -946,14 +1502,13 @@ static void SetupConfiguration( const std::vector<CfgProcessor::ShaderConfig>& c
 			cg.AddDefine( Define( combo.name, combo.minVal, combo.maxVal, staticC ) );
 	};
 
-	char baseTemplate[] = { " s_ _ " };
-
+	std::mutex mtxIncludes;
 	robin_hood::unordered_node_set<std::string> includes;
-	for ( const auto& conf : configs )
+	const auto& SetupEntry = [&]( const CfgProcessor::ShaderConfig& conf, std::optional<CfgEntry>& entry )
 	{
-		CfgEntry cfg;
-		cfg.m_szName = *s_strPool.emplace( conf.name ).first;
-		cfg.m_szShaderSrc = *s_strPool.emplace( conf.includes[0] ).first;
+		CfgEntry& cfg = entry.emplace();
+		cfg.m_szName = s_strPool.Intern( conf.name );
+		cfg.m_szShaderSrc = s_strPool.Intern( conf.includes[0] );
 		// Combo generator
 		cfg.m_pCg = std::make_unique<ComboGenerator>();
 		cfg.m_pExpr = std::make_unique<CComplexExpression>( cfg.m_pCg.get() );
@@ -964,6 +1519,39 @@ static void SetupConfiguration( const std::vector<CfgProcessor::ShaderConfig>& c
 		AddCombos( cg, conf.static_c, true );
 		exprSkip.Parse( ( std::accumulate( conf.skip.begin(), conf.skip.end(), "("s, []( const std::string& s, const std::string& sk ) { return s + sk + ")||("; } ) + "0)" ) );
 
+		// In the order of the slots, the index follows them
+		uint64_t nComboHash = CompileCache::HashString( conf.name, 0 );
+		for ( const std::vector<Parser::Combo>* pCombos : { &conf.dynamic_c, &conf.static_c } )
+		{
+			for ( const Parser::Combo& combo : *pCombos )
+			{
+				const int32_t arrRange[] = { combo.minVal, combo.maxVal };
+				nComboHash = CompileCache::HashBytes( arrRange, sizeof( arrRange ), CompileCache::HashString( combo.name, nComboHash ) );
+			}
+			nComboHash = CompileCache::HashString( "|"sv, nComboHash );
+		}
+		for ( const std::string& skip : conf.skip )
+			nComboHash = CompileCache::HashString( skip, nComboHash );
+		cfg.m_nComboHash = nComboHash;
+
+		// Split out the clauses so enumeration knows which slots each one reads
+		if ( exprSkip.IsValid() )
+		{
+			for ( const std::string& skip : conf.skip )
+			{
+				auto& pClause = cfg.m_arrSkipClauses.emplace_back( std::make_unique<CComplexExpression>( &cg ) );
+				pClause->Parse( skip );
+				if ( !pClause->IsValid() || !pClause->IsCompiled() )
+				{
+					cfg.m_arrSkipClauses.clear();
+					break;
+				}
+			}
+
+			std::stable_sort( cfg.m_arrSkipClauses.begin(), cfg.m_arrSkipClauses.end(), []( const auto& a, const auto& b ) noexcept { return a->LowestSlot() > b->LowestSlot(); } );
+		}
+
+		char baseTemplate[] = { " s_ _ " };
 		baseTemplate[0] = conf.target[0];
 		baseTemplate[3] = conf.version[0];
 		baseTemplate[5] = conf.version.size() == 3 ? 'b' : conf.version[1];
@@ -971,58 +1559,166 @@ static void SetupConfiguration( const std::vector<CfgProcessor::ShaderConfig>& c
 		CfgProcessor::CfgEntryInfo& info = cfg.m_eiInfo;
 		info.m_szName = cfg.m_szName;
 		info.m_szShaderFileName = cfg.m_szShaderSrc;
-		info.m_szShaderVersion = *s_strPool.emplace( baseTemplate ).first;
-		info.m_szEntryPoint = *s_strPool.emplace( conf.main ).first;
+		info.m_szShaderVersion = s_strPool.Intern( baseTemplate );
+
+		// What BuildCommand starts every command of the entry from, only the values change
+		std::string shaderModel = "SHADER_MODEL_"s + baseTemplate;
+		std::transform( shaderModel.begin(), shaderModel.end(), shaderModel.begin(), []( char c ) { return static_cast<char>( std::toupper( c ) ); } );
+		cfg.m_arrDefines.emplace_back( "SHADERCOMBO"sv, std::string_view() );
+		cfg.m_arrDefines.emplace_back( s_strPool.Intern( shaderModel ), "1"sv );
+		for ( const Define* pDef = cg.GetDefinesBase(); pDef < cg.GetDefinesEnd(); ++pDef )
+			cfg.m_arrDefines.emplace_back( pDef->Name(), std::string_view() );
+		for ( const auto& [name, value] : cfg.m_arrDefines )
+			cfg.m_arrMacros.emplace_back( CfgProcessor::ComboBuildCommand::Macro_t{ name.data(), value.data() } );
+		cfg.m_arrMacros.emplace_back( CfgProcessor::ComboBuildCommand::Macro_t{ nullptr, nullptr } );
+		info.m_szEntryPoint = s_strPool.Intern( conf.main );
 		info.m_numCombos = cg.NumCombos();
 		info.m_numDynamicCombos = cg.NumCombos( false );
 		info.m_numStaticCombos = cg.NumCombos( true );
+		info.m_numSurvivingCombos = info.m_numCombos;
+		info.m_numDynamicDefines = gsl::narrow<uint32_t>( conf.dynamic_c.size() );
 		info.m_nCentroidMask = conf.centroid_mask;
+		info.m_bReleaseProfile = conf.release_profile;
 		info.m_nCrc32 = conf.crc32;
 
-		s_setEntries.insert( std::move( cfg ) );
+		// Hash the source together with everything it includes, this is what the compile cache keys on
+		uint64_t nSourceHash = 0;
+		for ( const std::string& file : conf.includes )
+		{
+			// Parsing the shader most likely read it already
+			const CSharedFile* pFile = fileCache.GetOrLoad( file, root / file );
+			bool bFirst;
+			{
+				std::lock_guard lock( mtxIncludes );
+				bFirst = includes.insert( file ).second;
+			}
+			if ( !pFile )
+			{
+				if ( bFirst )
+					std::cout << clr::pinkish << "Can't find \"" << clr::red << file << clr::pinkish << "\"" << std::endl;
+				continue;
+			}
 
-		includes.insert( conf.includes.cbegin(), conf.includes.cend() );
-	}
+			if ( bFirst && bVerbose )
+				std::cout << "adding file to cache: \"" << clr::green << file << clr::reset << "\"" << std::endl;
 
-	for ( const std::string& file : includes )
-	{
-		std::ifstream src( root / file, std::ios::binary | std::ios::ate );
-		if ( !src )
-		{
-			std::cout << clr::pinkish << "Can't find \"" << clr::red << file << clr::pinkish << "\"" << std::endl;
-			continue;
+			nSourceHash = CompileCache::HashString( file, nSourceHash );
+			nSourceHash = CompileCache::HashBytes( pFile->Data(), pFile->Size(), nSourceHash );
 		}
+		info.m_nSourceHash = nSourceHash;
 
-		if ( bVerbose )
-			std::cout << "adding file to cache: \"" << clr::green << file << clr::reset << "\"" << std::endl;
+		cfg.m_flCost = static_cast<double>( conf.cost );
+	};
 
-		std::vector<char> data( gsl::narrow<size_t>( src.tellg() ) );
-		src.clear();
-		src.seekg( 0, std::ios::beg );
-		src.read( data.data(), data.size() );
+	// Parsing the skips and hashing the sources takes a while with a lot of shaders.
+	// Every config gets its own slot so the entries keep the order of the configs.
+	std::vector<std::optional<CfgEntry>> arrEntries( configs.size() );
+	std::atomic<size_t> nNextConfig = 0;
+	const auto& SetupEntries = [&]()
+	{
+		for ( size_t iConfig; ( iConfig = nNextConfig++ ) < configs.size(); )
+			SetupEntry( configs[iConfig], arrEntries[iConfig] );
+	};
 
-		fileCache.Add( file, std::move( data ) );
+	std::vector<std::thread> threads;
+	for ( uint32_t i = 1; i < std::min<size_t>( nThreads, configs.size() ); ++i )
+		threads.emplace_back( SetupEntries );
+	SetupEntries();
+	for ( std::thread& t : threads )
+		t.join();
+
+	for ( std::optional<CfgEntry>& entry : arrEntries )
+	{
+		if ( entry )
+			s_arrEntries.emplace_back( std::move( *entry ) );
 	}
 
+	// Shaders that were never timed cost as much per combo as the ones that were on average
+	double flKnownCost = 0.0, flKnownCombos = 0.0;
+	for ( const CfgEntry& e : s_arrEntries )
+	{
+		if ( e.m_flCost > 0.0 )
+		{
+			flKnownCost += e.m_flCost;
+			flKnownCombos += static_cast<double>( e.m_pCg->NumCombos() );
+		}
+	}
+	const double flCostPerCombo = flKnownCombos > 0.0 ? flKnownCost / flKnownCombos : 1.0;
+	for ( CfgEntry& e : s_arrEntries )
+	{
+		if ( e.m_flCost <= 0.0 )
+			e.m_flCost = static_cast<double>( e.m_pCg->NumCombos() ) * flCostPerCombo;
+	}
+
+	// Most expensive first, equal ones in reverse order of the configs
+	std::stable_sort( s_arrEntries.begin(), s_arrEntries.end() );
+	std::reverse( s_arrEntries.begin(), s_arrEntries.end() );
+
 	uint64_t nCurrentCommand = 0;
-	for ( auto it = s_setEntries.rbegin(), itEnd = s_setEntries.rend(); it != itEnd; ++it )
+	for ( CfgEntry& e : s_arrEntries )
 	{
-		// We establish a command mapping for the beginning of the entry
-		ComboHandleImpl chi;
-		chi.Initialize( nCurrentCommand, &*it );
-		s_mapComboCommands.emplace( nCurrentCommand, chi );
+		CfgProcessor::CfgEntryInfo& info = e.m_eiInfo;
+		info.m_iCommandStart = nCurrentCommand;
+		info.m_iCommandEnd   = nCurrentCommand + e.m_pCg->NumCombos();
+		nCurrentCommand      = info.m_iCommandEnd;
+	}
 
-		// We also establish mapping by either splitting the
-		// combos into 500 intervals or stepping by every 1000 combos.
-		const uint64_t iPartStep = std::max( 1000ULL, chi.m_numCombos / 500 );
-		for ( uint64_t iRecord = nCurrentCommand + iPartStep; iRecord < nCurrentCommand + chi.m_numCombos; iRecord += iPartStep )
+	// Every entry lays out its checkpoints on its own, slot offsets relative to its first one
+	struct EntryCheckpoints_t
+	{
+		std::vector<ComboCheckpoint_t> m_arrCheckpoints;
+		std::vector<int> m_arrSlots;
+	};
+	std::vector<EntryCheckpoints_t> arrEntryCheckpoints( s_arrEntries.size() );
+	std::atomic<size_t> nNextEntry = 0;
+	const auto& AddEntryCheckpoints = [&arrEntryCheckpoints, &nNextEntry]()
+	{
+		for ( size_t iEntry; ( iEntry = nNextEntry++ ) < s_arrEntries.size(); )
 		{
-			uint64_t iAdvance = iPartStep;
-			chi.AdvanceCommands( iAdvance );
-			s_mapComboCommands.emplace( iRecord, chi );
+			CfgEntry& e				  = s_arrEntries[iEntry];
+			EntryCheckpoints_t& check = arrEntryCheckpoints[iEntry];
+
+			// We establish a command mapping for the beginning of the entry
+			ComboHandleImpl chi;
+			chi.Initialize( e.m_eiInfo.m_iCommandStart, &e );
+			AddCheckpoint( chi, check.m_arrCheckpoints, check.m_arrSlots );
+
+			// We also establish mapping by either splitting the
+			// combos into 500 intervals or stepping by every 1000 combos.
+			const uint64_t iPartStep = std::max<uint64_t>( 1000, chi.m_numCombos / 500 );
+			for ( uint64_t iRecord = e.m_eiInfo.m_iCommandStart + iPartStep; iRecord < e.m_eiInfo.m_iCommandEnd; iRecord += iPartStep )
+			{
+				uint64_t iAdvance = iPartStep;
+				chi.AdvanceCommands( iAdvance );
+				AddCheckpoint( chi, check.m_arrCheckpoints, check.m_arrSlots );
+			}
 		}
+	};
+
+	threads.clear();
+	for ( uint32_t i = 1; i < std::min<size_t>( nThreads, s_arrEntries.size() ); ++i )
+		threads.emplace_back( AddEntryCheckpoints );
+	AddEntryCheckpoints();
+	for ( std::thread& t : threads )
+		t.join();
 
-		nCurrentCommand += chi.m_numCombos;
+	size_t nCheckpoints = 1, nCheckpointSlots = 0;
+	for ( const EntryCheckpoints_t& check : arrEntryCheckpoints )
+	{
+		nCheckpoints += check.m_arrCheckpoints.size();
+		nCheckpointSlots += check.m_arrSlots.size();
+	}
+	s_arrCheckpoints.reserve( nCheckpoints );
+	s_arrCheckpointSlots.reserve( nCheckpointSlots );
+	for ( const EntryCheckpoints_t& check : arrEntryCheckpoints )
+	{
+		const size_t iFirstSlot = s_arrCheckpointSlots.size();
+		for ( ComboCheckpoint_t checkpoint : check.m_arrCheckpoints )
+		{
+			checkpoint.m_iFirstSlot = gsl::narrow<uint32_t>( checkpoint.m_iFirstSlot + iFirstSlot );
+			s_arrCheckpoints.emplace_back( checkpoint );
+		}
+		s_arrCheckpointSlots.insert( s_arrCheckpointSlots.end(), check.m_arrSlots.cbegin(), check.m_arrSlots.cend() );
 	}
 
 	// Establish the last command terminator
@@ -1034,7 +1730,7 @@ static void SetupConfiguration( const std::vector<CfgProcessor::ShaderConfig>& c
 		ComboHandleImpl chi;
 		chi.m_iTotalCommand = nCurrentCommand;
 		chi.m_pEntry = &s_term;
-		s_mapComboCommands.emplace( nCurrentCommand, chi );
+		AddCheckpoint( chi );
 	}
 }
 }; // namespace ConfigurationProcessing
@@ -1051,83 +1747,309 @@ static ComboHandle AsHandle( CPCHI_t* pImpl ) noexcept
 	return reinterpret_cast<ComboHandle>( pImpl );
 }
 
-void SetupConfiguration( const std::vector<ShaderConfig>& configs, const std::filesystem::path& root, bool bVerbose )
+// Every thread keeps the last handle it freed. Workers free their handle and seek a new
+// one on every claim, this way that never reaches the allocator.
+static thread_local std::unique_ptr<CPCHI_t> s_tlSpareHandle;
+
+static CPCHI_t* NewHandle( const CPCHI_t& from )
 {
-	ConfigurationProcessing::SetupConfiguration( configs, root, bVerbose );
+	if ( CPCHI_t* pSpare = s_tlSpareHandle.release() )
+	{
+		*pSpare = from;
+		return pSpare;
+	}
+	return new CPCHI_t( from );
+}
+
+static void FreeHandle( CPCHI_t* pImpl ) noexcept
+{
+	if ( !s_tlSpareHandle )
+		s_tlSpareHandle.reset( pImpl );
+	else
+		delete pImpl;
+}
+
+// Shard s_iShard of s_nShards gets every s_nShards'th block of SHARD_BLOCK static combos of every entry
+static constexpr uint64_t SHARD_BLOCK = 16;
+static uint32_t s_iShard  = 0;
+static uint32_t s_nShards = 1;
+
+void SetShard( uint32_t iShard, uint32_t nShards ) noexcept
+{
+	s_iShard  = iShard;
+	s_nShards = std::max( nShards, 1U );
+}
+
+// Magic and version, the number of records, then every record with its name and runs, all of it 8 byte aligned
+static constexpr uint32_t INDEX_MAGIC	= ( 'X' << 24 ) + ( 'D' << 16 ) + ( 'I' << 8 ) + 'C';
+static constexpr uint32_t INDEX_VERSION = 1;
+
+struct IndexHeader_t
+{
+	uint32_t m_nMagic;
+	uint32_t m_nVersion;
+	uint64_t m_nRecords;
+};
+
+// The runs are relative to the start of the entry, its place among the others changes from build to build
+struct IndexRecord_t
+{
+	uint64_t m_nKey; // Combo hash of the entry and the shard
+	uint64_t m_nSurviving;
+	uint32_t m_nNameSize;
+	uint32_t m_bIndexed;
+	uint64_t m_nRuns;
+};
+static_assert( sizeof( IndexRecord_t ) == 4 * 8 );
+
+static constexpr size_t Align8( size_t n ) noexcept
+{
+	return ( n + 7 ) & ~size_t( 7 );
+}
+
+using Run_t = ConfigurationProcessing::CfgEntry::ComboRun_t;
+static std::unique_ptr<Platform::CMappedFile> s_pIndexFile;
+static robin_hood::unordered_flat_map<uint64_t, const IndexRecord_t*> s_mapIndexRecords;
+static bool s_bIndexBuilt = false;
+
+static uint64_t IndexKeyOf( const ConfigurationProcessing::CfgEntry& e ) noexcept
+{
+	const uint32_t arrShard[] = { s_iShard, s_nShards };
+	return CompileCache::HashBytes( arrShard, sizeof( arrShard ), e.m_nComboHash );
+}
+
+static std::string_view NameOf( const IndexRecord_t* pRecord ) noexcept
+{
+	return { reinterpret_cast<const char*>( pRecord + 1 ), pRecord->m_nNameSize };
+}
+
+static const Run_t* RunsOf( const IndexRecord_t* pRecord ) noexcept
+{
+	return reinterpret_cast<const Run_t*>( reinterpret_cast<const uint8_t*>( pRecord + 1 ) + Align8( pRecord->m_nNameSize ) );
+}
+
+void LoadComboIndex( const std::filesystem::path& path )
+{
+	s_mapIndexRecords.clear();
+	s_pIndexFile = std::make_unique<Platform::CMappedFile>( path );
+	const uint8_t* pData = s_pIndexFile->Data();
+	const size_t nSize	 = s_pIndexFile->Size();
+	IndexHeader_t header;
+	if ( !pData || nSize < sizeof( header ) )
+		return;
+	memcpy( &header, pData, sizeof( header ) );
+	if ( header.m_nMagic != INDEX_MAGIC || header.m_nVersion != INDEX_VERSION )
+		return;
+
+	// A record that doesn't fit ends the file, the ones before it are still good
+	s_mapIndexRecords.reserve( header.m_nRecords );
+	for ( size_t nPos = sizeof( header ); header.m_nRecords-- && nPos + sizeof( IndexRecord_t ) <= nSize; )
+	{
+		const IndexRecord_t* pRecord = reinterpret_cast<const IndexRecord_t*>( pData + nPos );
+		const uint64_t nRecordSize	 = sizeof( IndexRecord_t ) + Align8( pRecord->m_nNameSize ) + pRecord->m_nRuns * sizeof( Run_t );
+		if ( pRecord->m_nRuns > ConfigurationProcessing::MAX_COMBO_RUNS || nRecordSize > nSize - nPos )
+			break;
+		s_mapIndexRecords.emplace( pRecord->m_nKey, pRecord );
+		nPos += nRecordSize;
+	}
+}
+
+// Entries whose defines and skips are in the index file get their runs from it, returns how many did
+static size_t ReadComboIndex()
+{
+	size_t nRead = 0;
+	for ( ConfigurationProcessing::CfgEntry& e : ConfigurationProcessing::s_arrEntries )
+	{
+		const auto it = s_mapIndexRecords.find( IndexKeyOf( e ) );
+		if ( it == s_mapIndexRecords.end() || NameOf( it->second ) != e.m_szName )
+			continue;
+
+		const IndexRecord_t* pRecord = it->second;
+		const uint64_t iStart		 = e.m_eiInfo.m_iCommandStart;
+		const Run_t* pRuns			 = RunsOf( pRecord );
+		e.m_arrComboRuns.clear();
+		e.m_arrComboRuns.reserve( pRecord->m_nRuns );
+		for ( uint64_t i = 0; i < pRecord->m_nRuns; ++i )
+			e.m_arrComboRuns.emplace_back( Run_t{ pRuns[i].m_iBegin + iStart, pRuns[i].m_iEnd + iStart, pRuns[i].m_nBefore } );
+		e.m_bIndexed					= pRecord->m_bIndexed != 0;
+		e.m_bCounted					= true;
+		e.m_eiInfo.m_numSurvivingCombos = pRecord->m_nSurviving;
+		++nRead;
+	}
+	return nRead;
+}
+
+bool SaveComboIndex( const std::filesystem::path& path )
+{
+	if ( !s_bIndexBuilt )
+		return false;
+
+	// Shaders that weren't set up this time keep what they had
+	std::vector<uint8_t> data( sizeof( IndexHeader_t ) );
+	uint64_t nRecords = 0;
+	const auto& Append = [&data, &nRecords]( const IndexRecord_t& record, std::string_view name, const Run_t* pRuns, uint64_t iStart )
+	{
+		const size_t nPos = data.size();
+		data.resize( nPos + sizeof( record ) + Align8( name.size() ) + record.m_nRuns * sizeof( Run_t ) );
+		memcpy( data.data() + nPos, &record, sizeof( record ) );
+		memcpy( data.data() + nPos + sizeof( record ), name.data(), name.size() );
+		Run_t* pOut = reinterpret_cast<Run_t*>( data.data() + nPos + sizeof( record ) + Align8( name.size() ) );
+		for ( uint64_t i = 0; i < record.m_nRuns; ++i )
+			pOut[i] = Run_t{ pRuns[i].m_iBegin - iStart, pRuns[i].m_iEnd - iStart, pRuns[i].m_nBefore };
+		++nRecords;
+	};
+
+	robin_hood::unordered_flat_set<std::string_view> names;
+	for ( const ConfigurationProcessing::CfgEntry& e : ConfigurationProcessing::s_arrEntries )
+	{
+		names.emplace( e.m_szName );
+		Append( IndexRecord_t{ IndexKeyOf( e ), e.m_eiInfo.m_numSurvivingCombos, gsl::narrow<uint32_t>( e.m_szName.size() ), e.m_bIndexed, e.m_arrComboRuns.size() }, e.m_szName,
+				e.m_arrComboRuns.data(), e.m_eiInfo.m_iCommandStart );
+	}
+	for ( const auto& [nKey, pRecord] : s_mapIndexRecords )
+	{
+		if ( !names.contains( NameOf( pRecord ) ) )
+			Append( *pRecord, NameOf( pRecord ), RunsOf( pRecord ), 0 );
+	}
+	const IndexHeader_t header{ INDEX_MAGIC, INDEX_VERSION, nRecords };
+	memcpy( data.data(), &header, sizeof( header ) );
+
+	// The old file can only be replaced once it isn't mapped anymore
+	s_mapIndexRecords.clear();
+	s_pIndexFile.reset();
+	s_bIndexBuilt = false;
+
+	std::filesystem::path tmpPath = path;
+	tmpPath += ".tmp";
+	{
+		std::ofstream file( tmpPath, std::ios::binary | std::ios::trunc );
+		if ( !file.write( reinterpret_cast<const char*>( data.data() ), data.size() ) || !file.flush() )
+		{
+			file.close();
+			std::error_code c;
+			std::filesystem::remove( tmpPath, c );
+			return false;
+		}
+	}
+	return Platform::RenameOver( tmpPath, path );
+}
+
+void SetupConfiguration( const std::vector<ShaderConfig>& configs, const std::filesystem::path& root, bool bVerbose, uint32_t nThreads, uint32_t nIndexThreads )
+{
+	ConfigurationProcessing::SetupConfiguration( configs, root, bVerbose, nThreads );
+	if ( !nIndexThreads )
+		return;
+
+	const size_t nRead = ReadComboIndex();
+	if ( bVerbose && nRead )
+		std::cout << "Combo index of " << clr::green << nRead << clr::reset << " of " << clr::green << ConfigurationProcessing::s_arrEntries.size() << clr::reset << " shaders read from the index file" << std::endl;
+	ConfigurationProcessing::BuildComboIndex( nIndexThreads );
+	s_bIndexBuilt = true;
+}
+
+void ResetConfiguration()
+{
+	ConfigurationProcessing::s_arrEntries.clear();
+	ConfigurationProcessing::s_arrCheckpoints.clear();
+	ConfigurationProcessing::s_arrCheckpointSlots.clear();
+}
+
+MemoryUsage_t MemoryUsage()
+{
+	using namespace ConfigurationProcessing;
+	uint64_t nIndex = s_arrCheckpoints.capacity() * sizeof( ComboCheckpoint_t ) + s_arrCheckpointSlots.capacity() * sizeof( int );
+	for ( const CfgEntry& e : s_arrEntries )
+		nIndex += e.m_arrComboRuns.capacity() * sizeof( CfgEntry::ComboRun_t );
+	return { nIndex, s_strPool.Bytes() };
 }
 
 std::unique_ptr<CfgProcessor::CfgEntryInfo[]> DescribeConfiguration( bool bPrintExpressions )
 {
-	auto arrEntries = std::make_unique<CfgEntryInfo[]>( ConfigurationProcessing::s_setEntries.size() + 1 );
+	auto arrEntries = std::make_unique<CfgEntryInfo[]>( ConfigurationProcessing::s_arrEntries.size() + 1 );
 
 	CfgEntryInfo* pInfo      = arrEntries.get();
 	uint64_t nCurrentCommand = 0;
 
-	for ( auto it = ConfigurationProcessing::s_setEntries.rbegin(), itEnd = ConfigurationProcessing::s_setEntries.rend(); it != itEnd; ++it, ++pInfo )
+	for ( ConfigurationProcessing::CfgEntry& e : ConfigurationProcessing::s_arrEntries )
 	{
-		const ConfigurationProcessing::CfgEntry& e = *it;
 		*pInfo = e.m_eiInfo;
 
 		pInfo->m_iCommandStart    = nCurrentCommand;
 		pInfo->m_iCommandEnd      = pInfo->m_iCommandStart + pInfo->m_numCombos;
 
-		const_cast<CfgEntryInfo&>( e.m_eiInfo ) = *pInfo;
+		e.m_eiInfo = *pInfo;
 
 		if ( bPrintExpressions )
 			e.m_pExpr->Print( nullptr );
 
-		nCurrentCommand += pInfo->m_numCombos;
+		nCurrentCommand += pInfo++->m_numCombos;
 	}
 
 	// Terminator
-	memset( pInfo, 0, sizeof( CfgEntryInfo ) );
+	*pInfo = {};
 	pInfo->m_iCommandStart = nCurrentCommand;
 	pInfo->m_iCommandEnd   = nCurrentCommand;
 
 	return arrEntries;
 }
 
-static const CPCHI_t& GetLessOrEq( uint64_t& k, const CPCHI_t& v )
+bool FindStaticCombos( std::string_view szShader, const std::string& szExpression, std::vector<uint64_t>& arrStaticCombos )
 {
-	auto it = ConfigurationProcessing::s_mapComboCommands.lower_bound( k );
-	if ( ConfigurationProcessing::s_mapComboCommands.end() == it )
+	using namespace ConfigurationProcessing;
+	const auto it = std::find_if( s_arrEntries.cbegin(), s_arrEntries.cend(), [szShader]( const CfgEntry& e ) { return e.m_szName == szShader; } );
+	if ( it == s_arrEntries.cend() )
+		return false;
+
+	ComboGenerator cg{};
+	for ( const Define* pDef = it->m_pCg->GetDefinesBase(); pDef < it->m_pCg->GetDefinesEnd(); ++pDef )
 	{
-		if ( ConfigurationProcessing::s_mapComboCommands.empty() )
-			return v;
-		--it;
+		if ( pDef->IsStatic() )
+			cg.AddDefine( *pDef );
 	}
 
-	if ( k < it->first )
+	CComplexExpression expr{ &cg };
+	expr.Parse( szExpression );
+	if ( !expr.IsValid() )
+		return false;
+
+	// The first static combo is the lowest digit of the id, the same as in the combo number
+	const Define* const pDefs = cg.GetDefinesBase();
+	const size_t nDefs		  = cg.DefineCount();
+	std::vector<int> slots( nDefs );
+	for ( size_t j = 0; j < nDefs; ++j )
+		slots[j] = pDefs[j].Min();
+
+	const CSlotContext ctx{ cg, slots.data() };
+	arrStaticCombos.clear();
+	for ( uint64_t s = 0, nStaticCombos = cg.NumCombos(); s < nStaticCombos; ++s )
 	{
-		if ( ConfigurationProcessing::s_mapComboCommands.begin() == it )
-			return v;
-		--it;
+		if ( expr.Evaluate( &ctx ) != 0 )
+			arrStaticCombos.emplace_back( s );
+		for ( size_t j = 0; j < nDefs && ++slots[j] > pDefs[j].Max(); ++j )
+			slots[j] = pDefs[j].Min();
 	}
-
-	k = it->first;
-	return it->second;
+	return true;
 }
 
+using ConfigurationProcessing::FindCheckpoint;
+
 ComboHandle Combo_GetCombo( uint64_t iCommandNumber )
 {
 	// Find earlier command
-	uint64_t iCommandFound = iCommandNumber;
-	const CPCHI_t emptyCPCHI;
-	const CPCHI_t& chiFound = GetLessOrEq( iCommandFound, emptyCPCHI );
-
-	if ( chiFound.m_iTotalCommand < 0 || chiFound.m_iTotalCommand > iCommandNumber )
+	const ConfigurationProcessing::ComboCheckpoint_t* pFound = FindCheckpoint( iCommandNumber );
+	if ( !pFound )
 		return nullptr;
 
 	// Advance the handle as needed
-	CPCHI_t* pImpl = new CPCHI_t( chiFound );
+	CPCHI_t* pImpl = NewHandle( CPCHI_t( *pFound ) );
 
-	uint64_t iCommandFoundAdvance = iCommandNumber - iCommandFound;
+	uint64_t iCommandFoundAdvance = iCommandNumber - pFound->m_iTotalCommand;
 	pImpl->AdvanceCommands( iCommandFoundAdvance );
 
 	return AsHandle( pImpl );
 }
 
-void Combo_GetNext( uint64_t& riCommandNumber, ComboHandle& rhCombo, uint64_t iCommandEnd )
+static void GetNextCombo( uint64_t& riCommandNumber, ComboHandle& rhCombo, uint64_t iCommandEnd )
 {
 	// Combo handle implementation
 	CPCHI_t* pImpl = FromHandle( rhCombo );
@@ -1137,18 +2059,15 @@ void Combo_GetNext( uint64_t& riCommandNumber, ComboHandle& rhCombo, uint64_t iC
 		// We don't have a combo handle that corresponds to the command
 
 		// Find earlier command
-		uint64_t iCommandFound = riCommandNumber;
-		const CPCHI_t emptyCPCHI;
-		const CPCHI_t& chiFound = GetLessOrEq( iCommandFound, emptyCPCHI );
-
-		if ( !chiFound.m_pEntry || !chiFound.m_pEntry->m_pCg || !chiFound.m_pEntry->m_pExpr || chiFound.m_iTotalCommand < 0 || chiFound.m_iTotalCommand > riCommandNumber )
+		const ConfigurationProcessing::ComboCheckpoint_t* pFound = FindCheckpoint( riCommandNumber );
+		if ( !pFound || !pFound->m_pEntry->m_pCg || !pFound->m_pEntry->m_pExpr )
 			return;
 
 		// Advance the handle as needed
-		pImpl   = new CPCHI_t( chiFound );
+		pImpl   = NewHandle( CPCHI_t( *pFound ) );
 		rhCombo = AsHandle( pImpl );
 
-		uint64_t iCommandFoundAdvance = riCommandNumber - iCommandFound;
+		uint64_t iCommandFoundAdvance = riCommandNumber - pFound->m_iTotalCommand;
 		pImpl->AdvanceCommands( iCommandFoundAdvance );
 
 		if ( !pImpl->IsSkipped() )
@@ -1167,7 +2086,7 @@ void Combo_GetNext( uint64_t& riCommandNumber, ComboHandle& rhCombo, uint64_t iC
 		// We failed to get the next combo command (out of range)
 		if ( pImpl->m_iTotalCommand + 1 >= iCommandEnd )
 		{
-			delete pImpl;
+			FreeHandle( pImpl );
 			rhCombo         = nullptr;
 			riCommandNumber = iCommandEnd;
 			return;
@@ -1176,29 +2095,61 @@ void Combo_GetNext( uint64_t& riCommandNumber, ComboHandle& rhCombo, uint64_t iC
 		// Otherwise we just have to obtain the next combo handle
 		riCommandNumber = pImpl->m_iTotalCommand + 1;
 
-		// Delete the old combo handle
-		delete pImpl;
-		rhCombo = nullptr;
-
 		// Retrieve the next combo handle data
-		uint64_t iCommandLookup = riCommandNumber;
-		CPCHI_t emptyCPCHI;
-		const CPCHI_t& chiNext = GetLessOrEq( iCommandLookup, emptyCPCHI );
-		Assert( iCommandLookup == riCommandNumber && ( chiNext.m_pEntry ) );
+		const ConfigurationProcessing::ComboCheckpoint_t* pNext = FindCheckpoint( riCommandNumber );
+		Assert( pNext && pNext->m_iTotalCommand == riCommandNumber );
 
-		// Set up the new combo handle
-		pImpl   = new CPCHI_t( chiNext );
-		rhCombo = AsHandle( pImpl );
+		// Reuse the old combo handle for it
+		*pImpl = CPCHI_t( *pNext );
 
 		if ( !pImpl->IsSkipped() )
 			return;
 	}
 }
 
+// First command at or after iCommand that belongs to a static combo of this shard, the end of the entry if there is none
+static uint64_t NextShardCommand( const CfgEntryInfo& info, uint64_t iCommand ) noexcept
+{
+	// Static combos count down from the start of the entry
+	const uint64_t nBlock = ( info.m_iCommandEnd - 1 - iCommand ) / info.m_numDynamicCombos / SHARD_BLOCK;
+	if ( nBlock % s_nShards == s_iShard )
+		return iCommand;
+	if ( nBlock < s_iShard )
+		return info.m_iCommandEnd;
+
+	const uint64_t nShardBlock = nBlock - ( nBlock - s_iShard ) % s_nShards;
+	return info.m_iCommandEnd - std::min( ( nShardBlock + 1 ) * SHARD_BLOCK, info.m_numStaticCombos ) * info.m_numDynamicCombos;
+}
+
+void Combo_GetNext( uint64_t& riCommandNumber, ComboHandle& rhCombo, uint64_t iCommandEnd )
+{
+	GetNextCombo( riCommandNumber, rhCombo, iCommandEnd );
+
+	// Combos of the other shards count as skipped, seek straight to the next block of ours
+	while ( s_nShards > 1 && rhCombo )
+	{
+		const uint64_t iShardCommand = NextShardCommand( FromHandle( rhCombo )->m_pEntry->m_eiInfo, riCommandNumber );
+		if ( iShardCommand == riCommandNumber )
+			return;
+
+		Combo_Free( rhCombo );
+		riCommandNumber = std::min( iShardCommand, iCommandEnd );
+		if ( riCommandNumber == iCommandEnd )
+			return;
+		GetNextCombo( riCommandNumber, rhCombo, iCommandEnd );
+	}
+}
+
 ComboBuildCommand Combo_BuildCommand( ComboHandle hCombo )
 {
-	const auto pImpl = FromHandle( hCombo );
-	return pImpl->BuildCommand();
+	ComboBuildCommand command;
+	FromHandle( hCombo )->BuildCommand( command );
+	return command;
+}
+
+void Combo_BuildCommand( ComboHandle hCombo, ComboBuildCommand& command )
+{
+	FromHandle( hCombo )->BuildCommand( command );
 }
 
 void Combo_FormatCommandHumanReadable( ComboHandle hCombo, gsl::span<char> pchBuffer )
@@ -1228,11 +2179,93 @@ const CfgEntryInfo* Combo_GetEntryInfo( ComboHandle hCombo ) noexcept
 	return nullptr;
 }
 
+const CfgEntryInfo* Combo_FindEntryInfo( uint64_t iCommandNumber ) noexcept
+{
+	// The entries are numbered in order, empty ones end where they start and are passed over
+	const auto& arrEntries = ConfigurationProcessing::s_arrEntries;
+	const auto it		   = std::partition_point( arrEntries.cbegin(), arrEntries.cend(), [iCommandNumber]( const ConfigurationProcessing::CfgEntry& e ) noexcept { return e.m_eiInfo.m_iCommandEnd <= iCommandNumber; } );
+	return it != arrEntries.cend() && it->m_eiInfo.m_iCommandStart <= iCommandNumber ? &it->m_eiInfo : nullptr;
+}
+
+uint64_t Combo_CountSurviving( uint64_t iCommandBegin, uint64_t iCommandEnd )
+{
+	if ( iCommandBegin >= iCommandEnd )
+		return 0;
+
+	const ConfigurationProcessing::ComboCheckpoint_t* pFound = FindCheckpoint( iCommandBegin );
+	if ( !pFound || !pFound->m_pEntry->m_bIndexed )
+		return iCommandEnd - iCommandBegin;
+
+	return pFound->m_pEntry->CountSurviving( iCommandEnd ) - pFound->m_pEntry->CountSurviving( iCommandBegin );
+}
+
+uint64_t Combo_NextSurviving( uint64_t iCommandBegin, uint64_t iCommandEnd ) noexcept
+{
+	if ( iCommandBegin >= iCommandEnd )
+		return iCommandEnd;
+
+	const ConfigurationProcessing::ComboCheckpoint_t* pFound = FindCheckpoint( iCommandBegin );
+	if ( !pFound || !pFound->m_pEntry->m_bIndexed )
+		return iCommandBegin;
+
+	return std::min( pFound->m_pEntry->NextSurviving( iCommandBegin ), iCommandEnd );
+}
+
+uint64_t Combo_CountStaticSurviving( const CfgEntryInfo& entry ) noexcept
+{
+	if ( entry.m_iCommandStart >= entry.m_iCommandEnd )
+		return 0;
+
+	const ConfigurationProcessing::ComboCheckpoint_t* pFound = FindCheckpoint( entry.m_iCommandStart );
+	if ( !pFound || !pFound->m_pEntry->m_bIndexed )
+		return entry.m_numStaticCombos;
+
+	// Static combo s covers the commands [end - ( s + 1 ) * dynamic combos, end - s * dynamic combos), runs are in command order
+	uint64_t nStaticCombos = 0, nLast = UINT64_MAX;
+	for ( const ConfigurationProcessing::CfgEntry::ComboRun_t& run : pFound->m_pEntry->m_arrComboRuns )
+	{
+		const uint64_t nFirst = ( entry.m_iCommandEnd - 1 - run.m_iBegin ) / entry.m_numDynamicCombos;
+		const uint64_t nEnd	  = ( entry.m_iCommandEnd - run.m_iEnd ) / entry.m_numDynamicCombos;
+		nStaticCombos += nFirst - nEnd + ( nFirst != nLast );
+		nLast = nEnd;
+	}
+	return nStaticCombos;
+}
+
+uint64_t Combo_EvaluateSkips( uint64_t iCommandBegin, uint64_t iCommandEnd, bool bTree )
+{
+	CPCHI_t* pImpl = FromHandle( Combo_GetCombo( iCommandBegin ) );
+	if ( !pImpl || !pImpl->m_pEntry->m_pExpr )
+	{
+		FreeHandle( pImpl );
+		return 0;
+	}
+
+	const CComplexExpression& expr = *pImpl->m_pEntry->m_pExpr;
+	uint64_t nSkipped = 0;
+	for ( uint64_t iCommand = iCommandBegin, nAdvance = 1; iCommand < iCommandEnd; ++iCommand, nAdvance = 1 )
+	{
+		if ( bTree )
+		{
+			const ConfigurationProcessing::CSlotContext ctx{ *pImpl->m_pEntry->m_pCg, pImpl->VarSlots() };
+			nSkipped += expr.Evaluate( &ctx ) != 0;
+		}
+		else
+			nSkipped += pImpl->IsSkipped();
+
+		if ( !pImpl->AdvanceCommands( nAdvance ) )
+			break;
+	}
+
+	FreeHandle( pImpl );
+	return nSkipped;
+}
+
 ComboHandle Combo_Alloc( ComboHandle hComboCopyFrom ) noexcept
 {
 	if ( hComboCopyFrom )
-		return AsHandle( new CPCHI_t( *FromHandle( hComboCopyFrom ) ) );
-	return AsHandle( new( std::nothrow ) CPCHI_t );
+		return AsHandle( NewHandle( *FromHandle( hComboCopyFrom ) ) );
+	return AsHandle( NewHandle( CPCHI_t() ) );
 }
 
 void Combo_Assign( ComboHandle hComboDst, ComboHandle hComboSrc )
@@ -1243,7 +2276,7 @@ void Combo_Assign( ComboHandle hComboDst, ComboHandle hComboSrc )
 
 void Combo_Free( ComboHandle& rhComboFree ) noexcept
 {
-	delete FromHandle( rhComboFree );
+	FreeHandle( FromHandle( rhComboFree ) );
 	rhComboFree = nullptr;
 }
 }; // namespace CfgProcessor
\ No newline at end of file
@@ -10,6 +10,7 @@
 
 #include "basetypes.h"
 #include "gsl/span"
+#include <array>
 #include <filesystem>
 #include <memory>
 #include <string>
@@ -53,27 +54,60 @@ struct ShaderConfig
 	std::vector<Parser::Combo> dynamic_c;
 	std::vector<std::string> skip;
 	std::vector<std::string> includes;
+	uint64_t cost = 0; // What compiling it took last time, in microseconds, 0 if unknown
+	bool release_profile = false; // "// PROFILE: release", optimized under -profile dev too
 };
 
-void SetupConfiguration( const std::vector<ShaderConfig>& configs, const std::filesystem::path& root, bool bVerbose );
+// Shaders are laid out most expensive first, by cost or by their number of combos if that is unknown.
+// The entries are set up on nThreads threads. Also walks every combo once on nIndexThreads threads
+// to index the ones that survive the skips, 0 turns that off
+void SetupConfiguration( const std::vector<ShaderConfig>& configs, const std::filesystem::path& root, bool bVerbose, uint32_t nThreads, uint32_t nIndexThreads );
+// Drops the entries so SetupConfiguration can run again, names handed out stay valid
+void ResetConfiguration();
+
+// The combo index of every shader from the last run, keyed by its name, defines, skips and shard. SetupConfiguration
+// only walks the combos of the shaders that aren't in it. The file stays mapped until SaveComboIndex, which writes the
+// index of the entries set up together with the rest of the old file and returns false if nothing was indexed.
+void LoadComboIndex( const std::filesystem::path& path );
+bool SaveComboIndex( const std::filesystem::path& path );
+
+// Bytes the configuration holds, for -memory-stats
+struct MemoryUsage_t
+{
+	uint64_t m_nComboIndex; // Runs of surviving combos and the checkpoints commands are looked up from
+	uint64_t m_nStrings;	// Names and defines, they are never given back
+};
+[[nodiscard]] MemoryUsage_t MemoryUsage();
+
+// Leaves only the static combos of shard iShard of nShards to Combo_GetNext, the rest counts as skipped.
+// The split only depends on the static combo ids, so every shard of a build agrees on it. Set before SetupConfiguration.
+void SetShard( uint32_t iShard, uint32_t nShards ) noexcept;
 
 struct CfgEntryInfo
 {
-	std::string_view	m_szName;				// Name of the shader, e.g. "shader_ps20b"
-	std::string_view	m_szShaderFileName;		// Name of the src file, e.g. "shader_psxx.fxc"
-	std::string_view	m_szShaderVersion;		// Version of shader
-	std::string_view	m_szEntryPoint;			// Name of main function
-	uint64_t			m_numCombos;			// Total possible num of combos, e.g. 1024
-	uint64_t			m_numDynamicCombos;		// Num of dynamic combos, e.g. 4
-	uint64_t			m_numStaticCombos;		// Num of static combos, e.g. 256
-	uint64_t			m_iCommandStart;		// Start command, e.g. 0
-	uint64_t			m_iCommandEnd;			// End command, e.g. 1024
-	int					m_nCentroidMask;		// Mask of centroid samplers
-	uint32_t			m_nCrc32;
+	std::string_view	m_szName{};				// Name of the shader, e.g. "shader_ps20b"
+	std::string_view	m_szShaderFileName{};	// Name of the src file, e.g. "shader_psxx.fxc"
+	std::string_view	m_szShaderVersion{};	// Version of shader
+	std::string_view	m_szEntryPoint{};		// Name of main function
+	uint64_t			m_numCombos{};			// Total possible num of combos, e.g. 1024
+	uint64_t			m_numDynamicCombos{};	// Num of dynamic combos, e.g. 4
+	uint64_t			m_numStaticCombos{};	// Num of static combos, e.g. 256
+	uint64_t			m_iCommandStart{};		// Start command, e.g. 0
+	uint64_t			m_iCommandEnd{};		// End command, e.g. 1024
+	int					m_nCentroidMask{};		// Mask of centroid samplers
+	uint32_t			m_nCrc32{};
+	uint64_t			m_nSourceHash{};		// Hash of the source file and all of its includes
+	uint64_t			m_numSurvivingCombos{};	// Combos left to compile after skips, m_numCombos without the index
+	uint32_t			m_numDynamicDefines{};	// ComboBuildCommand::values has these first, the static ones follow
+	bool				m_bReleaseProfile{};	// Optimized under -profile dev too
 };
 
 std::unique_ptr<CfgProcessor::CfgEntryInfo[]> DescribeConfiguration( bool bPrintExpressions );
 
+// Static combos of the shader whose define values make szExpression true, in ascending order. The expression is
+// written like the skips and may only read static combos, false if it doesn't parse or the shader is unknown.
+bool FindStaticCombos( std::string_view szShader, const std::string& szExpression, std::vector<uint64_t>& arrStaticCombos );
+
 // Working with combos
 struct __ComboHandle
 {
@@ -87,15 +121,45 @@ void Combo_FormatCommandHumanReadable( ComboHandle hCombo, gsl::span<char> pchBu
 uint64_t Combo_GetCommandNum( ComboHandle hCombo ) noexcept;
 uint64_t Combo_GetComboNum( ComboHandle hCombo ) noexcept;
 const CfgEntryInfo* Combo_GetEntryInfo( ComboHandle hCombo ) noexcept;
+// Entry that holds the command, found in the command ranges of DescribeConfiguration without building a handle.
+// nullptr past the last one. Its combo number is m_iCommandEnd - 1 - iCommandNumber.
+const CfgEntryInfo* Combo_FindEntryInfo( uint64_t iCommandNumber ) noexcept;
+// Number of combos in [iCommandBegin, iCommandEnd) of a single entry that survive the skips,
+// just the size of the range if the entry has no index
+uint64_t Combo_CountSurviving( uint64_t iCommandBegin, uint64_t iCommandEnd );
+// First command in [iCommandBegin, iCommandEnd) of a single entry that survives the skips, iCommandEnd if none does.
+// iCommandBegin itself if the entry has no index.
+uint64_t Combo_NextSurviving( uint64_t iCommandBegin, uint64_t iCommandEnd ) noexcept;
+// Number of static combos of the entry with a combo that survives the skips, all of them if it has no index
+uint64_t Combo_CountStaticSurviving( const CfgEntryInfo& entry ) noexcept;
+// Evaluates the skips of every combo in [iCommandBegin, iCommandEnd) of a single entry and returns how many are skipped,
+// for -bench. Walks the expression tree if bTree, otherwise goes the way Combo_GetNext does.
+uint64_t Combo_EvaluateSkips( uint64_t iCommandBegin, uint64_t iCommandEnd, bool bTree );
 
 struct ComboBuildCommand
 {
 	std::string_view entryPoint;
 	std::string_view fileName;
 	std::string_view shaderModel;
-	std::vector<std::pair<std::string_view, std::string_view>> defines;
+	std::vector<std::pair<std::string_view, std::string_view>> defines{};
+
+	// The same defines laid out like D3D_SHADER_MACRO, null terminated
+	struct Macro_t
+	{
+		const char* Name;
+		const char* Definition;
+	};
+	std::vector<Macro_t> macros{};
+
+	// Backing store of the generated strings, defines point into it so don't copy a built command.
+	// Building into the same command again rewrites only the values that changed.
+	std::vector<std::array<char, 24>> strings{};
+	std::vector<int> values{};
+	const void* builtFor = nullptr;
 };
 ComboBuildCommand Combo_BuildCommand( ComboHandle hCombo );
+// Builds into a command kept around by the caller, allocates nothing once it was built for the shader
+void Combo_BuildCommand( ComboHandle hCombo, ComboBuildCommand& command );
 
 ComboHandle Combo_Alloc( ComboHandle hComboCopyFrom ) noexcept;
 void Combo_Assign( ComboHandle hComboDst, ComboHandle hComboSrc );
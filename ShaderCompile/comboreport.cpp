@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "comboreport.h"
+#include "termcolor/style.hpp"
+#include "termcolors.hpp"
+#include "strmanip.hpp"
+#include "robin_hood.h"
+
+using namespace std::literals;
+namespace fs = std::filesystem;
+
+namespace ComboReport
+{
+	static constexpr size_t NUM_PRINTED = 10;
+
+	struct Entry_t
+	{
+		Combo_t m_Combo;
+		std::string m_Defines;
+	};
+
+	struct ShaderSummary_t
+	{
+		std::string_view m_szShader;
+		uint64_t m_nCombos		   = 0;
+		uint64_t m_nMicroseconds   = 0;
+		uint64_t m_nSize		   = 0;
+		uint64_t m_nDeduped		   = 0;
+		uint32_t m_nMaxInstructions = 0;
+	};
+
+	static fs::path s_Path;
+	static bool s_bEnabled = false;
+	static std::mutex s_mtxBuffers;
+	static std::vector<std::unique_ptr<std::deque<Entry_t>>> s_Buffers; // One per thread, only it records into its own
+	static thread_local std::deque<Entry_t>* s_tlBuffer;
+
+	void Initialize( const fs::path& path )
+	{
+		s_Path	   = path;
+		s_bEnabled = !path.empty();
+	}
+
+	bool Enabled() noexcept
+	{
+		return s_bEnabled;
+	}
+
+	void Record( const Combo_t& combo, std::string_view defines )
+	{
+		if ( !s_tlBuffer )
+		{
+			std::lock_guard guard{ s_mtxBuffers };
+			s_tlBuffer = s_Buffers.emplace_back( std::make_unique<std::deque<Entry_t>>() ).get();
+		}
+		s_tlBuffer->emplace_back( Entry_t{ combo, std::string( defines ) } );
+	}
+
+	// Quoted for json, or for csv where quotes are doubled instead
+	static void WriteString( std::ostream& out, std::string_view str, bool bJson )
+	{
+		out << '"';
+		for ( const char c : str )
+		{
+			if ( c == '"' )
+				out << ( bJson ? "\\\"" : "\"\"" );
+			else if ( c == '\\' && bJson )
+				out << "\\\\";
+			else if ( static_cast<unsigned char>( c ) >= ' ' )
+				out << c;
+		}
+		out << '"';
+	}
+
+	static void WriteCsv( std::ostream& out, const std::vector<const Entry_t*>& arrCombos )
+	{
+		out << "shader,static,dynamic,defines,microseconds,size,instructions,cached,deduped\n";
+		for ( const Entry_t* pEntry : arrCombos )
+		{
+			const Combo_t& c = pEntry->m_Combo;
+			WriteString( out, c.m_szShader, false );
+			out << ',' << c.m_nStaticCombo << ',' << c.m_nDynamicCombo << ',';
+			WriteString( out, pEntry->m_Defines, false );
+			out << ',' << c.m_nMicroseconds << ',' << c.m_nSize << ',' << c.m_nInstructions << ',' << c.m_bCached << ',' << c.m_bDeduped << '\n';
+		}
+	}
+
+	static void WriteJson( std::ostream& out, const std::vector<const Entry_t*>& arrCombos, const std::vector<ShaderSummary_t>& arrShaders )
+	{
+		out << "{\"shaders\":[\n";
+		for ( size_t i = 0; i < arrShaders.size(); ++i )
+		{
+			const ShaderSummary_t& s = arrShaders[i];
+			out << ( i ? ",\n" : "" ) << "{\"shader\":";
+			WriteString( out, s.m_szShader, true );
+			out << ",\"combos\":" << s.m_nCombos << ",\"microseconds\":" << s.m_nMicroseconds << ",\"size\":" << s.m_nSize << ",\"deduped\":" << s.m_nDeduped << ",\"maxInstructions\":" << s.m_nMaxInstructions << '}';
+		}
+		out << "\n],\"combos\":[\n";
+		for ( size_t i = 0; i < arrCombos.size(); ++i )
+		{
+			const Combo_t& c = arrCombos[i]->m_Combo;
+			out << ( i ? ",\n" : "" ) << "{\"shader\":";
+			WriteString( out, c.m_szShader, true );
+			out << ",\"static\":" << c.m_nStaticCombo << ",\"dynamic\":" << c.m_nDynamicCombo << ",\"defines\":";
+			WriteString( out, arrCombos[i]->m_Defines, true );
+			out << ",\"microseconds\":" << c.m_nMicroseconds << ",\"size\":" << c.m_nSize << ",\"instructions\":" << c.m_nInstructions
+				<< ",\"cached\":" << ( c.m_bCached ? "true" : "false" ) << ",\"deduped\":" << ( c.m_bDeduped ? "true" : "false" ) << '}';
+		}
+		out << "\n]}\n";
+	}
+
+	void Finish()
+	{
+		if ( !s_bEnabled )
+			return;
+		s_bEnabled = false;
+
+		std::lock_guard guard{ s_mtxBuffers };
+		std::vector<const Entry_t*> arrCombos;
+		for ( const auto& pBuffer : s_Buffers )
+		{
+			for ( const Entry_t& entry : *pBuffer )
+				arrCombos.emplace_back( &entry );
+		}
+		std::sort( arrCombos.begin(), arrCombos.end(), []( const Entry_t* a, const Entry_t* b ) { return a->m_Combo.m_nMicroseconds > b->m_Combo.m_nMicroseconds; } );
+
+		robin_hood::unordered_map<std::string_view, ShaderSummary_t> shaders;
+		for ( const Entry_t* pEntry : arrCombos )
+		{
+			const Combo_t& c  = pEntry->m_Combo;
+			ShaderSummary_t& s = shaders[c.m_szShader];
+			s.m_szShader	   = c.m_szShader;
+			++s.m_nCombos;
+			s.m_nMicroseconds += c.m_nMicroseconds;
+			s.m_nSize += c.m_nSize;
+			s.m_nDeduped += c.m_bDeduped;
+			s.m_nMaxInstructions = std::max( s.m_nMaxInstructions, c.m_nInstructions );
+		}
+		std::vector<ShaderSummary_t> arrShaders;
+		for ( const auto& [name, s] : shaders )
+			arrShaders.emplace_back( s );
+		std::sort( arrShaders.begin(), arrShaders.end(), []( const ShaderSummary_t& a, const ShaderSummary_t& b ) { return a.m_nMicroseconds > b.m_nMicroseconds; } );
+
+		{
+			std::ofstream out( s_Path, std::ios::trunc );
+			if ( s_Path.extension() == ".json"sv )
+				WriteJson( out, arrCombos, arrShaders );
+			else
+				WriteCsv( out, arrCombos );
+			if ( !out )
+				std::cout << clr::red << "Couldn't write the combo report to "sv << s_Path << clr::reset << std::endl;
+		}
+
+		if ( arrCombos.empty() )
+			return;
+
+		std::cout << "Slowest combos:"sv << std::endl;
+		for ( size_t i = 0; i < std::min( NUM_PRINTED, arrCombos.size() ); ++i )
+		{
+			const Entry_t& e = *arrCombos[i];
+			std::cout << "  "sv << e.m_Combo.m_szShader << " static "sv << e.m_Combo.m_nStaticCombo << " dynamic "sv << e.m_Combo.m_nDynamicCombo << ": "sv << clr::green << PrettyPrint( e.m_Combo.m_nMicroseconds / 1000 ) << clr::reset
+					  << " ms, "sv << clr::green << PrettyPrint( e.m_Combo.m_nSize ) << clr::reset << " bytes, "sv << clr::green << e.m_Combo.m_nInstructions << clr::reset << " instructions ("sv << e.m_Defines << ")"sv << std::endl;
+		}
+	}
+}
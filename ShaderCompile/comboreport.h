@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+
+// Report of every compiled combo, to find the ones that take long or compile to a lot of code.
+// Written as json if the file ends in .json, as csv otherwise.
+namespace ComboReport
+{
+	struct Combo_t
+	{
+		std::string_view m_szShader;	// Has to outlive Finish
+		uint64_t m_nStaticCombo;
+		uint64_t m_nDynamicCombo;
+		uint32_t m_nMicroseconds;
+		uint32_t m_nSize;				// 0 if it failed
+		uint32_t m_nInstructions;
+		bool m_bCached;					// Came from the compile cache or an identical preprocessed combo
+		bool m_bDeduped;				// Same code as a combo of the shader compiled before it
+	};
+
+	// Empty path leaves the report off
+	void Initialize( const std::filesystem::path& path );
+	[[nodiscard]] bool Enabled() noexcept;
+
+	// defines are the NAME=value pairs of the combo, separated by spaces
+	void Record( const Combo_t& combo, std::string_view defines );
+
+	// Writes the combos slowest first, a summary of every shader and prints the slowest ones
+	void Finish();
+}
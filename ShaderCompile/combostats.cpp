@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <numeric>
+#include <string>
+
+#include "combostats.h"
+#include "gsl/narrow"
+#include "robin_hood.h"
+
+namespace fs = std::filesystem;
+
+namespace ComboStats
+{
+	static constexpr uint32_t STATS_VERSION = 2;
+	static constexpr uint32_t STATS_MAGIC   = ( 'T' << 24 ) + ( 'S' << 16 ) + ( 'C' << 8 ) + 'S';
+	static_assert( sizeof( StaticComboTime_t ) == 16 );
+
+	static constexpr uint32_t SHARD_BITS = 4;
+
+	struct ShaderRecord_t
+	{
+		std::vector<StaticComboTime_t> m_arrLast; // Loaded from the last run
+
+		// Recorded during this one, split by static combo so that workers rarely wait for each other
+		struct alignas( 64 ) Shard_t
+		{
+			std::mutex m_mtx;
+			robin_hood::unordered_flat_map<uint64_t, uint32_t> m_Times;
+		};
+		std::unique_ptr<Shard_t[]> m_arrCurrent;
+		uint64_t m_nStaticCombos = 0;
+		bool m_bFinished		 = false;
+	};
+
+	static fs::path s_File;
+	static robin_hood::unordered_node_map<std::string, ShaderRecord_t> s_Shaders;
+
+	void Load( const fs::path& file )
+	{
+		s_File = file;
+
+		std::ifstream f( file, std::ios::binary );
+		uint32_t header[2];
+		if ( !f || !f.read( reinterpret_cast<char*>( header ), sizeof( header ) ) || header[0] != STATS_MAGIC || header[1] != STATS_VERSION )
+			return;
+
+		for ( uint32_t nNameLen; f.read( reinterpret_cast<char*>( &nNameLen ), sizeof( nNameLen ) ); )
+		{
+			std::string name( nNameLen, '\0' );
+			uint64_t nStaticCombos, nTimes;
+			if ( !f.read( name.data(), nNameLen ) || !f.read( reinterpret_cast<char*>( &nStaticCombos ), sizeof( nStaticCombos ) )
+				 || !f.read( reinterpret_cast<char*>( &nTimes ), sizeof( nTimes ) ) || nTimes > nStaticCombos )
+				break;
+
+			std::vector<StaticComboTime_t> arrLast( gsl::narrow<size_t>( nTimes ) );
+			if ( !f.read( reinterpret_cast<char*>( arrLast.data() ), arrLast.size() * sizeof( StaticComboTime_t ) ) )
+				break;
+
+			ShaderRecord_t& rec = s_Shaders[std::move( name )];
+			rec.m_arrLast		= std::move( arrLast );
+			rec.m_nStaticCombos = nStaticCombos;
+		}
+	}
+
+	const std::vector<StaticComboTime_t>* Find( std::string_view name, uint64_t nStaticCombos )
+	{
+		const auto it = s_Shaders.find( std::string( name ) );
+		if ( it == s_Shaders.end() || it->second.m_arrLast.empty() || it->second.m_nStaticCombos != nStaticCombos )
+			return nullptr;
+		return &it->second.m_arrLast;
+	}
+
+	uint64_t Total( const std::vector<StaticComboTime_t>& arrTimes ) noexcept
+	{
+		return std::accumulate( arrTimes.cbegin(), arrTimes.cend(), 0ULL, []( uint64_t n, const StaticComboTime_t& time ) { return n + time.m_nMicroseconds; } );
+	}
+
+	ShaderRecord_t* Begin( std::string_view name, uint64_t nStaticCombos )
+	{
+		ShaderRecord_t& rec = s_Shaders[std::string( name )];
+		rec.m_arrCurrent	= std::make_unique<ShaderRecord_t::Shard_t[]>( 1 << SHARD_BITS );
+		rec.m_bFinished		= false;
+		// The old times only go with the old number of static combos
+		if ( rec.m_nStaticCombos != nStaticCombos )
+			rec.m_arrLast.clear();
+		rec.m_nStaticCombos = nStaticCombos;
+		return &rec;
+	}
+
+	void Add( ShaderRecord_t* pShader, uint64_t nStaticCombo, uint32_t nMicroseconds )
+	{
+		ShaderRecord_t::Shard_t& shard = pShader->m_arrCurrent[( nStaticCombo * 0x9E3779B97F4A7C15ULL ) >> ( 64 - SHARD_BITS )];
+		std::lock_guard guard{ shard.m_mtx };
+		shard.m_Times[nStaticCombo] += nMicroseconds;
+	}
+
+	void Finish( std::string_view name )
+	{
+		if ( const auto it = s_Shaders.find( std::string( name ) ); it != s_Shaders.end() && it->second.m_arrCurrent )
+			it->second.m_bFinished = true;
+	}
+
+	void Save()
+	{
+		if ( s_File.empty() )
+			return;
+
+		fs::path tmpPath = s_File;
+		tmpPath += ".tmp";
+		{
+			std::ofstream f( tmpPath, std::ios::binary | std::ios::trunc );
+			const uint32_t header[] = { STATS_MAGIC, STATS_VERSION };
+			f.write( reinterpret_cast<const char*>( header ), sizeof( header ) );
+
+			std::vector<StaticComboTime_t> arrCurrent;
+			for ( const auto& [name, rec] : s_Shaders )
+			{
+				if ( rec.m_bFinished )
+				{
+					arrCurrent.clear();
+					for ( size_t i = 0; i < 1 << SHARD_BITS; ++i )
+					{
+						for ( const auto& [nStaticCombo, nMicroseconds] : rec.m_arrCurrent[i].m_Times )
+							arrCurrent.emplace_back( StaticComboTime_t{ nStaticCombo, nMicroseconds, 0 } );
+					}
+					std::sort( arrCurrent.begin(), arrCurrent.end(), []( const StaticComboTime_t& a, const StaticComboTime_t& b ) { return a.m_nStaticCombo < b.m_nStaticCombo; } );
+				}
+				const std::vector<StaticComboTime_t>& arr = rec.m_bFinished ? arrCurrent : rec.m_arrLast;
+				if ( arr.empty() )
+					continue;
+
+				const uint32_t nNameLen = gsl::narrow<uint32_t>( name.size() );
+				const uint64_t nTimes	= arr.size();
+				f.write( reinterpret_cast<const char*>( &nNameLen ), sizeof( nNameLen ) );
+				f.write( name.data(), nNameLen );
+				f.write( reinterpret_cast<const char*>( &rec.m_nStaticCombos ), sizeof( rec.m_nStaticCombos ) );
+				f.write( reinterpret_cast<const char*>( &nTimes ), sizeof( nTimes ) );
+				f.write( reinterpret_cast<const char*>( arr.data() ), arr.size() * sizeof( StaticComboTime_t ) );
+			}
+
+			if ( !f )
+			{
+				f.close();
+				std::error_code c;
+				fs::remove( tmpPath, c );
+				return;
+			}
+		}
+
+		std::error_code c;
+		fs::rename( tmpPath, s_File, c );
+	}
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+#include <vector>
+
+// Compile time of every static combo, kept from one run to the next so the
+// expensive shaders and static combos can be started first. Only the static combos that took any time are kept,
+// skips can leave most of a huge space without any.
+namespace ComboStats
+{
+	struct StaticComboTime_t
+	{
+		uint64_t m_nStaticCombo;
+		uint32_t m_nMicroseconds;
+		uint32_t m_nUnused;
+	};
+
+	// Reads the stats of the last run, a missing or broken file just means nothing is known
+	void Load( const std::filesystem::path& file );
+
+	// Microseconds the static combos of the shader took last time, ascending by static combo,
+	// nullptr if the shader is unknown or its combos changed since
+	[[nodiscard]] const std::vector<StaticComboTime_t>* Find( std::string_view name, uint64_t nStaticCombos );
+
+	// Sum of the times of Find
+	[[nodiscard]] uint64_t Total( const std::vector<StaticComboTime_t>& arrTimes ) noexcept;
+
+	// What the workers add the compile time of a static combo to during this run.
+	// Has to be called for every shader before the workers start.
+	struct ShaderRecord_t;
+	[[nodiscard]] ShaderRecord_t* Begin( std::string_view name, uint64_t nStaticCombos );
+	void Add( ShaderRecord_t* pShader, uint64_t nStaticCombo, uint32_t nMicroseconds );
+
+	// The shader compiled completely, what was recorded for it replaces the old stats
+	void Finish( std::string_view name );
+
+	// Writes the stats back, shaders that were not finished this run keep their old ones
+	void Save();
+}
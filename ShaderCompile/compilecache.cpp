@@ -0,0 +1,529 @@
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "compilecache.h"
+#include "cfgprocessor.h"
+#include "cmdsink.h"
+#include "d3dxfxc.h"
+#include "gsl/narrow"
+#include "platform.h"
+#include "robin_hood.h"
+
+namespace fs = std::filesystem;
+namespace chrono = std::chrono;
+
+namespace CompileCache
+{
+	// Bump when anything that changes the compiled output is added to the key
+	static constexpr uint32_t CACHE_VERSION = 3;
+	static constexpr uint32_t CACHE_MAGIC   = ( 'H' << 24 ) + ( 'C' << 16 ) + ( 'C' << 8 ) + 'S';
+
+	struct CacheFileHeader_t
+	{
+		uint32_t m_nMagic;
+		uint32_t m_nVersion;
+		Key m_Key;
+		uint32_t m_nCodeSize;
+		uint32_t m_nListingSize;
+		uint32_t m_nMicroseconds; // Of the compile, what a hit saves
+		uint32_t m_nReserved;
+	};
+
+	static fs::path s_CacheDir;
+	static fs::path s_SharedDir;
+	static uint64_t s_nLocalLimit = 0;
+	static std::atomic<uint64_t> s_nHits;
+	static std::atomic<uint64_t> s_nMisses;
+	static std::atomic<uint64_t> s_nRecentHits;
+	static std::atomic<uint64_t> s_nSharedHits;
+	static std::atomic<uint64_t> s_nUploaded;
+
+	// Entries of the shared cache by the first byte of their name. A directory is listed once, the first time a key of it
+	// is looked for, so a miss costs one listing of many entries instead of a round trip to the share each.
+	struct SharedBucket_t
+	{
+		std::once_flag m_Listed;
+		robin_hood::unordered_flat_set<uint64_t> m_Keys; // Key::lo of every entry
+	};
+	static std::unique_ptr<SharedBucket_t[]> s_pSharedBuckets;
+
+	// The only file at the top of the cache directory, entries are a level down
+	static constexpr std::string_view VALIDATED_NAME = "validated";
+	static std::once_flag s_ValidatedRead;
+	static std::mutex s_mtxValidated;
+	static robin_hood::unordered_flat_set<uint64_t> s_setValidated;
+	static std::ofstream s_ValidatedFile;
+
+	// Local entries waiting to be copied to the shared cache
+	static std::mutex s_mtxUploads;
+	static std::condition_variable s_cvUploads;
+	static std::deque<Key> s_Uploads;
+	static std::thread s_UploadThread;
+	static bool s_bFinishing = false;
+
+	class CCachedResponse final : public CmdSink::IResponse
+	{
+	public:
+		CCachedResponse( std::vector<char>&& code, std::string&& listing ) noexcept
+			: m_Code( std::move( code ) ), m_Listing( std::move( listing ) )
+		{
+		}
+
+		bool Succeeded() const noexcept override { return true; }
+		size_t GetResultBufferLen() const override { return m_Code.size(); }
+		const void* GetResultBuffer() const override { return m_Code.data(); }
+		const char* GetListing() const override { return m_Listing.empty() ? nullptr : m_Listing.c_str(); }
+
+	private:
+		std::vector<char> m_Code;
+		std::string m_Listing;
+	};
+
+	static fs::path KeyToPath( const fs::path& root, const Key& key )
+	{
+		char name[36];
+		sprintf_s( name, sizeof( name ), "%016" PRIx64 "%016" PRIx64, key.hi, key.lo );
+		return root / std::string_view( name, 2 ) / name;
+	}
+
+	// Other threads and processes may look for the same key, so never expose a partial file
+	static fs::path TempPath( const fs::path& path )
+	{
+		static std::atomic<uint32_t> s_nTempFile;
+
+		fs::path tmpPath = path;
+		tmpPath += "." + std::to_string( Platform::ProcessId() ) + "." + std::to_string( s_nTempFile++ ) + ".tmp";
+		return tmpPath;
+	}
+
+	static bool CopyEntry( const fs::path& from, const fs::path& to )
+	{
+		std::error_code c;
+		fs::create_directories( to.parent_path(), c );
+		const fs::path tmpPath = TempPath( to );
+		if ( fs::copy_file( from, tmpPath, fs::copy_options::overwrite_existing, c ) )
+			fs::rename( tmpPath, to, c );
+		if ( c )
+			fs::remove( tmpPath, c );
+		return !c;
+	}
+
+	// nullptr if it isn't there or is the entry of another key
+	static CmdSink::IResponse* ReadEntry( const fs::path& path, const Key& key, uint32_t& nMicroseconds )
+	{
+		std::ifstream file( path, std::ios::binary );
+
+		CacheFileHeader_t hdr;
+		if ( !file || !file.read( reinterpret_cast<char*>( &hdr ), sizeof( hdr ) ) || hdr.m_nMagic != CACHE_MAGIC || hdr.m_nVersion != CACHE_VERSION
+			 || hdr.m_Key.lo != key.lo || hdr.m_Key.hi != key.hi )
+			return nullptr;
+
+		std::vector<char> code( hdr.m_nCodeSize );
+		std::string listing( hdr.m_nListingSize, '\0' );
+		if ( !file.read( code.data(), code.size() ) || !file.read( listing.data(), listing.size() ) )
+			return nullptr;
+
+		nMicroseconds = hdr.m_nMicroseconds;
+		return new ( std::nothrow ) CCachedResponse( std::move( code ), std::move( listing ) );
+	}
+
+	static bool SharedHas( const Key& key )
+	{
+		SharedBucket_t& bucket = s_pSharedBuckets[key.hi >> 56];
+		std::call_once( bucket.m_Listed, [&bucket, &key]
+		{
+			std::error_code c;
+			for ( fs::directory_iterator it( KeyToPath( s_SharedDir, key ).parent_path(), c ), end; !c && it != end; it.increment( c ) )
+			{
+				const std::string name = it->path().filename().string();
+				uint64_t lo;
+				if ( name.size() == 32 && std::from_chars( name.data() + 16, name.data() + 32, lo, 16 ).ptr == name.data() + 32 )
+					bucket.m_Keys.emplace( lo );
+			}
+		} );
+		return bucket.m_Keys.contains( key.lo );
+	}
+
+	static void Upload( const Key& key )
+	{
+		const fs::path sharedPath = KeyToPath( s_SharedDir, key );
+		std::error_code c;
+		if ( SharedHas( key ) || fs::exists( sharedPath, c ) )
+			return;
+		if ( CopyEntry( KeyToPath( s_CacheDir, key ), sharedPath ) )
+			++s_nUploaded;
+	}
+
+	static void UploadThread()
+	{
+		std::unique_lock guard{ s_mtxUploads };
+		for ( ;; )
+		{
+			s_cvUploads.wait( guard, [] { return s_bFinishing || !s_Uploads.empty(); } );
+			if ( s_Uploads.empty() )
+				return;
+			const Key key = s_Uploads.front();
+			s_Uploads.pop_front();
+
+			guard.unlock();
+			Upload( key );
+			guard.lock();
+		}
+	}
+
+	struct LocalEntry_t
+	{
+		fs::file_time_type m_tUsed;
+		uint64_t m_nSize;
+		fs::path m_Path;
+	};
+
+	// Oldest used first until the cache fits, hits touch their entry
+	static void TrimLocal( std::vector<LocalEntry_t>& entries, GarbageStats_t& stats )
+	{
+		uint64_t nTotal = 0;
+		for ( const LocalEntry_t& entry : entries )
+			nTotal += entry.m_nSize;
+		stats.m_nKept	   = entries.size();
+		stats.m_nKeptBytes = nTotal;
+		if ( !s_nLocalLimit || nTotal <= s_nLocalLimit )
+			return;
+
+		std::error_code c;
+		std::sort( entries.begin(), entries.end(), []( const LocalEntry_t& a, const LocalEntry_t& b ) { return a.m_tUsed < b.m_tUsed; } );
+		for ( const LocalEntry_t& entry : entries )
+		{
+			if ( nTotal <= s_nLocalLimit )
+				break;
+			if ( !fs::remove( entry.m_Path, c ) )
+				continue;
+			nTotal -= entry.m_nSize;
+			--stats.m_nKept;
+			stats.m_nKeptBytes -= entry.m_nSize;
+			++stats.m_nRemoved;
+			stats.m_nRemovedBytes += entry.m_nSize;
+		}
+	}
+
+	// Entries of the local cache, temp files aside. bCheck reads their header and removes the ones of other versions.
+	static std::vector<LocalEntry_t> ListLocal( bool bCheck, GarbageStats_t& stats )
+	{
+		// Older temp files belong to a writer that is gone
+		static constexpr auto STALE_TEMP = chrono::hours( 1 );
+
+		std::vector<LocalEntry_t> entries;
+		const fs::file_time_type tNow = fs::file_time_type::clock::now();
+		std::error_code c;
+		for ( fs::recursive_directory_iterator it( s_CacheDir, c ), end; !c && it != end; it.increment( c ) )
+		{
+			if ( !it->is_regular_file( c ) || it.depth() == 0 )
+				continue;
+			const LocalEntry_t entry{ it->last_write_time( c ), it->file_size( c ), it->path() };
+			bool bGarbage = false;
+			if ( entry.m_Path.extension() == ".tmp" )
+			{
+				if ( !bCheck || tNow - entry.m_tUsed < STALE_TEMP )
+					continue;
+				bGarbage = true;
+			}
+			else if ( bCheck )
+			{
+				std::ifstream file( entry.m_Path, std::ios::binary );
+				CacheFileHeader_t hdr;
+				bGarbage = !file.read( reinterpret_cast<char*>( &hdr ), sizeof( hdr ) ) || hdr.m_nMagic != CACHE_MAGIC || hdr.m_nVersion != CACHE_VERSION;
+			}
+
+			std::error_code cRemove;
+			if ( !bGarbage )
+				entries.emplace_back( entry );
+			else if ( fs::remove( entry.m_Path, cRemove ) )
+			{
+				++stats.m_nRemoved;
+				stats.m_nRemovedBytes += entry.m_nSize;
+			}
+		}
+		return entries;
+	}
+
+	void Initialize( const fs::path& dir )
+	{
+		s_CacheDir = dir;
+		if ( dir.empty() )
+			return;
+
+		std::error_code c;
+		fs::create_directories( dir, c );
+	}
+
+	bool Enabled() noexcept
+	{
+		return !s_CacheDir.empty();
+	}
+
+	void InitializeShared( const fs::path& dir )
+	{
+		s_SharedDir = dir;
+		s_pSharedBuckets.reset( dir.empty() ? nullptr : new SharedBucket_t[256] );
+	}
+
+	void SetLocalLimit( uint64_t nBytes ) noexcept
+	{
+		s_nLocalLimit = nBytes;
+	}
+
+	void Finish()
+	{
+		{
+			std::lock_guard guard{ s_mtxUploads };
+			s_bFinishing = true;
+		}
+		s_cvUploads.notify_one();
+		if ( s_UploadThread.joinable() )
+			s_UploadThread.join();
+		s_bFinishing = false;
+
+		if ( s_nLocalLimit && Enabled() )
+		{
+			GarbageStats_t stats{};
+			std::vector<LocalEntry_t> entries = ListLocal( false, stats );
+			TrimLocal( entries, stats );
+		}
+	}
+
+	GarbageStats_t CollectGarbage()
+	{
+		GarbageStats_t stats{};
+		std::vector<LocalEntry_t> entries = ListLocal( true, stats );
+		TrimLocal( entries, stats );
+		return stats;
+	}
+
+	Key ComputeKey( uint64_t nSourceHash, const CfgProcessor::ComboBuildCommand& command, uint32_t flags )
+	{
+		// Define order does not change the output, so don't let it change the key
+		static thread_local std::vector<std::pair<std::string_view, std::string_view>> s_tlDefines;
+		std::vector<std::pair<std::string_view, std::string_view>>& defines = s_tlDefines;
+		defines.assign( command.defines.cbegin(), command.defines.cend() );
+		std::sort( defines.begin(), defines.end() );
+
+		Key key{ 0x243f6a8885a308d3ULL, 0x13198a2e03707344ULL };
+		const auto& Add = [&key]( const void* pData, size_t nSize )
+		{
+			key.lo = HashBytes( pData, nSize, key.lo );
+			key.hi = HashBytes( pData, nSize, key.hi ^ 0xa4093822299f31d0ULL );
+		};
+		const auto& AddString = [&Add]( std::string_view str )
+		{
+			Add( str.data(), str.size() );
+		};
+
+		const uint64_t header[] = { CACHE_VERSION, Compiler::Version(), flags };
+		Add( header, sizeof( header ) );
+		Add( &nSourceHash, sizeof( nSourceHash ) );
+		AddString( command.fileName );
+		AddString( command.entryPoint );
+		AddString( command.shaderModel );
+		for ( const auto& [name, value] : defines )
+		{
+			AddString( name );
+			AddString( value );
+		}
+
+		return key;
+	}
+
+	CmdSink::IResponse* Find( const Key& key, uint32_t& nMicroseconds )
+	{
+		const fs::path path = KeyToPath( s_CacheDir, key );
+		if ( CmdSink::IResponse* pResponse = ReadEntry( path, key, nMicroseconds ) )
+		{
+			if ( s_nLocalLimit )
+			{
+				std::error_code c;
+				fs::last_write_time( path, fs::file_time_type::clock::now(), c );
+			}
+			++s_nHits;
+			return pResponse;
+		}
+
+		if ( s_pSharedBuckets && SharedHas( key ) )
+		{
+			const fs::path sharedPath = KeyToPath( s_SharedDir, key );
+			if ( CmdSink::IResponse* pResponse = ReadEntry( sharedPath, key, nMicroseconds ) )
+			{
+				CopyEntry( sharedPath, path );
+				++s_nHits;
+				++s_nSharedHits;
+				return pResponse;
+			}
+		}
+
+		++s_nMisses;
+		return nullptr;
+	}
+
+	bool Contains( const Key& key )
+	{
+		std::ifstream file( KeyToPath( s_CacheDir, key ), std::ios::binary );
+		CacheFileHeader_t hdr;
+		if ( file && file.read( reinterpret_cast<char*>( &hdr ), sizeof( hdr ) ) && hdr.m_nMagic == CACHE_MAGIC && hdr.m_nVersion == CACHE_VERSION && hdr.m_Key.lo == key.lo
+			 && hdr.m_Key.hi == key.hi )
+			return true;
+		return s_pSharedBuckets && SharedHas( key );
+	}
+
+	void Store( const Key& key, const CmdSink::IResponse* pResponse, uint32_t nMicroseconds )
+	{
+		const fs::path path = KeyToPath( s_CacheDir, key );
+		std::error_code c;
+		fs::create_directories( path.parent_path(), c );
+
+		const char* szListing = pResponse->GetListing();
+		const CacheFileHeader_t hdr{
+			CACHE_MAGIC,
+			CACHE_VERSION,
+			key,
+			gsl::narrow<uint32_t>( pResponse->GetResultBufferLen() ),
+			gsl::narrow<uint32_t>( szListing ? strlen( szListing ) : 0 ),
+			nMicroseconds,
+			0
+		};
+
+		const fs::path tmpPath = TempPath( path );
+		{
+			std::ofstream file( tmpPath, std::ios::binary | std::ios::trunc );
+			file.write( reinterpret_cast<const char*>( &hdr ), sizeof( hdr ) );
+			file.write( static_cast<const char*>( pResponse->GetResultBuffer() ), hdr.m_nCodeSize );
+			file.write( szListing ? szListing : "", hdr.m_nListingSize );
+			if ( !file )
+			{
+				file.close();
+				fs::remove( tmpPath, c );
+				return;
+			}
+		}
+
+		fs::rename( tmpPath, path, c );
+		if ( c )
+		{
+			fs::remove( tmpPath, c );
+			return;
+		}
+
+		// Never waits for the share
+		if ( s_pSharedBuckets )
+		{
+			std::lock_guard guard{ s_mtxUploads };
+			s_Uploads.emplace_back( key );
+			if ( !s_UploadThread.joinable() )
+				s_UploadThread = std::thread( UploadThread );
+			s_cvUploads.notify_one();
+		}
+	}
+
+	static void ReadValidated()
+	{
+		if ( !Enabled() )
+			return;
+
+		// A hash cut short by a crash goes, the ones after it would be misread
+		const fs::path path = s_CacheDir / VALIDATED_NAME;
+		std::error_code c;
+		if ( const uintmax_t nSize = fs::file_size( path, c ); !c && nSize % sizeof( uint64_t ) )
+			fs::resize_file( path, nSize - nSize % sizeof( uint64_t ), c );
+
+		std::ifstream file( path, std::ios::binary );
+		for ( uint64_t nCodeHash; file.read( reinterpret_cast<char*>( &nCodeHash ), sizeof( nCodeHash ) ); )
+			s_setValidated.emplace( nCodeHash );
+		s_ValidatedFile.open( path, std::ios::binary | std::ios::app );
+	}
+
+	bool IsValidated( uint64_t nCodeHash )
+	{
+		std::call_once( s_ValidatedRead, ReadValidated );
+		std::lock_guard guard{ s_mtxValidated };
+		return s_setValidated.contains( nCodeHash );
+	}
+
+	void SetValidated( uint64_t nCodeHash )
+	{
+		std::call_once( s_ValidatedRead, ReadValidated );
+		std::lock_guard guard{ s_mtxValidated };
+		if ( s_setValidated.emplace( nCodeHash ).second && s_ValidatedFile )
+			s_ValidatedFile.write( reinterpret_cast<const char*>( &nCodeHash ), sizeof( nCodeHash ) );
+	}
+
+	struct RecentResult_t
+	{
+		Key m_Key;
+		std::vector<char> m_Code;
+		std::string m_Listing;
+		uint32_t m_nMicroseconds;
+	};
+	static constexpr size_t MAX_RECENT = 64;
+	static thread_local std::vector<RecentResult_t> s_tlRecent;
+	static thread_local size_t s_tlNextRecent;
+
+	CmdSink::IResponse* FindRecent( const Key& key, uint32_t& nMicroseconds )
+	{
+		for ( const RecentResult_t& recent : s_tlRecent )
+		{
+			if ( recent.m_Key.lo == key.lo && recent.m_Key.hi == key.hi )
+			{
+				++s_nRecentHits;
+				nMicroseconds = recent.m_nMicroseconds;
+				return new ( std::nothrow ) CCachedResponse( std::vector<char>( recent.m_Code ), std::string( recent.m_Listing ) );
+			}
+		}
+		return nullptr;
+	}
+
+	void StoreRecent( const Key& key, const CmdSink::IResponse* pResponse, uint32_t nMicroseconds )
+	{
+		const char* pCode     = static_cast<const char*>( pResponse->GetResultBuffer() );
+		const char* szListing = pResponse->GetListing();
+		RecentResult_t recent{ key, std::vector<char>( pCode, pCode + pResponse->GetResultBufferLen() ), szListing ? szListing : "", nMicroseconds };
+
+		// Overwrite the oldest one once full
+		if ( s_tlRecent.size() < MAX_RECENT )
+			s_tlRecent.emplace_back( std::move( recent ) );
+		else
+			s_tlRecent[s_tlNextRecent++ % MAX_RECENT] = std::move( recent );
+	}
+
+	uint64_t NumHits() noexcept
+	{
+		return s_nHits;
+	}
+
+	uint64_t NumMisses() noexcept
+	{
+		return s_nMisses;
+	}
+
+	uint64_t NumRecentHits() noexcept
+	{
+		return s_nRecentHits;
+	}
+
+	uint64_t NumSharedHits() noexcept
+	{
+		return s_nSharedHits;
+	}
+
+	uint64_t NumUploaded() noexcept
+	{
+		return s_nUploaded;
+	}
+}
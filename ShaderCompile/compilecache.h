@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string_view>
+
+namespace CmdSink
+{
+	class IResponse;
+}
+
+namespace CfgProcessor
+{
+	struct ComboBuildCommand;
+}
+
+// On-disk cache of compiled combos, addressed by a hash of everything that goes into D3DCompile
+namespace CompileCache
+{
+	struct Key
+	{
+		uint64_t lo;
+		uint64_t hi;
+	};
+
+	// Not cryptographic, just well mixed
+	inline uint64_t HashBytes( const void* pData, size_t nSize, uint64_t nSeed )
+	{
+		const auto& Mix = []( uint64_t h ) noexcept
+		{
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdULL;
+			h ^= h >> 33;
+			h *= 0xc4ceb9fe1a85ec53ULL;
+			h ^= h >> 33;
+			return h;
+		};
+
+		const auto* p = static_cast<const uint8_t*>( pData );
+		uint64_t h    = Mix( nSeed ^ ( nSize * 0x9e3779b97f4a7c15ULL ) );
+		for ( ; nSize >= 8; p += 8, nSize -= 8 )
+		{
+			uint64_t w;
+			memcpy( &w, p, sizeof( w ) );
+			h = Mix( h ^ w ) * 0x9e3779b97f4a7c15ULL;
+		}
+
+		uint64_t w = 0;
+		memcpy( &w, p, nSize );
+		return Mix( h ^ w );
+	}
+
+	inline uint64_t HashString( std::string_view str, uint64_t nSeed )
+	{
+		return HashBytes( str.data(), str.size(), nSeed );
+	}
+
+	// Empty path disables the cache
+	void Initialize( const std::filesystem::path& dir );
+	[[nodiscard]] bool Enabled() noexcept;
+
+	// A second tier behind the local cache, a directory on a share other machines build with as well. Its hits are
+	// copied to the local cache, what is stored locally is copied up by a thread of its own. Empty path disables it.
+	void InitializeShared( const std::filesystem::path& dir );
+	// The least recently used entries of the local cache go once it is bigger than this, 0 keeps everything
+	void SetLocalLimit( uint64_t nBytes ) noexcept;
+	// Waits for the uploads still queued and trims the local cache
+	void Finish();
+
+	struct GarbageStats_t
+	{
+		uint64_t m_nRemoved;
+		uint64_t m_nRemovedBytes;
+		uint64_t m_nKept;
+		uint64_t m_nKeptBytes;
+	};
+	// -cache-gc: removes temp files writers left behind, entries of other cache versions and what doesn't fit the limit
+	[[nodiscard]] GarbageStats_t CollectGarbage();
+
+	[[nodiscard]] Key ComputeKey( uint64_t nSourceHash, const CfgProcessor::ComboBuildCommand& command, uint32_t flags );
+
+	// Returns nullptr on a miss. nMicroseconds is what the compile took when it was stored.
+	[[nodiscard]] CmdSink::IResponse* Find( const Key& key, uint32_t& nMicroseconds );
+	// Only reads the header, doesn't count as a hit or a miss
+	[[nodiscard]] bool Contains( const Key& key );
+	void Store( const Key& key, const CmdSink::IResponse* pResponse, uint32_t nMicroseconds );
+
+	// The last few results of the calling thread. Dynamic combos of a static combo run
+	// back to back on one worker, so combos that preprocess to the same text meet here.
+	[[nodiscard]] CmdSink::IResponse* FindRecent( const Key& key, uint32_t& nMicroseconds );
+	void StoreRecent( const Key& key, const CmdSink::IResponse* pResponse, uint32_t nMicroseconds );
+
+	// -validate-sample: hashes of code a compile with validation produced. Kept in the cache directory so code is
+	// validated once across builds, only in memory without -cache. Safe to call from several threads.
+	[[nodiscard]] bool IsValidated( uint64_t nCodeHash );
+	void SetValidated( uint64_t nCodeHash );
+
+	[[nodiscard]] uint64_t NumHits() noexcept;
+	[[nodiscard]] uint64_t NumMisses() noexcept;
+	[[nodiscard]] uint64_t NumRecentHits() noexcept;
+	[[nodiscard]] uint64_t NumSharedHits() noexcept;
+	[[nodiscard]] uint64_t NumUploaded() noexcept;
+}
@@ -0,0 +1,114 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <utility>
+
+#include "consolelog.h"
+
+namespace ConsoleLog
+{
+	struct Line_t
+	{
+		std::string m_szText;
+		Line_t* m_pNext;
+	};
+
+	static std::atomic<Line_t*> s_pLines; // Newest first
+	static std::atomic<std::string*> s_pProgress;
+	static std::atomic<bool> s_bRunning;
+	static std::atomic<bool> s_bStop;
+	static std::thread s_Thread;
+
+	static void Drain()
+	{
+		static std::string s_Out;
+		s_Out.clear();
+
+		Line_t* pReversed = nullptr;
+		for ( Line_t* pLine = s_pLines.exchange( nullptr, std::memory_order_acquire ); pLine; )
+		{
+			Line_t* pNext	= pLine->m_pNext;
+			pLine->m_pNext	= pReversed;
+			pReversed		= pLine;
+			pLine			= pNext;
+		}
+		while ( pReversed )
+		{
+			s_Out.append( pReversed->m_szText );
+			delete std::exchange( pReversed, pReversed->m_pNext );
+		}
+
+		if ( std::string* pProgress = s_pProgress.exchange( nullptr, std::memory_order_acquire ) )
+		{
+			s_Out.append( *pProgress );
+			delete pProgress;
+		}
+
+		if ( !s_Out.empty() )
+		{
+			std::cout.write( s_Out.data(), static_cast<std::streamsize>( s_Out.size() ) );
+			std::cout.flush();
+		}
+	}
+
+	void Start()
+	{
+		if ( s_bRunning.load() )
+			return;
+		s_bStop.store( false );
+		s_Thread = std::thread( []
+		{
+			while ( !s_bStop.load( std::memory_order_acquire ) )
+			{
+				std::this_thread::sleep_for( std::chrono::milliseconds( 1000 / REFRESH_RATE ) );
+				Drain();
+			}
+		} );
+		s_bRunning.store( true, std::memory_order_release );
+	}
+
+	void Stop()
+	{
+		if ( !s_bRunning.exchange( false, std::memory_order_acq_rel ) )
+			return;
+		s_bStop.store( true, std::memory_order_release );
+		s_Thread.join();
+		Drain();
+	}
+
+	void Write( std::string&& text )
+	{
+		if ( !s_bRunning.load( std::memory_order_acquire ) )
+		{
+			std::cout << text << std::flush;
+			return;
+		}
+
+		Line_t* pLine = new Line_t{ std::move( text ), s_pLines.load( std::memory_order_relaxed ) };
+		while ( !s_pLines.compare_exchange_weak( pLine->m_pNext, pLine, std::memory_order_release, std::memory_order_relaxed ) )
+			continue;
+	}
+
+	void Progress( std::string&& text )
+	{
+		if ( !s_bRunning.load( std::memory_order_acquire ) )
+		{
+			std::cout << text << std::flush;
+			return;
+		}
+		delete s_pProgress.exchange( new std::string( std::move( text ) ), std::memory_order_acq_rel );
+	}
+
+	std::ostringstream& Stream()
+	{
+		static thread_local std::ostringstream s_tlStream = []
+		{
+			std::ostringstream s;
+			s.copyfmt( std::cout ); // Keeps clr::colorize
+			return s;
+		}();
+		s_tlStream.str( {} );
+		return s_tlStream;
+	}
+}
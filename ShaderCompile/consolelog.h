@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+#include "termcolor/style.hpp" // Its operator<< has to be seen before CLine's
+
+// Console output while shaders compile. Nothing waits on the console: lines are queued without a lock and one
+// thread writes them out REFRESH_RATE times a second in one go. Of the progress lines only the last one is written.
+// Before Start and after Stop everything goes straight to std::cout.
+namespace ConsoleLog
+{
+	static constexpr uint32_t REFRESH_RATE = 10;
+
+	void Start();
+	void Stop();
+
+	void Write( std::string&& text );
+	void Progress( std::string&& text );
+
+	// Empty stream of the calling thread, formatted like std::cout
+	[[nodiscard]] std::ostringstream& Stream();
+
+	// Used like std::cout, the text goes to Write (or Progress) at the end of the statement
+	class CLine
+	{
+	public:
+		explicit CLine( bool bProgress = false ) : m_Stream( Stream() ), m_bProgress( bProgress ) {}
+
+		~CLine()
+		{
+			if ( m_bProgress )
+				Progress( std::move( m_Stream ).str() );
+			else
+				Write( std::move( m_Stream ).str() );
+		}
+
+		CLine( const CLine& ) = delete;
+		CLine& operator=( const CLine& ) = delete;
+
+		template <typename T>
+		CLine& operator<<( const T& value )
+		{
+			m_Stream << value;
+			return *this;
+		}
+
+		CLine& operator<<( std::ostream& ( *pfnManip )( std::ostream& ) )
+		{
+			m_Stream << pfnManip;
+			return *this;
+		}
+
+		CLine& operator<<( std::ios_base& ( *pfnManip )( std::ios_base& ) )
+		{
+			m_Stream << pfnManip;
+			return *this;
+		}
+
+	private:
+		std::ostringstream& m_Stream;
+		bool m_bProgress;
+	};
+}
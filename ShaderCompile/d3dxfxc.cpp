@@ -6,37 +6,64 @@
 //
 //=============================================================================//
 
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #define NOWINRES
 #define NOSERVICE
 #define NOMCX
 #define NOIME
 #define NOMINMAX
+#endif
 
 #include "d3dxfxc.h"
 
 #include "basetypes.h"
 #include "cfgprocessor.h"
 #include "cmdsink.h"
+#include "compilecache.h"
+#ifdef _WIN32
 #include "d3dcompiler.h"
+#include "d3d11shader.h"
+#else
+#include <vkd3d_d3dcompiler.h>
+#endif
 #include "gsl/narrow"
-#include <malloc.h>
+#include "platform.h"
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <vector>
 
+#ifdef _WIN32
 #pragma comment( lib, "D3DCompiler" )
+#endif
 
-CSharedFile::CSharedFile( std::vector<char>&& data ) noexcept : std::vector<char>( std::forward<std::vector<char>>( data ) )
+CSharedFile::CSharedFile( std::vector<char>&& data ) noexcept : m_Data( std::forward<std::vector<char>>( data ) ), m_pData( m_Data.data() ), m_nSize( m_Data.size() )
+{
+}
+
+CSharedFile::CSharedFile( const char* pData, size_t nSize ) noexcept : m_pData( pData ), m_nSize( nSize )
 {
 }
 
 void FileCache::Add( const std::string& fileName, std::vector<char>&& data )
 {
-	const auto& it = m_map.find( fileName );
-	if ( it != m_map.end() )
-		return;
+	std::lock_guard lock( m_mtxLoad );
+	Insert( fileName, std::forward<std::vector<char>>( data ) );
+}
 
-	CSharedFile file( std::forward<std::vector<char>>( data ) );
-	m_map.emplace( fileName, std::move( file ) );
+const CSharedFile* FileCache::Insert( const std::string& fileName, CSharedFile&& file )
+{
+	const auto [it, bInserted] = m_map.try_emplace( fileName, std::move( file ) );
+	if ( bInserted )
+	{
+		const std::string_view name = it->first;
+		const size_t nSlash			= name.rfind( '/' );
+		it->second.m_szDirectory	= nSlash == std::string_view::npos ? std::string_view() : name.substr( 0, nSlash );
+		m_byData.emplace( it->second.Data(), &it->second );
+	}
+	return &it->second;
 }
 
 const CSharedFile* FileCache::Get( const std::string& filename ) const
@@ -48,18 +75,254 @@ const CSharedFile* FileCache::Get( const std::string& filename ) const
 	return nullptr;
 }
 
+const CSharedFile* FileCache::GetOrLoad( const std::string& fileName, const std::filesystem::path& path )
+{
+	{
+		std::lock_guard lock( m_mtxLoad );
+		if ( const CSharedFile* file = Get( fileName ) )
+			return file;
+	}
+
+	// Read outside the lock, if another thread got there first its copy wins
+	std::ifstream src( path, std::ios::binary | std::ios::ate );
+	if ( !src )
+		return nullptr;
+
+	std::vector<char> data( gsl::narrow<size_t>( static_cast<std::streamoff>( src.tellg() ) ) );
+	src.seekg( 0, std::ios::beg );
+	if ( !src.read( data.data(), data.size() ) )
+		return nullptr;
+
+	std::lock_guard lock( m_mtxLoad );
+	return Insert( fileName, std::move( data ) );
+}
+
+// dir/name with . and .. taken out, empty if it leaves the root
+static std::string JoinIncludePath( std::string_view dir, std::string_view name )
+{
+	std::string path;
+	const auto& Append = [&path]( std::string_view part )
+	{
+		while ( !part.empty() )
+		{
+			const size_t nSep			  = part.find_first_of( "/\\" );
+			const std::string_view segment = part.substr( 0, nSep );
+			part.remove_prefix( nSep == std::string_view::npos ? part.size() : nSep + 1 );
+
+			if ( segment.empty() || segment == "." )
+				continue;
+			if ( segment == ".." )
+			{
+				if ( path.empty() )
+					return false;
+				const size_t nSlash = path.rfind( '/' );
+				path.resize( nSlash == std::string::npos ? 0 : nSlash );
+				continue;
+			}
+			if ( !path.empty() )
+				path += '/';
+			path += segment;
+		}
+		return true;
+	};
+
+	if ( !Append( dir ) || !Append( name ) )
+		path.clear();
+	return path;
+}
+
+const CSharedFile* FileCache::Resolve( const void* pParentData, std::string_view include, const std::filesystem::path& root )
+{
+	std::string_view directory;
+	{
+		std::shared_lock lock( m_mtxLoad );
+		// Whatever isn't one of ours (the shader itself, preprocessed text) resolves from the root, under one key
+		const auto parent = m_byData.find( pParentData );
+		if ( parent == m_byData.end() )
+			pParentData = nullptr;
+		else
+			directory = parent->second->Directory();
+
+		if ( const auto it = m_resolved.find( IncludeView_t{ pParentData, include } ); it != m_resolved.end() )
+			return it->second;
+	}
+
+	// Like the parser, next to the including file first
+	const CSharedFile* pFile = nullptr;
+	for ( const std::string_view dir : { directory, std::string_view() } )
+	{
+		if ( const std::string name = JoinIncludePath( dir, include ); !name.empty() )
+		{
+			if ( pFile = GetOrLoad( name, root / name ); pFile )
+				break;
+		}
+		if ( directory.empty() )
+			break;
+	}
+	if ( !pFile )
+		return nullptr;
+
+	std::lock_guard lock( m_mtxLoad );
+	m_resolved.try_emplace( std::pair<const void*, std::string>( pParentData, include ), pFile );
+	return pFile;
+}
+
+void FileCache::Forget( const std::string& fileName )
+{
+	m_resolved.clear();
+	if ( const auto it = m_map.find( fileName ); it != m_map.end() )
+	{
+		m_byData.erase( it->second.Data() );
+		m_map.erase( it );
+	}
+}
+
 void FileCache::Clear()
 {
+	m_resolved.clear();
+	m_byData.clear();
 	m_map.clear();
 }
 
+uint64_t FileCache::Bytes()
+{
+	std::shared_lock lock( m_mtxLoad );
+	uint64_t nBytes = 0;
+	for ( const auto& [name, file] : m_map )
+		nBytes += name.capacity() + file.m_Data.capacity();
+	return nBytes;
+}
+
+// Magic and version, the number of files, then the size of the name and of the data of every file followed by both
+static constexpr uint32_t SNAPSHOT_MAGIC   = ( 'S' << 24 ) + ( 'C' << 16 ) + ( 'R' << 8 ) + 'S';
+static constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+bool FileCache::SaveSnapshot( const std::filesystem::path& path )
+{
+	std::shared_lock lock( m_mtxLoad );
+	std::ofstream file( path, std::ios::binary | std::ios::trunc );
+	const uint32_t header[3] = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, gsl::narrow<uint32_t>( m_map.size() ) };
+	file.write( reinterpret_cast<const char*>( header ), sizeof( header ) );
+	for ( const auto& [name, data] : m_map )
+	{
+		const uint32_t sizes[2] = { gsl::narrow<uint32_t>( name.size() ), gsl::narrow<uint32_t>( data.Size() ) };
+		file.write( reinterpret_cast<const char*>( sizes ), sizeof( sizes ) );
+		file.write( name.data(), name.size() );
+		file.write( static_cast<const char*>( data.Data() ), data.Size() );
+	}
+	return static_cast<bool>( file.flush() );
+}
+
+bool FileCache::AttachSnapshot( const void* pData, size_t nSize )
+{
+	const char* p	 = static_cast<const char*>( pData );
+	const char* pEnd = p + nSize;
+	uint32_t header[3];
+	if ( !p || nSize < sizeof( header ) )
+		return false;
+	memcpy( header, p, sizeof( header ) );
+	p += sizeof( header );
+	if ( header[0] != SNAPSHOT_MAGIC || header[1] != SNAPSHOT_VERSION )
+		return false;
+
+	std::lock_guard lock( m_mtxLoad );
+	for ( uint32_t i = 0; i < header[2]; ++i )
+	{
+		uint32_t sizes[2];
+		if ( static_cast<size_t>( pEnd - p ) < sizeof( sizes ) )
+			return false;
+		memcpy( sizes, p, sizeof( sizes ) );
+		p += sizeof( sizes );
+		if ( static_cast<uint64_t>( pEnd - p ) < uint64_t( sizes[0] ) + sizes[1] )
+			return false;
+		Insert( std::string( p, sizes[0] ), CSharedFile( p + sizes[0], sizes[1] ) );
+		p += sizes[0] + sizes[1];
+	}
+	return true;
+}
+
 FileCache fileCache;
 
+static std::filesystem::path s_IncludeRoot;
+
+// Where compiling goes, filled in by LoadCompilerLibrary unless the linked in d3dcompiler does
+static struct CompilerLibrary_t
+{
+	decltype( &D3DCompile ) m_pfnCompile;
+	decltype( &D3DPreprocess ) m_pfnPreprocess;
+	decltype( &D3DDisassemble ) m_pfnDisassemble; // Optional, for CountInstructions
+	uint64_t m_nVersion;
+	std::string m_Name;
+#ifdef _WIN32
+} s_Library{ &D3DCompile, &D3DPreprocess, &D3DDisassemble, D3D_COMPILER_VERSION, {} };
+#else
+} s_Library{};
+#endif
+
+bool Compiler::LoadCompilerLibrary( std::string_view name )
+{
+#ifdef _WIN32
+	// The linked in one stays
+	if ( name.empty() )
+		return true;
+	const std::string_view file = name;
+#else
+	static constexpr std::string_view DEFAULT_LIBRARY = "libvkd3d-utils.so.1";
+	const std::string_view file = name.empty() ? DEFAULT_LIBRARY : name;
+#endif
+	void* pLibrary = Platform::OpenLibrary( std::string( file ).c_str() );
+	if ( !pLibrary )
+		return false;
+
+	CompilerLibrary_t library{ reinterpret_cast<decltype( &D3DCompile )>( Platform::FindSymbol( pLibrary, "D3DCompile" ) ),
+							   reinterpret_cast<decltype( &D3DPreprocess )>( Platform::FindSymbol( pLibrary, "D3DPreprocess" ) ),
+							   reinterpret_cast<decltype( &D3DDisassemble )>( Platform::FindSymbol( pLibrary, "D3DDisassemble" ) ), 0, std::string( name ) };
+	if ( !library.m_pfnCompile || !library.m_pfnPreprocess )
+		return false;
+
+	// An update under the same name compiles differently, so the version is the hash of what was loaded
+	const Platform::CMappedFile contents( Platform::LibraryPath( pLibrary ) );
+	if ( !contents.Data() )
+		return false;
+	library.m_nVersion = CompileCache::HashBytes( contents.Data(), contents.Size(), 0 );
+	s_Library = std::move( library );
+	return true;
+}
+
+std::string_view Compiler::LibraryName() noexcept
+{
+	return s_Library.m_Name;
+}
+
+uint64_t Compiler::Version() noexcept
+{
+	return s_Library.m_nVersion;
+}
+
+static Compiler::Profile s_eProfile = Compiler::Profile::Release;
+
+void Compiler::SetProfile( Profile eProfile ) noexcept
+{
+	s_eProfile = eProfile;
+}
+
+uint32_t Compiler::FlagsFor( const CfgProcessor::CfgEntryInfo& entry, uint32_t flags ) noexcept
+{
+	if ( s_eProfile == Profile::Release || entry.m_bReleaseProfile )
+		return flags;
+	return ( flags & ~( D3DCOMPILE_OPTIMIZATION_LEVEL0 | D3DCOMPILE_OPTIMIZATION_LEVEL2 | D3DCOMPILE_OPTIMIZATION_LEVEL3 ) ) | D3DCOMPILE_SKIP_OPTIMIZATION;
+}
+
+void Compiler::LoadIncludesFrom( const std::filesystem::path& root )
+{
+	s_IncludeRoot = root;
+}
+
 static struct DxIncludeImpl final : public ID3DInclude
 {
-	STDMETHOD( Open )( THIS_ D3D_INCLUDE_TYPE, LPCSTR pFileName, LPCVOID, LPCVOID* ppData, UINT* pBytes ) override
+	STDMETHOD( Open )( THIS_ D3D_INCLUDE_TYPE, LPCSTR pFileName, LPCVOID pParentData, LPCVOID* ppData, UINT* pBytes ) override
 	{
-		const CSharedFile* file = fileCache.Get( pFileName );
+		const CSharedFile* file = fileCache.Resolve( pParentData, pFileName, s_IncludeRoot );
 		if ( !file )
 			return E_FAIL;
 
@@ -108,12 +371,17 @@ protected:
 };
 
 
+// Macros to be defined for D3DX, building the command kept them up to date with its defines
+using Macro_t = CfgProcessor::ComboBuildCommand::Macro_t;
+static_assert( sizeof( Macro_t ) == sizeof( D3D_SHADER_MACRO ) && offsetof( Macro_t, Name ) == offsetof( D3D_SHADER_MACRO, Name ) && offsetof( Macro_t, Definition ) == offsetof( D3D_SHADER_MACRO, Definition ) );
+static const D3D_SHADER_MACRO* BuildMacros( const CfgProcessor::ComboBuildCommand& pCommand ) noexcept
+{
+	return reinterpret_cast<const D3D_SHADER_MACRO*>( pCommand.macros.data() );
+}
+
 void Compiler::ExecuteCommand( const CfgProcessor::ComboBuildCommand& pCommand, CmdSink::IResponse* &pResponse, unsigned int flags )
 {
-	// Macros to be defined for D3DX
-	std::vector<D3D_SHADER_MACRO> macros;
-	macros.resize( pCommand.defines.size() + 1 );
-	std::transform( pCommand.defines.cbegin(), pCommand.defines.cend(), macros.begin(), []( const auto& d ) { return D3D_SHADER_MACRO{ d.first.data(), d.second.data() }; } );
+	const D3D_SHADER_MACRO* const macros = BuildMacros( pCommand );
 
 	ID3DBlob* pShader        = nullptr; // NOTE: Must release the COM interface later
 	ID3DBlob* pErrorMessages = nullptr; // NOTE: Must release COM interface later
@@ -123,11 +391,180 @@ void Compiler::ExecuteCommand( const CfgProcessor::ComboBuildCommand& pCommand,
 	HRESULT hr       = s_incDxImpl.Open( D3D_INCLUDE_LOCAL, pCommand.fileName.data(), nullptr, &lpcvData, &numBytes );
 	if ( !FAILED( hr ) )
 	{
-		hr = D3DCompile( lpcvData, numBytes, pCommand.fileName.data(), macros.data(), &s_incDxImpl, pCommand.entryPoint.data(), pCommand.shaderModel.data(), flags, 0, &pShader, &pErrorMessages );
+		hr = s_Library.m_pfnCompile( lpcvData, numBytes, pCommand.fileName.data(), macros, &s_incDxImpl, pCommand.entryPoint.data(), pCommand.shaderModel.data(), flags, 0, &pShader, &pErrorMessages );
 
 		// Close the file
 		s_incDxImpl.Close( lpcvData );
 	}
 
 	pResponse = new( std::nothrow ) CResponse( pShader, pErrorMessages, hr );
-}
\ No newline at end of file
+}
+
+bool Compiler::PreprocessCommand( const CfgProcessor::ComboBuildCommand& pCommand, std::string& text )
+{
+	const D3D_SHADER_MACRO* const macros = BuildMacros( pCommand );
+
+	ID3DBlob* pText          = nullptr;
+	ID3DBlob* pErrorMessages = nullptr;
+
+	LPCVOID lpcvData = nullptr;
+	UINT numBytes    = 0;
+	HRESULT hr       = s_incDxImpl.Open( D3D_INCLUDE_LOCAL, pCommand.fileName.data(), nullptr, &lpcvData, &numBytes );
+	if ( !FAILED( hr ) )
+	{
+		hr = s_Library.m_pfnPreprocess( lpcvData, numBytes, pCommand.fileName.data(), macros, &s_incDxImpl, &pText, &pErrorMessages );
+		s_incDxImpl.Close( lpcvData );
+	}
+
+	const bool bSucceeded = !FAILED( hr ) && pText;
+	if ( bSucceeded )
+		text.assign( static_cast<const char*>( pText->GetBufferPointer() ), strnlen( static_cast<const char*>( pText->GetBufferPointer() ), pText->GetBufferSize() ) );
+
+	if ( pText )
+		pText->Release();
+	if ( pErrorMessages )
+		pErrorMessages->Release();
+
+	return bSucceeded;
+}
+
+void Compiler::ExecutePreprocessed( const CfgProcessor::ComboBuildCommand& pCommand, const std::string& text, CmdSink::IResponse* &pResponse, unsigned int flags )
+{
+	ID3DBlob* pShader        = nullptr; // NOTE: Must release the COM interface later
+	ID3DBlob* pErrorMessages = nullptr; // NOTE: Must release COM interface later
+
+	// Defines are already applied, #line directives keep the messages pointing at the original files
+	const HRESULT hr = s_Library.m_pfnCompile( text.data(), text.size(), pCommand.fileName.data(), nullptr, &s_incDxImpl, pCommand.entryPoint.data(), pCommand.shaderModel.data(), flags, 0, &pShader, &pErrorMessages );
+
+	pResponse = new( std::nothrow ) CResponse( pShader, pErrorMessages, hr );
+}
+
+namespace
+{
+	class CD3DCompileBackend final : public Compiler::IBackend
+	{
+	public:
+		std::string_view Name() const noexcept override { return "D3DCompile"; }
+		bool Supports( const CfgProcessor::CfgEntryInfo& ) const override { return true; }
+		bool UsesWorkerProcesses() const noexcept override { return true; }
+
+		void Compile( const CfgProcessor::ComboBuildCommand* const* ppCommands, const std::string* const* ppPreprocessed, CmdSink::IResponse** ppResponses,
+					  size_t nCommands, unsigned int flags ) override
+		{
+			// Nothing to gain from batching, every call is a compile of its own
+			for ( size_t i = 0; i < nCommands; ++i )
+			{
+				if ( ppPreprocessed && ppPreprocessed[i] )
+					Compiler::ExecutePreprocessed( *ppCommands[i], *ppPreprocessed[i], ppResponses[i], flags );
+				else
+					Compiler::ExecuteCommand( *ppCommands[i], ppResponses[i], flags );
+			}
+		}
+	};
+} // namespace
+
+static CD3DCompileBackend s_D3DCompileBackend;
+static std::vector<std::unique_ptr<Compiler::IBackend>> s_Backends;
+
+void Compiler::RegisterBackend( std::unique_ptr<IBackend> pBackend )
+{
+	s_Backends.emplace_back( std::move( pBackend ) );
+}
+
+Compiler::IBackend& Compiler::SelectBackend( const CfgProcessor::CfgEntryInfo& entry )
+{
+	for ( auto it = s_Backends.rbegin(); it != s_Backends.rend(); ++it )
+	{
+		if ( ( *it )->Supports( entry ) )
+			return **it;
+	}
+	return s_D3DCompileBackend;
+}
+
+uint32_t Compiler::CountInstructions( const void* pByteCode, size_t nSize )
+{
+#ifdef _WIN32
+	ID3D11ShaderReflection* pReflection = nullptr;
+	if ( SUCCEEDED( D3DReflect( pByteCode, nSize, __uuidof( ID3D11ShaderReflection ), reinterpret_cast<void**>( &pReflection ) ) ) )
+	{
+		D3D11_SHADER_DESC desc;
+		const HRESULT hr = pReflection->GetDesc( &desc );
+		pReflection->Release();
+		if ( SUCCEEDED( hr ) )
+			return desc.InstructionCount;
+	}
+#endif
+
+	// Shader model 3 and older can't be reflected, their listing ends in the number of slots used
+	ID3DBlob* pText = nullptr;
+	if ( !s_Library.m_pfnDisassemble || FAILED( s_Library.m_pfnDisassemble( pByteCode, nSize, 0, nullptr, &pText ) ) )
+		return 0;
+
+	uint32_t nInstructions = 0;
+	const std::string_view text( static_cast<const char*>( pText->GetBufferPointer() ), pText->GetBufferSize() );
+	constexpr std::string_view slots = "// approximately ";
+	if ( const size_t nPos = text.rfind( slots ); nPos != std::string_view::npos )
+		nInstructions = static_cast<uint32_t>( strtoul( text.data() + nPos + slots.size(), nullptr, 10 ) );
+	pText->Release();
+	return nInstructions;
+}
+
+bool Compiler::StripByteCode( const void* pByteCode, size_t nSize, Strip eStrip, std::vector<uint8_t>& stripped )
+{
+	// The version token, then instructions that carry their own length and comments, up to the end token
+	constexpr uint32_t END_TOKEN	 = 0x0000FFFF;
+	constexpr uint32_t COMMENT		 = 0xFFFE;
+	constexpr uint32_t CONSTANT_TABLE = 'C' | 'T' << 8 | 'A' << 16 | 'B' << 24;
+	if ( eStrip == Strip::None || nSize < 8 || nSize % 4 )
+		return false;
+
+	const uint8_t* const pBytes = static_cast<const uint8_t*>( pByteCode );
+	const size_t nTokens		= nSize / 4;
+	const auto& Token			= [pBytes]( size_t i ) noexcept
+	{
+		uint32_t nToken;
+		memcpy( &nToken, pBytes + i * 4, 4 );
+		return nToken;
+	};
+
+	// Pixel and vertex shaders from 2.0 on, before that instructions don't say how long they are
+	const uint32_t nVersion = Token( 0 );
+	if ( ( nVersion >> 16 != 0xFFFF && nVersion >> 16 != 0xFFFE ) || ( ( nVersion >> 8 ) & 0xFF ) < 2 )
+		return false;
+
+	stripped.assign( pBytes, pBytes + 4 );
+	bool bStripped = false;
+	for ( size_t i = 1; i < nTokens; )
+	{
+		const uint32_t nToken = Token( i );
+		if ( nToken == END_TOKEN )
+		{
+			stripped.insert( stripped.end(), pBytes + i * 4, pBytes + nSize );
+			return bStripped;
+		}
+
+		size_t nLength;
+		if ( ( nToken & 0xFFFF ) == COMMENT )
+		{
+			nLength = 1 + ( ( nToken >> 16 ) & 0x7FFF );
+			if ( i + nLength > nTokens )
+				return false;
+			if ( eStrip == Strip::All || nLength < 2 || Token( i + 1 ) != CONSTANT_TABLE )
+			{
+				bStripped = true;
+				i += nLength;
+				continue;
+			}
+		}
+		else
+			nLength = 1 + ( ( nToken >> 24 ) & 0xF );
+
+		if ( i + nLength > nTokens )
+			return false;
+		stripped.insert( stripped.end(), pBytes + i * 4, pBytes + ( i + nLength ) * 4 );
+		i += nLength;
+	}
+
+	// Never got to the end token
+	return false;
+}
@@ -8,20 +8,40 @@
 
 #pragma once
 
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
 #include "basetypes.h"
 #include "cmdsink.h"
 
 #include "robin_hood.h"
 
-class CSharedFile final : private std::vector<char>
+class CSharedFile final
 {
 public:
 	CSharedFile( std::vector<char>&& data ) noexcept;
-	using std::vector<char>::vector;
+	// Bytes kept elsewhere for as long as the cache, a snapshot of -processes
+	CSharedFile( const char* pData, size_t nSize ) noexcept;
+	CSharedFile( CSharedFile&& ) noexcept = default; // The buffer of a moved vector stays where it is
 	~CSharedFile() = default;
 
-	[[nodiscard]] const void* Data() const noexcept { return data(); }
-	[[nodiscard]] size_t Size() const noexcept { return size(); }
+	[[nodiscard]] const void* Data() const noexcept { return m_pData; }
+	[[nodiscard]] size_t Size() const noexcept { return m_nSize; }
+	// Relative to the root with forward slashes, #includes in the file are looked for here first
+	[[nodiscard]] std::string_view Directory() const noexcept { return m_szDirectory; }
+
+private:
+	friend class FileCache;
+	std::vector<char> m_Data; // Empty if the bytes are elsewhere
+	const char* m_pData;
+	size_t m_nSize;
+	std::string_view m_szDirectory; // Points into the name the cache keeps it under
 };
 
 class FileCache final
@@ -32,13 +52,58 @@ public:
 
 	void Add( const std::string& fileName, std::vector<char>&& data );
 
+	// Doesn't lock, only call it once nothing is loaded anymore
 	[[nodiscard]] const CSharedFile* Get( const std::string& filename ) const;
 
+	// Reads path the first time fileName is asked for, every later caller shares that copy.
+	// Returns nullptr if it can't be read. Safe to call from several threads.
+	[[nodiscard]] const CSharedFile* GetOrLoad( const std::string& fileName, const std::filesystem::path& path );
+
+	// Finds what an #include of the compiler means: relative to the directory of the including file, whose data is
+	// pParentData, then relative to root. Files nobody asked for yet are read from root. Every include is only
+	// resolved once per including file, after that it is a single lookup. Safe to call from several threads.
+	[[nodiscard]] const CSharedFile* Resolve( const void* pParentData, std::string_view include, const std::filesystem::path& root );
+
+	// Drops fileName if it changed on disk, the next GetOrLoad reads it again. Includes resolve afresh, a new file may
+	// shadow another. Doesn't lock, only call it once nothing is loaded anymore.
+	void Forget( const std::string& fileName );
+
 	void Clear();
 
+	// Data of the files read so far, the ones in a mapped snapshot don't count. Safe to call from several threads.
+	[[nodiscard]] uint64_t Bytes();
+
+	// -processes: every file read so far in one file, the children map it instead of each reading its own copies. The
+	// pages of the mapping are shared, the sources cost the same memory however many children there are.
+	[[nodiscard]] bool SaveSnapshot( const std::filesystem::path& path );
+	// The files point into pData, which has to stay mapped as long as the cache. Call it before anything is loaded.
+	bool AttachSnapshot( const void* pData, size_t nSize );
+
 protected:
+	// Adds the file unless fileName is already there, call with m_mtxLoad held
+	const CSharedFile* Insert( const std::string& fileName, CSharedFile&& file );
+
 	typedef robin_hood::unordered_node_map<std::string, CSharedFile> Mapping;
 	Mapping m_map;
+	std::shared_mutex m_mtxLoad;
+
+	// Including file and the name as written, looked up without copying the name
+	using IncludeView_t = std::pair<const void*, std::string_view>;
+	struct IncludeHash
+	{
+		using is_transparent = int;
+		size_t operator()( const IncludeView_t& key ) const noexcept
+		{
+			return robin_hood::hash_bytes( key.second.data(), key.second.size() ) ^ robin_hood::hash_int( reinterpret_cast<uintptr_t>( key.first ) );
+		}
+	};
+	struct IncludeEqual
+	{
+		using is_transparent = int;
+		bool operator()( const IncludeView_t& a, const IncludeView_t& b ) const noexcept { return a == b; }
+	};
+	robin_hood::unordered_flat_map<const void*, const CSharedFile*> m_byData;
+	robin_hood::unordered_node_map<std::pair<const void*, std::string>, const CSharedFile*, IncludeHash, IncludeEqual> m_resolved;
 };
 
 extern FileCache fileCache;
@@ -46,9 +111,78 @@ extern FileCache fileCache;
 namespace CfgProcessor
 {
 	struct ComboBuildCommand;
+	struct CfgEntryInfo;
 }
 
 namespace Compiler
 {
 	void ExecuteCommand( const CfgProcessor::ComboBuildCommand& pCommand, CmdSink::IResponse* &ppResponse, unsigned int flags );
+
+	// Loads D3DCompile and friends from the library, or a d3dcompiler compatible one like vkd3d-utils.
+	// Empty picks the default: the d3dcompiler linked in on Windows, libvkd3d-utils elsewhere.
+	[[nodiscard]] bool LoadCompilerLibrary( std::string_view name );
+	// What LoadCompilerLibrary was given, for the children of -processes
+	[[nodiscard]] std::string_view LibraryName() noexcept;
+	// Tells compilers apart in the keys of the compile cache, from the contents of the library
+	[[nodiscard]] uint64_t Version() noexcept;
+
+	// -profile: release compiles every shader with the flags it is given. Dev skips optimization, which compiles several
+	// times faster, except for shaders whose source says "// PROFILE: release". The flags are part of the compile cache key.
+	enum class Profile : uint8_t
+	{
+		Release,
+		Dev,
+	};
+	void SetProfile( Profile eProfile ) noexcept;
+	// The flags the combos of entry compile with under the profile
+	[[nodiscard]] uint32_t FlagsFor( const CfgProcessor::CfgEntryInfo& entry, uint32_t flags ) noexcept;
+
+	// Files that are not in fileCache yet are read from root when they are opened, for processes that didn't parse the shaders
+	// and for includes the parser never saw
+	void LoadIncludesFrom( const std::filesystem::path& root );
+
+	// Runs only the preprocessor with the defines of the command, returns false if it failed
+	bool PreprocessCommand( const CfgProcessor::ComboBuildCommand& pCommand, std::string& text );
+	// Compiles text returned by PreprocessCommand
+	void ExecutePreprocessed( const CfgProcessor::ComboBuildCommand& pCommand, const std::string& text, CmdSink::IResponse* &ppResponse, unsigned int flags );
+
+	// Instructions of compiled bytecode, from the reflection or the disassembly of older shader models. 0 if neither knows.
+	[[nodiscard]] uint32_t CountInstructions( const void* pByteCode, size_t nSize );
+
+	// What -strip takes out of compiled code before it is packed
+	enum class Strip : uint8_t
+	{
+		None,
+		Comments,	// Comment blocks other than the constant table, which binding constants by name needs
+		All,		// The constant table too, for shaders whose constants are only set by register
+	};
+
+	// Copies shader model 2 and 3 code to stripped without the comment blocks eStrip drops. False if there were none
+	// or the code isn't a well formed token stream, stripped isn't meaningful then.
+	[[nodiscard]] bool StripByteCode( const void* pByteCode, size_t nSize, Strip eStrip, std::vector<uint8_t>& stripped );
+
+	// Turns commands into code. Every shader gets the backend SelectBackend picks for it, and commands are handed over
+	// in batches so that a backend with a high cost per call (another compiler, a remote service) can spread it out.
+	class IBackend
+	{
+	public:
+		virtual ~IBackend() = default;
+
+		[[nodiscard]] virtual std::string_view Name() const noexcept = 0;
+		// Whether it can compile the shader model and entry point of the shader
+		[[nodiscard]] virtual bool Supports( const CfgProcessor::CfgEntryInfo& entry ) const = 0;
+		// The children of -processes compile with D3DCompile, commands of other backends never go to them
+		[[nodiscard]] virtual bool UsesWorkerProcesses() const noexcept { return false; }
+
+		// Sets ppResponses[i] for every ppCommands[i], nullptr if it couldn't even try. ppPreprocessed[i] is the text
+		// PreprocessCommand returned for the command or nullptr, ppPreprocessed itself may be nullptr if none are.
+		// Called from all worker threads at once.
+		virtual void Compile( const CfgProcessor::ComboBuildCommand* const* ppCommands, const std::string* const* ppPreprocessed, CmdSink::IResponse** ppResponses,
+							  size_t nCommands, unsigned int flags ) = 0;
+	};
+
+	// Backends registered later are asked first, D3DCompile takes every shader none of them supports.
+	// Register before compiling starts, selecting doesn't lock.
+	void RegisterBackend( std::unique_ptr<IBackend> pBackend );
+	[[nodiscard]] IBackend& SelectBackend( const CfgProcessor::CfgEntryInfo& entry );
 }; // namespace InterceptFxc
\ No newline at end of file
@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <climits>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "defineanalysis.h"
+#include "termcolor/style.hpp"
+#include "termcolors.hpp"
+#include "strmanip.hpp"
+#include "robin_hood.h"
+
+using namespace std::literals;
+
+namespace DefineAnalysis
+{
+	static constexpr size_t NUM_PRINTED = 20;
+
+	struct ShaderData_t
+	{
+		std::vector<std::string> m_arrNames;	// Of the defines, in the order of ComboBuildCommand::values
+		std::vector<int> m_arrValues;			// m_arrNames.size() per combo
+		std::vector<uint64_t> m_arrHashes;
+		std::vector<uint32_t> m_arrMicroseconds;
+	};
+	using ShaderMap_t = robin_hood::unordered_node_map<std::string_view, ShaderData_t>;
+
+	struct Pairs_t
+	{
+		uint64_t m_nCompared		= 0;
+		uint64_t m_nSame			= 0;
+		uint64_t m_nSameMicroseconds = 0; // Spent on the combos of m_nSame
+
+		void Add( bool bSame, uint32_t nMicroseconds ) noexcept
+		{
+			++m_nCompared;
+			if ( bSame )
+			{
+				++m_nSame;
+				m_nSameMicroseconds += nMicroseconds;
+			}
+		}
+	};
+
+	struct Suggestion_t
+	{
+		std::string_view m_szShader;
+		std::string m_szText;
+		Pairs_t m_Pairs;
+	};
+
+	static bool s_bEnabled = false;
+	static std::mutex s_mtxBuffers;
+	static std::vector<std::unique_ptr<ShaderMap_t>> s_Buffers; // One per thread, only it records into its own
+	static thread_local ShaderMap_t* s_tlBuffer;
+
+	void Enable( bool bEnable ) noexcept
+	{
+		s_bEnabled = bEnable;
+	}
+
+	bool Enabled() noexcept
+	{
+		return s_bEnabled;
+	}
+
+	void Record( std::string_view szShader, const CfgProcessor::ComboBuildCommand& command, uint64_t nHash, uint32_t nMicroseconds )
+	{
+		if ( !s_tlBuffer )
+		{
+			std::lock_guard guard{ s_mtxBuffers };
+			s_tlBuffer = s_Buffers.emplace_back( std::make_unique<ShaderMap_t>() ).get();
+		}
+
+		ShaderData_t& data = ( *s_tlBuffer )[szShader];
+		if ( data.m_arrNames.empty() )
+		{
+			const size_t iFirstName = command.defines.size() - command.values.size();
+			for ( size_t i = 0; i < command.values.size(); ++i )
+				data.m_arrNames.emplace_back( command.defines[iFirstName + i].first );
+		}
+		data.m_arrValues.insert( data.m_arrValues.end(), command.values.cbegin(), command.values.cend() );
+		data.m_arrHashes.emplace_back( nHash );
+		data.m_arrMicroseconds.emplace_back( nMicroseconds );
+	}
+
+	static std::string Condition( std::string_view szName, std::string_view szOp, int nValue )
+	{
+		return "$"s.append( szName ).append( szOp ).append( std::to_string( nValue ) );
+	}
+
+	// Compares every combo with the one that has define i at its lowest value, unconditionally and for every value of the others
+	static void AnalyzeShader( std::string_view szShader, const ShaderData_t& data, std::vector<Suggestion_t>& arrSuggestions )
+	{
+		const size_t nSlots	 = data.m_arrNames.size();
+		const size_t nCombos = data.m_arrHashes.size();
+		if ( !nSlots )
+			return;
+
+		std::vector<int> arrMin( nSlots, INT_MAX ), arrMax( nSlots, INT_MIN );
+		for ( size_t c = 0; c < nCombos; ++c )
+		{
+			for ( size_t i = 0; i < nSlots; ++i )
+			{
+				arrMin[i] = std::min( arrMin[i], data.m_arrValues[c * nSlots + i] );
+				arrMax[i] = std::max( arrMax[i], data.m_arrValues[c * nSlots + i] );
+			}
+		}
+
+		// The values seen, numbered like the combos are
+		std::vector<uint64_t> arrStride( nSlots );
+		uint64_t nStride = 1;
+		for ( size_t i = 0; i < nSlots; ++i )
+		{
+			const uint64_t nRange = static_cast<uint64_t>( static_cast<int64_t>( arrMax[i] ) - arrMin[i] + 1 );
+			if ( nStride > UINT64_MAX / nRange )
+				return;
+			arrStride[i] = nStride;
+			nStride *= nRange;
+		}
+
+		std::vector<uint64_t> arrKeys( nCombos );
+		robin_hood::unordered_flat_map<uint64_t, size_t> comboOfKey;
+		comboOfKey.reserve( nCombos );
+		for ( size_t c = 0; c < nCombos; ++c )
+		{
+			uint64_t nKey = 0;
+			for ( size_t i = 0; i < nSlots; ++i )
+				nKey += static_cast<uint64_t>( data.m_arrValues[c * nSlots + i] - arrMin[i] ) * arrStride[i];
+			arrKeys[c] = nKey;
+			comboOfKey.emplace( nKey, c );
+		}
+
+		std::vector<std::vector<Pairs_t>> arrByValue( nSlots ); // Of define j while define i varies
+		for ( size_t i = 0; i < nSlots; ++i )
+		{
+			if ( arrMin[i] == arrMax[i] )
+				continue;
+
+			Pairs_t total;
+			for ( size_t j = 0; j < nSlots; ++j )
+				arrByValue[j].assign( j == i ? 0 : static_cast<size_t>( arrMax[j] - arrMin[j] + 1 ), Pairs_t{} );
+
+			for ( size_t c = 0; c < nCombos; ++c )
+			{
+				const int* pValues = data.m_arrValues.data() + c * nSlots;
+				if ( pValues[i] == arrMin[i] )
+					continue;
+				const auto it = comboOfKey.find( arrKeys[c] - static_cast<uint64_t>( pValues[i] - arrMin[i] ) * arrStride[i] );
+				if ( it == comboOfKey.end() )
+					continue;
+
+				const bool bSame			= data.m_arrHashes[c] == data.m_arrHashes[it->second];
+				const uint32_t nMicroseconds = data.m_arrMicroseconds[c];
+				total.Add( bSame, nMicroseconds );
+				for ( size_t j = 0; j < nSlots; ++j )
+				{
+					if ( j != i )
+						arrByValue[j][pValues[j] - arrMin[j]].Add( bSame, nMicroseconds );
+				}
+			}
+
+			const std::string_view szName = data.m_arrNames[i];
+			if ( !total.m_nSame )
+				continue;
+			if ( total.m_nSame == total.m_nCompared )
+			{
+				arrSuggestions.emplace_back( Suggestion_t{ szShader, "drop "s.append( szName ).append( " from the combos or SKIP: " ).append( Condition( szName, " != "sv, arrMin[i] ) ), total } );
+				continue;
+			}
+
+			for ( size_t j = 0; j < nSlots; ++j )
+			{
+				for ( size_t w = 0; w < arrByValue[j].size(); ++w )
+				{
+					const Pairs_t& pairs = arrByValue[j][w];
+					if ( pairs.m_nSame < MIN_SAME || pairs.m_nSame != pairs.m_nCompared )
+						continue;
+					arrSuggestions.emplace_back( Suggestion_t{ szShader, "SKIP: ( "s.append( Condition( data.m_arrNames[j], " == "sv, arrMin[j] + static_cast<int>( w ) ) ).append( " ) && ( " ).append( Condition( szName, " != "sv, arrMin[i] ) ).append( " )" ), pairs } );
+				}
+			}
+		}
+	}
+
+	void Finish()
+	{
+		if ( !s_bEnabled )
+			return;
+		s_bEnabled = false;
+
+		std::lock_guard guard{ s_mtxBuffers };
+		ShaderMap_t shaders;
+		for ( const auto& pBuffer : s_Buffers )
+		{
+			for ( auto& [name, from] : *pBuffer )
+			{
+				ShaderData_t& data = shaders[name];
+				if ( data.m_arrNames.empty() )
+					data.m_arrNames = std::move( from.m_arrNames );
+				data.m_arrValues.insert( data.m_arrValues.end(), from.m_arrValues.cbegin(), from.m_arrValues.cend() );
+				data.m_arrHashes.insert( data.m_arrHashes.end(), from.m_arrHashes.cbegin(), from.m_arrHashes.cend() );
+				data.m_arrMicroseconds.insert( data.m_arrMicroseconds.end(), from.m_arrMicroseconds.cbegin(), from.m_arrMicroseconds.cend() );
+			}
+		}
+
+		std::vector<Suggestion_t> arrSuggestions;
+		for ( const auto& [name, data] : shaders )
+			AnalyzeShader( name, data, arrSuggestions );
+		if ( arrSuggestions.empty() )
+		{
+			std::cout << "Every define changed the code of the combos it was compared in"sv << std::endl;
+			return;
+		}
+
+		std::sort( arrSuggestions.begin(), arrSuggestions.end(), []( const Suggestion_t& a, const Suggestion_t& b ) { return a.m_Pairs.m_nSameMicroseconds > b.m_Pairs.m_nSameMicroseconds; } );
+		std::cout << "Defines that didn't change the code:"sv << std::endl;
+		for ( size_t i = 0; i < std::min( NUM_PRINTED, arrSuggestions.size() ); ++i )
+		{
+			const Suggestion_t& s = arrSuggestions[i];
+			std::cout << "  "sv << s.m_szShader << ": "sv << s.m_szText << ", "sv << clr::green << PrettyPrint( s.m_Pairs.m_nSame ) << clr::reset << " of "sv << PrettyPrint( s.m_Pairs.m_nCompared ) << " combos compiled the same, saves "sv
+					  << clr::green << PrettyPrint( s.m_Pairs.m_nSameMicroseconds / 1000 ) << clr::reset << " ms"sv << std::endl;
+		}
+		if ( arrSuggestions.size() > NUM_PRINTED )
+			std::cout << "  and "sv << PrettyPrint( arrSuggestions.size() - NUM_PRINTED ) << " more"sv << std::endl;
+	}
+}
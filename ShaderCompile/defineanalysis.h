@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+#include "cfgprocessor.h"
+
+// -analyze: finds defines that don't change the code. Every combo that compiled is compared with the combo that only
+// differs in one define, set to its lowest value. A define whose combos always compile the same as that one could be
+// dropped, one that does so only while another define has some value could be skipped there. The SKIP expressions
+// suggested that way remove combos the game may still ask for, they are meant to be looked at, not pasted.
+namespace DefineAnalysis
+{
+	// Pairs that have to compile the same before a SKIP is suggested for them
+	static constexpr uint64_t MIN_SAME = 4;
+
+	void Enable( bool bEnable ) noexcept;
+	[[nodiscard]] bool Enabled() noexcept;
+
+	// A combo of szShader (has to outlive Finish) that compiled to code hashing to nHash
+	void Record( std::string_view szShader, const CfgProcessor::ComboBuildCommand& command, uint64_t nHash, uint32_t nMicroseconds );
+
+	// Prints the defines that changed the code least and what leaving them out would have saved
+	void Finish();
+}
@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "failpredict.h"
+#include "termcolor/style.hpp"
+#include "termcolors.hpp"
+#include "strmanip.hpp"
+#include "robin_hood.h"
+
+using namespace std::literals;
+
+namespace FailPredict
+{
+	static constexpr int ANY_VALUE = INT_MIN; // The failures of a signature differ in this define
+
+	struct Signature_t
+	{
+		std::string m_szErrors;								// Error codes of the listing, e.g. "X5608"
+		std::vector<int> m_arrValues;						// Static define values all of its failures had, ANY_VALUE where they differ
+		robin_hood::unordered_flat_set<uint64_t> m_Failed;	// Static combos that failed with it
+		uint64_t m_nSkipped = 0;
+		bool m_bRefuted		= false;
+
+		[[nodiscard]] bool Matches( const int* pValues ) const noexcept
+		{
+			for ( size_t i = 0; i < m_arrValues.size(); ++i )
+			{
+				if ( m_arrValues[i] != ANY_VALUE && m_arrValues[i] != pValues[i] )
+					return false;
+			}
+			return true;
+		}
+
+		// Failures that share no static define value are not tied to the static combo
+		[[nodiscard]] bool Pinned() const noexcept
+		{
+			return std::any_of( m_arrValues.cbegin(), m_arrValues.cend(), []( int v ) noexcept { return v != ANY_VALUE; } );
+		}
+
+		[[nodiscard]] bool Predicts() const noexcept
+		{
+			return !m_bRefuted && m_Failed.size() >= MIN_FAILURES && Pinned();
+		}
+	};
+
+	class CShaderModel
+	{
+	public:
+		std::mutex m_mtx;
+		std::atomic<bool> m_bFailed{ false };		// Successes only matter once something failed
+		std::atomic<bool> m_bPredicting{ false };	// Some signature predicts, Skip has to look
+		std::vector<std::string_view> m_arrNames;	// Of the static defines
+		std::vector<Signature_t> m_arrSignatures;
+
+		void Update() noexcept
+		{
+			m_bPredicting.store( std::any_of( m_arrSignatures.cbegin(), m_arrSignatures.cend(), []( const Signature_t& sig ) noexcept { return sig.Predicts(); } ),
+								 std::memory_order_release );
+		}
+	};
+
+	static bool s_bEnabled = false;
+	static std::mutex s_mtx;
+	static robin_hood::unordered_node_map<std::string, CShaderModel> s_Shaders;
+
+	// The error codes of a listing, sorted and separated by spaces. Empty if it has none.
+	static std::string ErrorCodes( std::string_view szListing )
+	{
+		std::vector<std::string_view> codes;
+		for ( size_t nPos = szListing.find( "error "sv ); nPos != std::string_view::npos; nPos = szListing.find( "error "sv, nPos ) )
+		{
+			nPos += 6;
+			const size_t nEnd = szListing.find_first_of( ": \t\r\n"sv, nPos );
+			if ( nEnd != nPos && nEnd != std::string_view::npos && szListing[nEnd] == ':' )
+				codes.emplace_back( szListing.substr( nPos, nEnd - nPos ) );
+		}
+		std::sort( codes.begin(), codes.end() );
+		codes.erase( std::unique( codes.begin(), codes.end() ), codes.end() );
+
+		std::string szCodes;
+		for ( std::string_view code : codes )
+		{
+			if ( !szCodes.empty() )
+				szCodes += ' ';
+			szCodes += code;
+		}
+		return szCodes;
+	}
+
+	void Enable( bool bEnable ) noexcept
+	{
+		s_bEnabled = bEnable;
+	}
+
+	CShaderModel* Begin( std::string_view szShader )
+	{
+		if ( !s_bEnabled )
+			return nullptr;
+		std::lock_guard guard{ s_mtx };
+		return &s_Shaders[std::string( szShader )];
+	}
+
+	bool Skip( CShaderModel& model, uint64_t nStaticCombo, const CfgProcessor::ComboBuildCommand& command, uint32_t nDynamicDefines )
+	{
+		if ( !model.m_bPredicting.load( std::memory_order_acquire ) )
+			return false;
+
+		// The sample is picked by static combo, all of its dynamic combos go the same way
+		if ( ( ( nStaticCombo * 0x9E3779B97F4A7C15ULL ) >> 32 ) % SAMPLE_EVERY == 0 )
+			return false;
+
+		const int* pValues = command.values.data() + nDynamicDefines;
+		std::lock_guard guard{ model.m_mtx };
+		for ( Signature_t& sig : model.m_arrSignatures )
+		{
+			if ( sig.Predicts() && sig.Matches( pValues ) )
+			{
+				++sig.m_nSkipped;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void Record( CShaderModel& model, uint64_t nStaticCombo, const CfgProcessor::ComboBuildCommand& command, uint32_t nDynamicDefines, bool bSucceeded, std::string_view szListing )
+	{
+		const int* pValues = command.values.data() + nDynamicDefines;
+		if ( bSucceeded )
+		{
+			if ( !model.m_bFailed.load( std::memory_order_acquire ) )
+				return;
+
+			// Failures that come and go with the dynamic combos, or with values the signature doesn't look at
+			std::lock_guard guard{ model.m_mtx };
+			for ( Signature_t& sig : model.m_arrSignatures )
+			{
+				if ( !sig.m_bRefuted && sig.Matches( pValues ) )
+					sig.m_bRefuted = true;
+			}
+			model.Update();
+			return;
+		}
+
+		std::string szErrors = ErrorCodes( szListing );
+		if ( szErrors.empty() )
+			return;
+
+		const size_t nValues = command.values.size() - nDynamicDefines;
+		std::lock_guard guard{ model.m_mtx };
+		if ( model.m_arrNames.empty() )
+		{
+			const size_t iFirstName = command.defines.size() - command.values.size() + nDynamicDefines;
+			for ( size_t i = 0; i < nValues; ++i )
+				model.m_arrNames.emplace_back( command.defines[iFirstName + i].first );
+		}
+
+		auto it = std::find_if( model.m_arrSignatures.begin(), model.m_arrSignatures.end(), [&szErrors]( const Signature_t& sig ) { return sig.m_szErrors == szErrors; } );
+		if ( it == model.m_arrSignatures.end() )
+		{
+			Signature_t& sig = model.m_arrSignatures.emplace_back();
+			sig.m_szErrors	 = std::move( szErrors );
+			sig.m_arrValues.assign( pValues, pValues + nValues );
+			sig.m_Failed.emplace( nStaticCombo );
+		}
+		else if ( it->m_Failed.emplace( nStaticCombo ).second )
+		{
+			for ( size_t i = 0; i < nValues; ++i )
+			{
+				if ( it->m_arrValues[i] != pValues[i] )
+					it->m_arrValues[i] = ANY_VALUE;
+			}
+		}
+
+		model.m_bFailed.store( true, std::memory_order_release );
+		model.Update();
+	}
+
+	void PrintSkipped( std::string_view szShader )
+	{
+		std::lock_guard guard{ s_mtx };
+		const auto it = s_Shaders.find( std::string( szShader ) );
+		if ( it == s_Shaders.end() )
+			return;
+
+		CShaderModel& model = it->second;
+		std::lock_guard guardModel{ model.m_mtx };
+		for ( const Signature_t& sig : model.m_arrSignatures )
+		{
+			if ( !sig.m_nSkipped )
+				continue;
+
+			std::cout << "    Skipped "sv << clr::green << PrettyPrint( sig.m_nSkipped ) << clr::reset << " combos predicted to fail with "sv << clr::red << sig.m_szErrors << clr::reset
+					  << " like the "sv << PrettyPrint( sig.m_Failed.size() ) << " static combos with"sv;
+			for ( size_t i = 0; i < sig.m_arrValues.size(); ++i )
+			{
+				if ( sig.m_arrValues[i] != ANY_VALUE )
+					std::cout << ' ' << model.m_arrNames[i] << '=' << sig.m_arrValues[i];
+			}
+			std::cout << std::endl;
+		}
+	}
+
+	void Reset()
+	{
+		std::lock_guard guard{ s_mtx };
+		s_Shaders.clear();
+	}
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+#include "cfgprocessor.h"
+
+// -predict-failures: learns during the build which static define values the failures of a shader come with. Once
+// a few static combos failed with the same errors and share some static define values (the ps20b static combos with
+// FLASHLIGHT=1 going over the instruction limit), the remaining static combos with those values are expected to fail
+// the same way and only a sample of them is compiled. The shader fails either way, what is skipped only shortens its
+// list of errors. A success in a static combo the failures were pinned on drops the prediction.
+namespace FailPredict
+{
+	// Static combos that have to fail the same way before the rest is predicted
+	static constexpr uint32_t MIN_FAILURES = 2;
+	// One in this many predicted static combos is still compiled, to check the prediction and report what it says
+	static constexpr uint64_t SAMPLE_EVERY = 8;
+
+	class CShaderModel;
+
+	void Enable( bool bEnable ) noexcept;
+
+	// Model of the shader, kept for the whole run. nullptr if prediction is off.
+	[[nodiscard]] CShaderModel* Begin( std::string_view szShader );
+
+	// Whether the combos of static combo nStaticCombo are predicted to fail and not part of the sample. The static define
+	// values are command.values past the first nDynamicDefines.
+	[[nodiscard]] bool Skip( CShaderModel& model, uint64_t nStaticCombo, const CfgProcessor::ComboBuildCommand& command, uint32_t nDynamicDefines );
+
+	// Learns from a combo that compiled, szListing is what the compiler said about it if it failed
+	void Record( CShaderModel& model, uint64_t nStaticCombo, const CfgProcessor::ComboBuildCommand& command, uint32_t nDynamicDefines, bool bSucceeded, std::string_view szListing );
+
+	// Prints what was skipped of the shader and why, nothing if none of it was
+	void PrintSkipped( std::string_view szShader );
+
+	// Forgets every shader, for the next build of -watch
+	void Reset();
+}
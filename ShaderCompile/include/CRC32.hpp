@@ -1,5 +1,17 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <cstring>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC32_TARGET_CLMUL
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#define CRC32_TARGET_CLMUL __attribute__( ( target( "pclmul,sse4.1" ) ) )
+#endif
+
 namespace CRC32
 {
 	static constexpr auto CRC32_INIT_VALUE = 0xFFFFFFFFUL;
@@ -80,90 +92,138 @@ namespace CRC32
 		pulCRC = CRC32_INIT_VALUE;
 	}
 
-	static void ProcessBuffer( CRC32_t& pulCRC, const void* pBuffer, size_t nBuffer )
+	// pulCRCTable advanced by 0..7 more zero bytes, for slicing by 8
+	static constexpr auto MakeSliceTables()
 	{
-		CRC32_t ulCrc = pulCRC;
-		const auto* pb = static_cast<const uint8_t*>( pBuffer );
+		std::array<std::array<CRC32_t, NUM_BYTES>, 8> tables{};
+		for ( int i = 0; i < NUM_BYTES; ++i )
+			tables[0][i] = pulCRCTable[i];
+		for ( int k = 1; k < 8; ++k )
+			for ( int i = 0; i < NUM_BYTES; ++i )
+				tables[k][i] = ( tables[k - 1][i] >> 8 ) ^ pulCRCTable[tables[k - 1][i] & 0xFF];
+		return tables;
+	}
+	static constexpr auto pulSliceTables = MakeSliceTables();
 
-	JustAfew:
-		switch ( nBuffer )
+	static CRC32_t ProcessSlicing( CRC32_t ulCrc, const uint8_t* pb, size_t nBuffer )
+	{
+		for ( ; nBuffer >= 8; pb += 8, nBuffer -= 8 )
 		{
-		case 7:
-			ulCrc = pulCRCTable[*pb++ ^ static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			[[fallthrough]];
-
-		case 6:
-			ulCrc = pulCRCTable[*pb++ ^ static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			[[fallthrough]];
+			CRC32_t ulLo, ulHi;
+			memcpy( &ulLo, pb, sizeof( ulLo ) );
+			memcpy( &ulHi, pb + 4, sizeof( ulHi ) );
+			ulLo ^= ulCrc;
+			ulCrc = pulSliceTables[7][ulLo & 0xFF] ^ pulSliceTables[6][( ulLo >> 8 ) & 0xFF] ^ pulSliceTables[5][( ulLo >> 16 ) & 0xFF] ^ pulSliceTables[4][ulLo >> 24]
+				  ^ pulSliceTables[3][ulHi & 0xFF] ^ pulSliceTables[2][( ulHi >> 8 ) & 0xFF] ^ pulSliceTables[1][( ulHi >> 16 ) & 0xFF] ^ pulSliceTables[0][ulHi >> 24];
+		}
 
-		case 5:
+		for ( ; nBuffer; --nBuffer )
 			ulCrc = pulCRCTable[*pb++ ^ static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			[[fallthrough]];
-
-		case 4:
-			ulCrc ^= *reinterpret_cast<const CRC32_t*>( pb );
-			ulCrc = pulCRCTable[static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			ulCrc = pulCRCTable[static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			ulCrc = pulCRCTable[static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			ulCrc = pulCRCTable[static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			pulCRC = ulCrc;
-			return;
-
-		case 3:
-			ulCrc = pulCRCTable[*pb++ ^ static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			[[fallthrough]];
+		return ulCrc;
+	}
 
-		case 2:
-			ulCrc = pulCRCTable[*pb++ ^ static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			[[fallthrough]];
+	// PCLMULQDQ and SSE4.1, checked once
+	static bool HasCarrylessMultiply()
+	{
+		static const bool s_bSupported = []
+		{
+#ifdef _MSC_VER
+			int regs[4];
+			__cpuid( regs, 1 );
+#else
+			unsigned int regs[4]{};
+			__get_cpuid( 1, &regs[0], &regs[1], &regs[2], &regs[3] );
+#endif
+			return ( regs[2] & ( 1 << 1 ) ) && ( regs[2] & ( 1 << 19 ) );
+		}();
+		return s_bSupported;
+	}
 
-		case 1:
-			ulCrc = pulCRCTable[*pb++ ^ static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			[[fallthrough]];
+	// x folded into next with the constants in k. Not a lambda, it wouldn't get the target of the function it is in.
+	CRC32_TARGET_CLMUL static __m128i Fold( __m128i x, __m128i next, __m128i k )
+	{
+		const __m128i lo = _mm_clmulepi64_si128( x, k, 0x00 );
+		return _mm_xor_si128( _mm_xor_si128( _mm_clmulepi64_si128( x, k, 0x11 ), next ), lo );
+	}
 
-		case 0:
-			pulCRC = ulCrc;
-			return;
-		}
+	// Folds 64 bytes at a time with carry-less multiplies, see Intel's "Fast CRC Computation
+	// for Generic Polynomials Using PCLMULQDQ Instruction". nBuffer is a multiple of 16, at least 64.
 
-		// We may need to do some alignment work up front, and at the end, so that
-		// the main loop is aligned and only has to worry about 8 byte at a time.
-		//
-		// The low-order two bits of pb and nBuffer in total control the
-		// upfront work.
-		//
-		const int nFront = gsl::narrow<int>( reinterpret_cast<intptr_t>( pb ) & 3 );
-		nBuffer -= nFront;
-		switch ( nFront )
+	CRC32_TARGET_CLMUL static CRC32_t ProcessCarrylessMultiply( CRC32_t ulCrc, const uint8_t* pb, size_t nBuffer )
+	{
+		alignas( 16 ) static constexpr uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+		alignas( 16 ) static constexpr uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+		alignas( 16 ) static constexpr uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+		alignas( 16 ) static constexpr uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+		__m128i x1 = _mm_loadu_si128( reinterpret_cast<const __m128i*>( pb + 0x00 ) );
+		__m128i x2 = _mm_loadu_si128( reinterpret_cast<const __m128i*>( pb + 0x10 ) );
+		__m128i x3 = _mm_loadu_si128( reinterpret_cast<const __m128i*>( pb + 0x20 ) );
+		__m128i x4 = _mm_loadu_si128( reinterpret_cast<const __m128i*>( pb + 0x30 ) );
+		x1 = _mm_xor_si128( x1, _mm_cvtsi32_si128( static_cast<int>( ulCrc ) ) );
+		pb += 64;
+		nBuffer -= 64;
+
+		// Four lanes in parallel
+		__m128i x0 = _mm_load_si128( reinterpret_cast<const __m128i*>( k1k2 ) );
+		for ( ; nBuffer >= 64; pb += 64, nBuffer -= 64 )
 		{
-		case 3:
-			ulCrc = pulCRCTable[*pb++ ^ static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			[[fallthrough]];
-		case 2:
-			ulCrc = pulCRCTable[*pb++ ^ static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			[[fallthrough]];
-		case 1:
-			ulCrc = pulCRCTable[*pb++ ^ static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
+			const __m128i x5 = _mm_clmulepi64_si128( x1, x0, 0x00 );
+			const __m128i x6 = _mm_clmulepi64_si128( x2, x0, 0x00 );
+			const __m128i x7 = _mm_clmulepi64_si128( x3, x0, 0x00 );
+			const __m128i x8 = _mm_clmulepi64_si128( x4, x0, 0x00 );
+
+			x1 = _mm_clmulepi64_si128( x1, x0, 0x11 );
+			x2 = _mm_clmulepi64_si128( x2, x0, 0x11 );
+			x3 = _mm_clmulepi64_si128( x3, x0, 0x11 );
+			x4 = _mm_clmulepi64_si128( x4, x0, 0x11 );
+
+			x1 = _mm_xor_si128( _mm_xor_si128( x1, x5 ), _mm_loadu_si128( reinterpret_cast<const __m128i*>( pb + 0x00 ) ) );
+			x2 = _mm_xor_si128( _mm_xor_si128( x2, x6 ), _mm_loadu_si128( reinterpret_cast<const __m128i*>( pb + 0x10 ) ) );
+			x3 = _mm_xor_si128( _mm_xor_si128( x3, x7 ), _mm_loadu_si128( reinterpret_cast<const __m128i*>( pb + 0x20 ) ) );
+			x4 = _mm_xor_si128( _mm_xor_si128( x4, x8 ), _mm_loadu_si128( reinterpret_cast<const __m128i*>( pb + 0x30 ) ) );
 		}
 
-		size_t nMain = nBuffer >> 3;
-		while ( nMain-- )
+		// Fold the lanes and the remaining 16 byte blocks into one
+		x0 = _mm_load_si128( reinterpret_cast<const __m128i*>( k3k4 ) );
+		x1 = Fold( x1, x2, x0 );
+		x1 = Fold( x1, x3, x0 );
+		x1 = Fold( x1, x4, x0 );
+		for ( ; nBuffer >= 16; pb += 16, nBuffer -= 16 )
+			x1 = Fold( x1, _mm_loadu_si128( reinterpret_cast<const __m128i*>( pb ) ), x0 );
+
+		// 128 to 64 bits
+		const __m128i mask = _mm_setr_epi32( ~0, 0, ~0, 0 );
+		x2 = _mm_clmulepi64_si128( x1, x0, 0x10 );
+		x1 = _mm_xor_si128( _mm_srli_si128( x1, 8 ), x2 );
+
+		x0 = _mm_loadl_epi64( reinterpret_cast<const __m128i*>( k5k0 ) );
+		x2 = _mm_srli_si128( x1, 4 );
+		x1 = _mm_xor_si128( _mm_clmulepi64_si128( _mm_and_si128( x1, mask ), x0, 0x00 ), x2 );
+
+		// Barrett reduction to 32 bits
+		x0 = _mm_load_si128( reinterpret_cast<const __m128i*>( poly ) );
+		x2 = _mm_clmulepi64_si128( _mm_and_si128( x1, mask ), x0, 0x10 );
+		x2 = _mm_clmulepi64_si128( _mm_and_si128( x2, mask ), x0, 0x00 );
+		x1 = _mm_xor_si128( x1, x2 );
+
+		return static_cast<CRC32_t>( _mm_extract_epi32( x1, 1 ) );
+	}
+
+	static void ProcessBuffer( CRC32_t& pulCRC, const void* pBuffer, size_t nBuffer )
+	{
+		CRC32_t ulCrc = pulCRC;
+		const auto* pb = static_cast<const uint8_t*>( pBuffer );
+
+		if ( nBuffer >= 64 && HasCarrylessMultiply() )
 		{
-			ulCrc ^= ( *reinterpret_cast<const CRC32_t*>( pb ) );
-			ulCrc = pulCRCTable[static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			ulCrc = pulCRCTable[static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			ulCrc = pulCRCTable[static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			ulCrc = pulCRCTable[static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			ulCrc ^= *reinterpret_cast<const CRC32_t*>( pb + 4 );
-			ulCrc = pulCRCTable[static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			ulCrc = pulCRCTable[static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			ulCrc = pulCRCTable[static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			ulCrc = pulCRCTable[static_cast<uint8_t>( ulCrc )] ^ ( ulCrc >> 8 );
-			pb += 8;
+			const size_t nFolded = nBuffer & ~size_t( 15 );
+			ulCrc = ProcessCarrylessMultiply( ulCrc, pb, nFolded );
+			pb += nFolded;
+			nBuffer -= nFolded;
 		}
 
-		nBuffer &= 7;
-		goto JustAfew;
+		pulCRC = ProcessSlicing( ulCrc, pb, nBuffer );
 	}
 
 	static void Final( CRC32_t& pulCRC )
@@ -0,0 +1,166 @@
+#include <fstream>
+#include <mutex>
+
+#include "includegraph.h"
+#include "gsl/narrow"
+#include "robin_hood.h"
+
+namespace fs = std::filesystem;
+
+namespace IncludeGraph
+{
+	static constexpr uint32_t GRAPH_VERSION = 1;
+	static constexpr uint32_t GRAPH_MAGIC   = ( 'G' << 24 ) + ( 'I' << 16 ) + ( 'C' << 8 ) + 'S';
+
+	static fs::path s_File;
+	static std::mutex s_mtx;
+	static robin_hood::unordered_node_map<std::string, std::set<std::string>> s_Files;		// Shader to the files it reads
+	static robin_hood::unordered_node_map<std::string, std::set<std::string>> s_Dependents; // File to the shaders reading it
+	static bool s_bDirty = false;
+
+	template <typename T>
+	static bool ReadValue( std::ifstream& f, T& value )
+	{
+		return static_cast<bool>( f.read( reinterpret_cast<char*>( &value ), sizeof( value ) ) );
+	}
+
+	static bool ReadString( std::ifstream& f, std::string& str )
+	{
+		uint32_t nLen;
+		if ( !ReadValue( f, nLen ) )
+			return false;
+		str.resize( nLen );
+		return static_cast<bool>( f.read( str.data(), nLen ) );
+	}
+
+	template <typename T>
+	static void WriteValue( std::ofstream& f, const T& value )
+	{
+		f.write( reinterpret_cast<const char*>( &value ), sizeof( value ) );
+	}
+
+	static void WriteString( std::ofstream& f, const std::string& str )
+	{
+		WriteValue( f, gsl::narrow<uint32_t>( str.size() ) );
+		f.write( str.data(), str.size() );
+	}
+
+	// Names of the shaders once, then every file with the indices of the shaders that read it
+	void Load( const fs::path& file )
+	{
+		s_File = file;
+
+		std::ifstream f( file, std::ios::binary );
+		uint32_t header[4];
+		if ( !f || !ReadValue( f, header ) || header[0] != GRAPH_MAGIC || header[1] != GRAPH_VERSION )
+			return;
+
+		std::vector<std::string> shaders( header[2] );
+		for ( std::string& shader : shaders )
+		{
+			if ( !ReadString( f, shader ) )
+				return;
+		}
+
+		robin_hood::unordered_node_map<std::string, std::set<std::string>> files, dependents;
+		for ( uint32_t iFile = 0; iFile < header[3]; ++iFile )
+		{
+			std::string name;
+			uint32_t nShaders;
+			if ( !ReadString( f, name ) || !ReadValue( f, nShaders ) )
+				return;
+			std::set<std::string>& readers = dependents[name];
+			for ( uint32_t i = 0; i < nShaders; ++i )
+			{
+				uint32_t iShader;
+				if ( !ReadValue( f, iShader ) || iShader >= shaders.size() )
+					return;
+				readers.insert( shaders[iShader] );
+				files[shaders[iShader]].insert( name );
+			}
+		}
+
+		// All or nothing, a graph that lost some edges would leave shaders out of a rebuild
+		s_Files		 = std::move( files );
+		s_Dependents = std::move( dependents );
+	}
+
+	void Set( const std::string& shader, const std::vector<std::string>& files )
+	{
+		std::set<std::string> newFiles( files.cbegin(), files.cend() );
+		std::lock_guard guard{ s_mtx };
+		std::set<std::string>& oldFiles = s_Files[shader];
+		if ( oldFiles == newFiles )
+			return;
+
+		for ( const std::string& file : oldFiles )
+		{
+			if ( const auto it = s_Dependents.find( file ); it != s_Dependents.end() && it->second.erase( shader ) && it->second.empty() )
+				s_Dependents.erase( it );
+		}
+		for ( const std::string& file : newFiles )
+			s_Dependents[file].insert( shader );
+		oldFiles = std::move( newFiles );
+		s_bDirty = true;
+	}
+
+	bool Knows( const std::string& shader )
+	{
+		std::lock_guard guard{ s_mtx };
+		return s_Files.contains( shader );
+	}
+
+	std::set<std::string> Dependents( const std::vector<std::string>& files )
+	{
+		std::set<std::string> shaders;
+		std::lock_guard guard{ s_mtx };
+		for ( const std::string& file : files )
+		{
+			if ( const auto it = s_Dependents.find( file ); it != s_Dependents.end() )
+				shaders.insert( it->second.cbegin(), it->second.cend() );
+		}
+		return shaders;
+	}
+
+	void Save()
+	{
+		std::lock_guard guard{ s_mtx };
+		if ( s_File.empty() || !s_bDirty )
+			return;
+
+		robin_hood::unordered_flat_map<std::string_view, uint32_t> indices;
+		fs::path tmpPath = s_File;
+		tmpPath += ".tmp";
+		{
+			std::ofstream f( tmpPath, std::ios::binary | std::ios::trunc );
+			const uint32_t header[] = { GRAPH_MAGIC, GRAPH_VERSION, gsl::narrow<uint32_t>( s_Files.size() ), gsl::narrow<uint32_t>( s_Dependents.size() ) };
+			WriteValue( f, header );
+			for ( const auto& [shader, files] : s_Files )
+			{
+				indices.emplace( shader, gsl::narrow<uint32_t>( indices.size() ) );
+				WriteString( f, shader );
+			}
+
+			for ( const auto& [file, shaders] : s_Dependents )
+			{
+				WriteString( f, file );
+				WriteValue( f, gsl::narrow<uint32_t>( shaders.size() ) );
+				for ( const std::string& shader : shaders )
+					WriteValue( f, indices[shader] );
+			}
+
+			if ( !f )
+			{
+				f.close();
+				std::error_code c;
+				fs::remove( tmpPath, c );
+				return;
+			}
+		}
+
+		std::error_code c;
+		fs::rename( tmpPath, s_File, c );
+		if ( !c )
+			s_bDirty = false;
+	}
+}
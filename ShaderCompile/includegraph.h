@@ -0,0 +1,27 @@
+#pragma once
+
+#include <filesystem>
+#include <set>
+#include <string>
+#include <vector>
+
+// Which shaders read which files, kept from one run to the next as the reverse graph (file to the shaders that read it)
+// so that a changed header tells what needs rebuilding without reading any shader again
+namespace IncludeGraph
+{
+	// Reads the graph of the last run, a missing or broken file just means nothing is known
+	void Load( const std::filesystem::path& file );
+
+	// The files the shader (by its vcs name) read this time, its own source among them, replace what it read before.
+	// Safe to call from several threads.
+	void Set( const std::string& shader, const std::vector<std::string>& files );
+
+	// Whether the graph knows what the shader reads
+	[[nodiscard]] bool Knows( const std::string& shader );
+
+	// Shaders that read any of the files, relative to the shader path with forward slashes
+	[[nodiscard]] std::set<std::string> Dependents( const std::vector<std::string>& files );
+
+	// Writes the graph back if anything changed since it was loaded
+	void Save();
+}
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "latency.h"
+#include "termcolor/style.hpp"
+#include "termcolors.hpp"
+#include "strmanip.hpp"
+
+using namespace std::literals;
+
+namespace Latency
+{
+	uint64_t CHistogram::Count() const noexcept
+	{
+		uint64_t nCount = 0;
+		for ( const std::atomic<uint32_t>& nBucket : m_nBuckets )
+			nCount += nBucket.load( std::memory_order_relaxed );
+		return nCount;
+	}
+
+	uint64_t CHistogram::UpperOf( uint32_t iBucket ) noexcept
+	{
+		if ( iBucket < EXACT )
+			return iBucket;
+		const uint32_t nExponent = ( iBucket - EXACT ) / ( 1 << SUB_BITS ) + SUB_BITS + 1;
+		const uint64_t nSub		 = ( iBucket - EXACT ) % ( 1 << SUB_BITS );
+		return ( ( ( 1ULL << SUB_BITS ) + nSub + 1 ) << ( nExponent - SUB_BITS ) ) - 1;
+	}
+
+	uint64_t CHistogram::Percentile( uint32_t nPercent ) const noexcept
+	{
+		const uint64_t nCount = Count();
+		if ( !nCount )
+			return 0;
+
+		const uint64_t nRank = std::max<uint64_t>( ( nCount * nPercent + 99 ) / 100, 1 );
+		uint64_t nSeen		 = 0;
+		for ( uint32_t i = 0; i < NUM_BUCKETS; ++i )
+		{
+			nSeen += m_nBuckets[i].load( std::memory_order_relaxed );
+			if ( nSeen >= nRank )
+				return std::min( UpperOf( i ), Max() );
+		}
+		return Max();
+	}
+
+	struct Slow_t
+	{
+		uint64_t m_nMicroseconds;
+		std::string_view m_szShader;
+		std::string m_Command;
+
+		bool operator<( const Slow_t& other ) const noexcept { return m_nMicroseconds > other.m_nMicroseconds; }
+	};
+
+	static uint32_t s_nSlowest = 0;
+	static std::mutex s_mtxSlowest;
+	static std::vector<Slow_t> s_Slowest; // Heap with the fastest of them in front once it is full
+	static std::atomic<uint64_t> s_nThreshold;
+
+	void Initialize( uint32_t nSlowest ) noexcept
+	{
+		s_nSlowest = nSlowest;
+	}
+
+	bool Enabled() noexcept
+	{
+		return s_nSlowest != 0;
+	}
+
+	bool IsSlowest( uint64_t nMicroseconds ) noexcept
+	{
+		return s_nSlowest && nMicroseconds > s_nThreshold.load( std::memory_order_relaxed );
+	}
+
+	void AddSlowest( std::string_view szShader, uint64_t nMicroseconds, std::string_view command )
+	{
+		std::lock_guard guard{ s_mtxSlowest };
+		if ( s_Slowest.size() == s_nSlowest )
+		{
+			if ( nMicroseconds <= s_Slowest.front().m_nMicroseconds )
+				return;
+			std::pop_heap( s_Slowest.begin(), s_Slowest.end() );
+			s_Slowest.pop_back();
+		}
+		s_Slowest.emplace_back( Slow_t{ nMicroseconds, szShader, std::string( command ) } );
+		std::push_heap( s_Slowest.begin(), s_Slowest.end() );
+		if ( s_Slowest.size() == s_nSlowest )
+			s_nThreshold.store( s_Slowest.front().m_nMicroseconds, std::memory_order_relaxed );
+	}
+
+	std::string Describe( const CHistogram& histogram )
+	{
+		const bool bMilliseconds = histogram.Max() >= 10'000;
+		const auto& Format		 = [bMilliseconds]( uint64_t nMicroseconds )
+		{
+			return bMilliseconds ? std::to_string( ( nMicroseconds + 500 ) / 1000 ) : std::to_string( nMicroseconds );
+		};
+		return "p50 "s + Format( histogram.Percentile( 50 ) ) + ", p90 "s + Format( histogram.Percentile( 90 ) ) + ", p99 "s + Format( histogram.Percentile( 99 ) ) + ", max "s
+			   + Format( histogram.Max() ) + ( bMilliseconds ? " ms"s : " us"s );
+	}
+
+	void PrintSlowest()
+	{
+		std::lock_guard guard{ s_mtxSlowest };
+		if ( s_Slowest.empty() )
+			return;
+
+		std::sort_heap( s_Slowest.begin(), s_Slowest.end() );
+		std::cout << "Slowest compiles:"sv << std::endl;
+		for ( const Slow_t& slow : s_Slowest )
+			std::cout << "  "sv << clr::green << PrettyPrint( ( slow.m_nMicroseconds + 500 ) / 1000 ) << clr::reset << " ms "sv << slow.m_szShader << ": "sv << slow.m_Command << std::endl;
+		s_Slowest.clear();
+		s_nThreshold.store( 0, std::memory_order_relaxed );
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// -latency: how compile and packing times of every shader and the waits for the locks are spread, and the slowest
+// combos of the build. An average hides the few combos that keep a shader going long after the rest is done.
+namespace Latency
+{
+	// Microseconds in buckets within 1/8 of the value, exact below 16. Adding takes no lock, a compile or a static combo
+	// takes far longer than the add, the workers don't get in each other's way.
+	class CHistogram
+	{
+	public:
+		void Add( uint64_t nMicroseconds ) noexcept
+		{
+			m_nBuckets[BucketOf( nMicroseconds )].fetch_add( 1, std::memory_order_relaxed );
+			for ( uint64_t nMax = m_nMax.load( std::memory_order_relaxed ); nMicroseconds > nMax && !m_nMax.compare_exchange_weak( nMax, nMicroseconds, std::memory_order_relaxed ); )
+				continue;
+		}
+
+		[[nodiscard]] uint64_t Count() const noexcept;
+		[[nodiscard]] uint64_t Max() const noexcept { return m_nMax.load( std::memory_order_relaxed ); }
+		// The most a bucket holds that nPercent of the values are in or below, never more than Max
+		[[nodiscard]] uint64_t Percentile( uint32_t nPercent ) const noexcept;
+
+	private:
+		static constexpr uint32_t SUB_BITS	  = 3;
+		static constexpr uint32_t EXACT		  = 2 << SUB_BITS;
+		static constexpr uint32_t MAX_BITS	  = 40;
+		static constexpr uint32_t NUM_BUCKETS = EXACT + ( MAX_BITS - SUB_BITS - 1 ) * ( 1 << SUB_BITS );
+
+		[[nodiscard]] static uint32_t BucketOf( uint64_t nValue ) noexcept
+		{
+			if ( nValue < EXACT )
+				return static_cast<uint32_t>( nValue );
+			const uint32_t nExponent = std::min<uint32_t>( std::bit_width( nValue ) - 1, MAX_BITS - 1 );
+			const uint32_t nSub		 = static_cast<uint32_t>( nValue >> ( nExponent - SUB_BITS ) ) & ( ( 1 << SUB_BITS ) - 1 );
+			return EXACT + ( nExponent - SUB_BITS - 1 ) * ( 1 << SUB_BITS ) + nSub;
+		}
+
+		[[nodiscard]] static uint64_t UpperOf( uint32_t iBucket ) noexcept;
+
+		std::atomic<uint32_t> m_nBuckets[NUM_BUCKETS] = {};
+		std::atomic<uint64_t> m_nMax = 0;
+	};
+
+	// Keeps the nSlowest slowest compiles, 0 leaves all of -latency off
+	void Initialize( uint32_t nSlowest ) noexcept;
+	[[nodiscard]] bool Enabled() noexcept;
+
+	// Cheap enough for every compile, only the ones it is true for have to format their command for AddSlowest
+	[[nodiscard]] bool IsSlowest( uint64_t nMicroseconds ) noexcept;
+	void AddSlowest( std::string_view szShader, uint64_t nMicroseconds, std::string_view command );
+
+	// p50, p90, p99 and max, in ms once the max is past 10 ms and in µs before that
+	[[nodiscard]] std::string Describe( const CHistogram& histogram );
+	// Slowest first
+	void PrintSlowest();
+}
@@ -0,0 +1,79 @@
+#include <atomic>
+
+#include "memorybudget.h"
+
+namespace MemoryBudget
+{
+	static uint64_t s_nLimit = 0;
+	static std::atomic<uint64_t> s_nHeld;
+	static std::atomic<uint64_t> s_nPeak;
+	static std::atomic<uint64_t> s_nRecentPeak;
+	static std::atomic<uint64_t> s_nStoreHeld[static_cast<size_t>( Store::Count )];
+	static std::atomic<uint64_t> s_nStorePeak[static_cast<size_t>( Store::Count )];
+
+	static void RaisePeak( std::atomic<uint64_t>& rnPeak, uint64_t nHeld ) noexcept
+	{
+		for ( uint64_t nPeak = rnPeak.load( std::memory_order_relaxed ); nHeld > nPeak && !rnPeak.compare_exchange_weak( nPeak, nHeld, std::memory_order_relaxed ); )
+			continue;
+	}
+
+	void SetLimit( uint64_t nBytes ) noexcept
+	{
+		s_nLimit = nBytes;
+	}
+
+	uint64_t Limit() noexcept
+	{
+		return s_nLimit;
+	}
+
+	void Add( size_t nBytes, Store store ) noexcept
+	{
+		const uint64_t nHeld = s_nHeld.fetch_add( nBytes, std::memory_order_relaxed ) + nBytes;
+		RaisePeak( s_nPeak, nHeld );
+		RaisePeak( s_nRecentPeak, nHeld );
+		const size_t i = static_cast<size_t>( store );
+		RaisePeak( s_nStorePeak[i], s_nStoreHeld[i].fetch_add( nBytes, std::memory_order_relaxed ) + nBytes );
+	}
+
+	void Release( size_t nBytes, Store store ) noexcept
+	{
+		s_nHeld.fetch_sub( nBytes, std::memory_order_relaxed );
+		s_nStoreHeld[static_cast<size_t>( store )].fetch_sub( nBytes, std::memory_order_relaxed );
+	}
+
+	uint64_t Held() noexcept
+	{
+		return s_nHeld.load( std::memory_order_relaxed );
+	}
+
+	uint64_t Peak() noexcept
+	{
+		return s_nPeak.load( std::memory_order_relaxed );
+	}
+
+	uint64_t Held( Store store ) noexcept
+	{
+		return s_nStoreHeld[static_cast<size_t>( store )].load( std::memory_order_relaxed );
+	}
+
+	uint64_t Peak( Store store ) noexcept
+	{
+		return s_nStorePeak[static_cast<size_t>( store )].load( std::memory_order_relaxed );
+	}
+
+	uint64_t TakeRecentPeak() noexcept
+	{
+		return s_nRecentPeak.exchange( Held(), std::memory_order_relaxed );
+	}
+
+	bool NearLimit() noexcept
+	{
+		return s_nLimit && Held() >= s_nLimit / 4 * 3;
+	}
+
+	bool OverLimit() noexcept
+	{
+		return s_nLimit && Held() >= s_nLimit;
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+// -max-memory: accounts the compiled code held between the compiler and the vcs file, the bytecode chunks of the
+// workers and the packed static combos. Past 3/4 of the limit packed static combos go to the spill file,
+// past the limit all workers but one stop claiming commands until enough of it is packed and written.
+namespace MemoryBudget
+{
+	// Where accounted code is held, the budget is their sum
+	enum class Store : uint32_t
+	{
+		ByteCode, // Chunks of the workers, from the compiler until the static combo is packed
+		Packed,	  // Packed static combos until their shader is written
+		Count
+	};
+
+	// 0 turns the limit off, the code is still accounted
+	void SetLimit( uint64_t nBytes ) noexcept;
+	[[nodiscard]] uint64_t Limit() noexcept;
+
+	void Add( size_t nBytes, Store store ) noexcept;
+	void Release( size_t nBytes, Store store ) noexcept;
+
+	[[nodiscard]] uint64_t Held() noexcept;
+	[[nodiscard]] uint64_t Peak() noexcept;
+	[[nodiscard]] uint64_t Held( Store store ) noexcept;
+	[[nodiscard]] uint64_t Peak( Store store ) noexcept;
+	// Most held since the last call, then starts over from what is held now. -memory-stats takes it whenever a shader
+	// is written, for what was held while it was being finished.
+	[[nodiscard]] uint64_t TakeRecentPeak() noexcept;
+
+	[[nodiscard]] bool NearLimit() noexcept;
+	[[nodiscard]] bool OverLimit() noexcept;
+
+	// Deleter of accounted arrays
+	struct CDelete
+	{
+		size_t m_nBytes;
+		Store m_Store;
+
+		void operator()( uint8_t* p ) const noexcept
+		{
+			delete[] p;
+			Release( m_nBytes, m_Store );
+		}
+	};
+
+	// Blocks while over the limit, memory is given back from everywhere so it is polled. fnStop ends the wait early.
+	template <typename TFn>
+	void WaitBelowLimit( TFn&& fnStop )
+	{
+		using namespace std::chrono_literals;
+		while ( OverLimit() && !fnStop() )
+			std::this_thread::sleep_for( 10ms );
+	}
+}
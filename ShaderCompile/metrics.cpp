@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+#include "platform.h"
+
+namespace fs	 = std::filesystem;
+namespace chrono = std::chrono;
+using namespace std::literals;
+
+namespace Metrics
+{
+	struct Metric_t
+	{
+		const char* m_szName;
+		const char* m_szHelp;
+		const char* m_szType;
+		std::function<double()> m_fnValue;
+	};
+
+	struct Phase_t
+	{
+		const char* m_szName;
+		double m_flSeconds;
+	};
+
+	static fs::path s_Path;
+	static chrono::seconds s_Interval;
+	static std::vector<Metric_t> s_Metrics;
+
+	static std::mutex s_mtxPhases;
+	static std::vector<Phase_t> s_Phases; // In the order they were first entered
+	static size_t s_iPhase = 0;
+	static chrono::steady_clock::time_point s_tPhase;
+
+	static std::mutex s_mtxThread;
+	static std::condition_variable s_cvThread;
+	static std::thread s_Thread;
+	static bool s_bStopping = false;
+
+	void Initialize( const fs::path& path, uint32_t nIntervalSeconds )
+	{
+		s_Path	   = path;
+		s_Interval = chrono::seconds( std::max( nIntervalSeconds, 1U ) );
+	}
+
+	bool Enabled() noexcept
+	{
+		return !s_Path.empty();
+	}
+
+	void AddCounter( const char* szName, const char* szHelp, std::function<double()> fn )
+	{
+		s_Metrics.emplace_back( Metric_t{ szName, szHelp, "counter", std::move( fn ) } );
+	}
+
+	void AddGauge( const char* szName, const char* szHelp, std::function<double()> fn )
+	{
+		s_Metrics.emplace_back( Metric_t{ szName, szHelp, "gauge", std::move( fn ) } );
+	}
+
+	void EnterPhase( const char* szPhase )
+	{
+		std::lock_guard guard{ s_mtxPhases };
+		const chrono::steady_clock::time_point tNow = chrono::steady_clock::now();
+		if ( !s_Phases.empty() )
+			s_Phases[s_iPhase].m_flSeconds += chrono::duration<double>( tNow - s_tPhase ).count();
+		s_tPhase = tNow;
+
+		for ( s_iPhase = 0; s_iPhase < s_Phases.size() && std::string_view( s_Phases[s_iPhase].m_szName ) != szPhase; )
+			++s_iPhase;
+		if ( s_iPhase == s_Phases.size() )
+			s_Phases.emplace_back( Phase_t{ szPhase, 0.0 } );
+	}
+
+	static void WriteValue( std::ostream& out, std::string_view name, double flValue )
+	{
+		char buf[32];
+		snprintf( buf, sizeof( buf ), "%.17g", flValue );
+		out << name << ' ' << buf << '\n';
+	}
+
+	// The textfile collector may read at any time, so the file is written next to it and renamed over it
+	static void Write()
+	{
+		fs::path tmpPath = s_Path;
+		tmpPath += ".tmp";
+		bool bWritten;
+		{
+			std::ofstream out( tmpPath, std::ios::trunc );
+			std::string_view lastName;
+			for ( const Metric_t& metric : s_Metrics )
+			{
+				const std::string_view fullName = metric.m_szName;
+				const std::string_view name		= fullName.substr( 0, fullName.find( '{' ) );
+				if ( name != lastName )
+					out << "# HELP "sv << name << ' ' << metric.m_szHelp << "\n# TYPE "sv << name << ' ' << metric.m_szType << '\n';
+				lastName = name;
+				WriteValue( out, fullName, metric.m_fnValue() );
+			}
+
+			// The phase going on counts up to now
+			std::lock_guard guard{ s_mtxPhases };
+			if ( !s_Phases.empty() )
+				out << "# HELP shadercompile_phase_seconds_total Time spent in every phase of the build\n# TYPE shadercompile_phase_seconds_total counter\n"sv;
+			const chrono::steady_clock::time_point tNow = chrono::steady_clock::now();
+			for ( size_t i = 0; i < s_Phases.size(); ++i )
+			{
+				const double flSeconds = s_Phases[i].m_flSeconds + ( i == s_iPhase ? chrono::duration<double>( tNow - s_tPhase ).count() : 0.0 );
+				WriteValue( out, "shadercompile_phase_seconds_total{phase=\""s + s_Phases[i].m_szName + "\"}", flSeconds );
+			}
+			bWritten = static_cast<bool>( out );
+		}
+		if ( !bWritten || !Platform::RenameOver( tmpPath, s_Path ) )
+		{
+			std::error_code c;
+			fs::remove( tmpPath, c );
+		}
+	}
+
+	static void MetricsThread()
+	{
+		std::unique_lock guard{ s_mtxThread };
+		while ( !s_cvThread.wait_for( guard, s_Interval, [] { return s_bStopping; } ) )
+		{
+			guard.unlock();
+			Write();
+			guard.lock();
+		}
+	}
+
+	void Start()
+	{
+		if ( Enabled() && !s_Thread.joinable() )
+			s_Thread = std::thread( MetricsThread );
+	}
+
+	void Finish()
+	{
+		if ( !s_Thread.joinable() )
+			return;
+		{
+			std::lock_guard guard{ s_mtxThread };
+			s_bStopping = true;
+		}
+		s_cvThread.notify_one();
+		s_Thread.join();
+		s_bStopping = false;
+		Write();
+	}
+}
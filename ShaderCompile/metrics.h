@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string_view>
+
+// -metrics: the counters of the build as a Prometheus text file, for the textfile collector of node_exporter, so a farm
+// of build machines can be watched from one dashboard. A thread of its own reads them every interval and replaces the
+// file in one step, the workers never wait for it.
+namespace Metrics
+{
+	// Empty path leaves it off
+	void Initialize( const std::filesystem::path& path, uint32_t nIntervalSeconds );
+	[[nodiscard]] bool Enabled() noexcept;
+
+	// szName may carry labels, name{label="value"}. Metrics of one name have to be added one after the other, they share
+	// the help. fn runs on the metrics thread while the build goes on, it may only read atomics and the like.
+	// Add them all before Start.
+	void AddCounter( const char* szName, const char* szHelp, std::function<double()> fn );
+	void AddGauge( const char* szName, const char* szHelp, std::function<double()> fn );
+
+	// From now on the time counts towards szPhase, a literal, until the next phase
+	void EnterPhase( const char* szPhase );
+
+	void Start();
+	// Writes the file a last time and stops the thread
+	void Finish();
+}
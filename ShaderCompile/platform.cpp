@@ -0,0 +1,718 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOWINRES
+#define NOSERVICE
+#define NOMCX
+#define NOIME
+#define NOMINMAX
+
+#include <windows.h>
+#include <psapi.h>
+#include "DbgHelp.h"
+#else
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <link.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#endif
+#include <algorithm>
+#include <bit>
+#include <ctime>
+#include <thread>
+#include <vector>
+
+#include "platform.h"
+
+namespace fs = std::filesystem;
+
+#ifdef _WIN32
+#pragma comment( lib, "DbgHelp" )
+
+namespace Platform
+{
+	static LONG WINAPI ExceptionFilter( _EXCEPTION_POINTERS* pExceptionInfo )
+	{
+		constexpr const auto iType = static_cast<MINIDUMP_TYPE>( MiniDumpNormal | MiniDumpWithDataSegs | MiniDumpWithIndirectlyReferencedMemory | MiniDumpWithThreadInfo );
+
+		// create a unique filename for the minidump based on the current time and module name
+		time_t currTime = time( nullptr );
+		struct tm pTime;
+		localtime_s( &pTime, &currTime );
+
+		// strip off the rest of the path from the .exe name
+		char rgchModuleName[MAX_PATH];
+		::GetModuleFileName( nullptr, rgchModuleName, std::size( rgchModuleName ) );
+		char* pch1 = strchr( rgchModuleName, '.' );
+		if ( pch1 )
+			*pch1 = 0;
+		const char* pch = strchr( rgchModuleName, '\\' );
+		if ( pch )
+			// move past the last slash
+			pch++;
+		else
+			pch = "unknown";
+
+		// can't use the normal string functions since we're in tier0
+		char rgchFileName[MAX_PATH];
+		_snprintf_s( rgchFileName, std::size( rgchFileName ),
+			"%s_%d%.2d%2d%.2d%.2d%.2d.mdmp",
+			pch,
+			pTime.tm_year + 1900,	/* Year less 2000 */
+			pTime.tm_mon + 1,		/* month (0 - 11 : 0 = January) */
+			pTime.tm_mday,			/* day of month (1 - 31) */
+			pTime.tm_hour,			/* hour (0 - 23) */
+			pTime.tm_min,			/* minutes (0 - 59) */
+			pTime.tm_sec			/* seconds (0 - 59) */
+			);
+
+		BOOL bMinidumpResult = FALSE;
+		const HANDLE hFile = ::CreateFile( rgchFileName, GENERIC_WRITE, FILE_SHARE_WRITE, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr );
+
+		if ( hFile )
+		{
+			// dump the exception information into the file
+			MINIDUMP_EXCEPTION_INFORMATION ExInfo;
+			ExInfo.ThreadId = GetCurrentThreadId();
+			ExInfo.ExceptionPointers = pExceptionInfo;
+			ExInfo.ClientPointers = FALSE;
+
+			bMinidumpResult = MiniDumpWriteDump( ::GetCurrentProcess(), ::GetCurrentProcessId(), hFile, iType, &ExInfo, nullptr, nullptr );
+			CloseHandle( hFile );
+		}
+
+		// mark any failed minidump writes by renaming them
+		if ( !bMinidumpResult )
+		{
+			char rgchFailedFileName[_MAX_PATH];
+			_snprintf_s( rgchFailedFileName, std::size( rgchFailedFileName ), "failed_%s", rgchFileName );
+			std::error_code c;
+			fs::rename( rgchFileName, rgchFailedFileName, c );
+		}
+
+		return EXCEPTION_CONTINUE_SEARCH;
+	}
+
+	void InstallCrashHandler()
+	{
+		SetUnhandledExceptionFilter( ExceptionFilter );
+	}
+
+	static void ( *s_pfnInterrupt )();
+
+	static BOOL WINAPI CtrlHandler( DWORD signal )
+	{
+		if ( signal == CTRL_C_EVENT && s_pfnInterrupt )
+			s_pfnInterrupt();
+		return FALSE;
+	}
+
+	void SetInterruptHandler( void ( *pfnHandler )() )
+	{
+		s_pfnInterrupt = pfnHandler;
+		SetConsoleCtrlHandler( CtrlHandler, true );
+	}
+
+	bool EnableTerminalColors()
+	{
+		const HANDLE console = GetStdHandle( STD_OUTPUT_HANDLE );
+		DWORD mode;
+		GetConsoleMode( console, &mode );
+		return SetConsoleMode( console, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING );
+	}
+
+	uint32_t ConsoleWidth()
+	{
+		CONSOLE_SCREEN_BUFFER_INFO csbi;
+		if ( !GetConsoleScreenBufferInfo( GetStdHandle( STD_OUTPUT_HANDLE ), &csbi ) )
+			return 80;
+		return csbi.srWindow.Right - csbi.srWindow.Left + 1;
+	}
+
+	void KeepAwake( bool bAwake )
+	{
+		SetThreadExecutionState( bAwake ? ES_CONTINUOUS | ES_SYSTEM_REQUIRED : ES_CONTINUOUS );
+	}
+
+	void LowerProcessPriority()
+	{
+		SetPriorityClass( GetCurrentProcess(), BELOW_NORMAL_PRIORITY_CLASS );
+	}
+
+	void SetThreadBackground()
+	{
+		SetThreadPriority( GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN );
+	}
+
+	// hardware_concurrency only sees the group of the process
+	uint32_t NumLogicalProcessors()
+	{
+		const DWORD nProcessors = GetActiveProcessorCount( ALL_PROCESSOR_GROUPS );
+		return nProcessors ? nProcessors : std::thread::hardware_concurrency();
+	}
+
+	// Windows keeps every thread in the processor group of its process, at most 64 logical processors.
+	// Workers are spread over the NUMA nodes in proportion to their processors and stay there,
+	// so they reach every group and their bytecode arenas are allocated on their own node.
+	void AssignThreadToNode( uint32_t iWorker, uint32_t nWorkers )
+	{
+		static const std::vector<GROUP_AFFINITY> s_arrNodes = []
+		{
+			std::vector<GROUP_AFFINITY> arrNodes;
+			ULONG nHighestNode = 0;
+			if ( !GetNumaHighestNodeNumber( &nHighestNode ) )
+				return arrNodes;
+			for ( USHORT iNode = 0; iNode <= nHighestNode; ++iNode )
+			{
+				GROUP_AFFINITY affinity{};
+				if ( GetNumaNodeProcessorMaskEx( iNode, &affinity ) && affinity.Mask )
+					arrNodes.emplace_back( affinity );
+			}
+			return arrNodes;
+		}();
+
+		if ( s_arrNodes.size() < 2 )
+			return;
+
+		uint64_t nProcessors = 0;
+		for ( const GROUP_AFFINITY& node : s_arrNodes )
+			nProcessors += std::popcount( static_cast<uint64_t>( node.Mask ) );
+
+		// The node the share of processors of this worker falls into
+		const uint64_t nSlot = static_cast<uint64_t>( iWorker ) * nProcessors / std::max( nWorkers, 1U );
+		uint64_t nBefore     = 0;
+		for ( const GROUP_AFFINITY& node : s_arrNodes )
+		{
+			nBefore += std::popcount( static_cast<uint64_t>( node.Mask ) );
+			if ( nSlot < nBefore || &node == &s_arrNodes.back() )
+			{
+				SetThreadGroupAffinity( GetCurrentThread(), &node, nullptr );
+				return;
+			}
+		}
+	}
+
+	[[nodiscard]] static uint64_t Ticks( const FILETIME& ft ) noexcept
+	{
+		return ( static_cast<uint64_t>( ft.dwHighDateTime ) << 32 ) | ft.dwLowDateTime;
+	}
+
+	bool GetCpuTimes( CpuTimes_t& times )
+	{
+		FILETIME idle, kernel, user, created, exited, ownKernel, ownUser;
+		if ( !GetSystemTimes( &idle, &kernel, &user ) || !GetProcessTimes( GetCurrentProcess(), &created, &exited, &ownKernel, &ownUser ) )
+			return false;
+
+		// Kernel time includes the idle time
+		times = { Ticks( kernel ) + Ticks( user ), Ticks( idle ), Ticks( ownKernel ) + Ticks( ownUser ) };
+		return true;
+	}
+
+	uint32_t MemoryLoad()
+	{
+		MEMORYSTATUSEX memory{};
+		memory.dwLength = sizeof( memory );
+		return GlobalMemoryStatusEx( &memory ) ? memory.dwMemoryLoad : 0;
+	}
+
+	uint64_t PeakMemory()
+	{
+		PROCESS_MEMORY_COUNTERS memory{};
+		GetProcessMemoryInfo( GetCurrentProcess(), &memory, sizeof( memory ) );
+		return memory.PeakWorkingSetSize;
+	}
+
+	uint32_t ProcessId()
+	{
+		return GetCurrentProcessId();
+	}
+
+	std::string MachineName()
+	{
+		char szName[MAX_COMPUTERNAME_LENGTH + 1];
+		DWORD nSize = sizeof( szName );
+		return GetComputerNameA( szName, &nSize ) ? std::string( szName, nSize ) : std::string();
+	}
+
+	fs::path ExecutablePath()
+	{
+		wchar_t szExe[MAX_PATH];
+		return GetModuleFileNameW( nullptr, szExe, MAX_PATH ) ? fs::path( szExe ) : fs::path();
+	}
+
+	void* OpenLibrary( const char* szName )
+	{
+		return LoadLibraryA( szName );
+	}
+
+	void* FindSymbol( void* pLibrary, const char* szName )
+	{
+		return reinterpret_cast<void*>( GetProcAddress( static_cast<HMODULE>( pLibrary ), szName ) );
+	}
+
+	fs::path LibraryPath( void* pLibrary )
+	{
+		wchar_t szLibrary[MAX_PATH];
+		return GetModuleFileNameW( static_cast<HMODULE>( pLibrary ), szLibrary, MAX_PATH ) ? fs::path( szLibrary ) : fs::path();
+	}
+
+	void* CreateSequentialFile( const fs::path& path )
+	{
+		const HANDLE hFile = CreateFileW( path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+		return hFile != INVALID_HANDLE_VALUE ? hFile : nullptr;
+	}
+
+	bool WriteToFile( void* hFile, const void* pData, size_t nSize )
+	{
+		const auto* p = static_cast<const uint8_t*>( pData );
+		while ( nSize )
+		{
+			DWORD nChunkWritten = 0;
+			const DWORD nChunk = static_cast<DWORD>( std::min<size_t>( nSize, 1U << 30 ) );
+			if ( !WriteFile( hFile, p, nChunk, &nChunkWritten, nullptr ) || nChunkWritten != nChunk )
+				return false;
+			p += nChunk;
+			nSize -= nChunk;
+		}
+		return true;
+	}
+
+	void CloseFile( void* hFile )
+	{
+		CloseHandle( hFile );
+	}
+
+	bool RenameOver( const fs::path& from, const fs::path& to )
+	{
+		return MoveFileExW( from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH );
+	}
+
+	CMappedFile::CMappedFile( const fs::path& path )
+	{
+		const HANDLE hFile = CreateFileW( path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+		if ( hFile == INVALID_HANDLE_VALUE )
+			return;
+
+		// The view keeps the file and the mapping open
+		LARGE_INTEGER size;
+		if ( GetFileSizeEx( hFile, &size ) && size.QuadPart )
+		{
+			if ( const HANDLE hMapping = CreateFileMappingW( hFile, nullptr, PAGE_READONLY, 0, 0, nullptr ) )
+			{
+				m_pData = static_cast<const uint8_t*>( MapViewOfFile( hMapping, FILE_MAP_READ, 0, 0, 0 ) );
+				CloseHandle( hMapping );
+			}
+			if ( m_pData )
+				m_nSize = static_cast<size_t>( size.QuadPart );
+		}
+		CloseHandle( hFile );
+	}
+
+	CMappedFile::~CMappedFile()
+	{
+		if ( m_pData )
+			UnmapViewOfFile( m_pData );
+	}
+
+	struct CDirectoryWatch::Impl
+	{
+		HANDLE m_hDirectory = INVALID_HANDLE_VALUE;
+		OVERLAPPED m_Overlapped{};
+		bool m_bPending = false;
+		alignas( DWORD ) uint8_t m_Buffer[64 * 1024];
+
+		~Impl()
+		{
+			if ( m_bPending )
+			{
+				DWORD nBytes;
+				CancelIoEx( m_hDirectory, &m_Overlapped );
+				GetOverlappedResult( m_hDirectory, &m_Overlapped, &nBytes, TRUE );
+			}
+			if ( m_hDirectory != INVALID_HANDLE_VALUE )
+				CloseHandle( m_hDirectory );
+			if ( m_Overlapped.hEvent )
+				CloseHandle( m_Overlapped.hEvent );
+		}
+
+		bool Read()
+		{
+			m_bPending = ReadDirectoryChangesW( m_hDirectory, m_Buffer, sizeof( m_Buffer ), TRUE,
+												FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE,
+												nullptr, &m_Overlapped, nullptr );
+			return m_bPending;
+		}
+	};
+
+	CDirectoryWatch::CDirectoryWatch( const fs::path& dir )
+		: m_pImpl( std::make_unique<Impl>() )
+	{
+		m_pImpl->m_hDirectory = CreateFileW( dir.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+											 FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr );
+		m_pImpl->m_Overlapped.hEvent = CreateEventW( nullptr, TRUE, FALSE, nullptr );
+		if ( m_pImpl->m_hDirectory == INVALID_HANDLE_VALUE || !m_pImpl->m_Overlapped.hEvent || !m_pImpl->Read() )
+			m_pImpl.reset();
+	}
+
+	CDirectoryWatch::~CDirectoryWatch() = default;
+
+	bool CDirectoryWatch::Wait( uint32_t nTimeoutMs, std::vector<std::string>& changed )
+	{
+		if ( !m_pImpl )
+			return false;
+		const DWORD nWait = WaitForSingleObject( m_pImpl->m_Overlapped.hEvent, nTimeoutMs == UINT32_MAX ? INFINITE : nTimeoutMs );
+		if ( nWait == WAIT_TIMEOUT )
+			return true;
+
+		DWORD nBytes = 0;
+		if ( nWait != WAIT_OBJECT_0 || !GetOverlappedResult( m_pImpl->m_hDirectory, &m_pImpl->m_Overlapped, &nBytes, FALSE ) )
+			return false;
+		m_pImpl->m_bPending = false;
+		ResetEvent( m_pImpl->m_Overlapped.hEvent );
+
+		// Nothing came back if more changed than the buffer holds
+		if ( !nBytes )
+			changed.emplace_back();
+		for ( DWORD nOffset = 0; nBytes; )
+		{
+			const auto pInfo = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>( m_pImpl->m_Buffer + nOffset );
+			changed.emplace_back( fs::path( std::wstring_view( pInfo->FileName, pInfo->FileNameLength / sizeof( WCHAR ) ) ).generic_string() );
+			if ( !pInfo->NextEntryOffset )
+				break;
+			nOffset += pInfo->NextEntryOffset;
+		}
+		return m_pImpl->Read();
+	}
+}
+#else
+namespace Platform
+{
+	// Only async signal safe calls in here, then the default action dumps core
+	static void CrashHandler( int signal )
+	{
+		char message[64];
+		const int nLength = snprintf( message, sizeof( message ), "\nShaderCompile crashed with signal %d\n", signal );
+		if ( nLength > 0 )
+		{
+			[[maybe_unused]] const ssize_t nWritten = write( STDERR_FILENO, message, static_cast<size_t>( nLength ) );
+		}
+		raise( signal );
+	}
+
+	void InstallCrashHandler()
+	{
+		struct sigaction action{};
+		action.sa_handler = CrashHandler;
+		action.sa_flags	  = SA_RESETHAND;
+		sigemptyset( &action.sa_mask );
+		for ( const int signal : { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT } )
+			sigaction( signal, &action, nullptr );
+	}
+
+	// Every thread started after this leaves SIGINT to a thread of its own,
+	// which can run the handler like the console control thread of Windows does
+	void SetInterruptHandler( void ( *pfnHandler )() )
+	{
+		sigset_t set;
+		sigemptyset( &set );
+		sigaddset( &set, SIGINT );
+		pthread_sigmask( SIG_BLOCK, &set, nullptr );
+		std::thread( [set, pfnHandler]
+		{
+			int signal = 0;
+			if ( sigwait( &set, &signal ) == 0 )
+			{
+				pfnHandler();
+				std::_Exit( 128 + SIGINT );
+			}
+		} ).detach();
+	}
+
+	bool EnableTerminalColors()
+	{
+		return isatty( STDOUT_FILENO );
+	}
+
+	uint32_t ConsoleWidth()
+	{
+		winsize size{};
+		return ioctl( STDOUT_FILENO, TIOCGWINSZ, &size ) == 0 && size.ws_col ? size.ws_col : 80;
+	}
+
+	// Servers of a build farm don't go to sleep on their own
+	void KeepAwake( bool )
+	{
+	}
+
+	void LowerProcessPriority()
+	{
+		// Threads and children started later inherit it
+		setpriority( PRIO_PROCESS, 0, 10 );
+	}
+
+	void SetThreadBackground()
+	{
+		constexpr int IOPRIO_CLASS_IDLE = 3, IOPRIO_CLASS_SHIFT = 13, IOPRIO_WHO_PROCESS = 1;
+		const sched_param param{};
+		pthread_setschedparam( pthread_self(), SCHED_IDLE, &param );
+		syscall( SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT );
+	}
+
+	// Only the processors the process may run on, containers and taskset leave out the rest
+	uint32_t NumLogicalProcessors()
+	{
+		cpu_set_t set;
+		CPU_ZERO( &set );
+		if ( sched_getaffinity( 0, sizeof( set ), &set ) == 0 && CPU_COUNT( &set ) > 0 )
+			return static_cast<uint32_t>( CPU_COUNT( &set ) );
+		return std::thread::hardware_concurrency();
+	}
+
+	// The scheduler already moves threads over all processors, and first touch puts the arenas on their node
+	void AssignThreadToNode( uint32_t, uint32_t )
+	{
+	}
+
+	bool GetCpuTimes( CpuTimes_t& times )
+	{
+		// cpu  user nice system idle iowait irq softirq steal, in clock ticks
+		std::ifstream stat( "/proc/stat" );
+		std::string cpu;
+		uint64_t arrFields[8]{};
+		if ( !( stat >> cpu ) || cpu != "cpu" )
+			return false;
+		for ( uint64_t& nField : arrFields )
+			stat >> nField;
+		if ( !stat )
+			return false;
+
+		rusage usage{};
+		if ( getrusage( RUSAGE_SELF, &usage ) != 0 )
+			return false;
+
+		const uint64_t nTicksPerClock = 10'000'000 / std::max<long>( sysconf( _SC_CLK_TCK ), 1 );
+		uint64_t nTotal				  = 0;
+		for ( const uint64_t nField : arrFields )
+			nTotal += nField;
+		const auto& Ticks = []( const timeval& tv ) { return static_cast<uint64_t>( tv.tv_sec ) * 10'000'000 + static_cast<uint64_t>( tv.tv_usec ) * 10; };
+		times = { nTotal * nTicksPerClock, ( arrFields[3] + arrFields[4] ) * nTicksPerClock, Ticks( usage.ru_utime ) + Ticks( usage.ru_stime ) };
+		return true;
+	}
+
+	uint32_t MemoryLoad()
+	{
+		std::ifstream meminfo( "/proc/meminfo" );
+		uint64_t nTotal = 0, nAvailable = 0;
+		for ( std::string key; meminfo >> key; )
+		{
+			uint64_t nValue = 0;
+			meminfo >> nValue;
+			if ( key == "MemTotal:" )
+				nTotal = nValue;
+			else if ( key == "MemAvailable:" )
+				nAvailable = nValue;
+			meminfo.ignore( 64, '\n' );
+		}
+		return nTotal ? static_cast<uint32_t>( 100 - std::min( nAvailable, nTotal ) * 100 / nTotal ) : 0;
+	}
+
+	uint64_t PeakMemory()
+	{
+		rusage usage{};
+		return getrusage( RUSAGE_SELF, &usage ) == 0 ? static_cast<uint64_t>( usage.ru_maxrss ) * 1024 : 0;
+	}
+
+	uint32_t ProcessId()
+	{
+		return static_cast<uint32_t>( getpid() );
+	}
+
+	std::string MachineName()
+	{
+		char szName[256];
+		if ( gethostname( szName, sizeof( szName ) ) != 0 )
+			return {};
+		szName[sizeof( szName ) - 1] = '\0';
+		return szName;
+	}
+
+	fs::path ExecutablePath()
+	{
+		std::error_code c;
+		return fs::read_symlink( "/proc/self/exe", c );
+	}
+
+	void* OpenLibrary( const char* szName )
+	{
+		return dlopen( szName, RTLD_NOW | RTLD_LOCAL );
+	}
+
+	void* FindSymbol( void* pLibrary, const char* szName )
+	{
+		return dlsym( pLibrary, szName );
+	}
+
+	fs::path LibraryPath( void* pLibrary )
+	{
+		const link_map* pMap = nullptr;
+		if ( dlinfo( pLibrary, RTLD_DI_LINKMAP, &pMap ) || !pMap || !pMap->l_name )
+			return {};
+		return pMap->l_name;
+	}
+
+	// The callers buffer on their own
+	void* CreateSequentialFile( const fs::path& path )
+	{
+		FILE* pFile = fopen( path.c_str(), "wb" );
+		if ( pFile )
+			setvbuf( pFile, nullptr, _IONBF, 0 );
+		return pFile;
+	}
+
+	bool WriteToFile( void* hFile, const void* pData, size_t nSize )
+	{
+		return fwrite( pData, 1, nSize, static_cast<FILE*>( hFile ) ) == nSize;
+	}
+
+	void CloseFile( void* hFile )
+	{
+		fclose( static_cast<FILE*>( hFile ) );
+	}
+
+	bool RenameOver( const fs::path& from, const fs::path& to )
+	{
+		return rename( from.c_str(), to.c_str() ) == 0;
+	}
+
+	CMappedFile::CMappedFile( const fs::path& path )
+	{
+		const int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+		if ( fd < 0 )
+			return;
+
+		// The mapping keeps the file open
+		struct stat st{};
+		if ( fstat( fd, &st ) == 0 && st.st_size > 0 )
+		{
+			void* pData = mmap( nullptr, static_cast<size_t>( st.st_size ), PROT_READ, MAP_PRIVATE, fd, 0 );
+			if ( pData != MAP_FAILED )
+			{
+				madvise( pData, static_cast<size_t>( st.st_size ), MADV_SEQUENTIAL );
+				m_pData = static_cast<const uint8_t*>( pData );
+				m_nSize = static_cast<size_t>( st.st_size );
+			}
+		}
+		close( fd );
+	}
+
+	CMappedFile::~CMappedFile()
+	{
+		if ( m_pData )
+			munmap( const_cast<uint8_t*>( m_pData ), m_nSize );
+	}
+
+	// inotify doesn't watch subdirectories, each one gets its own watch
+	struct CDirectoryWatch::Impl
+	{
+		fs::path m_Root;
+		int m_fd = -1;
+		std::unordered_map<int, std::string> m_Dirs; // Watch to its directory relative to the root, ending in a slash
+
+		~Impl()
+		{
+			if ( m_fd >= 0 )
+				close( m_fd );
+		}
+
+		void Add( const std::string& dir )
+		{
+			const int wd = inotify_add_watch( m_fd, ( m_Root / dir ).c_str(), IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR );
+			if ( wd >= 0 )
+				m_Dirs[wd] = dir.empty() ? dir : dir + '/';
+		}
+
+		// Directories that show up later, and whatever is in them by the time they are watched
+		void AddTree( const std::string& dir )
+		{
+			Add( dir );
+			std::error_code c;
+			for ( fs::recursive_directory_iterator it( m_Root / dir, fs::directory_options::skip_permission_denied, c ), end; !c && it != end; it.increment( c ) )
+				if ( it->is_directory( c ) )
+					Add( fs::relative( it->path(), m_Root, c ).generic_string() );
+		}
+	};
+
+	CDirectoryWatch::CDirectoryWatch( const fs::path& dir )
+		: m_pImpl( std::make_unique<Impl>() )
+	{
+		m_pImpl->m_Root = dir;
+		m_pImpl->m_fd	= inotify_init1( IN_CLOEXEC | IN_NONBLOCK );
+		if ( m_pImpl->m_fd < 0 )
+		{
+			m_pImpl.reset();
+			return;
+		}
+		m_pImpl->AddTree( {} );
+		if ( m_pImpl->m_Dirs.empty() )
+			m_pImpl.reset();
+	}
+
+	CDirectoryWatch::~CDirectoryWatch() = default;
+
+	bool CDirectoryWatch::Wait( uint32_t nTimeoutMs, std::vector<std::string>& changed )
+	{
+		if ( !m_pImpl )
+			return false;
+		pollfd pfd{ m_pImpl->m_fd, POLLIN, 0 };
+		const int nReady = poll( &pfd, 1, nTimeoutMs == UINT32_MAX ? -1 : static_cast<int>( std::min<uint32_t>( nTimeoutMs, INT32_MAX ) ) );
+		if ( nReady <= 0 )
+			return nReady == 0 || errno == EINTR;
+
+		alignas( inotify_event ) char buffer[64 * 1024];
+		ssize_t nBytes;
+		while ( ( nBytes = read( m_pImpl->m_fd, buffer, sizeof( buffer ) ) ) > 0 )
+		{
+			for ( ssize_t nOffset = 0; nOffset < nBytes; )
+			{
+				const auto pEvent = reinterpret_cast<const inotify_event*>( buffer + nOffset );
+				nOffset += sizeof( inotify_event ) + pEvent->len;
+				if ( pEvent->mask & IN_Q_OVERFLOW )
+				{
+					changed.emplace_back();
+					continue;
+				}
+				const auto it = m_pImpl->m_Dirs.find( pEvent->wd );
+				if ( it == m_pImpl->m_Dirs.end() )
+					continue;
+				if ( pEvent->mask & IN_IGNORED ) // The directory is gone
+				{
+					m_pImpl->m_Dirs.erase( it );
+					continue;
+				}
+				if ( !pEvent->len )
+					continue;
+				std::string name = it->second + pEvent->name;
+				if ( ( pEvent->mask & IN_ISDIR ) && ( pEvent->mask & ( IN_CREATE | IN_MOVED_TO ) ) )
+					m_pImpl->AddTree( name );
+				changed.emplace_back( std::move( name ) );
+			}
+		}
+		return nBytes == 0 || errno == EAGAIN;
+	}
+}
+#endif
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+// What the operating system does differently, so the rest builds for Windows and natively for Linux alike.
+// The compiler library is loaded by d3dxfxc, the processes and sockets of -processes and -remote are in workerprocess.
+namespace Platform
+{
+	// Writes a minidump next to the executable (Windows) or names the signal (elsewhere) when the process crashes
+	void InstallCrashHandler();
+
+	// Ctrl+C calls pfnHandler, after it returns the process exits
+	void SetInterruptHandler( void ( *pfnHandler )() );
+
+	// Turns on escape sequences, false if the console can't show colors
+	[[nodiscard]] bool EnableTerminalColors();
+	// Columns of the console, 80 if it isn't one
+	[[nodiscard]] uint32_t ConsoleWidth();
+
+	// Keeps the machine from sleeping while bAwake
+	void KeepAwake( bool bAwake );
+	// Below normal priority, inherited by child processes
+	void LowerProcessPriority();
+	// Lowest priority for the processor and the disk, for the calling thread
+	void SetThreadBackground();
+
+	// Logical processors of every processor group
+	[[nodiscard]] uint32_t NumLogicalProcessors();
+	// Puts worker iWorker of nWorkers on a NUMA node, in proportion to the processors of every node
+	void AssignThreadToNode( uint32_t iWorker, uint32_t nWorkers );
+
+	// In 100ns ticks, added up over all processors since some point in the past
+	struct CpuTimes_t
+	{
+		uint64_t m_nTotal;
+		uint64_t m_nIdle;
+		uint64_t m_nOwn; // This process, not its children
+	};
+	[[nodiscard]] bool GetCpuTimes( CpuTimes_t& times );
+	// Percent of physical memory in use, 0 if unknown
+	[[nodiscard]] uint32_t MemoryLoad();
+	// Largest the working set of the process got so far, in bytes
+	[[nodiscard]] uint64_t PeakMemory();
+	[[nodiscard]] uint32_t ProcessId();
+	// Host name of the machine, empty if unknown
+	[[nodiscard]] std::string MachineName();
+	[[nodiscard]] std::filesystem::path ExecutablePath();
+
+	// nullptr if it can't be loaded or has no such symbol
+	[[nodiscard]] void* OpenLibrary( const char* szName );
+	[[nodiscard]] void* FindSymbol( void* pLibrary, const char* szName );
+	// The file the library was loaded from, empty if unknown
+	[[nodiscard]] std::filesystem::path LibraryPath( void* pLibrary );
+
+	// A file written front to back, nullptr if it can't be created
+	[[nodiscard]] void* CreateSequentialFile( const std::filesystem::path& path );
+	[[nodiscard]] bool WriteToFile( void* hFile, const void* pData, size_t nSize );
+	void CloseFile( void* hFile );
+	// Moves from over to in one step, readers see either the old or the new file
+	[[nodiscard]] bool RenameOver( const std::filesystem::path& from, const std::filesystem::path& to );
+
+	// The whole file mapped for reading, Data() is nullptr if it can't be or is empty
+	class CMappedFile
+	{
+	public:
+		explicit CMappedFile( const std::filesystem::path& path );
+		~CMappedFile();
+
+		CMappedFile( const CMappedFile& ) = delete;
+		CMappedFile& operator=( const CMappedFile& ) = delete;
+
+		[[nodiscard]] const uint8_t* Data() const noexcept { return m_pData; }
+		[[nodiscard]] size_t Size() const noexcept { return m_nSize; }
+
+	private:
+		const uint8_t* m_pData = nullptr;
+		size_t m_nSize		   = 0;
+	};
+
+	// Files created, written, renamed or deleted anywhere below a directory
+	class CDirectoryWatch
+	{
+	public:
+		explicit CDirectoryWatch( const std::filesystem::path& dir );
+		~CDirectoryWatch();
+
+		CDirectoryWatch( const CDirectoryWatch& ) = delete;
+		CDirectoryWatch& operator=( const CDirectoryWatch& ) = delete;
+
+		[[nodiscard]] bool IsValid() const noexcept { return m_pImpl != nullptr; }
+
+		// Adds the paths that changed within nTimeoutMs (UINT32_MAX waits for good) to changed, relative to the directory
+		// with forward slashes. An empty path means changes were lost and anything may have changed. false if the watch broke.
+		[[nodiscard]] bool Wait( uint32_t nTimeoutMs, std::vector<std::string>& changed );
+
+	private:
+		struct Impl;
+		std::unique_ptr<Impl> m_pImpl;
+	};
+}
@@ -0,0 +1,97 @@
+#include "resumejournal.h"
+#include "compilecache.h"
+
+namespace fs = std::filesystem;
+
+namespace ResumeJournal
+{
+	static constexpr uint32_t JOURNAL_VERSION = 1;
+	static constexpr uint32_t JOURNAL_MAGIC	  = ( 'J' << 24 ) + ( 'R' << 16 ) + ( 'C' << 8 ) + 'S';
+	static constexpr uint32_t MAX_RECORD_SIZE = 1U << 31; // Anything bigger is a torn record
+
+	struct JournalHeader_t
+	{
+		uint32_t m_nMagic;
+		uint32_t m_nVersion;
+		uint64_t m_nSettings;
+	};
+
+	struct RecordHeader_t
+	{
+		uint64_t m_nStaticComboID;
+		uint64_t m_nPackedHash;
+		uint32_t m_nSize;
+	};
+
+	static fs::path JournalPath( const fs::path& vcsPath )
+	{
+		fs::path path = vcsPath;
+		path += ".journal";
+		return path;
+	}
+
+	CJournal::CJournal( const fs::path& vcsPath, uint64_t nSettings ) : m_nEnd( sizeof( JournalHeader_t ) ), m_bReading( true ), m_bOk( true )
+	{
+		const fs::path path = JournalPath( vcsPath );
+		m_File.open( path, std::ios::binary | std::ios::in | std::ios::out );
+
+		JournalHeader_t header;
+		if ( m_File && m_File.read( reinterpret_cast<char*>( &header ), sizeof( header ) ) && header.m_nMagic == JOURNAL_MAGIC && header.m_nVersion == JOURNAL_VERSION
+			 && header.m_nSettings == nSettings )
+			return;
+
+		// Missing, broken or of other settings, nothing in it can be used
+		m_bReading = false;
+		m_File.close();
+		m_File.open( path, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc );
+		header = { JOURNAL_MAGIC, JOURNAL_VERSION, nSettings };
+		m_bOk = m_File && m_File.write( reinterpret_cast<const char*>( &header ), sizeof( header ) ) && m_File.flush();
+	}
+
+	bool CJournal::Read( Record_t& record )
+	{
+		std::lock_guard guard{ m_mtx };
+		if ( !m_bReading )
+			return false;
+
+		RecordHeader_t header;
+		m_File.seekg( m_nEnd, std::ios::beg );
+		if ( m_File.read( reinterpret_cast<char*>( &header ), sizeof( header ) ) && header.m_nSize <= MAX_RECORD_SIZE )
+		{
+			record.m_Code.resize( header.m_nSize );
+			if ( m_File.read( reinterpret_cast<char*>( record.m_Code.data() ), header.m_nSize )
+				 && CompileCache::HashBytes( record.m_Code.data(), header.m_nSize, 0 ) == header.m_nPackedHash )
+			{
+				record.m_nStaticComboID = header.m_nStaticComboID;
+				record.m_nPackedHash	= header.m_nPackedHash;
+				m_nEnd += sizeof( header ) + header.m_nSize;
+				return true;
+			}
+		}
+
+		// Whatever follows is written over
+		m_bReading = false;
+		m_File.clear();
+		return false;
+	}
+
+	void CJournal::Append( uint64_t nStaticComboID, uint64_t nPackedHash, const uint8_t* pCode, size_t nSize )
+	{
+		std::lock_guard guard{ m_mtx };
+		if ( !m_bOk || nSize > MAX_RECORD_SIZE )
+			return;
+
+		m_bReading = false;
+		const RecordHeader_t header{ nStaticComboID, nPackedHash, static_cast<uint32_t>( nSize ) };
+		m_File.seekp( m_nEnd, std::ios::beg );
+		m_bOk = m_File.write( reinterpret_cast<const char*>( &header ), sizeof( header ) ) && m_File.write( reinterpret_cast<const char*>( pCode ), nSize ) && m_File.flush();
+		if ( m_bOk )
+			m_nEnd += sizeof( header ) + nSize;
+	}
+
+	void Remove( const fs::path& vcsPath )
+	{
+		std::error_code c;
+		fs::remove( JournalPath( vcsPath ), c );
+	}
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+// -resume: a journal next to the vcs file of every shader in progress gets each static combo as soon as it is packed.
+// A build that crashed or was stopped reads them back and doesn't compile them again. A journal only counts for the
+// settings it was written with, sources, combos, compiler and packing alike, and goes once the vcs file is written.
+namespace ResumeJournal
+{
+	struct Record_t
+	{
+		uint64_t m_nStaticComboID;
+		uint64_t m_nPackedHash;
+		std::vector<uint8_t> m_Code;
+	};
+
+	class CJournal
+	{
+	public:
+		// Keeps the journal of vcsPath if it was written with nSettings, starts a new one otherwise
+		CJournal( const std::filesystem::path& vcsPath, uint64_t nSettings );
+
+		// The next complete record the journal had when it was opened, false after the last one or a torn one
+		[[nodiscard]] bool Read( Record_t& record );
+
+		// Goes after the last record Read returned and is flushed right away, so a crash right after keeps it
+		void Append( uint64_t nStaticComboID, uint64_t nPackedHash, const uint8_t* pCode, size_t nSize );
+
+	private:
+		std::fstream m_File;
+		uint64_t m_nEnd; // Of the records that are known to be whole
+		bool m_bReading;
+		bool m_bOk;
+		std::mutex m_mtx;
+	};
+
+	// Once the vcs file is written the journal has nothing left to give
+	void Remove( const std::filesystem::path& vcsPath );
+}
@@ -14,7 +14,52 @@
 // 4 = v2 + crc32
 // 5 = v3 + crc32
 // 6 = v5 + duplicate static combo records
-static inline constexpr int SHADER_VCS_VERSION_NUMBER = 6;
+// 7 = v6 + shader dictionary after the duplicate records, blocks flagged 11 are LZMA primed with it, then maybe a dynamic combo index
+// 8 = v7 with 64-bit static combo ids and combo counts
+static inline constexpr int SHADER_VCS_VERSION_NUMBER			 = 6;
+static inline constexpr int SHADER_VCS_DICTIONARY_VERSION_NUMBER = 7; // Only written with -dictionary or -block-index
+static inline constexpr int SHADER_VCS_WIDE_VERSION_NUMBER		 = 8; // Only written when an id or a count doesn't fit version 6 or 7
+
+// The dictionary is a uint32 size followed by that many bytes, a primed block decodes as if they came right before it
+static inline constexpr int MAX_SHADER_DICTIONARY_SIZE = ( 1 << 16 );
+static inline constexpr uint32_t SHADER_BLOCK_PRIMED		 = 0xC0000000;
+
+// Version 7 only: when the first static combo starts after the dictionary, what lies between is an index of the
+// dynamic combos. uint32 entries, uint32 first entry of every static combo record (the sentinel's is the number of
+// entries), then the entries, sorted by dynamic combo id within every static combo.
+static inline constexpr int SHADER_INDEX_BLOCK_SHIFT = 17; // Offsets in an unpacked block stay below MAX_SHADER_UNPACKED_BLOCK_SIZE
+
+// Version 7 and 8, in m_nFlags: the static combos are stored in the order the engine loads them (-load-order). The records
+// stay sorted by id, but a static combo runs up to its end mark rather than to the next record, and the static combos
+// start at the smallest offset of any record.
+static inline constexpr uint32_t SHADER_FLAG_LOAD_ORDER = 0x00000001;
+
+struct DynamicComboIndexRecord_t
+{
+	uint32_t m_nDynamicComboID;
+	uint32_t m_nLocation; // Block number << SHADER_INDEX_BLOCK_SHIFT | offset of the combo's id in the unpacked block
+};
+static_assert( sizeof( DynamicComboIndexRecord_t ) == 2 * 4 );
+
+// Version 7 only: a static combo that is nothing but one block of this type holding a SharedBlobReference_t lives in
+// shared.vcsblob next to the vcs file, its blocks and end mark just as they would be in the vcs file (-shared-blobs)
+static inline constexpr uint32_t SHADER_BLOCK_SHARED = 0x00000000;
+
+#pragma pack( 1 )
+struct SharedBlobReference_t
+{
+	uint64_t m_nFileId; // Of the shared.vcsblob it was written to, a new file gets a new id
+	uint32_t m_nOffset; // Of the blob in the file, after its header
+	uint32_t m_nSize;
+};
+#pragma pack()
+static_assert( sizeof( SharedBlobReference_t ) == 4 * 4 );
+
+// shared.vcsblob: magic, version, uint64 file id, then every blob as uint32 size, uint64 hash and size bytes
+static inline constexpr uint32_t SHARED_BLOB_MAGIC	 = ( 'B' << 24 ) + ( 'S' << 16 ) + ( 'C' << 8 ) + 'V';
+static inline constexpr uint32_t SHARED_BLOB_VERSION = 1;
+static inline constexpr size_t SHARED_BLOB_FILE_HEADER_SIZE = 4 + 4 + 8;
+static inline constexpr size_t SHARED_BLOB_HEADER_SIZE		= 4 + 8;
 
 static inline constexpr int MAX_SHADER_UNPACKED_BLOCK_SIZE = ( 1 << 17 );
 static inline constexpr int MAX_SHADER_PACKED_SIZE         = ( 1 + MAX_SHADER_UNPACKED_BLOCK_SIZE );
@@ -47,6 +92,15 @@ struct ShaderHeader_t_v4 // still used for assembly shaders
 #pragma pack()
 static_assert( sizeof( ShaderHeader_t_v4 ) == 7 * 4 );
 
+// Version 8 only: comes right after ShaderHeader_t, whose m_nTotalCombos and m_nDynamicCombos are -1. The records are
+// StaticComboRecordWide_t with a sentinel id of UINT64_MAX, the duplicates StaticComboAliasRecordWide_t, the rest reads as in version 7.
+struct ShaderHeaderWide_t
+{
+	uint64_t m_nTotalCombos;
+	uint64_t m_nDynamicCombos;
+};
+static_assert( sizeof( ShaderHeaderWide_t ) == 4 * 4 );
+
 // for old format files
 struct ShaderDictionaryEntry_t
 {
@@ -68,4 +122,20 @@ struct StaticComboAliasRecord_t // for duplicate static combos
 	uint32_t m_nStaticComboID;     // this combo
 	uint32_t m_nSourceStaticCombo; // the combo it is the same as
 };
-static_assert( sizeof( StaticComboAliasRecord_t ) == 2 * 4 );
\ No newline at end of file
+static_assert( sizeof( StaticComboAliasRecord_t ) == 2 * 4 );
+
+#pragma pack( 1 )
+struct StaticComboRecordWide_t
+{
+	uint64_t m_nStaticComboID;
+	uint32_t m_nFileOffset;
+};
+#pragma pack()
+static_assert( sizeof( StaticComboRecordWide_t ) == 3 * 4 );
+
+struct StaticComboAliasRecordWide_t
+{
+	uint64_t m_nStaticComboID;
+	uint64_t m_nSourceStaticCombo;
+};
+static_assert( sizeof( StaticComboAliasRecordWide_t ) == 4 * 4 );
@@ -6,11 +6,17 @@
 #define NOIME
 #define NOMINMAX
 
+#include <algorithm>
 #include <bit>
+#include <charconv>
+#include <cstdio>
 #include <fstream>
 #include <filesystem>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <unordered_map>
 #include <vector>
 
 #include "shaderparser.h"
@@ -20,6 +26,8 @@
 #include "re2/re2.h"
 #include "gsl/narrow"
 #include "CRC32.hpp"
+#include "compilecache.h"
+#include "d3dxfxc.h"
 #include "strmanip.hpp"
 
 // gcc9 for some reason doesn't have this
@@ -32,6 +40,9 @@ template <class T, std::enable_if_t<std::is_unsigned_v<T>, int> = 0>
 namespace ConfigurationProcessing
 {
 	std::vector<std::pair<std::string, std::string>> GenerateSkipAsserts( const std::vector<Parser::Combo>& combos, const std::vector<std::string>& skips );
+	// Bit i of table is set if combo i survives the skips, table is left empty if no skip applies.
+	// False if there are too many combos for a table.
+	bool GenerateSkipTable( const std::vector<Parser::Combo>& combos, const std::vector<std::string>& skips, std::vector<uint32_t>& table );
 }
 
 using namespace std::literals;
@@ -43,7 +54,7 @@ namespace r
 	static const RE2 inc( R"reg(#\s*include\s*"(.*)")reg" );
 	static const RE2 xbox_reg( R"reg(\[XBOX\])reg" );
 	static const RE2 pc_reg( R"reg(\[PC\])reg" );
-	static const RE2 start( R"reg(^\s*//\s*(STATIC|DYNAMIC|SKIP|CENTROID|[VPGDH]S_MAIN)\s*:\s*(.*)$)reg" );
+	static const RE2 start( R"reg(^\s*//\s*(STATIC|DYNAMIC|SKIP|CENTROID|PROFILE|[VPGDH]S_MAIN)\s*:\s*(.*)$)reg" );
 	static const RE2 init( R"reg(\[\s*=\s*([^\]]+)\])reg" );
 	static const RE2 static_combo( R"reg(^\s*//\s*STATIC\s*:\s*"(.*)"\s+"(\d+)\.\.(\d+)".*)reg" );
 	static const RE2 dynamic_combo( R"reg(^\s*//\s*DYNAMIC\s*:\s*"(.*)"\s+"(\d+)\.\.(\d+)".*)reg" );
@@ -78,6 +89,97 @@ std::string_view Parser::GetTarget( const std::string& baseName )
 	return { target.data(), target.size() };
 }
 
+// Hand written versions of the per line regexes, they have to give the same results as those do,
+// the lines that come out of ReadFile go into the crc. RE2 only matches . against valid UTF-8,
+// so lines with other bytes still take the regexes.
+namespace Scan
+{
+	[[nodiscard]] static bool IsAscii( std::string_view line )
+	{
+		return std::none_of( line.cbegin(), line.cend(), []( char c ) { return static_cast<unsigned char>( c ) >= 0x80; } );
+	}
+
+	// \s of RE2
+	static constexpr std::string_view SPACES = " \t\n\f\r"sv;
+
+	// r::c_inline_comment until it stops matching: the last /* that has a */ after it goes, up to the first */ after it
+	static void StripInlineComments( std::string& line )
+	{
+		for ( size_t nLastEnd; ( nLastEnd = line.rfind( "*/"sv ) ) != std::string::npos && nLastEnd >= 2; )
+		{
+			const size_t nStart = line.rfind( "/*"sv, nLastEnd - 2 );
+			if ( nStart == std::string::npos )
+				return;
+			const size_t nEnd = line.find( "*/"sv, nStart + 2 );
+			line.erase( nStart, nEnd + 2 - nStart );
+		}
+	}
+
+	// r::cpp_comment, a trailing // goes unless that is all there is
+	[[nodiscard]] static std::string_view ReduceCppComment( std::string_view line )
+	{
+		return line.size() > 2 && line.ends_with( "//"sv ) ? line.substr( 0, line.size() - 2 ) : line;
+	}
+
+	// r::inc, from the first " after #include up to the last " of the line
+	[[nodiscard]] static bool MatchInclude( std::string_view line, std::string& incl )
+	{
+		for ( size_t nHash = line.find( '#' ); nHash != std::string_view::npos; nHash = line.find( '#', nHash + 1 ) )
+		{
+			size_t i = std::min( line.find_first_not_of( SPACES, nHash + 1 ), line.size() );
+			if ( line.substr( i, 7 ) != "include"sv )
+				continue;
+			i = std::min( line.find_first_not_of( SPACES, i + 7 ), line.size() );
+			if ( i == line.size() || line[i] != '"' )
+				continue;
+			if ( const size_t nLast = line.rfind( '"' ); nLast > i )
+			{
+				incl = line.substr( i + 1, nLast - i - 1 );
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Lines r::start can match at all, everything else skips the regexes
+	[[nodiscard]] static bool IsDirective( std::string_view line )
+	{
+		size_t i = line.find_first_not_of( SPACES );
+		if ( i == std::string_view::npos || line.substr( i, 2 ) != "//"sv )
+			return false;
+		if ( i = line.find_first_not_of( SPACES, i + 2 ); i == std::string_view::npos )
+			return false;
+
+		line.remove_prefix( i );
+		return line.starts_with( "STATIC"sv ) || line.starts_with( "DYNAMIC"sv ) || line.starts_with( "SKIP"sv ) || line.starts_with( "CENTROID"sv )
+			|| line.starts_with( "PROFILE"sv )
+			|| ( line.size() >= 7 && "VPGDH"sv.find( line[0] ) != std::string_view::npos && line.substr( 1, 6 ) == "S_MAIN"sv );
+	}
+
+	// Next line the way std::getline on a text mode stream returns it
+	[[nodiscard]] static bool NextLine( std::string_view contents, size_t& nPos, std::string& line )
+	{
+		if ( nPos >= contents.size() )
+			return false;
+
+		const size_t nEnd = contents.find( '\n', nPos );
+		if ( nEnd == std::string_view::npos )
+		{
+			line.assign( contents.substr( nPos ) );
+			nPos = contents.size();
+			return true;
+		}
+
+		line.assign( contents.substr( nPos, nEnd - nPos ) );
+		nPos = nEnd + 1;
+#ifdef _WIN32
+		if ( !line.empty() && line.back() == '\r' )
+			line.pop_back();
+#endif
+		return true;
+	}
+}
+
 template <typename T>
 static bool ReadFile( const fs::path& name, const std::string& srcPath, std::vector<std::string>& includes, T& func )
 {
@@ -92,16 +194,45 @@ static bool ReadFile( const fs::path& name, const std::string& srcPath, std::vec
 	auto rawName = fullPath.string().substr( srcPath.size() + 1 );
 	std::for_each( rawName.begin(), rawName.end(), []( char& c ) { if ( c == '\\' ) c = '/'; } );
 	includes.emplace_back( rawName );
-	std::ifstream file( fullPath );
-	if ( file.fail() )
+
+	// Shared with the crc check, the other shaders including it and the compiler
+	const CSharedFile* pFile = fileCache.GetOrLoad( rawName, fullPath );
+	if ( !pFile )
 	{
 		std::cout << clr::red << "File \""sv << rawName << "\" does not exist"sv << clr::reset << std::endl;
 		return false;
 	}
 
+	std::string_view contents( static_cast<const char*>( pFile->Data() ), pFile->Size() );
+#ifdef _WIN32
+	// Where a text mode stream stops
+	if ( const size_t nEof = contents.find( '\x1a' ); nEof != std::string_view::npos )
+		contents = contents.substr( 0, nEof );
+#endif
+
 	bool cComment = false;
-	for ( std::string line, reducedLine, incl, c1, c2; std::getline( file, line ); )
+	size_t nPos = 0;
+	for ( std::string line, reducedLine, incl, c1, c2; Scan::NextLine( contents, nPos, line ); )
 	{
+		if ( Scan::IsAscii( line ) )
+		{
+			Scan::StripInlineComments( line );
+			const std::string_view reduced = Scan::ReduceCppComment( line );
+			if ( Scan::MatchInclude( reduced, incl ) && !reduced.starts_with( "//"sv ) )
+			{
+				if ( V_IsAbsolutePath( incl.c_str() ) )
+				{
+					std::cout << clr::red << "Absolute path \""sv << incl << "\" in #include, aborting!"sv << clr::reset << std::endl;
+					return false;
+				}
+
+				ReadFile( parent / incl, srcPath, includes, func );
+				continue;
+			}
+			func( line );
+			continue;
+		}
+
 		if ( !cComment )
 		{
 			while ( re2::RE2::FullMatch( line, r::c_inline_comment, &c1, &c2 ) )
@@ -143,14 +274,53 @@ static bool ReadFile( const fs::path& name, const std::string& srcPath, std::vec
 	return !cComment;
 }
 
+// The directive lines of a source file and its includes, with their [ps20b], [ps30] and other annotations still on them.
+// Read once for every target and version the file is built for, each one picks its own lines from it.
+struct ParsedSource_t
+{
+	std::once_flag m_Read;
+	bool m_bOk = false;
+	std::vector<std::string> m_arrDirectives;
+	std::vector<std::string> m_arrIncludes;
+};
+static std::mutex s_mtxParsed;
+static std::unordered_map<std::string, std::shared_ptr<ParsedSource_t>> s_Parsed;
+
+static std::shared_ptr<const ParsedSource_t> ReadParsedSource( const fs::path& name, const std::string& root )
+{
+	std::shared_ptr<ParsedSource_t> pSource;
+	{
+		std::lock_guard guard{ s_mtxParsed };
+		std::shared_ptr<ParsedSource_t>& rpSource = s_Parsed[name.string()];
+		if ( !rpSource )
+			rpSource = std::make_shared<ParsedSource_t>();
+		pSource = rpSource;
+	}
+
+	std::call_once( pSource->m_Read, [&name, &root, &pSource]
+	{
+		const auto& collect = [&pSource]( const std::string& line )
+		{
+			if ( Scan::IsDirective( line ) )
+				pSource->m_arrDirectives.emplace_back( line );
+		};
+		pSource->m_bOk = ReadFile( name, root, pSource->m_arrIncludes, collect );
+	} );
+	return pSource;
+}
+
+void Parser::ForgetParsedSources()
+{
+	std::lock_guard guard{ s_mtxParsed };
+	s_Parsed.clear();
+}
+
 static constexpr const char validL[] = { 'v', 'p', 'g', 'h', 'd' };
 static constexpr const char validU[] = { 'V', 'P', 'G', 'H', 'D' };
 bool Parser::ParseFile( const fs::path& name, const std::string& root, const std::string_view& target, const std::string_view& version, CfgProcessor::ShaderConfig& conf )
 {
 	using re2::RE2;
 	conf.centroid_mask = 0U;
-	const auto nameS = name.string();
-	const auto f = nameS.find_last_of( '.' );
 	char regMatch[] = { R"reg(\[ s(\d+\w?)\])reg" };
 	char regNotMatch[] = { R"reg(\[[    ]s\d+\w?\])reg" };
 	std::string mainCat = " S_MAIN"s;
@@ -221,28 +391,76 @@ bool Parser::ParseFile( const fs::path& name, const std::string& root, const std
 			RE2::Replace( &value, r::pc_reg, {} );
 			conf.skip.emplace_back( trim( std::move( value ) ) );
 		}
+		else if ( name == "PROFILE"sv )
+		{
+			RE2::GlobalReplace( &value, shouldMatch, {} );
+			RE2::Replace( &value, r::pc_reg, {} );
+			conf.release_profile = trim( std::move( value ) ) == "release"sv;
+		}
 		else if ( name == mainCat )
 		{
 			conf.main = value;
 		}
 	};
 
-	return ReadFile( name, root, conf.includes, read );
+	const std::shared_ptr<const ParsedSource_t> pSource = ReadParsedSource( name, root );
+	conf.includes.insert( conf.includes.end(), pSource->m_arrIncludes.cbegin(), pSource->m_arrIncludes.cend() );
+	for ( const std::string& line : pSource->m_arrDirectives )
+		read( line );
+	return pSource->m_bOk;
 }
 
-void Parser::WriteInclude( const fs::path& fileName, const std::string& name, const std::string_view& target, const std::vector<Combo>& static_c,
-							const std::vector<Combo>& dynamic_c, const std::vector<std::string>& skip, bool writeSCI )
+static bool SameContents( const fs::path& fileName, std::string_view contents )
 {
-	if ( fs::exists( fileName ) )
-		fs::permissions( fileName, fs::perms::owner_read | fs::perms::owner_write );
+	std::error_code c;
+	if ( fs::file_size( fileName, c ) != contents.size() || c )
+		return false;
+
+	static thread_local std::string s_tlExisting;
+	s_tlExisting.resize( contents.size() );
+	std::ifstream file( fileName, std::ios::binary );
+	return file && file.read( s_tlExisting.data(), s_tlExisting.size() ) && s_tlExisting == contents;
+}
 
+// The text of an include, appended to a buffer every thread keeps for the next one. Numbers go through to_chars,
+// none of the locale and stream state of an ostringstream.
+class CIncludeText
+{
+public:
+	CIncludeText() { s_tlBuffer.clear(); }
+
+	CIncludeText& operator<<( std::string_view str )
+	{
+		s_tlBuffer.append( str );
+		return *this;
+	}
+
+	CIncludeText& operator<<( const std::string& str ) { return *this << std::string_view( str ); }
+	CIncludeText& operator<<( const char* str ) { return *this << std::string_view( str ); }
+
+	template <typename T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool> && !std::is_same_v<T, char>, int> = 0>
+	CIncludeText& operator<<( T value )
+	{
+		char digits[24];
+		return *this << std::string_view( digits, std::to_chars( std::begin( digits ), std::end( digits ), value ).ptr - digits );
+	}
+
+	[[nodiscard]] std::string_view str() const noexcept { return s_tlBuffer; }
+
+private:
+	static thread_local std::string s_tlBuffer;
+};
+thread_local std::string CIncludeText::s_tlBuffer;
+
+void Parser::WriteInclude( const fs::path& fileName, const std::string& name, const std::string_view& target, const std::vector<Combo>& static_c,
+							const std::vector<Combo>& dynamic_c, const std::vector<std::string>& skip, bool writeSCI, bool writeSkipTables )
+{
 	char prefix[] = { " sh_" };
 	prefix[0] = target[0];
 
+	CIncludeText file;
 	{
-		fs::create_directories( fileName.parent_path() );
-		std::ofstream file( fileName, std::ios::trunc | std::ios::binary );
-		const auto& writeVars = [&]( const std::string_view& suffix, const std::vector<Combo>& vars, const std::string_view& ctor, uint32_t scale, bool dynamic )
+		const auto& writeVars = [&]( const std::string_view& suffix, const std::vector<Combo>& vars, const std::string_view& ctor, uint32_t scale )
 		{
 			file << "class "sv << name << "_"sv << suffix << "_Index\n{\n";
 			const bool hasIfdef = std::find_if( vars.begin(), vars.end(), []( const Combo& c ) { return c.initVal.empty(); } ) != vars.end();
@@ -255,6 +473,21 @@ void Parser::WriteInclude( const fs::path& fileName, const std::string& name, co
 					file << "\tbool m_b"sv << c.name << " : 1;\n"sv;
 			if ( hasIfdef )
 				file << "#endif\t// _DEBUG\n"sv;
+
+			// One bit per combo is a single lookup in debug builds instead of an assert per skip
+			std::vector<uint32_t> validCombos;
+			const bool hasTable = writeSkipTables && ConfigurationProcessing::GenerateSkipTable( vars, skip, validCombos );
+			if ( !validCombos.empty() )
+			{
+				file << "\tstatic constexpr unsigned int s_nValidCombos[] =\n\t{"sv;
+				for ( size_t i = 0; i < validCombos.size(); ++i )
+				{
+					char word[16];
+					const int nWord = snprintf( word, sizeof( word ), "0x%08x,", validCombos[i] );
+					file << ( i % 8 ? " "sv : "\n\t\t"sv ) << std::string_view( word, nWord );
+				}
+				file << "\n\t};\n"sv;
+			}
 			file << "public:\n"sv;
 			for ( const Combo& c : vars )
 			{
@@ -285,16 +518,21 @@ void Parser::WriteInclude( const fs::path& fileName, const std::string& name, co
 			{
 				if ( hasIfdef )
 					file << "\t\tAssert( "sv << std::accumulate( vars.begin(), vars.end(), ""s, []( const std::string& s, const Combo& c ) { return c.initVal.empty() ? ( s + " && m_b" + c.name ) : s; } ).substr( 4 ) << " );\n"sv;
-				const auto skipAsserts = ConfigurationProcessing::GenerateSkipAsserts( dynamic ? dynamic_c : static_c, skip );
-				for ( const auto& [msg, check] : skipAsserts )
-					file << "\t\tAssertMsg( !"sv << check << ", \"Invalid combo combination "sv << msg << "\" );\n"sv;
-				file << "\t\treturn "sv;
+				if ( !hasTable )
+				{
+					const auto skipAsserts = ConfigurationProcessing::GenerateSkipAsserts( vars, skip );
+					for ( const auto& [msg, check] : skipAsserts )
+						file << "\t\tAssertMsg( !"sv << check << ", \"Invalid combo combination "sv << msg << "\" );\n"sv;
+				}
+				file << ( validCombos.empty() ? "\t\treturn "sv : "\t\tconst int nIndex = "sv );
 				for ( const Combo& c : vars )
 				{
 					file << "( "sv << scale << " * m_n"sv << c.name << " ) + "sv;
 					scale *= c.maxVal - c.minVal + 1;
 				}
 				file << "0;\n"sv;
+				if ( !validCombos.empty() )
+					file << "\t\tAssertMsg( IsValidShaderCombo( s_nValidCombos, nIndex ), \"Invalid combo combination, see the skips on top\" );\n\t\treturn nIndex;\n"sv;
 			}
 			file << "\t}\n};\n\n"sv;
 
@@ -320,11 +558,11 @@ void Parser::WriteInclude( const fs::path& fileName, const std::string& name, co
 		file << "#pragma once\n" R"(#include "shaderlib/cshader.h")" "\n"sv;
 
 		writeVars( "Static"sv, static_c, ""sv,
-			std::accumulate( dynamic_c.begin(), dynamic_c.end(), 1U, []( uint32_t a, const Combo& b ) { return a * ( b.maxVal - b.minVal + 1 ); } ), false );
+			std::accumulate( dynamic_c.begin(), dynamic_c.end(), 1U, []( uint32_t a, const Combo& b ) { return a * ( b.maxVal - b.minVal + 1 ); } ) );
 
 		file << "\n"sv;
 
-		writeVars( "Dynamic"sv, dynamic_c, ""sv, 1U, true );
+		writeVars( "Dynamic"sv, dynamic_c, ""sv, 1U );
 
 		if ( writeSCI )
 		{
@@ -362,14 +600,137 @@ void Parser::WriteInclude( const fs::path& fileName, const std::string& name, co
 		}
 	}
 
+	// Touching the include rebuilds everything in the game that includes it, so leave it be if nothing changed
+	const std::string_view contents = file.str();
+	if ( SameContents( fileName, contents ) )
+		return;
+
+	if ( fs::exists( fileName ) )
+		fs::permissions( fileName, fs::perms::owner_read | fs::perms::owner_write );
+
+	fs::create_directories( fileName.parent_path() );
+	std::ofstream( fileName, std::ios::trunc | std::ios::binary ).write( contents.data(), contents.size() );
+
 	fs::permissions( fileName, fs::perms::owner_read );
 }
 
+// Sidecar of every vcs file: the source crc it was checked against and the files that went into it,
+// so that a shader whose sources weren't touched doesn't need to be read again
+namespace Manifest
+{
+	static constexpr uint32_t MANIFEST_MAGIC   = ( 'F' << 24 ) + ( 'M' << 16 ) + ( 'C' << 8 ) + 'S';
+	static constexpr uint32_t MANIFEST_VERSION = 1;
+
+	struct Entry
+	{
+		std::string path; // relative to root
+		uint64_t size;
+		int64_t mtime;
+		uint64_t hash; // of the raw contents
+	};
+
+	static bool Stat( const fs::path& path, uint64_t& size, int64_t& mtime )
+	{
+		std::error_code c;
+		size = fs::file_size( path, c );
+		if ( c )
+			return false;
+		mtime = fs::last_write_time( path, c ).time_since_epoch().count();
+		return !c;
+	}
+
+	static bool HashContents( const fs::path& path, uint64_t& hash )
+	{
+		std::ifstream file( path, std::ios::binary );
+		if ( !file )
+			return false;
+		const std::string contents( std::istreambuf_iterator<char>( file ), {} );
+		hash = CompileCache::HashBytes( contents.data(), contents.size(), 0 );
+		return true;
+	}
+
+	static bool Load( const fs::path& path, uint32_t& crc32, std::vector<Entry>& entries )
+	{
+		std::ifstream file( path, std::ios::binary );
+		uint32_t header[4];
+		if ( !file || !file.read( reinterpret_cast<char*>( header ), sizeof( header ) ) || header[0] != MANIFEST_MAGIC || header[1] != MANIFEST_VERSION )
+			return false;
+
+		crc32 = header[2];
+		entries.resize( header[3] );
+		for ( Entry& entry : entries )
+		{
+			uint32_t len;
+			if ( !file.read( reinterpret_cast<char*>( &len ), sizeof( len ) ) )
+				return false;
+			entry.path.resize( len );
+			if ( !file.read( entry.path.data(), len ) || !file.read( reinterpret_cast<char*>( &entry.size ), sizeof( entry.size ) )
+				 || !file.read( reinterpret_cast<char*>( &entry.mtime ), sizeof( entry.mtime ) ) || !file.read( reinterpret_cast<char*>( &entry.hash ), sizeof( entry.hash ) ) )
+				return false;
+		}
+		return true;
+	}
+
+	static void Save( const fs::path& path, uint32_t crc32, const std::vector<Entry>& entries )
+	{
+		fs::path tmpPath = path;
+		tmpPath += ".tmp"sv;
+		{
+			std::ofstream file( tmpPath, std::ios::binary | std::ios::trunc );
+			const uint32_t header[4] = { MANIFEST_MAGIC, MANIFEST_VERSION, crc32, gsl::narrow<uint32_t>( entries.size() ) };
+			file.write( reinterpret_cast<const char*>( header ), sizeof( header ) );
+			for ( const Entry& entry : entries )
+			{
+				const uint32_t len = gsl::narrow<uint32_t>( entry.path.size() );
+				file.write( reinterpret_cast<const char*>( &len ), sizeof( len ) );
+				file.write( entry.path.data(), len );
+				file.write( reinterpret_cast<const char*>( &entry.size ), sizeof( entry.size ) );
+				file.write( reinterpret_cast<const char*>( &entry.mtime ), sizeof( entry.mtime ) );
+				file.write( reinterpret_cast<const char*>( &entry.hash ), sizeof( entry.hash ) );
+			}
+			if ( !file )
+			{
+				file.close();
+				std::error_code c;
+				fs::remove( tmpPath, c );
+				return;
+			}
+		}
+
+		std::error_code c;
+		fs::rename( tmpPath, path, c );
+		if ( c )
+			fs::remove( tmpPath, c );
+	}
+
+	// True if every file is still what it was, files that were only touched are hashed again
+	static bool UpToDate( const std::string& root, std::vector<Entry>& entries, bool& bTouched )
+	{
+		bTouched = false;
+		for ( Entry& entry : entries )
+		{
+			const fs::path path = fs::path( root ) / entry.path;
+			uint64_t size, hash;
+			int64_t mtime;
+			if ( !Stat( path, size, mtime ) || size != entry.size )
+				return false;
+			if ( mtime == entry.mtime )
+				continue;
+
+			if ( !HashContents( path, hash ) || hash != entry.hash )
+				return false;
+			entry.mtime = mtime;
+			bTouched = true;
+		}
+		return true;
+	}
+}
+
 bool Parser::CheckCrc( const fs::path& sourceFile, const std::string& root, const std::string& name, uint32_t& crc32 )
 {
+	const auto filePath = sourceFile.parent_path() / "shaders"sv / "fxc"sv / ( name + ".vcs" );
 	uint32_t binCrc = 0;
 	{
-		const auto filePath = sourceFile.parent_path() / "shaders"sv / "fxc"sv / ( name + ".vcs" );
 		std::ifstream file( filePath, std::ios::binary );
 		if ( file )
 		{
@@ -378,6 +739,24 @@ bool Parser::CheckCrc( const fs::path& sourceFile, const std::string& root, cons
 		}
 	}
 
+	fs::path manifestPath = filePath;
+	manifestPath += ".manifest"sv;
+
+	// Nothing changed since the crc of this vcs was computed, no need to read the sources
+	std::vector<Manifest::Entry> entries;
+	uint32_t manifestCrc = 0;
+	if ( binCrc && Manifest::Load( manifestPath, manifestCrc, entries ) && manifestCrc == binCrc )
+	{
+		bool bTouched;
+		if ( Manifest::UpToDate( root, entries, bTouched ) )
+		{
+			if ( bTouched )
+				Manifest::Save( manifestPath, manifestCrc, entries );
+			crc32 = binCrc;
+			return true;
+		}
+	}
+
 	std::string file;
 	std::vector<std::string> includes;
 	const auto& read = [&file]( const std::string& line )
@@ -388,5 +767,21 @@ bool Parser::CheckCrc( const fs::path& sourceFile, const std::string& root, cons
 		return false;
 
 	crc32 = CRC32::ProcessSingleBuffer( file.c_str(), file.size() );
+
+	std::sort( includes.begin(), includes.end() );
+	includes.erase( std::unique( includes.begin(), includes.end() ), includes.end() );
+	entries.clear();
+	for ( std::string& include : includes )
+	{
+		const fs::path path = fs::path( root ) / include;
+		Manifest::Entry& entry = entries.emplace_back( Manifest::Entry{ std::move( include ) } );
+		if ( !Manifest::Stat( path, entry.size, entry.mtime ) || !Manifest::HashContents( path, entry.hash ) )
+			return crc32 == binCrc;
+	}
+
+	std::error_code c;
+	fs::create_directories( manifestPath.parent_path(), c );
+	Manifest::Save( manifestPath, crc32, entries );
+
 	return crc32 == binCrc;
 }
\ No newline at end of file
@@ -24,8 +24,11 @@ namespace Parser
 
 	std::string ConstructName( const std::string& baseName, const std::string_view& target, const std::string_view& ver );
 	std::string_view GetTarget( const std::string& baseName );
+	// The source and its includes are read once for all targets and versions, see ForgetParsedSources
 	bool ParseFile( const std::filesystem::path& name, const std::string& root, const std::string_view& target, const std::string_view& version, CfgProcessor::ShaderConfig& conf );
+	// Sources change between -watch builds
+	void ForgetParsedSources();
 	void WriteInclude( const std::filesystem::path& fileName, const std::string& name, const std::string_view& target, const std::vector<Combo>& static_c,
-		const std::vector<Combo>& dynamic_c, const std::vector<std::string>& skip, bool writeSCI );
+		const std::vector<Combo>& dynamic_c, const std::vector<std::string>& skip, bool writeSCI, bool writeSkipTables );
 	bool CheckCrc( const std::filesystem::path& sourceFile, const std::string& root, const std::string& name, uint32_t& crc32 );
 }
\ No newline at end of file
@@ -0,0 +1,175 @@
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include "sharedblobs.h"
+#include "robin_hood.h"
+
+namespace fs = std::filesystem;
+
+namespace SharedBlobs
+{
+	struct Blob_t
+	{
+		uint32_t m_nOffset; // Of the data, after the blob header
+		uint32_t m_nSize;
+	};
+
+	static std::mutex s_mtx;
+	static std::fstream s_File;
+	static uint64_t s_nFileId;
+	static uint64_t s_nEnd; // Where the next blob goes
+	static robin_hood::unordered_flat_map<uint64_t, std::vector<Blob_t>> s_Blobs; // By hash, collisions side by side
+	static std::vector<uint8_t> s_Check;
+	static std::atomic<uint64_t> s_nShared;
+
+	template <typename T>
+	static bool ReadValue( T& value )
+	{
+		return static_cast<bool>( s_File.read( reinterpret_cast<char*>( &value ), sizeof( value ) ) );
+	}
+
+	template <typename T>
+	static bool WriteValue( const T& value )
+	{
+		return static_cast<bool>( s_File.write( reinterpret_cast<const char*>( &value ), sizeof( value ) ) );
+	}
+
+	// Learns the blobs of the file that is open, false if it isn't one of ours
+	static bool ReadBlobs( const fs::path& path )
+	{
+		uint32_t header[2];
+		if ( !ReadValue( header ) || header[0] != SHARED_BLOB_MAGIC || header[1] != SHARED_BLOB_VERSION || !ReadValue( s_nFileId ) )
+			return false;
+
+		std::error_code c;
+		const uint64_t nFileSize = fs::file_size( path, c );
+		if ( c )
+			return false;
+
+		uint64_t nPos = SHARED_BLOB_FILE_HEADER_SIZE;
+		for ( ;; )
+		{
+			uint32_t nSize;
+			uint64_t nHash;
+			if ( nFileSize - nPos < SHARED_BLOB_HEADER_SIZE || !ReadValue( nSize ) || !ReadValue( nHash ) || nFileSize - nPos - SHARED_BLOB_HEADER_SIZE < nSize )
+				break;
+			s_Blobs[nHash].emplace_back( Blob_t{ static_cast<uint32_t>( nPos + SHARED_BLOB_HEADER_SIZE ), nSize } );
+			nPos += SHARED_BLOB_HEADER_SIZE + nSize;
+			if ( !s_File.seekg( static_cast<std::streamoff>( nPos ) ) )
+				return false;
+		}
+		s_File.clear();
+
+		// A blob cut short by a build that was interrupted, no vcs file refers to it
+		if ( nPos != nFileSize )
+		{
+			s_File.close();
+			fs::resize_file( path, nPos, c );
+			if ( c )
+				return false;
+			s_File.open( path, std::ios::binary | std::ios::in | std::ios::out );
+			if ( !s_File )
+				return false;
+		}
+		s_nEnd = nPos;
+		return true;
+	}
+
+	static void CloseFile()
+	{
+		s_File.close();
+		s_File.clear();
+		s_Blobs.clear();
+		s_nEnd = 0;
+	}
+
+	bool Open( const fs::path& dir )
+	{
+		std::lock_guard guard{ s_mtx };
+		CloseFile();
+
+		std::error_code c;
+		fs::create_directories( dir, c );
+		const fs::path path = dir / "shared.vcsblob";
+		s_File.open( path, std::ios::binary | std::ios::in | std::ios::out );
+		if ( s_File && ReadBlobs( path ) )
+			return true;
+
+		// A new file gets a new id, vcs files that refer to the old one can't mistake it for theirs
+		s_File.close();
+		s_Blobs.clear();
+		s_File.open( path, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc );
+		std::random_device rd;
+		s_nFileId = ( static_cast<uint64_t>( rd() ) << 32 ) | rd();
+		const uint32_t header[2] = { SHARED_BLOB_MAGIC, SHARED_BLOB_VERSION };
+		s_nEnd = SHARED_BLOB_FILE_HEADER_SIZE;
+		return s_File && WriteValue( header ) && WriteValue( s_nFileId ) && s_File.flush();
+	}
+
+	void Close()
+	{
+		std::lock_guard guard{ s_mtx };
+		CloseFile();
+	}
+
+	bool Store( const uint8_t* pCode, size_t nSize, uint64_t nHash, SharedBlobReference_t& ref )
+	{
+		constexpr uint32_t endMark = 0xffffffff;
+		std::lock_guard guard{ s_mtx };
+		if ( !s_File.is_open() || nSize > UINT32_MAX - sizeof( endMark ) )
+			return false;
+		const uint32_t nBlobSize = static_cast<uint32_t>( nSize + sizeof( endMark ) );
+
+		// The bytes are compared on a hash hit, the end mark always matches
+		std::vector<Blob_t>& blobs = s_Blobs[nHash];
+		for ( const Blob_t& blob : blobs )
+		{
+			if ( blob.m_nSize != nBlobSize )
+				continue;
+			s_Check.resize( nSize );
+			if ( !s_File.seekg( blob.m_nOffset ) || !s_File.read( reinterpret_cast<char*>( s_Check.data() ), nSize ) )
+			{
+				s_File.clear();
+				continue;
+			}
+			if ( memcmp( s_Check.data(), pCode, nSize ) == 0 )
+			{
+				ref = SharedBlobReference_t{ s_nFileId, blob.m_nOffset, blob.m_nSize };
+				++s_nShared;
+				return true;
+			}
+		}
+
+		// Offsets are 32 bits, a file that big takes no more blobs
+		if ( s_nEnd + SHARED_BLOB_HEADER_SIZE + nBlobSize > UINT32_MAX )
+			return false;
+		if ( !s_File.seekp( static_cast<std::streamoff>( s_nEnd ) ) || !WriteValue( nBlobSize ) || !WriteValue( nHash )
+			 || !s_File.write( reinterpret_cast<const char*>( pCode ), nSize ) || !WriteValue( endMark ) )
+		{
+			// Whatever made it out is past s_nEnd where no vcs file refers to it, the next blob writes over it
+			s_File.clear();
+			return false;
+		}
+
+		const Blob_t blob{ static_cast<uint32_t>( s_nEnd + SHARED_BLOB_HEADER_SIZE ), nBlobSize };
+		blobs.emplace_back( blob );
+		s_nEnd += SHARED_BLOB_HEADER_SIZE + nBlobSize;
+		ref = SharedBlobReference_t{ s_nFileId, blob.m_nOffset, blob.m_nSize };
+		return true;
+	}
+
+	bool Flush()
+	{
+		std::lock_guard guard{ s_mtx };
+		return s_File.is_open() && s_File.flush();
+	}
+
+	uint64_t NumShared() noexcept
+	{
+		return s_nShared;
+	}
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+#include "shader_vcs_version.h"
+
+// -shared-blobs: the packed code of static combos goes to one shared.vcsblob next to the vcs files, so code that is
+// the same in several shaders (ps20b/ps30, vs20/vs30, shared fallbacks) is kept once and the vcs files refer to it.
+// The file only grows, blobs nothing refers to anymore stay until it is deleted and all shaders are built again.
+namespace SharedBlobs
+{
+	// Smaller static combos stay in their vcs file, a reference would cost about as much
+	static constexpr size_t MIN_SIZE = 64;
+
+	// Opens the file in dir, or starts a new one, and learns the hashes of the blobs already in it
+	[[nodiscard]] bool Open( const std::filesystem::path& dir );
+	void Close();
+
+	// Reference to a blob of the packed code of a static combo followed by its end mark, appended if the file doesn't
+	// have it yet. false if it can't be written, the static combo then stays in the vcs file.
+	[[nodiscard]] bool Store( const uint8_t* pCode, size_t nSize, uint64_t nHash, SharedBlobReference_t& ref );
+
+	// Gets everything stored so far to the disk, before vcs files that refer to it replace the old ones
+	[[nodiscard]] bool Flush();
+
+	[[nodiscard]] uint64_t NumShared() noexcept; // References handed out to blobs that were already there
+}
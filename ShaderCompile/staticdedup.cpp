@@ -0,0 +1,167 @@
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "staticdedup.h"
+#include "compilecache.h"
+#include "d3dxfxc.h"
+#include "trace.h"
+#include "robin_hood.h"
+
+namespace StaticDedup
+{
+	static constexpr uint64_t NO_SIGNATURE = 0;
+
+	struct Job_t
+	{
+		const CfgProcessor::CfgEntryInfo* m_pEntry;
+		uint64_t m_nStaticCombo;
+		uint64_t* m_pSignature; // NO_SIGNATURE if the static combo can't be aliased
+	};
+
+	// Calls fn with every dynamic combo of the static combo that survives the skips, fn returns false to stop
+	template <typename TFn>
+	static void ForEachDynamicCombo( const CfgProcessor::CfgEntryInfo& entry, uint64_t nStaticCombo, TFn&& fn )
+	{
+		// Static combo s covers the commands [end - ( s + 1 ) * dynamic combos, end - s * dynamic combos)
+		const uint64_t iEnd				 = entry.m_iCommandEnd - nStaticCombo * entry.m_numDynamicCombos;
+		uint64_t iCommand				 = iEnd - entry.m_numDynamicCombos;
+		CfgProcessor::ComboHandle hCombo = nullptr;
+		for ( CfgProcessor::Combo_GetNext( iCommand, hCombo, iEnd ); hCombo && iCommand < iEnd; CfgProcessor::Combo_GetNext( iCommand, hCombo, iEnd ) )
+		{
+			if ( !fn( hCombo, CfgProcessor::Combo_GetComboNum( hCombo ) - nStaticCombo * entry.m_numDynamicCombos ) )
+				break;
+		}
+		CfgProcessor::Combo_Free( hCombo );
+	}
+
+	// The text of the static combo with its dynamic defines and SHADERCOMBO left out, and which dynamic combos survive
+	static uint64_t StaticSignature( const Job_t& job )
+	{
+		static thread_local CfgProcessor::ComboBuildCommand s_tlCommand;
+		static thread_local CfgProcessor::ComboBuildCommand s_tlStatic;
+		static thread_local std::string s_tlText;
+
+		uint64_t nSurviving = NO_SIGNATURE;
+		bool bBuilt			= false;
+		ForEachDynamicCombo( *job.m_pEntry, job.m_nStaticCombo, [&]( CfgProcessor::ComboHandle hCombo, uint64_t nDynamicCombo )
+		{
+			if ( !bBuilt )
+			{
+				CfgProcessor::Combo_BuildCommand( hCombo, s_tlCommand );
+				bBuilt = true;
+			}
+			nSurviving = CompileCache::HashBytes( &nDynamicCombo, sizeof( nDynamicCombo ), nSurviving );
+			return true;
+		} );
+		if ( !bBuilt )
+			return NO_SIGNATURE;
+
+		// Defines: SHADERCOMBO, SHADER_MODEL_, the dynamic ones, then the static ones. The macros end in a null one.
+		const size_t iFirstStatic = s_tlCommand.defines.size() - s_tlCommand.values.size() + job.m_pEntry->m_numDynamicDefines;
+		s_tlStatic.entryPoint	  = s_tlCommand.entryPoint;
+		s_tlStatic.fileName		  = s_tlCommand.fileName;
+		s_tlStatic.shaderModel	  = s_tlCommand.shaderModel;
+		s_tlStatic.macros.assign( 1, s_tlCommand.macros[1] );
+		s_tlStatic.macros.insert( s_tlStatic.macros.end(), s_tlCommand.macros.begin() + iFirstStatic, s_tlCommand.macros.end() );
+		if ( !Compiler::PreprocessCommand( s_tlStatic, s_tlText ) )
+			return NO_SIGNATURE;
+		return CompileCache::HashString( s_tlText, nSurviving ) | 1;
+	}
+
+	// The text of every dynamic combo that survives, in order
+	static uint64_t FullSignature( const Job_t& job )
+	{
+		static thread_local CfgProcessor::ComboBuildCommand s_tlCommand;
+		static thread_local std::string s_tlText;
+
+		uint64_t nSignature = NO_SIGNATURE;
+		bool bFailed		= false;
+		ForEachDynamicCombo( *job.m_pEntry, job.m_nStaticCombo, [&]( CfgProcessor::ComboHandle hCombo, uint64_t nDynamicCombo )
+		{
+			CfgProcessor::Combo_BuildCommand( hCombo, s_tlCommand );
+			if ( !Compiler::PreprocessCommand( s_tlCommand, s_tlText ) )
+			{
+				bFailed = true;
+				return false;
+			}
+			nSignature = CompileCache::HashBytes( &nDynamicCombo, sizeof( nDynamicCombo ), nSignature );
+			nSignature = CompileCache::HashString( s_tlText, nSignature );
+			return true;
+		} );
+		return bFailed ? NO_SIGNATURE : nSignature | 1;
+	}
+
+	template <typename TFn>
+	static void RunJobs( std::vector<Job_t>& jobs, uint32_t nThreads, TFn&& fn )
+	{
+		std::atomic<size_t> nNextJob = 0;
+		const auto& Run = [&jobs, &nNextJob, &fn]()
+		{
+			for ( size_t iJob; ( iJob = nNextJob++ ) < jobs.size(); )
+				*jobs[iJob].m_pSignature = fn( jobs[iJob] );
+		};
+
+		std::vector<std::thread> threads;
+		for ( uint32_t i = 1; i < nThreads; ++i )
+			threads.emplace_back( Run );
+		Run();
+		for ( std::thread& t : threads )
+			t.join();
+	}
+
+	std::vector<std::vector<StaticComboAliasRecordWide_t>> FindAliases( const CfgProcessor::CfgEntryInfo* pEntries, uint32_t nThreads )
+	{
+		const Trace::CScope trace{ "FindStaticAliases" };
+
+		std::vector<std::vector<uint64_t>> arrSignatures;
+		std::vector<Job_t> jobs;
+		for ( const CfgProcessor::CfgEntryInfo* pEntry = pEntries; pEntry && !pEntry->m_szName.empty(); ++pEntry )
+		{
+			std::vector<uint64_t>& signatures = arrSignatures.emplace_back( pEntry->m_numStaticCombos, NO_SIGNATURE );
+			if ( pEntry->m_numStaticCombos < 2 )
+				continue;
+			for ( uint64_t s = 0; s < pEntry->m_numStaticCombos; ++s )
+				jobs.emplace_back( Job_t{ pEntry, s, &signatures[s] } );
+		}
+		RunJobs( jobs, nThreads, StaticSignature );
+
+		// Static combos that preprocess alone like no other one can't be aliased, the rest is checked combo by combo
+		std::vector<Job_t> candidates;
+		robin_hood::unordered_flat_map<uint64_t, uint64_t> count;
+		for ( size_t iBegin = 0, iEnd; iBegin < jobs.size(); iBegin = iEnd )
+		{
+			iEnd = iBegin;
+			count.clear();
+			for ( ; iEnd < jobs.size() && jobs[iEnd].m_pEntry == jobs[iBegin].m_pEntry; ++iEnd )
+			{
+				if ( *jobs[iEnd].m_pSignature != NO_SIGNATURE )
+					++count[*jobs[iEnd].m_pSignature];
+			}
+			for ( size_t i = iBegin; i < iEnd; ++i )
+			{
+				if ( *jobs[i].m_pSignature != NO_SIGNATURE && count[*jobs[i].m_pSignature] > 1 )
+					candidates.emplace_back( jobs[i] );
+				else
+					*jobs[i].m_pSignature = NO_SIGNATURE;
+			}
+		}
+		RunJobs( candidates, nThreads, FullSignature );
+
+		std::vector<std::vector<StaticComboAliasRecordWide_t>> arrAliases( arrSignatures.size() );
+		robin_hood::unordered_flat_map<uint64_t, uint64_t> first;
+		for ( size_t i = 0; i < arrSignatures.size(); ++i )
+		{
+			first.clear();
+			for ( uint64_t s = 0; s < arrSignatures[i].size(); ++s )
+			{
+				if ( arrSignatures[i][s] == NO_SIGNATURE )
+					continue;
+				const auto [it, bInserted] = first.try_emplace( arrSignatures[i][s], s );
+				if ( !bInserted )
+					arrAliases[i].emplace_back( StaticComboAliasRecordWide_t{ s, it->second } );
+			}
+		}
+		return arrAliases;
+	}
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "cfgprocessor.h"
+#include "shader_vcs_version.h"
+
+// -dedup-static: finds static combos that compile the same as another one before anything is compiled. Every static
+// combo is preprocessed once with only its static defines, which picks the candidates. A candidate is aliased to the
+// first static combo of its entry whose dynamic combos survive the skips the same way and all preprocess to the same
+// text, so none of its dynamic combos are compiled.
+namespace StaticDedup
+{
+	// One list per entry of pEntries, sorted by m_nStaticComboID, every source is a static combo that isn't aliased
+	[[nodiscard]] std::vector<std::vector<StaticComboAliasRecordWide_t>> FindAliases( const CfgProcessor::CfgEntryInfo* pEntries, uint32_t nThreads );
+}
@@ -0,0 +1,138 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "status.h"
+#include "gsl/narrow"
+
+#ifdef _WIN32
+#pragma comment( lib, "Ws2_32" )
+#endif
+
+using namespace std::literals;
+
+namespace Status
+{
+#ifndef _WIN32
+	using SOCKET = int;
+	static constexpr int INVALID_SOCKET = -1;
+	static constexpr int SOCKET_ERROR	= -1;
+	static constexpr int SD_BOTH		= SHUT_RDWR;
+	static constexpr int SD_SEND		= SHUT_WR;
+	static int closesocket( int s ) { return close( s ); }
+#endif
+
+	static SOCKET s_Listener = INVALID_SOCKET;
+	static std::thread s_Thread;
+
+	static std::mutex s_mtx;
+	static std::string s_Json = "{}";
+
+	static void Serve( SOCKET s )
+	{
+		std::string response;
+		{
+			std::lock_guard guard{ s_mtx };
+			response = "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\nCache-Control: no-store\r\nContent-Length: "s + std::to_string( s_Json.size() ) + "\r\n\r\n"s + s_Json;
+		}
+		for ( const char* p = response.data(), *pEnd = p + response.size(); p < pEnd; )
+		{
+			const int nSent = send( s, p, gsl::narrow<int>( pEnd - p ), 0 );
+			if ( nSent <= 0 )
+				break;
+			p += nSent;
+		}
+
+		// Whatever the client sent is read before closing, or the close may reset the connection before it got the reply
+		shutdown( s, SD_SEND );
+#ifdef _WIN32
+		const DWORD timeout = 1000;
+#else
+		const timeval timeout{ 1, 0 };
+#endif
+		setsockopt( s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>( &timeout ), sizeof( timeout ) );
+		char buf[512];
+		while ( recv( s, buf, sizeof( buf ), 0 ) > 0 )
+			;
+		closesocket( s );
+	}
+
+	bool Start( std::string_view port )
+	{
+#ifdef _WIN32
+		WSADATA wsaData;
+		if ( WSAStartup( MAKEWORD( 2, 2 ), &wsaData ) != 0 )
+			return false;
+#else
+		// A client that went away shows up as a failed send, not as a signal that ends this process
+		signal( SIGPIPE, SIG_IGN );
+#endif
+
+		addrinfo hints{};
+		hints.ai_family	  = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+		addrinfo* pAddress = nullptr;
+		const std::string szPort( port );
+		if ( getaddrinfo( "127.0.0.1", szPort.c_str(), &hints, &pAddress ) != 0 )
+			return false;
+
+		const SOCKET listener = socket( pAddress->ai_family, pAddress->ai_socktype, pAddress->ai_protocol );
+		const bool bListening = listener != INVALID_SOCKET && bind( listener, pAddress->ai_addr, gsl::narrow<int>( pAddress->ai_addrlen ) ) != SOCKET_ERROR && listen( listener, SOMAXCONN ) != SOCKET_ERROR;
+		freeaddrinfo( pAddress );
+		if ( !bListening )
+		{
+			if ( listener != INVALID_SOCKET )
+				closesocket( listener );
+			return false;
+		}
+
+		// Clients only read a snapshot, one at a time is plenty
+		s_Listener = listener;
+		s_Thread   = std::thread( [listener]
+		{
+			for ( SOCKET s; ( s = accept( listener, nullptr, nullptr ) ) != INVALID_SOCKET; )
+				Serve( s );
+		} );
+		return true;
+	}
+
+	bool Enabled() noexcept
+	{
+		return s_Listener != INVALID_SOCKET;
+	}
+
+	void Publish( std::string json )
+	{
+		std::lock_guard guard{ s_mtx };
+		s_Json = std::move( json );
+	}
+
+	void Finish()
+	{
+		if ( s_Listener == INVALID_SOCKET )
+			return;
+
+		// Either of them makes accept return, depending on the platform
+		shutdown( s_Listener, SD_BOTH );
+		closesocket( s_Listener );
+		s_Listener = INVALID_SOCKET;
+		if ( s_Thread.joinable() )
+			s_Thread.join();
+	}
+}
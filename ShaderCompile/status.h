@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// -status-port: the progress of the build as json on a local port, for build systems and IDEs that would otherwise read
+// the console. Every connection gets the last snapshot and is closed, plain HTTP so curl works as well. The build only
+// hands over a new snapshot, it never waits for a client.
+namespace Status
+{
+	// Listens on 127.0.0.1 only, false if the port can't be had
+	[[nodiscard]] bool Start( std::string_view port );
+	[[nodiscard]] bool Enabled() noexcept;
+
+	// What connections get from now on
+	void Publish( std::string json );
+
+	void Finish();
+}
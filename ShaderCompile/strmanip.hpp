@@ -12,7 +12,7 @@ struct _Smanip2
 		return _Ostr;
 	}
 
-	void(__cdecl* _Pfun)(std::ostream&, _Arg);
+	void(* _Pfun)(std::ostream&, _Arg);
 	_Arg _Manarg;
 };
 
@@ -25,7 +25,7 @@ static inline void __PrettyPrintNumber( std::ostream& s, uint64_t k )
 		( j && !( j % 3 ) ) ? ( *pchPrint-- = ',' ) : 0;
 		*pchPrint-- = '0' + char( k % 10 );
 	}
-	*++pchPrint ? 0 : *pchPrint = 0;
+	*++pchPrint ? 0 : *pchPrint = '0';
 	s << pchPrint;
 }
 
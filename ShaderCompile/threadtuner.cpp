@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+#include "threadtuner.h"
+#include "gsl/narrow"
+#include "movingaverage.hpp"
+#include "platform.h"
+#include "robin_hood.h"
+
+namespace fs	 = std::filesystem;
+namespace chrono = std::chrono;
+
+namespace ThreadTuner
+{
+	static constexpr uint32_t WINDOW_SECONDS = 5;
+	static constexpr double SAME_RATE		 = 0.03; // Rates closer than this apart are noise
+
+	static fs::path s_File;
+	static std::string s_szMachine;
+	static uint32_t s_nWorkers = 0; // 0 until Start
+	static std::atomic<uint32_t> s_nActive = ~0U;
+	static std::atomic<uint32_t> s_nBest;
+	static std::atomic<uint64_t> s_nBestRate;
+
+	// Only touched with s_mtx held
+	static std::mutex s_mtx;
+	static chrono::steady_clock::time_point s_tNext;
+	static uint64_t s_nLastDone = 0;
+	static uint32_t s_nSeconds	= 0;
+	static int32_t s_nStep		= 0; // Of the last move, 0 once settled
+	static uint64_t s_nLastRate = 0; // Of the window before the last move
+	static CUtlMovingAverage<uint64_t, WINDOW_SECONDS> s_Average;
+
+	using Tuned_t = robin_hood::unordered_flat_map<std::string, uint32_t>;
+
+	// A line of machine and workers each, a missing or broken file just means nothing is known
+	static Tuned_t ReadTuned( const fs::path& file )
+	{
+		Tuned_t tuned;
+		std::ifstream f( file );
+		std::string machine;
+		for ( uint32_t nWorkers; f >> machine >> nWorkers; )
+			tuned[machine] = nWorkers;
+		return tuned;
+	}
+
+	void Start( const fs::path& file, uint32_t nWorkers )
+	{
+		// A machine that got more or fewer processors is tuned afresh
+		s_File		= file;
+		s_szMachine = Platform::MachineName() + '/' + std::to_string( Platform::NumLogicalProcessors() );
+		s_nWorkers	= std::max( nWorkers, 1U );
+
+		const Tuned_t tuned = ReadTuned( file );
+		const auto it		= tuned.find( s_szMachine );
+		const bool bKnown	= it != tuned.end();
+		const uint32_t nStart = bKnown ? std::clamp( it->second, 1U, s_nWorkers ) : s_nWorkers;
+		s_nActive = nStart;
+		s_nBest	  = nStart;
+
+		// Fewer workers go first, that is where SMT siblings stop hurting. Next to a known optimum only small steps are left.
+		s_nStep = -static_cast<int32_t>( bKnown ? 1 : std::max( s_nWorkers / 4, 1U ) );
+	}
+
+	bool Enabled() noexcept
+	{
+		return s_nWorkers != 0;
+	}
+
+	void Update( uint64_t nCombosDone )
+	{
+		if ( !s_nWorkers )
+			return;
+		std::unique_lock guard{ s_mtx, std::try_to_lock };
+		const chrono::steady_clock::time_point tNow = chrono::steady_clock::now();
+		if ( !guard || !s_nStep || tNow < s_tNext )
+			return;
+		s_tNext = tNow + chrono::seconds( 1 );
+
+		// The first second after a move is workers starting or stopping. A new build counts from 0 again.
+		if ( nCombosDone < s_nLastDone )
+		{
+			s_nSeconds = 0;
+			s_Average.Reset();
+		}
+		const uint64_t nDelta = nCombosDone - std::min( nCombosDone, s_nLastDone );
+		s_nLastDone			  = nCombosDone;
+		if ( s_nSeconds++ == 0 )
+			return;
+		s_Average.PushValue( nDelta );
+		if ( s_nSeconds <= WINDOW_SECONDS )
+			return;
+
+		const uint64_t nRate = s_Average.GetAverage();
+		s_Average.Reset();
+		s_nSeconds = 0;
+
+		// The same rate with fewer workers is better, with more it isn't
+		const uint32_t nActive = s_nActive;
+		const double flRate = static_cast<double>( nRate ), flLast = static_cast<double>( s_nLastRate );
+		bool bBetter;
+		if ( !s_nLastRate || flRate > flLast * ( 1.0 + SAME_RATE ) )
+			bBetter = true;
+		else if ( flRate < flLast * ( 1.0 - SAME_RATE ) )
+			bBetter = false;
+		else
+			bBetter = s_nStep < 0;
+		s_nLastRate = nRate;
+
+		if ( bBetter )
+		{
+			s_nBest		= nActive;
+			s_nBestRate = nRate;
+		}
+		else
+			s_nStep = -s_nStep / 2;
+
+		const uint32_t nNext = static_cast<uint32_t>( std::clamp<int64_t>( static_cast<int64_t>( nActive ) + s_nStep, 1, s_nWorkers ) );
+		if ( !s_nStep || nNext == nActive )
+		{
+			s_nStep	  = 0;
+			s_nActive = s_nBest.load();
+			return;
+		}
+		s_nActive = nNext;
+	}
+
+	bool MayRun( uint32_t iWorker ) noexcept
+	{
+		return iWorker < s_nActive.load( std::memory_order_relaxed );
+	}
+
+	uint32_t Best() noexcept
+	{
+		return s_nBest;
+	}
+
+	uint64_t BestRate() noexcept
+	{
+		return s_nBestRate;
+	}
+
+	void Save()
+	{
+		if ( !s_nWorkers )
+			return;
+
+		// Other machines may have saved theirs since Start
+		Tuned_t tuned	   = ReadTuned( s_File );
+		tuned[s_szMachine] = s_nBest;
+		std::ofstream f( s_File, std::ios::trunc );
+		for ( const auto& [machine, nWorkers] : tuned )
+			f << machine << ' ' << nWorkers << '\n';
+	}
+}
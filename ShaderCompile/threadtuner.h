@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+// -auto-threads: looks for the number of workers that compiles the most combos a second. The compiler often peaks well
+// below the number of logical processors, SMT siblings slow it down. Every window the number of active workers moves by
+// a step, the same way while throughput rises and back with half the step once it drops. Where it settles is kept per
+// machine, the next run starts from there.
+namespace ThreadTuner
+{
+	// Starts at what the last run on this machine settled on, or all of nWorkers the first time
+	void Start( const std::filesystem::path& file, uint32_t nWorkers );
+	[[nodiscard]] bool Enabled() noexcept;
+
+	// Measures combos a second from nCombosDone and moves the active workers once a window is full.
+	// Whoever gets here first after a second does it, the others return right away.
+	void Update( uint64_t nCombosDone );
+	// Worker iWorker is one of the active ones
+	[[nodiscard]] bool MayRun( uint32_t iWorker ) noexcept;
+
+	// The active workers of the last window throughput rose, and its combos a second
+	[[nodiscard]] uint32_t Best() noexcept;
+	[[nodiscard]] uint64_t BestRate() noexcept;
+
+	// Keeps Best for this machine, the entries of other machines in the file stay
+	void Save();
+}
@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+
+namespace fs = std::filesystem;
+
+namespace Trace
+{
+	struct Event_t
+	{
+		const char* m_szName;
+		std::string_view m_Detail;
+		int64_t m_nStart;
+		int64_t m_nDuration;
+		uint64_t m_nStaticCombo;
+		uint64_t m_nDynamicCombo;
+	};
+
+	// Only its own thread touches a buffer until Finish
+	struct ThreadBuffer_t
+	{
+		uint32_t m_nThread;
+		std::deque<Event_t> m_Events;	// Grows without moving what is recorded
+		std::deque<std::string> m_Kept;
+	};
+
+	static fs::path s_Path;
+	static bool s_bEnabled = false;
+	static std::chrono::steady_clock::time_point s_tStart;
+	static std::mutex s_mtxBuffers;
+	static std::vector<std::unique_ptr<ThreadBuffer_t>> s_Buffers; // Outlive their threads
+	static thread_local ThreadBuffer_t* s_tlBuffer;
+
+	static ThreadBuffer_t& ThreadBuffer()
+	{
+		if ( !s_tlBuffer )
+		{
+			std::lock_guard guard{ s_mtxBuffers };
+			auto& pBuffer = s_Buffers.emplace_back( std::make_unique<ThreadBuffer_t>() );
+			pBuffer->m_nThread = static_cast<uint32_t>( s_Buffers.size() );
+			s_tlBuffer = pBuffer.get();
+		}
+		return *s_tlBuffer;
+	}
+
+	void Initialize( const fs::path& path, bool bInMemory )
+	{
+		s_Path     = path;
+		s_bEnabled = !path.empty() || bInMemory;
+		s_tStart   = std::chrono::steady_clock::now();
+	}
+
+	bool Enabled() noexcept
+	{
+		return s_bEnabled;
+	}
+
+	int64_t Now() noexcept
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - s_tStart ).count();
+	}
+
+	std::string_view Keep( std::string_view str )
+	{
+		return ThreadBuffer().m_Kept.emplace_back( str );
+	}
+
+	void Record( const char* szName, std::string_view detail, int64_t nStart, uint64_t nStaticCombo, uint64_t nDynamicCombo )
+	{
+		ThreadBuffer().m_Events.emplace_back( Event_t{ szName, detail, nStart, Now() - nStart, nStaticCombo, nDynamicCombo } );
+	}
+
+	static void WriteString( std::ostream& out, std::string_view str )
+	{
+		out << '"';
+		for ( const char c : str )
+		{
+			if ( c == '"' || c == '\\' )
+				out << '\\' << c;
+			else if ( static_cast<unsigned char>( c ) >= ' ' )
+				out << c;
+		}
+		out << '"';
+	}
+
+	// Microseconds with the nanoseconds after the point
+	static void WriteTime( std::ostream& out, int64_t nNanoseconds )
+	{
+		char buf[32];
+		snprintf( buf, sizeof( buf ), "%lld.%03lld", static_cast<long long>( nNanoseconds / 1000 ), static_cast<long long>( nNanoseconds % 1000 ) );
+		out << buf;
+	}
+
+	std::vector<Total_t> Totals()
+	{
+		std::vector<Total_t> totals;
+		std::lock_guard guard{ s_mtxBuffers };
+		for ( const auto& pBuffer : s_Buffers )
+		{
+			for ( const Event_t& event : pBuffer->m_Events )
+			{
+				// Names are literals, a handful of them
+				auto it = std::find_if( totals.begin(), totals.end(), [&event]( const Total_t& total ) { return std::string_view( total.m_szName ) == event.m_szName; } );
+				if ( it == totals.end() )
+					it = totals.insert( totals.end(), Total_t{ event.m_szName, 0, 0 } );
+				++it->m_nEvents;
+				it->m_nNanoseconds += event.m_nDuration;
+			}
+		}
+		return totals;
+	}
+
+	void Finish()
+	{
+		if ( !s_bEnabled )
+			return;
+		s_bEnabled = false;
+		if ( s_Path.empty() )
+			return;
+
+		std::ofstream out( s_Path, std::ios::trunc );
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+		bool bFirst = true;
+		std::lock_guard guard{ s_mtxBuffers };
+		for ( const auto& pBuffer : s_Buffers )
+		{
+			for ( const Event_t& event : pBuffer->m_Events )
+			{
+				out << ( bFirst ? "" : ",\n" ) << "{\"ph\":\"X\",\"pid\":1,\"tid\":" << pBuffer->m_nThread << ",\"name\":";
+				WriteString( out, event.m_szName );
+				out << ",\"ts\":";
+				WriteTime( out, event.m_nStart );
+				out << ",\"dur\":";
+				WriteTime( out, event.m_nDuration );
+				if ( !event.m_Detail.empty() || event.m_nStaticCombo != NO_ID )
+				{
+					out << ",\"args\":{";
+					const char* szSeparator = "";
+					if ( !event.m_Detail.empty() )
+					{
+						out << "\"name\":";
+						WriteString( out, event.m_Detail );
+						szSeparator = ",";
+					}
+					if ( event.m_nStaticCombo != NO_ID )
+						out << szSeparator << "\"static\":" << event.m_nStaticCombo;
+					if ( event.m_nDynamicCombo != NO_ID )
+						out << ",\"dynamic\":" << event.m_nDynamicCombo;
+					out << '}';
+				}
+				out << '}';
+				bFirst = false;
+			}
+		}
+		out << "\n]}\n";
+	}
+}
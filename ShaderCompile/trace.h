@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+#include <vector>
+
+// Chrome trace of the whole build, for chrome://tracing or Perfetto. Every thread records
+// into a buffer of its own, nothing is formatted or written before Finish.
+namespace Trace
+{
+	static constexpr uint64_t NO_ID = ~0ULL;
+
+	// Empty path leaves tracing off, unless bInMemory keeps the events for Totals without writing them
+	void Initialize( const std::filesystem::path& path, bool bInMemory = false );
+	[[nodiscard]] bool Enabled() noexcept;
+
+	// Writes every event recorded so far
+	void Finish();
+
+	struct Total_t
+	{
+		const char* m_szName;
+		uint64_t m_nEvents;
+		int64_t m_nNanoseconds;
+	};
+
+	// Events of every name added up over all threads, in the order the names were first recorded
+	[[nodiscard]] std::vector<Total_t> Totals();
+
+	// Copy of str that lives until Finish, for details that don't live that long on their own
+	[[nodiscard]] std::string_view Keep( std::string_view str );
+
+	// Nanoseconds since Initialize
+	[[nodiscard]] int64_t Now() noexcept;
+	void Record( const char* szName, std::string_view detail, int64_t nStart, uint64_t nStaticCombo, uint64_t nDynamicCombo );
+
+	// Records its lifetime as one event. szName has to be a literal and detail has to outlive Finish.
+	class CScope
+	{
+	public:
+		explicit CScope( const char* szName, std::string_view detail = {}, uint64_t nStaticCombo = NO_ID, uint64_t nDynamicCombo = NO_ID ) noexcept
+			: m_szName( Enabled() ? szName : nullptr ), m_Detail( detail ), m_nStaticCombo( nStaticCombo ), m_nDynamicCombo( nDynamicCombo ), m_nStart( m_szName ? Now() : 0 )
+		{
+		}
+
+		~CScope()
+		{
+			if ( m_szName )
+				Record( m_szName, m_Detail, m_nStart, m_nStaticCombo, m_nDynamicCombo );
+		}
+
+		CScope( const CScope& ) = delete;
+		CScope& operator=( const CScope& ) = delete;
+
+	private:
+		const char* m_szName;
+		std::string_view m_Detail;
+		uint64_t m_nStaticCombo;
+		uint64_t m_nDynamicCombo;
+		int64_t m_nStart;
+	};
+}
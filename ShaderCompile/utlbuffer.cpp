@@ -8,6 +8,7 @@
 
 #include "utlbuffer.h"
 
+#include <algorithm>
 #include <cctype>
 #include <climits>
 #include <cstdarg>
@@ -1413,7 +1414,7 @@ void CUtlBuffer::PutDelimitedString( CUtlCharConversion* pConv, const char* pStr
 void CUtlBuffer::VaPrintf( const char* pFmt, va_list list )
 {
 	char temp[2048];
-	const int nLen = vsnprintf( temp, sizeof( temp ), pFmt, list );
+	[[maybe_unused]] const int nLen = vsnprintf( temp, sizeof( temp ), pFmt, list );
 	Assert( nLen < 2048 );
 	PutString( temp );
 }
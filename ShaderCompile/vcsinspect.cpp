@@ -0,0 +1,606 @@
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vcsinspect.h"
+#include "compilecache.h"
+#include "platform.h"
+#include "shader_vcs_version.h"
+#include "termcolor/style.hpp"
+#include "termcolors.hpp"
+#include "strmanip.hpp"
+#include "robin_hood.h"
+
+extern "C" {
+#define _7ZIP_ST
+
+#include "C/7zTypes.h"
+#include "C/LzmaDec.c"
+
+#undef _7ZIP_ST
+}
+
+using namespace std::literals;
+namespace fs = std::filesystem;
+
+namespace VcsInspect
+{
+	static constexpr uint32_t END_MARK		  = 0xffffffff;
+	static constexpr uint32_t LZMA_ID		  = ( 'A' << 24 ) + ( 'M' << 16 ) + ( 'Z' << 8 ) + 'L';
+	static constexpr size_t LZMA_HEADER_SIZE  = 17; // id, actual size, lzma size, properties
+	static constexpr size_t MAX_ERRORS_SHOWN  = 20;
+
+	using Platform::CMappedFile;
+
+	struct DynamicCombo_t
+	{
+		uint32_t m_nComboID;
+		uint32_t m_nSize;
+		uint64_t m_nHash;
+		uint32_t m_nBlock;	// Of its static combo
+		uint32_t m_nOffset; // Of its id in the unpacked block
+	};
+
+	struct StaticCombo_t
+	{
+		uint64_t m_nStaticComboID;
+		uint32_t m_nFileOffset;
+		uint32_t m_nPackedSize = 0;
+		uint32_t m_nBlocks	   = 0;
+		uint64_t m_nUnpackedSize = 0;
+		uint64_t m_nHash	   = 0; // Of all dynamic combos
+		bool m_bShared		   = false; // Its blocks are in shared.vcsblob
+		std::vector<DynamicCombo_t> m_DynamicCombos{};
+		std::string m_Error{};
+	};
+
+	struct Shader_t
+	{
+		fs::path m_Path;
+		ShaderHeader_t m_Header{};
+		uint64_t m_nDynamicCombos = 0; // Of the header, or of the wide header in version 8
+		uint64_t m_nFileSize	  = 0;
+		std::vector<StaticCombo_t> m_StaticCombos;				// Sorted by id, without the sentinel
+		std::vector<StaticComboAliasRecordWide_t> m_Aliases;
+		std::vector<uint8_t> m_Dictionary;						// What primed blocks decode after, version 7 and 8 only
+		std::vector<uint32_t> m_IndexFirst;						// First index entry of every record, empty without a dynamic combo index
+		std::vector<DynamicComboIndexRecord_t> m_IndexEntries;
+		robin_hood::unordered_flat_map<uint64_t, size_t> m_Index; // Static combo id, aliases included, to m_StaticCombos
+		std::vector<std::string> m_Errors;
+
+		[[nodiscard]] const StaticCombo_t* Find( uint64_t nStaticComboID ) const
+		{
+			const auto it = m_Index.find( nStaticComboID );
+			return it != m_Index.end() ? &m_StaticCombos[it->second] : nullptr;
+		}
+	};
+
+	// A primed block decodes after its dictionary, so out holds the dictionary first and the block nDictionarySize bytes in
+	static bool DecodeLzma( const uint8_t* pData, size_t nSize, const uint8_t* pDictionary, size_t nDictionarySize, std::vector<uint8_t>& out, std::string& error )
+	{
+		uint32_t header[3];
+		if ( nSize < LZMA_HEADER_SIZE )
+		{
+			error = "truncated LZMA header";
+			return false;
+		}
+		memcpy( header, pData, sizeof( header ) );
+		if ( header[0] != LZMA_ID || header[2] != nSize - LZMA_HEADER_SIZE )
+		{
+			error = "bad LZMA header";
+			return false;
+		}
+
+		static ISzAlloc s_Alloc = { []( void*, size_t size ) { return malloc( size ); }, []( void*, void* p ) { free( p ); } };
+		out.resize( nDictionarySize + header[1] );
+		std::copy( pDictionary, pDictionary + nDictionarySize, out.begin() );
+
+		CLzmaDec dec;
+		LzmaDec_Construct( &dec );
+		if ( LzmaDec_AllocateProbs( &dec, pData + 12, LZMA_PROPS_SIZE, &s_Alloc ) != SZ_OK )
+		{
+			error = "bad LZMA properties";
+			return false;
+		}
+		dec.dic		   = out.data();
+		dec.dicBufSize = out.size();
+		LzmaDec_Init( &dec );
+		// Go on from the dictionary as if it had just been decoded
+		dec.dicPos		 = nDictionarySize;
+		dec.processedPos = static_cast<UInt32>( nDictionarySize );
+
+		SizeT nSrcLen = header[2];
+		ELzmaStatus status;
+		const SRes res = LzmaDec_DecodeToDic( &dec, out.size(), pData + LZMA_HEADER_SIZE, &nSrcLen, LZMA_FINISH_END, &status );
+		const bool bDecoded = res == SZ_OK && dec.dicPos == out.size();
+		LzmaDec_FreeProbs( &dec, &s_Alloc );
+		if ( !bDecoded )
+		{
+			error = "LZMA block does not decode";
+			return false;
+		}
+		return true;
+	}
+
+	// Walks the blocks of one static combo, nothing is trusted
+	static void DecodeStaticCombo( const uint8_t* pFile, uint32_t nEnd, const Shader_t& shader, const CMappedFile* pShared, StaticCombo_t& combo, std::vector<uint8_t>& lzma )
+	{
+		const uint64_t nDynamicCombos = shader.m_nDynamicCombos;
+		const auto& Fail = [&combo]( std::string&& error ) { combo.m_Error = std::move( error ); };
+
+		// A reference of -shared-blobs, the blocks and end mark are in shared.vcsblob
+		uint32_t nPos = combo.m_nFileOffset;
+		uint32_t reference[2]; // flags and size, end mark
+		SharedBlobReference_t ref;
+		if ( shader.m_Header.m_nVersion != SHADER_VCS_VERSION_NUMBER && nEnd - nPos == sizeof( reference ) + sizeof( ref ) )
+		{
+			memcpy( &reference[0], pFile + nPos, sizeof( uint32_t ) );
+			memcpy( &ref, pFile + nPos + sizeof( uint32_t ), sizeof( ref ) );
+			memcpy( &reference[1], pFile + nEnd - sizeof( uint32_t ), sizeof( uint32_t ) );
+			if ( reference[0] == ( SHADER_BLOCK_SHARED | sizeof( ref ) ) && reference[1] == END_MARK )
+			{
+				combo.m_bShared = true;
+				uint32_t header[2];
+				uint64_t nFileId;
+				if ( !pShared || pShared->Size() < SHARED_BLOB_FILE_HEADER_SIZE )
+					return Fail( "refers to shared.vcsblob, which isn't there" );
+				memcpy( header, pShared->Data(), sizeof( header ) );
+				memcpy( &nFileId, pShared->Data() + sizeof( header ), sizeof( nFileId ) );
+				if ( header[0] != SHARED_BLOB_MAGIC || header[1] != SHARED_BLOB_VERSION || nFileId != ref.m_nFileId )
+					return Fail( "refers to another shared.vcsblob" );
+				if ( ref.m_nOffset < SHARED_BLOB_FILE_HEADER_SIZE || uint64_t( ref.m_nOffset ) + ref.m_nSize > pShared->Size() )
+					return Fail( "runs past the end of shared.vcsblob" );
+				pFile = pShared->Data();
+				nPos  = ref.m_nOffset;
+				nEnd  = ref.m_nOffset + ref.m_nSize;
+			}
+		}
+
+		for ( ;; )
+		{
+			uint32_t nFlagSize;
+			if ( nPos + sizeof( nFlagSize ) > nEnd )
+				return Fail( "runs into the next static combo" );
+			memcpy( &nFlagSize, pFile + nPos, sizeof( nFlagSize ) );
+			nPos += sizeof( nFlagSize );
+
+			if ( nFlagSize == END_MARK )
+			{
+				if ( nPos != nEnd )
+					return Fail( "data after the end mark" );
+				break;
+			}
+
+			const uint32_t nSize = nFlagSize & 0x3fffffff;
+			if ( nPos + nSize > nEnd )
+				return Fail( "block runs into the next static combo" );
+
+			const uint8_t* pBlock = pFile + nPos;
+			size_t nBlockSize	  = nSize;
+			switch ( nFlagSize & 0xc0000000 )
+			{
+			case 0x80000000: // uncompressed
+				break;
+			case 0x40000000:
+				if ( !DecodeLzma( pBlock, nSize, nullptr, 0, lzma, combo.m_Error ) )
+					return;
+				pBlock	   = lzma.data();
+				nBlockSize = lzma.size();
+				break;
+			case SHADER_BLOCK_PRIMED:
+				if ( shader.m_Dictionary.empty() )
+					return Fail( "primed block without a dictionary" );
+				if ( !DecodeLzma( pBlock, nSize, shader.m_Dictionary.data(), shader.m_Dictionary.size(), lzma, combo.m_Error ) )
+					return;
+				pBlock	   = lzma.data() + shader.m_Dictionary.size();
+				nBlockSize = lzma.size() - shader.m_Dictionary.size();
+				break;
+			default:
+				return Fail( "bzip2 or unknown block type" );
+			}
+			nPos += nSize;
+			combo.m_nPackedSize += sizeof( nFlagSize ) + nSize;
+			combo.m_nUnpackedSize += nBlockSize;
+			++combo.m_nBlocks;
+
+			for ( size_t i = 0; i < nBlockSize; )
+			{
+				uint32_t rec[2]; // id, size
+				if ( i + sizeof( rec ) > nBlockSize )
+					return Fail( "truncated dynamic combo" );
+				memcpy( rec, pBlock + i, sizeof( rec ) );
+				i += sizeof( rec );
+				if ( i + rec[1] > nBlockSize )
+					return Fail( "dynamic combo runs past its block" );
+				if ( rec[0] >= nDynamicCombos )
+					return Fail( "dynamic combo " + std::to_string( rec[0] ) + " out of range" );
+
+				// Only the code goes into the hash of a dynamic combo, the same code under another id is a duplicate
+				const uint64_t nComboHash = CompileCache::HashBytes( pBlock + i, rec[1], 0 );
+				combo.m_DynamicCombos.emplace_back( DynamicCombo_t{ rec[0], rec[1], nComboHash, combo.m_nBlocks - 1, static_cast<uint32_t>( i - sizeof( rec ) ) } );
+				i += rec[1];
+			}
+		}
+
+		// Blocks can group dynamic combos in any order, compare them by id
+		std::sort( combo.m_DynamicCombos.begin(), combo.m_DynamicCombos.end(), []( const DynamicCombo_t& a, const DynamicCombo_t& b ) { return a.m_nComboID < b.m_nComboID; } );
+		uint64_t nHash = 0;
+		for ( size_t i = 0; i < combo.m_DynamicCombos.size(); ++i )
+		{
+			const DynamicCombo_t& dyn = combo.m_DynamicCombos[i];
+			if ( i && dyn.m_nComboID == combo.m_DynamicCombos[i - 1].m_nComboID )
+				return Fail( "dynamic combo " + std::to_string( dyn.m_nComboID ) + " stored twice" );
+			const uint64_t idHash[] = { dyn.m_nComboID, dyn.m_nHash };
+			nHash = CompileCache::HashBytes( idHash, sizeof( idHash ), nHash );
+		}
+		combo.m_nHash = nHash;
+	}
+
+	static bool Load( const fs::path& path, const CMappedFile& file, uint32_t nThreads, Shader_t& shader )
+	{
+		shader.m_Path	   = path;
+		shader.m_nFileSize = file.Size();
+		const uint8_t* pFile = file.Data();
+		const auto& Fail = [&shader]( std::string&& error )
+		{
+			shader.m_Errors.emplace_back( std::move( error ) );
+			return false;
+		};
+
+		if ( !pFile )
+			return Fail( "can't be opened" );
+		if ( file.Size() < sizeof( ShaderHeader_t ) || file.Size() > UINT32_MAX )
+			return Fail( "bad size" );
+		memcpy( &shader.m_Header, pFile, sizeof( ShaderHeader_t ) );
+		const int32_t nVersion = shader.m_Header.m_nVersion;
+		if ( nVersion != SHADER_VCS_VERSION_NUMBER && nVersion != SHADER_VCS_DICTIONARY_VERSION_NUMBER && nVersion != SHADER_VCS_WIDE_VERSION_NUMBER )
+			return Fail( "version "s + std::to_string( nVersion ) + ", expected "s + std::to_string( SHADER_VCS_VERSION_NUMBER ) + " to "s + std::to_string( SHADER_VCS_WIDE_VERSION_NUMBER ) );
+
+		// Version 8 has 64-bit ids and its totals in a second header
+		const bool bWide		  = nVersion == SHADER_VCS_WIDE_VERSION_NUMBER;
+		const size_t nRecordSize  = bWide ? sizeof( StaticComboRecordWide_t ) : sizeof( StaticComboRecord_t );
+		const size_t nAliasSize	  = bWide ? sizeof( StaticComboAliasRecordWide_t ) : sizeof( StaticComboAliasRecord_t );
+		const uint64_t nSentinel  = bWide ? UINT64_MAX : END_MARK;
+		size_t nPos				  = sizeof( ShaderHeader_t );
+		shader.m_nDynamicCombos	  = static_cast<uint32_t>( shader.m_Header.m_nDynamicCombos );
+		if ( bWide )
+		{
+			ShaderHeaderWide_t wideHeader;
+			if ( nPos + sizeof( wideHeader ) > file.Size() )
+				return Fail( "wide header runs past the end" );
+			memcpy( &wideHeader, pFile + nPos, sizeof( wideHeader ) );
+			nPos += sizeof( wideHeader );
+			shader.m_nDynamicCombos = wideHeader.m_nDynamicCombos;
+		}
+
+		const uint32_t nRecords = shader.m_Header.m_nNumStaticCombos;
+		if ( !nRecords || nPos + uint64_t( nRecords ) * nRecordSize + sizeof( uint32_t ) > file.Size() )
+			return Fail( "dictionary runs past the end" );
+
+		std::vector<StaticComboRecordWide_t> records( nRecords );
+		for ( StaticComboRecordWide_t& rec : records )
+		{
+			if ( bWide )
+				memcpy( &rec, pFile + nPos, sizeof( rec ) );
+			else
+			{
+				StaticComboRecord_t narrowRec;
+				memcpy( &narrowRec, pFile + nPos, sizeof( narrowRec ) );
+				rec = { narrowRec.m_nStaticComboID, narrowRec.m_nFileOffset };
+			}
+			nPos += nRecordSize;
+		}
+
+		uint32_t nAliases;
+		memcpy( &nAliases, pFile + nPos, sizeof( nAliases ) );
+		nPos += sizeof( nAliases );
+		if ( nPos + uint64_t( nAliases ) * nAliasSize > file.Size() )
+			return Fail( "alias table runs past the end" );
+		shader.m_Aliases.resize( nAliases );
+		for ( StaticComboAliasRecordWide_t& alias : shader.m_Aliases )
+		{
+			if ( bWide )
+				memcpy( &alias, pFile + nPos, sizeof( alias ) );
+			else
+			{
+				StaticComboAliasRecord_t narrowAlias;
+				memcpy( &narrowAlias, pFile + nPos, sizeof( narrowAlias ) );
+				alias = { narrowAlias.m_nStaticComboID, narrowAlias.m_nSourceStaticCombo };
+			}
+			nPos += nAliasSize;
+		}
+
+		// In load order a static combo runs up to the next one in the file, not to the next record
+		const bool bLoadOrder = nVersion != SHADER_VCS_VERSION_NUMBER && ( shader.m_Header.m_nFlags & SHADER_FLAG_LOAD_ORDER );
+		std::vector<uint32_t> offsets( nRecords );
+		for ( uint32_t i = 0; i < nRecords; ++i )
+			offsets[i] = records[i].m_nFileOffset;
+		std::sort( offsets.begin(), offsets.end() );
+		const auto& EndOf = [&]( uint32_t i )
+		{
+			const auto it = std::upper_bound( offsets.begin(), offsets.end(), records[i].m_nFileOffset );
+			return bLoadOrder ? ( it != offsets.end() ? *it : records[i].m_nFileOffset ) : records[i + 1].m_nFileOffset;
+		};
+
+		if ( nVersion != SHADER_VCS_VERSION_NUMBER )
+		{
+			uint32_t nDictionarySize;
+			if ( nPos + sizeof( nDictionarySize ) > file.Size() )
+				return Fail( "shader dictionary runs past the end" );
+			memcpy( &nDictionarySize, pFile + nPos, sizeof( nDictionarySize ) );
+			nPos += sizeof( nDictionarySize );
+			if ( nDictionarySize > MAX_SHADER_DICTIONARY_SIZE || nPos + nDictionarySize > file.Size() )
+				return Fail( "shader dictionary runs past the end" );
+			shader.m_Dictionary.assign( pFile + nPos, pFile + nPos + nDictionarySize );
+			nPos += nDictionarySize;
+
+			// The index fills the gap up to the first static combo
+			if ( offsets.front() > nPos )
+			{
+				uint32_t nEntries;
+				if ( nPos + sizeof( nEntries ) + uint64_t( nRecords ) * sizeof( uint32_t ) > file.Size() )
+					return Fail( "dynamic combo index runs past the end" );
+				memcpy( &nEntries, pFile + nPos, sizeof( nEntries ) );
+				nPos += sizeof( nEntries );
+				shader.m_IndexFirst.resize( nRecords );
+				memcpy( shader.m_IndexFirst.data(), pFile + nPos, nRecords * sizeof( uint32_t ) );
+				nPos += nRecords * sizeof( uint32_t );
+				if ( nPos + uint64_t( nEntries ) * sizeof( DynamicComboIndexRecord_t ) > file.Size() )
+					return Fail( "dynamic combo index runs past the end" );
+				shader.m_IndexEntries.resize( nEntries );
+				memcpy( shader.m_IndexEntries.data(), pFile + nPos, nEntries * sizeof( DynamicComboIndexRecord_t ) );
+				nPos += nEntries * sizeof( DynamicComboIndexRecord_t );
+				if ( !std::is_sorted( shader.m_IndexFirst.begin(), shader.m_IndexFirst.end() ) || shader.m_IndexFirst.back() != nEntries )
+					return Fail( "dynamic combo index out of order" );
+			}
+		}
+
+		if ( records.back().m_nStaticComboID != nSentinel || records.back().m_nFileOffset != file.Size() || ( bLoadOrder && offsets.back() != file.Size() ) )
+			return Fail( "no sentinel at the end of the dictionary" );
+
+		for ( uint32_t i = 0; i + 1 < nRecords; ++i )
+		{
+			if ( ( i && records[i].m_nStaticComboID <= records[i - 1].m_nStaticComboID ) || records[i].m_nFileOffset < nPos || EndOf( i ) < records[i].m_nFileOffset )
+				return Fail( "dictionary entry "s + std::to_string( i ) + " out of order" );
+			shader.m_Index[records[i].m_nStaticComboID] = i;
+			shader.m_StaticCombos.emplace_back( StaticCombo_t{ records[i].m_nStaticComboID, records[i].m_nFileOffset } );
+		}
+
+		for ( size_t i = 0; i < shader.m_Aliases.size(); ++i )
+		{
+			const StaticComboAliasRecordWide_t& alias = shader.m_Aliases[i];
+			if ( i && alias.m_nStaticComboID <= shader.m_Aliases[i - 1].m_nStaticComboID )
+				Fail( "alias table out of order" );
+			const auto it = shader.m_Index.find( alias.m_nSourceStaticCombo );
+			if ( it == shader.m_Index.end() )
+			{
+				Fail( "static combo "s + std::to_string( alias.m_nStaticComboID ) + " aliases missing " + std::to_string( alias.m_nSourceStaticCombo ) );
+				continue;
+			}
+			const size_t nTarget = it->second; // it dies if the map grows
+			if ( !shader.m_Index.try_emplace( alias.m_nStaticComboID, nTarget ).second )
+				Fail( "static combo "s + std::to_string( alias.m_nStaticComboID ) + " is both stored and aliased" );
+		}
+
+		// Static combos of -shared-blobs are in the shared.vcsblob next to the vcs file
+		std::unique_ptr<CMappedFile> pShared;
+		if ( shader.m_Header.m_nVersion != SHADER_VCS_VERSION_NUMBER )
+			pShared = std::make_unique<CMappedFile>( path.parent_path() / "shared.vcsblob" );
+
+		// Blocks are independent, decode them on all threads
+		std::atomic<size_t> nNext = 0;
+		const auto& Work = [&]
+		{
+			std::vector<uint8_t> lzma;
+			for ( size_t i; ( i = nNext++ ) < shader.m_StaticCombos.size(); )
+			{
+				StaticCombo_t& combo = shader.m_StaticCombos[i];
+				DecodeStaticCombo( pFile, EndOf( static_cast<uint32_t>( i ) ), shader, pShared.get(), combo, lzma );
+			}
+		};
+		std::vector<std::thread> threads;
+		for ( uint32_t i = 1; i < nThreads; ++i )
+			threads.emplace_back( Work );
+		Work();
+		for ( std::thread& thread : threads )
+			thread.join();
+
+		for ( const StaticCombo_t& combo : shader.m_StaticCombos )
+		{
+			if ( !combo.m_Error.empty() )
+				Fail( "static combo "s + std::to_string( combo.m_nStaticComboID ) + ": " + combo.m_Error );
+		}
+
+		// Every dynamic combo has to be where the index says, and nothing else may be in it
+		for ( size_t i = 0; !shader.m_IndexFirst.empty() && i < shader.m_StaticCombos.size(); ++i )
+		{
+			const StaticCombo_t& combo = shader.m_StaticCombos[i];
+			const uint32_t nFirst = shader.m_IndexFirst[i], nLast = shader.m_IndexFirst[i + 1];
+			bool bMatches = combo.m_Error.empty() && nLast - nFirst == combo.m_DynamicCombos.size();
+			for ( uint32_t e = nFirst; bMatches && e < nLast; ++e )
+			{
+				const DynamicComboIndexRecord_t& entry = shader.m_IndexEntries[e];
+				const DynamicCombo_t& dyn			   = combo.m_DynamicCombos[e - nFirst];
+				bMatches = entry.m_nDynamicComboID == dyn.m_nComboID && entry.m_nLocation == ( dyn.m_nBlock << SHADER_INDEX_BLOCK_SHIFT | dyn.m_nOffset );
+			}
+			if ( !bMatches && combo.m_Error.empty() )
+				Fail( "static combo "s + std::to_string( combo.m_nStaticComboID ) + ": dynamic combo index doesn't match its blocks" );
+		}
+		return shader.m_Errors.empty();
+	}
+
+	static void PrintErrors( const Shader_t& shader )
+	{
+		for ( size_t i = 0; i < std::min( shader.m_Errors.size(), MAX_ERRORS_SHOWN ); ++i )
+			std::cout << clr::red << shader.m_Path.string() << ": "sv << shader.m_Errors[i] << clr::reset << std::endl;
+		if ( shader.m_Errors.size() > MAX_ERRORS_SHOWN )
+			std::cout << clr::red << shader.m_Path.string() << ": "sv << shader.m_Errors.size() - MAX_ERRORS_SHOWN << " more errors"sv << clr::reset << std::endl;
+	}
+
+	static std::string Ratio( uint64_t nPacked, uint64_t nUnpacked )
+	{
+		char buf[32];
+		sprintf_s( buf, sizeof( buf ), "%.2fx", nPacked ? static_cast<double>( nUnpacked ) / nPacked : 0.0 );
+		return buf;
+	}
+
+	static void PrintStaticCombo( const StaticCombo_t& combo )
+	{
+		std::cout << "  "sv << std::setw( 10 ) << combo.m_nStaticComboID << std::setw( 12 ) << combo.m_nPackedSize << std::setw( 12 ) << combo.m_nUnpackedSize << std::setw( 9 ) << Ratio( combo.m_nPackedSize, combo.m_nUnpackedSize )
+				  << std::setw( 9 ) << combo.m_DynamicCombos.size() << "  "sv << std::hex << std::setw( 16 ) << std::setfill( '0' ) << combo.m_nHash << std::setfill( ' ' ) << std::dec << std::endl;
+	}
+
+	int Inspect( const fs::path& path, uint32_t nThreads, bool bVerbose )
+	{
+		const CMappedFile file( path );
+		Shader_t shader;
+		Load( path, file, nThreads, shader );
+		PrintErrors( shader );
+		if ( shader.m_StaticCombos.empty() && !shader.m_Errors.empty() )
+			return -1;
+
+		uint64_t nPacked = 0, nUnpacked = 0, nDynamic = 0, nUniqueDynamic = 0, nShared = 0;
+		robin_hood::unordered_flat_set<uint64_t> dynamicHashes;
+		for ( const StaticCombo_t& combo : shader.m_StaticCombos )
+		{
+			nShared += combo.m_bShared;
+			nPacked += combo.m_nPackedSize;
+			nUnpacked += combo.m_nUnpackedSize;
+			nDynamic += combo.m_DynamicCombos.size();
+			for ( const DynamicCombo_t& dyn : combo.m_DynamicCombos )
+				nUniqueDynamic += dynamicHashes.insert( dyn.m_nHash ).second;
+		}
+
+		const uint64_t nStatic = shader.m_StaticCombos.size(), nAliases = shader.m_Aliases.size();
+		std::cout << clr::green << path.string() << clr::reset << ": version "sv << shader.m_Header.m_nVersion << ", crc "sv << std::hex << shader.m_Header.m_nSourceCRC32 << std::dec
+				  << ", centroid mask "sv << std::hex << shader.m_Header.m_nCentroidMask << std::dec << ", "sv << PrettyPrint( shader.m_nDynamicCombos ) << " dynamic combos per static combo"sv << std::endl;
+		if ( !shader.m_Dictionary.empty() )
+			std::cout << "  blocks primed with a "sv << PrettyPrint( shader.m_Dictionary.size() ) << " byte dictionary"sv << std::endl;
+		if ( shader.m_Header.m_nVersion != SHADER_VCS_VERSION_NUMBER && ( shader.m_Header.m_nFlags & SHADER_FLAG_LOAD_ORDER ) )
+			std::cout << "  static combos in the order the engine loads them"sv << std::endl;
+		if ( !shader.m_IndexFirst.empty() )
+			std::cout << "  dynamic combo index of "sv << PrettyPrint( shader.m_IndexEntries.size() ) << " entries"sv << std::endl;
+		if ( nShared )
+			std::cout << "  "sv << PrettyPrint( nShared ) << " static combos in shared.vcsblob, counted in the packed code below"sv << std::endl;
+		std::cout << "  "sv << PrettyPrint( nStatic ) << " static combos stored, "sv << PrettyPrint( nAliases ) << " aliased ("sv << ( nStatic + nAliases ? nAliases * 100 / ( nStatic + nAliases ) : 0 ) << "% duplicates)"sv << std::endl;
+		std::cout << "  "sv << PrettyPrint( nDynamic ) << " dynamic combos, "sv << PrettyPrint( nUniqueDynamic ) << " with unique code ("sv << ( nDynamic ? ( nDynamic - nUniqueDynamic ) * 100 / nDynamic : 0 ) << "% duplicates)"sv << std::endl;
+		std::cout << "  "sv << PrettyPrint( shader.m_nFileSize ) << " bytes, "sv << PrettyPrint( nPacked ) << " of them packed code, "sv << PrettyPrint( nUnpacked ) << " unpacked ("sv
+				  << Ratio( nPacked, nUnpacked ) << ")"sv << std::endl;
+
+		std::vector<const StaticCombo_t*> arrBySize;
+		for ( const StaticCombo_t& combo : shader.m_StaticCombos )
+			arrBySize.emplace_back( &combo );
+		std::stable_sort( arrBySize.begin(), arrBySize.end(), []( const StaticCombo_t* a, const StaticCombo_t* b ) { return a->m_nPackedSize > b->m_nPackedSize; } );
+		if ( !bVerbose && arrBySize.size() > 10 )
+			arrBySize.resize( 10 );
+
+		std::cout << ( bVerbose ? "  All static combos:\n"sv : "  Largest static combos:\n"sv );
+		std::cout << "  "sv << std::setw( 10 ) << "id"sv << std::setw( 12 ) << "packed"sv << std::setw( 12 ) << "unpacked"sv << std::setw( 9 ) << "ratio"sv << std::setw( 9 ) << "dynamic"sv << "  "sv << std::setw( 16 ) << "hash"sv << std::endl;
+		for ( const StaticCombo_t* pCombo : arrBySize )
+			PrintStaticCombo( *pCombo );
+
+		return shader.m_Errors.empty() ? 0 : -1;
+	}
+
+	int Verify( const fs::path& path, uint32_t nThreads )
+	{
+		const CMappedFile file( path );
+		Shader_t shader;
+		if ( !Load( path, file, nThreads, shader ) )
+		{
+			PrintErrors( shader );
+			return -1;
+		}
+
+		std::cout << clr::green << path.string() << clr::reset << ": OK, "sv << PrettyPrint( shader.m_StaticCombos.size() ) << " static combos"sv << std::endl;
+		return 0;
+	}
+
+	int Diff( const fs::path& oldPath, const fs::path& newPath, uint32_t nThreads, bool bVerbose )
+	{
+		const CMappedFile oldFile( oldPath ), newFile( newPath );
+		if ( oldFile.Data() && newFile.Data() && oldFile.Size() == newFile.Size() && memcmp( oldFile.Data(), newFile.Data(), oldFile.Size() ) == 0 )
+		{
+			std::cout << clr::green << "Files are byte-identical"sv << clr::reset << std::endl;
+			return 0;
+		}
+
+		Shader_t oldShader, newShader;
+		const bool bOldOk = Load( oldPath, oldFile, nThreads, oldShader );
+		const bool bNewOk = Load( newPath, newFile, nThreads, newShader );
+		PrintErrors( oldShader );
+		PrintErrors( newShader );
+		if ( !bOldOk || !bNewOk )
+			return -1;
+
+		uint64_t nDifferences = 0;
+		const auto& Report = [&nDifferences]( const auto&... args )
+		{
+			++nDifferences;
+			( std::cout << ... << args ) << std::endl;
+		};
+
+		const ShaderHeader_t &oldHeader = oldShader.m_Header, &newHeader = newShader.m_Header;
+		if ( oldShader.m_nDynamicCombos != newShader.m_nDynamicCombos )
+			Report( "Dynamic combos: "sv, oldShader.m_nDynamicCombos, " -> "sv, newShader.m_nDynamicCombos );
+		if ( oldHeader.m_nCentroidMask != newHeader.m_nCentroidMask )
+			Report( "Centroid mask: "sv, oldHeader.m_nCentroidMask, " -> "sv, newHeader.m_nCentroidMask );
+		if ( oldHeader.m_nSourceCRC32 != newHeader.m_nSourceCRC32 )
+			std::cout << "Source crc: "sv << std::hex << oldHeader.m_nSourceCRC32 << " -> "sv << newHeader.m_nSourceCRC32 << std::dec << std::endl;
+
+		std::vector<uint64_t> ids;
+		for ( const auto& [id, i] : oldShader.m_Index )
+			ids.emplace_back( id );
+		for ( const auto& [id, i] : newShader.m_Index )
+			ids.emplace_back( id );
+		std::sort( ids.begin(), ids.end() );
+		ids.erase( std::unique( ids.begin(), ids.end() ), ids.end() );
+
+		uint64_t nSame = 0;
+		for ( const uint64_t id : ids )
+		{
+			const StaticCombo_t* pOld = oldShader.Find( id );
+			const StaticCombo_t* pNew = newShader.Find( id );
+			if ( !pOld )
+				Report( "Static combo "sv, id, " only in the new build"sv );
+			else if ( !pNew )
+				Report( "Static combo "sv, id, " only in the old build"sv );
+			else if ( pOld->m_nHash != pNew->m_nHash || pOld->m_DynamicCombos.size() != pNew->m_DynamicCombos.size() )
+			{
+				// Which of its dynamic combos changed
+				size_t nChanged = 0, nOld = 0, nNew = 0;
+				for ( auto itOld = pOld->m_DynamicCombos.cbegin(), itNew = pNew->m_DynamicCombos.cbegin(); itOld != pOld->m_DynamicCombos.cend() || itNew != pNew->m_DynamicCombos.cend(); )
+				{
+					if ( itNew == pNew->m_DynamicCombos.cend() || ( itOld != pOld->m_DynamicCombos.cend() && itOld->m_nComboID < itNew->m_nComboID ) )
+						++nOld, ++itOld;
+					else if ( itOld == pOld->m_DynamicCombos.cend() || itNew->m_nComboID < itOld->m_nComboID )
+						++nNew, ++itNew;
+					else
+					{
+						if ( itOld->m_nHash != itNew->m_nHash || itOld->m_nSize != itNew->m_nSize )
+						{
+							++nChanged;
+							if ( bVerbose )
+								std::cout << "  dynamic combo "sv << itOld->m_nComboID << ": "sv << itOld->m_nSize << " -> "sv << itNew->m_nSize << " bytes"sv << std::endl;
+						}
+						++itOld, ++itNew;
+					}
+				}
+				Report( "Static combo "sv, id, ": "sv, nChanged, " dynamic combos changed, "sv, nOld, " only in the old build, "sv, nNew, " only in the new one, "sv, pOld->m_nPackedSize, " -> "sv, pNew->m_nPackedSize, " bytes packed"sv );
+			}
+			else
+				++nSame;
+		}
+
+		if ( !nDifferences )
+			std::cout << clr::green << "Same code in every static combo"sv << clr::reset << " ("sv << PrettyPrint( nSame ) << ", packed "sv << PrettyPrint( oldFile.Size() ) << " -> "sv << PrettyPrint( newFile.Size() ) << " bytes)"sv << std::endl;
+		else
+			std::cout << clr::red << PrettyPrint( nDifferences ) << " differences"sv << clr::reset << ", "sv << PrettyPrint( nSame ) << " static combos the same"sv << std::endl;
+		return nDifferences ? 1 : 0;
+	}
+}
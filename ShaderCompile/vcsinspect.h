@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+// Reading finished vcs files back without the engine, every block is decoded
+namespace VcsInspect
+{
+	// Sizes, compression and duplicates of the file, -v lists every static combo.
+	// Returns 0 if the file is well formed.
+	[[nodiscard]] int Inspect( const std::filesystem::path& file, uint32_t nThreads, bool bVerbose );
+
+	// Only checks that the file is well formed and that every block decodes
+	[[nodiscard]] int Verify( const std::filesystem::path& file, uint32_t nThreads );
+
+	// Compares two builds static combo by static combo, returns 0 if they hold the same code
+	[[nodiscard]] int Diff( const std::filesystem::path& oldFile, const std::filesystem::path& newFile, uint32_t nThreads, bool bVerbose );
+}
@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "vcspatch.h"
+#include "compilecache.h"
+#include "platform.h"
+#include "shader_vcs_version.h"
+#include "termcolor/style.hpp"
+#include "termcolors.hpp"
+#include "strmanip.hpp"
+#include "robin_hood.h"
+
+using namespace std::literals;
+namespace fs = std::filesystem;
+
+namespace VcsPatch
+{
+	static constexpr uint32_t PATCH_MAGIC	= ( 'P' << 24 ) + ( 'S' << 16 ) + ( 'C' << 8 ) + 'V';
+	static constexpr uint32_t PATCH_VERSION = 1;
+	static constexpr uint32_t LITERAL		= 0xffffffff; // Op whose bytes follow it in the patch
+
+	using Platform::CMappedFile;
+
+	struct PatchHeader_t
+	{
+		uint32_t m_nMagic;
+		uint32_t m_nVersion;
+		uint64_t m_nOldSize;
+		uint64_t m_nOldHash;
+		uint64_t m_nNewSize;
+		uint64_t m_nNewHash;
+		uint32_t m_nPrefixSize; // Bytes in front of the static combos, they follow the header
+		uint32_t m_nOps;
+	};
+	static_assert( sizeof( PatchHeader_t ) == 12 * 4 );
+
+	// Bytes of the new file, from the old one at m_nOldOffset or from the patch
+	struct Op_t
+	{
+		uint32_t m_nOldOffset;
+		uint32_t m_nSize;
+	};
+	static_assert( sizeof( Op_t ) == 2 * 4 );
+
+	struct Payload_t
+	{
+		uint64_t m_nStaticComboID;
+		uint32_t m_nOffset;
+		uint32_t m_nSize; // Blocks and end mark
+	};
+
+	// The static combos in the order they are in the file, each runs up to the next. Works the same in load order.
+	static bool ReadPayloads( const uint8_t* pFile, size_t nSize, uint32_t& nFirst, std::vector<Payload_t>& payloads )
+	{
+		ShaderHeader_t header;
+		if ( nSize < sizeof( header ) || nSize > UINT32_MAX )
+			return false;
+		memcpy( &header, pFile, sizeof( header ) );
+		if ( header.m_nVersion != SHADER_VCS_VERSION_NUMBER && header.m_nVersion != SHADER_VCS_DICTIONARY_VERSION_NUMBER && header.m_nVersion != SHADER_VCS_WIDE_VERSION_NUMBER )
+			return false;
+
+		const bool bWide		 = header.m_nVersion == SHADER_VCS_WIDE_VERSION_NUMBER;
+		const size_t nRecordSize = bWide ? sizeof( StaticComboRecordWide_t ) : sizeof( StaticComboRecord_t );
+		const size_t nRecordsPos = sizeof( header ) + ( bWide ? sizeof( ShaderHeaderWide_t ) : 0 );
+		if ( !header.m_nNumStaticCombos || nRecordsPos + uint64_t( header.m_nNumStaticCombos ) * nRecordSize > nSize )
+			return false;
+
+		payloads.clear();
+		for ( uint32_t i = 0; i < header.m_nNumStaticCombos; ++i )
+		{
+			StaticComboRecordWide_t rec;
+			if ( bWide )
+				memcpy( &rec, pFile + nRecordsPos + i * nRecordSize, sizeof( rec ) );
+			else
+			{
+				StaticComboRecord_t narrowRec;
+				memcpy( &narrowRec, pFile + nRecordsPos + i * nRecordSize, sizeof( narrowRec ) );
+				rec = { narrowRec.m_nStaticComboID, narrowRec.m_nFileOffset };
+			}
+			if ( rec.m_nFileOffset < nRecordsPos + uint64_t( header.m_nNumStaticCombos ) * nRecordSize || rec.m_nFileOffset > nSize )
+				return false;
+			payloads.emplace_back( Payload_t{ rec.m_nStaticComboID, rec.m_nFileOffset, 0 } );
+		}
+
+		// The sentinel has the end of the file, it is the last one once they are sorted
+		std::sort( payloads.begin(), payloads.end(), []( const Payload_t& a, const Payload_t& b ) { return a.m_nOffset < b.m_nOffset; } );
+		if ( payloads.back().m_nOffset != nSize )
+			return false;
+		for ( size_t i = 0; i + 1 < payloads.size(); ++i )
+			payloads[i].m_nSize = payloads[i + 1].m_nOffset - payloads[i].m_nOffset;
+		nFirst = payloads.front().m_nOffset;
+		payloads.pop_back();
+		return true;
+	}
+
+	static int Fail( const fs::path& path, std::string_view error )
+	{
+		std::cout << clr::red << path.string() << ": "sv << error << clr::reset << std::endl;
+		return -1;
+	}
+
+	int Make( const fs::path& oldPath, const fs::path& newPath, const fs::path& patchPath )
+	{
+		const CMappedFile oldFile( oldPath ), newFile( newPath );
+		std::vector<Payload_t> oldPayloads, newPayloads;
+		uint32_t nOldFirst, nNewFirst;
+		if ( !oldFile.Data() || !ReadPayloads( oldFile.Data(), oldFile.Size(), nOldFirst, oldPayloads ) )
+			return Fail( oldPath, "not a vcs file of version 6, 7 or 8" );
+		if ( !newFile.Data() || !ReadPayloads( newFile.Data(), newFile.Size(), nNewFirst, newPayloads ) )
+			return Fail( newPath, "not a vcs file of version 6, 7 or 8" );
+
+		// The same id first, then the same bytes under any id, the build may have moved a static combo
+		robin_hood::unordered_flat_map<uint64_t, const Payload_t*> oldById, oldByHash;
+		oldById.reserve( oldPayloads.size() );
+		oldByHash.reserve( oldPayloads.size() );
+		for ( const Payload_t& payload : oldPayloads )
+		{
+			oldById.emplace( payload.m_nStaticComboID, &payload );
+			oldByHash.emplace( CompileCache::HashBytes( oldFile.Data() + payload.m_nOffset, payload.m_nSize, 0 ), &payload );
+		}
+		const auto& Same = [&]( const Payload_t* pOld, const Payload_t& payload )
+		{
+			return pOld && pOld->m_nSize == payload.m_nSize && memcmp( oldFile.Data() + pOld->m_nOffset, newFile.Data() + payload.m_nOffset, payload.m_nSize ) == 0;
+		};
+
+		std::vector<Op_t> ops;
+		uint64_t nChanged = 0, nLiteral = 0;
+		for ( const Payload_t& payload : newPayloads )
+		{
+			const auto itId		  = oldById.find( payload.m_nStaticComboID );
+			const Payload_t* pOld = itId != oldById.end() ? itId->second : nullptr;
+			if ( !Same( pOld, payload ) )
+			{
+				const auto itHash = oldByHash.find( CompileCache::HashBytes( newFile.Data() + payload.m_nOffset, payload.m_nSize, 0 ) );
+				pOld			  = itHash != oldByHash.end() ? itHash->second : nullptr;
+				if ( !Same( pOld, payload ) )
+					pOld = nullptr;
+			}
+			nChanged += !pOld || pOld->m_nStaticComboID != payload.m_nStaticComboID;
+
+			// Runs of copies that follow each other in the old file, and of literals, are one op
+			const uint32_t nOldOffset = pOld ? pOld->m_nOffset : LITERAL;
+			if ( !ops.empty() && ( nOldOffset == LITERAL ? ops.back().m_nOldOffset == LITERAL : ops.back().m_nOldOffset != LITERAL && ops.back().m_nOldOffset + ops.back().m_nSize == nOldOffset ) )
+				ops.back().m_nSize += payload.m_nSize;
+			else
+				ops.emplace_back( Op_t{ nOldOffset, payload.m_nSize } );
+			if ( !pOld )
+				nLiteral += payload.m_nSize;
+		}
+
+		const PatchHeader_t header{ PATCH_MAGIC, PATCH_VERSION, oldFile.Size(), CompileCache::HashBytes( oldFile.Data(), oldFile.Size(), 0 ), newFile.Size(),
+									CompileCache::HashBytes( newFile.Data(), newFile.Size(), 0 ), nNewFirst, static_cast<uint32_t>( ops.size() ) };
+		std::ofstream patch( patchPath, std::ios::binary | std::ios::trunc );
+		patch.write( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+		patch.write( reinterpret_cast<const char*>( newFile.Data() ), nNewFirst );
+		uint32_t nNewOffset = nNewFirst;
+		for ( const Op_t& op : ops )
+		{
+			patch.write( reinterpret_cast<const char*>( &op ), sizeof( op ) );
+			if ( op.m_nOldOffset == LITERAL )
+				patch.write( reinterpret_cast<const char*>( newFile.Data() + nNewOffset ), op.m_nSize );
+			nNewOffset += op.m_nSize;
+		}
+		if ( !patch.flush() )
+			return Fail( patchPath, "can't be written" );
+
+		std::cout << clr::green << patchPath.string() << clr::reset << ": "sv << PrettyPrint( nChanged ) << " of "sv << PrettyPrint( newPayloads.size() ) << " static combos changed, "sv
+				  << PrettyPrint( static_cast<uint64_t>( patch.tellp() ) ) << " bytes for a "sv << PrettyPrint( newFile.Size() ) << " byte file ("sv << PrettyPrint( nLiteral ) << " of code)"sv << std::endl;
+		return 0;
+	}
+
+	int Apply( const fs::path& oldPath, const fs::path& patchPath, const fs::path& outPath )
+	{
+		std::ifstream patch( patchPath, std::ios::binary );
+		PatchHeader_t header;
+		if ( !patch || !patch.read( reinterpret_cast<char*>( &header ), sizeof( header ) ) || header.m_nMagic != PATCH_MAGIC || header.m_nVersion != PATCH_VERSION )
+			return Fail( patchPath, "not a vcs patch" );
+
+		// Built in memory, the old file has to be closed before it may be replaced
+		std::vector<uint8_t> out;
+		{
+			const CMappedFile oldFile( oldPath );
+			if ( !oldFile.Data() || oldFile.Size() != header.m_nOldSize || CompileCache::HashBytes( oldFile.Data(), oldFile.Size(), 0 ) != header.m_nOldHash )
+				return Fail( oldPath, "isn't the file the patch was made from" );
+			if ( header.m_nPrefixSize > header.m_nNewSize )
+				return Fail( patchPath, "broken" );
+
+			out.resize( header.m_nPrefixSize );
+			if ( !patch.read( reinterpret_cast<char*>( out.data() ), out.size() ) )
+				return Fail( patchPath, "truncated" );
+			for ( uint32_t i = 0; i < header.m_nOps; ++i )
+			{
+				Op_t op;
+				if ( !patch.read( reinterpret_cast<char*>( &op ), sizeof( op ) ) || out.size() + op.m_nSize > header.m_nNewSize )
+					return Fail( patchPath, "broken" );
+				const size_t nPos = out.size();
+				out.resize( nPos + op.m_nSize );
+				if ( op.m_nOldOffset == LITERAL )
+				{
+					if ( !patch.read( reinterpret_cast<char*>( out.data() + nPos ), op.m_nSize ) )
+						return Fail( patchPath, "truncated" );
+				}
+				else if ( uint64_t( op.m_nOldOffset ) + op.m_nSize > oldFile.Size() )
+					return Fail( patchPath, "broken" );
+				else
+					memcpy( out.data() + nPos, oldFile.Data() + op.m_nOldOffset, op.m_nSize );
+			}
+		}
+		if ( out.size() != header.m_nNewSize || CompileCache::HashBytes( out.data(), out.size(), 0 ) != header.m_nNewHash )
+			return Fail( patchPath, "doesn't give the file it was made for" );
+
+		fs::path tmpPath = outPath;
+		tmpPath += ".tmp"sv;
+		{
+			std::ofstream file( tmpPath, std::ios::binary | std::ios::trunc );
+			if ( !file.write( reinterpret_cast<const char*>( out.data() ), out.size() ) || !file.flush() )
+			{
+				file.close();
+				std::error_code c;
+				fs::remove( tmpPath, c );
+				return Fail( outPath, "can't be written" );
+			}
+		}
+		if ( !Platform::RenameOver( tmpPath, outPath ) )
+		{
+			std::error_code c;
+			fs::remove( tmpPath, c );
+			return Fail( outPath, "can't be replaced" );
+		}
+
+		std::cout << clr::green << outPath.string() << clr::reset << ": patched, "sv << PrettyPrint( out.size() ) << " bytes"sv << std::endl;
+		return 0;
+	}
+}
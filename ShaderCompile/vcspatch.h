@@ -0,0 +1,16 @@
+#pragma once
+
+#include <filesystem>
+
+// Patches between two builds of a vcs file, for shipping a shader tweak without the whole file. A patch keeps the part of
+// the new file in front of the static combos as it is, then for every static combo either where the same bytes are in
+// the old file or the bytes themselves. Both files are hashed, a patch only applies to the file it was made from and
+// has to give the file it was made for.
+namespace VcsPatch
+{
+	// Returns 0 once the patch is written
+	[[nodiscard]] int Make( const std::filesystem::path& oldFile, const std::filesystem::path& newFile, const std::filesystem::path& patchFile );
+
+	// outFile may be oldFile, it is replaced in one step. Returns 0 once it is written.
+	[[nodiscard]] int Apply( const std::filesystem::path& oldFile, const std::filesystem::path& patchFile, const std::filesystem::path& outFile );
+}
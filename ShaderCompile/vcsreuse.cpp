@@ -0,0 +1,143 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#endif
+
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include "vcsreuse.h"
+#include "compilecache.h"
+#include "platform.h"
+#include "shader_vcs_version.h"
+#include "gsl/narrow"
+
+#include "C/7zTypes.h"
+#include "C/LzmaDec.h"
+#include "vcsloader.h"
+
+namespace fs = std::filesystem;
+
+namespace VcsReuse
+{
+	static constexpr uint32_t SIDECAR_VERSION = 1;
+	static constexpr uint32_t SIDECAR_MAGIC   = ( 'R' << 24 ) + ( 'C' << 16 ) + ( 'C' << 8 ) + 'S';
+
+	static std::atomic<uint64_t> s_nReused;
+
+	static fs::path SidecarPath( const fs::path& vcsPath )
+	{
+		fs::path path = vcsPath;
+		path += ".combos";
+		return path;
+	}
+
+	std::unique_ptr<CPreviousShader> CPreviousShader::Open( const fs::path& vcsPath )
+	{
+		std::ifstream sidecar( SidecarPath( vcsPath ), std::ios::binary );
+		uint32_t header[3];
+		uint64_t nVcsSize;
+		if ( !sidecar || !sidecar.read( reinterpret_cast<char*>( header ), sizeof( header ) ) || header[0] != SIDECAR_MAGIC || header[1] != SIDECAR_VERSION
+			 || !sidecar.read( reinterpret_cast<char*>( &nVcsSize ), sizeof( nVcsSize ) ) )
+			return nullptr;
+
+		std::vector<Entry> entries( header[2] );
+		for ( Entry& entry : entries )
+		{
+			if ( !sidecar.read( reinterpret_cast<char*>( &entry.m_nStaticComboID ), sizeof( entry.m_nStaticComboID ) )
+				 || !sidecar.read( reinterpret_cast<char*>( &entry.m_nFingerprint ), sizeof( entry.m_nFingerprint ) )
+				 || !sidecar.read( reinterpret_cast<char*>( &entry.m_nPackedHash ), sizeof( entry.m_nPackedHash ) ) )
+				return nullptr;
+		}
+
+		// The loader finds the blocks right in the mapped file, duplicates included
+		auto pShader	= std::make_unique<CPreviousShader>();
+		pShader->m_pVcs = std::make_unique<Platform::CMappedFile>( vcsPath );
+		CVcsFile vcs;
+		if ( pShader->m_pVcs->Size() != nVcsSize || nVcsSize > UINT32_MAX || !vcs.Attach( pShader->m_pVcs->Data(), static_cast<uint32_t>( nVcsSize ) ) )
+			return nullptr;
+
+		// Static combos of -shared-blobs, the file only grows so it is mapped once for every shader
+		static const Platform::CMappedFile s_Shared( vcsPath.parent_path() / "shared.vcsblob" );
+		if ( s_Shared.Data() && s_Shared.Size() <= UINT32_MAX )
+			vcs.AttachShared( s_Shared.Data(), static_cast<uint32_t>( s_Shared.Size() ) );
+
+		for ( const Entry& entry : entries )
+		{
+			const unsigned char* pBlocks;
+			unsigned int nSize;
+			if ( vcs.FindStaticCombo( entry.m_nStaticComboID, &pBlocks, &nSize ) && nSize )
+				pShader->m_Blocks[entry.m_nStaticComboID] = Block_t{ entry.m_nFingerprint, entry.m_nPackedHash, pBlocks, nSize };
+		}
+
+		return pShader;
+	}
+
+	size_t CPreviousShader::Find( uint32_t nStaticComboID, uint64_t nFingerprint, uint64_t& nPackedHash ) const
+	{
+		const auto it = m_Blocks.find( nStaticComboID );
+		if ( it == m_Blocks.end() || it->second.m_nFingerprint != nFingerprint )
+			return 0;
+
+		nPackedHash = it->second.m_nPackedHash;
+		return it->second.m_nSize;
+	}
+
+	bool CPreviousShader::Read( uint32_t nStaticComboID, uint8_t* pData, size_t nSize ) const
+	{
+		const auto it = m_Blocks.find( nStaticComboID );
+		if ( it == m_Blocks.end() || it->second.m_nSize != nSize )
+			return false;
+
+		memcpy( pData, it->second.m_pData, nSize );
+		if ( CompileCache::HashBytes( pData, nSize, 0 ) != it->second.m_nPackedHash )
+			return false;
+
+		++s_nReused;
+		return true;
+	}
+
+	void Save( const fs::path& vcsPath, uint64_t nVcsSize, const std::vector<Entry>& entries )
+	{
+		const fs::path path = SidecarPath( vcsPath );
+		fs::path tmpPath = path;
+		tmpPath += ".tmp";
+		{
+			std::ofstream file( tmpPath, std::ios::binary | std::ios::trunc );
+			const uint32_t header[3] = { SIDECAR_MAGIC, SIDECAR_VERSION, gsl::narrow<uint32_t>( entries.size() ) };
+			file.write( reinterpret_cast<const char*>( header ), sizeof( header ) );
+			file.write( reinterpret_cast<const char*>( &nVcsSize ), sizeof( nVcsSize ) );
+			for ( const Entry& entry : entries )
+			{
+				file.write( reinterpret_cast<const char*>( &entry.m_nStaticComboID ), sizeof( entry.m_nStaticComboID ) );
+				file.write( reinterpret_cast<const char*>( &entry.m_nFingerprint ), sizeof( entry.m_nFingerprint ) );
+				file.write( reinterpret_cast<const char*>( &entry.m_nPackedHash ), sizeof( entry.m_nPackedHash ) );
+			}
+			if ( !file )
+			{
+				file.close();
+				std::error_code c;
+				fs::remove( tmpPath, c );
+				return;
+			}
+		}
+
+		std::error_code c;
+		fs::rename( tmpPath, path, c );
+		if ( c )
+			fs::remove( tmpPath, c );
+	}
+
+	void Remove( const fs::path& vcsPath )
+	{
+		std::error_code c;
+		fs::remove( SidecarPath( vcsPath ), c );
+	}
+
+	uint64_t NumReused() noexcept
+	{
+		return s_nReused;
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+#include "platform.h"
+#include "robin_hood.h"
+
+// Packed static combos of the vcs file from the last build. A sidecar next to the vcs keeps
+// a fingerprint of the dynamic combos every static combo was packed from, static combos
+// that come out of this build the same are copied from the old file instead of packed again.
+namespace VcsReuse
+{
+	struct Entry
+	{
+		uint32_t m_nStaticComboID;
+		uint64_t m_nFingerprint; // Of the dynamic combos before packing
+		uint64_t m_nPackedHash;  // Of the packed block
+	};
+
+	class CPreviousShader
+	{
+	public:
+		// nullptr if there is no vcs or sidecar, or they don't belong together
+		[[nodiscard]] static std::unique_ptr<CPreviousShader> Open( const std::filesystem::path& vcsPath );
+
+		// Size of the packed block of the static combo if it was packed from the same
+		// dynamic combos last time, 0 if it has to be packed again
+		[[nodiscard]] size_t Find( uint32_t nStaticComboID, uint64_t nFingerprint, uint64_t& nPackedHash ) const;
+
+		// Copies the block Find returned the size of, fails if it is not what the sidecar says
+		[[nodiscard]] bool Read( uint32_t nStaticComboID, uint8_t* pData, size_t nSize ) const;
+
+	private:
+		struct Block_t
+		{
+			uint64_t m_nFingerprint;
+			uint64_t m_nPackedHash;
+			const uint8_t* m_pData; // In m_pVcs
+			uint32_t m_nSize;
+		};
+
+		std::unique_ptr<Platform::CMappedFile> m_pVcs;
+		robin_hood::unordered_flat_map<uint32_t, Block_t> m_Blocks;
+	};
+
+	// Writes the sidecar of a vcs file that was just written
+	void Save( const std::filesystem::path& vcsPath, uint64_t nVcsSize, const std::vector<Entry>& entries );
+
+	// Has to be called before the vcs file is replaced, a sidecar must never describe another file
+	void Remove( const std::filesystem::path& vcsPath );
+
+	[[nodiscard]] uint64_t NumReused() noexcept;
+}
@@ -0,0 +1,762 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOWINRES
+#define NOSERVICE
+#define NOMCX
+#define NOIME
+#define NOMINMAX
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "workerprocess.h"
+#include "cfgprocessor.h"
+#include "cmdsink.h"
+#include "d3dxfxc.h"
+#include "gsl/narrow"
+#include "platform.h"
+#include "termcolor/style.hpp"
+#include "termcolors.hpp"
+
+#ifdef _WIN32
+#pragma comment( lib, "Ws2_32" )
+#endif
+
+namespace fs = std::filesystem;
+using namespace std::literals;
+
+namespace WorkerProcess
+{
+	static constexpr std::string_view DEFAULT_PORT = "27272"sv;
+	static constexpr std::string_view DEFAULT_HOST = "127.0.0.1"sv;
+
+#ifdef _WIN32
+	using Handle_t = HANDLE;
+	using Process_t = HANDLE;
+	static const Handle_t NO_HANDLE = nullptr;
+#else
+	using Handle_t	= int;
+	using Process_t = pid_t;
+	using SOCKET	= int;
+	static constexpr int NO_HANDLE		= -1;
+	static constexpr int INVALID_SOCKET = -1;
+	static constexpr int SOCKET_ERROR	= -1;
+	static constexpr int SD_BOTH		= SHUT_RDWR;
+	static int closesocket( int s ) { return close( s ); }
+#endif
+
+	// Followed by the file name, entry point, shader model and name and value of every define,
+	// each with its null, then the preprocessed text if there is one
+	struct RequestHeader_t
+	{
+		uint32_t m_nFlags;
+		uint32_t m_nDefines;
+		uint32_t m_nStringsSize;
+		uint32_t m_bPreprocessed;
+		uint32_t m_nTextSize;
+	};
+
+	// First on every connection to a remote worker, followed by the token. The worker answers with a uint32_t, 0 if it
+	// refused the token and closes the connection.
+	struct HandshakeHeader_t
+	{
+		uint32_t m_nMagic;
+		uint32_t m_nTokenSize;
+	};
+	static constexpr uint32_t HANDSHAKE_MAGIC = ( 'S' << 24 ) + ( 'C' << 16 ) + ( 'W' << 8 ) + '1';
+
+	// No coordinator sends more, remote workers drop connections that do
+	static constexpr uint32_t MAX_TOKEN_SIZE   = 4 * 1024;
+	static constexpr uint32_t MAX_DEFINES	   = 1024;
+	static constexpr uint32_t MAX_STRINGS_SIZE = 1024 * 1024;
+	static constexpr uint32_t MAX_TEXT_SIZE	   = 64 * 1024 * 1024;
+	// Every connection is a thread, more than this many at once are turned away
+	static constexpr uint32_t MAX_CONNECTIONS = 256;
+
+	// Followed by the code and the listing
+	struct ResponseHeader_t
+	{
+		uint32_t m_bSucceeded;
+		uint32_t m_nCodeSize;
+		uint32_t m_nListingSize; // With the null, 0 if there is no listing
+	};
+
+	class CWorkerResponse final : public CmdSink::IResponse
+	{
+	public:
+		CWorkerResponse( bool bSucceeded, std::vector<char>&& code, std::string&& listing, bool bHasListing ) noexcept
+			: m_Code( std::move( code ) ), m_Listing( std::move( listing ) ), m_bSucceeded( bSucceeded ), m_bHasListing( bHasListing )
+		{
+		}
+
+		bool Succeeded() const noexcept override { return m_bSucceeded; }
+		size_t GetResultBufferLen() const override { return m_bSucceeded ? m_Code.size() : 0; }
+		const void* GetResultBuffer() const override { return m_bSucceeded ? m_Code.data() : nullptr; }
+		const char* GetListing() const override { return m_bHasListing ? m_Listing.c_str() : nullptr; }
+
+	private:
+		std::vector<char> m_Code;
+		std::string m_Listing;
+		bool m_bSucceeded;
+		bool m_bHasListing;
+	};
+
+	// The pipes of a child process, or a connection to a remote worker
+	struct Channel_t
+	{
+		Handle_t m_hRead;
+		Handle_t m_hWrite;
+		SOCKET m_Socket; // INVALID_SOCKET for pipes
+	};
+
+	struct Child_t
+	{
+		Process_t m_hProcess; // NO_HANDLE for remote workers
+		Channel_t m_Channel;
+		bool m_bOpen;
+		std::vector<char> m_Request;	// Reused for every command
+	};
+
+	// Started and stopped while no worker runs, every worker only touches its own child in between
+	static std::vector<Child_t> s_Children;
+	static fs::path s_SourcesPath; // Snapshot of fileCache the local children map, removed once they are gone
+
+	// Returns how much made it, 0 on errors
+	static size_t WriteHandle( Handle_t hFile, const void* pData, size_t nSize )
+	{
+#ifdef _WIN32
+		DWORD nWritten = 0;
+		return WriteFile( hFile, pData, gsl::narrow<DWORD>( nSize ), &nWritten, nullptr ) ? nWritten : 0;
+#else
+		ssize_t nWritten;
+		while ( ( nWritten = write( hFile, pData, nSize ) ) < 0 && errno == EINTR )
+			continue;
+		return nWritten > 0 ? static_cast<size_t>( nWritten ) : 0;
+#endif
+	}
+
+	static size_t ReadHandle( Handle_t hFile, void* pData, size_t nSize )
+	{
+#ifdef _WIN32
+		DWORD nRead = 0;
+		return ReadFile( hFile, pData, gsl::narrow<DWORD>( nSize ), &nRead, nullptr ) ? nRead : 0;
+#else
+		ssize_t nRead;
+		while ( ( nRead = read( hFile, pData, nSize ) ) < 0 && errno == EINTR )
+			continue;
+		return nRead > 0 ? static_cast<size_t>( nRead ) : 0;
+#endif
+	}
+
+	static bool WriteAll( const Channel_t& channel, const void* pData, size_t nSize )
+	{
+		for ( const char* p = static_cast<const char*>( pData ); nSize; )
+		{
+			const size_t nChunk = std::min<size_t>( nSize, 1 << 20 );
+			size_t nWritten     = 0;
+			if ( channel.m_Socket != INVALID_SOCKET )
+			{
+				const int nSent = send( channel.m_Socket, p, gsl::narrow<int>( nChunk ), 0 );
+				nWritten        = nSent > 0 ? nSent : 0;
+			}
+			else
+				nWritten = WriteHandle( channel.m_hWrite, p, nChunk );
+			if ( !nWritten )
+				return false;
+			p += nWritten;
+			nSize -= nWritten;
+		}
+		return true;
+	}
+
+	static bool ReadAll( const Channel_t& channel, void* pData, size_t nSize )
+	{
+		for ( char* p = static_cast<char*>( pData ); nSize; )
+		{
+			const size_t nChunk = std::min<size_t>( nSize, 1 << 20 );
+			size_t nRead        = 0;
+			if ( channel.m_Socket != INVALID_SOCKET )
+			{
+				const int nReceived = recv( channel.m_Socket, p, gsl::narrow<int>( nChunk ), 0 );
+				nRead               = nReceived > 0 ? nReceived : 0;
+			}
+			else
+				nRead = ReadHandle( channel.m_hRead, p, nChunk );
+			if ( !nRead )
+				return false;
+			p += nRead;
+			nSize -= nRead;
+		}
+		return true;
+	}
+
+	static void Close( Child_t& child, bool bTerminate )
+	{
+		child.m_bOpen = false;
+		if ( child.m_Channel.m_Socket != INVALID_SOCKET )
+		{
+			// The remote worker drops the connection after the last response
+			shutdown( child.m_Channel.m_Socket, SD_BOTH );
+			closesocket( child.m_Channel.m_Socket );
+			return;
+		}
+
+		// A child sees the end of its pipe and exits on its own
+#ifdef _WIN32
+		CloseHandle( child.m_Channel.m_hWrite );
+		if ( bTerminate || WaitForSingleObject( child.m_hProcess, 10000 ) != WAIT_OBJECT_0 )
+			TerminateProcess( child.m_hProcess, 1 );
+		CloseHandle( child.m_Channel.m_hRead );
+#else
+		close( child.m_Channel.m_hWrite );
+		bool bExited = false;
+		for ( int i = 0; !bTerminate && !bExited && i < 1000; ++i )
+		{
+			// Left for Stop to reap, its processor time is still read until then
+			siginfo_t info{};
+			bExited = waitid( P_PID, static_cast<id_t>( child.m_hProcess ), &info, WEXITED | WNOHANG | WNOWAIT ) == 0 && info.si_pid;
+			if ( !bExited )
+				std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+		}
+		if ( !bExited )
+			kill( child.m_hProcess, SIGKILL );
+		close( child.m_Channel.m_hRead );
+#endif
+	}
+
+	static bool InitSockets()
+	{
+		static const bool s_bStarted = []
+		{
+#ifdef _WIN32
+			WSADATA wsaData;
+			return WSAStartup( MAKEWORD( 2, 2 ), &wsaData ) == 0;
+#else
+			// A worker that went away shows up as a failed write, not as a signal that ends this process
+			signal( SIGPIPE, SIG_IGN );
+			return true;
+#endif
+		}();
+		return s_bStarted;
+	}
+
+	// Every source and include the parser read, the children find them there without reading or parsing anything
+	static bool SaveSources()
+	{
+		std::error_code c;
+		s_SourcesPath = fs::temp_directory_path( c ) / ( "shadercompile-"s + std::to_string( Platform::ProcessId() ) + ".sources"s );
+		if ( c || !fileCache.SaveSnapshot( s_SourcesPath ) )
+		{
+			fs::remove( s_SourcesPath, c );
+			s_SourcesPath.clear();
+		}
+		return !s_SourcesPath.empty();
+	}
+
+#ifdef _WIN32
+	uint32_t Start( uint32_t nProcesses, const fs::path& shaderPath )
+	{
+		const fs::path exe = Platform::ExecutablePath();
+		if ( exe.empty() )
+			return 0;
+		std::wstring cmdLine = L"\"" + exe.wstring() + L"\" -worker-process -shaderpath \"" + shaderPath.wstring() + L"\"";
+		if ( const std::string_view lib = Compiler::LibraryName(); !lib.empty() )
+			cmdLine += L" -compiler-lib \"" + fs::path( lib ).wstring() + L"\"";
+		if ( SaveSources() )
+			cmdLine += L" -worker-sources \"" + s_SourcesPath.wstring() + L"\"";
+
+		SECURITY_ATTRIBUTES sa{ sizeof( sa ), nullptr, TRUE };
+		for ( uint32_t i = 0; i < nProcesses; ++i )
+		{
+			HANDLE hRequestsRead, hRequestsWrite, hResponsesRead, hResponsesWrite;
+			if ( !CreatePipe( &hRequestsRead, &hRequestsWrite, &sa, 0 ) )
+				break;
+			if ( !CreatePipe( &hResponsesRead, &hResponsesWrite, &sa, 0 ) )
+			{
+				CloseHandle( hRequestsRead );
+				CloseHandle( hRequestsWrite );
+				break;
+			}
+
+			// Only the ends of the child may be inherited, or the other children keep our ends open too
+			SetHandleInformation( hRequestsWrite, HANDLE_FLAG_INHERIT, 0 );
+			SetHandleInformation( hResponsesRead, HANDLE_FLAG_INHERIT, 0 );
+
+			STARTUPINFOW si{};
+			si.cb         = sizeof( si );
+			si.dwFlags    = STARTF_USESTDHANDLES;
+			si.hStdInput  = hRequestsRead;
+			si.hStdOutput = hResponsesWrite;
+			si.hStdError  = GetStdHandle( STD_ERROR_HANDLE );
+
+			PROCESS_INFORMATION pi{};
+			std::wstring args = cmdLine;
+			const BOOL bStarted = CreateProcessW( nullptr, args.data(), nullptr, nullptr, TRUE, 0, nullptr, nullptr, &si, &pi );
+			CloseHandle( hRequestsRead );
+			CloseHandle( hResponsesWrite );
+			if ( !bStarted )
+			{
+				CloseHandle( hRequestsWrite );
+				CloseHandle( hResponsesRead );
+				break;
+			}
+
+			CloseHandle( pi.hThread );
+			s_Children.emplace_back( Child_t{ pi.hProcess, Channel_t{ hResponsesRead, hRequestsWrite, INVALID_SOCKET }, true, {} } );
+		}
+
+		return Count();
+	}
+#else
+	uint32_t Start( uint32_t nProcesses, const fs::path& shaderPath )
+	{
+		const fs::path exe = Platform::ExecutablePath();
+		if ( exe.empty() || !InitSockets() )
+			return 0;
+
+		// Everything the child needs is ready before fork, between fork and exec only a few system calls are safe
+		std::vector<std::string> args{ exe.string(), "-worker-process", "-shaderpath", shaderPath.string() };
+		if ( const std::string_view lib = Compiler::LibraryName(); !lib.empty() )
+			args.insert( args.end(), { "-compiler-lib", std::string( lib ) } );
+		if ( SaveSources() )
+			args.insert( args.end(), { "-worker-sources", s_SourcesPath.string() } );
+		std::vector<char*> argv;
+		for ( std::string& arg : args )
+			argv.emplace_back( arg.data() );
+		argv.emplace_back( nullptr );
+
+		for ( uint32_t i = 0; i < nProcesses; ++i )
+		{
+			// Close on exec, so no child keeps the pipes of another open
+			int requests[2], responses[2];
+			if ( pipe2( requests, O_CLOEXEC ) != 0 )
+				break;
+			if ( pipe2( responses, O_CLOEXEC ) != 0 )
+			{
+				close( requests[0] );
+				close( requests[1] );
+				break;
+			}
+
+			const pid_t pid = fork();
+			if ( pid == 0 )
+			{
+				// dup2 clears close on exec for the copies
+				if ( dup2( requests[0], STDIN_FILENO ) < 0 || dup2( responses[1], STDOUT_FILENO ) < 0 )
+					_exit( 127 );
+				execv( argv[0], argv.data() );
+				_exit( 127 );
+			}
+
+			close( requests[0] );
+			close( responses[1] );
+			if ( pid < 0 )
+			{
+				close( requests[1] );
+				close( responses[0] );
+				break;
+			}
+
+			s_Children.emplace_back( Child_t{ pid, Channel_t{ responses[0], requests[1], INVALID_SOCKET }, true, {} } );
+		}
+
+		return Count();
+	}
+#endif
+
+	uint32_t Connect( std::string_view remotes, std::string_view token )
+	{
+		const uint32_t nBefore = Count();
+		if ( !InitSockets() )
+			return 0;
+
+		while ( !remotes.empty() )
+		{
+			std::string_view remote = remotes.substr( 0, remotes.find( ',' ) );
+			remotes.remove_prefix( std::min( remote.size() + 1, remotes.size() ) );
+
+			// host:port/connections
+			uint32_t nConnections = 1;
+			if ( const size_t iSlash = remote.find( '/' ); iSlash != std::string_view::npos )
+			{
+				nConnections = std::max( 1UL, strtoul( std::string( remote.substr( iSlash + 1 ) ).c_str(), nullptr, 10 ) );
+				remote       = remote.substr( 0, iSlash );
+			}
+			const size_t iColon = remote.rfind( ':' );
+			const std::string host( remote.substr( 0, iColon ) );
+			const std::string port( iColon != std::string_view::npos ? remote.substr( iColon + 1 ) : std::string_view( DEFAULT_PORT ) );
+
+			addrinfo hints{};
+			hints.ai_family   = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			hints.ai_protocol = IPPROTO_TCP;
+			addrinfo* pAddresses = nullptr;
+			if ( getaddrinfo( host.c_str(), port.c_str(), &hints, &pAddresses ) != 0 )
+			{
+				std::cout << clr::pinkish << "Couldn't resolve remote worker "sv << remote << clr::reset << std::endl;
+				continue;
+			}
+
+			uint32_t nConnected = 0;
+			for ( ; nConnected < nConnections; ++nConnected )
+			{
+				SOCKET s = INVALID_SOCKET;
+				for ( const addrinfo* pAddress = pAddresses; pAddress && s == INVALID_SOCKET; pAddress = pAddress->ai_next )
+				{
+					s = socket( pAddress->ai_family, pAddress->ai_socktype, pAddress->ai_protocol );
+					if ( s != INVALID_SOCKET && connect( s, pAddress->ai_addr, gsl::narrow<int>( pAddress->ai_addrlen ) ) == SOCKET_ERROR )
+					{
+						closesocket( s );
+						s = INVALID_SOCKET;
+					}
+				}
+				if ( s == INVALID_SOCKET )
+					break;
+
+				// Requests and responses are small and strictly alternate
+				const int bNoDelay = 1;
+				setsockopt( s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>( &bNoDelay ), sizeof( bNoDelay ) );
+
+				const Channel_t channel{ NO_HANDLE, NO_HANDLE, s };
+				const HandshakeHeader_t hdr{ HANDSHAKE_MAGIC, gsl::narrow<uint32_t>( token.size() ) };
+				uint32_t bAccepted = 0;
+				if ( !WriteAll( channel, &hdr, sizeof( hdr ) ) || !WriteAll( channel, token.data(), token.size() ) || !ReadAll( channel, &bAccepted, sizeof( bAccepted ) ) || !bAccepted )
+				{
+					std::cout << clr::pinkish << "Remote worker "sv << remote << " didn't accept the -worker-token"sv << clr::reset << std::endl;
+					closesocket( s );
+					break;
+				}
+				s_Children.emplace_back( Child_t{ NO_HANDLE, channel, true, {} } );
+			}
+			freeaddrinfo( pAddresses );
+
+			if ( nConnected < nConnections )
+				std::cout << clr::pinkish << "Only "sv << nConnected << " of "sv << nConnections << " connections to remote worker "sv << remote << " succeeded"sv << clr::reset << std::endl;
+		}
+
+		return Count() - nBefore;
+	}
+
+	void Stop()
+	{
+		for ( Child_t& child : s_Children )
+		{
+			if ( child.m_bOpen )
+				Close( child, false );
+#ifdef _WIN32
+			if ( child.m_hProcess )
+				CloseHandle( child.m_hProcess );
+#else
+			if ( child.m_hProcess != NO_HANDLE )
+				waitpid( child.m_hProcess, nullptr, 0 );
+#endif
+		}
+		s_Children.clear();
+
+		if ( !s_SourcesPath.empty() )
+		{
+			std::error_code c;
+			fs::remove( s_SourcesPath, c );
+			s_SourcesPath.clear();
+		}
+	}
+
+	uint64_t CpuTime()
+	{
+		// Process handles stay open until Stop, even for children that went away
+		uint64_t nTicks = 0;
+		for ( const Child_t& child : s_Children )
+		{
+#ifdef _WIN32
+			FILETIME created, exited, kernel, user;
+			if ( child.m_hProcess && GetProcessTimes( child.m_hProcess, &created, &exited, &kernel, &user ) )
+				nTicks += ( ( static_cast<uint64_t>( kernel.dwHighDateTime ) << 32 ) | kernel.dwLowDateTime ) + ( ( static_cast<uint64_t>( user.dwHighDateTime ) << 32 ) | user.dwLowDateTime );
+#else
+			if ( child.m_hProcess == NO_HANDLE )
+				continue;
+
+			// utime and stime are the 12th and 13th fields after the name, in clock ticks
+			std::ifstream stat( "/proc/" + std::to_string( child.m_hProcess ) + "/stat" );
+			std::string line;
+			std::getline( stat, line );
+			const size_t iName = line.rfind( ')' );
+			if ( iName == std::string::npos )
+				continue;
+			std::istringstream fields( line.substr( iName + 1 ) );
+			std::string skipped;
+			for ( int i = 0; i < 11; ++i )
+				fields >> skipped;
+			uint64_t nUser = 0, nSystem = 0;
+			if ( fields >> nUser >> nSystem )
+				nTicks += ( nUser + nSystem ) * ( 10'000'000 / std::max<long>( sysconf( _SC_CLK_TCK ), 1 ) );
+#endif
+		}
+		return nTicks;
+	}
+
+	uint32_t Count() noexcept
+	{
+		return gsl::narrow_cast<uint32_t>( s_Children.size() );
+	}
+
+	CmdSink::IResponse* Execute( uint32_t iProcess, const CfgProcessor::ComboBuildCommand& command, const std::string* pPreprocessed, uint32_t flags )
+	{
+		Child_t& child = s_Children[iProcess];
+		if ( !child.m_bOpen )
+			return nullptr;
+
+		std::vector<char>& request = child.m_Request;
+		request.resize( sizeof( RequestHeader_t ) );
+		const auto& AddString = [&request]( std::string_view str )
+		{
+			request.insert( request.end(), str.begin(), str.end() );
+			request.emplace_back( '\0' );
+		};
+		AddString( command.fileName );
+		AddString( command.entryPoint );
+		AddString( command.shaderModel );
+		for ( const auto& [name, value] : command.defines )
+		{
+			AddString( name );
+			AddString( value );
+		}
+
+		const size_t nStringsSize = request.size() - sizeof( RequestHeader_t );
+		if ( pPreprocessed )
+			request.insert( request.end(), pPreprocessed->begin(), pPreprocessed->end() );
+
+		const RequestHeader_t hdr{ flags, gsl::narrow<uint32_t>( command.defines.size() ), gsl::narrow<uint32_t>( nStringsSize ), pPreprocessed != nullptr,
+								   pPreprocessed ? gsl::narrow<uint32_t>( pPreprocessed->size() ) : 0 };
+		memcpy( request.data(), &hdr, sizeof( hdr ) );
+
+		ResponseHeader_t response;
+		std::vector<char> code;
+		std::string listing;
+		bool bReceived = WriteAll( child.m_Channel, request.data(), request.size() ) && ReadAll( child.m_Channel, &response, sizeof( response ) );
+		if ( bReceived )
+		{
+			code.resize( response.m_nCodeSize );
+			listing.resize( response.m_nListingSize ? response.m_nListingSize - 1 : 0 );
+			bReceived = ReadAll( child.m_Channel, code.data(), code.size() ) && ReadAll( child.m_Channel, listing.data(), listing.size() );
+		}
+
+		if ( !bReceived )
+		{
+			std::cout << clr::pinkish << ( child.m_hProcess != NO_HANDLE ? "Worker process " : "Remote worker " ) << iProcess << " went away, its thread compiles on its own from now on" << clr::reset << std::endl;
+			Close( child, true );
+			return nullptr;
+		}
+
+		return new ( std::nothrow ) CWorkerResponse( response.m_bSucceeded != 0, std::move( code ), std::move( listing ), response.m_nListingSize != 0 );
+	}
+
+	// The file of a command has to be below the shader path, no coordinator gets to read anything else
+	static bool IsBelow( const fs::path& root, std::string_view fileName )
+	{
+		const fs::path file( fileName );
+		if ( file.empty() || file.has_root_path() )
+			return false;
+		const fs::path relative = ( root / file ).lexically_normal().lexically_relative( ( root / "" ).lexically_normal() );
+		return !relative.empty() && relative != "." && *relative.begin() != "..";
+	}
+
+	// Compiles what comes in over the channel until it is closed or breaks the limits
+	static int ServeChannel( const Channel_t& channel, const fs::path& shaderPath )
+	{
+		CfgProcessor::ComboBuildCommand command;
+		std::vector<char> strings;
+		std::string text;
+		for ( RequestHeader_t hdr; ReadAll( channel, &hdr, sizeof( hdr ) ); )
+		{
+			if ( hdr.m_nDefines > MAX_DEFINES || hdr.m_nStringsSize > MAX_STRINGS_SIZE || hdr.m_nTextSize > MAX_TEXT_SIZE )
+				return -1;
+			strings.resize( hdr.m_nStringsSize );
+			text.resize( hdr.m_nTextSize );
+			if ( !ReadAll( channel, strings.data(), strings.size() ) || !ReadAll( channel, text.data(), text.size() ) || strings.empty() || strings.back() != '\0' )
+				return -1;
+
+			// Every string ends in a null, the last one included
+			const char* p          = strings.data();
+			const char* const pEnd = p + strings.size();
+			const auto& Next       = [&p, pEnd]()
+			{
+				const std::string_view str( p, strnlen( p, pEnd - p ) );
+				p = std::min( p + str.size() + 1, pEnd );
+				return str;
+			};
+
+			command.fileName    = Next();
+			if ( !IsBelow( shaderPath, command.fileName ) )
+				return -1;
+			command.entryPoint  = Next();
+			command.shaderModel = Next();
+			command.defines.clear();
+			command.macros.clear();
+			for ( uint32_t i = 0; i < hdr.m_nDefines; ++i )
+			{
+				const std::string_view name = Next();
+				command.defines.emplace_back( name, Next() );
+			}
+			for ( const auto& [name, value] : command.defines )
+				command.macros.emplace_back( CfgProcessor::ComboBuildCommand::Macro_t{ name.data(), value.data() } );
+			command.macros.emplace_back( CfgProcessor::ComboBuildCommand::Macro_t{ nullptr, nullptr } );
+
+			CmdSink::IResponse* pResponse = nullptr;
+			if ( hdr.m_bPreprocessed )
+				Compiler::ExecutePreprocessed( command, text, pResponse, hdr.m_nFlags );
+			else
+				Compiler::ExecuteCommand( command, pResponse, hdr.m_nFlags );
+
+			const bool bSucceeded  = pResponse && pResponse->Succeeded();
+			const char* szListing  = pResponse ? pResponse->GetListing() : nullptr;
+			const size_t nListing  = szListing ? strlen( szListing ) : 0;
+			const ResponseHeader_t response{ bSucceeded, bSucceeded ? gsl::narrow<uint32_t>( pResponse->GetResultBufferLen() ) : 0, szListing ? gsl::narrow<uint32_t>( nListing + 1 ) : 0 };
+			const bool bSent = WriteAll( channel, &response, sizeof( response ) ) && WriteAll( channel, bSucceeded ? pResponse->GetResultBuffer() : nullptr, response.m_nCodeSize )
+							   && WriteAll( channel, szListing, nListing );
+			if ( pResponse )
+				pResponse->Release();
+			if ( !bSent )
+				return -1;
+		}
+
+		return 0;
+	}
+
+	int Serve( const fs::path& shaderPath, const fs::path& sourcesPath )
+	{
+		Compiler::LoadIncludesFrom( shaderPath );
+		// What isn't in the snapshot is still read from shaderPath
+		static std::unique_ptr<Platform::CMappedFile> s_pSources;
+		if ( !sourcesPath.empty() )
+		{
+			s_pSources = std::make_unique<Platform::CMappedFile>( sourcesPath );
+			if ( s_pSources->Data() )
+				fileCache.AttachSnapshot( s_pSources->Data(), s_pSources->Size() );
+		}
+#ifdef _WIN32
+		return ServeChannel( Channel_t{ GetStdHandle( STD_INPUT_HANDLE ), GetStdHandle( STD_OUTPUT_HANDLE ), INVALID_SOCKET }, shaderPath );
+#else
+		return ServeChannel( Channel_t{ STDIN_FILENO, STDOUT_FILENO, INVALID_SOCKET }, shaderPath );
+#endif
+	}
+
+	// Reads the handshake of a coordinator and answers it, false drops the connection
+	static bool AcceptHandshake( const Channel_t& channel, std::string_view token )
+	{
+		HandshakeHeader_t hdr;
+		if ( !ReadAll( channel, &hdr, sizeof( hdr ) ) || hdr.m_nMagic != HANDSHAKE_MAGIC || hdr.m_nTokenSize > MAX_TOKEN_SIZE )
+			return false;
+		std::string received( hdr.m_nTokenSize, '\0' );
+		if ( !ReadAll( channel, received.data(), received.size() ) )
+			return false;
+
+		// Compares every byte, how long it takes doesn't tell how much of the token was right
+		uint32_t nDifferent = received.size() != token.size();
+		for ( size_t i = 0; i < std::min( received.size(), token.size() ); ++i )
+			nDifferent |= static_cast<uint8_t>( received[i] ^ token[i] );
+		const uint32_t bAccepted = nDifferent == 0;
+		return WriteAll( channel, &bAccepted, sizeof( bAccepted ) ) && bAccepted;
+	}
+
+	static bool IsLoopback( const sockaddr* pAddress )
+	{
+		if ( pAddress->sa_family == AF_INET )
+			return ( ntohl( reinterpret_cast<const sockaddr_in*>( pAddress )->sin_addr.s_addr ) >> 24 ) == 127;
+		if ( pAddress->sa_family == AF_INET6 )
+			return IN6_IS_ADDR_LOOPBACK( &reinterpret_cast<const sockaddr_in6*>( pAddress )->sin6_addr );
+		return false;
+	}
+
+	int Listen( std::string_view address, std::string_view token, const fs::path& shaderPath )
+	{
+		Compiler::LoadIncludesFrom( shaderPath );
+		if ( !InitSockets() )
+			return -1;
+
+		// [host:]port
+		const size_t iColon = address.rfind( ':' );
+		const std::string szHost( iColon != std::string_view::npos ? address.substr( 0, iColon ) : DEFAULT_HOST );
+		const std::string_view port = iColon != std::string_view::npos ? address.substr( iColon + 1 ) : address;
+		const std::string szPort( port.empty() ? DEFAULT_PORT : port );
+
+		addrinfo hints{};
+		hints.ai_family   = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+		addrinfo* pAddress = nullptr;
+		if ( getaddrinfo( szHost.c_str(), szPort.c_str(), &hints, &pAddress ) != 0 )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: Couldn't resolve "sv << szHost << clr::reset << std::endl;
+			return -1;
+		}
+		if ( token.empty() && !IsLoopback( pAddress->ai_addr ) )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: Listening on "sv << szHost << " needs a -worker-token, anyone who can reach it could compile on this machine"sv << clr::reset << std::endl;
+			freeaddrinfo( pAddress );
+			return -1;
+		}
+
+		const SOCKET listener = socket( pAddress->ai_family, pAddress->ai_socktype, pAddress->ai_protocol );
+		const bool bListening = listener != INVALID_SOCKET && bind( listener, pAddress->ai_addr, gsl::narrow<int>( pAddress->ai_addrlen ) ) != SOCKET_ERROR && listen( listener, SOMAXCONN ) != SOCKET_ERROR;
+		freeaddrinfo( pAddress );
+		if ( !bListening )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: Couldn't listen on "sv << szHost << ":"sv << szPort << clr::reset << std::endl;
+			if ( listener != INVALID_SOCKET )
+				closesocket( listener );
+			return -1;
+		}
+
+		std::cout << "Waiting for compile commands on "sv << clr::green << szHost << ":"sv << szPort << clr::reset << std::endl;
+
+		// Every connection is one worker thread of some coordinator, serve them side by side
+		static std::atomic<uint32_t> s_nConnections = 0;
+		for ( SOCKET s; ( s = accept( listener, nullptr, nullptr ) ) != INVALID_SOCKET; )
+		{
+			if ( s_nConnections >= MAX_CONNECTIONS )
+			{
+				closesocket( s );
+				continue;
+			}
+
+			++s_nConnections;
+			const int bNoDelay = 1;
+			setsockopt( s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>( &bNoDelay ), sizeof( bNoDelay ) );
+			std::thread( [s, token = std::string( token ), shaderPath]
+			{
+				const Channel_t channel{ NO_HANDLE, NO_HANDLE, s };
+				if ( AcceptHandshake( channel, token ) )
+					ServeChannel( channel, shaderPath );
+				closesocket( s );
+				--s_nConnections;
+			} ).detach();
+		}
+
+		closesocket( listener );
+		return -1;
+	}
+}
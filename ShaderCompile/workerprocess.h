@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+namespace CmdSink
+{
+	class IResponse;
+}
+
+namespace CfgProcessor
+{
+	struct ComboBuildCommand;
+}
+
+// Child ShaderCompile processes that run D3DCompile for the worker threads. Past a dozen or so
+// threads d3dcompiler serializes on its own locks and heap, a process of its own doesn't.
+// Every child belongs to one worker thread and gets one command at a time over a pipe.
+// Remote workers on other machines are children too, only their pipe is a TCP connection.
+namespace WorkerProcess
+{
+	// Starts nProcesses children that resolve includes against shaderPath,
+	// returns the number that actually started
+	uint32_t Start( uint32_t nProcesses, const std::filesystem::path& shaderPath );
+
+	// Connects to the remote workers in a comma separated list of host:port/connections and hands each the token,
+	// returns the number of connections made. Each one wants a worker thread of its own.
+	uint32_t Connect( std::string_view remotes, std::string_view token );
+	void Stop();
+
+	[[nodiscard]] uint32_t Count() noexcept;
+
+	// Processor time the local children used so far, in 100ns ticks
+	[[nodiscard]] uint64_t CpuTime();
+
+	// Compiles the command in child iProcess, pPreprocessed replaces the source if it is set.
+	// nullptr if the child is gone, the caller compiles the command itself then.
+	[[nodiscard]] CmdSink::IResponse* Execute( uint32_t iProcess, const CfgProcessor::ComboBuildCommand& command, const std::string* pPreprocessed, uint32_t flags );
+
+	// Main loop of a child, compiles commands from stdin until the pipe is closed. sourcesPath is the snapshot of
+	// fileCache the parent wrote for its children, if there is one.
+	int Serve( const std::filesystem::path& shaderPath, const std::filesystem::path& sourcesPath );
+
+	// Main loop of a remote worker, serves every connection on [host:]port that has the token with its own thread.
+	// Without a host it only listens on loopback, any other address needs a token. Includes and shaders come from
+	// shaderPath, which must match the tree of the coordinator, commands for files outside of it are dropped.
+	int Listen( std::string_view address, std::string_view token, const std::filesystem::path& shaderPath );
+}
@@ -10,22 +10,16 @@ if ($Version -notin @("20b", "30", "40", "41", "50", "51")) {
 	return
 }
 
-$fileList = $File.OpenText()
-while ($null -ne ($line = $fileList.ReadLine())) {
-	if ($line -match '^\s*$' -or $line -match '^\s*//') {
-		continue
-	}
-
-	if ($Dynamic) {
-		& "$PSScriptRoot\ShaderCompile" "-dynamic" "-ver" $Version "-shaderpath" $File.DirectoryName $line
-		continue
-	}
-
-	if ($Threads -ne 0) {
-		& "$PSScriptRoot\ShaderCompile" "-threads" $Threads "-ver" $Version "-shaderpath" $File.DirectoryName $line
-		continue
-	}
+if (-not (Get-Content $File.FullName | Where-Object { $_ -notmatch '^\s*$' -and $_ -notmatch '^\s*//' })) {
+	return
+}
 
-	& "$PSScriptRoot\ShaderCompile" "-ver" $Version "-shaderpath" $File.DirectoryName $line
+# One process for the whole list, every combo of every shader is scheduled across all cores
+$arguments = @("-ver", $Version, "-shaderpath", $File.DirectoryName, "-list", $File.FullName)
+if ($Dynamic) {
+	$arguments = @("-dynamic") + $arguments
+} elseif ($Threads -ne 0) {
+	$arguments = @("-threads", $Threads) + $arguments
 }
-$fileList.Close()
+
+& "$PSScriptRoot\ShaderCompile" @arguments
@@ -351,6 +351,13 @@ inline bool CShader_IsFlag2Set( IMaterialVar **params, MaterialVarFlags2_t _flag
 #define BEGIN_INHERITED_SHADER( _name, _base, _help ) BEGIN_INHERITED_SHADER_FLAGS( _name, _base, _help, 0 )
 #define END_INHERITED_SHADER END_SHADER }
 
+// Includes written with -skip-tables carry one bit per combo, set if the skips let it through
+template <size_t N>
+constexpr bool IsValidShaderCombo( const unsigned int ( &table )[N], int nIndex )
+{
+	return nIndex >= 0 && static_cast<size_t>( nIndex >> 5 ) < N && ( ( table[nIndex >> 5] >> ( nIndex & 31 ) ) & 1 );
+}
+
 // psh ## shader is used here to generate a warning if you don't ever call SET_DYNAMIC_PIXEL_SHADER
 #define DECLARE_DYNAMIC_PIXEL_SHADER( shader ) \
 	shader ## _Dynamic_Index _pshIndex( pShaderAPI ); \
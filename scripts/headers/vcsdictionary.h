@@ -0,0 +1,73 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Reading the primed blocks of version 7 vcs files, written by ShaderCompile -dictionary
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef VCSDICTIONARY_H
+#define VCSDICTIONARY_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+// Version 7 is version 6 with a dictionary of the shader's code right after the duplicate static combo records:
+//   uint32 size, then that many bytes (64k at most)
+// The static combo offsets already count it, and the dynamic combo index of vcsloader.h that may follow it. Blocks whose size has both high bits set are LZMA with the usual
+// 17 byte header (id, actual size, lzma size, properties), coded as if the dictionary came right before them.
+// Every other block reads the same as in version 6.
+//
+// Needs LzmaDec.h of the LZMA SDK included first, the one tier1 builds its lzma decoder from will do.
+
+#include <string.h>
+
+#define SHADER_VCS_DICTIONARY_VERSION 7
+#define SHADER_BLOCK_TYPE_MASK 0xC0000000
+#define SHADER_BLOCK_PRIMED 0xC0000000
+
+#define SHADER_BLOCK_LZMA_HEADER_SIZE 17
+
+// Bytes DecodePrimedShaderBlock needs in its window for the block, 0 if the block is broken
+inline unsigned int PrimedShaderBlockWindowSize( unsigned int nDictionarySize, const unsigned char* pBlock, unsigned int nBlockSize )
+{
+	unsigned int header[3]; // id, actual size, lzma size
+	if ( nBlockSize < SHADER_BLOCK_LZMA_HEADER_SIZE )
+		return 0;
+	memcpy( header, pBlock, sizeof( header ) );
+	if ( header[0] != ( ( 'A' << 24 ) | ( 'M' << 16 ) | ( 'Z' << 8 ) | 'L' ) || header[2] != nBlockSize - SHADER_BLOCK_LZMA_HEADER_SIZE )
+		return 0;
+	return nDictionarySize + header[1];
+}
+
+// Decodes a primed block (without its size and flags) into pWindow, which holds PrimedShaderBlockWindowSize bytes.
+// The dynamic combos start nDictionarySize bytes into the window, the dictionary is copied in front of them.
+inline bool DecodePrimedShaderBlock( const unsigned char* pDictionary, unsigned int nDictionarySize, const unsigned char* pBlock, unsigned int nBlockSize,
+									 unsigned char* pWindow, ISzAlloc* pAlloc )
+{
+	const unsigned int nWindowSize = PrimedShaderBlockWindowSize( nDictionarySize, pBlock, nBlockSize );
+	if ( !nWindowSize )
+		return false;
+	memcpy( pWindow, pDictionary, nDictionarySize );
+
+	CLzmaDec dec;
+	LzmaDec_Construct( &dec );
+	if ( LzmaDec_AllocateProbs( &dec, pBlock + 12, LZMA_PROPS_SIZE, pAlloc ) != SZ_OK )
+		return false;
+	dec.dic		   = pWindow;
+	dec.dicBufSize = nWindowSize;
+	LzmaDec_Init( &dec );
+
+	// Go on from the dictionary as if it had just been decoded
+	dec.dicPos		 = nDictionarySize;
+	dec.processedPos = nDictionarySize;
+
+	SizeT nSrcLen = nBlockSize - SHADER_BLOCK_LZMA_HEADER_SIZE;
+	ELzmaStatus status;
+	const SRes res = LzmaDec_DecodeToDic( &dec, nWindowSize, pBlock + SHADER_BLOCK_LZMA_HEADER_SIZE, &nSrcLen, LZMA_FINISH_END, &status );
+	const bool bDecoded = res == SZ_OK && dec.dicPos == nWindowSize;
+	LzmaDec_FreeProbs( &dec, pAlloc );
+	return bDecoded;
+}
+
+#endif // VCSDICTIONARY_H
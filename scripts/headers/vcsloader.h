@@ -0,0 +1,588 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Finding shaders in version 6, 7 and 8 vcs files without reading them into memory first
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef VCSLOADER_H
+#define VCSLOADER_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+// The file is mapped (or given in memory), static combos are found by a binary search of the records in it,
+// and blocks are unpacked into a buffer of the caller with one LZMA decoder that is kept for every block.
+// Raw blocks aren't copied at all. Nothing in the file is trusted, a broken one only makes lookups fail.
+//
+// Version 7 files written with -block-index have an index of the dynamic combos between the dictionary and the first
+// static combo: uint32 entries, uint32 first entry of every static combo record (the sentinel's is the number of
+// entries), then the entries, sorted by dynamic combo id within every static combo. An entry is the dynamic combo id
+// and its location, the block number << 17 | the offset of its id in the unpacked block (after the dictionary).
+//
+// Version 7 files written with -shared-blobs keep big static combos in shared.vcsblob next to them. Such a static
+// combo is a single block of type 00 and size 16: the uint64 id of the shared.vcsblob, then the uint32 offset and size of
+// its blocks and end mark in there. They are only found with that file attached as well (OpenShared or AttachShared).
+//
+// Version 8 is version 7 for combo spaces that don't fit 32 bits. A second header of two uint64, the total and the
+// dynamic combos, follows the first one (whose are -1), the ids of the static combo records and both ids of the
+// duplicates are uint64 and the sentinel's id is all ones. File offsets and dynamic combo ids stay uint32.
+//
+// Version 7 and 8 files written with -load-order have flag 1 in the header and store the static combos in the order the
+// engine loads them. The records stay sorted by id, a static combo runs up to its end mark instead of the next record.
+//
+// Needs shader_vcs_version.h and LzmaDec.h of the LZMA SDK included first.
+//
+//	CVcsFile vcs;
+//	unsigned char* pBuffer = new unsigned char[vcs.Open( "shaders/fxc/foo_ps30.vcs" ) ? vcs.BufferSize() : 0];
+//	const unsigned char* pCode; unsigned int nCodeSize;
+//	vcs.OpenShared( "shaders/fxc/shared.vcsblob" );
+//	if ( vcs.FindDynamicCombo( nStaticCombo, nDynamicCombo, pBuffer, &pCode, &nCodeSize ) ) ...
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "vcsdictionary.h"
+
+#define SHADER_BLOCK_RAW 0x80000000
+#define SHADER_BLOCK_LZMA 0x40000000
+#define SHADER_BLOCK_END 0xffffffff
+#define SHADER_VCS_WIDE_VERSION 8
+#define SHADER_VCS_MAX_DICTIONARY_SIZE ( 1 << 16 )
+#define SHADER_INDEX_BLOCK_SHIFT 17
+#define SHADER_BLOCK_SHARED 0x00000000
+#define SHADER_FLAG_LOAD_ORDER 0x00000001
+#define SHARED_BLOB_MAGIC ( ( 'B' << 24 ) | ( 'S' << 16 ) | ( 'C' << 8 ) | 'V' )
+#define SHARED_BLOB_VERSION 1
+
+class CVcsFile
+{
+public:
+	// pAlloc is what the decoder allocates with, malloc if NULL
+	explicit CVcsFile( ISzAlloc* pAlloc = NULL )
+		: m_pAlloc( pAlloc ? pAlloc : DefaultAlloc() ), m_pMapped( NULL ), m_nMappedSize( 0 ), m_pSharedMapped( NULL ), m_nSharedMappedSize( 0 ), m_bDecoder( false )
+	{
+		Reset();
+		CloseShared();
+		LzmaDec_Construct( &m_Dec );
+	}
+
+	~CVcsFile()
+	{
+		Close();
+		CloseShared();
+		if ( m_bDecoder )
+			LzmaDec_FreeProbs( &m_Dec, m_pAlloc );
+	}
+
+	// Maps the file, false if it can't be or isn't a vcs of version 6, 7 or 8
+	bool Open( const char* pFileName )
+	{
+		Close();
+		if ( Map( pFileName, &m_pMapped, &m_nMappedSize ) && Attach( m_pMapped, m_nMappedSize ) )
+			return true;
+		Close();
+		return false;
+	}
+
+	// Maps the shared.vcsblob the vcs files refer to, it stays open when they are closed
+	bool OpenShared( const char* pFileName )
+	{
+		CloseShared();
+		if ( Map( pFileName, &m_pSharedMapped, &m_nSharedMappedSize ) && AttachShared( m_pSharedMapped, m_nSharedMappedSize ) )
+			return true;
+		CloseShared();
+		return false;
+	}
+
+	// Reads a vcs that is already in memory, it has to stay there until Close
+	bool Attach( const void* pData, unsigned int nSize )
+	{
+		Reset();
+		const unsigned char* pFile = static_cast<const unsigned char*>( pData );
+		if ( nSize < sizeof( ShaderHeader_t ) )
+			return false;
+		ShaderHeader_t header;
+		memcpy( &header, pFile, sizeof( header ) );
+		if ( ( header.m_nVersion != SHADER_VCS_VERSION_NUMBER && header.m_nVersion != SHADER_VCS_DICTIONARY_VERSION && header.m_nVersion != SHADER_VCS_WIDE_VERSION )
+			 || !header.m_nNumStaticCombos )
+			return false;
+
+		// Records, the duplicate count, the duplicates and the dictionary come one after the other
+		const bool bWide			   = header.m_nVersion == SHADER_VCS_WIDE_VERSION;
+		const unsigned int nIdSize	   = bWide ? 8 : 4;
+		const unsigned int nRecordSize = nIdSize + sizeof( unsigned int );
+		const unsigned int nAliasSize  = nIdSize * 2;
+		unsigned int nPos			   = sizeof( ShaderHeader_t );
+		unsigned long long wide[2]	   = { static_cast<unsigned int>( header.m_nTotalCombos ), static_cast<unsigned int>( header.m_nDynamicCombos ) };
+		if ( bWide )
+		{
+			if ( nSize - nPos < sizeof( wide ) )
+				return false;
+			memcpy( wide, pFile + nPos, sizeof( wide ) );
+			nPos += sizeof( wide );
+		}
+		if ( header.m_nNumStaticCombos > ( nSize - nPos ) / nRecordSize )
+			return false;
+		const unsigned int nRecordsPos = nPos;
+		nPos += header.m_nNumStaticCombos * nRecordSize;
+
+		unsigned int nDuplicates;
+		if ( !Read( pFile, nSize, nPos, &nDuplicates ) || nDuplicates > ( nSize - nPos ) / nAliasSize )
+			return false;
+		const unsigned int nDuplicatesPos = nPos;
+		nPos += nDuplicates * nAliasSize;
+
+		unsigned int nDictionarySize = 0;
+		if ( header.m_nVersion != SHADER_VCS_VERSION_NUMBER
+			 && ( !Read( pFile, nSize, nPos, &nDictionarySize ) || nDictionarySize > SHADER_VCS_MAX_DICTIONARY_SIZE || nDictionarySize > nSize - nPos ) )
+			return false;
+
+		const unsigned int nDictionaryPos = nPos;
+		nPos += nDictionarySize;
+
+		// The sentinel sorts last and tells where the last static combo ends, its id is all ones in either width
+		const unsigned char* pSentinel = pFile + nRecordsPos + ( header.m_nNumStaticCombos - 1 ) * nRecordSize;
+		unsigned long long nSentinelId = 0;
+		unsigned int nFirstOffset, nSentinelOffset;
+		memcpy( &nFirstOffset, pFile + nRecordsPos + nIdSize, sizeof( nFirstOffset ) );
+		memcpy( &nSentinelId, pSentinel, nIdSize );
+		memcpy( &nSentinelOffset, pSentinel + nIdSize, sizeof( nSentinelOffset ) );
+		if ( nSentinelId != ( bWide ? ~0ull : SHADER_BLOCK_END ) || nSentinelOffset > nSize )
+			return false;
+
+		// In load order any record may hold the first static combo
+		const bool bLoadOrder = header.m_nVersion != SHADER_VCS_VERSION_NUMBER && ( header.m_nFlags & SHADER_FLAG_LOAD_ORDER );
+		for ( unsigned int i = 1; bLoadOrder && i < header.m_nNumStaticCombos; ++i )
+		{
+			unsigned int nOffset;
+			memcpy( &nOffset, pFile + nRecordsPos + i * nRecordSize + nIdSize, sizeof( nOffset ) );
+			if ( nOffset < nFirstOffset )
+				nFirstOffset = nOffset;
+		}
+
+		// The index is there when the static combos start after the dictionary
+		unsigned int nIndexEntries = 0, nIndexFirstPos = 0;
+		if ( header.m_nVersion != SHADER_VCS_VERSION_NUMBER && nFirstOffset > nPos )
+		{
+			if ( !Read( pFile, nSize, nPos, &nIndexEntries ) || header.m_nNumStaticCombos > ( nSize - nPos ) / sizeof( unsigned int ) )
+				return false;
+			nIndexFirstPos = nPos;
+			nPos += header.m_nNumStaticCombos * sizeof( unsigned int );
+			if ( nIndexEntries > ( nSize - nPos ) / 8 )
+				return false;
+		}
+
+		m_pFile			  = pFile;
+		m_nFileSize		  = nSize;
+		m_Header		  = header;
+		m_nTotalCombos	  = wide[0];
+		m_nDynamicCombos  = wide[1];
+		m_nIdSize		  = nIdSize;
+		m_nRecordSize	  = nRecordSize;
+		m_nAliasSize	  = nAliasSize;
+		m_pRecords		  = pFile + nRecordsPos;
+		m_pDuplicates	  = pFile + nDuplicatesPos;
+		m_nDuplicates	  = nDuplicates;
+		m_pDictionary	  = pFile + nDictionaryPos;
+		m_nDictionarySize = nDictionarySize;
+		m_pIndexFirst	  = pFile + nIndexFirstPos;
+		m_pIndexEntries	  = pFile + nPos;
+		m_nIndexEntries	  = nIndexEntries;
+		return true;
+	}
+
+	// A shared.vcsblob that is already in memory, it has to stay there until CloseShared
+	bool AttachShared( const void* pData, unsigned int nSize )
+	{
+		unsigned int header[2];
+		if ( nSize < sizeof( header ) + sizeof( m_nSharedId ) )
+			return false;
+		memcpy( header, pData, sizeof( header ) );
+		if ( header[0] != SHARED_BLOB_MAGIC || header[1] != SHARED_BLOB_VERSION )
+			return false;
+		memcpy( &m_nSharedId, static_cast<const unsigned char*>( pData ) + sizeof( header ), sizeof( m_nSharedId ) );
+		m_pShared	  = static_cast<const unsigned char*>( pData );
+		m_nSharedSize = nSize;
+		return true;
+	}
+
+	void Close()
+	{
+		Unmap( &m_pMapped, &m_nMappedSize );
+		Reset();
+	}
+
+	void CloseShared()
+	{
+		Unmap( &m_pSharedMapped, &m_nSharedMappedSize );
+		m_pShared	  = NULL;
+		m_nSharedSize = 0;
+		m_nSharedId	  = 0;
+	}
+
+	bool IsOpen() const { return m_pFile != NULL; }
+	const ShaderHeader_t& Header() const { return m_Header; }
+
+	// Of the header, or of the second one in version 8
+	unsigned long long TotalCombos() const { return m_nTotalCombos; }
+	unsigned long long DynamicCombos() const { return m_nDynamicCombos; }
+
+	// Bytes of the buffer FindDynamicCombo unpacks into, enough for the largest block the compiler writes
+	unsigned int BufferSize() const { return m_nDictionarySize + MAX_SHADER_UNPACKED_BLOCK_SIZE; }
+
+	// The blocks of a static combo up to its end mark, false if it was skipped
+	bool FindStaticCombo( unsigned long long nStaticComboID, const unsigned char** ppBlocks, unsigned int* pnSize ) const
+	{
+		unsigned int iRecord;
+		return FindRecord( nStaticComboID, &iRecord ) && BlocksOf( iRecord, ppBlocks, pnSize );
+	}
+
+	// Unpacks the blocks of the static combo into pBuffer of BufferSize() bytes until one holds the dynamic combo.
+	// *ppCode points into pBuffer, or straight into the file for raw blocks, and stays valid until the next call.
+	// With a dynamic combo index only the block that holds it is unpacked, and missing ones cost no unpacking at all.
+	bool FindDynamicCombo( unsigned long long nStaticComboID, unsigned int nDynamicComboID, unsigned char* pBuffer, const unsigned char** ppCode, unsigned int* pnCodeSize )
+	{
+		const unsigned char* pBlocks;
+		unsigned int nBlocksSize, iRecord;
+		if ( !FindRecord( nStaticComboID, &iRecord ) || !BlocksOf( iRecord, &pBlocks, &nBlocksSize ) )
+			return false;
+
+		unsigned int nIndexedBlock = 0, nIndexedOffset = 0;
+		if ( m_nIndexEntries )
+		{
+			unsigned int range[2], iEntry, entry[2];
+			memcpy( range, m_pIndexFirst + iRecord * sizeof( unsigned int ), sizeof( range ) );
+			if ( range[0] > range[1] || range[1] > m_nIndexEntries || !Search( m_pIndexEntries + range[0] * 8, range[1] - range[0], 8, 4, nDynamicComboID, &iEntry ) )
+				return false;
+			memcpy( entry, m_pIndexEntries + ( range[0] + iEntry ) * 8, sizeof( entry ) );
+			nIndexedBlock  = entry[1] >> SHADER_INDEX_BLOCK_SHIFT;
+			nIndexedOffset = entry[1] & ( ( 1 << SHADER_INDEX_BLOCK_SHIFT ) - 1 );
+		}
+
+		for ( unsigned int nPos = 0, iBlock = 0; nPos < nBlocksSize; ++iBlock )
+		{
+			unsigned int nFlagSize;
+			if ( !Read( pBlocks, nBlocksSize, nPos, &nFlagSize ) )
+				return false;
+			const unsigned int nBlockSize = nFlagSize & ~SHADER_BLOCK_TYPE_MASK;
+			if ( nBlockSize > nBlocksSize - nPos )
+				return false;
+			const unsigned char* pBlock = pBlocks + nPos;
+			nPos += nBlockSize;
+
+			// Only the sizes of the blocks in front of the indexed one are read
+			if ( iBlock < nIndexedBlock )
+				continue;
+
+			const unsigned char* pCombos;
+			unsigned int nCombosSize;
+			if ( !UnpackBlock( nFlagSize, pBlock, m_pDictionary, m_nDictionarySize, pBuffer, &pCombos, &nCombosSize ) )
+				return false;
+
+			// Every dynamic combo is its id, its size and its code
+			for ( unsigned int nCombo = nIndexedOffset; nCombo < nCombosSize; )
+			{
+				unsigned int combo[2];
+				if ( nCombosSize - nCombo < sizeof( combo ) )
+					return false;
+				memcpy( combo, pCombos + nCombo, sizeof( combo ) );
+				nCombo += sizeof( combo );
+				if ( combo[1] > nCombosSize - nCombo )
+					return false;
+				if ( combo[0] == nDynamicComboID )
+				{
+					*ppCode		= pCombos + nCombo;
+					*pnCodeSize = combo[1];
+					return true;
+				}
+				if ( m_nIndexEntries )
+					return false;
+				nCombo += combo[1];
+			}
+			if ( m_nIndexEntries )
+				return false;
+		}
+		return false;
+	}
+
+	// Unpacks one block, nFlagSize is the word in front of it. The dynamic combos end up in pBuffer, which holds
+	// nDictionarySize + MAX_SHADER_UNPACKED_BLOCK_SIZE bytes, or stay where they are if the block is raw.
+	bool UnpackBlock( unsigned int nFlagSize, const unsigned char* pBlock, const unsigned char* pDictionary, unsigned int nDictionarySize, unsigned char* pBuffer,
+					  const unsigned char** ppCombos, unsigned int* pnCombosSize )
+	{
+		const unsigned int nBlockSize = nFlagSize & ~SHADER_BLOCK_TYPE_MASK;
+		switch ( nFlagSize & SHADER_BLOCK_TYPE_MASK )
+		{
+		case SHADER_BLOCK_RAW:
+			*ppCombos	  = pBlock;
+			*pnCombosSize = nBlockSize;
+			return true;
+		case SHADER_BLOCK_LZMA:
+			if ( !Decode( pBlock, nBlockSize, NULL, 0, pBuffer ) )
+				return false;
+			*ppCombos	  = pBuffer;
+			*pnCombosSize = PrimedShaderBlockWindowSize( 0, pBlock, nBlockSize );
+			return true;
+		case SHADER_BLOCK_PRIMED:
+			if ( !nDictionarySize || !Decode( pBlock, nBlockSize, pDictionary, nDictionarySize, pBuffer ) )
+				return false;
+			*ppCombos	  = pBuffer + nDictionarySize;
+			*pnCombosSize = PrimedShaderBlockWindowSize( nDictionarySize, pBlock, nBlockSize ) - nDictionarySize;
+			return true;
+		default: // bzip2, which version 6 never had
+			return false;
+		}
+	}
+
+private:
+	CVcsFile( const CVcsFile& );
+	CVcsFile& operator=( const CVcsFile& );
+
+	static void* Alloc( void*, size_t nSize ) { return malloc( nSize ); }
+	static void Free( void*, void* pAddress ) { free( pAddress ); }
+	static ISzAlloc* DefaultAlloc()
+	{
+		static ISzAlloc s_Alloc = { &Alloc, &Free };
+		return &s_Alloc;
+	}
+
+	static bool Map( const char* pFileName, void** ppMapped, unsigned int* pnSize )
+	{
+#ifdef _WIN32
+		const HANDLE hFile = CreateFileA( pFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL );
+		if ( hFile == INVALID_HANDLE_VALUE )
+			return false;
+		LARGE_INTEGER size;
+		if ( GetFileSizeEx( hFile, &size ) && size.QuadPart && size.QuadPart <= 0xffffffff )
+		{
+			// The view keeps the file and the mapping open
+			if ( const HANDLE hMapping = CreateFileMappingA( hFile, NULL, PAGE_READONLY, 0, 0, NULL ) )
+			{
+				*ppMapped = MapViewOfFile( hMapping, FILE_MAP_READ, 0, 0, 0 );
+				CloseHandle( hMapping );
+			}
+			if ( *ppMapped )
+				*pnSize = static_cast<unsigned int>( size.QuadPart );
+		}
+		CloseHandle( hFile );
+#else
+		const int fd = open( pFileName, O_RDONLY | O_CLOEXEC );
+		if ( fd < 0 )
+			return false;
+		struct stat st;
+		if ( fstat( fd, &st ) == 0 && st.st_size > 0 && st.st_size <= 0xffffffff )
+		{
+			void* pMapped = mmap( NULL, static_cast<size_t>( st.st_size ), PROT_READ, MAP_PRIVATE, fd, 0 );
+			if ( pMapped != MAP_FAILED )
+			{
+				*ppMapped = pMapped;
+				*pnSize	  = static_cast<unsigned int>( st.st_size );
+			}
+		}
+		close( fd );
+#endif
+		return *ppMapped != NULL;
+	}
+
+	static void Unmap( void** ppMapped, unsigned int* pnSize )
+	{
+		if ( *ppMapped )
+		{
+#ifdef _WIN32
+			UnmapViewOfFile( *ppMapped );
+#else
+			munmap( *ppMapped, *pnSize );
+#endif
+		}
+		*ppMapped = NULL;
+		*pnSize	  = 0;
+	}
+
+	static bool Read( const unsigned char* pData, unsigned int nSize, unsigned int& nPos, unsigned int* pValue )
+	{
+		if ( nPos > nSize || nSize - nPos < sizeof( *pValue ) )
+			return false;
+		memcpy( pValue, pData + nPos, sizeof( *pValue ) );
+		nPos += sizeof( *pValue );
+		return true;
+	}
+
+	// Duplicates point at a static combo with records of its own
+	bool FindRecord( unsigned long long nStaticComboID, unsigned int* piRecord ) const
+	{
+		const unsigned long long nSentinelId = m_nIdSize == 8 ? ~0ull : SHADER_BLOCK_END;
+		if ( !m_pFile || nStaticComboID >= nSentinelId )
+			return false;
+		if ( Search( m_pRecords, m_Header.m_nNumStaticCombos, m_nRecordSize, m_nIdSize, nStaticComboID, piRecord ) )
+			return true;
+
+		unsigned int iDuplicate;
+		unsigned long long nSource = 0;
+		if ( !Search( m_pDuplicates, m_nDuplicates, m_nAliasSize, m_nIdSize, nStaticComboID, &iDuplicate ) )
+			return false;
+		memcpy( &nSource, m_pDuplicates + iDuplicate * m_nAliasSize + m_nIdSize, m_nIdSize );
+		return nSource != nSentinelId && Search( m_pRecords, m_Header.m_nNumStaticCombos, m_nRecordSize, m_nIdSize, nSource, piRecord );
+	}
+
+	// Runs up to the next record, the sentinel comes after the last one. In load order the block sizes lead to the end mark.
+	bool BlocksOf( unsigned int iRecord, const unsigned char** ppBlocks, unsigned int* pnSize ) const
+	{
+		unsigned int offsets[2]; // of this record and the next
+		memcpy( &offsets[0], m_pRecords + iRecord * m_nRecordSize + m_nIdSize, sizeof( offsets[0] ) );
+		if ( m_Header.m_nVersion != SHADER_VCS_VERSION_NUMBER && ( m_Header.m_nFlags & SHADER_FLAG_LOAD_ORDER ) )
+		{
+			for ( offsets[1] = offsets[0];; )
+			{
+				unsigned int nFlagSize;
+				if ( !Read( m_pFile, m_nFileSize, offsets[1], &nFlagSize ) )
+					return false;
+				if ( nFlagSize == SHADER_BLOCK_END )
+					break;
+				if ( ( nFlagSize & ~SHADER_BLOCK_TYPE_MASK ) > m_nFileSize - offsets[1] )
+					return false;
+				offsets[1] += nFlagSize & ~SHADER_BLOCK_TYPE_MASK;
+			}
+		}
+		else
+			memcpy( &offsets[1], m_pRecords + ( iRecord + 1 ) * m_nRecordSize + m_nIdSize, sizeof( offsets[1] ) );
+		unsigned int nEndMark;
+		if ( offsets[1] > m_nFileSize || offsets[1] < offsets[0] || offsets[1] - offsets[0] < sizeof( nEndMark ) )
+			return false;
+		memcpy( &nEndMark, m_pFile + offsets[1] - sizeof( nEndMark ), sizeof( nEndMark ) );
+		if ( nEndMark != SHADER_BLOCK_END )
+			return false;
+
+		*ppBlocks = m_pFile + offsets[0];
+		*pnSize	  = offsets[1] - offsets[0] - sizeof( nEndMark );
+
+		// The blocks of a shared static combo are in shared.vcsblob, it has to be the file the reference was written to
+		unsigned int nFlagSize;
+		if ( m_Header.m_nVersion == SHADER_VCS_VERSION_NUMBER || *pnSize != sizeof( nFlagSize ) + 16 )
+			return true;
+		memcpy( &nFlagSize, *ppBlocks, sizeof( nFlagSize ) );
+		if ( nFlagSize != ( SHADER_BLOCK_SHARED | 16 ) )
+			return true;
+		unsigned long long nSharedId;
+		unsigned int location[2]; // offset, size
+		memcpy( &nSharedId, *ppBlocks + sizeof( nFlagSize ), sizeof( nSharedId ) );
+		memcpy( location, *ppBlocks + sizeof( nFlagSize ) + sizeof( nSharedId ), sizeof( location ) );
+		if ( !m_pShared || nSharedId != m_nSharedId || location[0] > m_nSharedSize || location[1] > m_nSharedSize - location[0] || location[1] < sizeof( nEndMark ) )
+			return false;
+		memcpy( &nEndMark, m_pShared + location[0] + location[1] - sizeof( nEndMark ), sizeof( nEndMark ) );
+		if ( nEndMark != SHADER_BLOCK_END )
+			return false;
+
+		*ppBlocks = m_pShared + location[0];
+		*pnSize	  = location[1] - sizeof( nEndMark );
+		return true;
+	}
+
+	// All kinds of records start with the id they are sorted by, nIdSize bytes of it in records of nStride bytes
+	static bool Search( const unsigned char* pRecords, unsigned int nRecords, unsigned int nStride, unsigned int nIdSize, unsigned long long nStaticComboID, unsigned int* piRecord )
+	{
+		unsigned int nLow = 0, nHigh = nRecords;
+		while ( nLow < nHigh )
+		{
+			const unsigned int nMid = nLow + ( nHigh - nLow ) / 2;
+			unsigned long long nID = 0; // little endian, like the file
+			memcpy( &nID, pRecords + nMid * nStride, nIdSize );
+			if ( nID == nStaticComboID )
+			{
+				*piRecord = nMid;
+				return true;
+			}
+			if ( nID < nStaticComboID )
+				nLow = nMid + 1;
+			else
+				nHigh = nMid;
+		}
+		return false;
+	}
+
+	// The decoder and its probabilities are kept, they are only allocated again when a block needs more of them
+	bool Decode( const unsigned char* pBlock, unsigned int nBlockSize, const unsigned char* pDictionary, unsigned int nDictionarySize, unsigned char* pBuffer )
+	{
+		const unsigned int nWindowSize = PrimedShaderBlockWindowSize( nDictionarySize, pBlock, nBlockSize );
+		if ( !nWindowSize || nWindowSize > nDictionarySize + MAX_SHADER_UNPACKED_BLOCK_SIZE )
+			return false;
+		if ( LzmaDec_AllocateProbs( &m_Dec, pBlock + 12, LZMA_PROPS_SIZE, m_pAlloc ) != SZ_OK )
+			return false;
+		m_bDecoder = true;
+
+		if ( nDictionarySize )
+			memcpy( pBuffer, pDictionary, nDictionarySize );
+		m_Dec.dic		 = pBuffer;
+		m_Dec.dicBufSize = nWindowSize;
+		LzmaDec_Init( &m_Dec );
+		m_Dec.dicPos	   = nDictionarySize;
+		m_Dec.processedPos = nDictionarySize;
+
+		SizeT nSrcLen = nBlockSize - SHADER_BLOCK_LZMA_HEADER_SIZE;
+		ELzmaStatus status;
+		const SRes res = LzmaDec_DecodeToDic( &m_Dec, nWindowSize, pBlock + SHADER_BLOCK_LZMA_HEADER_SIZE, &nSrcLen, LZMA_FINISH_END, &status );
+		return res == SZ_OK && m_Dec.dicPos == nWindowSize;
+	}
+
+	void Reset()
+	{
+		m_pFile			  = NULL;
+		m_nFileSize		  = 0;
+		memset( &m_Header, 0, sizeof( m_Header ) );
+		m_nTotalCombos	  = 0;
+		m_nDynamicCombos  = 0;
+		m_nIdSize		  = 4;
+		m_nRecordSize	  = 8;
+		m_nAliasSize	  = 8;
+		m_pRecords		  = NULL;
+		m_pDuplicates	  = NULL;
+		m_nDuplicates	  = 0;
+		m_pDictionary	  = NULL;
+		m_nDictionarySize = 0;
+		m_pIndexFirst	  = NULL;
+		m_pIndexEntries	  = NULL;
+		m_nIndexEntries	  = 0;
+	}
+
+	ISzAlloc* m_pAlloc;
+	void* m_pMapped; // Only when Open mapped it
+	unsigned int m_nMappedSize;
+
+	const unsigned char* m_pFile;
+	unsigned int m_nFileSize;
+	ShaderHeader_t m_Header;
+	unsigned long long m_nTotalCombos;
+	unsigned long long m_nDynamicCombos;
+	unsigned int m_nIdSize; // Of static combo ids, 8 in version 8
+	unsigned int m_nRecordSize;
+	unsigned int m_nAliasSize;
+	const unsigned char* m_pRecords;
+	const unsigned char* m_pDuplicates;
+	unsigned int m_nDuplicates;
+	const unsigned char* m_pDictionary;
+	unsigned int m_nDictionarySize;
+	const unsigned char* m_pIndexFirst; // First entry of every record, the sentinel's is the number of entries
+	const unsigned char* m_pIndexEntries;
+	unsigned int m_nIndexEntries; // 0 without an index
+
+	void* m_pSharedMapped; // Only when OpenShared mapped it
+	unsigned int m_nSharedMappedSize;
+	const unsigned char* m_pShared;
+	unsigned int m_nSharedSize;
+	unsigned long long m_nSharedId;
+
+	CLzmaDec m_Dec;
+	bool m_bDecoder;
+};
+
+#endif // VCSLOADER_H